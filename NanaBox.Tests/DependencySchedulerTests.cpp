@@ -0,0 +1,339 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      DependencySchedulerTests.cpp
+ * PURPOSE:   Tests for the Dependency Task Scheduler
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "NanaBox.Tests.h"
+
+#include "../NanaBox/DependencyScheduler.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#ifdef _WIN32
+#include <winrt/base.h>
+#endif
+
+namespace
+{
+    struct SimulatedVirtualMachine
+    {
+        std::string Name;
+        std::vector<std::string> DependsOn;
+        std::chrono::milliseconds PreparationTime;
+        std::chrono::milliseconds LaunchTime;
+        bool FailLaunch = false;
+    };
+
+    // Simulates the Host Compute Service calls of the headless host with the
+    // fixed latencies, and records the order and the concurrency of them.
+    class SimulatedComputeBackend
+    {
+    public:
+
+        void Prepare(
+            SimulatedVirtualMachine const& Target)
+        {
+            this->Run("Prepare " + Target.Name, Target.PreparationTime);
+        }
+
+        void Launch(
+            SimulatedVirtualMachine const& Target)
+        {
+            this->Run("Launch " + Target.Name, Target.LaunchTime);
+            if (Target.FailLaunch)
+            {
+                throw std::runtime_error("The simulated launch failed.");
+            }
+
+            std::lock_guard<std::mutex> Guard(this->m_Lock);
+            this->m_Running.insert(Target.Name);
+        }
+
+        bool IsRunning(
+            std::string const& Name)
+        {
+            std::lock_guard<std::mutex> Guard(this->m_Lock);
+            return this->m_Running.end() != this->m_Running.find(Name);
+        }
+
+        std::size_t MaxInFlight()
+        {
+            std::lock_guard<std::mutex> Guard(this->m_Lock);
+            return this->m_MaxInFlight;
+        }
+
+        std::size_t ThreadCount()
+        {
+            std::lock_guard<std::mutex> Guard(this->m_Lock);
+            return this->m_Threads.size();
+        }
+
+        std::vector<std::string> Calls()
+        {
+            std::lock_guard<std::mutex> Guard(this->m_Lock);
+            return this->m_Calls;
+        }
+
+    private:
+
+        std::mutex m_Lock;
+        std::size_t m_InFlight = 0;
+        std::size_t m_MaxInFlight = 0;
+        std::set<std::thread::id> m_Threads;
+        std::set<std::string> m_Running;
+        std::vector<std::string> m_Calls;
+
+        void Run(
+            std::string const& Call,
+            std::chrono::milliseconds Latency)
+        {
+            {
+                std::lock_guard<std::mutex> Guard(this->m_Lock);
+                this->m_Calls.push_back(Call);
+                this->m_Threads.insert(std::this_thread::get_id());
+                this->m_MaxInFlight = std::max(
+                    this->m_MaxInFlight,
+                    ++this->m_InFlight);
+            }
+
+            std::this_thread::sleep_for(Latency);
+
+            std::lock_guard<std::mutex> Guard(this->m_Lock);
+            --this->m_InFlight;
+        }
+    };
+
+    // Builds the same graph as the headless host, each virtual machine has a
+    // preparation without dependencies and a launch which depends on its
+    // preparation and the launches of its dependencies.
+    std::vector<NanaBox::DependencyTaskTimeline> StartVirtualMachines(
+        SimulatedComputeBackend& Backend,
+        std::vector<SimulatedVirtualMachine> const& Targets,
+        std::size_t MaxParallelism)
+    {
+        std::vector<NanaBox::DependencyTask> Tasks;
+        for (SimulatedVirtualMachine const& Target : Targets)
+        {
+            NanaBox::DependencyTask Preparation;
+            Preparation.Name = "Prepare " + Target.Name;
+            Tasks.push_back(Preparation);
+
+            NanaBox::DependencyTask Launch;
+            Launch.Name = "Launch " + Target.Name;
+            Launch.DependsOn.push_back(Preparation.Name);
+            for (std::string const& Dependency : Target.DependsOn)
+            {
+                Launch.DependsOn.push_back("Launch " + Dependency);
+            }
+            Tasks.push_back(Launch);
+        }
+
+        return NanaBox::RunDependencyTasks(
+            Tasks,
+            MaxParallelism,
+            [&](std::size_t Index)
+        {
+            SimulatedVirtualMachine const& Target = Targets[Index / 2];
+            if (Index % 2)
+            {
+                for (std::string const& Dependency : Target.DependsOn)
+                {
+                    NANABOX_CHECK(Backend.IsRunning(Dependency));
+                }
+                Backend.Launch(Target);
+            }
+            else
+            {
+                Backend.Prepare(Target);
+            }
+        });
+    }
+
+    std::size_t FindCall(
+        std::vector<std::string> const& Calls,
+        std::string const& Call)
+    {
+        return static_cast<std::size_t>(
+            std::find(Calls.begin(), Calls.end(), Call) - Calls.begin());
+    }
+
+    const std::chrono::milliseconds g_Latency = std::chrono::milliseconds(20);
+}
+
+NANABOX_TEST(DependencySchedulerLaunchesInDependencyOrder)
+{
+    SimulatedComputeBackend Backend;
+    std::vector<NanaBox::DependencyTaskTimeline> Timeline =
+        ::StartVirtualMachines(
+            Backend,
+            {
+                { "Web", { "Database", "Cache" }, g_Latency, g_Latency },
+                { "Database", {}, g_Latency, g_Latency },
+                { "Cache", { "Database" }, g_Latency, g_Latency },
+            },
+            4);
+
+    for (NanaBox::DependencyTaskTimeline const& Current : Timeline)
+    {
+        NANABOX_CHECK(
+            Current.Status == NanaBox::DependencyTaskStatus::Succeeded);
+    }
+
+    std::vector<std::string> Calls = Backend.Calls();
+    NANABOX_CHECK(6 == Calls.size());
+    NANABOX_CHECK(
+        ::FindCall(Calls, "Launch Database") <
+        ::FindCall(Calls, "Launch Cache"));
+    NANABOX_CHECK(
+        ::FindCall(Calls, "Launch Cache") <
+        ::FindCall(Calls, "Launch Web"));
+
+    // All preparations are started before any launch because they have no
+    // dependencies between each other.
+    for (char const* Name : { "Web", "Database", "Cache" })
+    {
+        NANABOX_CHECK(
+            ::FindCall(Calls, std::string("Prepare ") + Name) < 3);
+    }
+}
+
+NANABOX_TEST(DependencySchedulerLimitsParallelism)
+{
+    std::vector<SimulatedVirtualMachine> Targets;
+    for (int i = 0; i < 8; ++i)
+    {
+        Targets.push_back(
+            { "VM" + std::to_string(i), {}, g_Latency, g_Latency });
+    }
+
+    SimulatedComputeBackend Backend;
+    ::StartVirtualMachines(Backend, Targets, 3);
+    NANABOX_CHECK(3 == Backend.MaxInFlight());
+    NANABOX_CHECK(3 >= Backend.ThreadCount());
+}
+
+NANABOX_TEST(DependencySchedulerBoundsWorkersByGraphWidth)
+{
+    // A chain never has two tasks ready at the same time, so the calling
+    // thread runs all of them even if more parallelism is allowed.
+    std::vector<NanaBox::DependencyTask> Tasks;
+    for (int i = 0; i < 16; ++i)
+    {
+        NanaBox::DependencyTask Current;
+        Current.Name = "Task" + std::to_string(i);
+        if (i)
+        {
+            Current.DependsOn.push_back("Task" + std::to_string(i - 1));
+        }
+        Tasks.push_back(Current);
+    }
+
+    std::mutex Lock;
+    std::set<std::thread::id> Threads;
+    NanaBox::RunDependencyTasks(Tasks, 16, [&](std::size_t Index)
+    {
+        (void)Index;
+        std::lock_guard<std::mutex> Guard(Lock);
+        Threads.insert(std::this_thread::get_id());
+    });
+    NANABOX_CHECK(1 == Threads.size());
+    NANABOX_CHECK(Threads.count(std::this_thread::get_id()));
+
+    // The two virtual machines form two chains, so at most two workers run
+    // the preparations and the launches.
+    SimulatedComputeBackend Backend;
+    ::StartVirtualMachines(
+        Backend,
+        {
+            { "A", {}, g_Latency, g_Latency },
+            { "B", { "A" }, g_Latency, g_Latency },
+        },
+        16);
+    NANABOX_CHECK(2 >= Backend.ThreadCount());
+}
+
+NANABOX_TEST(DependencySchedulerSkipsDependentsOfFailedTasks)
+{
+    SimulatedComputeBackend Backend;
+    std::vector<SimulatedVirtualMachine> Targets =
+    {
+        { "Database", {}, g_Latency, g_Latency, true },
+        { "Web", { "Database" }, g_Latency, g_Latency },
+        { "Monitor", {}, g_Latency, g_Latency },
+    };
+    std::vector<NanaBox::DependencyTaskTimeline> Timeline =
+        ::StartVirtualMachines(Backend, Targets, 2);
+
+    std::map<std::string, NanaBox::DependencyTaskTimeline> Results;
+    for (NanaBox::DependencyTaskTimeline const& Current : Timeline)
+    {
+        Results[Current.Name] = Current;
+    }
+    NANABOX_CHECK(
+        Results["Launch Database"].Status ==
+        NanaBox::DependencyTaskStatus::Failed);
+    NANABOX_CHECK_EQUAL(
+        Results["Launch Database"].Error,
+        "The simulated launch failed.");
+    NANABOX_CHECK(
+        Results["Launch Web"].Status ==
+        NanaBox::DependencyTaskStatus::Skipped);
+    NANABOX_CHECK(
+        Results["Prepare Web"].Status ==
+        NanaBox::DependencyTaskStatus::Succeeded);
+    NANABOX_CHECK(
+        Results["Launch Monitor"].Status ==
+        NanaBox::DependencyTaskStatus::Succeeded);
+    NANABOX_CHECK(!Backend.IsRunning("Web"));
+
+    std::string Text = NanaBox::FormatDependencyTimeline(Timeline);
+    NANABOX_CHECK(std::string::npos != Text.find(
+        "The dependency \"Launch Database\" is not ready."));
+}
+
+NANABOX_TEST(DependencySchedulerRejectsInvalidGraphs)
+{
+    auto Rejected = [](std::vector<NanaBox::DependencyTask> const& Tasks)
+    {
+        bool Called = false;
+        try
+        {
+            NanaBox::RunDependencyTasks(Tasks, 4, [&](std::size_t Index)
+            {
+                (void)Index;
+                Called = true;
+            });
+        }
+        catch (std::runtime_error const&)
+        {
+            return !Called;
+        }
+        return false;
+    };
+
+    NANABOX_CHECK(Rejected({ { "A", { "B" } }, { "B", { "A" } } }));
+    NANABOX_CHECK(Rejected({ { "A", { "Unknown" } } }));
+    NANABOX_CHECK(Rejected({ { "A", {} }, { "A", {} } }));
+    NANABOX_CHECK(NanaBox::RunDependencyTasks({}, 4, nullptr).empty());
+}
+
+#ifdef _WIN32
+NANABOX_TEST(DependencySchedulerReportsHResultErrors)
+{
+    std::vector<NanaBox::DependencyTaskTimeline> Timeline =
+        NanaBox::RunDependencyTasks({ { "A", {} } }, 1, [](std::size_t)
+    {
+        throw winrt::hresult_error(E_ACCESSDENIED, L"Access is denied.");
+    });
+    NANABOX_CHECK_EQUAL(Timeline[0].Error, "0x80070005 Access is denied.");
+}
+#endif
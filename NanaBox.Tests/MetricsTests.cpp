@@ -0,0 +1,146 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      MetricsTests.cpp
+ * PURPOSE:   Tests for the Prometheus Metrics Formatter
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "NanaBox.Tests.h"
+
+#include "../NanaBox/Metrics.h"
+
+#include <chrono>
+
+NANABOX_TEST(MetricsFormatsFamily)
+{
+    std::string Buffer;
+    NanaBox::PrometheusTextWriter Writer(Buffer);
+    Writer.Family("nanabox_test_total", "counter", "Number of tests.");
+    NANABOX_CHECK_EQUAL(
+        Buffer,
+        "# HELP nanabox_test_total Number of tests.\n"
+        "# TYPE nanabox_test_total counter\n");
+}
+
+NANABOX_TEST(MetricsFormatsFixedPointSamples)
+{
+    std::string Buffer;
+    NanaBox::PrometheusTextWriter Writer(Buffer);
+    Writer.Sample("a", {}, 42);
+    Writer.Sample("b", {}, 1500000, 6);
+    Writer.Sample("c", {}, 2000000, 6);
+    Writer.Sample("d", {}, 5, 6);
+    Writer.Sample("e", {}, 0, 6);
+    Writer.Sample("f", {}, UINT64_MAX);
+    NANABOX_CHECK_EQUAL(
+        Buffer,
+        "a 42\n"
+        "b 1.5\n"
+        "c 2\n"
+        "d 0.000005\n"
+        "e 0\n"
+        "f 18446744073709551615\n");
+}
+
+NANABOX_TEST(MetricsEscapesLabelValues)
+{
+    std::string Buffer;
+    NanaBox::PrometheusTextWriter Writer(Buffer);
+    Writer.Sample(
+        "nanabox_test",
+        { { "vm", "a\"b\\c\nd" }, { "phase", "Start" } },
+        1);
+    NANABOX_CHECK_EQUAL(
+        Buffer,
+        "nanabox_test{vm=\"a\\\"b\\\\c\\nd\",phase=\"Start\"} 1\n");
+}
+
+NANABOX_TEST(MetricsFormatsCumulativeHistogram)
+{
+    NanaBox::LatencyHistogram Histogram;
+    Histogram.Observe(500);
+    Histogram.Observe(1000);
+    Histogram.Observe(3000);
+    Histogram.Observe(20000000);
+
+    std::string Buffer;
+    NanaBox::PrometheusTextWriter Writer(Buffer);
+    Writer.Histogram("h", { { "vm", "Test" } }, Histogram);
+    NANABOX_CHECK_EQUAL(
+        Buffer,
+        "h_bucket{vm=\"Test\",le=\"0.001\"} 2\n"
+        "h_bucket{vm=\"Test\",le=\"0.0025\"} 2\n"
+        "h_bucket{vm=\"Test\",le=\"0.005\"} 3\n"
+        "h_bucket{vm=\"Test\",le=\"0.01\"} 3\n"
+        "h_bucket{vm=\"Test\",le=\"0.025\"} 3\n"
+        "h_bucket{vm=\"Test\",le=\"0.05\"} 3\n"
+        "h_bucket{vm=\"Test\",le=\"0.1\"} 3\n"
+        "h_bucket{vm=\"Test\",le=\"0.25\"} 3\n"
+        "h_bucket{vm=\"Test\",le=\"0.5\"} 3\n"
+        "h_bucket{vm=\"Test\",le=\"1\"} 3\n"
+        "h_bucket{vm=\"Test\",le=\"2.5\"} 3\n"
+        "h_bucket{vm=\"Test\",le=\"5\"} 3\n"
+        "h_bucket{vm=\"Test\",le=\"10\"} 3\n"
+        "h_bucket{vm=\"Test\",le=\"+Inf\"} 4\n"
+        "h_sum{vm=\"Test\"} 20.0045\n"
+        "h_count{vm=\"Test\"} 4\n");
+}
+
+NANABOX_TEST(MetricsClampsHistogramBucketsToCount)
+{
+    // Simulates an observation which has updated its bucket but not the count
+    // yet when the formatter reads the histogram.
+    NanaBox::LatencyHistogram Histogram;
+    Histogram.Observe(500);
+    Histogram.Buckets[0].fetch_add(1);
+
+    std::string Buffer;
+    NanaBox::PrometheusTextWriter Writer(Buffer);
+    Writer.Histogram("h", {}, Histogram);
+    NANABOX_CHECK(
+        Buffer.find("h_bucket{le=\"0.001\"} 1\n") != std::string::npos);
+    NANABOX_CHECK(
+        Buffer.find("h_bucket{le=\"+Inf\"} 1\n") != std::string::npos);
+    NANABOX_CHECK(Buffer.find("h_count 1\n") != std::string::npos);
+}
+
+NANABOX_TEST(MetricsExportsRegisteredVirtualMachines)
+{
+    std::shared_ptr<NanaBox::VirtualMachineMetrics> Metrics =
+        NanaBox::GetVirtualMachineMetrics("MetricsTestVM");
+    NANABOX_CHECK(
+        Metrics == NanaBox::GetVirtualMachineMetrics("MetricsTestVM"));
+    Metrics->RecordLifecycle(
+        NanaBox::LifecyclePhase::Initialize,
+        std::chrono::milliseconds(250));
+
+    std::string Buffer;
+    NanaBox::FormatMetrics(Buffer);
+    NANABOX_CHECK(std::string::npos != Buffer.find(
+        "nanabox_lifecycle_last_duration_seconds"
+        "{vm=\"MetricsTestVM\",phase=\"Initialize\"} 0.25\n"));
+    NANABOX_CHECK(std::string::npos != Buffer.find(
+        "nanabox_lifecycle_transitions_total"
+        "{vm=\"MetricsTestVM\",phase=\"Initialize\"} 1\n"));
+
+    NanaBox::ReleaseVirtualMachineMetrics("MetricsTestVM");
+    NanaBox::FormatMetrics(Buffer);
+    NANABOX_CHECK(Buffer.find("MetricsTestVM") == std::string::npos);
+    NANABOX_CHECK(std::string::npos != Buffer.find(
+        "# TYPE nanabox_lifecycle_transitions_total"));
+
+    // The holder still owns the released metrics, and the name registers new
+    // metrics afterwards.
+    Metrics->RecordLifecycle(
+        NanaBox::LifecyclePhase::Initialize,
+        std::chrono::milliseconds(1));
+    std::shared_ptr<NanaBox::VirtualMachineMetrics> Registered =
+        NanaBox::GetVirtualMachineMetrics("MetricsTestVM");
+    NANABOX_CHECK(Registered != Metrics);
+    NANABOX_CHECK(0 == Registered->LifecycleCounts[
+        static_cast<std::size_t>(NanaBox::LifecyclePhase::Initialize)].load());
+    NanaBox::ReleaseVirtualMachineMetrics("MetricsTestVM");
+}
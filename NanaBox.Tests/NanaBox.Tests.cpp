@@ -0,0 +1,127 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      NanaBox.Tests.cpp
+ * PURPOSE:   Implementation for the NanaBox Unit Test Harness
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "NanaBox.Tests.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <utility>
+#include <vector>
+
+namespace
+{
+    std::vector<std::pair<char const*, NanaBox::Tests::TestFunction>>& Tests()
+    {
+        static std::vector<
+            std::pair<char const*, NanaBox::Tests::TestFunction>> Result;
+        return Result;
+    }
+}
+
+NanaBox::Tests::TestRegistration::TestRegistration(
+    char const* Name,
+    TestFunction Function)
+{
+    ::Tests().emplace_back(Name, Function);
+}
+
+NanaBox::Tests::TestFailure::TestFailure(
+    std::string const& Message) :
+    std::runtime_error(Message)
+{
+
+}
+
+void NanaBox::Tests::Check(
+    bool Condition,
+    char const* Expression,
+    char const* File,
+    int Line)
+{
+    if (!Condition)
+    {
+        throw NanaBox::Tests::TestFailure(
+            std::string(File) + ":" + std::to_string(Line) +
+            ": check failed: " + Expression);
+    }
+}
+
+void NanaBox::Tests::CheckEqual(
+    std::string const& Actual,
+    std::string const& Expected,
+    char const* Expression,
+    char const* File,
+    int Line)
+{
+    if (Actual != Expected)
+    {
+        throw NanaBox::Tests::TestFailure(
+            std::string(File) + ":" + std::to_string(Line) +
+            ": check failed: " + Expression +
+            "\n  actual:   \"" + Actual + "\"" +
+            "\n  expected: \"" + Expected + "\"");
+    }
+}
+
+std::string NanaBox::Tests::GetTemporaryFilePath(
+    std::string const& Name)
+{
+#ifdef _WIN32
+    char TemporaryPath[MAX_PATH + 1] = { 0 };
+    ::GetTempPathA(MAX_PATH + 1, TemporaryPath);
+    return std::string(TemporaryPath) + "NanaBox.Tests." +
+        std::to_string(::GetCurrentProcessId()) + "." + Name;
+#else
+    char const* TemporaryPath = std::getenv("TMPDIR");
+    return std::string(TemporaryPath ? TemporaryPath : "/tmp") +
+        "/NanaBox.Tests." + std::to_string(::getpid()) + "." + Name;
+#endif
+}
+
+int main(
+    int argc,
+    char* argv[])
+{
+    // The optional argument filters the tests by a substring of the name.
+    char const* Filter = argc > 1 ? argv[1] : nullptr;
+
+    std::size_t Passed = 0;
+    std::size_t Failed = 0;
+    for (auto const& [Name, Function] : ::Tests())
+    {
+        if (Filter && !std::strstr(Name, Filter))
+        {
+            continue;
+        }
+
+        try
+        {
+            Function();
+            std::printf("[PASS] %s\n", Name);
+            ++Passed;
+        }
+        catch (std::exception const& ex)
+        {
+            std::printf("[FAIL] %s\n%s\n", Name, ex.what());
+            ++Failed;
+        }
+    }
+
+    std::printf("%zu passed, %zu failed\n", Passed, Failed);
+    return Failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,87 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      NanaBox.Tests.h
+ * PURPOSE:   Definition for the NanaBox Unit Test Harness
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_TESTS
+#define NANABOX_TESTS
+
+#if (defined(__cplusplus) && __cplusplus >= 201703L)
+#elif (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#else
+#error "[NanaBox.Tests] You should use a C++ compiler with the C++17 standard."
+#endif
+
+#include <stdexcept>
+#include <string>
+
+namespace NanaBox::Tests
+{
+    typedef void (*TestFunction)();
+
+    // Registers the test at static initialization time, the tests run in
+    // the order of registration within each translation unit.
+    struct TestRegistration
+    {
+        TestRegistration(
+            char const* Name,
+            TestFunction Function);
+    };
+
+    // Thrown by the checks, the runner reports it and continues with the
+    // next test.
+    class TestFailure : public std::runtime_error
+    {
+    public:
+
+        TestFailure(
+            std::string const& Message);
+    };
+
+    void Check(
+        bool Condition,
+        char const* Expression,
+        char const* File,
+        int Line);
+
+    void CheckEqual(
+        std::string const& Actual,
+        std::string const& Expected,
+        char const* Expression,
+        char const* File,
+        int Line);
+
+    // Returns a path under the temporary directory which is unique to the
+    // current process, the caller owns the file.
+    std::string GetTemporaryFilePath(
+        std::string const& Name);
+}
+
+#define NANABOX_TEST(Name) \
+    static void Name(); \
+    static NanaBox::Tests::TestRegistration Name##Registration( \
+        #Name, \
+        &Name); \
+    static void Name()
+
+#define NANABOX_CHECK(Expression) \
+    NanaBox::Tests::Check( \
+        static_cast<bool>(Expression), \
+        #Expression, \
+        __FILE__, \
+        __LINE__)
+
+#define NANABOX_CHECK_EQUAL(Actual, Expected) \
+    NanaBox::Tests::CheckEqual( \
+        (Actual), \
+        (Expected), \
+        #Actual " == " #Expected, \
+        __FILE__, \
+        __LINE__)
+
+#endif // !NANABOX_TESTS
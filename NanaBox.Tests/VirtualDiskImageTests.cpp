@@ -0,0 +1,879 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualDiskImageTests.cpp
+ * PURPOSE:   Tests for the Virtual Disk Image Engine
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "NanaBox.Tests.h"
+
+#include "../NanaBox/VirtualDiskImage.h"
+#include "../NanaBox/VirtualDiskChangeTracking.h"
+#include "../NanaBox/VirtualDiskCompaction.h"
+#include "../NanaBox/VirtualDiskConversion.h"
+#include "../NanaBox/VirtualDiskMerge.h"
+
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <system_error>
+#include <vector>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <initguid.h>
+#include <virtdisk.h>
+#pragma comment(lib, "virtdisk.lib")
+#endif
+
+namespace
+{
+    const std::uint64_t MiB = 1024 * 1024;
+
+    // Removes the images when the test finishes, including the failed ones.
+    class TemporaryImages
+    {
+    public:
+
+        std::string Add(
+            std::string const& Name)
+        {
+            std::string Path = NanaBox::Tests::GetTemporaryFilePath(Name);
+            NanaBox::RemoveVirtualDiskFile(Path);
+            this->m_Paths.push_back(Path);
+            return Path;
+        }
+
+        ~TemporaryImages()
+        {
+            for (std::string const& Path : this->m_Paths)
+            {
+                NanaBox::RemoveVirtualDiskFile(Path);
+            }
+        }
+
+    private:
+
+        std::vector<std::string> m_Paths;
+    };
+
+    std::vector<std::uint8_t> GeneratePattern(
+        std::size_t Size,
+        std::uint64_t Seed)
+    {
+        std::vector<std::uint8_t> Result(Size);
+        std::mt19937_64 Generator(Seed);
+        for (std::uint8_t& Value : Result)
+        {
+            Value = static_cast<std::uint8_t>(Generator());
+        }
+        return Result;
+    }
+
+    bool ReadsAs(
+        NanaBox::VirtualDiskImage& Image,
+        std::uint64_t Offset,
+        std::vector<std::uint8_t> const& Expected)
+    {
+        std::vector<std::uint8_t> Buffer(Expected.size());
+        Image.Read(Offset, Buffer.data(), Buffer.size());
+        return Buffer == Expected;
+    }
+
+    bool ReadsAsZero(
+        NanaBox::VirtualDiskImage& Image,
+        std::uint64_t Offset,
+        std::size_t Size)
+    {
+        return ::ReadsAs(Image, Offset, std::vector<std::uint8_t>(Size));
+    }
+
+    std::vector<std::uint8_t> ReadAll(
+        std::string const& Path)
+    {
+        std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+            NanaBox::VirtualDiskImage::Open(Path, false);
+        std::vector<std::uint8_t> Result(
+            static_cast<std::size_t>(Image->GetInformation().VirtualSize));
+        Image->Read(0, Result.data(), Result.size());
+        return Result;
+    }
+
+    // Writes the ranges inside a block, across the block boundary and at the
+    // end of the disk, then closes and reopens the image read-only and
+    // checks the content and the layout.
+    void CheckRoundTrip(
+        std::string const& Path,
+        NanaBox::VirtualDiskCreateParameters const& Parameters)
+    {
+        std::uint64_t VirtualSize = Parameters.VirtualSize;
+        std::vector<std::uint8_t> First = ::GeneratePattern(64 * 1024, 1);
+        std::vector<std::uint8_t> Boundary = ::GeneratePattern(2 * MiB, 2);
+        std::vector<std::uint8_t> Last = ::GeneratePattern(4096, 3);
+
+        NanaBox::VirtualDiskInformation Created;
+        {
+            std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+                NanaBox::VirtualDiskImage::Create(Path, Parameters);
+            Created = Image->GetInformation();
+            Image->Write(4096, First.data(), First.size());
+            Image->Write(3 * MiB, Boundary.data(), Boundary.size());
+            Image->Write(VirtualSize - Last.size(), Last.data(), Last.size());
+            Image->Flush();
+        }
+
+        std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+            NanaBox::VirtualDiskImage::Open(Path, false);
+        NanaBox::VirtualDiskInformation const& Information =
+            Image->GetInformation();
+        NANABOX_CHECK(Information.Format == Parameters.Format);
+        NANABOX_CHECK(Information.Type == Parameters.Type);
+        NANABOX_CHECK(Information.VirtualSize == VirtualSize);
+        NANABOX_CHECK(Information.BlockSize == Created.BlockSize);
+        NANABOX_CHECK(
+            Information.LogicalSectorSize == Created.LogicalSectorSize);
+        NANABOX_CHECK(Information.DiskId == Created.DiskId);
+
+        NANABOX_CHECK(::ReadsAsZero(*Image, 0, 4096));
+        NANABOX_CHECK(::ReadsAs(*Image, 4096, First));
+        NANABOX_CHECK(::ReadsAsZero(*Image, 4096 + First.size(), 4096));
+        NANABOX_CHECK(::ReadsAs(*Image, 3 * MiB, Boundary));
+        NANABOX_CHECK(::ReadsAs(*Image, VirtualSize - Last.size(), Last));
+    }
+
+    void CheckConversion(
+        std::string const& SourcePath,
+        std::string const& TargetPath,
+        NanaBox::VirtualDiskConversionOptions const& Options,
+        std::vector<std::uint8_t> const& Expected)
+    {
+        NanaBox::VirtualDiskConversionResult Result;
+        {
+            std::unique_ptr<NanaBox::VirtualDiskImage> Source =
+                NanaBox::OpenVirtualDiskChain(SourcePath, false);
+            Result = NanaBox::ConvertVirtualDiskImage(
+                *Source,
+                TargetPath,
+                Options);
+        }
+        NANABOX_CHECK(Result.VirtualSize == Expected.size());
+        // Only the written ranges are copied to the dynamic images.
+        if (Options.Type == NanaBox::VirtualDiskType::Dynamic)
+        {
+            NANABOX_CHECK(Result.WrittenBytes < Expected.size());
+        }
+
+        std::unique_ptr<NanaBox::VirtualDiskImage> Target =
+            NanaBox::VirtualDiskImage::Open(TargetPath, false);
+        NanaBox::VirtualDiskInformation const& Information =
+            Target->GetInformation();
+        NANABOX_CHECK(Information.Format == Options.Format);
+        NANABOX_CHECK(Information.Type == Options.Type);
+        NANABOX_CHECK(::ReadsAs(*Target, 0, Expected));
+    }
+
+    // Converts the image written by CheckRoundTrip to the other layout and
+    // back, the content is checked after each conversion.
+    void CheckConversionRoundTrip(
+        TemporaryImages& Images,
+        NanaBox::VirtualDiskCreateParameters const& Parameters,
+        NanaBox::VirtualDiskFormat Format,
+        NanaBox::VirtualDiskType Type)
+    {
+        const char* Extensions[] = { ".vhd", ".vhdx" };
+        auto GetExtension = [&](NanaBox::VirtualDiskFormat Value)
+        {
+            return Extensions[NanaBox::VirtualDiskFormat::Vhdx == Value];
+        };
+
+        std::string SourcePath = Images.Add(
+            std::string("ConvertSource") + GetExtension(Parameters.Format));
+        std::string TargetPath = Images.Add(
+            std::string("ConvertTarget") + GetExtension(Format));
+        std::string BackPath = Images.Add(
+            std::string("ConvertBack") + GetExtension(Parameters.Format));
+
+        ::CheckRoundTrip(SourcePath, Parameters);
+        std::vector<std::uint8_t> Expected = ::ReadAll(SourcePath);
+
+        NanaBox::VirtualDiskConversionOptions Options;
+        Options.BufferSize = 1 * MiB;
+        Options.Format = Format;
+        Options.Type = Type;
+        ::CheckConversion(SourcePath, TargetPath, Options, Expected);
+
+        Options.Format = Parameters.Format;
+        Options.Type = Parameters.Type;
+        ::CheckConversion(TargetPath, BackPath, Options, Expected);
+    }
+
+    // Fills the first blocks with the pattern except the zero ones, and also
+    // writes the last block so it has to be moved into the freed space, then
+    // checks that compacting only frees the zero blocks.
+    void CheckCompaction(
+        std::string const& Path,
+        std::uint32_t LogicalSectorSize)
+    {
+        const std::uint64_t BlockSize = 1 * MiB;
+        const std::uint64_t VirtualSize = 32 * MiB;
+
+        std::vector<std::uint8_t> Expected(VirtualSize);
+        {
+            NanaBox::VirtualDiskCreateParameters Parameters;
+            Parameters.VirtualSize = VirtualSize;
+            Parameters.BlockSize = static_cast<std::uint32_t>(BlockSize);
+            Parameters.LogicalSectorSize = LogicalSectorSize;
+            std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+                NanaBox::VirtualDiskImage::Create(Path, Parameters);
+
+            std::vector<std::uint8_t> Data = ::GeneratePattern(8 * MiB, 7);
+            std::memset(Data.data() + 2 * BlockSize, 0, BlockSize);
+            std::memset(Data.data() + 5 * BlockSize, 0, BlockSize);
+            Image->Write(0, Data.data(), Data.size());
+            std::memcpy(Expected.data(), Data.data(), Data.size());
+
+            std::vector<std::uint8_t> Last = ::GeneratePattern(BlockSize, 8);
+            Image->Write(VirtualSize - BlockSize, Last.data(), Last.size());
+            std::memcpy(
+                Expected.data() + VirtualSize - BlockSize,
+                Last.data(),
+                Last.size());
+            NANABOX_CHECK(Image->GetAllocatedBlockCount() == 9);
+        }
+
+        NanaBox::VirtualDiskCompactionResult Result;
+        {
+            std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+                NanaBox::VirtualDiskImage::Open(Path, true);
+            NanaBox::VirtualDiskCompactionOptions Options;
+            Options.ChunkSize = 256 * 1024;
+            Result = NanaBox::CompactVirtualDiskImage(*Image, Options);
+        }
+        NANABOX_CHECK(Result.AllocatedBlocks == 9);
+        NANABOX_CHECK(Result.ZeroBlocks == 2);
+        NANABOX_CHECK(Result.RelocatedBlocks > 0);
+        NANABOX_CHECK(Result.CompactedFileSize < Result.OriginalFileSize);
+
+        std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+            NanaBox::VirtualDiskImage::Open(Path, false);
+        NANABOX_CHECK(
+            Image->GetInformation().LogicalSectorSize == LogicalSectorSize);
+        NANABOX_CHECK(Image->GetAllocatedBlockCount() == 7);
+        NANABOX_CHECK(Image->GetFile().GetSize() == Result.CompactedFileSize);
+        NANABOX_CHECK(::ReadsAs(*Image, 0, Expected));
+    }
+
+    bool FileExists(
+        std::string const& Path)
+    {
+        return std::ifstream(Path).good();
+    }
+
+    void CopyImageFile(
+        std::string const& Source,
+        std::string const& Target)
+    {
+        std::ifstream Input(Source, std::ios::binary);
+        std::ofstream Output(Target, std::ios::binary | std::ios::trunc);
+        Output << Input.rdbuf();
+        NANABOX_CHECK(Input.good() && Output.good());
+    }
+
+    // Creates the parent, child and grandchild chain whose writes overlap
+    // inside the blocks and across the block boundaries, including the zeros
+    // which hide the data of the parents. Returns the read-through of the
+    // grandchild.
+    std::vector<std::uint8_t> CreateMergeChain(
+        std::string const& ParentPath,
+        std::string const& ChildPath,
+        std::string const& GrandchildPath)
+    {
+        const std::uint64_t VirtualSize = 16 * MiB;
+
+        {
+            NanaBox::VirtualDiskCreateParameters Parameters;
+            Parameters.VirtualSize = VirtualSize;
+            Parameters.BlockSize = static_cast<std::uint32_t>(1 * MiB);
+            std::unique_ptr<NanaBox::VirtualDiskImage> Parent =
+                NanaBox::VirtualDiskImage::Create(ParentPath, Parameters);
+            std::vector<std::uint8_t> Data = ::GeneratePattern(4 * MiB, 9);
+            Parent->Write(0, Data.data(), Data.size());
+        }
+
+        NanaBox::VirtualDiskCreateParameters Parameters;
+        Parameters.Type = NanaBox::VirtualDiskType::Differencing;
+        {
+            Parameters.ParentPath = ParentPath;
+            std::unique_ptr<NanaBox::VirtualDiskImage> Child =
+                NanaBox::VirtualDiskImage::Create(ChildPath, Parameters);
+            std::vector<std::uint8_t> Data = ::GeneratePattern(3072, 10);
+            Child->Write(MiB - 1024, Data.data(), Data.size());
+            Data = ::GeneratePattern(64 * 1024, 11);
+            Child->Write(2 * MiB + 512, Data.data(), Data.size());
+            Data = ::GeneratePattern(4096, 12);
+            Child->Write(6 * MiB, Data.data(), Data.size());
+        }
+        {
+            Parameters.ParentPath = ChildPath;
+            std::unique_ptr<NanaBox::VirtualDiskImage> Grandchild =
+                NanaBox::VirtualDiskImage::Create(GrandchildPath, Parameters);
+            std::vector<std::uint8_t> Data = ::GeneratePattern(1024, 13);
+            Grandchild->Write(MiB - 512, Data.data(), Data.size());
+            Data = std::vector<std::uint8_t>(32 * 1024);
+            Grandchild->Write(2 * MiB + 16 * 1024, Data.data(), Data.size());
+            Data = ::GeneratePattern(512, 14);
+            Grandchild->Write(VirtualSize - 512, Data.data(), Data.size());
+        }
+
+        std::unique_ptr<NanaBox::VirtualDiskImage> Chain =
+            NanaBox::OpenVirtualDiskChain(GrandchildPath, false);
+        std::vector<std::uint8_t> Result(VirtualSize);
+        Chain->Read(0, Result.data(), Result.size());
+        return Result;
+    }
+
+    // Compares each sector, so the failure shows where the content differs.
+    void CheckSectors(
+        NanaBox::VirtualDiskImage& Image,
+        std::vector<std::uint8_t> const& Expected)
+    {
+        const std::size_t SectorSize = 512;
+
+        NANABOX_CHECK(Image.GetInformation().VirtualSize == Expected.size());
+        std::vector<std::uint8_t> Actual(Expected.size());
+        Image.Read(0, Actual.data(), Actual.size());
+        for (std::size_t i = 0; i < Expected.size(); i += SectorSize)
+        {
+            if (0 != std::memcmp(
+                Actual.data() + i,
+                Expected.data() + i,
+                SectorSize))
+            {
+                throw NanaBox::Tests::TestFailure(
+                    "Sector " + std::to_string(i / SectorSize) + " differs");
+            }
+        }
+    }
+}
+
+NANABOX_TEST(VirtualDiskImageRoundTripsVhdxDynamic)
+{
+    TemporaryImages Images;
+
+    NanaBox::VirtualDiskCreateParameters Parameters;
+    Parameters.Format = NanaBox::VirtualDiskFormat::Vhdx;
+    Parameters.Type = NanaBox::VirtualDiskType::Dynamic;
+    Parameters.VirtualSize = 64 * MiB;
+    Parameters.BlockSize = static_cast<std::uint32_t>(1 * MiB);
+    ::CheckRoundTrip(Images.Add("Dynamic.vhdx"), Parameters);
+}
+
+NANABOX_TEST(VirtualDiskImageRoundTripsVhdx4KnFixed)
+{
+    TemporaryImages Images;
+
+    NanaBox::VirtualDiskCreateParameters Parameters;
+    Parameters.Format = NanaBox::VirtualDiskFormat::Vhdx;
+    Parameters.Type = NanaBox::VirtualDiskType::Fixed;
+    Parameters.VirtualSize = 16 * MiB;
+    Parameters.LogicalSectorSize = 4096;
+    ::CheckRoundTrip(Images.Add("Fixed.vhdx"), Parameters);
+}
+
+NANABOX_TEST(VirtualDiskImageRoundTripsVhdDynamic)
+{
+    TemporaryImages Images;
+
+    NanaBox::VirtualDiskCreateParameters Parameters;
+    Parameters.Format = NanaBox::VirtualDiskFormat::Vhd;
+    Parameters.Type = NanaBox::VirtualDiskType::Dynamic;
+    Parameters.VirtualSize = 64 * MiB;
+    ::CheckRoundTrip(Images.Add("Dynamic.vhd"), Parameters);
+}
+
+NANABOX_TEST(VirtualDiskImageRoundTripsVhdFixed)
+{
+    TemporaryImages Images;
+
+    NanaBox::VirtualDiskCreateParameters Parameters;
+    Parameters.Format = NanaBox::VirtualDiskFormat::Vhd;
+    Parameters.Type = NanaBox::VirtualDiskType::Fixed;
+    Parameters.VirtualSize = 16 * MiB;
+    ::CheckRoundTrip(Images.Add("Fixed.vhd"), Parameters);
+}
+
+NANABOX_TEST(VirtualDiskImageRoundTripsDifferencingChain)
+{
+    TemporaryImages Images;
+    std::string ParentPath = Images.Add("Parent.vhdx");
+    std::string ChildPath = Images.Add("Child.vhdx");
+
+    std::vector<std::uint8_t> ParentData = ::GeneratePattern(4 * MiB, 4);
+    std::vector<std::uint8_t> ChildData = ::GeneratePattern(512, 5);
+    {
+        NanaBox::VirtualDiskCreateParameters Parameters;
+        Parameters.VirtualSize = 32 * MiB;
+        std::unique_ptr<NanaBox::VirtualDiskImage> Parent =
+            NanaBox::VirtualDiskImage::Create(ParentPath, Parameters);
+        Parent->Write(0, ParentData.data(), ParentData.size());
+    }
+    {
+        NanaBox::VirtualDiskCreateParameters Parameters;
+        Parameters.Type = NanaBox::VirtualDiskType::Differencing;
+        Parameters.ParentPath = ParentPath;
+        std::unique_ptr<NanaBox::VirtualDiskImage> Child =
+            NanaBox::VirtualDiskImage::Create(ChildPath, Parameters);
+        Child->Write(1536, ChildData.data(), ChildData.size());
+    }
+
+    // Only the sector written to the child hides the parent.
+    std::vector<std::uint8_t> Expected = ParentData;
+    std::memcpy(Expected.data() + 1536, ChildData.data(), ChildData.size());
+
+    std::unique_ptr<NanaBox::VirtualDiskImage> Chain =
+        NanaBox::OpenVirtualDiskChain(ChildPath, false);
+    NANABOX_CHECK(
+        Chain->GetInformation().Type ==
+        NanaBox::VirtualDiskType::Differencing);
+    NANABOX_CHECK(Chain->GetParent());
+    NANABOX_CHECK(Chain->GetAllocatedBlockCount() == 1);
+    NANABOX_CHECK(::ReadsAs(*Chain, 0, Expected));
+    NANABOX_CHECK(::ReadsAsZero(*Chain, 4 * MiB, 4096));
+}
+
+NANABOX_TEST(VirtualDiskImageLocksWritableOpens)
+{
+    TemporaryImages Images;
+    std::string Path = Images.Add("Locked.vhdx");
+
+    NanaBox::VirtualDiskCreateParameters Parameters;
+    Parameters.VirtualSize = 16 * MiB;
+    std::unique_ptr<NanaBox::VirtualDiskImage> Writer =
+        NanaBox::VirtualDiskImage::Create(Path, Parameters);
+
+    bool Rejected = false;
+    try
+    {
+        NanaBox::VirtualDiskImage::Open(Path, false);
+    }
+    catch (std::system_error const&)
+    {
+        Rejected = true;
+    }
+    NANABOX_CHECK(Rejected);
+
+    // The readers share the file with each other but not with a writer.
+    Writer.reset();
+    std::unique_ptr<NanaBox::VirtualDiskImage> Reader =
+        NanaBox::VirtualDiskImage::Open(Path, false);
+    std::unique_ptr<NanaBox::VirtualDiskImage> OtherReader =
+        NanaBox::VirtualDiskImage::Open(Path, false);
+    Rejected = false;
+    try
+    {
+        NanaBox::VirtualDiskImage::Open(Path, true);
+    }
+    catch (std::system_error const&)
+    {
+        Rejected = true;
+    }
+    NANABOX_CHECK(Rejected);
+}
+
+NANABOX_TEST(VirtualDiskImageConvertsVhdxDynamicToVhdDynamic)
+{
+    TemporaryImages Images;
+
+    NanaBox::VirtualDiskCreateParameters Parameters;
+    Parameters.Format = NanaBox::VirtualDiskFormat::Vhdx;
+    Parameters.Type = NanaBox::VirtualDiskType::Dynamic;
+    Parameters.VirtualSize = 16 * MiB;
+    Parameters.BlockSize = static_cast<std::uint32_t>(1 * MiB);
+    ::CheckConversionRoundTrip(
+        Images,
+        Parameters,
+        NanaBox::VirtualDiskFormat::Vhd,
+        NanaBox::VirtualDiskType::Dynamic);
+}
+
+NANABOX_TEST(VirtualDiskImageConvertsVhdFixedToVhdxDynamic)
+{
+    TemporaryImages Images;
+
+    NanaBox::VirtualDiskCreateParameters Parameters;
+    Parameters.Format = NanaBox::VirtualDiskFormat::Vhd;
+    Parameters.Type = NanaBox::VirtualDiskType::Fixed;
+    Parameters.VirtualSize = 16 * MiB;
+    ::CheckConversionRoundTrip(
+        Images,
+        Parameters,
+        NanaBox::VirtualDiskFormat::Vhdx,
+        NanaBox::VirtualDiskType::Dynamic);
+}
+
+NANABOX_TEST(VirtualDiskImageConvertsVhdxDynamicToVhdxFixed)
+{
+    TemporaryImages Images;
+
+    NanaBox::VirtualDiskCreateParameters Parameters;
+    Parameters.Format = NanaBox::VirtualDiskFormat::Vhdx;
+    Parameters.Type = NanaBox::VirtualDiskType::Dynamic;
+    Parameters.VirtualSize = 16 * MiB;
+    Parameters.BlockSize = static_cast<std::uint32_t>(1 * MiB);
+    ::CheckConversionRoundTrip(
+        Images,
+        Parameters,
+        NanaBox::VirtualDiskFormat::Vhdx,
+        NanaBox::VirtualDiskType::Fixed);
+}
+
+NANABOX_TEST(VirtualDiskImageCompactsZeroBlocks512e)
+{
+    TemporaryImages Images;
+    ::CheckCompaction(Images.Add("Compact512e.vhdx"), 512);
+}
+
+NANABOX_TEST(VirtualDiskImageCompactsZeroBlocks4Kn)
+{
+    TemporaryImages Images;
+    ::CheckCompaction(Images.Add("Compact4Kn.vhdx"), 4096);
+}
+
+NANABOX_TEST(VirtualDiskImageMergesIntoParents)
+{
+    TemporaryImages Images;
+    std::string ParentPath = Images.Add("MergeParent.vhdx");
+    std::string ChildPath = Images.Add("MergeChild.vhdx");
+    std::string GrandchildPath = Images.Add("MergeGrandchild.vhdx");
+
+    std::vector<std::uint8_t> Expected = ::CreateMergeChain(
+        ParentPath,
+        ChildPath,
+        GrandchildPath);
+
+    NanaBox::VirtualDiskMergeOptions Options;
+    Options.ChunkSize = 4096;
+
+    NanaBox::VirtualDiskMergeResult Result =
+        NanaBox::MergeVirtualDiskIntoParent(GrandchildPath, Options);
+    NANABOX_CHECK(!::FileExists(GrandchildPath));
+    NANABOX_CHECK(Result.Before.ChainDepth == 3);
+    {
+        std::unique_ptr<NanaBox::VirtualDiskImage> Chain =
+            NanaBox::OpenVirtualDiskChain(ChildPath, false);
+        ::CheckSectors(*Chain, Expected);
+    }
+
+    NanaBox::MergeVirtualDiskIntoParent(ChildPath, Options);
+    NANABOX_CHECK(!::FileExists(ChildPath));
+    {
+        std::unique_ptr<NanaBox::VirtualDiskImage> Parent =
+            NanaBox::VirtualDiskImage::Open(ParentPath, false);
+        NANABOX_CHECK(!Parent->GetParent());
+        ::CheckSectors(*Parent, Expected);
+    }
+}
+
+NANABOX_TEST(VirtualDiskImageMergesChains)
+{
+    TemporaryImages Images;
+    std::string ParentPath = Images.Add("ChainParent.vhdx");
+    std::string ChildPath = Images.Add("ChainChild.vhdx");
+    std::string GrandchildPath = Images.Add("ChainGrandchild.vhdx");
+    std::string TargetPath = Images.Add("ChainTarget.vhdx");
+
+    std::vector<std::uint8_t> Expected = ::CreateMergeChain(
+        ParentPath,
+        ChildPath,
+        GrandchildPath);
+
+    NanaBox::VirtualDiskMergeOptions Options;
+    Options.ChunkSize = 4096;
+    NanaBox::MergeVirtualDiskChain(GrandchildPath, TargetPath, Options);
+
+    {
+        std::unique_ptr<NanaBox::VirtualDiskImage> Target =
+            NanaBox::VirtualDiskImage::Open(TargetPath, false);
+        NANABOX_CHECK(
+            Target->GetInformation().Type ==
+            NanaBox::VirtualDiskType::Dynamic);
+        ::CheckSectors(*Target, Expected);
+    }
+
+    // The chain itself is not modified.
+    std::unique_ptr<NanaBox::VirtualDiskImage> Chain =
+        NanaBox::OpenVirtualDiskChain(GrandchildPath, false);
+    ::CheckSectors(*Chain, Expected);
+}
+
+NANABOX_TEST(VirtualDiskImageAppliesDeltas)
+{
+    TemporaryImages Images;
+    std::string BasePath = Images.Add("DeltaBase.vhdx");
+    std::string CurrentPath = Images.Add("DeltaCurrent.vhdx");
+    std::string CopyPath = Images.Add("DeltaCopy.vhdx");
+    std::string DivergedPath = Images.Add("DeltaDiverged.vhdx");
+    std::string DeltaPath = Images.Add("Delta.bin");
+
+    {
+        NanaBox::VirtualDiskCreateParameters Parameters;
+        Parameters.VirtualSize = 16 * MiB;
+        Parameters.BlockSize = static_cast<std::uint32_t>(1 * MiB);
+        std::unique_ptr<NanaBox::VirtualDiskImage> Base =
+            NanaBox::VirtualDiskImage::Create(BasePath, Parameters);
+        std::vector<std::uint8_t> Data = ::GeneratePattern(4 * MiB, 15);
+        Base->Write(0, Data.data(), Data.size());
+    }
+    ::CopyImageFile(BasePath, CurrentPath);
+    ::CopyImageFile(BasePath, CopyPath);
+    ::CopyImageFile(BasePath, DivergedPath);
+
+    // The next generation changes the data inside and across the blocks,
+    // zeros a range and writes to a block which was not allocated.
+    {
+        std::unique_ptr<NanaBox::VirtualDiskImage> Current =
+            NanaBox::VirtualDiskImage::Open(CurrentPath, true);
+        std::vector<std::uint8_t> Data = ::GeneratePattern(3072, 16);
+        Current->Write(MiB - 1024, Data.data(), Data.size());
+        Data = std::vector<std::uint8_t>(16 * 1024);
+        Current->Write(2 * MiB + 4096, Data.data(), Data.size());
+        Data = ::GeneratePattern(4096, 17);
+        Current->Write(10 * MiB, Data.data(), Data.size());
+    }
+    {
+        std::unique_ptr<NanaBox::VirtualDiskImage> Diverged =
+            NanaBox::VirtualDiskImage::Open(DivergedPath, true);
+        std::vector<std::uint8_t> Data = ::GeneratePattern(4096, 18);
+        Diverged->Write(8 * MiB, Data.data(), Data.size());
+    }
+
+    NanaBox::VirtualDiskGuid BaseDataWriteGuid;
+    NanaBox::VirtualDiskGuid CurrentDataWriteGuid;
+    {
+        std::unique_ptr<NanaBox::VirtualDiskImage> Base =
+            NanaBox::VirtualDiskImage::Open(BasePath, false);
+        std::unique_ptr<NanaBox::VirtualDiskImage> Current =
+            NanaBox::VirtualDiskImage::Open(CurrentPath, false);
+        BaseDataWriteGuid = Base->GetInformation().DataWriteGuid;
+        CurrentDataWriteGuid = Current->GetInformation().DataWriteGuid;
+        NANABOX_CHECK(BaseDataWriteGuid != CurrentDataWriteGuid);
+
+        NanaBox::VirtualDiskChangeTrackingOptions Options;
+        std::vector<NanaBox::VirtualDiskChangedRange> Ranges =
+            NanaBox::CompareVirtualDiskImages(*Base, *Current, Options);
+        NANABOX_CHECK(!Ranges.empty());
+        NanaBox::CreateVirtualDiskDelta(
+            *Current,
+            BaseDataWriteGuid,
+            Ranges,
+            DeltaPath);
+    }
+
+    NanaBox::VirtualDiskDeltaInformation Information =
+        NanaBox::ReadVirtualDiskDeltaInformation(DeltaPath);
+    NANABOX_CHECK(Information.VirtualSize == 16 * MiB);
+    NANABOX_CHECK(Information.BaseDataWriteGuid == BaseDataWriteGuid);
+    NANABOX_CHECK(Information.CurrentDataWriteGuid == CurrentDataWriteGuid);
+
+    {
+        std::unique_ptr<NanaBox::VirtualDiskImage> Copy =
+            NanaBox::VirtualDiskImage::Open(CopyPath, true);
+        NanaBox::ApplyVirtualDiskDelta(*Copy, DeltaPath, false);
+    }
+    NANABOX_CHECK(::ReadAll(CopyPath) == ::ReadAll(CurrentPath));
+
+    // The diverged copy is not the base of the delta anymore, so it is
+    // rejected without being modified.
+    std::vector<std::uint8_t> Diverged = ::ReadAll(DivergedPath);
+    bool Rejected = false;
+    try
+    {
+        std::unique_ptr<NanaBox::VirtualDiskImage> Target =
+            NanaBox::VirtualDiskImage::Open(DivergedPath, true);
+        NanaBox::ApplyVirtualDiskDelta(*Target, DeltaPath, false);
+    }
+    catch (std::exception const&)
+    {
+        Rejected = true;
+    }
+    NANABOX_CHECK(Rejected);
+    NANABOX_CHECK(::ReadAll(DivergedPath) == Diverged);
+}
+
+#ifdef _WIN32
+
+namespace
+{
+    std::wstring ToWidePath(
+        std::string const& Path)
+    {
+        int Length = ::MultiByteToWideChar(
+            CP_UTF8,
+            0,
+            Path.c_str(),
+            -1,
+            nullptr,
+            0);
+        std::wstring Result(Length, L'\0');
+        ::MultiByteToWideChar(
+            CP_UTF8,
+            0,
+            Path.c_str(),
+            -1,
+            &Result[0],
+            Length);
+        Result.resize(Length - 1);
+        return Result;
+    }
+
+    VIRTUAL_STORAGE_TYPE GetStorageType(
+        std::string const& Path)
+    {
+        VIRTUAL_STORAGE_TYPE Result;
+        Result.DeviceId = Path.size() > 5 &&
+            0 == Path.compare(Path.size() - 5, 5, ".vhdx")
+            ? VIRTUAL_STORAGE_TYPE_DEVICE_VHDX
+            : VIRTUAL_STORAGE_TYPE_DEVICE_VHD;
+        Result.VendorId = VIRTUAL_STORAGE_TYPE_VENDOR_MICROSOFT;
+        return Result;
+    }
+
+    // Opens the image with VirtDisk for reading the information only, which
+    // doesn't need the administrator privilege.
+    HANDLE OpenWithVirtDisk(
+        std::string const& Path)
+    {
+        VIRTUAL_STORAGE_TYPE StorageType = ::GetStorageType(Path);
+        OPEN_VIRTUAL_DISK_PARAMETERS Parameters = {};
+        Parameters.Version = OPEN_VIRTUAL_DISK_VERSION_2;
+        Parameters.Version2.GetInfoOnly = TRUE;
+        HANDLE Result = INVALID_HANDLE_VALUE;
+        DWORD Error = ::OpenVirtualDisk(
+            &StorageType,
+            ::ToWidePath(Path).c_str(),
+            VIRTUAL_DISK_ACCESS_NONE,
+            OPEN_VIRTUAL_DISK_FLAG_NONE,
+            &Parameters,
+            &Result);
+        NANABOX_CHECK(ERROR_SUCCESS == Error);
+        return Result;
+    }
+
+    GET_VIRTUAL_DISK_INFO GetVirtDiskInformation(
+        HANDLE Handle,
+        GET_VIRTUAL_DISK_INFO_VERSION Version)
+    {
+        GET_VIRTUAL_DISK_INFO Result = {};
+        Result.Version = Version;
+        ULONG Size = sizeof(Result);
+        NANABOX_CHECK(ERROR_SUCCESS == ::GetVirtualDiskInformation(
+            Handle,
+            &Size,
+            &Result,
+            nullptr));
+        return Result;
+    }
+
+    // Checks that VirtDisk reads the same layout as the library.
+    void CheckVirtDiskInformation(
+        std::string const& Path)
+    {
+        NanaBox::VirtualDiskInformation Expected;
+        {
+            std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+                NanaBox::VirtualDiskImage::Open(Path, false);
+            Expected = Image->GetInformation();
+        }
+
+        HANDLE Handle = ::OpenWithVirtDisk(Path);
+        GET_VIRTUAL_DISK_INFO Size = ::GetVirtDiskInformation(
+            Handle,
+            GET_VIRTUAL_DISK_INFO_SIZE);
+        GET_VIRTUAL_DISK_INFO Identifier = ::GetVirtDiskInformation(
+            Handle,
+            GET_VIRTUAL_DISK_INFO_IDENTIFIER);
+        ::CloseHandle(Handle);
+
+        NANABOX_CHECK(Size.Size.VirtualSize == Expected.VirtualSize);
+        NANABOX_CHECK(Size.Size.SectorSize == Expected.LogicalSectorSize);
+        NANABOX_CHECK(0 == std::memcmp(
+            &Identifier.Identifier,
+            Expected.DiskId.Bytes,
+            sizeof(Expected.DiskId.Bytes)));
+    }
+}
+
+NANABOX_TEST(VirtualDiskImageRoundTripsVirtDiskImages)
+{
+    TemporaryImages Images;
+
+    const char* Names[] = { "VirtDisk.vhdx", "VirtDisk.vhd" };
+    for (const char* Name : Names)
+    {
+        std::string Path = Images.Add(Name);
+
+        VIRTUAL_STORAGE_TYPE StorageType = ::GetStorageType(Path);
+        CREATE_VIRTUAL_DISK_PARAMETERS Parameters = {};
+        Parameters.Version = CREATE_VIRTUAL_DISK_VERSION_2;
+        Parameters.Version2.MaximumSize = 64 * MiB;
+        HANDLE Handle = INVALID_HANDLE_VALUE;
+        NANABOX_CHECK(ERROR_SUCCESS == ::CreateVirtualDisk(
+            &StorageType,
+            ::ToWidePath(Path).c_str(),
+            VIRTUAL_DISK_ACCESS_NONE,
+            nullptr,
+            CREATE_VIRTUAL_DISK_FLAG_NONE,
+            0,
+            &Parameters,
+            nullptr,
+            &Handle));
+        ::CloseHandle(Handle);
+
+        std::vector<std::uint8_t> Data = ::GeneratePattern(3 * MiB, 6);
+        {
+            std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+                NanaBox::VirtualDiskImage::Open(Path, true);
+            // VirtDisk may round the size of VHD to the disk geometry.
+            NANABOX_CHECK(Image->GetInformation().VirtualSize >= 63 * MiB);
+            NANABOX_CHECK(::ReadsAsZero(*Image, 0, 4096));
+            Image->Write(MiB / 2, Data.data(), Data.size());
+        }
+        {
+            std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+                NanaBox::VirtualDiskImage::Open(Path, false);
+            NANABOX_CHECK(::ReadsAs(*Image, MiB / 2, Data));
+        }
+
+        ::CheckVirtDiskInformation(Path);
+    }
+}
+
+NANABOX_TEST(VirtualDiskImageCreatesImagesForVirtDisk)
+{
+    TemporaryImages Images;
+    std::string ParentPath = Images.Add("ForVirtDisk.vhdx");
+    std::string ChildPath = Images.Add("ForVirtDisk.Child.vhdx");
+    std::string VhdPath = Images.Add("ForVirtDisk.vhd");
+
+    {
+        NanaBox::VirtualDiskCreateParameters Parameters;
+        Parameters.VirtualSize = 64 * MiB;
+        NanaBox::VirtualDiskImage::Create(ParentPath, Parameters);
+        Parameters.Type = NanaBox::VirtualDiskType::Differencing;
+        Parameters.ParentPath = ParentPath;
+        NanaBox::VirtualDiskImage::Create(ChildPath, Parameters);
+        Parameters.Format = NanaBox::VirtualDiskFormat::Vhd;
+        Parameters.Type = NanaBox::VirtualDiskType::Fixed;
+        Parameters.ParentPath.clear();
+        NanaBox::VirtualDiskImage::Create(VhdPath, Parameters);
+    }
+
+    ::CheckVirtDiskInformation(ParentPath);
+    ::CheckVirtDiskInformation(ChildPath);
+    ::CheckVirtDiskInformation(VhdPath);
+}
+
+#endif // _WIN32
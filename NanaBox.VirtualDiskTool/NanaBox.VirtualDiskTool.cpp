@@ -0,0 +1,1597 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      NanaBox.VirtualDiskTool.cpp
+ * PURPOSE:   Implementation for the Portable Virtual Disk Tool
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "../NanaBox/VirtualDiskImage.h"
+#include "../NanaBox/VirtualDiskBenchmark.h"
+#include "../NanaBox/VirtualDiskChangeTracking.h"
+#include "../NanaBox/VirtualDiskCompaction.h"
+#include "../NanaBox/VirtualDiskConversion.h"
+#include "../NanaBox/VirtualDiskDeduplication.h"
+#include "../NanaBox/VirtualDiskMerge.h"
+#include "../NanaBox/VirtualDiskOperation.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+    const char* GetFormatName(
+        NanaBox::VirtualDiskFormat Value)
+    {
+        switch (Value)
+        {
+        case NanaBox::VirtualDiskFormat::Vhd:
+            return "VHD";
+        case NanaBox::VirtualDiskFormat::Vhdx:
+            return "VHDX";
+        default:
+            return "Unknown";
+        }
+    }
+
+    const char* GetTypeName(
+        NanaBox::VirtualDiskType Value)
+    {
+        switch (Value)
+        {
+        case NanaBox::VirtualDiskType::Fixed:
+            return "Fixed";
+        case NanaBox::VirtualDiskType::Dynamic:
+            return "Dynamic";
+        case NanaBox::VirtualDiskType::Differencing:
+            return "Differencing";
+        default:
+            return "Unknown";
+        }
+    }
+
+    const char* GetBlockStateName(
+        NanaBox::VirtualDiskBlockState Value)
+    {
+        switch (Value)
+        {
+        case NanaBox::VirtualDiskBlockState::NotPresent:
+            return "NotPresent";
+        case NanaBox::VirtualDiskBlockState::Undefined:
+            return "Undefined";
+        case NanaBox::VirtualDiskBlockState::Zero:
+            return "Zero";
+        case NanaBox::VirtualDiskBlockState::Unmapped:
+            return "Unmapped";
+        case NanaBox::VirtualDiskBlockState::FullyPresent:
+            return "FullyPresent";
+        case NanaBox::VirtualDiskBlockState::PartiallyPresent:
+            return "PartiallyPresent";
+        default:
+            return "Unknown";
+        }
+    }
+
+    void PrintImageInformation(
+        NanaBox::VirtualDiskImage& Image)
+    {
+        NanaBox::VirtualDiskInformation const& Information =
+            Image.GetInformation();
+
+        std::map<NanaBox::VirtualDiskBlockState, std::uint64_t> BlockStates;
+        for (std::uint64_t i = 0; i < Information.BlockCount; ++i)
+        {
+            ++BlockStates[Image.GetBlockState(i)];
+        }
+        std::uint64_t AllocatedBlocks = Image.GetAllocatedBlockCount();
+
+        std::printf("Path: %s\n", Image.GetPath().c_str());
+        std::printf(
+            "Format: %s (%s)\n",
+            ::GetFormatName(Information.Format),
+            ::GetTypeName(Information.Type));
+        std::printf(
+            "Virtual Size: %s (%llu bytes)\n",
+            NanaBox::FormatVirtualDiskSize(Information.VirtualSize).c_str(),
+            static_cast<unsigned long long>(Information.VirtualSize));
+        std::printf(
+            "File Size: %s\n",
+            NanaBox::FormatVirtualDiskSize(
+                Image.GetFile().GetSize()).c_str());
+        std::printf(
+            "Block Size: %s\n",
+            NanaBox::FormatVirtualDiskSize(Information.BlockSize).c_str());
+        std::printf(
+            "Sector Size: %u bytes logical, %u bytes physical\n",
+            Information.LogicalSectorSize,
+            Information.PhysicalSectorSize);
+        std::printf(
+            "Allocation: %llu of %llu blocks (%s)\n",
+            static_cast<unsigned long long>(AllocatedBlocks),
+            static_cast<unsigned long long>(Information.BlockCount),
+            NanaBox::FormatVirtualDiskSize(
+                AllocatedBlocks * Information.BlockSize).c_str());
+        for (auto const& BlockState : BlockStates)
+        {
+            std::printf(
+                "    %s: %llu\n",
+                ::GetBlockStateName(BlockState.first),
+                static_cast<unsigned long long>(BlockState.second));
+        }
+        std::printf(
+            "Disk ID: %s\n",
+            NanaBox::FormatVirtualDiskGuid(Information.DiskId).c_str());
+        if (NanaBox::VirtualDiskFormat::Vhdx == Information.Format)
+        {
+            std::printf(
+                "Data Write GUID: %s\n",
+                NanaBox::FormatVirtualDiskGuid(
+                    Information.DataWriteGuid).c_str());
+        }
+        if (Image.GetReplayedLogEntryCount())
+        {
+            std::printf(
+                "Replayed Log Entries: %zu\n",
+                Image.GetReplayedLogEntryCount());
+        }
+    }
+
+    int InfoCommand(
+        std::vector<std::string> const& Arguments)
+    {
+        if (Arguments.size() != 1)
+        {
+            std::fprintf(stderr, "Usage: info <Image>\n");
+            return 1;
+        }
+
+        std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+            NanaBox::VirtualDiskImage::Open(Arguments[0], false);
+        ::PrintImageInformation(*Image);
+
+        // Walks the parent chain without failing on the missing parents, so
+        // the broken chains can be diagnosed.
+        NanaBox::VirtualDiskImage* Current = Image.get();
+        for (std::size_t Depth = 1;
+            NanaBox::VirtualDiskType::Differencing ==
+            Current->GetInformation().Type;
+            ++Depth)
+        {
+            NanaBox::VirtualDiskParentLocator const& Locator =
+                Current->GetInformation().Parent;
+            std::printf("\nParent %zu:\n", Depth);
+            std::printf(
+                "    Linkage: %s\n",
+                NanaBox::FormatVirtualDiskGuid(Locator.Linkage).c_str());
+            if (!Locator.RelativePath.empty())
+            {
+                std::printf(
+                    "    Relative Path: %s\n",
+                    Locator.RelativePath.c_str());
+            }
+            if (!Locator.AbsolutePath.empty())
+            {
+                std::printf(
+                    "    Absolute Path: %s\n",
+                    Locator.AbsolutePath.c_str());
+            }
+            if (!Locator.VolumePath.empty())
+            {
+                std::printf(
+                    "    Volume Path: %s\n",
+                    Locator.VolumePath.c_str());
+            }
+
+            std::unique_ptr<NanaBox::VirtualDiskImage> Parent;
+            try
+            {
+                Parent = Current->OpenParent();
+            }
+            catch (std::exception const& Exception)
+            {
+                std::printf("    Status: %s\n", Exception.what());
+                return 2;
+            }
+            if (!Parent)
+            {
+                std::printf("    Status: Missing\n");
+                return 2;
+            }
+            std::printf("    Status: Found\n\n");
+            ::PrintImageInformation(*Parent);
+
+            NanaBox::VirtualDiskImage* Next = Parent.get();
+            Current->SetParent(std::move(Parent));
+            Current = Next;
+        }
+
+        return 0;
+    }
+
+    int ReplayCommand(
+        std::vector<std::string> const& Arguments)
+    {
+        if (Arguments.size() != 1)
+        {
+            std::fprintf(stderr, "Usage: replay <Image>\n");
+            return 1;
+        }
+
+        std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+            NanaBox::VirtualDiskImage::Open(Arguments[0], true);
+        Image->Flush();
+        std::printf(
+            "Replayed %zu log entries.\n",
+            Image->GetReplayedLogEntryCount());
+        return 0;
+    }
+
+    // Splits the arguments into the options in the "--Name=Value" or "--Name"
+    // format and the others.
+    void ParseArguments(
+        std::vector<std::string> const& Arguments,
+        std::map<std::string, std::string>& Options,
+        std::vector<std::string>& Values)
+    {
+        for (std::string const& Argument : Arguments)
+        {
+            if (0 != Argument.rfind("--", 0))
+            {
+                Values.push_back(Argument);
+                continue;
+            }
+
+            std::string::size_type Separator = Argument.find('=');
+            if (std::string::npos == Separator)
+            {
+                Options[Argument.substr(2)] = std::string();
+            }
+            else
+            {
+                Options[Argument.substr(2, Separator - 2)] =
+                    Argument.substr(Separator + 1);
+            }
+        }
+    }
+
+    double GetThroughput(
+        std::uint64_t Bytes,
+        double Seconds)
+    {
+        return Seconds > 0 ? Bytes / Seconds / 1e9 : 0.0;
+    }
+
+    int CompactCommand(
+        std::vector<std::string> const& Arguments)
+    {
+        std::map<std::string, std::string> Options;
+        std::vector<std::string> Values;
+        ::ParseArguments(Arguments, Options, Values);
+        if (Values.size() != 1)
+        {
+            std::fprintf(
+                stderr,
+                "Usage: compact [--ScanOnly] [--Parallelism=Count] "
+                "[--ChunkSize=KiB] <Image>\n");
+            return 1;
+        }
+
+        NanaBox::VirtualDiskCompactionOptions CompactionOptions;
+        CompactionOptions.ScanOnly = Options.count("ScanOnly");
+        if (Options.count("Parallelism"))
+        {
+            CompactionOptions.MaxParallelism = std::strtoull(
+                Options["Parallelism"].c_str(),
+                nullptr,
+                10);
+        }
+        if (Options.count("ChunkSize"))
+        {
+            CompactionOptions.ChunkSize = std::strtoull(
+                Options["ChunkSize"].c_str(),
+                nullptr,
+                10) * 1024;
+        }
+
+        std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+            NanaBox::VirtualDiskImage::Open(
+                Values[0],
+                !CompactionOptions.ScanOnly);
+        NanaBox::VirtualDiskCompactionResult Result =
+            NanaBox::CompactVirtualDiskImage(*Image, CompactionOptions);
+
+        std::uint64_t BlockSize = Image->GetInformation().BlockSize;
+        std::printf(
+            "Allocated Blocks: %llu\n",
+            static_cast<unsigned long long>(Result.AllocatedBlocks));
+        std::printf(
+            "Zero Blocks: %llu of %llu scanned (%s)\n",
+            static_cast<unsigned long long>(Result.ZeroBlocks),
+            static_cast<unsigned long long>(Result.ScannedBlocks),
+            NanaBox::FormatVirtualDiskSize(
+                Result.ZeroBlocks * BlockSize).c_str());
+        std::printf(
+            "Relocated Blocks: %llu\n",
+            static_cast<unsigned long long>(Result.RelocatedBlocks));
+        std::printf(
+            "File Size: %s -> %s\n",
+            NanaBox::FormatVirtualDiskSize(Result.OriginalFileSize).c_str(),
+            NanaBox::FormatVirtualDiskSize(Result.CompactedFileSize).c_str());
+        std::printf(
+            "Scan: %s read in %.3f s, %.2f GB/s\n",
+            NanaBox::FormatVirtualDiskSize(Result.ScannedBytes).c_str(),
+            Result.ScanSeconds,
+            ::GetThroughput(Result.ScannedBytes, Result.ScanSeconds));
+        std::printf("Total: %.3f s\n", Result.TotalSeconds);
+        if (CompactionOptions.ScanOnly)
+        {
+            std::printf("The image is not modified in the scan only mode.\n");
+        }
+        return 0;
+    }
+
+    bool IsSameText(
+        std::string const& Left,
+        std::string const& Right)
+    {
+        return Left.size() == Right.size() && std::equal(
+            Left.begin(),
+            Left.end(),
+            Right.begin(),
+            [](char LeftCharacter, char RightCharacter)
+        {
+            return std::tolower(static_cast<unsigned char>(LeftCharacter)) ==
+                std::tolower(static_cast<unsigned char>(RightCharacter));
+        });
+    }
+
+    int ConvertCommand(
+        std::vector<std::string> const& Arguments)
+    {
+        std::map<std::string, std::string> Options;
+        std::vector<std::string> Values;
+        ::ParseArguments(Arguments, Options, Values);
+        if (Values.size() != 2)
+        {
+            std::fprintf(
+                stderr,
+                "Usage: convert [--Format=VHD|VHDX] [--Type=Fixed|Dynamic] "
+                "[--BlockSize=MiB] [--BufferSize=MiB] [--QueueDepth=Count] "
+                "<Source> <Target>\n");
+            return 1;
+        }
+
+        NanaBox::VirtualDiskConversionOptions ConversionOptions;
+        std::string Format = Options["Format"];
+        if (Format.empty())
+        {
+            std::string::size_type Dot = Values[1].rfind('.');
+            if (std::string::npos != Dot)
+            {
+                Format = Values[1].substr(Dot + 1);
+            }
+        }
+        ConversionOptions.Format = ::IsSameText(Format, "vhd")
+            ? NanaBox::VirtualDiskFormat::Vhd
+            : NanaBox::VirtualDiskFormat::Vhdx;
+        if (::IsSameText(Options["Type"], "Fixed"))
+        {
+            ConversionOptions.Type = NanaBox::VirtualDiskType::Fixed;
+        }
+        if (Options.count("BlockSize"))
+        {
+            ConversionOptions.BlockSize = static_cast<std::uint32_t>(
+                std::strtoul(Options["BlockSize"].c_str(), nullptr, 10) *
+                1024 * 1024);
+        }
+        if (Options.count("BufferSize"))
+        {
+            ConversionOptions.BufferSize = std::strtoull(
+                Options["BufferSize"].c_str(),
+                nullptr,
+                10) * 1024 * 1024;
+        }
+        if (Options.count("QueueDepth"))
+        {
+            ConversionOptions.QueueDepth = std::strtoull(
+                Options["QueueDepth"].c_str(),
+                nullptr,
+                10);
+        }
+
+        std::unique_ptr<NanaBox::VirtualDiskImage> Source =
+            NanaBox::OpenVirtualDiskChain(Values[0], false);
+        NanaBox::VirtualDiskConversionResult Result =
+            NanaBox::ConvertVirtualDiskImage(
+                *Source,
+                Values[1],
+                ConversionOptions);
+
+        std::printf(
+            "Virtual Size: %s\n",
+            NanaBox::FormatVirtualDiskSize(Result.VirtualSize).c_str());
+        std::printf(
+            "Present: %s, Written: %s\n",
+            NanaBox::FormatVirtualDiskSize(Result.PresentBytes).c_str(),
+            NanaBox::FormatVirtualDiskSize(Result.WrittenBytes).c_str());
+        std::printf(
+            "Target File Size: %s\n",
+            NanaBox::FormatVirtualDiskSize(Result.TargetFileSize).c_str());
+        std::printf(
+            "Time: %.3f s, %.2f GB/s of the virtual disk, %.2f GB/s read\n",
+            Result.Seconds,
+            ::GetThroughput(Result.VirtualSize, Result.Seconds),
+            ::GetThroughput(Result.PresentBytes, Result.Seconds));
+        return 0;
+    }
+
+    int ChangesCommand(
+        std::vector<std::string> const& Arguments)
+    {
+        std::map<std::string, std::string> Options;
+        std::vector<std::string> Values;
+        ::ParseArguments(Arguments, Options, Values);
+        if (Values.size() != 1 && Values.size() != 2)
+        {
+            std::fprintf(
+                stderr,
+                "Usage: changes [--Granularity=KiB] [--Parallelism=Count] "
+                "[--Map=Path] [--Delta=Path] <Current> [Base]\n");
+            return 1;
+        }
+
+        NanaBox::VirtualDiskChangeTrackingOptions TrackingOptions;
+        if (Options.count("Granularity"))
+        {
+            TrackingOptions.Granularity = static_cast<std::uint32_t>(
+                std::strtoul(Options["Granularity"].c_str(), nullptr, 10) *
+                1024);
+        }
+        if (Options.count("Parallelism"))
+        {
+            TrackingOptions.MaxParallelism = std::strtoull(
+                Options["Parallelism"].c_str(),
+                nullptr,
+                10);
+        }
+
+        std::chrono::steady_clock::time_point StartTime =
+            std::chrono::steady_clock::now();
+
+        std::unique_ptr<NanaBox::VirtualDiskImage> Current =
+            NanaBox::OpenVirtualDiskChain(Values[0], false);
+        std::unique_ptr<NanaBox::VirtualDiskImage> Base;
+        std::vector<NanaBox::VirtualDiskChangedRange> Ranges;
+        NanaBox::VirtualDiskGuid BaseDataWriteGuid;
+        if (Values.size() == 1)
+        {
+            // The parent is the base of the differencing disk.
+            Ranges = NanaBox::GetDifferencingDiskChanges(*Current);
+            BaseDataWriteGuid =
+                Current->GetParent()->GetInformation().DataWriteGuid;
+        }
+        else
+        {
+            Base = NanaBox::OpenVirtualDiskChain(Values[1], false);
+            Ranges = NanaBox::CompareVirtualDiskImages(
+                *Base,
+                *Current,
+                TrackingOptions);
+            BaseDataWriteGuid = Base->GetInformation().DataWriteGuid;
+        }
+
+        double Seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - StartTime).count();
+
+        std::uint64_t VirtualSize = Current->GetInformation().VirtualSize;
+        std::uint64_t ChangedBytes = 0;
+        for (NanaBox::VirtualDiskChangedRange const& Range : Ranges)
+        {
+            ChangedBytes += Range.Length;
+        }
+        std::printf(
+            "Changed: %s in %zu ranges (%.2f%% of %s)\n",
+            NanaBox::FormatVirtualDiskSize(ChangedBytes).c_str(),
+            Ranges.size(),
+            VirtualSize ? 100.0 * ChangedBytes / VirtualSize : 0.0,
+            NanaBox::FormatVirtualDiskSize(VirtualSize).c_str());
+        std::printf(
+            "Time: %.3f s, %.2f GB/s of the virtual disk\n",
+            Seconds,
+            ::GetThroughput(VirtualSize, Seconds));
+
+        if (Options.count("Map"))
+        {
+            std::string Content;
+            for (NanaBox::VirtualDiskChangedRange const& Range : Ranges)
+            {
+                char Line[64];
+                std::snprintf(
+                    Line,
+                    sizeof(Line),
+                    "%llu %llu\n",
+                    static_cast<unsigned long long>(Range.Offset),
+                    static_cast<unsigned long long>(Range.Length));
+                Content += Line;
+            }
+            NanaBox::VirtualDiskFile File(Options["Map"], true, true);
+            File.Write(0, Content.data(), Content.size());
+            std::printf("Map: %s\n", Options["Map"].c_str());
+        }
+
+        if (Options.count("Delta"))
+        {
+            NanaBox::CreateVirtualDiskDelta(
+                *Current,
+                BaseDataWriteGuid,
+                Ranges,
+                Options["Delta"]);
+            std::printf("Delta: %s\n", Options["Delta"].c_str());
+        }
+
+        return 0;
+    }
+
+    int ApplyCommand(
+        std::vector<std::string> const& Arguments)
+    {
+        std::map<std::string, std::string> Options;
+        std::vector<std::string> Values;
+        ::ParseArguments(Arguments, Options, Values);
+        if (Values.size() != 2)
+        {
+            std::fprintf(stderr, "Usage: apply [--Force] <Delta> <Image>\n");
+            return 1;
+        }
+
+        std::unique_ptr<NanaBox::VirtualDiskImage> Target =
+            NanaBox::OpenVirtualDiskChain(Values[1], true);
+        NanaBox::ApplyVirtualDiskDelta(
+            *Target,
+            Values[0],
+            Options.count("Force"));
+        std::printf("The delta is applied.\n");
+        return 0;
+    }
+
+    // Fills the format from the extension of the path and the other options
+    // of the "--Name=Value" format, which are shared by the commands creating
+    // the images.
+    NanaBox::VirtualDiskCreateParameters GetCreateParameters(
+        std::map<std::string, std::string>& Options,
+        std::string const& Path)
+    {
+        NanaBox::VirtualDiskCreateParameters Parameters;
+
+        std::string Format = Options["Format"];
+        if (Format.empty())
+        {
+            std::string::size_type Dot = Path.rfind('.');
+            if (std::string::npos != Dot)
+            {
+                Format = Path.substr(Dot + 1);
+            }
+        }
+        Parameters.Format = ::IsSameText(Format, "vhd")
+            ? NanaBox::VirtualDiskFormat::Vhd
+            : NanaBox::VirtualDiskFormat::Vhdx;
+
+        if (Options.count("Parent"))
+        {
+            Parameters.Type = NanaBox::VirtualDiskType::Differencing;
+            Parameters.ParentPath = Options["Parent"];
+        }
+        else if (::IsSameText(Options["Type"], "Fixed"))
+        {
+            Parameters.Type = NanaBox::VirtualDiskType::Fixed;
+        }
+        if (Options.count("Size"))
+        {
+            Parameters.VirtualSize = std::strtoull(
+                Options["Size"].c_str(),
+                nullptr,
+                10) * 1024 * 1024;
+        }
+        if (Options.count("BlockSize"))
+        {
+            Parameters.BlockSize = static_cast<std::uint32_t>(
+                std::strtoul(Options["BlockSize"].c_str(), nullptr, 10) *
+                1024 * 1024);
+        }
+        if (Options.count("LogicalSectorSize"))
+        {
+            Parameters.LogicalSectorSize = static_cast<std::uint32_t>(
+                std::strtoul(
+                    Options["LogicalSectorSize"].c_str(),
+                    nullptr,
+                    10));
+        }
+        if (Options.count("PhysicalSectorSize"))
+        {
+            Parameters.PhysicalSectorSize = static_cast<std::uint32_t>(
+                std::strtoul(
+                    Options["PhysicalSectorSize"].c_str(),
+                    nullptr,
+                    10));
+        }
+        Parameters.SkipZeroing = Options.count("SkipZeroing");
+
+        return Parameters;
+    }
+
+    int CreateCommand(
+        std::vector<std::string> const& Arguments)
+    {
+        std::map<std::string, std::string> Options;
+        std::vector<std::string> Values;
+        ::ParseArguments(Arguments, Options, Values);
+        if (Values.size() != 1 ||
+            (!Options.count("Size") && !Options.count("Parent")))
+        {
+            std::fprintf(
+                stderr,
+                "Usage: create [--Format=VHD|VHDX] [--Type=Fixed|Dynamic] "
+                "[--Size=MiB] [--BlockSize=MiB] [--LogicalSectorSize=Bytes] "
+                "[--PhysicalSectorSize=Bytes] [--Parent=Path] [--SkipZeroing] "
+                "<Image>\n");
+            return 1;
+        }
+
+        std::chrono::steady_clock::time_point StartTime =
+            std::chrono::steady_clock::now();
+        std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+            NanaBox::VirtualDiskImage::Create(
+                Values[0],
+                ::GetCreateParameters(Options, Values[0]));
+        double Seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - StartTime).count();
+
+        ::PrintImageInformation(*Image);
+        std::uint64_t VirtualSize = Image->GetInformation().VirtualSize;
+        std::printf(
+            "Creation Time: %.3f seconds (%.3f seconds per TiB)\n",
+            Seconds,
+            Seconds * (1ULL << 40) / VirtualSize);
+        return 0;
+    }
+
+    int ResizeCommand(
+        std::vector<std::string> const& Arguments)
+    {
+        std::map<std::string, std::string> Options;
+        std::vector<std::string> Values;
+        ::ParseArguments(Arguments, Options, Values);
+        if (Values.size() != 1 || !Options.count("Size"))
+        {
+            std::fprintf(stderr, "Usage: resize --Size=MiB <Image>\n");
+            return 1;
+        }
+
+        std::uint64_t VirtualSize = std::strtoull(
+            Options["Size"].c_str(),
+            nullptr,
+            10) * 1024 * 1024;
+        std::unique_ptr<NanaBox::VirtualDiskOperation> Operation =
+            NanaBox::StartResizeVirtualDiskOperation(Values[0], VirtualSize);
+        while (!Operation->Wait(100))
+        {
+            NanaBox::VirtualDiskOperationProgress Progress =
+                Operation->GetProgress();
+            if (Progress.TotalValue)
+            {
+                std::fprintf(
+                    stderr,
+                    "\rProgress: %.1f%%",
+                    100.0 * Progress.CompletedValue / Progress.TotalValue);
+            }
+        }
+        std::fprintf(stderr, "\r");
+
+        NanaBox::VirtualDiskOperationProgress Progress =
+            Operation->GetProgress();
+        if (NanaBox::VirtualDiskOperationState::Succeeded != Progress.State)
+        {
+            std::fprintf(stderr, "%s\n", Progress.ErrorMessage.c_str());
+            return 1;
+        }
+
+        std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+            NanaBox::VirtualDiskImage::Open(Values[0], false);
+        ::PrintImageInformation(*Image);
+        return 0;
+    }
+
+    int DedupCommand(
+        std::vector<std::string> const& Arguments)
+    {
+        std::map<std::string, std::string> Options;
+        std::vector<std::string> Values;
+        ::ParseArguments(Arguments, Options, Values);
+        if (Values.empty())
+        {
+            std::fprintf(
+                stderr,
+                "Usage: dedup [--ChunkSize=KiB] [--Parallelism=Count] "
+                "[--MaxMemory=MiB] [--TemporaryDirectory=Path] "
+                "<Configuration or Image>...\n");
+            return 1;
+        }
+
+        NanaBox::VirtualDiskDeduplicationOptions DeduplicationOptions;
+        if (Options.count("ChunkSize"))
+        {
+            DeduplicationOptions.ChunkSize = static_cast<std::uint32_t>(
+                std::strtoul(Options["ChunkSize"].c_str(), nullptr, 10) *
+                1024);
+        }
+        if (Options.count("Parallelism"))
+        {
+            DeduplicationOptions.MaxParallelism = std::strtoull(
+                Options["Parallelism"].c_str(),
+                nullptr,
+                10);
+        }
+        if (Options.count("MaxMemory"))
+        {
+            DeduplicationOptions.MaxIndexMemory = std::strtoull(
+                Options["MaxMemory"].c_str(),
+                nullptr,
+                10) * 1024 * 1024;
+        }
+        if (Options.count("TemporaryDirectory"))
+        {
+            DeduplicationOptions.TemporaryDirectory =
+                Options["TemporaryDirectory"];
+        }
+
+        // The virtual machine configurations are expanded to the virtual
+        // disks attached to them.
+        std::vector<std::string> ImagePaths;
+        for (std::string const& Value : Values)
+        {
+            std::string::size_type Dot = Value.rfind('.');
+            if (std::string::npos != Dot &&
+                ::IsSameText(Value.substr(Dot + 1), "7b"))
+            {
+                for (std::string const& Path
+                    : NanaBox::GetVirtualMachineDiskPaths(Value))
+                {
+                    ImagePaths.push_back(Path);
+                }
+            }
+            else
+            {
+                ImagePaths.push_back(Value);
+            }
+        }
+
+        NanaBox::VirtualDiskDeduplicationResult Result =
+            NanaBox::AnalyzeVirtualDiskDeduplication(
+                ImagePaths,
+                DeduplicationOptions);
+
+        for (NanaBox::VirtualDiskDeduplicationFile const& File : Result.Files)
+        {
+            std::printf("%s\n", File.Path.c_str());
+            std::printf(
+                "    Allocated: %s, Zero: %s, Not Fully Present: %s\n",
+                NanaBox::FormatVirtualDiskSize(File.AllocatedBytes).c_str(),
+                NanaBox::FormatVirtualDiskSize(File.ZeroBytes).c_str(),
+                NanaBox::FormatVirtualDiskSize(File.PartialBytes).c_str());
+            std::printf(
+                "    Shared With Other Files: %s, Duplicated Inside: %s\n",
+                NanaBox::FormatVirtualDiskSize(File.SharedBytes).c_str(),
+                NanaBox::FormatVirtualDiskSize(
+                    File.InternalDuplicateBytes).c_str());
+        }
+
+        std::printf(
+            "\nFiles: %zu, Chunk Size: %s\n",
+            Result.Files.size(),
+            NanaBox::FormatVirtualDiskSize(Result.ChunkSize).c_str());
+        std::printf(
+            "Allocated: %s, Hashed: %s, Zero: %s, Not Fully Present: %s\n",
+            NanaBox::FormatVirtualDiskSize(Result.AllocatedBytes).c_str(),
+            NanaBox::FormatVirtualDiskSize(Result.HashedBytes).c_str(),
+            NanaBox::FormatVirtualDiskSize(Result.ZeroBytes).c_str(),
+            NanaBox::FormatVirtualDiskSize(Result.PartialBytes).c_str());
+        std::printf(
+            "Unique: %s, Duplicate: %s (%.2f%% of the hashed data)\n",
+            NanaBox::FormatVirtualDiskSize(Result.UniqueBytes).c_str(),
+            NanaBox::FormatVirtualDiskSize(Result.DuplicateBytes).c_str(),
+            Result.HashedBytes
+                ? 100.0 * Result.DuplicateBytes / Result.HashedBytes
+                : 0.0);
+        std::printf(
+            "Scan: %.3f s, %.2f GB/s, Total: %.3f s, Spilled Runs: %zu\n",
+            Result.ScanSeconds,
+            ::GetThroughput(Result.AllocatedBytes, Result.ScanSeconds),
+            Result.TotalSeconds,
+            Result.SpilledRuns);
+        return 0;
+    }
+
+    void PrintReadAmplification(
+        const char* Title,
+        NanaBox::VirtualDiskReadAmplification const& Value)
+    {
+        std::printf(
+            "%s: %.3f images per read, %zu images in the chain\n",
+            Title,
+            Value.ReadAmplification,
+            Value.ChainDepth);
+        for (std::size_t i = 0; i < Value.ResolvedBytes.size(); ++i)
+        {
+            std::printf(
+                "    Level %zu: %s\n",
+                i,
+                NanaBox::FormatVirtualDiskSize(
+                    Value.ResolvedBytes[i]).c_str());
+        }
+    }
+
+    int MergeCommand(
+        std::vector<std::string> const& Arguments)
+    {
+        std::map<std::string, std::string> Options;
+        std::vector<std::string> Values;
+        ::ParseArguments(Arguments, Options, Values);
+        if (Values.size() != 1)
+        {
+            std::fprintf(
+                stderr,
+                "Usage: merge [--Target=Path] [--Parallelism=Count] "
+                "[--ChunkSize=KiB] [--KeepChild]\n"
+                "        [--AnalyzeOnly] <Image>\n");
+            return 1;
+        }
+
+        NanaBox::VirtualDiskMergeOptions MergeOptions;
+        MergeOptions.KeepChild = Options.count("KeepChild");
+        if (Options.count("Parallelism"))
+        {
+            MergeOptions.MaxParallelism = std::strtoull(
+                Options["Parallelism"].c_str(),
+                nullptr,
+                10);
+        }
+        if (Options.count("ChunkSize"))
+        {
+            MergeOptions.ChunkSize = std::strtoull(
+                Options["ChunkSize"].c_str(),
+                nullptr,
+                10) * 1024;
+        }
+
+        if (Options.count("AnalyzeOnly"))
+        {
+            std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+                NanaBox::OpenVirtualDiskChain(Values[0], false);
+            std::chrono::steady_clock::time_point StartTime =
+                std::chrono::steady_clock::now();
+            NanaBox::VirtualDiskReadAmplification Result =
+                NanaBox::AnalyzeVirtualDiskReadAmplification(
+                    *Image,
+                    MergeOptions.MaxParallelism);
+            ::PrintReadAmplification("Read Amplification", Result);
+            std::printf(
+                "Analysis: %.3f s\n",
+                std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - StartTime).count());
+            return 0;
+        }
+
+        NanaBox::VirtualDiskMergeResult Result = Options.count("Target")
+            ? NanaBox::MergeVirtualDiskChain(
+                Values[0],
+                Options["Target"],
+                MergeOptions)
+            : NanaBox::MergeVirtualDiskIntoParent(
+                Values[0],
+                MergeOptions);
+
+        std::printf("Target: %s\n", Result.TargetPath.c_str());
+        std::printf(
+            "Present: %s, Copied: %s, Skipped Zero: %s\n",
+            NanaBox::FormatVirtualDiskSize(Result.PresentBytes).c_str(),
+            NanaBox::FormatVirtualDiskSize(Result.CopiedBytes).c_str(),
+            NanaBox::FormatVirtualDiskSize(Result.SkippedZeroBytes).c_str());
+        ::PrintReadAmplification("Before", Result.Before);
+        ::PrintReadAmplification("After", Result.After);
+        std::printf(
+            "Total: %.3f s, %.2f GB/s\n",
+            Result.Seconds,
+            ::GetThroughput(Result.PresentBytes, Result.Seconds));
+        return 0;
+    }
+
+    std::vector<std::size_t> ParseCountList(
+        std::string const& Value)
+    {
+        std::vector<std::size_t> Result;
+        std::string::size_type Start = 0;
+        while (Start <= Value.size())
+        {
+            std::string::size_type End = Value.find(',', Start);
+            if (std::string::npos == End)
+            {
+                End = Value.size();
+            }
+            std::size_t Count = static_cast<std::size_t>(std::strtoull(
+                Value.substr(Start, End - Start).c_str(),
+                nullptr,
+                10));
+            if (Count)
+            {
+                Result.push_back(Count);
+            }
+            Start = End + 1;
+        }
+        return Result;
+    }
+
+    struct BenchmarkLayoutItem
+    {
+        const char* Name;
+        NanaBox::VirtualDiskFormat Format;
+        NanaBox::VirtualDiskType Type;
+        std::uint32_t BlockSize;
+        std::uint32_t LogicalSectorSize;
+        std::uint32_t PhysicalSectorSize;
+    };
+
+    void FillBenchmarkImage(
+        NanaBox::VirtualDiskImage& Image,
+        std::uint64_t Range,
+        std::uint64_t Seed)
+    {
+        const std::size_t BufferSize = 1024 * 1024;
+
+        NanaBox::VirtualDiskBuffer Buffer(BufferSize);
+        std::mt19937_64 Generator(Seed);
+        for (std::size_t i = 0; i < BufferSize; ++i)
+        {
+            Buffer.GetData()[i] = static_cast<std::uint8_t>(Generator());
+        }
+        for (std::uint64_t Offset = 0; Offset < Range; Offset += BufferSize)
+        {
+            Image.Write(
+                Offset,
+                Buffer.GetData(),
+                static_cast<std::size_t>(
+                    std::min<std::uint64_t>(BufferSize, Range - Offset)));
+        }
+        Image.Flush();
+    }
+
+    std::vector<NanaBox::VirtualDiskBenchmarkResult> RunBenchmarkWorkloads(
+        NanaBox::VirtualDiskImage& Image,
+        std::vector<NanaBox::VirtualDiskBenchmarkOptions> const& Workloads,
+        std::vector<std::size_t> const& QueueDepths,
+        bool Prefill)
+    {
+        NanaBox::VirtualDiskInformation const& Information =
+            Image.GetInformation();
+
+        std::printf(
+            "Image: %s (%s %s, %s blocks, %u/%u sectors, %s)\n",
+            Image.GetPath().c_str(),
+            ::GetFormatName(Information.Format),
+            ::GetTypeName(Information.Type),
+            NanaBox::FormatVirtualDiskSize(Information.BlockSize).c_str(),
+            Information.LogicalSectorSize,
+            Information.PhysicalSectorSize,
+            Image.GetFile().IsUnbuffered() ? "unbuffered" : "buffered");
+
+        // Writes the whole range once, so the blocks are allocated before the
+        // measurement and the results are the steady state of the layout.
+        if (Prefill && !Workloads.empty())
+        {
+            std::uint64_t Range = Workloads.front().Range
+                ? std::min(Workloads.front().Range, Information.VirtualSize)
+                : Information.VirtualSize;
+            Range = Range / Information.LogicalSectorSize *
+                Information.LogicalSectorSize;
+            ::FillBenchmarkImage(Image, Range, Workloads.front().Seed);
+            std::printf(
+                "Prefilled: %s\n",
+                NanaBox::FormatVirtualDiskSize(Range).c_str());
+        }
+
+        std::printf(
+            "\n%-16s %6s %4s %5s %11s %10s %10s %10s %10s %10s\n",
+            "Workload",
+            "I/O",
+            "Read",
+            "QD",
+            "IOPS",
+            "MB/s",
+            "Avg us",
+            "P50 us",
+            "P99 us",
+            "P99.9 us");
+
+        std::vector<NanaBox::VirtualDiskBenchmarkResult> Results;
+        for (NanaBox::VirtualDiskBenchmarkOptions Workload : Workloads)
+        {
+            for (std::size_t QueueDepth : QueueDepths)
+            {
+                Workload.QueueDepth = QueueDepth;
+                NanaBox::VirtualDiskBenchmarkResult Result =
+                    NanaBox::RunVirtualDiskBenchmark(Image, Workload);
+                std::printf(
+                    "%-16s %6s %3u%% %5zu %11.0f %10.1f %10.1f %10.1f "
+                    "%10.1f %10.1f\n",
+                    NanaBox::VirtualDiskBenchmarkPattern::Random ==
+                        Workload.Pattern ? "Random" : "Sequential",
+                    NanaBox::FormatVirtualDiskSize(Workload.IoSize).c_str(),
+                    Workload.ReadPercentage,
+                    QueueDepth,
+                    Result.Iops,
+                    Result.BytesPerSecond / 1e6,
+                    Result.Latency.AverageMicroseconds,
+                    Result.Latency.P50Microseconds,
+                    Result.Latency.P99Microseconds,
+                    Result.Latency.P999Microseconds);
+                std::fflush(stdout);
+                Results.push_back(Result);
+            }
+        }
+        return Results;
+    }
+
+    // Creates each layout in the directory, runs the workloads against it and
+    // removes it, and returns the JSON documents of the layouts.
+    std::vector<std::string> RunLayoutBenchmark(
+        std::string const& Directory,
+        std::uint64_t VirtualSize,
+        bool Unbuffered,
+        std::vector<NanaBox::VirtualDiskBenchmarkOptions> const& Workloads,
+        std::vector<std::size_t> const& QueueDepths,
+        bool Prefill)
+    {
+        const BenchmarkLayoutItem Layouts[] =
+        {
+            {
+                "VHDX Dynamic 1 MiB 512/4096",
+                NanaBox::VirtualDiskFormat::Vhdx,
+                NanaBox::VirtualDiskType::Dynamic,
+                1 * 1024 * 1024,
+                512,
+                4096
+            },
+            {
+                "VHDX Dynamic 32 MiB 512/4096",
+                NanaBox::VirtualDiskFormat::Vhdx,
+                NanaBox::VirtualDiskType::Dynamic,
+                32 * 1024 * 1024,
+                512,
+                4096
+            },
+            {
+                "VHDX Dynamic 32 MiB 4096/4096",
+                NanaBox::VirtualDiskFormat::Vhdx,
+                NanaBox::VirtualDiskType::Dynamic,
+                32 * 1024 * 1024,
+                4096,
+                4096
+            },
+            {
+                "VHDX Fixed 4096/4096",
+                NanaBox::VirtualDiskFormat::Vhdx,
+                NanaBox::VirtualDiskType::Fixed,
+                32 * 1024 * 1024,
+                4096,
+                4096
+            },
+            {
+                "VHDX Differencing 2 MiB",
+                NanaBox::VirtualDiskFormat::Vhdx,
+                NanaBox::VirtualDiskType::Differencing,
+                2 * 1024 * 1024,
+                512,
+                4096
+            },
+            {
+                "VHD Dynamic 512 KiB",
+                NanaBox::VirtualDiskFormat::Vhd,
+                NanaBox::VirtualDiskType::Dynamic,
+                512 * 1024,
+                512,
+                512
+            },
+            {
+                "VHD Fixed",
+                NanaBox::VirtualDiskFormat::Vhd,
+                NanaBox::VirtualDiskType::Fixed,
+                0,
+                512,
+                512
+            },
+        };
+
+        std::vector<std::string> Documents;
+        for (BenchmarkLayoutItem const& Layout : Layouts)
+        {
+            std::string Extension =
+                NanaBox::VirtualDiskFormat::Vhdx == Layout.Format
+                ? ".vhdx"
+                : ".vhd";
+            std::string Path = Directory + "/NanaBox.Benchmark" + Extension;
+            std::string ParentPath =
+                Directory + "/NanaBox.Benchmark.Parent" + Extension;
+            NanaBox::RemoveVirtualDiskFile(Path);
+            NanaBox::RemoveVirtualDiskFile(ParentPath);
+
+            try
+            {
+                NanaBox::VirtualDiskCreateParameters Parameters;
+                Parameters.Format = Layout.Format;
+                Parameters.Type = Layout.Type;
+                Parameters.VirtualSize = VirtualSize;
+                Parameters.BlockSize = Layout.BlockSize;
+                Parameters.LogicalSectorSize = Layout.LogicalSectorSize;
+                Parameters.PhysicalSectorSize = Layout.PhysicalSectorSize;
+
+                // The parent of the differencing disk has the content, so the
+                // reads of the unwritten ranges go through the chain.
+                if (NanaBox::VirtualDiskType::Differencing == Layout.Type)
+                {
+                    NanaBox::VirtualDiskCreateParameters ParentParameters =
+                        Parameters;
+                    ParentParameters.Type = NanaBox::VirtualDiskType::Dynamic;
+                    ParentParameters.BlockSize = 0;
+                    ::FillBenchmarkImage(
+                        *NanaBox::VirtualDiskImage::Create(
+                            ParentPath,
+                            ParentParameters),
+                        VirtualSize,
+                        Workloads.empty() ? 0 : Workloads.front().Seed);
+                    Parameters.ParentPath = ParentPath;
+                }
+
+                NanaBox::VirtualDiskImage::Create(Path, Parameters).reset();
+
+                std::printf("\nLayout: %s\n", Layout.Name);
+                std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+                    NanaBox::OpenVirtualDiskChain(Path, true, Unbuffered);
+                std::vector<NanaBox::VirtualDiskBenchmarkResult> Results =
+                    ::RunBenchmarkWorkloads(
+                        *Image,
+                        Workloads,
+                        QueueDepths,
+                        Prefill);
+                std::printf(
+                    "File Size: %s\n",
+                    NanaBox::FormatVirtualDiskSize(
+                        Image->GetFile().GetSize()).c_str());
+                Documents.push_back(
+                    NanaBox::FormatVirtualDiskBenchmarkJson(*Image, Results));
+            }
+            catch (...)
+            {
+                NanaBox::RemoveVirtualDiskFile(Path);
+                NanaBox::RemoveVirtualDiskFile(ParentPath);
+                throw;
+            }
+
+            NanaBox::RemoveVirtualDiskFile(Path);
+            NanaBox::RemoveVirtualDiskFile(ParentPath);
+        }
+        return Documents;
+    }
+
+    int BenchmarkCommand(
+        std::vector<std::string> const& Arguments)
+    {
+        std::map<std::string, std::string> Options;
+        std::vector<std::string> Values;
+        ::ParseArguments(Arguments, Options, Values);
+        if (Values.size() != 1)
+        {
+            std::fprintf(
+                stderr,
+                "Usage: benchmark [--Pattern=Random|Sequential] "
+                "[--IoSize=KiB] [--ReadPercentage=Percent] "
+                "[--QueueDepth=Count[,Count...]] [--Seconds=Seconds] "
+                "[--WarmUp=Seconds] [--Range=MiB] [--FlushInterval=Count] "
+                "[--Prefill] [--ReadOnly] [--Buffered] [--Output=Path] "
+                "<Image>\n"
+                "       benchmark --Layouts [--Size=MiB] [Options] "
+                "<Directory>\n");
+            return 1;
+        }
+
+        const std::uint64_t KiB = 1024;
+        const std::uint64_t MiB = 1024 * 1024;
+
+        NanaBox::VirtualDiskBenchmarkOptions Template;
+        if (Options.count("Seconds"))
+        {
+            Template.Seconds = std::strtod(Options["Seconds"].c_str(), nullptr);
+        }
+        if (Options.count("WarmUp"))
+        {
+            Template.WarmUpSeconds =
+                std::strtod(Options["WarmUp"].c_str(), nullptr);
+        }
+        if (Options.count("Range"))
+        {
+            Template.Range = std::strtoull(
+                Options["Range"].c_str(),
+                nullptr,
+                10) * MiB;
+        }
+        if (Options.count("FlushInterval"))
+        {
+            Template.FlushInterval = static_cast<std::uint32_t>(std::strtoul(
+                Options["FlushInterval"].c_str(),
+                nullptr,
+                10));
+        }
+
+        std::vector<NanaBox::VirtualDiskBenchmarkOptions> Workloads;
+        if (Options.count("Pattern") ||
+            Options.count("IoSize") ||
+            Options.count("ReadPercentage"))
+        {
+            NanaBox::VirtualDiskBenchmarkOptions Workload = Template;
+            if (Options.count("Pattern"))
+            {
+                if (::IsSameText(Options["Pattern"], "Sequential"))
+                {
+                    Workload.Pattern =
+                        NanaBox::VirtualDiskBenchmarkPattern::Sequential;
+                }
+                else if (!::IsSameText(Options["Pattern"], "Random"))
+                {
+                    std::fprintf(stderr, "Unknown pattern.\n");
+                    return 1;
+                }
+            }
+            if (Options.count("IoSize"))
+            {
+                Workload.IoSize = static_cast<std::uint32_t>(std::strtoul(
+                    Options["IoSize"].c_str(),
+                    nullptr,
+                    10) * KiB);
+            }
+            if (Options.count("ReadPercentage"))
+            {
+                Workload.ReadPercentage =
+                    static_cast<std::uint32_t>(std::strtoul(
+                        Options["ReadPercentage"].c_str(),
+                        nullptr,
+                        10));
+            }
+            Workloads.push_back(Workload);
+        }
+        else
+        {
+            // The random 4 KiB reads, writes and 70/30 mix, and the 1 MiB
+            // sequential reads and writes.
+            const struct
+            {
+                NanaBox::VirtualDiskBenchmarkPattern Pattern;
+                std::uint32_t IoSize;
+                std::uint32_t ReadPercentage;
+            } DefaultWorkloads[] =
+            {
+                { NanaBox::VirtualDiskBenchmarkPattern::Random, 4096, 100 },
+                { NanaBox::VirtualDiskBenchmarkPattern::Random, 4096, 0 },
+                { NanaBox::VirtualDiskBenchmarkPattern::Random, 4096, 70 },
+                { NanaBox::VirtualDiskBenchmarkPattern::Sequential, 1048576, 100 },
+                { NanaBox::VirtualDiskBenchmarkPattern::Sequential, 1048576, 0 },
+            };
+            for (auto const& Item : DefaultWorkloads)
+            {
+                if (Options.count("ReadOnly") && Item.ReadPercentage < 100)
+                {
+                    continue;
+                }
+                NanaBox::VirtualDiskBenchmarkOptions Workload = Template;
+                Workload.Pattern = Item.Pattern;
+                Workload.IoSize = Item.IoSize;
+                Workload.ReadPercentage = Item.ReadPercentage;
+                Workloads.push_back(Workload);
+            }
+        }
+
+        std::vector<std::size_t> QueueDepths = ::ParseCountList(
+            Options.count("QueueDepth") ? Options["QueueDepth"] : "1,32");
+        if (QueueDepths.empty())
+        {
+            std::fprintf(stderr, "Invalid queue depth.\n");
+            return 1;
+        }
+
+        bool Unbuffered = !Options.count("Buffered");
+        std::string Content;
+        if (Options.count("Layouts"))
+        {
+            std::uint64_t VirtualSize = 1024 * MiB;
+            if (Options.count("Size"))
+            {
+                VirtualSize = std::strtoull(
+                    Options["Size"].c_str(),
+                    nullptr,
+                    10) * MiB;
+            }
+            VirtualSize = std::max(VirtualSize / MiB * MiB, 16 * MiB);
+
+            std::vector<std::string> Documents = ::RunLayoutBenchmark(
+                Values[0],
+                VirtualSize,
+                Unbuffered,
+                Workloads,
+                QueueDepths,
+                Options.count("Prefill"));
+
+            // The documents of the layouts are indented as the elements.
+            Content = "[";
+            for (std::size_t i = 0; i < Documents.size(); ++i)
+            {
+                Content += i ? ",\n    " : "\n    ";
+                for (char Character : Documents[i].substr(
+                    0,
+                    Documents[i].size() - 1))
+                {
+                    Content += Character;
+                    if ('\n' == Character)
+                    {
+                        Content += "    ";
+                    }
+                }
+            }
+            Content += Documents.empty() ? "]\n" : "\n]\n";
+        }
+        else
+        {
+            std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+                NanaBox::OpenVirtualDiskChain(
+                    Values[0],
+                    !Options.count("ReadOnly"),
+                    Unbuffered);
+            std::vector<NanaBox::VirtualDiskBenchmarkResult> Results =
+                ::RunBenchmarkWorkloads(
+                    *Image,
+                    Workloads,
+                    QueueDepths,
+                    Options.count("Prefill"));
+            Content = NanaBox::FormatVirtualDiskBenchmarkJson(*Image, Results);
+        }
+
+        if (Options.count("Output"))
+        {
+            NanaBox::RemoveVirtualDiskFile(Options["Output"]);
+            NanaBox::VirtualDiskFile File(Options["Output"], true, true);
+            File.Write(0, Content.data(), Content.size());
+            std::printf("\nOutput: %s\n", Options["Output"].c_str());
+        }
+        return 0;
+    }
+
+    struct CommandItem
+    {
+        const char* Name;
+        const char* Usage;
+        std::function<int(std::vector<std::string> const&)> Handler;
+    };
+
+    const CommandItem g_Commands[] =
+    {
+        {
+            "info",
+            "info <Image>\n"
+            "    Shows the layout, the allocation and the parent chain.",
+            ::InfoCommand
+        },
+        {
+            "replay",
+            "replay <Image>\n"
+            "    Replays the pending log of the VHDX image.",
+            ::ReplayCommand
+        },
+        {
+            "compact",
+            "compact [--ScanOnly] [--Parallelism=Count] [--ChunkSize=KiB] "
+            "<Image>\n"
+            "    Unmaps the zero blocks of a dynamic or differencing VHDX, moves\n"
+            "    the blocks at the end into the freed space and truncates the\n"
+            "    file. The scan only mode reports the result and the scan\n"
+            "    throughput without modifying the image.",
+            ::CompactCommand
+        },
+        {
+            "convert",
+            "convert [--Format=VHD|VHDX] [--Type=Fixed|Dynamic] "
+            "[--BlockSize=MiB]\n"
+            "        [--BufferSize=MiB] [--QueueDepth=Count] <Source> <Target>\n"
+            "    Copies the present blocks of the image and its parents to a new\n"
+            "    image, which also converts the format, the type and the block\n"
+            "    size. The format defaults to the extension of the target.",
+            ::ConvertCommand
+        },
+        {
+            "changes",
+            "changes [--Granularity=KiB] [--Parallelism=Count] [--Map=Path] "
+            "[--Delta=Path]\n"
+            "        <Current> [Base]\n"
+            "    Finds the ranges changed since the base, which is the parent if\n"
+            "    it is omitted, and writes the changed block map and the delta.",
+            ::ChangesCommand
+        },
+        {
+            "apply",
+            "apply [--Force] <Delta> <Image>\n"
+            "    Writes the changed ranges in the delta to the base image.",
+            ::ApplyCommand
+        },
+        {
+            "create",
+            "create [--Format=VHD|VHDX] [--Type=Fixed|Dynamic] [--Size=MiB] "
+            "[--BlockSize=MiB]\n"
+            "        [--LogicalSectorSize=Bytes] [--PhysicalSectorSize=Bytes] "
+            "[--Parent=Path]\n"
+            "        [--SkipZeroing] <Image>\n"
+            "    Creates a new image, which is a differencing disk if the parent\n"
+            "    is specified. The format defaults to the extension. The payload\n"
+            "    of the fixed disks is preallocated instead of being written, and\n"
+            "    --SkipZeroing exposes the stale content of the volume on Windows.",
+            ::CreateCommand
+        },
+        {
+            "resize",
+            "resize --Size=MiB <Image>\n"
+            "    Expands a VHDX which is not a differencing disk. The BAT is\n"
+            "    moved to the end of the file if it needs more space.",
+            ::ResizeCommand
+        },
+        {
+            "dedup",
+            "dedup [--ChunkSize=KiB] [--Parallelism=Count] [--MaxMemory=MiB]\n"
+            "        [--TemporaryDirectory=Path] <Configuration or Image>...\n"
+            "    Hashes the payload of the images and their parents, or the\n"
+            "    virtual disks of the .7b files, and reports the duplicate data\n"
+            "    which can be saved by moving it to the shared parents.",
+            ::DedupCommand
+        },
+        {
+            "merge",
+            "merge [--Target=Path] [--Parallelism=Count] [--ChunkSize=KiB] "
+            "[--KeepChild]\n"
+            "        [--AnalyzeOnly] <Image>\n"
+            "    Merges the differencing disk into its parent, or the whole chain\n"
+            "    into a new image if the target is specified, and reports the\n"
+            "    read amplification of the chain before and after.",
+            ::MergeCommand
+        },
+        {
+            "benchmark",
+            "benchmark [--Pattern=Random|Sequential] [--IoSize=KiB] "
+            "[--ReadPercentage=Percent]\n"
+            "        [--QueueDepth=Count[,Count...]] [--Seconds=Seconds] "
+            "[--WarmUp=Seconds]\n"
+            "        [--Range=MiB] [--FlushInterval=Count] [--Prefill] "
+            "[--ReadOnly]\n"
+            "        [--Buffered] [--Output=Path] <Image>\n"
+            "    benchmark --Layouts [--Size=MiB] [Options] <Directory>\n"
+            "    Runs the random and sequential read and write mixes against the\n"
+            "    image at the queue depths, and reports the IOPS, the throughput\n"
+            "    and the latency percentiles, which are also saved as JSON. The\n"
+            "    I/O bypasses the cache of the system unless it is buffered. The\n"
+            "    layouts mode creates the images with the different formats,\n"
+            "    types, block sizes and sector sizes in the directory one by one\n"
+            "    and compares them.",
+            ::BenchmarkCommand
+        },
+    };
+
+    void PrintUsage()
+    {
+        std::fprintf(
+            stderr,
+            "NanaBox Virtual Disk Tool\n"
+            "\n"
+            "Usage: NanaBox.VirtualDiskTool <Command> [Arguments]\n"
+            "\n"
+            "Commands:\n"
+            "\n");
+        for (CommandItem const& Command : g_Commands)
+        {
+            std::fprintf(stderr, "%s\n\n", Command.Usage);
+        }
+    }
+}
+
+namespace
+{
+    int Main(
+        std::vector<std::string> const& CommandLine)
+    {
+        if (CommandLine.empty())
+        {
+            ::PrintUsage();
+            return 1;
+        }
+
+        std::vector<std::string> Arguments(
+            CommandLine.begin() + 1,
+            CommandLine.end());
+        for (CommandItem const& Command : g_Commands)
+        {
+            if (CommandLine[0] != Command.Name)
+            {
+                continue;
+            }
+
+            try
+            {
+                return Command.Handler(Arguments);
+            }
+            catch (std::exception const& Exception)
+            {
+                std::fprintf(stderr, "Error: %s\n", Exception.what());
+                return 1;
+            }
+        }
+
+        ::PrintUsage();
+        return 1;
+    }
+}
+
+#ifdef _WIN32
+int wmain(int argc, wchar_t* argv[])
+{
+    // The library uses the UTF-8 paths.
+    std::vector<std::string> CommandLine;
+    for (int i = 1; i < argc; ++i)
+    {
+        int Length = ::WideCharToMultiByte(
+            CP_UTF8,
+            0,
+            argv[i],
+            -1,
+            nullptr,
+            0,
+            nullptr,
+            nullptr);
+        std::string Argument(Length > 0 ? Length - 1 : 0, '\0');
+        if (!Argument.empty())
+        {
+            ::WideCharToMultiByte(
+                CP_UTF8,
+                0,
+                argv[i],
+                -1,
+                &Argument[0],
+                Length,
+                nullptr,
+                nullptr);
+        }
+        CommandLine.push_back(Argument);
+    }
+    return ::Main(CommandLine);
+}
+#else
+int main(int argc, char* argv[])
+{
+    return ::Main(std::vector<std::string>(argv + 1, argv + argc));
+}
+#endif
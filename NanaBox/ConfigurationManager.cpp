@@ -14,6 +14,9 @@
 
 #include <Mile.Helpers.Base.h>
 
+#include <algorithm>
+#include <cctype>
+
 namespace NanaBox
 {
     namespace ResolutionType
@@ -55,6 +58,100 @@ namespace NanaBox
         { NanaBox::ScsiDeviceType::VirtualImage, "VirtualImage" },
         { NanaBox::ScsiDeviceType::PhysicalDevice, "PhysicalDevice" }
     })
+
+    NLOHMANN_JSON_SERIALIZE_ENUM(NanaBox::PerformancePreset, {
+        { NanaBox::PerformancePreset::Default, "Default" },
+        { NanaBox::PerformancePreset::LowLatency, "LowLatency" },
+        { NanaBox::PerformancePreset::LowBandwidth, "LowBandwidth" },
+        { NanaBox::PerformancePreset::HighFidelity, "HighFidelity" }
+    })
+}
+
+namespace
+{
+    NanaBox::PerformanceProfileConfiguration GetPerformancePresetSettings(
+        NanaBox::PerformancePreset Preset)
+    {
+        NanaBox::PerformanceProfileConfiguration Result;
+        Result.Preset = Preset;
+
+        switch (Preset)
+        {
+        case NanaBox::PerformancePreset::LowLatency:
+        {
+            // The session runs over the local pipe, so the compression and
+            // the visual effects only cost the time to encode the frames.
+            Result.ColorDepth = 32;
+            Result.BitmapPersistence = false;
+            Result.Compression = false;
+            Result.InputSendInterval = 5;
+            Result.VisualEffects = false;
+            Result.FontSmoothing = true;
+            Result.DesktopComposition = false;
+            Result.HardwareAcceleration = true;
+            break;
+        }
+        case NanaBox::PerformancePreset::LowBandwidth:
+        {
+            Result.ColorDepth = 16;
+            Result.BitmapCacheSize = 32;
+            Result.BitmapPersistence = true;
+            Result.Compression = true;
+            Result.InputSendInterval = 50;
+            Result.VisualEffects = false;
+            Result.FontSmoothing = false;
+            Result.DesktopComposition = false;
+            Result.HardwareAcceleration = true;
+            break;
+        }
+        case NanaBox::PerformancePreset::HighFidelity:
+        {
+            Result.ColorDepth = 32;
+            Result.BitmapCacheSize = 32;
+            Result.BitmapPersistence = true;
+            Result.Compression = true;
+            Result.InputSendInterval = 20;
+            Result.VisualEffects = true;
+            Result.FontSmoothing = true;
+            Result.DesktopComposition = true;
+            Result.HardwareAcceleration = true;
+            break;
+        }
+        default:
+        {
+            // The color depth, the bitmap caches and the compression keep the
+            // defaults of the remote desktop client.
+            Result.InputSendInterval = 20;
+            Result.VisualEffects = true;
+            Result.FontSmoothing = true;
+            Result.DesktopComposition = true;
+            Result.HardwareAcceleration = true;
+            break;
+        }
+        }
+
+        return Result;
+    }
+
+    std::optional<bool> ToOptionalBoolean(
+        nlohmann::json const& Value)
+    {
+        if (Value.is_null())
+        {
+            return std::nullopt;
+        }
+        return Mile::Json::ToBoolean(Value);
+    }
+
+    std::optional<std::uint32_t> ToOptionalUInt32(
+        nlohmann::json const& Value)
+    {
+        if (Value.is_null())
+        {
+            return std::nullopt;
+        }
+        return static_cast<std::uint32_t>(Mile::Json::ToUInt64(Value));
+    }
 }
 
 nlohmann::json NanaBox::MakeHcsComPortConfiguration(
@@ -456,6 +553,95 @@ void NanaBox::ComputeNetworkDeleteEndpoint(
     }
 }
 
+bool NanaBox::ComputeNetworkCheckEndpoint(
+    std::string const& Owner,
+    NanaBox::NetworkAdapterConfiguration const& Configuration)
+{
+    if (Configuration.EndpointId.empty() || Configuration.MacAddress.empty())
+    {
+        return false;
+    }
+
+    try
+    {
+        NanaBox::HcnEndpoint EndpointHandle = NanaBox::HcnOpenEndpoint(
+            winrt::guid(Configuration.EndpointId));
+
+        nlohmann::json Properties = nlohmann::json::parse(winrt::to_string(
+            NanaBox::HcnQueryEndpointProperties(EndpointHandle)));
+
+        // The Host Network Service may use either hyphens or colons in the
+        // MAC address, and either case in the identifiers.
+        auto Normalize = [](std::string const& Value) -> std::string
+        {
+            std::string Result;
+            for (char const& Character : Value)
+            {
+                if (Character != '-' && Character != ':' &&
+                    Character != '{' && Character != '}')
+                {
+                    Result.push_back(static_cast<char>(
+                        std::toupper(static_cast<unsigned char>(Character))));
+                }
+            }
+            return Result;
+        };
+
+        if (Normalize(Mile::Json::ToString(
+            Mile::Json::GetSubKey(Properties, "MacAddress"))) !=
+            Normalize(Configuration.MacAddress))
+        {
+            return false;
+        }
+
+        if (Normalize(Mile::Json::ToString(
+            Mile::Json::GetSubKey(Properties, "HostComputeNetwork"))) !=
+            Normalize(winrt::to_string(::FromGuid(NanaBox::DefaultSwitchId))))
+        {
+            return false;
+        }
+
+        std::string EndpointOwner = Mile::Json::ToString(
+            Mile::Json::GetSubKey(Properties, "Owner"));
+        if (!EndpointOwner.empty() && EndpointOwner != Owner)
+        {
+            return false;
+        }
+
+        // No policy is applied when creating the endpoint, so any policy means
+        // the endpoint has been changed by others.
+        if (!Mile::Json::ToArray(
+            Mile::Json::GetSubKey(Properties, "Policies")).empty())
+        {
+            return false;
+        }
+
+        return true;
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+void NanaBox::ComputeNetworkEnsureEndpoint(
+    std::string const& Owner,
+    NanaBox::NetworkAdapterConfiguration& Configuration)
+{
+    std::shared_ptr<NanaBox::VirtualMachineMetrics> Metrics =
+        NanaBox::GetVirtualMachineMetrics(Owner);
+
+    if (NanaBox::ComputeNetworkCheckEndpoint(Owner, Configuration))
+    {
+        ++Metrics->EndpointReuseHits;
+        return;
+    }
+
+    ++Metrics->EndpointReuseMisses;
+    NanaBox::ComputeNetworkDeleteEndpoint(Configuration);
+    NanaBox::ComputeNetworkCreateEndpoint(Owner, Configuration);
+}
+
 void NanaBox::ComputeSystemUpdateMemorySize(
     winrt::com_ptr<NanaBox::ComputeSystem> const& Instance,
     std::uint64_t const& MemorySize)
@@ -917,6 +1103,199 @@ void NanaBox::RemoteDesktopUpdateEnhancedSessionConfiguration(
     }
 }
 
+void NanaBox::RemoteDesktopUpdatePerformanceProfileConfiguration(
+    winrt::com_ptr<NanaBox::RdpClient> const& Instance,
+    NanaBox::PerformanceProfileConfiguration const& Configuration)
+{
+    NanaBox::PerformanceProfileConfiguration Settings =
+        ::GetPerformancePresetSettings(Configuration.Preset);
+    if (Configuration.ColorDepth)
+    {
+        Settings.ColorDepth = Configuration.ColorDepth;
+    }
+    if (Configuration.BitmapCacheSize)
+    {
+        Settings.BitmapCacheSize = Configuration.BitmapCacheSize;
+    }
+    if (Configuration.BitmapPersistence)
+    {
+        Settings.BitmapPersistence = Configuration.BitmapPersistence;
+    }
+    if (Configuration.Compression)
+    {
+        Settings.Compression = Configuration.Compression;
+    }
+    if (Configuration.InputSendInterval)
+    {
+        Settings.InputSendInterval = Configuration.InputSendInterval;
+    }
+    if (Configuration.VisualEffects)
+    {
+        Settings.VisualEffects = Configuration.VisualEffects;
+    }
+    if (Configuration.FontSmoothing)
+    {
+        Settings.FontSmoothing = Configuration.FontSmoothing;
+    }
+    if (Configuration.DesktopComposition)
+    {
+        Settings.DesktopComposition = Configuration.DesktopComposition;
+    }
+    if (Configuration.HardwareAcceleration)
+    {
+        Settings.HardwareAcceleration = Configuration.HardwareAcceleration;
+    }
+
+    // Most of the settings are only accepted before connecting, and the
+    // failures are ignored because they are applied when the client is
+    // connected next time.
+
+    if (Settings.ColorDepth)
+    {
+        try
+        {
+            Instance->ColorDepth(*Settings.ColorDepth);
+        }
+        catch (...)
+        {
+
+        }
+    }
+
+    if (Settings.BitmapCacheSize)
+    {
+        LONG Size = static_cast<LONG>(
+            std::clamp<std::uint32_t>(*Settings.BitmapCacheSize, 1, 32));
+
+        try
+        {
+            Instance->BitmapVirtualCacheSize(Size);
+        }
+        catch (...)
+        {
+
+        }
+
+        try
+        {
+            Instance->BitmapVirtualCache16BppSize(Size);
+        }
+        catch (...)
+        {
+
+        }
+
+        try
+        {
+            Instance->BitmapVirtualCache24BppSize(Size);
+        }
+        catch (...)
+        {
+
+        }
+
+        try
+        {
+            Instance->BitmapVirtualCache32BppSize(Size);
+        }
+        catch (...)
+        {
+
+        }
+    }
+
+    if (Settings.BitmapPersistence)
+    {
+        try
+        {
+            Instance->BitmapPersistence(*Settings.BitmapPersistence);
+        }
+        catch (...)
+        {
+
+        }
+    }
+
+    if (Settings.Compression)
+    {
+        try
+        {
+            Instance->Compress(*Settings.Compression);
+        }
+        catch (...)
+        {
+
+        }
+    }
+
+    // The input send interval is also accepted by the connected client.
+    if (Settings.InputSendInterval)
+    {
+        try
+        {
+            Instance->MinInputSendInterval(*Settings.InputSendInterval);
+        }
+        catch (...)
+        {
+
+        }
+    }
+
+    try
+    {
+        LONG PerformanceFlags = TS_PERF_ENABLE_ENHANCED_GRAPHICS;
+        if (Settings.FontSmoothing.value_or(true))
+        {
+            PerformanceFlags |= TS_PERF_ENABLE_FONT_SMOOTHING;
+        }
+        if (Settings.DesktopComposition.value_or(true))
+        {
+            PerformanceFlags |= TS_PERF_ENABLE_DESKTOP_COMPOSITION;
+        }
+        if (!Settings.VisualEffects.value_or(true))
+        {
+            PerformanceFlags |=
+                TS_PERF_DISABLE_WALLPAPER |
+                TS_PERF_DISABLE_FULLWINDOWDRAG |
+                TS_PERF_DISABLE_MENUANIMATIONS |
+                TS_PERF_DISABLE_THEMING |
+                TS_PERF_DISABLE_CURSOR_SHADOW;
+        }
+        Instance->PerformanceFlags(PerformanceFlags);
+    }
+    catch (...)
+    {
+
+    }
+
+    VARIANT HardwareAcceleration;
+    HardwareAcceleration.vt = VT_BOOL;
+    HardwareAcceleration.boolVal =
+        Settings.HardwareAcceleration.value_or(true)
+        ? VARIANT_TRUE
+        : VARIANT_FALSE;
+
+    try
+    {
+        Instance->Property(L"EnableHardwareMode", HardwareAcceleration);
+    }
+    catch (...)
+    {
+
+    }
+
+    try
+    {
+        Instance->Property(
+            L"EnableFrameBufferRedirection",
+            HardwareAcceleration);
+    }
+    catch (...)
+    {
+
+    }
+}
+
 void NanaBox::DeserializeKeyboardConfiguration(
     nlohmann::json const& Input,
     NanaBox::KeyboardConfiguration& Output)
@@ -1298,6 +1677,285 @@ nlohmann::json NanaBox::SerializeChipsetInformationConfiguration(
     return Output;
 }
 
+void NanaBox::DeserializeVideoMonitorConfiguration(
+    nlohmann::json const& Input,
+    NanaBox::VideoMonitorConfiguration& Output)
+{
+    nlohmann::json PerformanceProfile =
+        Mile::Json::GetSubKey(Input, "PerformanceProfile");
+
+    try
+    {
+        Output.PerformanceProfile.Preset = PerformanceProfile.at(
+            "Preset").get<NanaBox::PerformancePreset>();
+    }
+    catch (...)
+    {
+
+    }
+
+    Output.PerformanceProfile.ColorDepth = ::ToOptionalUInt32(
+        Mile::Json::GetSubKey(PerformanceProfile, "ColorDepth"));
+    if (Output.PerformanceProfile.ColorDepth)
+    {
+        std::uint32_t ColorDepth = *Output.PerformanceProfile.ColorDepth;
+        if (15 != ColorDepth &&
+            16 != ColorDepth &&
+            24 != ColorDepth &&
+            32 != ColorDepth)
+        {
+            Output.PerformanceProfile.ColorDepth = std::nullopt;
+        }
+    }
+
+    Output.PerformanceProfile.BitmapCacheSize = ::ToOptionalUInt32(
+        Mile::Json::GetSubKey(PerformanceProfile, "BitmapCacheSize"));
+
+    Output.PerformanceProfile.BitmapPersistence = ::ToOptionalBoolean(
+        Mile::Json::GetSubKey(PerformanceProfile, "BitmapPersistence"));
+
+    Output.PerformanceProfile.Compression = ::ToOptionalBoolean(
+        Mile::Json::GetSubKey(PerformanceProfile, "Compression"));
+
+    Output.PerformanceProfile.InputSendInterval = ::ToOptionalUInt32(
+        Mile::Json::GetSubKey(PerformanceProfile, "InputSendInterval"));
+
+    Output.PerformanceProfile.VisualEffects = ::ToOptionalBoolean(
+        Mile::Json::GetSubKey(PerformanceProfile, "VisualEffects"));
+
+    Output.PerformanceProfile.FontSmoothing = ::ToOptionalBoolean(
+        Mile::Json::GetSubKey(PerformanceProfile, "FontSmoothing"));
+
+    Output.PerformanceProfile.DesktopComposition = ::ToOptionalBoolean(
+        Mile::Json::GetSubKey(PerformanceProfile, "DesktopComposition"));
+
+    Output.PerformanceProfile.HardwareAcceleration = ::ToOptionalBoolean(
+        Mile::Json::GetSubKey(PerformanceProfile, "HardwareAcceleration"));
+}
+
+nlohmann::json NanaBox::SerializeVideoMonitorConfiguration(
+    NanaBox::VideoMonitorConfiguration const& Input)
+{
+    nlohmann::json Output;
+
+    nlohmann::json PerformanceProfile;
+    {
+        NanaBox::PerformanceProfileConfiguration const& Current =
+            Input.PerformanceProfile;
+
+        if (NanaBox::PerformancePreset::Default != Current.Preset)
+        {
+            PerformanceProfile["Preset"] = Current.Preset;
+        }
+
+        if (Current.ColorDepth)
+        {
+            PerformanceProfile["ColorDepth"] = *Current.ColorDepth;
+        }
+
+        if (Current.BitmapCacheSize)
+        {
+            PerformanceProfile["BitmapCacheSize"] = *Current.BitmapCacheSize;
+        }
+
+        if (Current.BitmapPersistence)
+        {
+            PerformanceProfile["BitmapPersistence"] =
+                *Current.BitmapPersistence;
+        }
+
+        if (Current.Compression)
+        {
+            PerformanceProfile["Compression"] = *Current.Compression;
+        }
+
+        if (Current.InputSendInterval)
+        {
+            PerformanceProfile["InputSendInterval"] =
+                *Current.InputSendInterval;
+        }
+
+        if (Current.VisualEffects)
+        {
+            PerformanceProfile["VisualEffects"] = *Current.VisualEffects;
+        }
+
+        if (Current.FontSmoothing)
+        {
+            PerformanceProfile["FontSmoothing"] = *Current.FontSmoothing;
+        }
+
+        if (Current.DesktopComposition)
+        {
+            PerformanceProfile["DesktopComposition"] =
+                *Current.DesktopComposition;
+        }
+
+        if (Current.HardwareAcceleration)
+        {
+            PerformanceProfile["HardwareAcceleration"] =
+                *Current.HardwareAcceleration;
+        }
+    }
+    if (!PerformanceProfile.empty())
+    {
+        Output["PerformanceProfile"] = PerformanceProfile;
+    }
+
+    return Output;
+}
+
+void NanaBox::DeserializeMetricsConfiguration(
+    nlohmann::json const& Input,
+    NanaBox::MetricsConfiguration& Output)
+{
+    Output.Enabled = Mile::Json::ToBoolean(
+        Mile::Json::GetSubKey(Input, "Enabled"),
+        Output.Enabled);
+
+    Output.File = Mile::Json::ToString(
+        Mile::Json::GetSubKey(Input, "File"),
+        Output.File);
+
+    Output.UpdateInterval = static_cast<std::uint32_t>(Mile::Json::ToUInt64(
+        Mile::Json::GetSubKey(Input, "UpdateInterval"),
+        Output.UpdateInterval));
+    if (!Output.UpdateInterval)
+    {
+        Output.UpdateInterval = 1;
+    }
+}
+
+nlohmann::json NanaBox::SerializeMetricsConfiguration(
+    NanaBox::MetricsConfiguration const& Input)
+{
+    nlohmann::json Output;
+
+    if (Input.Enabled)
+    {
+        Output["Enabled"] = true;
+    }
+
+    if (!Input.File.empty())
+    {
+        Output["File"] = Input.File;
+    }
+
+    if (15 != Input.UpdateInterval)
+    {
+        Output["UpdateInterval"] = Input.UpdateInterval;
+    }
+
+    return Output;
+}
+
+void NanaBox::DeserializeCheckpointConfiguration(
+    nlohmann::json const& Input,
+    NanaBox::CheckpointConfiguration& Output)
+{
+    Output.Name = Mile::Json::ToString(
+        Mile::Json::GetSubKey(Input, "Name"),
+        Output.Name);
+
+    Output.Parent = Mile::Json::ToString(
+        Mile::Json::GetSubKey(Input, "Parent"),
+        Output.Parent);
+
+    Output.CreationTime = Mile::Json::ToString(
+        Mile::Json::GetSubKey(Input, "CreationTime"),
+        Output.CreationTime);
+
+    for (nlohmann::json const& Disk : Mile::Json::ToArray(
+        Mile::Json::GetSubKey(Input, "Disks")))
+    {
+        Output.Disks.push_back(Mile::Json::ToString(Disk));
+    }
+
+    Output.GuestStateFile = Mile::Json::ToString(
+        Mile::Json::GetSubKey(Input, "GuestStateFile"),
+        Output.GuestStateFile);
+
+    Output.SaveStateFile = Mile::Json::ToString(
+        Mile::Json::GetSubKey(Input, "SaveStateFile"),
+        Output.SaveStateFile);
+}
+
+nlohmann::json NanaBox::SerializeCheckpointConfiguration(
+    NanaBox::CheckpointConfiguration const& Input)
+{
+    nlohmann::json Output;
+
+    Output["Name"] = Input.Name;
+
+    if (!Input.Parent.empty())
+    {
+        Output["Parent"] = Input.Parent;
+    }
+
+    if (!Input.CreationTime.empty())
+    {
+        Output["CreationTime"] = Input.CreationTime;
+    }
+
+    Output["Disks"] = Input.Disks;
+
+    if (!Input.GuestStateFile.empty())
+    {
+        Output["GuestStateFile"] = Input.GuestStateFile;
+    }
+
+    if (!Input.SaveStateFile.empty())
+    {
+        Output["SaveStateFile"] = Input.SaveStateFile;
+    }
+
+    return Output;
+}
+
+void NanaBox::DeserializePoolConfiguration(
+    nlohmann::json const& Input,
+    NanaBox::PoolConfiguration& Output)
+{
+    Output.Size = static_cast<std::uint32_t>(Mile::Json::ToUInt64(
+        Mile::Json::GetSubKey(Input, "Size"),
+        Output.Size));
+
+    Output.RefillConcurrency = static_cast<std::uint32_t>(Mile::Json::ToUInt64(
+        Mile::Json::GetSubKey(Input, "RefillConcurrency"),
+        Output.RefillConcurrency));
+    if (!Output.RefillConcurrency)
+    {
+        Output.RefillConcurrency = 1;
+    }
+
+    Output.WarmupTime = static_cast<std::uint32_t>(Mile::Json::ToUInt64(
+        Mile::Json::GetSubKey(Input, "WarmupTime"),
+        Output.WarmupTime));
+}
+
+nlohmann::json NanaBox::SerializePoolConfiguration(
+    NanaBox::PoolConfiguration const& Input)
+{
+    nlohmann::json Output;
+
+    if (Input.Size)
+    {
+        Output["Size"] = Input.Size;
+    }
+
+    if (1 != Input.RefillConcurrency)
+    {
+        Output["RefillConcurrency"] = Input.RefillConcurrency;
+    }
+
+    if (60 != Input.WarmupTime)
+    {
+        Output["WarmupTime"] = Input.WarmupTime;
+    }
+
+    return Output;
+}
+
 NanaBox::VirtualMachineConfiguration NanaBox::DeserializeConfiguration(
     std::string const& Configuration)
 {
@@ -1475,6 +2133,9 @@ NanaBox::VirtualMachineConfiguration NanaBox::DeserializeConfiguration(
         Current.Path = Mile::Json::ToString(
             Mile::Json::GetSubKey(ScsiDevice, "Path"),
             Current.Path);
+        Current.Size = Mile::Json::ToUInt64(
+            Mile::Json::GetSubKey(ScsiDevice, "Size"),
+            Current.Size);
         if (Current.Path.empty() &&
             Current.Type != NanaBox::ScsiDeviceType::VirtualImage)
         {
@@ -1508,6 +2169,10 @@ NanaBox::VirtualMachineConfiguration NanaBox::DeserializeConfiguration(
         Mile::Json::GetSubKey(RootJson, "ExposeVirtualizationExtensions"),
         Result.ExposeVirtualizationExtensions);
 
+    Result.SaveOnSessionEnd = Mile::Json::ToBoolean(
+        Mile::Json::GetSubKey(RootJson, "SaveOnSessionEnd"),
+        Result.SaveOnSessionEnd);
+
     NanaBox::DeserializeKeyboardConfiguration(
         Mile::Json::GetSubKey(RootJson, "Keyboard"),
         Result.Keyboard);
@@ -1520,6 +2185,49 @@ NanaBox::VirtualMachineConfiguration NanaBox::DeserializeConfiguration(
         Mile::Json::GetSubKey(RootJson, "ChipsetInformation"),
         Result.ChipsetInformation);
 
+    NanaBox::DeserializeMetricsConfiguration(
+        Mile::Json::GetSubKey(RootJson, "Metrics"),
+        Result.Metrics);
+
+    NanaBox::DeserializeVideoMonitorConfiguration(
+        Mile::Json::GetSubKey(RootJson, "VideoMonitor"),
+        Result.VideoMonitor);
+
+    for (nlohmann::json const& Dependency : Mile::Json::ToArray(
+        Mile::Json::GetSubKey(RootJson, "DependsOn")))
+    {
+        std::string Name = Mile::Json::ToString(Dependency);
+        if (!Name.empty())
+        {
+            Result.DependsOn.push_back(Name);
+        }
+    }
+
+    NanaBox::DeserializePoolConfiguration(
+        Mile::Json::GetSubKey(RootJson, "Pool"),
+        Result.Pool);
+
+    for (nlohmann::json const& Checkpoint : Mile::Json::ToArray(
+        Mile::Json::GetSubKey(RootJson, "Checkpoints")))
+    {
+        NanaBox::CheckpointConfiguration Current;
+        NanaBox::DeserializeCheckpointConfiguration(Checkpoint, Current);
+        if (!Current.Name.empty())
+        {
+            Result.Checkpoints.push_back(Current);
+        }
+    }
+
+    Result.CurrentCheckpoint = Mile::Json::ToString(
+        Mile::Json::GetSubKey(RootJson, "CurrentCheckpoint"),
+        Result.CurrentCheckpoint);
+
+    for (nlohmann::json const& Disk : Mile::Json::ToArray(
+        Mile::Json::GetSubKey(RootJson, "CurrentCheckpointDisks")))
+    {
+        Result.CurrentCheckpointDisks.push_back(Mile::Json::ToString(Disk));
+    }
+
     return Result;
 }
 
@@ -1608,6 +2316,10 @@ std::string NanaBox::SerializeConfiguration(
             {
                 Current["Path"] = ScsiDevice.Path;
             }
+            if (ScsiDevice.Size)
+            {
+                Current["Size"] = ScsiDevice.Size;
+            }
             ScsiDevices.push_back(Current);
         }
         RootJson["ScsiDevices"] = ScsiDevices;
@@ -1637,6 +2349,10 @@ std::string NanaBox::SerializeConfiguration(
         RootJson["ExposeVirtualizationExtensions"] =
             Configuration.ExposeVirtualizationExtensions;
     }
+    if (Configuration.SaveOnSessionEnd)
+    {
+        RootJson["SaveOnSessionEnd"] = Configuration.SaveOnSessionEnd;
+    }
     {
         nlohmann::json Keyboard =
             NanaBox::SerializeKeyboardConfiguration(
@@ -1664,6 +2380,57 @@ std::string NanaBox::SerializeConfiguration(
             RootJson["ChipsetInformation"] = ChipsetInformation;
         }
     }
+    {
+        nlohmann::json Metrics =
+            NanaBox::SerializeMetricsConfiguration(
+                Configuration.Metrics);
+        if (!Metrics.empty())
+        {
+            RootJson["Metrics"] = Metrics;
+        }
+    }
+    {
+        nlohmann::json VideoMonitor =
+            NanaBox::SerializeVideoMonitorConfiguration(
+                Configuration.VideoMonitor);
+        if (!VideoMonitor.empty())
+        {
+            RootJson["VideoMonitor"] = VideoMonitor;
+        }
+    }
+    if (!Configuration.DependsOn.empty())
+    {
+        RootJson["DependsOn"] = Configuration.DependsOn;
+    }
+    {
+        nlohmann::json Pool =
+            NanaBox::SerializePoolConfiguration(
+                Configuration.Pool);
+        if (!Pool.empty())
+        {
+            RootJson["Pool"] = Pool;
+        }
+    }
+    if (!Configuration.Checkpoints.empty())
+    {
+        nlohmann::json Checkpoints;
+        for (NanaBox::CheckpointConfiguration const& Checkpoint
+            : Configuration.Checkpoints)
+        {
+            Checkpoints.push_back(
+                NanaBox::SerializeCheckpointConfiguration(Checkpoint));
+        }
+        RootJson["Checkpoints"] = Checkpoints;
+    }
+    if (!Configuration.CurrentCheckpoint.empty())
+    {
+        RootJson["CurrentCheckpoint"] = Configuration.CurrentCheckpoint;
+    }
+    if (!Configuration.CurrentCheckpointDisks.empty())
+    {
+        RootJson["CurrentCheckpointDisks"] =
+            Configuration.CurrentCheckpointDisks;
+    }
 
     nlohmann::json Result;
     Result["NanaBox"] = RootJson;
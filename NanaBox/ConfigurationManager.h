@@ -39,6 +39,19 @@ namespace NanaBox
     void ComputeNetworkDeleteEndpoint(
         NetworkAdapterConfiguration& Configuration);
 
+    // Returns true if the existing endpoint of the network adapter still
+    // matches what ComputeNetworkCreateEndpoint creates for it.
+    bool ComputeNetworkCheckEndpoint(
+        std::string const& Owner,
+        NetworkAdapterConfiguration const& Configuration);
+
+    // Reuses the existing endpoint of the network adapter if it still matches,
+    // otherwise recreates it. The result is counted in the metrics of the
+    // owner.
+    void ComputeNetworkEnsureEndpoint(
+        std::string const& Owner,
+        NetworkAdapterConfiguration& Configuration);
+
     void ComputeSystemUpdateMemorySize(
         winrt::com_ptr<ComputeSystem> const& Instance,
         std::uint64_t const& MemorySize);
@@ -88,6 +101,13 @@ namespace NanaBox
         winrt::com_ptr<RdpClient> const& Instance,
         EnhancedSessionConfiguration& Configuration);
 
+    // Applies the preset and the overrides. Only the input send interval
+    // takes effect immediately on the connected client, and the others take
+    // effect when it is connected next time.
+    void RemoteDesktopUpdatePerformanceProfileConfiguration(
+        winrt::com_ptr<RdpClient> const& Instance,
+        PerformanceProfileConfiguration const& Configuration);
+
     void DeserializeKeyboardConfiguration(
         nlohmann::json const& Input,
         KeyboardConfiguration& Output);
@@ -109,6 +129,34 @@ namespace NanaBox
     nlohmann::json SerializeChipsetInformationConfiguration(
         ChipsetInformationConfiguration const& Input);
 
+    void DeserializeVideoMonitorConfiguration(
+        nlohmann::json const& Input,
+        VideoMonitorConfiguration& Output);
+
+    nlohmann::json SerializeVideoMonitorConfiguration(
+        VideoMonitorConfiguration const& Input);
+
+    void DeserializeMetricsConfiguration(
+        nlohmann::json const& Input,
+        MetricsConfiguration& Output);
+
+    nlohmann::json SerializeMetricsConfiguration(
+        MetricsConfiguration const& Input);
+
+    void DeserializeCheckpointConfiguration(
+        nlohmann::json const& Input,
+        CheckpointConfiguration& Output);
+
+    nlohmann::json SerializeCheckpointConfiguration(
+        CheckpointConfiguration const& Input);
+
+    void DeserializePoolConfiguration(
+        nlohmann::json const& Input,
+        PoolConfiguration& Output);
+
+    nlohmann::json SerializePoolConfiguration(
+        PoolConfiguration const& Input);
+
     VirtualMachineConfiguration DeserializeConfiguration(
         std::string const& Configuration);
 
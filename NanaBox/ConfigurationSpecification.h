@@ -21,6 +21,7 @@
 
 #include <cstdint>
 #include <map>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -56,6 +57,14 @@ namespace NanaBox
         PhysicalDevice = 2,
     };
 
+    enum class PerformancePreset : std::int32_t
+    {
+        Default = 0,
+        LowLatency = 1,
+        LowBandwidth = 2,
+        HighFidelity = 3,
+    };
+
     struct ComPortsConfiguration
     {
         UefiConsoleMode UefiConsole = UefiConsoleMode::Disabled;
@@ -81,6 +90,30 @@ namespace NanaBox
     {
         ScsiDeviceType Type;
         std::string Path;
+        // The virtual size of the disk in MiB, which is only used to expand
+        // the virtual disks when reloading the settings of a running virtual
+        // machine. The disk is never shrunk.
+        std::uint64_t Size = 0;
+    };
+
+    // The settings of the remote desktop client which are not set by the
+    // overrides follow the preset.
+    struct PerformanceProfileConfiguration
+    {
+        PerformancePreset Preset = PerformancePreset::Default;
+        std::optional<std::uint32_t> ColorDepth; // 15, 16, 24 or 32
+        // In MiB, for the virtual bitmap caches of all color depths.
+        std::optional<std::uint32_t> BitmapCacheSize;
+        std::optional<bool> BitmapPersistence;
+        std::optional<bool> Compression;
+        std::optional<std::uint32_t> InputSendInterval; // In milliseconds
+        // The wallpaper, the theming, the animations, the full window drag
+        // and the cursor shadow.
+        std::optional<bool> VisualEffects;
+        std::optional<bool> FontSmoothing;
+        std::optional<bool> DesktopComposition;
+        // The hardware mode and the frame buffer redirection.
+        std::optional<bool> HardwareAcceleration;
     };
 
     struct VideoMonitorConfiguration
@@ -92,6 +125,7 @@ namespace NanaBox
         std::uint16_t HorizontalResolution = 1024;
         std::uint16_t VerticalResolution = 768;
         std::uint32_t OverriddenDpiScalingValue = 100;
+        PerformanceProfileConfiguration PerformanceProfile;
     };
 
     struct KeyboardConfiguration
@@ -139,6 +173,33 @@ namespace NanaBox
         std::string Family; // At least 20348.
     };
 
+    struct MetricsConfiguration
+    {
+        bool Enabled = false;
+        std::string File;
+        std::uint32_t UpdateInterval = 15; // In seconds
+    };
+
+    struct CheckpointConfiguration
+    {
+        std::string Name;
+        // The name of the checkpoint which the state was based on.
+        std::string Parent;
+        std::string CreationTime; // In the ISO 8601 format, UTC
+        // The frozen virtual disks, in the same order as ScsiDevices, the
+        // items for the other types of devices are empty.
+        std::vector<std::string> Disks;
+        std::string GuestStateFile;
+        std::string SaveStateFile; // Optional memory state
+    };
+
+    struct PoolConfiguration
+    {
+        std::uint32_t Size = 0;
+        std::uint32_t RefillConcurrency = 1;
+        std::uint32_t WarmupTime = 60; // In seconds
+    };
+
     struct VirtualMachineConfiguration
     {
         std::uint32_t Version = 1;
@@ -156,10 +217,20 @@ namespace NanaBox
         std::string RuntimeStateFile;
         std::string SaveStateFile;
         bool ExposeVirtualizationExtensions = false;
+        bool SaveOnSessionEnd = false;
         KeyboardConfiguration Keyboard;
         EnhancedSessionConfiguration EnhancedSession;
         ChipsetInformationConfiguration ChipsetInformation;
-        VideoMonitorConfiguration VideoMonitor; // Not Implemented
+        MetricsConfiguration Metrics;
+        std::vector<std::string> DependsOn;
+        PoolConfiguration Pool;
+        std::vector<CheckpointConfiguration> Checkpoints;
+        std::string CurrentCheckpoint;
+        // The differencing disks created for the current state by the
+        // checkpoint operations, only these disks are deleted when reverting.
+        std::vector<std::string> CurrentCheckpointDisks;
+        // Only the PerformanceProfile is implemented.
+        VideoMonitorConfiguration VideoMonitor;
     };
 }
 
@@ -0,0 +1,378 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      DependencyScheduler.cpp
+ * PURPOSE:   Implementation for the Dependency Task Scheduler
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "DependencyScheduler.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#ifdef _WIN32
+#include <winrt/base.h>
+#endif
+
+namespace
+{
+    const char* g_StatusNames[] =
+    {
+        "Pending",
+        "Succeeded",
+        "Failed",
+        "Skipped",
+    };
+
+    const std::size_t TimelineBarWidth = 40;
+
+    double ToMilliseconds(
+        std::chrono::steady_clock::duration Duration)
+    {
+        return std::chrono::duration<double, std::milli>(Duration).count();
+    }
+
+    std::string GetCurrentExceptionMessage()
+    {
+        try
+        {
+            throw;
+        }
+#ifdef _WIN32
+        catch (winrt::hresult_error const& ex)
+        {
+            char Buffer[16];
+            std::snprintf(
+                Buffer,
+                sizeof(Buffer),
+                "0x%08X ",
+                static_cast<std::uint32_t>(ex.code().value));
+            return Buffer + winrt::to_string(ex.message());
+        }
+#endif
+        catch (std::exception const& ex)
+        {
+            return ex.what();
+        }
+        catch (...)
+        {
+            return "Unknown error";
+        }
+    }
+}
+
+std::vector<NanaBox::DependencyTaskTimeline> NanaBox::RunDependencyTasks(
+    std::vector<NanaBox::DependencyTask> const& Tasks,
+    std::size_t MaxParallelism,
+    NanaBox::DependencyTaskCallback const& Callback)
+{
+    std::size_t Count = Tasks.size();
+
+    std::map<std::string, std::size_t> Indexes;
+    for (std::size_t i = 0; i < Count; ++i)
+    {
+        if (!Indexes.emplace(Tasks[i].Name, i).second)
+        {
+            throw std::runtime_error(
+                "The task \"" + Tasks[i].Name + "\" is duplicated.");
+        }
+    }
+
+    std::vector<std::vector<std::size_t>> Dependents(Count);
+    std::vector<std::size_t> RemainingDependencies(Count);
+    for (std::size_t i = 0; i < Count; ++i)
+    {
+        for (std::string const& Dependency : Tasks[i].DependsOn)
+        {
+            auto Iterator = Indexes.find(Dependency);
+            if (Indexes.end() == Iterator)
+            {
+                throw std::runtime_error(
+                    "The task \"" + Tasks[i].Name +
+                    "\" depends on the unknown task \"" + Dependency + "\".");
+            }
+            Dependents[Iterator->second].push_back(i);
+            ++RemainingDependencies[i];
+        }
+    }
+
+    std::deque<std::size_t> ReadyQueue;
+    {
+        // Validate the graph with the Kahn's algorithm before running anything,
+        // the tasks left unvisited are exactly the ones in or behind a cycle.
+        std::vector<std::size_t> Remaining = RemainingDependencies;
+        std::vector<std::size_t> Order;
+        for (std::size_t i = 0; i < Count; ++i)
+        {
+            if (!Remaining[i])
+            {
+                Order.push_back(i);
+                ReadyQueue.push_back(i);
+            }
+        }
+        for (std::size_t i = 0; i < Order.size(); ++i)
+        {
+            for (std::size_t Dependent : Dependents[Order[i]])
+            {
+                if (!--Remaining[Dependent])
+                {
+                    Order.push_back(Dependent);
+                }
+            }
+        }
+        if (Order.size() != Count)
+        {
+            std::string Names;
+            for (std::size_t i = 0; i < Count; ++i)
+            {
+                if (Remaining[i])
+                {
+                    Names += Names.empty() ? "\"" : ", \"";
+                    Names += Tasks[i].Name + "\"";
+                }
+            }
+            throw std::runtime_error(
+                "The dependencies of the tasks " + Names + " are circular.");
+        }
+    }
+
+    std::vector<NanaBox::DependencyTaskTimeline> Timeline(Count);
+    for (std::size_t i = 0; i < Count; ++i)
+    {
+        Timeline[i].Name = Tasks[i].Name;
+    }
+
+    std::mutex Lock;
+    std::condition_variable ReadyCondition;
+    std::size_t FinishedCount = 0;
+    std::size_t MaxWorkerCount = std::min(std::max<std::size_t>(
+        MaxParallelism, 1), Count);
+    // The calling thread is the first worker, the workers waiting for the
+    // ready tasks or just started are idle.
+    std::vector<std::thread> Workers;
+    std::size_t IdleWorkerCount = 1;
+    std::chrono::steady_clock::time_point SchedulingStartTime =
+        std::chrono::steady_clock::now();
+
+    // Marks the dependents of a failed or skipped task as skipped, the lock
+    // must be held by the caller.
+    std::function<void(std::size_t)> SkipDependents = [&](
+        std::size_t Index)
+    {
+        for (std::size_t Dependent : Dependents[Index])
+        {
+            NanaBox::DependencyTaskTimeline& Current = Timeline[Dependent];
+            if (Current.Status != NanaBox::DependencyTaskStatus::Pending)
+            {
+                continue;
+            }
+            Current.Status = NanaBox::DependencyTaskStatus::Skipped;
+            Current.StartTime = Current.FinishTime =
+                std::chrono::steady_clock::now() - SchedulingStartTime;
+            Current.Error =
+                "The dependency \"" + Tasks[Index].Name + "\" is not ready.";
+            ++FinishedCount;
+            SkipDependents(Dependent);
+        }
+    };
+
+    // Starts a worker only if the ready tasks outnumber the idle workers, so
+    // the number of workers never exceeds the number of tasks which can run
+    // at the same time in the graph. The lock must be held by the caller.
+    std::function<void()> Worker;
+    auto StartWorkers = [&]()
+    {
+        while (ReadyQueue.size() > IdleWorkerCount &&
+            Workers.size() + 1 < MaxWorkerCount)
+        {
+            try
+            {
+                Workers.emplace_back(Worker);
+            }
+            catch (std::system_error const&)
+            {
+                // The running workers still finish all tasks.
+                break;
+            }
+            ++IdleWorkerCount;
+        }
+    };
+
+    Worker = [&]()
+    {
+        std::unique_lock<std::mutex> Guard(Lock);
+        for (;;)
+        {
+            ReadyCondition.wait(Guard, [&]()
+            {
+                return !ReadyQueue.empty() || FinishedCount == Count;
+            });
+            if (ReadyQueue.empty())
+            {
+                break;
+            }
+
+            std::size_t Index = ReadyQueue.front();
+            ReadyQueue.pop_front();
+            --IdleWorkerCount;
+            Timeline[Index].StartTime =
+                std::chrono::steady_clock::now() - SchedulingStartTime;
+            Guard.unlock();
+
+            NanaBox::DependencyTaskStatus Status =
+                NanaBox::DependencyTaskStatus::Succeeded;
+            std::string Error;
+            try
+            {
+                Callback(Index);
+            }
+            catch (...)
+            {
+                Status = NanaBox::DependencyTaskStatus::Failed;
+                Error = ::GetCurrentExceptionMessage();
+            }
+
+            Guard.lock();
+            NanaBox::DependencyTaskTimeline& Current = Timeline[Index];
+            Current.FinishTime =
+                std::chrono::steady_clock::now() - SchedulingStartTime;
+            Current.Status = Status;
+            Current.Error = std::move(Error);
+            ++FinishedCount;
+            ++IdleWorkerCount;
+
+            if (Status == NanaBox::DependencyTaskStatus::Succeeded)
+            {
+                for (std::size_t Dependent : Dependents[Index])
+                {
+                    if (!--RemainingDependencies[Dependent] &&
+                        Timeline[Dependent].Status ==
+                        NanaBox::DependencyTaskStatus::Pending)
+                    {
+                        ReadyQueue.push_back(Dependent);
+                    }
+                }
+            }
+            else
+            {
+                SkipDependents(Index);
+            }
+
+            StartWorkers();
+            ReadyCondition.notify_all();
+        }
+    };
+
+    if (Count)
+    {
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            StartWorkers();
+        }
+        Worker();
+    }
+
+    // No worker is started after all tasks are finished, so the list is no
+    // longer changed when the calling thread returns from its worker.
+    for (std::thread& Current : Workers)
+    {
+        Current.join();
+    }
+
+    return Timeline;
+}
+
+std::string NanaBox::FormatDependencyTimeline(
+    std::vector<NanaBox::DependencyTaskTimeline> const& Timeline)
+{
+    std::chrono::steady_clock::duration TotalTime =
+        std::chrono::steady_clock::duration::zero();
+    std::chrono::steady_clock::duration BusyTime =
+        std::chrono::steady_clock::duration::zero();
+    std::size_t NameWidth = 4;
+    for (NanaBox::DependencyTaskTimeline const& Current : Timeline)
+    {
+        TotalTime = std::max(TotalTime, Current.FinishTime);
+        BusyTime += Current.FinishTime - Current.StartTime;
+        NameWidth = std::max(NameWidth, Current.Name.size());
+    }
+
+    std::string Result;
+    char Buffer[128];
+
+    Result += "Name";
+    Result.append(NameWidth - 4, ' ');
+    std::snprintf(
+        Buffer,
+        sizeof(Buffer),
+        " %-9s %10s %10s %10s\n",
+        "Status",
+        "Start(ms)",
+        "Finish(ms)",
+        "Took(ms)");
+    Result += Buffer;
+
+    for (NanaBox::DependencyTaskTimeline const& Current : Timeline)
+    {
+        Result += Current.Name;
+        Result.append(NameWidth - Current.Name.size(), ' ');
+        std::snprintf(
+            Buffer,
+            sizeof(Buffer),
+            " %-9s %10.1f %10.1f %10.1f ",
+            g_StatusNames[static_cast<std::size_t>(Current.Status)],
+            ::ToMilliseconds(Current.StartTime),
+            ::ToMilliseconds(Current.FinishTime),
+            ::ToMilliseconds(Current.FinishTime - Current.StartTime));
+        Result += Buffer;
+
+        std::size_t BarStart = 0;
+        std::size_t BarFinish = 0;
+        if (TotalTime.count())
+        {
+            BarStart = static_cast<std::size_t>(
+                Current.StartTime.count() * TimelineBarWidth /
+                TotalTime.count());
+            BarFinish = static_cast<std::size_t>(
+                Current.FinishTime.count() * TimelineBarWidth /
+                TotalTime.count());
+        }
+        Result.push_back('|');
+        Result.append(BarStart, ' ');
+        Result.append(std::max<std::size_t>(BarFinish - BarStart, 1), '#');
+        Result.append(TimelineBarWidth - std::min(
+            TimelineBarWidth,
+            std::max(BarFinish, BarStart + 1)), ' ');
+        Result.push_back('|');
+        if (!Current.Error.empty())
+        {
+            Result += ' ';
+            Result += Current.Error;
+        }
+        Result += '\n';
+    }
+
+    std::snprintf(
+        Buffer,
+        sizeof(Buffer),
+        "Total %.1f ms, busy %.1f ms, average parallelism %.2f\n",
+        ::ToMilliseconds(TotalTime),
+        ::ToMilliseconds(BusyTime),
+        TotalTime.count()
+            ? static_cast<double>(BusyTime.count()) / TotalTime.count()
+            : 0.0);
+    Result += Buffer;
+
+    return Result;
+}
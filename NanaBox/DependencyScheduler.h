@@ -0,0 +1,79 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      DependencyScheduler.h
+ * PURPOSE:   Definition for the Dependency Task Scheduler
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_DEPENDENCY_SCHEDULER
+#define NANABOX_DEPENDENCY_SCHEDULER
+
+#if (defined(__cplusplus) && __cplusplus >= 201703L)
+#elif (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#else
+#error "[DependencyScheduler] You should use a C++ compiler with the C++17 standard."
+#endif
+
+// This module is intentionally free of Windows dependencies, so the scheduler
+// can be verified with a simulated backend on other platforms.
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace NanaBox
+{
+    struct DependencyTask
+    {
+        std::string Name;
+        std::vector<std::string> DependsOn;
+    };
+
+    enum class DependencyTaskStatus : std::uint32_t
+    {
+        Pending = 0,
+        Succeeded = 1,
+        Failed = 2,
+        Skipped = 3,
+    };
+
+    struct DependencyTaskTimeline
+    {
+        std::string Name;
+        DependencyTaskStatus Status = DependencyTaskStatus::Pending;
+        // Relative to the time when the scheduling started.
+        std::chrono::steady_clock::duration StartTime =
+            std::chrono::steady_clock::duration::zero();
+        std::chrono::steady_clock::duration FinishTime =
+            std::chrono::steady_clock::duration::zero();
+        std::string Error;
+    };
+
+    // The callback reports the failure of the task by throwing an exception,
+    // and the tasks depending on a failed task are skipped.
+    using DependencyTaskCallback = std::function<void(std::size_t Index)>;
+
+    // Runs the tasks in the dependency order with at most MaxParallelism tasks
+    // in flight, the tasks without pending dependencies start in the order of
+    // the input. The calling thread runs the tasks as well, and the other
+    // workers are only started when more tasks are ready than the idle
+    // workers, so a chain of tasks runs on the calling thread alone. Throws
+    // std::runtime_error without running anything if the names are
+    // duplicated, a dependency is unknown or there is a cycle.
+    std::vector<DependencyTaskTimeline> RunDependencyTasks(
+        std::vector<DependencyTask> const& Tasks,
+        std::size_t MaxParallelism,
+        DependencyTaskCallback const& Callback);
+
+    // One line per task with a text bar chart, followed by the summary.
+    std::string FormatDependencyTimeline(
+        std::vector<DependencyTaskTimeline> const& Timeline);
+}
+
+#endif // !NANABOX_DEPENDENCY_SCHEDULER
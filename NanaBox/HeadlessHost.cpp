@@ -0,0 +1,1438 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      HeadlessHost.cpp
+ * PURPOSE:   Implementation for the Headless Virtual Machine Host
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "HeadlessHost.h"
+
+#include "Utils.h"
+
+#include <Mile.Helpers.h>
+
+#include <Psapi.h>
+
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include <stdexcept>
+
+namespace
+{
+    const char* g_StateNames[] =
+    {
+        "Stopped",
+        "Starting",
+        "Running",
+        "Saving",
+        "Stopping",
+        "Failed",
+    };
+
+    const DWORD g_ControlPipeClientTimeout = 5000;
+
+    struct ParallelForEachContext
+    {
+        std::vector<NanaBox::HeadlessVirtualMachine*> const* Targets;
+        std::function<void(NanaBox::HeadlessVirtualMachine&)> const* Action;
+        std::atomic<std::size_t> NextIndex = 0;
+    };
+
+    void CALLBACK ParallelForEachCallback(
+        PTP_CALLBACK_INSTANCE Instance,
+        PVOID Context,
+        PTP_WORK Work)
+    {
+        UNREFERENCED_PARAMETER(Instance);
+        UNREFERENCED_PARAMETER(Work);
+
+        ParallelForEachContext* Parallel =
+            reinterpret_cast<ParallelForEachContext*>(Context);
+        std::size_t Index = Parallel->NextIndex++;
+        (*Parallel->Action)(*(*Parallel->Targets)[Index]);
+    }
+
+    std::uint64_t GetCurrentProcessPrivateUsage()
+    {
+        PROCESS_MEMORY_COUNTERS_EX Counters = { 0 };
+        Counters.cb = sizeof(PROCESS_MEMORY_COUNTERS_EX);
+        if (!::GetProcessMemoryInfo(
+            ::GetCurrentProcess(),
+            reinterpret_cast<PPROCESS_MEMORY_COUNTERS>(&Counters),
+            sizeof(PROCESS_MEMORY_COUNTERS_EX)))
+        {
+            return 0;
+        }
+        return Counters.PrivateUsage;
+    }
+
+    std::string GetCurrentExceptionMessage()
+    {
+        winrt::hresult_error Exception = Mile::WinRT::ToHResultError();
+        return Mile::FormatString(
+            "0x%08X %s",
+            Exception.code().value,
+            winrt::to_string(Exception.message()).c_str());
+    }
+
+    std::unique_ptr<NanaBox::HeadlessVirtualMachine> LoadVirtualMachine(
+        std::wstring const& ConfigurationFilePath)
+    {
+        std::unique_ptr<NanaBox::HeadlessVirtualMachine> Result =
+            std::make_unique<NanaBox::HeadlessVirtualMachine>();
+
+        Result->ConfigurationFilePath = ConfigurationFilePath;
+        {
+            std::wstring BaseDirectory = ConfigurationFilePath;
+            std::wcsrchr(&BaseDirectory[0], L'\\')[0] = L'\0';
+            BaseDirectory.resize(std::wcslen(BaseDirectory.c_str()));
+            Result->BaseDirectory = BaseDirectory;
+        }
+        Result->Name = winrt::to_string(ConfigurationFilePath);
+
+        try
+        {
+            Result->Configuration = NanaBox::DeserializeConfiguration(
+                ::ReadAllTextFromUtf8TextFile(ConfigurationFilePath));
+            Result->Name = Result->Configuration.Name;
+        }
+        catch (...)
+        {
+            Result->LastError = ::GetCurrentExceptionMessage();
+            Result->State = NanaBox::HeadlessVirtualMachineState::Failed;
+        }
+
+        return Result;
+    }
+
+    // Takes the first argument separated by the spaces from the arguments.
+    std::string PopArgument(
+        std::string& Arguments)
+    {
+        std::size_t End = Arguments.find_first_of(" \t");
+        std::string Result = Arguments.substr(0, End);
+        std::size_t Next = (std::string::npos == End)
+            ? std::string::npos
+            : Arguments.find_first_not_of(" \t", End);
+        Arguments = (std::string::npos == Next)
+            ? std::string()
+            : Arguments.substr(Next);
+        return Result;
+    }
+
+    LRESULT CALLBACK SessionEndWindowCallback(
+        _In_ HWND hWnd,
+        _In_ UINT uMsg,
+        _In_ WPARAM wParam,
+        _In_ LPARAM lParam)
+    {
+        if (WM_NCCREATE == uMsg)
+        {
+            ::SetWindowLongPtrW(
+                hWnd,
+                GWLP_USERDATA,
+                reinterpret_cast<LONG_PTR>(
+                    reinterpret_cast<LPCREATESTRUCTW>(lParam)->lpCreateParams));
+        }
+        else if (WM_QUERYENDSESSION == uMsg)
+        {
+            // The virtual machines are saved before answering, so the session
+            // only ends after the saves are completed, and the OS shows the
+            // reason meanwhile.
+            ::ShutdownBlockReasonCreate(
+                hWnd,
+                L"NanaBox is saving the virtual machines.");
+            NanaBox::HeadlessHost* Host =
+                reinterpret_cast<NanaBox::HeadlessHost*>(
+                    ::GetWindowLongPtrW(hWnd, GWLP_USERDATA));
+            if (!Host->SaveVirtualMachinesOnSessionEnd())
+            {
+                return FALSE;
+            }
+            ::ShutdownBlockReasonDestroy(hWnd);
+            return TRUE;
+        }
+        else if (WM_ENDSESSION == uMsg)
+        {
+            ::ShutdownBlockReasonDestroy(hWnd);
+            return 0;
+        }
+
+        return ::DefWindowProcW(hWnd, uMsg, wParam, lParam);
+    }
+
+    // Returns the volume which holds the save state file of the virtual
+    // machine, or the path of the save state file if it cannot be queried.
+    std::wstring GetSaveStateVolumePath(
+        NanaBox::HeadlessVirtualMachine const& Target)
+    {
+        std::string SaveStateFile = Target.Configuration.SaveStateFile;
+        if (SaveStateFile.empty())
+        {
+            SaveStateFile = Target.Configuration.Name + ".SaveState.vmrs";
+        }
+
+        ::SetCurrentThreadBaseDirectory(Target.BaseDirectory);
+        auto BaseDirectoryHandler = Mile::ScopeExitTaskHandler([]()
+        {
+            ::SetCurrentThreadBaseDirectory(std::wstring());
+        });
+
+        std::wstring FilePath = ::GetAbsolutePath(
+            Mile::ToWideString(CP_UTF8, SaveStateFile));
+
+        wchar_t VolumePath[MAX_PATH] = { 0 };
+        if (!::GetVolumePathNameW(FilePath.c_str(), VolumePath, MAX_PATH))
+        {
+            return FilePath;
+        }
+        return VolumePath;
+    }
+
+    void InitializeMetrics(
+        NanaBox::HeadlessVirtualMachine& Target)
+    {
+        if (!Target.Configuration.Metrics.Enabled)
+        {
+            return;
+        }
+
+        // The metrics are informational only, so never fail the virtual
+        // machine launch because of them.
+        try
+        {
+            if (!Target.Exporter)
+            {
+                std::wstring FilePath;
+                if (!Target.Configuration.Metrics.File.empty())
+                {
+                    FilePath = ::GetAbsolutePath(Mile::ToWideString(
+                        CP_UTF8,
+                        Target.Configuration.Metrics.File));
+                }
+
+                Target.Exporter = std::make_unique<NanaBox::MetricsExporter>(
+                    NanaBox::GetMetricsPipeName(Target.Name),
+                    FilePath,
+                    Target.Configuration.Metrics.UpdateInterval * 1000);
+            }
+
+            Target.StatisticsSampler =
+                std::make_unique<NanaBox::VirtualMachineStatisticsSampler>(
+                    Target.Name,
+                    Target.Configuration.ProcessorCount,
+                    Target.Instance);
+        }
+        catch (...)
+        {
+            return;
+        }
+
+        std::shared_ptr<NanaBox::VirtualMachineMetrics> Metrics =
+            NanaBox::GetVirtualMachineMetrics(Target.Name);
+        Target.StatisticsSampler->SampleAdded.add([=](
+            NanaBox::VirtualMachineStatisticsSample const& Previous,
+            NanaBox::VirtualMachineStatisticsSample const& Current)
+        {
+            UNREFERENCED_PARAMETER(Previous);
+
+            Metrics->Uptime.store(Current.Uptime);
+            Metrics->ProcessorRuntime.store(Current.ProcessorTotalRuntime);
+            Metrics->AssignedMemory.store(Current.AssignedMemory);
+            Metrics->AvailableMemory.store(Current.AvailableMemory);
+        });
+    }
+
+    void WriteConfigurationFile(
+        NanaBox::HeadlessVirtualMachine& Target)
+    {
+        std::string ConfigurationFileContent =
+            NanaBox::SerializeConfiguration(Target.Configuration);
+        ::ReplaceAllTextInUtf8TextFile(
+            Target.ConfigurationFilePath,
+            ConfigurationFileContent);
+    }
+}
+
+std::wstring NanaBox::GetHeadlessPipeName(
+    std::wstring const& InstanceName)
+{
+    std::wstring PipeName = L"\\\\.\\pipe\\NanaBox.Headless";
+    if (!InstanceName.empty())
+    {
+        PipeName += L"." + InstanceName;
+    }
+    return PipeName;
+}
+
+NanaBox::HeadlessHost::HeadlessHost(
+    std::vector<std::wstring> const& ConfigurationFilePaths,
+    std::size_t MaxParallelism) :
+    m_MaxParallelism(MaxParallelism)
+{
+    this->m_BaselinePrivateUsage = ::GetCurrentProcessPrivateUsage();
+
+    for (std::wstring const& ConfigurationFilePath : ConfigurationFilePaths)
+    {
+        std::unique_ptr<NanaBox::HeadlessVirtualMachine> Current =
+            ::LoadVirtualMachine(ConfigurationFilePath);
+
+        if (Current->Configuration.Pool.Size)
+        {
+            this->m_Pools.push_back(
+                std::make_unique<NanaBox::VirtualMachinePool>(
+                    ConfigurationFilePath,
+                    Current->Configuration));
+            continue;
+        }
+
+        this->m_VirtualMachines.push_back(std::move(Current));
+    }
+}
+
+std::vector<NanaBox::HeadlessVirtualMachine*>
+NanaBox::HeadlessHost::SelectVirtualMachines(
+    std::string const& Name)
+{
+    std::vector<NanaBox::HeadlessVirtualMachine*> Result;
+    for (std::unique_ptr<NanaBox::HeadlessVirtualMachine> const& Current
+        : this->m_VirtualMachines)
+    {
+        if (Name.empty() || 0 == _stricmp(Name.c_str(), Current->Name.c_str()))
+        {
+            Result.push_back(Current.get());
+        }
+    }
+    return Result;
+}
+
+void NanaBox::HeadlessHost::ParallelForEach(
+    std::vector<NanaBox::HeadlessVirtualMachine*> const& Targets,
+    std::function<void(NanaBox::HeadlessVirtualMachine&)> const& Action)
+{
+    if (Targets.empty())
+    {
+        return;
+    }
+
+    ParallelForEachContext Context;
+    Context.Targets = &Targets;
+    Context.Action = &Action;
+
+    PTP_WORK Work = ::CreateThreadpoolWork(
+        ::ParallelForEachCallback,
+        &Context,
+        nullptr);
+    if (!Work)
+    {
+        // Fall back to the sequential execution when the system is too short
+        // of resources to create the work object.
+        for (NanaBox::HeadlessVirtualMachine* Target : Targets)
+        {
+            Action(*Target);
+        }
+        return;
+    }
+
+    for (std::size_t i = 0; i < Targets.size(); ++i)
+    {
+        ::SubmitThreadpoolWork(Work);
+    }
+    ::WaitForThreadpoolWorkCallbacks(Work, FALSE);
+    ::CloseThreadpoolWork(Work);
+}
+
+void NanaBox::HeadlessHost::LoadConfiguration(
+    NanaBox::HeadlessVirtualMachine& Target)
+{
+    std::lock_guard<std::mutex> Guard(Target.OperationLock);
+
+    if (Target.Instance &&
+        Target.State == NanaBox::HeadlessVirtualMachineState::Running)
+    {
+        return;
+    }
+
+    try
+    {
+        Target.Configuration = NanaBox::DeserializeConfiguration(
+            ::ReadAllTextFromUtf8TextFile(Target.ConfigurationFilePath));
+        Target.Name = Target.Configuration.Name;
+    }
+    catch (...)
+    {
+        Target.LastError = ::GetCurrentExceptionMessage();
+        Target.State = NanaBox::HeadlessVirtualMachineState::Failed;
+        throw std::runtime_error(Target.LastError);
+    }
+}
+
+void NanaBox::HeadlessHost::PrepareVirtualMachine(
+    NanaBox::HeadlessVirtualMachine& Target)
+{
+    std::lock_guard<std::mutex> Guard(Target.OperationLock);
+
+    if (Target.Instance &&
+        Target.State == NanaBox::HeadlessVirtualMachineState::Running)
+    {
+        return;
+    }
+
+    // The guest may have been shut down by itself.
+    Target.StatisticsSampler = nullptr;
+    Target.Instance = nullptr;
+
+    Target.State = NanaBox::HeadlessVirtualMachineState::Starting;
+
+    ::SetCurrentThreadBaseDirectory(Target.BaseDirectory);
+    auto BaseDirectoryHandler = Mile::ScopeExitTaskHandler([]()
+    {
+        ::SetCurrentThreadBaseDirectory(std::wstring());
+    });
+
+    try
+    {
+        std::chrono::steady_clock::time_point StartTime =
+            std::chrono::steady_clock::now();
+
+        NanaBox::PrepareVirtualMachine(Target.Configuration);
+
+        Target.PreparationTime = std::chrono::steady_clock::now() - StartTime;
+    }
+    catch (...)
+    {
+        Target.LastError = ::GetCurrentExceptionMessage();
+        Target.State = NanaBox::HeadlessVirtualMachineState::Failed;
+        throw std::runtime_error(Target.LastError);
+    }
+}
+
+void NanaBox::HeadlessHost::LaunchVirtualMachine(
+    NanaBox::HeadlessVirtualMachine& Target)
+{
+    std::lock_guard<std::mutex> Guard(Target.OperationLock);
+
+    if (Target.Instance &&
+        Target.State == NanaBox::HeadlessVirtualMachineState::Running)
+    {
+        return;
+    }
+
+    ::SetCurrentThreadBaseDirectory(Target.BaseDirectory);
+    auto BaseDirectoryHandler = Mile::ScopeExitTaskHandler([]()
+    {
+        ::SetCurrentThreadBaseDirectory(std::wstring());
+    });
+
+    try
+    {
+        std::chrono::steady_clock::time_point StartTime =
+            std::chrono::steady_clock::now();
+
+        NanaBox::LifecyclePhase Phase = Target.Configuration.SaveStateFile.empty()
+            ? NanaBox::LifecyclePhase::Initialize
+            : NanaBox::LifecyclePhase::Restore;
+
+        Target.Instance = NanaBox::CreateVirtualMachine(Target.Configuration);
+
+        NanaBox::HeadlessVirtualMachine* Context = &Target;
+        Target.Instance->SystemExited.add([Context](
+            winrt::hstring const& EventData)
+        {
+            UNREFERENCED_PARAMETER(EventData);
+
+            Context->State = NanaBox::HeadlessVirtualMachineState::Stopped;
+        });
+
+        NanaBox::StartVirtualMachine(Target.Instance, Target.Configuration);
+
+        ::WriteConfigurationFile(Target);
+
+        // The time waiting for the dependencies is not included.
+        NanaBox::GetVirtualMachineMetrics(Target.Name)->RecordLifecycle(
+            Phase,
+            Target.PreparationTime +
+            (std::chrono::steady_clock::now() - StartTime));
+
+        ::InitializeMetrics(Target);
+
+        Target.LastError.clear();
+        Target.State = NanaBox::HeadlessVirtualMachineState::Running;
+    }
+    catch (...)
+    {
+        Target.LastError = ::GetCurrentExceptionMessage();
+        Target.StatisticsSampler = nullptr;
+        Target.Instance = nullptr;
+        Target.State = NanaBox::HeadlessVirtualMachineState::Failed;
+        throw std::runtime_error(Target.LastError);
+    }
+}
+
+std::string NanaBox::HeadlessHost::StartVirtualMachines(
+    std::vector<NanaBox::HeadlessVirtualMachine*> const& Targets)
+{
+    std::vector<std::string> LoadErrors(Targets.size());
+    std::set<std::string> Names;
+    for (std::size_t i = 0; i < Targets.size(); ++i)
+    {
+        try
+        {
+            this->LoadConfiguration(*Targets[i]);
+        }
+        catch (std::exception const& ex)
+        {
+            LoadErrors[i] = ex.what();
+        }
+        Names.insert(Targets[i]->Name);
+    }
+
+    // Each virtual machine has a preparation task without dependencies, and a
+    // launch task which depends on its preparation and the launch tasks of
+    // its dependencies, so all preparations run concurrently and only the
+    // launches follow the dependency order.
+    std::vector<NanaBox::DependencyTask> Tasks;
+    for (NanaBox::HeadlessVirtualMachine* Target : Targets)
+    {
+        NanaBox::DependencyTask Preparation;
+        Preparation.Name = "Prepare " + Target->Name;
+        Tasks.push_back(Preparation);
+
+        NanaBox::DependencyTask Launch;
+        Launch.Name = "Launch " + Target->Name;
+        Launch.DependsOn.push_back(Preparation.Name);
+        for (std::string const& Dependency : Target->Configuration.DependsOn)
+        {
+            // The dependencies which are not started together are ignored.
+            if (Names.end() != Names.find(Dependency))
+            {
+                Launch.DependsOn.push_back("Launch " + Dependency);
+            }
+        }
+        Tasks.push_back(Launch);
+    }
+
+    std::vector<NanaBox::DependencyTaskTimeline> Timeline =
+        NanaBox::RunDependencyTasks(
+            Tasks,
+            this->m_MaxParallelism,
+            [&](std::size_t Index)
+    {
+        std::size_t TargetIndex = Index / 2;
+        if (!LoadErrors[TargetIndex].empty())
+        {
+            throw std::runtime_error(LoadErrors[TargetIndex]);
+        }
+
+        if (Index % 2)
+        {
+            this->LaunchVirtualMachine(*Targets[TargetIndex]);
+        }
+        else
+        {
+            this->PrepareVirtualMachine(*Targets[TargetIndex]);
+        }
+    });
+
+    return NanaBox::FormatDependencyTimeline(Timeline);
+}
+
+void NanaBox::HeadlessHost::StopVirtualMachine(
+    NanaBox::HeadlessVirtualMachine& Target)
+{
+    std::lock_guard<std::mutex> Guard(Target.OperationLock);
+
+    if (!Target.Instance)
+    {
+        return;
+    }
+
+    Target.State = NanaBox::HeadlessVirtualMachineState::Stopping;
+
+    Target.StatisticsSampler = nullptr;
+
+    try
+    {
+        Target.Instance->Pause();
+    }
+    catch (...)
+    {
+
+    }
+
+    try
+    {
+        Target.Instance->Terminate();
+    }
+    catch (...)
+    {
+
+    }
+
+    Target.Instance = nullptr;
+    Target.State = NanaBox::HeadlessVirtualMachineState::Stopped;
+
+    if (Target.Pooled)
+    {
+        Target.Exporter = nullptr;
+        NanaBox::ReleaseVirtualMachineMetrics(Target.Name);
+    }
+}
+
+void NanaBox::HeadlessHost::SaveVirtualMachine(
+    NanaBox::HeadlessVirtualMachine& Target)
+{
+    std::lock_guard<std::mutex> Guard(Target.OperationLock);
+
+    if (!Target.Instance ||
+        Target.State != NanaBox::HeadlessVirtualMachineState::Running)
+    {
+        return;
+    }
+
+    Target.State = NanaBox::HeadlessVirtualMachineState::Saving;
+
+    ::SetCurrentThreadBaseDirectory(Target.BaseDirectory);
+    auto BaseDirectoryHandler = Mile::ScopeExitTaskHandler([]()
+    {
+        ::SetCurrentThreadBaseDirectory(std::wstring());
+    });
+
+    try
+    {
+        std::chrono::steady_clock::time_point StartTime =
+            std::chrono::steady_clock::now();
+
+        Target.StatisticsSampler = nullptr;
+
+        NanaBox::SaveVirtualMachine(Target.Instance, Target.Configuration);
+
+        Target.Instance->Terminate();
+        Target.Instance = nullptr;
+
+        ::WriteConfigurationFile(Target);
+
+        NanaBox::GetVirtualMachineMetrics(Target.Name)->RecordLifecycle(
+            NanaBox::LifecyclePhase::Save,
+            std::chrono::steady_clock::now() - StartTime);
+
+        Target.LastError.clear();
+        Target.State = NanaBox::HeadlessVirtualMachineState::Stopped;
+    }
+    catch (...)
+    {
+        Target.LastError = ::GetCurrentExceptionMessage();
+        Target.State = Target.Instance
+            ? NanaBox::HeadlessVirtualMachineState::Running
+            : NanaBox::HeadlessVirtualMachineState::Stopped;
+        if (Target.Instance)
+        {
+            ::InitializeMetrics(Target);
+        }
+    }
+}
+
+void NanaBox::HeadlessHost::SaveVirtualMachines(
+    std::vector<NanaBox::HeadlessVirtualMachine*> const& Targets)
+{
+    // The saves of the virtual machines whose save state files are on the
+    // same volume are chained, so each volume only writes one save state file
+    // at a time instead of splitting its throughput between them.
+    std::vector<std::pair<std::wstring, std::string>> LastSaveOnVolumes;
+
+    std::vector<NanaBox::DependencyTask> Tasks(Targets.size());
+    for (std::size_t i = 0; i < Targets.size(); ++i)
+    {
+        // The names of the virtual machines which failed to load may be
+        // duplicated.
+        Tasks[i].Name = Mile::FormatString("Save %zu", i);
+
+        std::wstring VolumePath = ::GetSaveStateVolumePath(*Targets[i]);
+        auto Iterator = std::find_if(
+            LastSaveOnVolumes.begin(),
+            LastSaveOnVolumes.end(),
+            [&](std::pair<std::wstring, std::string> const& Current)
+        {
+            return 0 == _wcsicmp(Current.first.c_str(), VolumePath.c_str());
+        });
+        if (Iterator == LastSaveOnVolumes.end())
+        {
+            LastSaveOnVolumes.emplace_back(VolumePath, Tasks[i].Name);
+        }
+        else
+        {
+            Tasks[i].DependsOn.push_back(Iterator->second);
+            Iterator->second = Tasks[i].Name;
+        }
+    }
+
+    NanaBox::RunDependencyTasks(
+        Tasks,
+        this->m_MaxParallelism,
+        [&](std::size_t Index)
+    {
+        this->SaveVirtualMachine(*Targets[Index]);
+    });
+}
+
+bool NanaBox::HeadlessHost::SaveVirtualMachinesOnSessionEnd()
+{
+    std::lock_guard<std::mutex> Guard(this->m_CommandLock);
+
+    std::vector<NanaBox::HeadlessVirtualMachine*> Targets;
+    for (NanaBox::HeadlessVirtualMachine* Current
+        : this->SelectVirtualMachines(std::string()))
+    {
+        if (Current->State != NanaBox::HeadlessVirtualMachineState::Running)
+        {
+            continue;
+        }
+
+        // Prevent the session end like the main window because ending the
+        // session without exiting NanaBox may corrupt the virtual machine.
+        if (!Current->Configuration.SaveOnSessionEnd)
+        {
+            return false;
+        }
+
+        Targets.push_back(Current);
+    }
+
+    this->SaveVirtualMachines(Targets);
+
+    bool Result = true;
+    for (NanaBox::HeadlessVirtualMachine* Current : Targets)
+    {
+        if (Current->State == NanaBox::HeadlessVirtualMachineState::Running)
+        {
+            // The error is also kept for the status command if the session
+            // end is canceled.
+            ::OutputDebugStringA(Mile::FormatString(
+                "NanaBox: Failed to save %s when the session is ending: %s\n",
+                Current->Name.c_str(),
+                Current->LastError.c_str()).c_str());
+            Result = false;
+        }
+    }
+    return Result;
+}
+
+void NanaBox::HeadlessHost::ReloadVirtualMachine(
+    NanaBox::HeadlessVirtualMachine& Target)
+{
+    std::lock_guard<std::mutex> Guard(Target.OperationLock);
+
+    // The stopped virtual machines will read the configuration file when they
+    // are started next time.
+    if (!Target.Instance ||
+        Target.State != NanaBox::HeadlessVirtualMachineState::Running)
+    {
+        return;
+    }
+
+    ::SetCurrentThreadBaseDirectory(Target.BaseDirectory);
+    auto BaseDirectoryHandler = Mile::ScopeExitTaskHandler([]()
+    {
+        ::SetCurrentThreadBaseDirectory(std::wstring());
+    });
+
+    try
+    {
+        std::chrono::steady_clock::time_point StartTime =
+            std::chrono::steady_clock::now();
+
+        NanaBox::VirtualMachineConfiguration Configuration =
+            NanaBox::DeserializeConfiguration(
+                ::ReadAllTextFromUtf8TextFile(Target.ConfigurationFilePath));
+
+        NanaBox::ReloadVirtualMachine(
+            Target.Instance,
+            Target.Configuration,
+            Configuration);
+
+        // The Remote Desktop related settings take effect immediately because
+        // there is no Remote Desktop client in the headless mode.
+        Target.Configuration.Keyboard = Configuration.Keyboard;
+        Target.Configuration.EnhancedSession = Configuration.EnhancedSession;
+        Target.Configuration.VideoMonitor = Configuration.VideoMonitor;
+
+        ::WriteConfigurationFile(Target);
+
+        std::shared_ptr<NanaBox::VirtualMachineMetrics> Metrics =
+            NanaBox::GetVirtualMachineMetrics(Target.Name);
+        ++Metrics->Reloads;
+        Metrics->RecordLifecycle(
+            NanaBox::LifecyclePhase::Reload,
+            std::chrono::steady_clock::now() - StartTime);
+
+        Target.LastError.clear();
+    }
+    catch (...)
+    {
+        Target.LastError = ::GetCurrentExceptionMessage();
+    }
+}
+
+void NanaBox::HeadlessHost::RelaunchVirtualMachine(
+    NanaBox::HeadlessVirtualMachine& Target)
+{
+    std::string LastError;
+    {
+        std::lock_guard<std::mutex> Guard(Target.OperationLock);
+        LastError = Target.LastError;
+    }
+
+    try
+    {
+        this->PrepareVirtualMachine(Target);
+        this->LaunchVirtualMachine(Target);
+    }
+    catch (...)
+    {
+        return;
+    }
+
+    if (!LastError.empty())
+    {
+        std::lock_guard<std::mutex> Guard(Target.OperationLock);
+        Target.LastError = LastError;
+    }
+}
+
+void NanaBox::HeadlessHost::CheckpointVirtualMachine(
+    NanaBox::HeadlessVirtualMachine& Target,
+    std::string const& CheckpointName,
+    bool IncludeMemoryState)
+{
+    bool Running = false;
+    {
+        std::lock_guard<std::mutex> Guard(Target.OperationLock);
+
+        NanaBox::CheckpointFileChanges Changes;
+
+        Running = Target.Instance &&
+            Target.State == NanaBox::HeadlessVirtualMachineState::Running;
+
+        ::SetCurrentThreadBaseDirectory(Target.BaseDirectory);
+        auto BaseDirectoryHandler = Mile::ScopeExitTaskHandler([]()
+        {
+            ::SetCurrentThreadBaseDirectory(std::wstring());
+        });
+
+        try
+        {
+            if (Running)
+            {
+                Target.State = NanaBox::HeadlessVirtualMachineState::Saving;
+                Target.StatisticsSampler = nullptr;
+                NanaBox::SaveVirtualMachine(
+                    Target.Instance,
+                    Target.Configuration);
+                Target.Instance->Terminate();
+                Target.Instance = nullptr;
+                Target.State = NanaBox::HeadlessVirtualMachineState::Stopped;
+            }
+
+            Changes = NanaBox::CreateCheckpoint(
+                Target.Configuration,
+                CheckpointName,
+                IncludeMemoryState);
+
+            Target.LastError.clear();
+        }
+        catch (...)
+        {
+            Target.LastError = ::GetCurrentExceptionMessage();
+            Target.State = Target.Instance
+                ? NanaBox::HeadlessVirtualMachineState::Running
+                : NanaBox::HeadlessVirtualMachineState::Stopped;
+            if (Target.Instance)
+            {
+                ::InitializeMetrics(Target);
+            }
+        }
+
+        // Also records the save state file if the checkpoint failed after
+        // the virtual machine is saved. The disks of the checkpoint are only
+        // frozen after the configuration which uses the new differencing disks
+        // is written.
+        try
+        {
+            ::WriteConfigurationFile(Target);
+
+            NanaBox::ApplyCheckpointFileChanges(Changes);
+        }
+        catch (...)
+        {
+            Target.LastError = ::GetCurrentExceptionMessage();
+        }
+    }
+
+    if (Running && !Target.Instance)
+    {
+        this->RelaunchVirtualMachine(Target);
+    }
+}
+
+void NanaBox::HeadlessHost::RevertVirtualMachine(
+    NanaBox::HeadlessVirtualMachine& Target,
+    std::string const& CheckpointName)
+{
+    bool Running = false;
+    {
+        std::lock_guard<std::mutex> Guard(Target.OperationLock);
+
+        ::SetCurrentThreadBaseDirectory(Target.BaseDirectory);
+        auto BaseDirectoryHandler = Mile::ScopeExitTaskHandler([]()
+        {
+            ::SetCurrentThreadBaseDirectory(std::wstring());
+        });
+
+        bool Found = false;
+        for (NanaBox::CheckpointConfiguration const& Current
+            : Target.Configuration.Checkpoints)
+        {
+            if (0 == _stricmp(Current.Name.c_str(), CheckpointName.c_str()))
+            {
+                Found = true;
+            }
+        }
+        if (!Found)
+        {
+            Target.LastError = "The checkpoint is not found.";
+            return;
+        }
+
+        Running = Target.Instance &&
+            Target.State == NanaBox::HeadlessVirtualMachineState::Running;
+        if (Target.Instance)
+        {
+            Target.State = NanaBox::HeadlessVirtualMachineState::Stopping;
+            Target.StatisticsSampler = nullptr;
+
+            try
+            {
+                Target.Instance->Pause();
+            }
+            catch (...)
+            {
+
+            }
+
+            try
+            {
+                Target.Instance->Terminate();
+            }
+            catch (...)
+            {
+
+            }
+
+            Target.Instance = nullptr;
+            Target.State = NanaBox::HeadlessVirtualMachineState::Stopped;
+        }
+
+        try
+        {
+            NanaBox::CheckpointFileChanges Changes = NanaBox::RevertCheckpoint(
+                Target.Configuration,
+                CheckpointName);
+
+            // The discarded files are kept if the configuration which still
+            // refers to them fails to be written.
+            ::WriteConfigurationFile(Target);
+
+            NanaBox::ApplyCheckpointFileChanges(Changes);
+
+            Target.LastError.clear();
+        }
+        catch (...)
+        {
+            Target.LastError = ::GetCurrentExceptionMessage();
+        }
+    }
+
+    if (Running)
+    {
+        this->RelaunchVirtualMachine(Target);
+    }
+}
+
+std::string NanaBox::HeadlessHost::FormatCheckpoints(
+    std::vector<NanaBox::HeadlessVirtualMachine*> const& Targets)
+{
+    std::string Result;
+    for (NanaBox::HeadlessVirtualMachine* Target : Targets)
+    {
+        std::lock_guard<std::mutex> Guard(Target->OperationLock);
+
+        for (NanaBox::CheckpointConfiguration const& Current
+            : Target->Configuration.Checkpoints)
+        {
+            Result += Mile::FormatString(
+                "%s\t%s\t%s\t%s\t%s%s\n",
+                Target->Name.c_str(),
+                Current.Name.c_str(),
+                Current.CreationTime.c_str(),
+                Current.Parent.c_str(),
+                Current.SaveStateFile.empty() ? "Disk" : "Memory",
+                Current.Name == Target->Configuration.CurrentCheckpoint
+                ? "\tCurrent"
+                : "");
+        }
+    }
+    return Result;
+}
+
+std::string NanaBox::HeadlessHost::AcquireVirtualMachine(
+    std::string const& PoolName)
+{
+    std::chrono::steady_clock::time_point RequestTime =
+        std::chrono::steady_clock::now();
+
+    NanaBox::VirtualMachinePool* Pool = nullptr;
+    for (std::unique_ptr<NanaBox::VirtualMachinePool> const& Current
+        : this->m_Pools)
+    {
+        if (PoolName.empty()
+            ? 1 == this->m_Pools.size()
+            : 0 == _stricmp(PoolName.c_str(), Current->GetName().c_str()))
+        {
+            Pool = Current.get();
+        }
+    }
+    if (!Pool)
+    {
+        return "ERROR The pool is not found.\n";
+    }
+
+    NanaBox::VirtualMachinePoolRequest Request;
+    std::wstring ConfigurationFilePath;
+    try
+    {
+        ConfigurationFilePath = Pool->Acquire(Request.Warm);
+    }
+    catch (...)
+    {
+        return "ERROR " + ::GetCurrentExceptionMessage() + "\n";
+    }
+
+    std::unique_ptr<NanaBox::HeadlessVirtualMachine> Current =
+        ::LoadVirtualMachine(ConfigurationFilePath);
+    NanaBox::HeadlessVirtualMachine* Target = Current.get();
+    Target->Pooled = true;
+    this->m_VirtualMachines.push_back(std::move(Current));
+    Request.Name = Target->Name;
+
+    try
+    {
+        this->m_LastStartupTimeline = this->StartVirtualMachines({ Target });
+    }
+    catch (std::exception const& ex)
+    {
+        return std::string("ERROR ") + ex.what() + "\n";
+    }
+    if (Target->State != NanaBox::HeadlessVirtualMachineState::Running)
+    {
+        return "ERROR " + Target->LastError + "\n" + this->FormatStatus();
+    }
+
+    Request.TimeToUsable = std::chrono::steady_clock::now() - RequestTime;
+    Pool->RecordRequest(Request);
+
+    return Mile::FormatString(
+        "OK\n%s\t%s\tTimeToUsable=%.1fms\n",
+        Request.Name.c_str(),
+        Request.Warm ? "Warm" : "Cold",
+        std::chrono::duration<double, std::milli>(
+            Request.TimeToUsable).count()) + this->FormatPoolStatus();
+}
+
+std::string NanaBox::HeadlessHost::FormatPoolStatus()
+{
+    std::string Result;
+    for (std::unique_ptr<NanaBox::VirtualMachinePool> const& Current
+        : this->m_Pools)
+    {
+        Result += Current->FormatStatus();
+    }
+    return Result;
+}
+
+std::string NanaBox::HeadlessHost::FormatStatus()
+{
+    std::string Result;
+
+    std::size_t ActiveCount = 0;
+    for (std::unique_ptr<NanaBox::HeadlessVirtualMachine> const& Current
+        : this->m_VirtualMachines)
+    {
+        std::string LastError;
+        std::string SaveStateFile;
+        {
+            std::lock_guard<std::mutex> Guard(Current->OperationLock);
+            LastError = Current->LastError;
+            SaveStateFile = Current->Configuration.SaveStateFile;
+            if (Current->Instance)
+            {
+                ++ActiveCount;
+            }
+        }
+
+        NanaBox::HeadlessVirtualMachineState State = Current->State;
+        const char* StateName = g_StateNames[static_cast<std::size_t>(State)];
+        if (State == NanaBox::HeadlessVirtualMachineState::Stopped &&
+            !SaveStateFile.empty())
+        {
+            StateName = "Saved";
+        }
+
+        Result += Mile::FormatString(
+            "%s\t%s\t%s\n",
+            Current->Name.c_str(),
+            StateName,
+            LastError.c_str());
+    }
+
+    // The overhead is measured as the private memory committed by this
+    // process since the host was created, which includes everything the host
+    // keeps for the virtual machines. The memory of the guests is
+    // owned by the worker processes and not counted here.
+    std::uint64_t PrivateUsage = ::GetCurrentProcessPrivateUsage();
+    std::uint64_t Overhead = PrivateUsage > this->m_BaselinePrivateUsage
+        ? PrivateUsage - this->m_BaselinePrivateUsage
+        : 0;
+    Result += Mile::FormatString(
+        "# PrivateUsage=%llu Baseline=%llu Active=%zu OverheadPerVirtualMachine=%llu\n",
+        PrivateUsage,
+        this->m_BaselinePrivateUsage,
+        ActiveCount,
+        ActiveCount ? Overhead / ActiveCount : 0);
+
+    return Result;
+}
+
+std::string NanaBox::HeadlessHost::ExecuteCommand(
+    std::string const& CommandLine,
+    bool& ExitRequested)
+{
+    std::lock_guard<std::mutex> Guard(this->m_CommandLock);
+
+    ExitRequested = false;
+
+    std::string Verb;
+    std::string Name;
+    {
+        std::size_t VerbStart = CommandLine.find_first_not_of(" \t");
+        if (VerbStart != std::string::npos)
+        {
+            std::size_t VerbEnd = CommandLine.find_first_of(" \t", VerbStart);
+            Verb = CommandLine.substr(VerbStart, VerbEnd - VerbStart);
+            if (VerbEnd != std::string::npos)
+            {
+                std::size_t NameStart =
+                    CommandLine.find_first_not_of(" \t", VerbEnd);
+                std::size_t NameEnd = CommandLine.find_last_not_of(" \t");
+                if (NameStart != std::string::npos)
+                {
+                    Name = CommandLine.substr(
+                        NameStart,
+                        NameEnd - NameStart + 1);
+                }
+            }
+        }
+    }
+
+    // The checkpoint commands take the checkpoint name before the name of
+    // the virtual machine, which may contain spaces.
+    bool IncludeMemoryState = false;
+    std::string CheckpointName;
+    if (0 == _stricmp(Verb.c_str(), "checkpoint") ||
+        0 == _stricmp(Verb.c_str(), "revert"))
+    {
+        CheckpointName = ::PopArgument(Name);
+        if (0 == _stricmp(CheckpointName.c_str(), "--Memory"))
+        {
+            IncludeMemoryState = true;
+            CheckpointName = ::PopArgument(Name);
+        }
+        if (CheckpointName.empty())
+        {
+            return "ERROR The checkpoint name is required.\n";
+        }
+    }
+
+    if (Name == "*" || 0 == _stricmp(Verb.c_str(), "exit"))
+    {
+        Name.clear();
+    }
+
+    if (0 == _stricmp(Verb.c_str(), "status"))
+    {
+        return "OK\n" + this->FormatStatus();
+    }
+
+    if (0 == _stricmp(Verb.c_str(), "pool"))
+    {
+        return "OK\n" + this->FormatPoolStatus();
+    }
+
+    if (0 == _stricmp(Verb.c_str(), "acquire"))
+    {
+        return this->AcquireVirtualMachine(Name);
+    }
+
+    std::vector<NanaBox::HeadlessVirtualMachine*> Targets =
+        this->SelectVirtualMachines(Name);
+    if (!Name.empty() && Targets.empty())
+    {
+        return "ERROR The virtual machine is not found.\n";
+    }
+
+    if (0 == _stricmp(Verb.c_str(), "timeline"))
+    {
+        return "OK\n" + this->m_LastStartupTimeline;
+    }
+
+    if (0 == _stricmp(Verb.c_str(), "checkpoints"))
+    {
+        return "OK\n" + this->FormatCheckpoints(Targets);
+    }
+
+    if (0 == _stricmp(Verb.c_str(), "start"))
+    {
+        try
+        {
+            this->m_LastStartupTimeline = this->StartVirtualMachines(Targets);
+        }
+        catch (std::exception const& ex)
+        {
+            return std::string("ERROR ") + ex.what() + "\n";
+        }
+
+        return "OK\n" + this->m_LastStartupTimeline + this->FormatStatus();
+    }
+
+    std::function<void(NanaBox::HeadlessVirtualMachine&)> Action;
+    if (0 == _stricmp(Verb.c_str(), "stop"))
+    {
+        Action = [this](NanaBox::HeadlessVirtualMachine& Target)
+        {
+            this->StopVirtualMachine(Target);
+        };
+    }
+    else if (0 == _stricmp(Verb.c_str(), "reload"))
+    {
+        Action = [this](NanaBox::HeadlessVirtualMachine& Target)
+        {
+            this->ReloadVirtualMachine(Target);
+        };
+    }
+    else if (0 == _stricmp(Verb.c_str(), "checkpoint"))
+    {
+        Action = [&](NanaBox::HeadlessVirtualMachine& Target)
+        {
+            this->CheckpointVirtualMachine(
+                Target,
+                CheckpointName,
+                IncludeMemoryState);
+        };
+    }
+    else if (0 == _stricmp(Verb.c_str(), "revert"))
+    {
+        Action = [&](NanaBox::HeadlessVirtualMachine& Target)
+        {
+            this->RevertVirtualMachine(Target, CheckpointName);
+        };
+    }
+    else if (0 != _stricmp(Verb.c_str(), "save") &&
+        0 != _stricmp(Verb.c_str(), "exit"))
+    {
+        return "ERROR The command is not supported.\n";
+    }
+
+    if (Action)
+    {
+        this->ParallelForEach(Targets, Action);
+    }
+    else
+    {
+        this->SaveVirtualMachines(Targets);
+    }
+
+    if (0 == _stricmp(Verb.c_str(), "exit"))
+    {
+        // Never exit with the virtual machines which failed to save, because
+        // they will be lost with this process.
+        for (NanaBox::HeadlessVirtualMachine* Target : Targets)
+        {
+            if (Target->State == NanaBox::HeadlessVirtualMachineState::Running)
+            {
+                return "ERROR Some virtual machines failed to save.\n" +
+                    this->FormatStatus();
+            }
+        }
+
+        ExitRequested = true;
+    }
+
+    return "OK\n" + this->FormatStatus();
+}
+
+void NanaBox::HeadlessHost::Run(
+    std::wstring const& PipeName)
+{
+    bool ExitRequested = false;
+    this->ExecuteCommand("start", ExitRequested);
+
+    // The headless host has no window, so a hidden top level window is
+    // created to receive the session end notifications.
+    winrt::handle(Mile::CreateThread([this]()
+    {
+        WNDCLASSEXW WindowClass = { 0 };
+        WindowClass.cbSize = sizeof(WNDCLASSEXW);
+        WindowClass.lpfnWndProc = ::SessionEndWindowCallback;
+        WindowClass.hInstance = ::GetModuleHandleW(nullptr);
+        WindowClass.lpszClassName = L"NanaBox.Headless.SessionEnd";
+        if (!::RegisterClassExW(&WindowClass))
+        {
+            return;
+        }
+
+        HWND WindowHandle = ::CreateWindowExW(
+            0,
+            WindowClass.lpszClassName,
+            L"NanaBox Headless",
+            WS_OVERLAPPED,
+            0,
+            0,
+            0,
+            0,
+            nullptr,
+            nullptr,
+            WindowClass.hInstance,
+            this);
+        if (!WindowHandle)
+        {
+            return;
+        }
+
+        MSG Message;
+        while (::GetMessageW(&Message, nullptr, 0, 0))
+        {
+            ::TranslateMessage(&Message);
+            ::DispatchMessageW(&Message);
+        }
+    }));
+
+    // The pipe instance is kept until the host exits and reused for every
+    // client, so the pipe name is never released to other users. The output
+    // buffer is not reserved, so a write is only completed after the client
+    // has read the whole response, and disconnecting never discards it.
+    winrt::file_handle PipeHandle = ::CreateLocalNamedPipe(
+        PipeName,
+        PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+        0,
+        4 * 1024);
+    winrt::check_bool(static_cast<bool>(PipeHandle));
+
+    winrt::handle CompletionEvent = winrt::handle(::CreateEventExW(
+        nullptr,
+        nullptr,
+        CREATE_EVENT_MANUAL_RESET,
+        EVENT_ALL_ACCESS));
+    winrt::check_bool(static_cast<bool>(CompletionEvent));
+
+    OVERLAPPED Overlapped = { 0 };
+    auto ResetOverlapped = [&]()
+    {
+        ::ResetEvent(CompletionEvent.get());
+        Overlapped = { 0 };
+        Overlapped.hEvent = CompletionEvent.get();
+    };
+
+    while (!ExitRequested)
+    {
+        ResetOverlapped();
+        BOOL Connected = ::ConnectNamedPipe(PipeHandle.get(), &Overlapped);
+        if (!Connected && ERROR_PIPE_CONNECTED == ::GetLastError())
+        {
+            Connected = TRUE;
+            ::SetEvent(CompletionEvent.get());
+        }
+        if (!::WaitForOverlappedOperation(
+            PipeHandle.get(),
+            &Overlapped,
+            Connected,
+            INFINITE))
+        {
+            ::DisconnectNamedPipe(PipeHandle.get());
+            continue;
+        }
+
+        // Each connection carries one command line and its response, and
+        // the clients which stop sending or reading are disconnected after
+        // the timeout instead of blocking the host forever.
+        std::string CommandLine;
+        {
+            char Buffer[256];
+            DWORD NumberOfBytesRead = 0;
+            for (;;)
+            {
+                if (CommandLine.size() >= 4096)
+                {
+                    break;
+                }
+
+                ResetOverlapped();
+                if (!::WaitForOverlappedOperation(
+                    PipeHandle.get(),
+                    &Overlapped,
+                    ::ReadFile(
+                        PipeHandle.get(),
+                        Buffer,
+                        sizeof(Buffer),
+                        nullptr,
+                        &Overlapped),
+                    g_ControlPipeClientTimeout,
+                    &NumberOfBytesRead) || !NumberOfBytesRead)
+                {
+                    break;
+                }
+
+                CommandLine.append(Buffer, NumberOfBytesRead);
+                if (std::string::npos != CommandLine.find('\n'))
+                {
+                    break;
+                }
+            }
+
+            std::size_t LineEnd = CommandLine.find_first_of("\r\n");
+            if (std::string::npos != LineEnd)
+            {
+                CommandLine.resize(LineEnd);
+            }
+        }
+
+        std::string Response = this->ExecuteCommand(
+            CommandLine,
+            ExitRequested);
+
+        ResetOverlapped();
+        ::WaitForOverlappedOperation(
+            PipeHandle.get(),
+            &Overlapped,
+            ::WriteFile(
+                PipeHandle.get(),
+                Response.c_str(),
+                static_cast<DWORD>(Response.size()),
+                nullptr,
+                &Overlapped),
+            g_ControlPipeClientTimeout);
+        ::DisconnectNamedPipe(PipeHandle.get());
+    }
+}
@@ -0,0 +1,193 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      HeadlessHost.h
+ * PURPOSE:   Definition for the Headless Virtual Machine Host
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_HEADLESS_HOST
+#define NANABOX_HEADLESS_HOST
+
+#include "VirtualMachineLifecycle.h"
+#include "DependencyScheduler.h"
+#include "VirtualMachinePool.h"
+#include "VirtualMachineCheckpoint.h"
+#include "VirtualMachineStatistics.h"
+#include "MetricsExporter.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace NanaBox
+{
+    enum class HeadlessVirtualMachineState : std::uint32_t
+    {
+        Stopped = 0,
+        Starting = 1,
+        Running = 2,
+        Saving = 3,
+        Stopping = 4,
+        Failed = 5,
+    };
+
+    struct HeadlessVirtualMachine
+    {
+        std::wstring ConfigurationFilePath;
+        std::wstring BaseDirectory;
+        std::string Name;
+        // Acquired from a pool, the generated name is not used again after
+        // the virtual machine is stopped.
+        bool Pooled = false;
+        std::atomic<HeadlessVirtualMachineState> State =
+            HeadlessVirtualMachineState::Stopped;
+
+        // Serializes the operations of the virtual machine, and protects the
+        // members below.
+        std::mutex OperationLock;
+        std::string LastError;
+        VirtualMachineConfiguration Configuration;
+        std::chrono::steady_clock::duration PreparationTime =
+            std::chrono::steady_clock::duration::zero();
+
+        // Only created if the metrics are enabled, the exporter is kept
+        // after the virtual machine is stopped like the normal mode, and the
+        // sampler is recreated for each instance.
+        std::unique_ptr<MetricsExporter> Exporter;
+        std::unique_ptr<VirtualMachineStatisticsSampler> StatisticsSampler;
+
+        // Declared last, so the compute system is closed before the other
+        // members used by its event handlers are destroyed.
+        winrt::com_ptr<ComputeSystem> Instance;
+    };
+
+    // Hosts multiple virtual machines in the current process without the
+    // Remote Desktop client and the user interface. The virtual machines are
+    // started as a dependency graph with at most MaxParallelism operations in
+    // flight, the other operations of different virtual machines run
+    // concurrently on the system thread pool, and the host is controlled by
+    // text commands via a local named pipe. The configurations with the pool
+    // settings are used as the templates of the pre-warmed pools instead.
+    class HeadlessHost
+    {
+    public:
+
+        HeadlessHost(
+            std::vector<std::wstring> const& ConfigurationFilePaths,
+            std::size_t MaxParallelism);
+
+        HeadlessHost(
+            HeadlessHost const&) = delete;
+
+        HeadlessHost& operator=(
+            HeadlessHost const&) = delete;
+
+        // Returns the response of the command, the first line of it is "OK"
+        // or starts with "ERROR".
+        std::string ExecuteCommand(
+            std::string const& CommandLine,
+            bool& ExitRequested);
+
+        // Starts all virtual machines, then serves the control commands until
+        // the exit command succeeds.
+        void Run(
+            std::wstring const& PipeName);
+
+        // Saves all running virtual machines when the session of the host is
+        // ending. Returns false to prevent the session end if any of them
+        // doesn't enable SaveOnSessionEnd or fails to be saved.
+        bool SaveVirtualMachinesOnSessionEnd();
+
+    private:
+
+        std::vector<std::unique_ptr<HeadlessVirtualMachine>> m_VirtualMachines;
+        std::vector<std::unique_ptr<VirtualMachinePool>> m_Pools;
+        std::size_t m_MaxParallelism;
+        std::uint64_t m_BaselinePrivateUsage = 0;
+        std::string m_LastStartupTimeline;
+
+        // Serializes the commands from the named pipe and the session end.
+        std::mutex m_CommandLock;
+
+        std::vector<HeadlessVirtualMachine*> SelectVirtualMachines(
+            std::string const& Name);
+
+        void ParallelForEach(
+            std::vector<HeadlessVirtualMachine*> const& Targets,
+            std::function<void(HeadlessVirtualMachine&)> const& Action);
+
+        // Rereads the configuration of the virtual machine which is not
+        // running, so the changes of it are used in the next start.
+        void LoadConfiguration(
+            HeadlessVirtualMachine& Target);
+
+        void PrepareVirtualMachine(
+            HeadlessVirtualMachine& Target);
+
+        void LaunchVirtualMachine(
+            HeadlessVirtualMachine& Target);
+
+        // Returns the startup timeline.
+        std::string StartVirtualMachines(
+            std::vector<HeadlessVirtualMachine*> const& Targets);
+
+        void StopVirtualMachine(
+            HeadlessVirtualMachine& Target);
+
+        void SaveVirtualMachine(
+            HeadlessVirtualMachine& Target);
+
+        // Saving writes the whole memory of the guests to the disks, so at
+        // most MaxParallelism virtual machines are saved at the same time,
+        // and only one of them per volume holding the save state files.
+        void SaveVirtualMachines(
+            std::vector<HeadlessVirtualMachine*> const& Targets);
+
+        void ReloadVirtualMachine(
+            HeadlessVirtualMachine& Target);
+
+        // Prepares and launches the virtual machine again after it is stopped
+        // by the checkpoint operations, the error of the checkpoint operation
+        // is kept if there is.
+        void RelaunchVirtualMachine(
+            HeadlessVirtualMachine& Target);
+
+        // A running virtual machine is saved and restored around the switch
+        // of the disks.
+        void CheckpointVirtualMachine(
+            HeadlessVirtualMachine& Target,
+            std::string const& CheckpointName,
+            bool IncludeMemoryState);
+
+        // A running virtual machine is powered off before reverting, and it
+        // is restored from the memory state of the checkpoint if there is,
+        // otherwise started from the disks of the checkpoint.
+        void RevertVirtualMachine(
+            HeadlessVirtualMachine& Target,
+            std::string const& CheckpointName);
+
+        std::string FormatCheckpoints(
+            std::vector<HeadlessVirtualMachine*> const& Targets);
+
+        // Takes an instance from the pool and starts it as a new virtual
+        // machine of the host, returns the response of the command.
+        std::string AcquireVirtualMachine(
+            std::string const& PoolName);
+
+        std::string FormatStatus();
+
+        std::string FormatPoolStatus();
+    };
+
+    std::wstring GetHeadlessPipeName(
+        std::wstring const& InstanceName);
+}
+
+#endif // !NANABOX_HEADLESS_HOST
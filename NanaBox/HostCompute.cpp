@@ -54,6 +54,16 @@ namespace winrt
 
 namespace
 {
+    NanaBox::HcsOperation CreateOperation()
+    {
+        NanaBox::HcsOperation Result;
+        Result.attach(::HcsCreateOperation(
+            nullptr,
+            nullptr));
+        winrt::check_pointer(Result.get());
+        return Result;
+    }
+
     winrt::hstring WaitForOperationResult(
         NanaBox::HcsOperation const& Operation)
     {
@@ -122,23 +132,24 @@ namespace
 
 NanaBox::ComputeSystem::ComputeSystem(
     winrt::hstring const& Id,
-    winrt::hstring const& Configuration)
+    winrt::hstring const& Configuration) :
+    m_Metrics(NanaBox::GetVirtualMachineMetrics(winrt::to_string(Id)))
 {
-    this->m_Operation.attach(::HcsCreateOperation(
-        nullptr,
-        nullptr));
-    winrt::check_pointer(
-        this->m_Operation.get());
+    NanaBox::HcsCallMeasurement Measurement(
+        this->m_Metrics.get(),
+        NanaBox::HcsCallType::Create);
+
+    NanaBox::HcsOperation Operation = ::CreateOperation();
 
     winrt::check_hresult(::HcsCreateComputeSystem(
         Id.c_str(),
         Configuration.c_str(),
-        this->m_Operation.get(),
+        Operation.get(),
         nullptr,
         this->m_ComputeSystem.put()));
 
     ::WaitForOperationResult(
-        this->m_Operation);
+        Operation);
 
     winrt::check_hresult(::HcsSetComputeSystemCallback(
         this->m_ComputeSystem.get(),
@@ -148,13 +159,12 @@ NanaBox::ComputeSystem::ComputeSystem(
 }
 
 NanaBox::ComputeSystem::ComputeSystem(
-    winrt::hstring const& Id)
+    winrt::hstring const& Id) :
+    m_Metrics(NanaBox::GetVirtualMachineMetrics(winrt::to_string(Id)))
 {
-    this->m_Operation.attach(::HcsCreateOperation(
-        nullptr,
-        nullptr));
-    winrt::check_pointer(
-        this->m_Operation.get());
+    NanaBox::HcsCallMeasurement Measurement(
+        this->m_Metrics.get(),
+        NanaBox::HcsCallType::Open);
 
     winrt::check_hresult(::HcsOpenComputeSystem(
         Id.c_str(),
@@ -170,95 +180,143 @@ NanaBox::ComputeSystem::ComputeSystem(
 
 void NanaBox::ComputeSystem::Start()
 {
+    NanaBox::HcsCallMeasurement Measurement(
+        this->m_Metrics.get(),
+        NanaBox::HcsCallType::Start);
+
+    NanaBox::HcsOperation Operation = ::CreateOperation();
+
     winrt::check_hresult(::HcsStartComputeSystem(
         this->m_ComputeSystem.get(),
-        this->m_Operation.get(),
+        Operation.get(),
         nullptr));
 
     ::WaitForOperationResult(
-        this->m_Operation);
+        Operation);
 }
 
 void NanaBox::ComputeSystem::Shutdown()
 {
+    NanaBox::HcsCallMeasurement Measurement(
+        this->m_Metrics.get(),
+        NanaBox::HcsCallType::Shutdown);
+
+    NanaBox::HcsOperation Operation = ::CreateOperation();
+
     winrt::check_hresult(::HcsShutDownComputeSystem(
         this->m_ComputeSystem.get(),
-        this->m_Operation.get(),
+        Operation.get(),
         nullptr));
 
     ::WaitForOperationResult(
-        this->m_Operation);
+        Operation);
 }
 
 void NanaBox::ComputeSystem::Terminate()
 {
+    NanaBox::HcsCallMeasurement Measurement(
+        this->m_Metrics.get(),
+        NanaBox::HcsCallType::Terminate);
+
+    NanaBox::HcsOperation Operation = ::CreateOperation();
+
     winrt::check_hresult(::HcsTerminateComputeSystem(
         this->m_ComputeSystem.get(),
-        this->m_Operation.get(),
+        Operation.get(),
         nullptr));
 
     ::WaitForOperationResult(
-        this->m_Operation);
+        Operation);
 }
 
 void NanaBox::ComputeSystem::Pause(
     winrt::hstring const& Options)
 {
+    NanaBox::HcsCallMeasurement Measurement(
+        this->m_Metrics.get(),
+        NanaBox::HcsCallType::Pause);
+
+    NanaBox::HcsOperation Operation = ::CreateOperation();
+
     winrt::check_hresult(::HcsPauseComputeSystem(
         this->m_ComputeSystem.get(),
-        this->m_Operation.get(),
+        Operation.get(),
         Options.empty() ? nullptr : Options.c_str()));
 
     ::WaitForOperationResult(
-        this->m_Operation);
+        Operation);
 }
 
 void NanaBox::ComputeSystem::Resume()
 {
+    NanaBox::HcsCallMeasurement Measurement(
+        this->m_Metrics.get(),
+        NanaBox::HcsCallType::Resume);
+
+    NanaBox::HcsOperation Operation = ::CreateOperation();
+
     winrt::check_hresult(::HcsResumeComputeSystem(
         this->m_ComputeSystem.get(),
-        this->m_Operation.get(),
+        Operation.get(),
         nullptr));
 
     ::WaitForOperationResult(
-        this->m_Operation);
+        Operation);
 }
 
 void NanaBox::ComputeSystem::Save(
     winrt::hstring const& Options)
 {
+    NanaBox::HcsCallMeasurement Measurement(
+        this->m_Metrics.get(),
+        NanaBox::HcsCallType::Save);
+
+    NanaBox::HcsOperation Operation = ::CreateOperation();
+
     winrt::check_hresult(::HcsSaveComputeSystem(
         this->m_ComputeSystem.get(),
-        this->m_Operation.get(),
+        Operation.get(),
         Options.empty() ? nullptr : Options.c_str()));
 
     ::WaitForOperationResult(
-        this->m_Operation);
+        Operation);
 }
 
 winrt::hstring NanaBox::ComputeSystem::GetProperties(
     winrt::hstring const& PropertyQuery)
 {
+    NanaBox::HcsCallMeasurement Measurement(
+        this->m_Metrics.get(),
+        NanaBox::HcsCallType::GetProperties);
+
+    NanaBox::HcsOperation Operation = ::CreateOperation();
+
     winrt::check_hresult(::HcsGetComputeSystemProperties(
         this->m_ComputeSystem.get(),
-        this->m_Operation.get(),
+        Operation.get(),
         PropertyQuery.empty() ? nullptr : PropertyQuery.c_str()));
 
     return ::WaitForOperationResult(
-        this->m_Operation);
+        Operation);
 }
 
 void NanaBox::ComputeSystem::Modify(
     winrt::hstring const& Configuration)
 {
+    NanaBox::HcsCallMeasurement Measurement(
+        this->m_Metrics.get(),
+        NanaBox::HcsCallType::Modify);
+
+    NanaBox::HcsOperation Operation = ::CreateOperation();
+
     winrt::check_hresult(::HcsModifyComputeSystem(
         this->m_ComputeSystem.get(),
-        this->m_Operation.get(),
+        Operation.get(),
         Configuration.c_str(),
         nullptr));
 
     ::WaitForOperationResult(
-        this->m_Operation);
+        Operation);
 }
 
 void CALLBACK NanaBox::ComputeSystem::ComputeSystemCallback(
@@ -371,6 +429,22 @@ void NanaBox::HcnDeleteEndpoint(
         RawErrorRecord);
 }
 
+NanaBox::HcnEndpoint NanaBox::HcnOpenEndpoint(
+    winrt::guid const& EndpointId)
+{
+    NanaBox::HcnEndpoint Result;
+
+    winrt::cotaskmem_string RawErrorRecord;
+    ::CheckHcnCall(
+        ::HcnOpenEndpoint(
+            EndpointId,
+            Result.put(),
+            RawErrorRecord.put()),
+        RawErrorRecord);
+
+    return Result;
+}
+
 winrt::hstring NanaBox::HcnQueryEndpointProperties(
     NanaBox::HcnEndpoint const& EndpointHandle,
     winrt::hstring const& Query)
@@ -25,6 +25,8 @@
 
 #include <Mile.Helpers.CppWinRT.h>
 
+#include "Metrics.h"
+
 namespace NanaBox
 {
     struct HcsOperationTraits
@@ -131,8 +133,8 @@ namespace NanaBox
 
     private:
 
-        HcsOperation m_Operation;
         HcsSystem m_ComputeSystem;
+        std::shared_ptr<VirtualMachineMetrics> m_Metrics;
 
         static void CALLBACK ComputeSystemCallback(
             HCS_EVENT* Event,
@@ -156,6 +158,9 @@ namespace NanaBox
     void HcnDeleteEndpoint(
         winrt::guid const& EndpointId);
 
+    HcnEndpoint HcnOpenEndpoint(
+        winrt::guid const& EndpointId);
+
     winrt::hstring HcnQueryEndpointProperties(
         HcnEndpoint const& EndpointHandle,
         winrt::hstring const& Query = winrt::hstring());
@@ -15,8 +15,6 @@
 
 #include "Utils.h"
 
-#include <map>
-
 #include "NanaBoxResources.h"
 
 namespace winrt
@@ -73,6 +71,8 @@ int NanaBox::MainWindow::OnCreate(
         winrt::check_hresult(this->m_PlatformContext->InitializeInstance());
         this->m_RdpNamedPipeCallbacks =
             winrt::make<NanaBox::RdpNamedPipeCallbacks>(this);
+        this->m_RdpPreparedNamedPipeCallbacks =
+            winrt::make<NanaBox::RdpNamedPipeCallbacks>(this, true);
 
         this->RdpClientInitialize();
     }
@@ -97,8 +97,7 @@ void NanaBox::MainWindow::OnCommand(
     {
     case NanaBox::MainWindowCommands::EnterBasicSession:
     {
-        this->m_RdpClientMode = RdpClientMode::BasicSession;
-        this->m_NeedRdpClientModeChange = true;
+        this->RdpClientBeginSessionSwitch(RdpClientMode::BasicSession);
 
         this->m_RdpClient->Disconnect();
 
@@ -106,8 +105,7 @@ void NanaBox::MainWindow::OnCommand(
     }
     case NanaBox::MainWindowCommands::EnterEnhancedSession:
     {
-        this->m_RdpClientMode = RdpClientMode::EnhancedSession;
-        this->m_NeedRdpClientModeChange = true;
+        this->RdpClientBeginSessionSwitch(RdpClientMode::EnhancedSession);
 
         this->m_RdpClient->Disconnect();
 
@@ -146,12 +144,20 @@ void NanaBox::MainWindow::OnCommand(
     }
     case NanaBox::MainWindowCommands::RestartVirtualMachine:
     {
+        std::chrono::steady_clock::time_point StartTime =
+            std::chrono::steady_clock::now();
+
         this->m_VirtualMachineRestarting = true;
+        this->m_StatisticsSampler = nullptr;
         this->m_VirtualMachine->Terminate();
         this->m_VirtualMachine = nullptr;
 
         this->InitializeVirtualMachine();
 
+        this->m_Metrics->RecordLifecycle(
+            NanaBox::LifecyclePhase::Restart,
+            std::chrono::steady_clock::now() - StartTime);
+
         break;
     }
     case NanaBox::MainWindowCommands::VirtualMachineSettings:
@@ -218,7 +224,22 @@ void NanaBox::MainWindow::OnCommand(
     }
     case NanaBox::MainWindowCommands::ResizeVirtualHardDisk:
     {
-        ::ShowResizeVirtualHardDiskDialog(this->m_hWnd);
+        // The disks of the running virtual machine can be expanded as well,
+        // and the guest is notified after that.
+        winrt::com_ptr<NanaBox::ComputeSystem> Instance =
+            this->m_VirtualMachine;
+        std::vector<NanaBox::ScsiDeviceConfiguration> ScsiDevices =
+            this->m_Configuration.ScsiDevices;
+        ::ShowResizeVirtualHardDiskDialog(
+            this->m_hWnd,
+            [Instance, ScsiDevices](
+                std::wstring const& Path)
+        {
+            NanaBox::NotifyVirtualMachineDiskResized(
+                Instance,
+                ScsiDevices,
+                Path);
+        });
 
         break;
     }
@@ -250,44 +271,11 @@ void NanaBox::MainWindow::OnTimer(
 {
     if (nIDEvent == NanaBox::MainWindowTimerEvents::SyncDisplaySettings)
     {
-        if (this->m_RdpClientMode != RdpClientMode::EnhancedVideoSyncedSession)
-        {
-            return;
-        }
+        this->KillTimer(
+            NanaBox::MainWindowTimerEvents::SyncDisplaySettings);
+        ++this->m_Metrics->DisplaySyncWakeups;
 
-        UINT64 CurrentCheckPoint = ::GetTickCount64();
-        if (this->m_SyncDisplaySettingsCheckPoint > CurrentCheckPoint)
-        {
-            return;
-        }
-        else
-        {
-            this->m_SyncDisplaySettingsCheckPoint = CurrentCheckPoint + 200;
-        }
-
-        CSize DisplayResolution = this->m_RecommendedDisplayResolution;
-        if (this->m_DisplayResolution == DisplayResolution)
-        {
-            return;
-        }
-
-        try
-        {
-            this->m_RdpClient->UpdateSessionDisplaySettings(
-                DisplayResolution.cx,
-                DisplayResolution.cy,
-                DisplayResolution.cx,
-                DisplayResolution.cy,
-                0,
-                this->m_RecommendedZoomLevel,
-                100);
-
-            this->m_DisplayResolution = DisplayResolution;
-        }
-        catch (...)
-        {
-
-        }
+        this->SyncDisplaySettings();
     }
 }
 
@@ -366,6 +354,32 @@ void NanaBox::MainWindow::OnSize(
             L"ZoomLevel",
             RawZoomLevel);
     }
+
+    this->ScheduleSyncDisplaySettings();
+}
+
+LRESULT NanaBox::MainWindow::OnDpiChanged(
+    UINT uMsg,
+    WPARAM wParam,
+    LPARAM lParam,
+    BOOL& bHandled)
+{
+    UNREFERENCED_PARAMETER(uMsg);
+    UNREFERENCED_PARAMETER(lParam);
+
+    // The superclass resizes the window to the suggested rectangle, which
+    // doesn't send WM_SIZE if the size in pixels is not changed, so only
+    // the zoom level is updated here.
+    bHandled = FALSE;
+
+    this->m_RecommendedZoomLevel = ::MulDiv(
+        100,
+        HIWORD(wParam),
+        USER_DEFAULT_SCREEN_DPI);
+
+    this->ScheduleSyncDisplaySettings();
+
+    return 0;
 }
 
 void NanaBox::MainWindow::OnSetFocus(
@@ -420,65 +434,21 @@ void NanaBox::MainWindow::OnClose()
     {
     case winrt::NanaBox::ExitConfirmationStatus::Suspend:
     {
-        // Temporarily disable the GPU-PV settings because virtual machine
-        // doen't support save the state when GPU-PV is enabled.
-        NanaBox::GpuConfiguration Gpu;
-        Gpu.AssignmentMode = NanaBox::GpuAssignmentMode::Disabled;
-        NanaBox::ComputeSystemUpdateGpu(this->m_VirtualMachine, Gpu);
-
-        this->m_VirtualMachine->Pause();
-
-        if (this->m_Configuration.SaveStateFile.empty())
-        {
-            this->m_Configuration.SaveStateFile =
-                this->m_Configuration.Name + ".SaveState.vmrs";
-        }
-
-        std::wstring SaveStateFile = ::GetAbsolutePath(Mile::ToWideString(
-            CP_UTF8, this->m_Configuration.SaveStateFile));
-
-        ::MileDeleteFileIgnoreReadonlyAttribute(SaveStateFile.c_str());
-
-        nlohmann::json Options;
-        Options["SaveType"] = "ToFile";
-        Options["SaveStateFilePath"] = winrt::to_string(SaveStateFile.c_str());
-
         try
         {
-            this->m_VirtualMachine->Save(winrt::to_hstring(Options.dump()));
+            this->SuspendVirtualMachine();
         }
         catch (winrt::hresult_error const& ex)
         {
-            ::MileDeleteFileIgnoreReadonlyAttribute(SaveStateFile.c_str());
-
-            this->m_Configuration.SaveStateFile.clear();
-
             ::ShowErrorMessageDialog(ex);
         }
 
-        if (this->m_Configuration.SaveStateFile.empty())
-        {
-            this->m_VirtualMachine->Resume();
-
-            NanaBox::ComputeSystemUpdateGpu(
-                this->m_VirtualMachine,
-                this->m_Configuration.Gpu);
-        }
-        else
-        {
-            this->m_VirtualMachine->Terminate();
-
-            std::string ConfigurationFileContent =
-                NanaBox::SerializeConfiguration(this->m_Configuration);
-            ::WriteAllTextToUtf8TextFile(
-                this->m_ConfigurationFilePath,
-                ConfigurationFileContent);
-        }
-
         break;
     }
     case winrt::NanaBox::ExitConfirmationStatus::PowerOff:
     {
+        this->m_StatisticsSampler = nullptr;
+
         this->m_VirtualMachine->Pause();
         this->m_VirtualMachine->Terminate();
 
@@ -502,138 +472,100 @@ BOOL NanaBox::MainWindow::OnQueryEndSession(
     UNREFERENCED_PARAMETER(nSource);
     UNREFERENCED_PARAMETER(uLogOff);
 
+    if (!this->m_VirtualMachineRunning)
+    {
+        return TRUE;
+    }
+
     ::ShutdownBlockReasonCreate(
         this->m_hWnd,
         Mile::WinRT::GetLocalizedString(
             L"ExitConfirmationPage/GridTitleTextBlock/Text").c_str());
 
-    // Notify the OS to prevent shut down because shut down automatically
-    // without exiting NanaBox may corrupt the user's virtual machine.
-    return FALSE;
+    if (!this->m_Configuration.SaveOnSessionEnd)
+    {
+        // Notify the OS to prevent shut down because shut down automatically
+        // without exiting NanaBox may corrupt the user's virtual machine.
+        return FALSE;
+    }
+
+    // Save the virtual machine before answering, so the session only ends
+    // after the save is completed, and the OS shows the reason meanwhile.
+    // The session end is still prevented if the save fails because the
+    // virtual machine keeps running.
+    try
+    {
+        this->SuspendVirtualMachine();
+    }
+    catch (...)
+    {
+        ::ShowErrorMessageDialog(Mile::WinRT::ToHResultError());
+        return FALSE;
+    }
+
+    ::ShutdownBlockReasonDestroy(this->m_hWnd);
+    return TRUE;
 }
 
-void NanaBox::MainWindow::InitializeVirtualMachine()
+void NanaBox::MainWindow::OnEndSession(
+    BOOL bEnding,
+    UINT uLogOff)
 {
-    std::string ConfigurationFileContent = ::ReadAllTextFromUtf8TextFile(
-        this->m_ConfigurationFilePath);
+    UNREFERENCED_PARAMETER(bEnding);
+    UNREFERENCED_PARAMETER(uLogOff);
 
-    this->m_Configuration = NanaBox::DeserializeConfiguration(
-        ConfigurationFileContent);
+    ::ShutdownBlockReasonDestroy(this->m_hWnd);
+}
 
-    {
-        bool VirtualMachineExisted = true;
-        try
-        {
-            winrt::make_self<NanaBox::ComputeSystem>(
-                winrt::to_hstring(
-                    this->m_Configuration.Name));
-        }
-        catch (...)
-        {
-            VirtualMachineExisted = false;
-        }
+void NanaBox::MainWindow::SuspendVirtualMachine()
+{
+    std::chrono::steady_clock::time_point StartTime =
+        std::chrono::steady_clock::now();
 
-        if (VirtualMachineExisted)
-        {
-            winrt::throw_hresult(HCS_E_SYSTEM_ALREADY_EXISTS);
-        }
-    }
+    this->m_StatisticsSampler = nullptr;
 
-    for (NanaBox::ScsiDeviceConfiguration& ScsiDevice
-        : this->m_Configuration.ScsiDevices)
-    {
-        if (ScsiDevice.Type == NanaBox::ScsiDeviceType::PhysicalDevice)
-        {
-            break;
-        }
+    NanaBox::SaveVirtualMachine(
+        this->m_VirtualMachine,
+        this->m_Configuration);
 
-        std::wstring Path = ::GetAbsolutePath(Mile::ToWideString(
-            CP_UTF8, ScsiDevice.Path));
-        if (::PathFileExistsW(Path.c_str()))
-        {
-            winrt::check_hresult(::HcsGrantVmAccess(
-                winrt::to_hstring(this->m_Configuration.Name).c_str(),
-                Path.c_str()));
-        }
-    }
+    this->m_VirtualMachine->Terminate();
 
-    if (this->m_Configuration.GuestStateFile.empty())
-    {
-        this->m_Configuration.GuestStateFile =
-            this->m_Configuration.Name + ".vmgs";
-    }
-    {
-        std::wstring GuestStateFile = ::GetAbsolutePath(Mile::ToWideString(
-            CP_UTF8, this->m_Configuration.GuestStateFile));
-        if (!::PathFileExistsW(GuestStateFile.c_str()))
-        {
-            winrt::check_hresult(::HcsCreateEmptyGuestStateFile(
-                GuestStateFile.c_str()));
-        }
+    std::string ConfigurationFileContent =
+        NanaBox::SerializeConfiguration(this->m_Configuration);
+    ::ReplaceAllTextInUtf8TextFile(
+        this->m_ConfigurationFilePath,
+        ConfigurationFileContent);
 
-        winrt::check_hresult(::HcsGrantVmAccess(
-            winrt::to_hstring(this->m_Configuration.Name).c_str(),
-            GuestStateFile.c_str()));
-    }
+    this->m_Metrics->RecordLifecycle(
+        NanaBox::LifecyclePhase::Save,
+        std::chrono::steady_clock::now() - StartTime);
+}
 
-    if (this->m_Configuration.RuntimeStateFile.empty())
-    {
-        this->m_Configuration.RuntimeStateFile =
-            this->m_Configuration.Name + ".vmrs";
-    }
-    {
-        std::wstring RuntimeStateFile = ::GetAbsolutePath(Mile::ToWideString(
-            CP_UTF8, this->m_Configuration.RuntimeStateFile));
-        if (!::PathFileExistsW(RuntimeStateFile.c_str()))
-        {
-            winrt::check_hresult(::HcsCreateEmptyRuntimeStateFile(
-                RuntimeStateFile.c_str()));
-        }
+void NanaBox::MainWindow::InitializeVirtualMachine()
+{
+    std::chrono::steady_clock::time_point StartTime =
+        std::chrono::steady_clock::now();
 
-        winrt::check_hresult(::HcsGrantVmAccess(
-            winrt::to_hstring(this->m_Configuration.Name).c_str(),
-            RuntimeStateFile.c_str()));
-    }
+    std::string ConfigurationFileContent = ::ReadAllTextFromUtf8TextFile(
+        this->m_ConfigurationFilePath);
 
-    if (!this->m_Configuration.SaveStateFile.empty())
-    {
-        std::wstring SaveStateFile = ::GetAbsolutePath(Mile::ToWideString(
-            CP_UTF8, this->m_Configuration.SaveStateFile));
-        if (::PathFileExistsW(SaveStateFile.c_str()))
-        {
-            winrt::check_hresult(::HcsGrantVmAccess(
-                winrt::to_hstring(this->m_Configuration.Name).c_str(),
-                SaveStateFile.c_str()));
-        }
-    }
+    this->m_Configuration = NanaBox::DeserializeConfiguration(
+        ConfigurationFileContent);
 
-    if (!this->m_Configuration.NetworkAdapters.empty())
-    {
-        for (NanaBox::NetworkAdapterConfiguration& NetworkAdapter
-            : this->m_Configuration.NetworkAdapters)
-        {
-            NanaBox::ComputeNetworkDeleteEndpoint(NetworkAdapter);
-            if (NetworkAdapter.Connected)
-            {
-                try
-                {
-                    NanaBox::ComputeNetworkCreateEndpoint(
-                        this->m_Configuration.Name,
-                        NetworkAdapter);
-                }
-                catch (...)
-                {
-
-                }
-            }
-        }
-    }
+    this->m_Metrics = NanaBox::GetVirtualMachineMetrics(
+        this->m_Configuration.Name);
+    this->m_RdpSessionTelemetry =
+        std::make_unique<NanaBox::RdpSessionTelemetry>(this->m_Metrics.get());
+    this->InitializeMetricsExporter();
+
+    NanaBox::LifecyclePhase Phase = this->m_Configuration.SaveStateFile.empty()
+        ? NanaBox::LifecyclePhase::Initialize
+        : NanaBox::LifecyclePhase::Restore;
 
-    this->m_VirtualMachine = winrt::make_self<NanaBox::ComputeSystem>(
-        winrt::to_hstring(
-            this->m_Configuration.Name),
-        winrt::to_hstring(
-            NanaBox::MakeHcsConfiguration(this->m_Configuration)));
+    NanaBox::PrepareVirtualMachine(this->m_Configuration);
+
+    this->m_VirtualMachine = NanaBox::CreateVirtualMachine(
+        this->m_Configuration);
 
     this->m_VirtualMachine->SystemExited.add([this](
         winrt::hstring const& EventData)
@@ -657,27 +589,15 @@ void NanaBox::MainWindow::InitializeVirtualMachine()
         this->m_EnableEnhancedMode = !this->m_EnableEnhancedMode;
     });*/
 
-    this->m_VirtualMachine->Start();
-
-    NanaBox::ComputeSystemUpdateGpu(
+    NanaBox::StartVirtualMachine(
         this->m_VirtualMachine,
-        this->m_Configuration.Gpu);
+        this->m_Configuration);
 
     this->m_VirtualMachineRunning = true;
 
-    if (!this->m_Configuration.SaveStateFile.empty())
-    {
-        std::wstring SaveStateFile = ::GetAbsolutePath(Mile::ToWideString(
-            CP_UTF8, this->m_Configuration.SaveStateFile));
-
-        ::MileDeleteFileIgnoreReadonlyAttribute(SaveStateFile.c_str());
-
-        this->m_Configuration.SaveStateFile.clear();
-    }
-
     ConfigurationFileContent =
         NanaBox::SerializeConfiguration(this->m_Configuration);
-    ::WriteAllTextToUtf8TextFile(
+    ::ReplaceAllTextInUtf8TextFile(
         this->m_ConfigurationFilePath,
         ConfigurationFileContent);
 
@@ -689,294 +609,115 @@ void NanaBox::MainWindow::InitializeVirtualMachine()
         L"%s - NanaBox",
         Mile::ToWideString(CP_UTF8, this->m_Configuration.Name).c_str());
     this->SetWindowTextW(this->m_WindowTitle.c_str());
-}
 
-void NanaBox::MainWindow::TryReloadVirtualMachine()
-{
-    std::string ConfigurationFileContent =
-        ::ReadAllTextFromUtf8TextFile(this->m_ConfigurationFilePath);
+    this->m_Metrics->RecordLifecycle(
+        Phase,
+        std::chrono::steady_clock::now() - StartTime);
 
-    NanaBox::VirtualMachineConfiguration Configuration =
-        NanaBox::DeserializeConfiguration(ConfigurationFileContent);
+    this->InitializeStatisticsSampler();
+}
 
-    if (this->m_Configuration.MemorySize != Configuration.MemorySize)
+void NanaBox::MainWindow::InitializeStatisticsSampler()
+{
+    // The statistics are informational only, so never fail the virtual
+    // machine initialization because of them.
+    try
     {
-        try
-        {
-            NanaBox::ComputeSystemUpdateMemorySize(
-                this->m_VirtualMachine,
-                Configuration.MemorySize);
-            this->m_Configuration.MemorySize =
-                Configuration.MemorySize;
-        }
-        catch (...)
-        {
-
-        }
+        this->m_StatisticsSampler =
+            std::make_unique<NanaBox::VirtualMachineStatisticsSampler>(
+                this->m_Configuration.Name,
+                this->m_Configuration.ProcessorCount,
+                this->m_VirtualMachine);
     }
-
-    if (0 != _stricmp(
-        this->m_Configuration.ComPorts.ComPort1.c_str(),
-        Configuration.ComPorts.ComPort1.c_str()))
+    catch (...)
     {
-        try
-        {
-            if (this->m_Configuration.ComPorts.ComPort1.empty())
-            {
-                NanaBox::ComputeSystemAddComPort(
-                    this->m_VirtualMachine,
-                    0,
-                    Configuration.ComPorts.ComPort1);
-            }
-            else if (Configuration.ComPorts.ComPort1.empty())
-            {
-                NanaBox::ComputeSystemRemoveComPort(
-                    this->m_VirtualMachine,
-                    0,
-                    Configuration.ComPorts.ComPort1);
-            }
-            else
-            {
-                NanaBox::ComputeSystemUpdateComPort(
-                    this->m_VirtualMachine,
-                    0,
-                    Configuration.ComPorts.ComPort1);
-            }
+        return;
+    }
 
-            this->m_Configuration.ComPorts.ComPort1 =
-                Configuration.ComPorts.ComPort1;
-        }
-        catch (...)
-        {
+    std::uint32_t ProcessorCount = this->m_Configuration.ProcessorCount;
+    std::shared_ptr<NanaBox::VirtualMachineMetrics> Metrics = this->m_Metrics;
+    winrt::hstring FormatText = Mile::WinRT::GetLocalizedString(
+        L"MainWindow/StatisticsFormatText");
+    winrt::NanaBox::implementation::MainWindowControl* Control =
+        winrt::get_self<winrt::NanaBox::implementation::MainWindowControl>(
+            this->m_MainWindowControl);
+
+    this->m_StatisticsSampler->SampleAdded.add([=](
+        NanaBox::VirtualMachineStatisticsSample const& Previous,
+        NanaBox::VirtualMachineStatisticsSample const& Current)
+    {
+        Metrics->Uptime.store(Current.Uptime);
+        Metrics->ProcessorRuntime.store(Current.ProcessorTotalRuntime);
+        Metrics->AssignedMemory.store(Current.AssignedMemory);
+        Metrics->AvailableMemory.store(Current.AvailableMemory);
+
+        std::uint32_t Usage = NanaBox::CalculateProcessorUsage(
+            Previous,
+            Current,
+            ProcessorCount);
+
+        std::uint64_t UptimeSeconds = Current.Uptime / 10000000;
+        std::wstring Uptime = Mile::FormatWideString(
+            L"%llu:%02llu:%02llu",
+            UptimeSeconds / 3600,
+            UptimeSeconds / 60 % 60,
+            UptimeSeconds % 60);
+
+        Control->RefreshStatistics(winrt::hstring(Mile::FormatWideString(
+            FormatText.c_str(),
+            Usage / 100,
+            Usage % 100,
+            Current.AvailableMemory,
+            Current.AssignedMemory,
+            Uptime.c_str())));
+    });
+}
 
-        }
+void NanaBox::MainWindow::InitializeMetricsExporter()
+{
+    if (this->m_MetricsExporter || !this->m_Configuration.Metrics.Enabled)
+    {
+        return;
     }
 
-    if (0 != _stricmp(
-        this->m_Configuration.ComPorts.ComPort2.c_str(),
-        Configuration.ComPorts.ComPort2.c_str()))
+    std::wstring FilePath;
+    if (!this->m_Configuration.Metrics.File.empty())
     {
-        try
-        {
-            if (this->m_Configuration.ComPorts.ComPort2.empty())
-            {
-                NanaBox::ComputeSystemAddComPort(
-                    this->m_VirtualMachine,
-                    1,
-                    Configuration.ComPorts.ComPort2);
-            }
-            else if (Configuration.ComPorts.ComPort2.empty())
-            {
-                NanaBox::ComputeSystemRemoveComPort(
-                    this->m_VirtualMachine,
-                    1,
-                    Configuration.ComPorts.ComPort2);
-            }
-            else
-            {
-                NanaBox::ComputeSystemUpdateComPort(
-                    this->m_VirtualMachine,
-                    1,
-                    Configuration.ComPorts.ComPort2);
-            }
-
-            this->m_Configuration.ComPorts.ComPort2 =
-                Configuration.ComPorts.ComPort2;
-        }
-        catch (...)
-        {
-
-        }
+        FilePath = ::GetAbsolutePath(Mile::ToWideString(
+            CP_UTF8,
+            this->m_Configuration.Metrics.File));
     }
 
+    // The metrics are informational only, so never fail the virtual machine
+    // initialization because of them.
     try
     {
-        NanaBox::ComputeSystemUpdateGpu(
-            this->m_VirtualMachine,
-            Configuration.Gpu);
-        this->m_Configuration.Gpu = Configuration.Gpu;
+        this->m_MetricsExporter = std::make_unique<NanaBox::MetricsExporter>(
+            NanaBox::GetMetricsPipeName(this->m_Configuration.Name),
+            FilePath,
+            this->m_Configuration.Metrics.UpdateInterval * 1000);
     }
     catch (...)
     {
 
     }
+}
 
-    {
-        using NetworkAdapterMapType =
-            std::map<std::string, NanaBox::NetworkAdapterConfiguration>;
-
-        NetworkAdapterMapType PreviousList;
-        NetworkAdapterMapType CurrentList;
-        std::vector<NanaBox::NetworkAdapterConfiguration> KeepList;
-        std::vector<NanaBox::NetworkAdapterConfiguration> AddList;
-        std::vector<NanaBox::NetworkAdapterConfiguration> RemoveList;
-        std::vector<NanaBox::NetworkAdapterConfiguration> FinalList;
-
-        for (NanaBox::NetworkAdapterConfiguration& Previous
-            : this->m_Configuration.NetworkAdapters)
-        {
-            PreviousList.insert(std::pair(Previous.EndpointId, Previous));
-        }
-
-        for (NanaBox::NetworkAdapterConfiguration& Current
-            : Configuration.NetworkAdapters)
-        {
-            CurrentList.insert(std::pair(Current.EndpointId, Current));
-        }
-
-        for (NanaBox::NetworkAdapterConfiguration& Previous
-            : this->m_Configuration.NetworkAdapters)
-        {
-            NetworkAdapterMapType::iterator Current =
-                CurrentList.find(Previous.EndpointId);
-
-            if (CurrentList.end() == Current)
-            {
-                RemoveList.push_back(Previous);
-            }
-            else
-            {
-                if (Previous.Connected != Current->second.Connected ||
-                    0 != _stricmp(
-                        Previous.MacAddress.c_str(),
-                        Current->second.MacAddress.c_str()))
-                {
-                    if (Previous.Connected)
-                    {
-                        RemoveList.push_back(Previous);
-                    }
-                    AddList.push_back(Current->second);
-                }
-                else
-                {
-                    KeepList.push_back(Previous);
-                }
-            }
-        }
-
-        for (NanaBox::NetworkAdapterConfiguration& Current
-            : Configuration.NetworkAdapters)
-        {
-            if (PreviousList.end() == PreviousList.find(Current.EndpointId))
-            {
-                AddList.push_back(Current);
-            }
-        }
-
-        for (NanaBox::NetworkAdapterConfiguration& Current : KeepList)
-        {
-            FinalList.push_back(Current);
-        }
-
-        for (NanaBox::NetworkAdapterConfiguration& Current : RemoveList)
-        {
-            try
-            {
-                NanaBox::ComputeSystemRemoveNetworkAdapter(
-                    this->m_VirtualMachine,
-                    Current);
-                NanaBox::ComputeNetworkDeleteEndpoint(Current);
-            }
-            catch (...)
-            {
-                FinalList.push_back(Current);
-            }
-        }
-
-        for (NanaBox::NetworkAdapterConfiguration& Current : AddList)
-        {
-            try
-            {
-                NanaBox::ComputeNetworkDeleteEndpoint(Current);
-                if (Current.Connected)
-                {
-                    NanaBox::ComputeNetworkCreateEndpoint(
-                        this->m_Configuration.Name,
-                        Current);
-                    NanaBox::ComputeSystemAddNetworkAdapter(
-                        this->m_VirtualMachine,
-                        Current);
-                }
-                FinalList.push_back(Current);
-            }
-            catch (...)
-            {
+void NanaBox::MainWindow::TryReloadVirtualMachine()
+{
+    std::chrono::steady_clock::time_point StartTime =
+        std::chrono::steady_clock::now();
 
-            }
-        }
+    std::string ConfigurationFileContent =
+        ::ReadAllTextFromUtf8TextFile(this->m_ConfigurationFilePath);
 
-        this->m_Configuration.NetworkAdapters = FinalList;
-    }
+    NanaBox::VirtualMachineConfiguration Configuration =
+        NanaBox::DeserializeConfiguration(ConfigurationFileContent);
 
-    {
-        size_t PreviousCount = this->m_Configuration.ScsiDevices.size();
-        size_t NewCount = Configuration.ScsiDevices.size();
-        if (PreviousCount <= NewCount)
-        {
-            for (std::uint32_t i = 0; i < NewCount; ++i)
-            {
-                NanaBox::ScsiDeviceConfiguration& Current =
-                    Configuration.ScsiDevices[i];
-
-                if (i < PreviousCount)
-                {
-                    NanaBox::ScsiDeviceConfiguration& Previous =
-                        this->m_Configuration.ScsiDevices[i];
-
-                    if (Previous.Type == Current.Type)
-                    {
-                        if (0 != _stricmp(
-                            Previous.Path.c_str(),
-                            Current.Path.c_str()))
-                        {
-                            try
-                            {
-                                NanaBox::ComputeSystemUpdateScsiDevice(
-                                    this->m_VirtualMachine,
-                                    i,
-                                    Current);
-                                Previous.Path = Current.Path;
-                            }
-                            catch (...)
-                            {
-
-                            }
-                        }
-                    }
-                }
-                else
-                {
-                    try
-                    {
-                        if (Current.Type !=
-                            NanaBox::ScsiDeviceType::PhysicalDevice)
-                        {
-                            std::wstring Path = ::GetAbsolutePath(
-                                Mile::ToWideString(CP_UTF8, Current.Path));
-                            if (!::PathFileExistsW(Path.c_str()))
-                            {
-                                continue;
-                            }
-                            winrt::check_hresult(::HcsGrantVmAccess(
-                                winrt::to_hstring(
-                                    this->m_Configuration.Name).c_str(),
-                                Path.c_str()));
-                        }
-
-                        NanaBox::ComputeSystemAddScsiDevice(
-                            this->m_VirtualMachine,
-                            i,
-                            Current);
-                        this->m_Configuration.ScsiDevices.push_back(Current);
-                    }
-                    catch (...)
-                    {
-
-                    }
-                }
-            }
-        }
-    }
+    NanaBox::ReloadVirtualMachine(
+        this->m_VirtualMachine,
+        this->m_Configuration,
+        Configuration);
 
     try
     {
@@ -1002,16 +743,96 @@ void NanaBox::MainWindow::TryReloadVirtualMachine()
 
     }
 
+    try
+    {
+        NanaBox::RemoteDesktopUpdatePerformanceProfileConfiguration(
+            this->m_RdpClient,
+            Configuration.VideoMonitor.PerformanceProfile);
+        this->m_Configuration.VideoMonitor = Configuration.VideoMonitor;
+    }
+    catch (...)
+    {
+
+    }
+
     ConfigurationFileContent =
         NanaBox::SerializeConfiguration(this->m_Configuration);
-    ::WriteAllTextToUtf8TextFile(
+    ::ReplaceAllTextInUtf8TextFile(
         this->m_ConfigurationFilePath,
         ConfigurationFileContent);
 
+    ++this->m_Metrics->Reloads;
+    this->m_Metrics->RecordLifecycle(
+        NanaBox::LifecyclePhase::Reload,
+        std::chrono::steady_clock::now() - StartTime);
+
     this->m_NeedRdpClientModeChange = true;
     this->m_RdpClient->Disconnect();
 }
 
+void NanaBox::MainWindow::ScheduleSyncDisplaySettings()
+{
+    if (this->m_RdpClientMode != RdpClientMode::EnhancedVideoSyncedSession)
+    {
+        return;
+    }
+
+    ++this->m_Metrics->DisplaySyncRequests;
+    this->m_SyncDisplaySettingsRetryCount = 0;
+    this->SetTimer(
+        NanaBox::MainWindowTimerEvents::SyncDisplaySettings,
+        this->m_SyncDisplaySettingsDelay);
+}
+
+void NanaBox::MainWindow::SyncDisplaySettings()
+{
+    if (this->m_RdpClientMode != RdpClientMode::EnhancedVideoSyncedSession)
+    {
+        return;
+    }
+
+    CSize DisplayResolution = this->m_RecommendedDisplayResolution;
+    std::uint32_t ZoomLevel = this->m_RecommendedZoomLevel;
+    if (this->m_DisplayResolution == DisplayResolution &&
+        this->m_DisplayZoomLevel == ZoomLevel)
+    {
+        return;
+    }
+
+    try
+    {
+        this->m_RdpClient->UpdateSessionDisplaySettings(
+            DisplayResolution.cx,
+            DisplayResolution.cy,
+            DisplayResolution.cx,
+            DisplayResolution.cy,
+            0,
+            ZoomLevel,
+            100);
+
+        this->m_DisplayResolution = DisplayResolution;
+        this->m_DisplayZoomLevel = ZoomLevel;
+        this->m_SyncDisplaySettingsRetryCount = 0;
+        ++this->m_Metrics->DisplaySettingsUpdates;
+    }
+    catch (...)
+    {
+        // The session may not accept the display settings yet, so retry
+        // with the backoff instead of waiting for the next change, and give
+        // up if it keeps failing to avoid waking up the UI thread forever.
+        if (this->m_SyncDisplaySettingsRetryCount <
+            this->m_SyncDisplaySettingsMaxRetryCount)
+        {
+            ++this->m_SyncDisplaySettingsRetryCount;
+            ++this->m_Metrics->DisplaySyncRetries;
+            this->SetTimer(
+                NanaBox::MainWindowTimerEvents::SyncDisplaySettings,
+                this->m_SyncDisplaySettingsDelay <<
+                this->m_SyncDisplaySettingsRetryCount);
+        }
+    }
+}
+
 void NanaBox::MainWindow::RdpClientOnRemoteDesktopSizeChange(
     _In_ LONG Width,
     _In_ LONG Height)
@@ -1063,33 +884,98 @@ void NanaBox::MainWindow::RdpClientOnRemoteDesktopSizeChange(
     }
 }
 
+void NanaBox::MainWindow::RdpClientOnConnected()
+{
+    if (this->m_RdpClientMode == RdpClientMode::BasicSession)
+    {
+        this->RdpClientCompleteSessionSwitch();
+        this->RdpClientPrepareEnhancedSession();
+    }
+}
+
 void NanaBox::MainWindow::RdpClientOnLoginComplete()
 {
+    this->m_RdpSessionTelemetry->RecordLoginComplete();
+
     if (this->m_RdpClientMode == RdpClientMode::EnhancedSession)
     {
+        this->RdpClientCompleteSessionSwitch();
+
         this->m_RdpClientMode = RdpClientMode::EnhancedVideoSyncedSession;
         this->m_DisplayResolution = CSize();
+        this->ScheduleSyncDisplaySettings();
     }
 }
 
+void NanaBox::MainWindow::RdpClientOnNetworkStatusChanged(
+    _In_ ULONG QualityLevel,
+    _In_ LONG Bandwidth,
+    _In_ LONG RoundTripTime)
+{
+    this->m_RdpSessionTelemetry->RecordNetworkStatusChanged(
+        QualityLevel,
+        Bandwidth,
+        RoundTripTime);
+}
+
+void NanaBox::MainWindow::RdpClientOnAutoReconnecting2(
+    _In_ LONG DisconnectReason,
+    _In_ bool NetworkAvailable,
+    _In_ LONG AttemptCount,
+    _In_ LONG MaxAttemptCount)
+{
+    UNREFERENCED_PARAMETER(NetworkAvailable);
+    UNREFERENCED_PARAMETER(MaxAttemptCount);
+
+    this->m_RdpSessionTelemetry->RecordAutoReconnecting(
+        DisconnectReason,
+        AttemptCount);
+}
+
 void NanaBox::MainWindow::RdpClientOnDisconnected(
     _In_ LONG DisconnectReason)
 {
-    UNREFERENCED_PARAMETER(DisconnectReason);
+    ++this->m_Metrics->RdpDisconnects;
+
+    LONG ExtendedDisconnectReason = exDiscReasonNoInfo;
+    try
+    {
+        ExtendedDisconnectReason = static_cast<LONG>(
+            this->m_RdpClient->ExtendedDisconnectReason());
+    }
+    catch (...)
+    {
+
+    }
+    this->m_RdpSessionTelemetry->RecordDisconnected(
+        DisconnectReason,
+        ExtendedDisconnectReason);
 
     this->m_MouseCaptureMode = false;
     ::ClipCursor(nullptr);
 
     this->m_RdpNamedPipe->TerminateInstance();
     this->m_RdpNamedPipe = nullptr;
+    this->m_RdpPreparedNamedPipeAdopted = false;
 
     if (this->m_RdpClientMode == RdpClientMode::EnhancedVideoSyncedSession)
     {
         this->m_RdpClientMode = RdpClientMode::EnhancedSession;
     }
 
+    // Only keep the prepared connection for switching to the enhanced session
+    // because the named pipes are gone if the virtual machine is stopped.
+    if (!this->m_VirtualMachineRunning ||
+        !this->m_NeedRdpClientModeChange ||
+        this->m_RdpClientMode != RdpClientMode::EnhancedSession)
+    {
+        this->RdpClientReleasePreparedSession();
+    }
+
     if (this->m_VirtualMachineRunning)
     {
+        ++this->m_Metrics->RdpReconnects;
+
         if (this->m_NeedRdpClientModeChange)
         {
             try
@@ -1262,34 +1148,9 @@ void NanaBox::MainWindow::RdpClientInitialize()
 
     }
 
-    this->m_RdpClient->PerformanceFlags(
-        TS_PERF_ENABLE_ENHANCED_GRAPHICS |
-        TS_PERF_ENABLE_FONT_SMOOTHING |
-        TS_PERF_ENABLE_DESKTOP_COMPOSITION);
-
-    try
-    {
-        VARIANT Value;
-        Value.vt = VT_BOOL;
-        Value.boolVal = VARIANT_TRUE;
-        this->m_RdpClient->Property(L"EnableHardwareMode", Value);
-    }
-    catch (...)
-    {
-
-    }
-
-    try
-    {
-        VARIANT Value;
-        Value.vt = VT_BOOL;
-        Value.boolVal = VARIANT_TRUE;
-        this->m_RdpClient->Property(L"EnableFrameBufferRedirection", Value);
-    }
-    catch (...)
-    {
-
-    }
+    NanaBox::RemoteDesktopUpdatePerformanceProfileConfiguration(
+        this->m_RdpClient,
+        this->m_Configuration.VideoMonitor.PerformanceProfile);
 
     try
     {
@@ -1309,8 +1170,14 @@ void NanaBox::MainWindow::RdpClientInitialize()
 
     this->m_RdpClient->OnRemoteDesktopSizeChange.add(
         { this, &NanaBox::MainWindow::RdpClientOnRemoteDesktopSizeChange });
+    this->m_RdpClient->OnConnected.add(
+        { this, &NanaBox::MainWindow::RdpClientOnConnected });
     this->m_RdpClient->OnLoginComplete.add(
         { this, &NanaBox::MainWindow::RdpClientOnLoginComplete });
+    this->m_RdpClient->OnNetworkStatusChanged.add(
+        { this, &NanaBox::MainWindow::RdpClientOnNetworkStatusChanged });
+    this->m_RdpClient->OnAutoReconnecting2.add(
+        { this, &NanaBox::MainWindow::RdpClientOnAutoReconnecting2 });
     this->m_RdpClient->OnDisconnected.add(
         { this, &NanaBox::MainWindow::RdpClientOnDisconnected });
     this->m_RdpClient->OnRequestGoFullScreen.add(
@@ -1324,12 +1191,6 @@ void NanaBox::MainWindow::RdpClientInitialize()
     this->m_RdpClient->OnFocusReleased.add(
         { this, &NanaBox::MainWindow::RdpClientOnFocusReleased });
 
-    this->SetTimer(
-        NanaBox::MainWindowTimerEvents::SyncDisplaySettings,
-        200);
-
-    this->m_RdpClient->MinInputSendInterval(20);
-
     if (this->m_RdpClientMode == RdpClientMode::EnhancedSession)
     {
         this->m_RdpClient->DesktopWidth(
@@ -1381,6 +1242,31 @@ void NanaBox::MainWindow::RdpClientUninitialize()
 
 void NanaBox::MainWindow::RdpClientConnect()
 {
+    ++this->m_Metrics->RdpConnects;
+    this->m_RdpSessionTelemetry->RecordPipeConnecting();
+
+    this->m_RdpSessionSwitchType =
+        this->m_RdpClientMode == RdpClientMode::BasicSession
+        ? NanaBox::RdpSessionSwitchType::BasicSession
+        : NanaBox::RdpSessionSwitchType::EnhancedSession;
+
+    if (this->m_RdpClientMode == RdpClientMode::EnhancedSession &&
+        this->m_RdpPreparedNamedPipe)
+    {
+        this->m_RdpSessionSwitchType =
+            NanaBox::RdpSessionSwitchType::PreparedEnhancedSession;
+
+        this->m_RdpNamedPipe = std::move(this->m_RdpPreparedNamedPipe);
+        this->m_RdpPreparedNamedPipeAdopted = true;
+        winrt::com_ptr<IUnknown> NetStream =
+            std::move(this->m_RdpPreparedNetStream);
+        if (NetStream)
+        {
+            this->RdpClientConnectWithEndpoint(NetStream.get(), true);
+        }
+        return;
+    }
+
     winrt::check_hresult(::RDPBASE_CreateInstance(
         this->m_PlatformContext.get(),
         CLSID_RDPENCNamedPipeDirectConnector,
@@ -1398,9 +1284,133 @@ void NanaBox::MainWindow::RdpClientConnect()
                 this->m_Configuration.Name.c_str())).c_str()));
 }
 
+void NanaBox::MainWindow::RdpClientBeginSessionSwitch(
+    RdpClientMode Mode)
+{
+    this->m_RdpClientMode = Mode;
+    this->m_NeedRdpClientModeChange = true;
+
+    this->m_RdpSessionSwitching = true;
+    this->m_RdpSessionSwitchStartTime = std::chrono::steady_clock::now();
+}
+
+void NanaBox::MainWindow::RdpClientCompleteSessionSwitch()
+{
+    if (!this->m_RdpSessionSwitching)
+    {
+        return;
+    }
+    this->m_RdpSessionSwitching = false;
+
+    this->m_Metrics->RdpSessionSwitches[
+        static_cast<std::size_t>(this->m_RdpSessionSwitchType)].Observe(
+            static_cast<std::uint64_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() -
+                    this->m_RdpSessionSwitchStartTime).count()));
+}
+
+void NanaBox::MainWindow::RdpClientPrepareEnhancedSession()
+{
+    if (this->m_RdpPreparedNamedPipe)
+    {
+        return;
+    }
+
+    try
+    {
+        winrt::check_hresult(::RDPBASE_CreateInstance(
+            this->m_PlatformContext.get(),
+            CLSID_RDPENCNamedPipeDirectConnector,
+            IID_IRDPENCNamedPipeDirectConnector,
+            this->m_RdpPreparedNamedPipe.put_void()));
+        winrt::check_hresult(this->m_RdpPreparedNamedPipe->InitializeInstance(
+            this->m_RdpPreparedNamedPipeCallbacks.get()));
+        this->m_RdpPreparedStartTime = std::chrono::steady_clock::now();
+        winrt::check_hresult(this->m_RdpPreparedNamedPipe->StartConnect(
+            Mile::ToWideString(
+                CP_UTF8,
+                Mile::FormatString(
+                    "\\\\.\\pipe\\%s.EnhancedSession",
+                    this->m_Configuration.Name.c_str())).c_str()));
+    }
+    catch (...)
+    {
+        this->RdpClientReleasePreparedSession();
+    }
+}
+
+void NanaBox::MainWindow::RdpClientReleasePreparedSession()
+{
+    if (this->m_RdpPreparedNamedPipe)
+    {
+        this->m_RdpPreparedNamedPipe->TerminateInstance();
+        this->m_RdpPreparedNamedPipe = nullptr;
+    }
+    this->m_RdpPreparedNetStream = nullptr;
+}
+
+void NanaBox::MainWindow::RdpClientConnectWithEndpoint(
+    _In_ IUnknown* NetStream,
+    _In_ bool Prepared)
+{
+    if (Prepared)
+    {
+        this->m_RdpSessionTelemetry->RecordPipeConnected(
+            this->m_RdpPreparedConnectDuration);
+    }
+    else
+    {
+        this->m_RdpSessionTelemetry->RecordPipeConnected();
+    }
+
+    this->m_RdpClient->ConnectWithEndpoint(NetStream);
+
+    this->m_RdpClient->Connect();
+
+    this->m_RdpClientWindow.SetFocus();
+}
+
+void NanaBox::MainWindow::RdpClientOnPreparedConnectionCompleted(
+    _In_ IUnknown* NetStream)
+{
+    this->m_RdpPreparedConnectDuration = static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() -
+            this->m_RdpPreparedStartTime).count());
+
+    if (this->m_RdpPreparedNamedPipeAdopted)
+    {
+        this->RdpClientConnectWithEndpoint(NetStream, true);
+    }
+    else if (this->m_RdpPreparedNamedPipe)
+    {
+        this->m_RdpPreparedNetStream.copy_from(NetStream);
+    }
+}
+
+void NanaBox::MainWindow::RdpClientOnPreparedConnectorError(
+    _In_ HRESULT Error)
+{
+    UNREFERENCED_PARAMETER(Error);
+
+    // The adopted connector is the named pipe of the current session until
+    // it is disconnected, no matter whether it was connected before.
+    if (this->m_RdpPreparedNamedPipeAdopted)
+    {
+        this->RdpClientOnDisconnected(exDiscReasonServerDeniedConnection);
+    }
+    else
+    {
+        this->RdpClientReleasePreparedSession();
+    }
+}
+
 NanaBox::RdpNamedPipeCallbacks::RdpNamedPipeCallbacks(
-    _In_ MainWindow* Instance)
-    : m_Instance(Instance)
+    _In_ MainWindow* Instance,
+    _In_ bool Prepared)
+    : m_Instance(Instance),
+    m_Prepared(Prepared)
 {
 
 }
@@ -1408,17 +1418,23 @@ NanaBox::RdpNamedPipeCallbacks::RdpNamedPipeCallbacks(
 void STDMETHODCALLTYPE NanaBox::RdpNamedPipeCallbacks::OnConnectionCompleted(
     _In_ IUnknown* pNetStream)
 {
-    this->m_Instance->m_RdpClient->ConnectWithEndpoint(pNetStream);
-
-    this->m_Instance->m_RdpClient->Connect();
+    if (this->m_Prepared)
+    {
+        this->m_Instance->RdpClientOnPreparedConnectionCompleted(pNetStream);
+        return;
+    }
 
-    this->m_Instance->m_RdpClientWindow.SetFocus();
+    this->m_Instance->RdpClientConnectWithEndpoint(pNetStream);
 }
 
 void STDMETHODCALLTYPE NanaBox::RdpNamedPipeCallbacks::OnConnectorError(
     _In_ HRESULT hrError)
 {
-    UNREFERENCED_PARAMETER(hrError);
+    if (this->m_Prepared)
+    {
+        this->m_Instance->RdpClientOnPreparedConnectorError(hrError);
+        return;
+    }
 
     this->m_Instance->RdpClientOnDisconnected(
         exDiscReasonServerDeniedConnection);
@@ -13,6 +13,10 @@
 #include "RdpBase.h"
 #include "HostCompute.h"
 #include "ConfigurationManager.h"
+#include "VirtualMachineLifecycle.h"
+#include "VirtualMachineStatistics.h"
+#include "MetricsExporter.h"
+#include "RdpSessionTelemetry.h"
 
 #include "MainWindowControl.h"
 
@@ -47,11 +51,13 @@ namespace NanaBox
             MSG_WM_COMMAND(OnCommand)
             MSG_WM_TIMER(OnTimer)
             MSG_WM_SIZE(OnSize)
+            MESSAGE_HANDLER(WM_DPICHANGED, OnDpiChanged)
             MSG_WM_SETFOCUS(OnSetFocus)
             MSG_WM_ACTIVATE(OnActivate)
             MSG_WM_CLOSE(OnClose)
             MSG_WM_DESTROY(OnDestroy)
             MSG_WM_QUERYENDSESSION(OnQueryEndSession)
+            MSG_WM_ENDSESSION(OnEndSession)
         END_MSG_MAP()
 
         MainWindow(
@@ -72,6 +78,12 @@ namespace NanaBox
             UINT nType,
             CSize size);
 
+        LRESULT OnDpiChanged(
+            UINT uMsg,
+            WPARAM wParam,
+            LPARAM lParam,
+            BOOL& bHandled);
+
         void OnSetFocus(
             ATL::CWindow wndOld);
 
@@ -88,35 +100,75 @@ namespace NanaBox
             UINT nSource,
             UINT uLogOff);
 
+        void OnEndSession(
+            BOOL bEnding,
+            UINT uLogOff);
+
     public:
 
         winrt::com_ptr<NanaBox::RdpClient> m_RdpClient;
         ATL::CAxWindow m_RdpClientWindow;
+        std::unique_ptr<NanaBox::RdpSessionTelemetry> m_RdpSessionTelemetry;
 
         void RdpClientOnDisconnected(
             _In_ LONG DisconnectReason);
 
+        void RdpClientConnectWithEndpoint(
+            _In_ IUnknown* NetStream,
+            _In_ bool Prepared = false);
+
+        void RdpClientOnPreparedConnectionCompleted(
+            _In_ IUnknown* NetStream);
+
+        void RdpClientOnPreparedConnectorError(
+            _In_ HRESULT Error);
+
     private:
 
         WTL::CIcon m_ApplicationIcon;
         winrt::com_ptr<IRDPENCPlatformContext> m_PlatformContext;
         winrt::com_ptr<IRDPENCNamedPipeDirectConnectorCallbacks> m_RdpNamedPipeCallbacks;
         winrt::com_ptr<IRDPENCNamedPipeDirectConnector> m_RdpNamedPipe;
+        winrt::com_ptr<IRDPENCNamedPipeDirectConnectorCallbacks> m_RdpPreparedNamedPipeCallbacks;
+        winrt::com_ptr<IRDPENCNamedPipeDirectConnector> m_RdpPreparedNamedPipe;
+        winrt::com_ptr<IUnknown> m_RdpPreparedNetStream;
+        // The prepared connector is taken over by the current session, so its
+        // completion continues the connection and its errors disconnect the
+        // session.
+        bool m_RdpPreparedNamedPipeAdopted = false;
+        // The time the prepared connector takes to connect, which is used as
+        // the pipe connect duration of the session which adopts it.
+        std::chrono::steady_clock::time_point m_RdpPreparedStartTime;
+        std::uint64_t m_RdpPreparedConnectDuration = 0;
         const int m_MainWindowControlHeight = 48;
         int m_RecommendedMainWindowControlHeight = m_MainWindowControlHeight;
+        // The quiet period after the last size or DPI change before the
+        // display settings are sent to the enhanced session. A failed update
+        // is retried with the doubled delay up to the maximum retry count,
+        // and then waits for the next change.
+        const UINT m_SyncDisplaySettingsDelay = 200;
+        const UINT m_SyncDisplaySettingsMaxRetryCount = 5;
+        UINT m_SyncDisplaySettingsRetryCount = 0;
         winrt::NanaBox::MainWindowControl m_MainWindowControl;
         std::wstring m_ConfigurationFilePath;
         NanaBox::VirtualMachineConfiguration m_Configuration;
         winrt::com_ptr<NanaBox::ComputeSystem> m_VirtualMachine;
+        std::unique_ptr<NanaBox::VirtualMachineStatisticsSampler> m_StatisticsSampler;
+        std::unique_ptr<NanaBox::MetricsExporter> m_MetricsExporter;
+        std::shared_ptr<NanaBox::VirtualMachineMetrics> m_Metrics;
         std::string m_VirtualMachineGuid;
         bool m_VirtualMachineRunning = false;
         bool m_VirtualMachineRestarting = false;
         RdpClientMode m_RdpClientMode = RdpClientMode::BasicSession;
         bool m_NeedRdpClientModeChange = false;
+        bool m_RdpSessionSwitching = false;
+        NanaBox::RdpSessionSwitchType m_RdpSessionSwitchType =
+            NanaBox::RdpSessionSwitchType::BasicSession;
+        std::chrono::steady_clock::time_point m_RdpSessionSwitchStartTime;
         CSize m_RecommendedDisplayResolution = CSize(1024, 768);
         std::uint32_t m_RecommendedZoomLevel = 100;
         CSize m_DisplayResolution = CSize(1024, 768);
-        UINT64 m_SyncDisplaySettingsCheckPoint = 0;
+        std::uint32_t m_DisplayZoomLevel = 100;
         RECT m_RememberedMainWindowRect;
         LONG_PTR m_RememberedMainWindowStyle;
         std::wstring m_WindowTitle;
@@ -126,12 +178,40 @@ namespace NanaBox
 
         void TryReloadVirtualMachine();
 
+        // Saves the virtual machine, terminates it and records the save state
+        // file to the configuration file. The virtual machine keeps running
+        // and the exception is rethrown when failed.
+        void SuspendVirtualMachine();
+
+        void InitializeStatisticsSampler();
+
+        void InitializeMetricsExporter();
+
+        // Restarts the one-shot timer, so a burst of the size and DPI changes
+        // only syncs the display settings once after it settles.
+        void ScheduleSyncDisplaySettings();
+
+        void SyncDisplaySettings();
+
         void RdpClientOnRemoteDesktopSizeChange(
             _In_ LONG Width,
             _In_ LONG Height);
 
+        void RdpClientOnConnected();
+
         void RdpClientOnLoginComplete();
 
+        void RdpClientOnNetworkStatusChanged(
+            _In_ ULONG QualityLevel,
+            _In_ LONG Bandwidth,
+            _In_ LONG RoundTripTime);
+
+        void RdpClientOnAutoReconnecting2(
+            _In_ LONG DisconnectReason,
+            _In_ bool NetworkAvailable,
+            _In_ LONG AttemptCount,
+            _In_ LONG MaxAttemptCount);
+
         void RdpClientOnRequestGoFullScreen();
 
         void RdpClientOnRequestLeaveFullScreen();
@@ -149,6 +229,18 @@ namespace NanaBox
         void RdpClientUninitialize();
 
         void RdpClientConnect();
+
+        void RdpClientBeginSessionSwitch(
+            RdpClientMode Mode);
+
+        void RdpClientCompleteSessionSwitch();
+
+        // Connects the named pipe of the enhanced session while the basic
+        // session is active, so switching to the enhanced session only swaps
+        // the endpoint instead of waiting for the named pipe connection.
+        void RdpClientPrepareEnhancedSession();
+
+        void RdpClientReleasePreparedSession();
     };
 
     struct RdpNamedPipeCallbacks : winrt::implements<
@@ -158,7 +250,8 @@ namespace NanaBox
     public:
 
         RdpNamedPipeCallbacks(
-            _In_ MainWindow* Instance);
+            _In_ MainWindow* Instance,
+            _In_ bool Prepared = false);
 
         void STDMETHODCALLTYPE OnConnectionCompleted(
             _In_ IUnknown* pNetStream);
@@ -169,5 +262,6 @@ namespace NanaBox
     private:
 
         MainWindow* m_Instance;
+        bool m_Prepared;
     };
 }
@@ -404,6 +404,21 @@ namespace winrt::NanaBox::implementation
         return Sponsored;
     }
 
+    void MainWindowControl::RefreshStatistics(
+        winrt::hstring const& Content)
+    {
+        if (!this->m_DispatcherQueue)
+        {
+            return;
+        }
+        this->m_DispatcherQueue.TryEnqueue(
+            winrt::DispatcherQueuePriority::Low,
+            [=]()
+        {
+            this->StatisticsTextBlock().Text(Content);
+        });
+    }
+
     void MainWindowControl::RefreshSponsorButtonContent()
     {
         winrt::handle(Mile::CreateThread([=]()
@@ -108,6 +108,9 @@ namespace winrt::NanaBox::implementation
             winrt::IInspectable const& sender,
             winrt::RoutedEventArgs const& e);
 
+        void RefreshStatistics(
+            winrt::hstring const& Content);
+
     private:
 
         HWND m_WindowHandle;
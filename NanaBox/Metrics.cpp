@@ -0,0 +1,824 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      Metrics.cpp
+ * PURPOSE:   Implementation for the Metrics Registry and Prometheus Formatter
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "Metrics.h"
+
+#include <charconv>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace
+{
+    const std::string_view g_HcsCallTypeNames[] =
+    {
+        "Create",
+        "Open",
+        "Start",
+        "Shutdown",
+        "Terminate",
+        "Pause",
+        "Resume",
+        "Save",
+        "GetProperties",
+        "Modify",
+    };
+    static_assert(
+        std::size(g_HcsCallTypeNames) ==
+        static_cast<std::size_t>(NanaBox::HcsCallType::Count));
+
+    const std::string_view g_LifecyclePhaseNames[] =
+    {
+        "Initialize",
+        "Restore",
+        "Restart",
+        "Save",
+        "Reload",
+    };
+    static_assert(
+        std::size(g_LifecyclePhaseNames) ==
+        static_cast<std::size_t>(NanaBox::LifecyclePhase::Count));
+
+    const std::string_view g_ReloadChangeTypeNames[] =
+    {
+        "MemorySize",
+        "ComPort",
+        "NetworkAdapterAdded",
+        "NetworkAdapterRemoved",
+        "ScsiDeviceUpdated",
+        "ScsiDeviceAdded",
+        "ScsiDeviceExpanded",
+    };
+    static_assert(
+        std::size(g_ReloadChangeTypeNames) ==
+        static_cast<std::size_t>(NanaBox::ReloadChangeType::Count));
+
+    const std::string_view g_PreparationStepTypeNames[] =
+    {
+        "ExistenceProbe",
+        "DiskAccess",
+        "GuestStateFile",
+        "RuntimeStateFile",
+        "SaveStateFile",
+        "NetworkEndpoint",
+    };
+    static_assert(
+        std::size(g_PreparationStepTypeNames) ==
+        static_cast<std::size_t>(NanaBox::PreparationStepType::Count));
+
+    const std::string_view g_RdpSessionSwitchTypeNames[] =
+    {
+        "BasicSession",
+        "EnhancedSession",
+        "PreparedEnhancedSession",
+    };
+    static_assert(
+        std::size(g_RdpSessionSwitchTypeNames) ==
+        static_cast<std::size_t>(NanaBox::RdpSessionSwitchType::Count));
+
+    const std::string_view g_QuantileNames[] =
+    {
+        "0.5",
+        "0.9",
+        "0.99",
+    };
+    static_assert(
+        std::size(g_QuantileNames) ==
+        static_cast<std::size_t>(NanaBox::RdpSessionQuantile::Count));
+
+    // The bucket labels are kept as text to avoid formatting floating point
+    // values on every scrape.
+    const std::string_view g_LatencyBucketLabels[] =
+    {
+        "0.001",
+        "0.0025",
+        "0.005",
+        "0.01",
+        "0.025",
+        "0.05",
+        "0.1",
+        "0.25",
+        "0.5",
+        "1",
+        "2.5",
+        "5",
+        "10",
+        "+Inf",
+    };
+    static_assert(
+        std::size(g_LatencyBucketLabels) ==
+        NanaBox::LatencyHistogram::BucketCount + 1);
+
+    std::mutex g_RegistryLock;
+    std::map<std::string, std::shared_ptr<NanaBox::VirtualMachineMetrics>>
+        g_Registry;
+
+    std::uint64_t Load(
+        std::atomic<std::uint64_t> const& Value)
+    {
+        return Value.load(std::memory_order_relaxed);
+    }
+}
+
+const std::uint64_t NanaBox::LatencyHistogram::UpperBounds[] =
+{
+    1000,
+    2500,
+    5000,
+    10000,
+    25000,
+    50000,
+    100000,
+    250000,
+    500000,
+    1000000,
+    2500000,
+    5000000,
+    10000000,
+};
+
+void NanaBox::LatencyHistogram::Observe(
+    std::uint64_t Microseconds)
+{
+    std::size_t Index = 0;
+    while (Index < BucketCount && Microseconds > UpperBounds[Index])
+    {
+        ++Index;
+    }
+
+    this->Buckets[Index].fetch_add(1, std::memory_order_relaxed);
+    this->Sum.fetch_add(Microseconds, std::memory_order_relaxed);
+    this->Count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void NanaBox::VirtualMachineMetrics::RecordLifecycle(
+    NanaBox::LifecyclePhase Phase,
+    std::chrono::steady_clock::duration Duration)
+{
+    std::size_t Index = static_cast<std::size_t>(Phase);
+    this->LifecycleDurations[Index].store(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            Duration).count(),
+        std::memory_order_relaxed);
+    this->LifecycleCounts[Index].fetch_add(1, std::memory_order_relaxed);
+}
+
+void NanaBox::VirtualMachineMetrics::RecordPreparationStep(
+    NanaBox::PreparationStepType Type,
+    std::chrono::steady_clock::duration Duration)
+{
+    this->PreparationSteps[static_cast<std::size_t>(Type)].Observe(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            Duration).count());
+}
+
+void NanaBox::VirtualMachineMetrics::RecordReloadChange(
+    NanaBox::ReloadChangeType Type,
+    std::uint64_t Count)
+{
+    this->ReloadChanges[static_cast<std::size_t>(Type)].fetch_add(
+        Count,
+        std::memory_order_relaxed);
+}
+
+std::shared_ptr<NanaBox::VirtualMachineMetrics>
+NanaBox::GetVirtualMachineMetrics(
+    std::string const& Name)
+{
+    std::lock_guard<std::mutex> Guard(g_RegistryLock);
+
+    std::shared_ptr<NanaBox::VirtualMachineMetrics>& Result =
+        g_Registry[Name];
+    if (!Result)
+    {
+        Result = std::make_shared<NanaBox::VirtualMachineMetrics>();
+    }
+
+    return Result;
+}
+
+void NanaBox::ReleaseVirtualMachineMetrics(
+    std::string const& Name)
+{
+    std::lock_guard<std::mutex> Guard(g_RegistryLock);
+
+    g_Registry.erase(Name);
+}
+
+NanaBox::HcsCallMeasurement::HcsCallMeasurement(
+    NanaBox::VirtualMachineMetrics* Metrics,
+    NanaBox::HcsCallType Type) :
+    m_Metrics(Metrics),
+    m_Type(Type),
+    m_UncaughtExceptions(std::uncaught_exceptions()),
+    m_StartTime(std::chrono::steady_clock::now())
+{
+
+}
+
+NanaBox::HcsCallMeasurement::~HcsCallMeasurement()
+{
+    if (!this->m_Metrics)
+    {
+        return;
+    }
+
+    std::size_t Index = static_cast<std::size_t>(this->m_Type);
+
+    this->m_Metrics->HcsCalls[Index].Observe(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - this->m_StartTime).count());
+
+    if (std::uncaught_exceptions() > this->m_UncaughtExceptions)
+    {
+        this->m_Metrics->HcsCallFailures[Index].fetch_add(
+            1,
+            std::memory_order_relaxed);
+    }
+}
+
+NanaBox::PrometheusTextWriter::PrometheusTextWriter(
+    std::string& Buffer) :
+    m_Buffer(Buffer)
+{
+
+}
+
+void NanaBox::PrometheusTextWriter::Family(
+    std::string_view Name,
+    std::string_view Type,
+    std::string_view Help)
+{
+    this->m_Buffer.append("# HELP ");
+    this->m_Buffer.append(Name);
+    this->m_Buffer.push_back(' ');
+    this->m_Buffer.append(Help);
+    this->m_Buffer.append("\n# TYPE ");
+    this->m_Buffer.append(Name);
+    this->m_Buffer.push_back(' ');
+    this->m_Buffer.append(Type);
+    this->m_Buffer.push_back('\n');
+}
+
+void NanaBox::PrometheusTextWriter::Sample(
+    std::string_view Name,
+    std::initializer_list<PrometheusLabel> Labels,
+    std::uint64_t Value,
+    std::uint32_t FractionDigits)
+{
+    this->m_Buffer.append(Name);
+    this->AppendLabels(Labels);
+    this->m_Buffer.push_back(' ');
+    this->AppendNumber(Value, FractionDigits);
+    this->m_Buffer.push_back('\n');
+}
+
+void NanaBox::PrometheusTextWriter::Histogram(
+    std::string_view Name,
+    std::initializer_list<PrometheusLabel> Labels,
+    NanaBox::LatencyHistogram const& Histogram)
+{
+    // Read the count first and clamp the cumulative buckets to it, so a
+    // concurrent observation never produces a bucket above the count.
+    std::uint64_t Count = ::Load(Histogram.Count);
+    std::uint64_t Cumulative = 0;
+
+    for (std::size_t i = 0; i <= NanaBox::LatencyHistogram::BucketCount; ++i)
+    {
+        Cumulative += ::Load(Histogram.Buckets[i]);
+        if (Cumulative > Count ||
+            i == NanaBox::LatencyHistogram::BucketCount)
+        {
+            Cumulative = Count;
+        }
+
+        this->m_Buffer.append(Name);
+        this->m_Buffer.append("_bucket");
+        this->AppendLabels(Labels, "le", g_LatencyBucketLabels[i]);
+        this->m_Buffer.push_back(' ');
+        this->AppendNumber(Cumulative, 0);
+        this->m_Buffer.push_back('\n');
+    }
+
+    this->m_Buffer.append(Name);
+    this->m_Buffer.append("_sum");
+    this->AppendLabels(Labels);
+    this->m_Buffer.push_back(' ');
+    this->AppendNumber(::Load(Histogram.Sum), 6);
+    this->m_Buffer.push_back('\n');
+
+    this->m_Buffer.append(Name);
+    this->m_Buffer.append("_count");
+    this->AppendLabels(Labels);
+    this->m_Buffer.push_back(' ');
+    this->AppendNumber(Count, 0);
+    this->m_Buffer.push_back('\n');
+}
+
+void NanaBox::PrometheusTextWriter::AppendLabels(
+    std::initializer_list<PrometheusLabel> Labels,
+    std::string_view ExtraName,
+    std::string_view ExtraValue)
+{
+    if (!Labels.size() && ExtraName.empty())
+    {
+        return;
+    }
+
+    bool First = true;
+    this->m_Buffer.push_back('{');
+    for (PrometheusLabel const& Label : Labels)
+    {
+        if (!First)
+        {
+            this->m_Buffer.push_back(',');
+        }
+        First = false;
+        this->m_Buffer.append(Label.Name);
+        this->m_Buffer.append("=\"");
+        this->AppendEscaped(Label.Value);
+        this->m_Buffer.push_back('"');
+    }
+    if (!ExtraName.empty())
+    {
+        if (!First)
+        {
+            this->m_Buffer.push_back(',');
+        }
+        this->m_Buffer.append(ExtraName);
+        this->m_Buffer.append("=\"");
+        this->AppendEscaped(ExtraValue);
+        this->m_Buffer.push_back('"');
+    }
+    this->m_Buffer.push_back('}');
+}
+
+void NanaBox::PrometheusTextWriter::AppendEscaped(
+    std::string_view Value)
+{
+    for (char const& Character : Value)
+    {
+        switch (Character)
+        {
+        case '\\':
+            this->m_Buffer.append("\\\\");
+            break;
+        case '"':
+            this->m_Buffer.append("\\\"");
+            break;
+        case '\n':
+            this->m_Buffer.append("\\n");
+            break;
+        default:
+            this->m_Buffer.push_back(Character);
+            break;
+        }
+    }
+}
+
+void NanaBox::PrometheusTextWriter::AppendNumber(
+    std::uint64_t Value,
+    std::uint32_t FractionDigits)
+{
+    std::uint64_t Divisor = 1;
+    for (std::uint32_t i = 0; i < FractionDigits; ++i)
+    {
+        Divisor *= 10;
+    }
+
+    char Buffer[32];
+    std::to_chars_result Result = std::to_chars(
+        Buffer,
+        Buffer + sizeof(Buffer),
+        Value / Divisor);
+    this->m_Buffer.append(Buffer, Result.ptr);
+
+    std::uint64_t Fraction = Value % Divisor;
+    if (!Fraction)
+    {
+        return;
+    }
+
+    // Zero pad the fraction to the requested width, then drop the trailing
+    // zeros which carry no information.
+    char* Current = Buffer + FractionDigits;
+    *Current = '\0';
+    while (Current != Buffer)
+    {
+        *--Current = static_cast<char>('0' + Fraction % 10);
+        Fraction /= 10;
+    }
+    std::uint32_t Length = FractionDigits;
+    while (Length && Buffer[Length - 1] == '0')
+    {
+        --Length;
+    }
+    this->m_Buffer.push_back('.');
+    this->m_Buffer.append(Buffer, Length);
+}
+
+void NanaBox::FormatMetrics(
+    std::string& Buffer)
+{
+    Buffer.clear();
+
+    NanaBox::PrometheusTextWriter Writer(Buffer);
+
+    std::lock_guard<std::mutex> Guard(g_RegistryLock);
+
+    Writer.Family(
+        "nanabox_hcs_call_duration_seconds",
+        "histogram",
+        "Latency of Host Compute Service calls.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        for (std::size_t i = 0; i < std::size(g_HcsCallTypeNames); ++i)
+        {
+            Writer.Histogram(
+                "nanabox_hcs_call_duration_seconds",
+                { { "vm", Name }, { "operation", g_HcsCallTypeNames[i] } },
+                Metrics->HcsCalls[i]);
+        }
+    }
+
+    Writer.Family(
+        "nanabox_hcs_call_failures_total",
+        "counter",
+        "Number of failed Host Compute Service calls.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        for (std::size_t i = 0; i < std::size(g_HcsCallTypeNames); ++i)
+        {
+            Writer.Sample(
+                "nanabox_hcs_call_failures_total",
+                { { "vm", Name }, { "operation", g_HcsCallTypeNames[i] } },
+                ::Load(Metrics->HcsCallFailures[i]));
+        }
+    }
+
+    Writer.Family(
+        "nanabox_lifecycle_last_duration_seconds",
+        "gauge",
+        "Duration of the last virtual machine lifecycle transition.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        for (std::size_t i = 0; i < std::size(g_LifecyclePhaseNames); ++i)
+        {
+            Writer.Sample(
+                "nanabox_lifecycle_last_duration_seconds",
+                { { "vm", Name }, { "phase", g_LifecyclePhaseNames[i] } },
+                ::Load(Metrics->LifecycleDurations[i]),
+                6);
+        }
+    }
+
+    Writer.Family(
+        "nanabox_lifecycle_transitions_total",
+        "counter",
+        "Number of virtual machine lifecycle transitions.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        for (std::size_t i = 0; i < std::size(g_LifecyclePhaseNames); ++i)
+        {
+            Writer.Sample(
+                "nanabox_lifecycle_transitions_total",
+                { { "vm", Name }, { "phase", g_LifecyclePhaseNames[i] } },
+                ::Load(Metrics->LifecycleCounts[i]));
+        }
+    }
+
+    Writer.Family(
+        "nanabox_preparation_step_duration_seconds",
+        "histogram",
+        "Duration of the virtual machine preparation steps.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        for (std::size_t i = 0; i < std::size(g_PreparationStepTypeNames); ++i)
+        {
+            Writer.Histogram(
+                "nanabox_preparation_step_duration_seconds",
+                { { "vm", Name }, { "step", g_PreparationStepTypeNames[i] } },
+                Metrics->PreparationSteps[i]);
+        }
+    }
+
+    Writer.Family(
+        "nanabox_preparation_last_duration_seconds",
+        "gauge",
+        "Wall time of the last virtual machine preparation.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Sample(
+            "nanabox_preparation_last_duration_seconds",
+            { { "vm", Name } },
+            ::Load(Metrics->PreparationDuration),
+            6);
+    }
+
+    Writer.Family(
+        "nanabox_endpoint_reuse_total",
+        "counter",
+        "Number of network endpoints reused or recreated for adapters.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Sample(
+            "nanabox_endpoint_reuse_total",
+            { { "vm", Name }, { "result", "hit" } },
+            ::Load(Metrics->EndpointReuseHits));
+        Writer.Sample(
+            "nanabox_endpoint_reuse_total",
+            { { "vm", Name }, { "result", "miss" } },
+            ::Load(Metrics->EndpointReuseMisses));
+    }
+
+    Writer.Family(
+        "nanabox_reloads_total",
+        "counter",
+        "Number of configuration reloads.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Sample(
+            "nanabox_reloads_total",
+            { { "vm", Name } },
+            ::Load(Metrics->Reloads));
+    }
+
+    Writer.Family(
+        "nanabox_reload_changes_total",
+        "counter",
+        "Number of changes applied by configuration reloads.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        for (std::size_t i = 0; i < std::size(g_ReloadChangeTypeNames); ++i)
+        {
+            Writer.Sample(
+                "nanabox_reload_changes_total",
+                { { "vm", Name }, { "type", g_ReloadChangeTypeNames[i] } },
+                ::Load(Metrics->ReloadChanges[i]));
+        }
+    }
+
+    Writer.Family(
+        "nanabox_rdp_connects_total",
+        "counter",
+        "Number of remote desktop connection attempts.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Sample(
+            "nanabox_rdp_connects_total",
+            { { "vm", Name } },
+            ::Load(Metrics->RdpConnects));
+    }
+
+    Writer.Family(
+        "nanabox_rdp_disconnects_total",
+        "counter",
+        "Number of remote desktop disconnections.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Sample(
+            "nanabox_rdp_disconnects_total",
+            { { "vm", Name } },
+            ::Load(Metrics->RdpDisconnects));
+    }
+
+    Writer.Family(
+        "nanabox_rdp_reconnects_total",
+        "counter",
+        "Number of remote desktop reconnections.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Sample(
+            "nanabox_rdp_reconnects_total",
+            { { "vm", Name } },
+            ::Load(Metrics->RdpReconnects));
+    }
+
+    Writer.Family(
+        "nanabox_rdp_pipe_connect_duration_seconds",
+        "histogram",
+        "Duration of connecting the named pipe of remote desktop sessions.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Histogram(
+            "nanabox_rdp_pipe_connect_duration_seconds",
+            { { "vm", Name } },
+            Metrics->RdpPipeConnectDuration);
+    }
+
+    Writer.Family(
+        "nanabox_rdp_login_duration_seconds",
+        "histogram",
+        "Duration from connecting the named pipe to the login completion.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Histogram(
+            "nanabox_rdp_login_duration_seconds",
+            { { "vm", Name } },
+            Metrics->RdpLoginDuration);
+    }
+
+    Writer.Family(
+        "nanabox_rdp_session_switch_duration_seconds",
+        "histogram",
+        "Duration from requesting a session mode switch to the login.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        for (std::size_t i = 0; i < std::size(g_RdpSessionSwitchTypeNames); ++i)
+        {
+            Writer.Histogram(
+                "nanabox_rdp_session_switch_duration_seconds",
+                { { "vm", Name }, { "type", g_RdpSessionSwitchTypeNames[i] } },
+                Metrics->RdpSessionSwitches[i]);
+        }
+    }
+
+    Writer.Family(
+        "nanabox_rdp_bandwidth_kbps",
+        "gauge",
+        "Bandwidth percentiles of the latest remote desktop session.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        for (std::size_t i = 0; i < std::size(g_QuantileNames); ++i)
+        {
+            Writer.Sample(
+                "nanabox_rdp_bandwidth_kbps",
+                { { "vm", Name }, { "quantile", g_QuantileNames[i] } },
+                ::Load(Metrics->RdpBandwidth[i]));
+        }
+    }
+
+    Writer.Family(
+        "nanabox_rdp_round_trip_time_seconds",
+        "gauge",
+        "Round trip time percentiles of the latest remote desktop session.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        for (std::size_t i = 0; i < std::size(g_QuantileNames); ++i)
+        {
+            Writer.Sample(
+                "nanabox_rdp_round_trip_time_seconds",
+                { { "vm", Name }, { "quantile", g_QuantileNames[i] } },
+                ::Load(Metrics->RdpRoundTripTime[i]),
+                3);
+        }
+    }
+
+    Writer.Family(
+        "nanabox_rdp_quality_level",
+        "gauge",
+        "Connection quality level of the latest remote desktop session.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Sample(
+            "nanabox_rdp_quality_level",
+            { { "vm", Name } },
+            ::Load(Metrics->RdpQualityLevel));
+    }
+
+    Writer.Family(
+        "nanabox_rdp_quality_changes_total",
+        "counter",
+        "Number of remote desktop connection quality level changes.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Sample(
+            "nanabox_rdp_quality_changes_total",
+            { { "vm", Name } },
+            ::Load(Metrics->RdpQualityChanges));
+    }
+
+    Writer.Family(
+        "nanabox_rdp_auto_reconnects_total",
+        "counter",
+        "Number of remote desktop automatic reconnection attempts.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Sample(
+            "nanabox_rdp_auto_reconnects_total",
+            { { "vm", Name } },
+            ::Load(Metrics->RdpAutoReconnects));
+    }
+
+    Writer.Family(
+        "nanabox_rdp_last_disconnect_reason",
+        "gauge",
+        "Disconnect reason codes of the latest remote desktop session.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Sample(
+            "nanabox_rdp_last_disconnect_reason",
+            { { "vm", Name }, { "type", "Reason" } },
+            ::Load(Metrics->RdpDisconnectReason));
+        Writer.Sample(
+            "nanabox_rdp_last_disconnect_reason",
+            { { "vm", Name }, { "type", "ExtendedReason" } },
+            ::Load(Metrics->RdpExtendedDisconnectReason));
+    }
+
+    Writer.Family(
+        "nanabox_display_sync_requests_total",
+        "counter",
+        "Number of size and DPI changes which request to sync the display "
+        "settings.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Sample(
+            "nanabox_display_sync_requests_total",
+            { { "vm", Name } },
+            ::Load(Metrics->DisplaySyncRequests));
+    }
+
+    Writer.Family(
+        "nanabox_display_sync_wakeups_total",
+        "counter",
+        "Number of UI thread wakeups to sync the display settings.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Sample(
+            "nanabox_display_sync_wakeups_total",
+            { { "vm", Name } },
+            ::Load(Metrics->DisplaySyncWakeups));
+    }
+
+    Writer.Family(
+        "nanabox_display_sync_retries_total",
+        "counter",
+        "Number of failed display settings updates which are retried.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Sample(
+            "nanabox_display_sync_retries_total",
+            { { "vm", Name } },
+            ::Load(Metrics->DisplaySyncRetries));
+    }
+
+    Writer.Family(
+        "nanabox_display_settings_updates_total",
+        "counter",
+        "Number of display settings updates sent to the enhanced session.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Sample(
+            "nanabox_display_settings_updates_total",
+            { { "vm", Name } },
+            ::Load(Metrics->DisplaySettingsUpdates));
+    }
+
+    Writer.Family(
+        "nanabox_vm_uptime_seconds",
+        "gauge",
+        "Uptime of the virtual machine.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Sample(
+            "nanabox_vm_uptime_seconds",
+            { { "vm", Name } },
+            ::Load(Metrics->Uptime),
+            7);
+    }
+
+    Writer.Family(
+        "nanabox_vm_processor_seconds_total",
+        "counter",
+        "Processor time consumed by all virtual processors.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Sample(
+            "nanabox_vm_processor_seconds_total",
+            { { "vm", Name } },
+            ::Load(Metrics->ProcessorRuntime),
+            7);
+    }
+
+    Writer.Family(
+        "nanabox_vm_memory_assigned_bytes",
+        "gauge",
+        "Memory assigned to the virtual machine.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Sample(
+            "nanabox_vm_memory_assigned_bytes",
+            { { "vm", Name } },
+            ::Load(Metrics->AssignedMemory) << 20);
+    }
+
+    Writer.Family(
+        "nanabox_vm_memory_available_bytes",
+        "gauge",
+        "Memory reported as available by the guest.");
+    for (auto const& [Name, Metrics] : g_Registry)
+    {
+        Writer.Sample(
+            "nanabox_vm_memory_available_bytes",
+            { { "vm", Name } },
+            ::Load(Metrics->AvailableMemory) << 20);
+    }
+}
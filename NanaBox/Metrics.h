@@ -0,0 +1,290 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      Metrics.h
+ * PURPOSE:   Definition for the Metrics Registry and Prometheus Formatter
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_METRICS
+#define NANABOX_METRICS
+
+#if (defined(__cplusplus) && __cplusplus >= 201703L)
+#elif (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#else
+#error "[Metrics] You should use a C++ compiler with the C++17 standard."
+#endif
+
+// This module is intentionally free of Windows dependencies, so the registry
+// and the formatter can also be built and verified on other platforms.
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace NanaBox
+{
+    enum class HcsCallType : std::uint32_t
+    {
+        Create = 0,
+        Open = 1,
+        Start = 2,
+        Shutdown = 3,
+        Terminate = 4,
+        Pause = 5,
+        Resume = 6,
+        Save = 7,
+        GetProperties = 8,
+        Modify = 9,
+
+        Count
+    };
+
+    enum class LifecyclePhase : std::uint32_t
+    {
+        Initialize = 0,
+        Restore = 1,
+        Restart = 2,
+        Save = 3,
+        Reload = 4,
+
+        Count
+    };
+
+    enum class ReloadChangeType : std::uint32_t
+    {
+        MemorySize = 0,
+        ComPort = 1,
+        NetworkAdapterAdded = 2,
+        NetworkAdapterRemoved = 3,
+        ScsiDeviceUpdated = 4,
+        ScsiDeviceAdded = 5,
+        ScsiDeviceExpanded = 6,
+
+        Count
+    };
+
+    enum class PreparationStepType : std::uint32_t
+    {
+        ExistenceProbe = 0,
+        DiskAccess = 1,
+        GuestStateFile = 2,
+        RuntimeStateFile = 3,
+        SaveStateFile = 4,
+        NetworkEndpoint = 5,
+
+        Count
+    };
+
+    enum class RdpSessionSwitchType : std::uint32_t
+    {
+        BasicSession = 0,
+        EnhancedSession = 1,
+        PreparedEnhancedSession = 2,
+
+        Count
+    };
+
+    enum class RdpSessionQuantile : std::uint32_t
+    {
+        P50 = 0,
+        P90 = 1,
+        P99 = 2,
+
+        Count
+    };
+
+    struct LatencyHistogram
+    {
+        static constexpr std::size_t BucketCount = 13;
+
+        // The upper bounds of the buckets in microseconds, the implicit last
+        // bucket is +Inf.
+        static const std::uint64_t UpperBounds[BucketCount];
+
+        // Not cumulative, the formatter accumulates them.
+        std::atomic<std::uint64_t> Buckets[BucketCount + 1] = {};
+        std::atomic<std::uint64_t> Sum = 0;
+        std::atomic<std::uint64_t> Count = 0;
+
+        void Observe(
+            std::uint64_t Microseconds);
+    };
+
+    struct VirtualMachineMetrics
+    {
+        LatencyHistogram HcsCalls[
+            static_cast<std::size_t>(HcsCallType::Count)];
+        std::atomic<std::uint64_t> HcsCallFailures[
+            static_cast<std::size_t>(HcsCallType::Count)] = {};
+
+        // The duration of the last occurrence in microseconds.
+        std::atomic<std::uint64_t> LifecycleDurations[
+            static_cast<std::size_t>(LifecyclePhase::Count)] = {};
+        std::atomic<std::uint64_t> LifecycleCounts[
+            static_cast<std::size_t>(LifecyclePhase::Count)] = {};
+
+        LatencyHistogram PreparationSteps[
+            static_cast<std::size_t>(PreparationStepType::Count)];
+        // The wall time of the last preparation in microseconds, the steps
+        // run concurrently so it is shorter than the sum of them.
+        std::atomic<std::uint64_t> PreparationDuration = 0;
+
+        std::atomic<std::uint64_t> EndpointReuseHits = 0;
+        std::atomic<std::uint64_t> EndpointReuseMisses = 0;
+
+        std::atomic<std::uint64_t> Reloads = 0;
+        std::atomic<std::uint64_t> ReloadChanges[
+            static_cast<std::size_t>(ReloadChangeType::Count)] = {};
+
+        std::atomic<std::uint64_t> RdpConnects = 0;
+        std::atomic<std::uint64_t> RdpDisconnects = 0;
+        std::atomic<std::uint64_t> RdpReconnects = 0;
+
+        // The durations from starting to connect the named pipe of the
+        // remote desktop session to the connection and the login.
+        LatencyHistogram RdpPipeConnectDuration;
+        LatencyHistogram RdpLoginDuration;
+        // The durations from requesting the session mode switch to the login
+        // of the new session.
+        LatencyHistogram RdpSessionSwitches[
+            static_cast<std::size_t>(RdpSessionSwitchType::Count)];
+        // The percentiles of the network status reports of the latest
+        // session, in Kbps and milliseconds.
+        std::atomic<std::uint64_t> RdpBandwidth[
+            static_cast<std::size_t>(RdpSessionQuantile::Count)] = {};
+        std::atomic<std::uint64_t> RdpRoundTripTime[
+            static_cast<std::size_t>(RdpSessionQuantile::Count)] = {};
+        std::atomic<std::uint64_t> RdpQualityLevel = 0;
+        std::atomic<std::uint64_t> RdpQualityChanges = 0;
+        std::atomic<std::uint64_t> RdpAutoReconnects = 0;
+        std::atomic<std::uint64_t> RdpDisconnectReason = 0;
+        std::atomic<std::uint64_t> RdpExtendedDisconnectReason = 0;
+
+        // The size and DPI changes which request to sync the display
+        // settings of the enhanced session before they are debounced, the
+        // wakeups of the UI thread to sync them including the retries, and
+        // the updates which are sent to the guest.
+        std::atomic<std::uint64_t> DisplaySyncRequests = 0;
+        std::atomic<std::uint64_t> DisplaySyncWakeups = 0;
+        std::atomic<std::uint64_t> DisplaySyncRetries = 0;
+        std::atomic<std::uint64_t> DisplaySettingsUpdates = 0;
+
+        // The latest resource statistics, in 100ns units and MB.
+        std::atomic<std::uint64_t> Uptime = 0;
+        std::atomic<std::uint64_t> ProcessorRuntime = 0;
+        std::atomic<std::uint64_t> AssignedMemory = 0;
+        std::atomic<std::uint64_t> AvailableMemory = 0;
+
+        void RecordLifecycle(
+            LifecyclePhase Phase,
+            std::chrono::steady_clock::duration Duration);
+
+        void RecordPreparationStep(
+            PreparationStepType Type,
+            std::chrono::steady_clock::duration Duration);
+
+        void RecordReloadChange(
+            ReloadChangeType Type,
+            std::uint64_t Count = 1);
+    };
+
+    // Returns the metrics registered with the name, which are created if they
+    // don't exist.
+    std::shared_ptr<VirtualMachineMetrics> GetVirtualMachineMetrics(
+        std::string const& Name);
+
+    // Removes the metrics from the registry, so they are no longer exported.
+    // The holders of the metrics can still update them, and the next call of
+    // GetVirtualMachineMetrics with the name registers new metrics.
+    void ReleaseVirtualMachineMetrics(
+        std::string const& Name);
+
+    // Observes the lifetime of the object into the histogram of the call and
+    // counts a failure when it is destroyed by an exception.
+    class HcsCallMeasurement
+    {
+    public:
+
+        HcsCallMeasurement(
+            VirtualMachineMetrics* Metrics,
+            HcsCallType Type);
+
+        ~HcsCallMeasurement();
+
+        HcsCallMeasurement(
+            HcsCallMeasurement const&) = delete;
+
+        HcsCallMeasurement& operator=(
+            HcsCallMeasurement const&) = delete;
+
+    private:
+
+        VirtualMachineMetrics* m_Metrics;
+        HcsCallType m_Type;
+        int m_UncaughtExceptions;
+        std::chrono::steady_clock::time_point m_StartTime;
+    };
+
+    struct PrometheusLabel
+    {
+        std::string_view Name;
+        std::string_view Value;
+    };
+
+    // Appends the Prometheus text exposition format to a caller owned buffer,
+    // reusing the buffer makes the steady state free of allocations.
+    class PrometheusTextWriter
+    {
+    public:
+
+        PrometheusTextWriter(
+            std::string& Buffer);
+
+        void Family(
+            std::string_view Name,
+            std::string_view Type,
+            std::string_view Help);
+
+        // Value is written as Value / 10^FractionDigits.
+        void Sample(
+            std::string_view Name,
+            std::initializer_list<PrometheusLabel> Labels,
+            std::uint64_t Value,
+            std::uint32_t FractionDigits = 0);
+
+        void Histogram(
+            std::string_view Name,
+            std::initializer_list<PrometheusLabel> Labels,
+            LatencyHistogram const& Histogram);
+
+    private:
+
+        std::string& m_Buffer;
+
+        void AppendLabels(
+            std::initializer_list<PrometheusLabel> Labels,
+            std::string_view ExtraName = std::string_view(),
+            std::string_view ExtraValue = std::string_view());
+
+        void AppendEscaped(
+            std::string_view Value);
+
+        void AppendNumber(
+            std::uint64_t Value,
+            std::uint32_t FractionDigits);
+    };
+
+    void FormatMetrics(
+        std::string& Buffer);
+}
+
+#endif // !NANABOX_METRICS
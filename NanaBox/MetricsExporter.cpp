@@ -0,0 +1,244 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      MetricsExporter.cpp
+ * PURPOSE:   Implementation for the Prometheus Metrics Exporter
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "MetricsExporter.h"
+
+#include "Utils.h"
+
+#include <Mile.Helpers.CppBase.h>
+
+namespace
+{
+    const DWORD PipeClientTimeout = 5000;
+}
+
+std::wstring NanaBox::GetMetricsPipeName(
+    std::string const& Name)
+{
+    return L"\\\\.\\pipe\\NanaBox.Metrics." + Mile::ToWideString(
+        CP_UTF8,
+        Name);
+}
+
+NanaBox::MetricsExporter::MetricsExporter(
+    std::wstring const& PipeName,
+    std::wstring const& FilePath,
+    DWORD UpdateInterval) :
+    m_PipeName(PipeName),
+    m_FilePath(FilePath),
+    m_UpdateInterval(UpdateInterval)
+{
+    this->m_StopEvent = winrt::handle(::CreateEventExW(
+        nullptr,
+        nullptr,
+        CREATE_EVENT_MANUAL_RESET,
+        EVENT_ALL_ACCESS));
+    winrt::check_bool(static_cast<bool>(this->m_StopEvent));
+
+    this->m_WorkerThread = winrt::handle(Mile::CreateThread([this]()
+    {
+        this->Worker();
+    }));
+    winrt::check_bool(static_cast<bool>(this->m_WorkerThread));
+}
+
+NanaBox::MetricsExporter::~MetricsExporter()
+{
+    ::SetEvent(this->m_StopEvent.get());
+    ::WaitForSingleObject(this->m_WorkerThread.get(), INFINITE);
+}
+
+winrt::file_handle NanaBox::MetricsExporter::CreatePipeInstance()
+{
+    return ::CreateLocalNamedPipe(
+        this->m_PipeName,
+        PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+        64 * 1024,
+        4 * 1024);
+}
+
+void NanaBox::MetricsExporter::ServePipeClient(
+    winrt::file_handle const& PipeHandle)
+{
+    NanaBox::FormatMetrics(this->m_Buffer);
+
+    winrt::handle CompletionEvent = winrt::handle(::CreateEventExW(
+        nullptr,
+        nullptr,
+        CREATE_EVENT_MANUAL_RESET,
+        EVENT_ALL_ACCESS));
+    if (!CompletionEvent)
+    {
+        return;
+    }
+
+    OVERLAPPED Overlapped = { 0 };
+    Overlapped.hEvent = CompletionEvent.get();
+    if (!::WaitForOverlappedOperation(
+        PipeHandle.get(),
+        &Overlapped,
+        ::WriteFile(
+            PipeHandle.get(),
+            this->m_Buffer.c_str(),
+            static_cast<DWORD>(this->m_Buffer.size()),
+            nullptr,
+            &Overlapped),
+        PipeClientTimeout))
+    {
+        return;
+    }
+
+    // Closing the server end discards the unread data, so wait until the
+    // client has read everything and closed its end of the pipe.
+    char Unused = 0;
+    ::ResetEvent(CompletionEvent.get());
+    Overlapped = { 0 };
+    Overlapped.hEvent = CompletionEvent.get();
+    ::WaitForOverlappedOperation(
+        PipeHandle.get(),
+        &Overlapped,
+        ::ReadFile(
+            PipeHandle.get(),
+            &Unused,
+            sizeof(Unused),
+            nullptr,
+            &Overlapped),
+        PipeClientTimeout);
+}
+
+void NanaBox::MetricsExporter::WriteMetricsFile()
+{
+    NanaBox::FormatMetrics(this->m_Buffer);
+
+    // Write to a temporary file and replace the target with it, so scrapers
+    // never observe a partially written file.
+    std::wstring TemporaryFilePath = this->m_FilePath + L".tmp";
+    {
+        winrt::file_handle FileHandle = winrt::file_handle(::CreateFileW(
+            TemporaryFilePath.c_str(),
+            GENERIC_WRITE,
+            0,
+            nullptr,
+            CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr));
+        if (!FileHandle)
+        {
+            return;
+        }
+
+        DWORD NumberOfBytesWritten = 0;
+        if (!::WriteFile(
+            FileHandle.get(),
+            this->m_Buffer.c_str(),
+            static_cast<DWORD>(this->m_Buffer.size()),
+            &NumberOfBytesWritten,
+            nullptr))
+        {
+            return;
+        }
+    }
+
+    ::MoveFileExW(
+        TemporaryFilePath.c_str(),
+        this->m_FilePath.c_str(),
+        MOVEFILE_REPLACE_EXISTING);
+}
+
+void NanaBox::MetricsExporter::Worker()
+{
+    winrt::handle ConnectEvent = winrt::handle(::CreateEventExW(
+        nullptr,
+        nullptr,
+        CREATE_EVENT_MANUAL_RESET,
+        EVENT_ALL_ACCESS));
+    if (!ConnectEvent)
+    {
+        return;
+    }
+
+    OVERLAPPED Overlapped = { 0 };
+    winrt::file_handle PipeHandle;
+    bool Listening = false;
+    ULONGLONG NextFileUpdateTime = 0;
+
+    // The pipe instance is kept for the lifetime of the exporter and reused
+    // for every client, so the pipe name is never released to other users.
+    if (!this->m_PipeName.empty())
+    {
+        PipeHandle = this->CreatePipeInstance();
+    }
+
+    for (;;)
+    {
+        if (PipeHandle && !Listening)
+        {
+            ::ResetEvent(ConnectEvent.get());
+            Overlapped = { 0 };
+            Overlapped.hEvent = ConnectEvent.get();
+            Listening = true;
+            if (!::ConnectNamedPipe(PipeHandle.get(), &Overlapped))
+            {
+                DWORD Error = ::GetLastError();
+                if (ERROR_PIPE_CONNECTED == Error)
+                {
+                    ::SetEvent(ConnectEvent.get());
+                }
+                else if (ERROR_IO_PENDING != Error)
+                {
+                    PipeHandle.close();
+                    Listening = false;
+                }
+            }
+        }
+
+        DWORD Timeout = INFINITE;
+        if (!this->m_FilePath.empty())
+        {
+            ULONGLONG CurrentTime = ::GetTickCount64();
+            Timeout = NextFileUpdateTime > CurrentTime
+                ? static_cast<DWORD>(NextFileUpdateTime - CurrentTime)
+                : 0;
+        }
+
+        HANDLE WaitHandles[] = { this->m_StopEvent.get(), ConnectEvent.get() };
+        DWORD WaitResult = ::WaitForMultipleObjects(
+            Listening ? 2 : 1,
+            WaitHandles,
+            FALSE,
+            Timeout);
+        if (WAIT_OBJECT_0 + 1 == WaitResult)
+        {
+            this->ServePipeClient(PipeHandle);
+            ::DisconnectNamedPipe(PipeHandle.get());
+            Listening = false;
+        }
+        else if (WAIT_TIMEOUT == WaitResult)
+        {
+            this->WriteMetricsFile();
+            NextFileUpdateTime = ::GetTickCount64() + this->m_UpdateInterval;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (Listening)
+    {
+        ::CancelIoEx(PipeHandle.get(), &Overlapped);
+        DWORD NumberOfBytesTransferred = 0;
+        ::GetOverlappedResult(
+            PipeHandle.get(),
+            &Overlapped,
+            &NumberOfBytesTransferred,
+            TRUE);
+    }
+}
@@ -0,0 +1,68 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      MetricsExporter.h
+ * PURPOSE:   Definition for the Prometheus Metrics Exporter
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_METRICS_EXPORTER
+#define NANABOX_METRICS_EXPORTER
+
+#include <Windows.h>
+
+#include <winrt/Windows.Foundation.h>
+
+#include "Metrics.h"
+
+namespace NanaBox
+{
+    // Serves the metrics of all virtual machines in the current process. Each
+    // connection to the named pipe receives one complete exposition and the
+    // client is disconnected afterwards, and the file is rewritten atomically
+    // every update interval. Either endpoint may be omitted with an empty
+    // string. The named pipe only accepts local clients running as the
+    // current user, SYSTEM or the administrators.
+    class MetricsExporter
+    {
+    public:
+
+        MetricsExporter(
+            std::wstring const& PipeName,
+            std::wstring const& FilePath,
+            DWORD UpdateInterval);
+
+        ~MetricsExporter();
+
+        MetricsExporter(
+            MetricsExporter const&) = delete;
+
+        MetricsExporter& operator=(
+            MetricsExporter const&) = delete;
+
+    private:
+
+        std::wstring m_PipeName;
+        std::wstring m_FilePath;
+        DWORD m_UpdateInterval;
+        winrt::handle m_StopEvent;
+        winrt::handle m_WorkerThread;
+        std::string m_Buffer;
+
+        winrt::file_handle CreatePipeInstance();
+
+        void ServePipeClient(
+            winrt::file_handle const& PipeHandle);
+
+        void WriteMetricsFile();
+
+        void Worker();
+    };
+
+    std::wstring GetMetricsPipeName(
+        std::string const& Name);
+}
+
+#endif // !NANABOX_METRICS_EXPORTER
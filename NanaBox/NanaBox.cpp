@@ -15,9 +15,11 @@
 #include "pch.h"
 
 #include "App.h"
+#include "HeadlessHost.h"
 #include "MainWindow.h"
 #include "QuickStartPage.h"
 #include "SponsorPage.h"
+#include "VirtualMachineClone.h"
 
 #include <Mile.Project.Version.h>
 
@@ -114,6 +116,10 @@ int WINAPI wWinMain(
         UnresolvedCommandLine);
 
     bool AcquireSponsorEdition = false;
+    bool Headless = false;
+    std::wstring HeadlessInstanceName;
+    std::size_t HeadlessParallelism = 0;
+    std::size_t CloneCount = 0;
 
     for (auto& Current : OptionsAndParameters)
     {
@@ -121,6 +127,25 @@ int WINAPI wWinMain(
         {
             AcquireSponsorEdition = true;
         }
+        else if (0 == _wcsicmp(Current.first.c_str(), L"Headless"))
+        {
+            Headless = true;
+            HeadlessInstanceName = Current.second;
+        }
+        else if (0 == _wcsicmp(Current.first.c_str(), L"Parallelism"))
+        {
+            HeadlessParallelism = std::wcstoul(
+                Current.second.c_str(),
+                nullptr,
+                10);
+        }
+        else if (0 == _wcsicmp(Current.first.c_str(), L"Clone"))
+        {
+            CloneCount = std::wcstoul(
+                Current.second.c_str(),
+                nullptr,
+                10);
+        }
     }
 
     if (AcquireSponsorEdition)
@@ -230,13 +255,32 @@ int WINAPI wWinMain(
                 ApplicationName = ::GetCurrentProcessModulePath();
             }
 
+            // Only the unresolved command line is passed to the elevated
+            // process, so the options need to be forwarded explicitly.
+            std::wstring Parameters = UnresolvedCommandLine;
+            if (Headless)
+            {
+                Parameters = Mile::FormatWideString(
+                    L"\"--Headless=%s\" --Parallelism=%zu %s",
+                    HeadlessInstanceName.c_str(),
+                    HeadlessParallelism,
+                    UnresolvedCommandLine.c_str());
+            }
+            else if (CloneCount)
+            {
+                Parameters = Mile::FormatWideString(
+                    L"--Clone=%zu %s",
+                    CloneCount,
+                    UnresolvedCommandLine.c_str());
+            }
+
             SHELLEXECUTEINFOW Information = { 0 };
             Information.cbSize = sizeof(SHELLEXECUTEINFOW);
             Information.fMask = SEE_MASK_NOCLOSEPROCESS;
             Information.lpVerb = L"runas";
             Information.nShow = nShowCmd;
             Information.lpFile = ApplicationName.c_str();
-            Information.lpParameters = UnresolvedCommandLine.c_str();
+            Information.lpParameters = Parameters.c_str();
             winrt::check_bool(::ShellExecuteExW(&Information));
             ::WaitForSingleObjectEx(Information.hProcess, INFINITE, FALSE);
             ::CloseHandle(Information.hProcess);
@@ -266,8 +310,90 @@ int WINAPI wWinMain(
         ::ExitProcess(0);
     }
 
+    if (CloneCount)
+    {
+        if (UnresolvedCommandLine.empty())
+        {
+            return -1;
+        }
+
+        SYSTEM_INFO SystemInfo = { 0 };
+        ::GetSystemInfo(&SystemInfo);
+
+        try
+        {
+            ULONGLONG StartTime = ::GetTickCount64();
+            std::vector<std::wstring> ConfigurationFilePaths =
+                NanaBox::CloneVirtualMachine(
+                    ::GetAbsolutePath(UnresolvedCommandLine),
+                    CloneCount,
+                    SystemInfo.dwNumberOfProcessors);
+            ULONGLONG ElapsedTime = ::GetTickCount64() - StartTime;
+
+            std::wstring ContentText;
+            for (std::wstring const& ConfigurationFilePath
+                : ConfigurationFilePaths)
+            {
+                ContentText.append(ConfigurationFilePath);
+                ContentText.append(L"\r\n");
+            }
+            ContentText.append(Mile::FormatWideString(
+                L"\r\n%llu ms",
+                ElapsedTime));
+
+            ::ShowMessageDialog(
+                nullptr,
+                Mile::WinRT::GetLocalizedString(
+                    L"Messages/CloneCompletedInstructionText"),
+                winrt::hstring(ContentText));
+        }
+        catch (...)
+        {
+            winrt::hresult_error Exception = Mile::WinRT::ToHResultError();
+            ::ShowErrorMessageDialog(Exception);
+            ::ExitProcess(Exception.code());
+        }
+
+        ::ExitProcess(0);
+    }
+
     ::PrerequisiteCheck();
 
+    if (Headless)
+    {
+        std::vector<std::wstring> ConfigurationFilePaths;
+        for (std::wstring const& Current
+            : Mile::SplitCommandLineWideString(UnresolvedCommandLine))
+        {
+            ConfigurationFilePaths.push_back(::GetAbsolutePath(Current));
+        }
+        if (ConfigurationFilePaths.empty())
+        {
+            return -1;
+        }
+
+        if (!HeadlessParallelism)
+        {
+            SYSTEM_INFO SystemInfo = { 0 };
+            ::GetSystemInfo(&SystemInfo);
+            HeadlessParallelism = SystemInfo.dwNumberOfProcessors;
+        }
+
+        try
+        {
+            NanaBox::HeadlessHost Host(
+                ConfigurationFilePaths,
+                HeadlessParallelism);
+            Host.Run(NanaBox::GetHeadlessPipeName(HeadlessInstanceName));
+        }
+        catch (...)
+        {
+            return Mile::WinRT::ToHResultError().code();
+        }
+
+        return 0;
+    }
+
     std::wstring ConfigurationFilePath;
 
     if (!UnresolvedCommandLine.empty())
@@ -18,6 +18,34 @@ namespace winrt
     using Windows::System::DispatcherQueuePriority;
 }
 
+namespace
+{
+    const std::int32_t FixedTypeIndex = 1;
+    const std::int32_t DifferencingTypeIndex = 2;
+
+    // The block sizes of the items in the block size combo box, zero means
+    // the default.
+    const DWORD BlockSizes[] =
+    {
+        0,
+        1 * 1024 * 1024,
+        2 * 1024 * 1024,
+        8 * 1024 * 1024,
+        32 * 1024 * 1024,
+        256 * 1024 * 1024,
+    };
+
+    // The logical and physical sector sizes of the items in the sector size
+    // combo box, zero means the default.
+    const DWORD SectorSizes[][2] =
+    {
+        { 0, 0 },
+        { 512, 512 },
+        { 512, 4096 },
+        { 4096, 4096 },
+    };
+}
+
 namespace winrt::NanaBox::implementation
 {
     NewVirtualHardDiskPage::NewVirtualHardDiskPage(
@@ -65,12 +93,63 @@ namespace winrt::NanaBox::implementation
         UNREFERENCED_PARAMETER(sender);
         UNREFERENCED_PARAMETER(e);
 
+        this->BrowseVirtualDiskFile(false);
+    }
+
+    void NewVirtualHardDiskPage::ParentBrowseButtonClickHandler(
+        IInspectable const& sender,
+        RoutedEventArgs const& e)
+    {
+        UNREFERENCED_PARAMETER(sender);
+        UNREFERENCED_PARAMETER(e);
+
+        this->BrowseVirtualDiskFile(true);
+    }
+
+    void NewVirtualHardDiskPage::TypeComboBoxSelectionChanged(
+        winrt::IInspectable const& sender,
+        winrt::SelectionChangedEventArgs const& e)
+    {
+        UNREFERENCED_PARAMETER(sender);
+        UNREFERENCED_PARAMETER(e);
+
+        // The initial selection is raised while loading the markup, which is
+        // before the controls after the combo box are created.
+        if (!this->ParentTextBox() ||
+            !this->ParentBrowseButton() ||
+            !this->SkipZeroingCheckBox())
+        {
+            return;
+        }
+
+        // The differencing disks use the size of the parent.
+        bool Differencing =
+            DifferencingTypeIndex == this->TypeComboBox().SelectedIndex();
+        this->SizeTextBox().IsEnabled(!Differencing);
+        this->SizeUnitComboBox().IsEnabled(!Differencing);
+        this->ParentTextBox().IsEnabled(Differencing);
+        this->ParentBrowseButton().IsEnabled(Differencing);
+
+        // The stale content of the volume is only exposed by the fixed disks.
+        bool Fixed = FixedTypeIndex == this->TypeComboBox().SelectedIndex();
+        this->SkipZeroingCheckBox().IsEnabled(Fixed);
+        if (!Fixed)
+        {
+            this->SkipZeroingCheckBox().IsChecked(false);
+        }
+    }
+
+    void NewVirtualHardDiskPage::BrowseVirtualDiskFile(
+        bool ParentFile)
+    {
         winrt::handle(Mile::CreateThread([=]()
         {
             try
             {
                 winrt::com_ptr<IFileDialog> FileDialog =
-                    winrt::create_instance<IFileDialog>(CLSID_FileSaveDialog);
+                    winrt::create_instance<IFileDialog>(ParentFile
+                        ? CLSID_FileOpenDialog
+                        : CLSID_FileSaveDialog);
 
                 DWORD Flags = 0;
                 winrt::check_hresult(FileDialog->GetOptions(&Flags));
@@ -124,7 +203,14 @@ namespace winrt::NanaBox::implementation
                     winrt::DispatcherQueuePriority::Normal,
                     [=]()
                 {
-                    this->FileNameTextBox().Text(FilePath);
+                    if (ParentFile)
+                    {
+                        this->ParentTextBox().Text(FilePath);
+                    }
+                    else
+                    {
+                        this->FileNameTextBox().Text(FilePath);
+                    }
                 });
             }
             catch (...)
@@ -168,25 +254,73 @@ namespace winrt::NanaBox::implementation
         }
         std::uint64_t Size = OriginalSize * UnitFactors[UnitIndex];
 
+        std::int32_t TypeIndex = this->TypeComboBox().SelectedIndex();
+        std::int32_t BlockSizeIndex =
+            this->BlockSizeComboBox().SelectedIndex();
+        std::int32_t SectorSizeIndex =
+            this->SectorSizeComboBox().SelectedIndex();
+
+        SimpleVirtualDiskCreationOptions Options;
+        Options.Fixed = (FixedTypeIndex == TypeIndex);
+        Options.SkipZeroing =
+            Options.Fixed &&
+            this->SkipZeroingCheckBox().IsChecked().GetBoolean();
+        if (BlockSizeIndex >= 0 &&
+            static_cast<std::size_t>(BlockSizeIndex) < ARRAYSIZE(BlockSizes))
+        {
+            Options.BlockSize = BlockSizes[BlockSizeIndex];
+        }
+        if (SectorSizeIndex >= 0 &&
+            static_cast<std::size_t>(SectorSizeIndex) < ARRAYSIZE(SectorSizes))
+        {
+            Options.LogicalSectorSize = SectorSizes[SectorSizeIndex][0];
+            Options.PhysicalSectorSize = SectorSizes[SectorSizeIndex][1];
+        }
+        if (DifferencingTypeIndex == TypeIndex)
+        {
+            Options.ParentPath = this->ParentTextBox().Text().c_str();
+            Size = 0;
+        }
+
         winrt::hstring SuccessInstructionText =
             Mile::WinRT::GetLocalizedString(
                 L"NewVirtualHardDiskPage/SuccessInstructionText");
         winrt::hstring SuccessContentText =
             Mile::WinRT::GetLocalizedString(
                 L"NewVirtualHardDiskPage/SuccessContentText");
+        winrt::hstring TitleText =
+            Mile::WinRT::GetLocalizedString(
+                L"NewVirtualHardDiskPage/GridTitleTextBlock/Text");
+        winrt::hstring ParentRequiredText =
+            Mile::WinRT::GetLocalizedString(
+                L"NewVirtualHardDiskPage/ParentRequiredText");
 
         winrt::handle(Mile::CreateThread([=]()
         {
-            HANDLE DiskHandle = INVALID_HANDLE_VALUE;
-
-            DWORD Error = ::SimpleCreateVirtualDisk(
-                Path.c_str(),
-                Size,
-                &DiskHandle);
-            if (ERROR_SUCCESS == Error)
+            if (DifferencingTypeIndex == TypeIndex &&
+                Options.ParentPath.empty())
             {
-                ::CloseHandle(DiskHandle);
+                ::ShowMessageDialog(
+                    this->m_WindowHandle,
+                    TitleText,
+                    ParentRequiredText);
+                return;
+            }
 
+            std::unique_ptr<NanaBox::VirtualDiskOperation> Operation =
+                ::SimpleCreateVirtualDiskAsync(
+                    Path.c_str(),
+                    Size,
+                    Options);
+
+            NanaBox::VirtualDiskOperationProgress Progress =
+                ::ShowVirtualDiskOperationProgressDialog(
+                    this->m_WindowHandle,
+                    TitleText,
+                    *Operation);
+            if (NanaBox::VirtualDiskOperationState::Succeeded
+                == Progress.State)
+            {
                 ::ShowMessageDialog(
                     this->m_WindowHandle,
                     SuccessInstructionText.c_str(),
@@ -196,11 +330,12 @@ namespace winrt::NanaBox::implementation
 
                 ::PostMessageW(this->m_WindowHandle, WM_CLOSE, 0, 0);
             }
-            else
+            else if (NanaBox::VirtualDiskOperationState::Failed
+                == Progress.State)
             {
                 ::ShowErrorMessageDialog(
                     this->m_WindowHandle,
-                    winrt::hresult_error(HRESULT_FROM_WIN32(Error)));
+                    ::GetVirtualDiskOperationError(Progress));
             }
         }));
     }
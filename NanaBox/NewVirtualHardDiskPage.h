@@ -10,6 +10,7 @@ namespace winrt
 {
     using Windows::Foundation::IInspectable;
     using Windows::System::DispatcherQueue;
+    using Windows::UI::Xaml::Controls::SelectionChangedEventArgs;
     using Windows::UI::Xaml::Controls::TextBox;
     using Windows::UI::Xaml::Controls::TextBoxBeforeTextChangingEventArgs;
     using Windows::UI::Xaml::RoutedEventArgs;
@@ -35,6 +36,14 @@ namespace winrt::NanaBox::implementation
             winrt::IInspectable const& sender,
             winrt::RoutedEventArgs const& e);
 
+        void ParentBrowseButtonClickHandler(
+            winrt::IInspectable const& sender,
+            winrt::RoutedEventArgs const& e);
+
+        void TypeComboBoxSelectionChanged(
+            winrt::IInspectable const& sender,
+            winrt::SelectionChangedEventArgs const& e);
+
         void CreateButtonClick(
             winrt::IInspectable const& sender,
             winrt::RoutedEventArgs const& e);
@@ -45,6 +54,11 @@ namespace winrt::NanaBox::implementation
 
     private:
 
+        // Shows the save dialog for the new disk or the open dialog for the
+        // parent, and fills the path to the corresponding text box.
+        void BrowseVirtualDiskFile(
+            bool ParentFile);
+
         HWND m_WindowHandle;
         winrt::DispatcherQueue m_DispatcherQueue = nullptr;
     };
@@ -0,0 +1,105 @@
+﻿#include "pch.h"
+#include "OperationProgressPage.h"
+#if __has_include("OperationProgressPage.g.cpp")
+#include "OperationProgressPage.g.cpp"
+#endif
+
+#include "Utils.h"
+
+using namespace winrt;
+using namespace Windows::UI::Xaml;
+
+namespace winrt::NanaBox::implementation
+{
+    OperationProgressPage::OperationProgressPage(
+        _In_ HWND WindowHandle,
+        _In_ winrt::hstring const& InstructionText,
+        _In_ ::NanaBox::VirtualDiskOperation* Operation) :
+        m_WindowHandle(WindowHandle),
+        m_InstructionText(InstructionText),
+        m_Operation(Operation)
+    {
+        ::SetWindowTextW(
+            this->m_WindowHandle,
+            this->m_InstructionText.c_str());
+    }
+
+    void OperationProgressPage::InitializeComponent()
+    {
+        OperationProgressPageT::InitializeComponent();
+
+        this->InstructionTextBlock().Text(this->m_InstructionText);
+
+        if (!this->m_Operation)
+        {
+            return;
+        }
+
+        // The progress is polled by the timer of the dispatcher queue of the
+        // UI thread, so it stops with the dialog and the operation is never
+        // accessed after the dialog is closed.
+        this->m_DispatcherQueue =
+            winrt::DispatcherQueue::GetForCurrentThread();
+        this->m_ProgressTimer = this->m_DispatcherQueue.CreateTimer();
+        this->m_ProgressTimer.Interval(std::chrono::milliseconds(100));
+        this->m_ProgressTimer.Tick([WeakThis = this->get_weak()](
+            winrt::DispatcherQueueTimer const& sender,
+            winrt::IInspectable const& args)
+        {
+            UNREFERENCED_PARAMETER(sender);
+            UNREFERENCED_PARAMETER(args);
+
+            if (auto This = WeakThis.get())
+            {
+                This->RefreshProgress();
+            }
+        });
+        this->m_ProgressTimer.Start();
+    }
+
+    void OperationProgressPage::CancelButtonClick(
+        winrt::IInspectable const& sender,
+        winrt::RoutedEventArgs const& e)
+    {
+        UNREFERENCED_PARAMETER(sender);
+        UNREFERENCED_PARAMETER(e);
+
+        if (!this->m_Operation)
+        {
+            ::DestroyWindow(this->m_WindowHandle);
+            return;
+        }
+
+        // The dialog is closed by the timer when the operation stops.
+        this->m_Operation->Cancel();
+        this->CancelButton().IsEnabled(false);
+        this->ProgressTextBlock().Text(
+            Mile::WinRT::GetLocalizedString(
+                L"OperationProgressPage/CancelingText"));
+    }
+
+    void OperationProgressPage::RefreshProgress()
+    {
+        ::NanaBox::VirtualDiskOperationProgress Progress =
+            this->m_Operation->GetProgress();
+        if (::NanaBox::VirtualDiskOperationState::Running != Progress.State)
+        {
+            this->m_ProgressTimer.Stop();
+            ::PostMessageW(this->m_WindowHandle, WM_CLOSE, 0, 0);
+            return;
+        }
+
+        if (Progress.TotalValue)
+        {
+            double Percentage =
+                100.0 * Progress.CompletedValue / Progress.TotalValue;
+            this->OperationProgressBar().IsIndeterminate(false);
+            this->OperationProgressBar().Value(Percentage);
+            if (this->CancelButton().IsEnabled())
+            {
+                this->ProgressTextBlock().Text(
+                    Mile::FormatWideString(L"%.1f%%", Percentage));
+            }
+        }
+    }
+}
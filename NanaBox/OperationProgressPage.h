@@ -0,0 +1,56 @@
+﻿#pragma once
+
+#include "OperationProgressPage.g.h"
+
+#include <winrt/Windows.System.h>
+
+#include <Windows.h>
+
+#include "VirtualDiskOperation.h"
+
+namespace winrt
+{
+    using Windows::Foundation::IInspectable;
+    using Windows::System::DispatcherQueue;
+    using Windows::System::DispatcherQueueTimer;
+    using Windows::UI::Xaml::RoutedEventArgs;
+}
+
+namespace winrt::NanaBox::implementation
+{
+    struct OperationProgressPage :
+        OperationProgressPageT<OperationProgressPage>
+    {
+    public:
+
+        OperationProgressPage(
+            _In_ HWND WindowHandle = nullptr,
+            _In_ winrt::hstring const& InstructionText = winrt::hstring(),
+            _In_ ::NanaBox::VirtualDiskOperation* Operation = nullptr);
+
+        void InitializeComponent();
+
+        void CancelButtonClick(
+            winrt::IInspectable const& sender,
+            winrt::RoutedEventArgs const& e);
+
+    private:
+
+        void RefreshProgress();
+
+        HWND m_WindowHandle;
+        winrt::hstring m_InstructionText;
+        ::NanaBox::VirtualDiskOperation* m_Operation;
+        winrt::DispatcherQueue m_DispatcherQueue = nullptr;
+        winrt::DispatcherQueueTimer m_ProgressTimer = nullptr;
+    };
+}
+
+namespace winrt::NanaBox::factory_implementation
+{
+    struct OperationProgressPage : OperationProgressPageT<
+        OperationProgressPage,
+        implementation::OperationProgressPage>
+    {
+    };
+}
@@ -0,0 +1,299 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      RdpSessionTelemetry.cpp
+ * PURPOSE:   Implementation for the Remote Desktop Session Telemetry Collector
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "RdpSessionTelemetry.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace
+{
+    std::uint32_t ToUnsigned(
+        std::int32_t Value)
+    {
+        return Value < 0 ? 0 : static_cast<std::uint32_t>(Value);
+    }
+
+    std::uint64_t ToMetricsValue(
+        std::int32_t Value)
+    {
+        return static_cast<std::uint32_t>(Value);
+    }
+}
+
+NanaBox::RdpSessionTelemetry::RdpSessionTelemetry(
+    VirtualMachineMetrics* Metrics,
+    std::size_t Capacity)
+    : m_Metrics(Metrics),
+    m_Capacity(std::max<std::size_t>(Capacity, 1))
+{
+    this->m_Events.reserve(this->m_Capacity);
+    this->m_Samples.reserve(this->m_Capacity);
+}
+
+void NanaBox::RdpSessionTelemetry::RecordPipeConnecting()
+{
+    std::uint64_t Session = this->m_Summary.Session + 1;
+
+    this->m_Events.clear();
+    this->m_Next = 0;
+    this->m_StartTime = std::chrono::steady_clock::now();
+    this->m_Summary = NanaBox::RdpSessionSummary();
+    this->m_Summary.Session = Session;
+
+    this->Append(NanaBox::RdpSessionEventType::PipeConnecting);
+}
+
+void NanaBox::RdpSessionTelemetry::RecordPipeConnected()
+{
+    NanaBox::RdpSessionEvent& Event = this->Append(
+        NanaBox::RdpSessionEventType::PipeConnected);
+
+    this->m_Summary.PipeConnectDuration = Event.Timestamp;
+    if (this->m_Metrics)
+    {
+        this->m_Metrics->RdpPipeConnectDuration.Observe(Event.Timestamp);
+    }
+}
+
+void NanaBox::RdpSessionTelemetry::RecordPipeConnected(
+    std::uint64_t ConnectDuration)
+{
+    this->Append(NanaBox::RdpSessionEventType::PipeConnected);
+
+    this->m_Summary.PipeConnectDuration = ConnectDuration;
+    if (this->m_Metrics)
+    {
+        this->m_Metrics->RdpPipeConnectDuration.Observe(ConnectDuration);
+    }
+}
+
+void NanaBox::RdpSessionTelemetry::RecordLoginComplete()
+{
+    NanaBox::RdpSessionEvent& Event = this->Append(
+        NanaBox::RdpSessionEventType::LoginComplete);
+
+    this->m_Summary.LoginDuration = Event.Timestamp;
+    if (this->m_Metrics)
+    {
+        this->m_Metrics->RdpLoginDuration.Observe(Event.Timestamp);
+    }
+}
+
+void NanaBox::RdpSessionTelemetry::RecordNetworkStatusChanged(
+    std::uint32_t QualityLevel,
+    std::int32_t Bandwidth,
+    std::int32_t RoundTripTime)
+{
+    // The first report of the session is the baseline of the changes, and
+    // the latest report is always in the ring buffer.
+    bool QualityChanged = this->m_Summary.Bandwidth.Count &&
+        this->m_Summary.QualityLevel != QualityLevel;
+
+    NanaBox::RdpSessionEvent& Event = this->Append(
+        QualityChanged
+        ? NanaBox::RdpSessionEventType::QualityChanged
+        : NanaBox::RdpSessionEventType::NetworkStatusChanged);
+    Event.QualityLevel = QualityLevel;
+    Event.Bandwidth = ::ToUnsigned(Bandwidth);
+    Event.RoundTripTime = ::ToUnsigned(RoundTripTime);
+
+    this->m_Summary.QualityLevel = QualityLevel;
+    if (QualityChanged)
+    {
+        ++this->m_Summary.QualityChanges;
+    }
+
+    this->PublishNetworkStatus();
+
+    if (this->m_Metrics && QualityChanged)
+    {
+        ++this->m_Metrics->RdpQualityChanges;
+    }
+}
+
+void NanaBox::RdpSessionTelemetry::RecordAutoReconnecting(
+    std::int32_t DisconnectReason,
+    std::int32_t AttemptCount)
+{
+    NanaBox::RdpSessionEvent& Event = this->Append(
+        NanaBox::RdpSessionEventType::AutoReconnecting);
+    Event.Reason = DisconnectReason;
+    Event.ExtendedReason = AttemptCount;
+
+    ++this->m_Summary.AutoReconnects;
+    if (this->m_Metrics)
+    {
+        ++this->m_Metrics->RdpAutoReconnects;
+    }
+}
+
+void NanaBox::RdpSessionTelemetry::RecordDisconnected(
+    std::int32_t DisconnectReason,
+    std::int32_t ExtendedDisconnectReason)
+{
+    NanaBox::RdpSessionEvent& Event = this->Append(
+        NanaBox::RdpSessionEventType::Disconnected);
+    Event.Reason = DisconnectReason;
+    Event.ExtendedReason = ExtendedDisconnectReason;
+
+    this->m_Summary.Disconnected = true;
+    this->m_Summary.DisconnectReason = DisconnectReason;
+    this->m_Summary.ExtendedDisconnectReason = ExtendedDisconnectReason;
+    if (this->m_Metrics)
+    {
+        this->m_Metrics->RdpDisconnectReason.store(
+            ::ToMetricsValue(DisconnectReason),
+            std::memory_order_relaxed);
+        this->m_Metrics->RdpExtendedDisconnectReason.store(
+            ::ToMetricsValue(ExtendedDisconnectReason),
+            std::memory_order_relaxed);
+    }
+}
+
+std::vector<NanaBox::RdpSessionEvent> NanaBox::RdpSessionTelemetry::Events(
+    ) const
+{
+    std::vector<NanaBox::RdpSessionEvent> Result;
+    Result.reserve(this->m_Events.size());
+    Result.insert(
+        Result.end(),
+        this->m_Events.begin() + this->m_Next,
+        this->m_Events.end());
+    Result.insert(
+        Result.end(),
+        this->m_Events.begin(),
+        this->m_Events.begin() + this->m_Next);
+    return Result;
+}
+
+NanaBox::RdpSessionSummary NanaBox::RdpSessionTelemetry::Summary() const
+{
+    return this->m_Summary;
+}
+
+NanaBox::RdpSessionEvent& NanaBox::RdpSessionTelemetry::Append(
+    RdpSessionEventType Type)
+{
+    NanaBox::RdpSessionEvent Event;
+    Event.Timestamp = static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - this->m_StartTime).count());
+    Event.Type = Type;
+    // Keep the latest network status in every event, so each one of them
+    // describes the session without looking at the previous ones.
+    if (!this->m_Events.empty())
+    {
+        NanaBox::RdpSessionEvent const& Previous = this->m_Events[
+            (this->m_Next + this->m_Events.size() - 1) %
+            this->m_Events.size()];
+        Event.QualityLevel = Previous.QualityLevel;
+        Event.Bandwidth = Previous.Bandwidth;
+        Event.RoundTripTime = Previous.RoundTripTime;
+    }
+
+    ++this->m_Summary.Events;
+
+    std::size_t Index = this->m_Next;
+    if (this->m_Events.size() < this->m_Capacity)
+    {
+        this->m_Events.push_back(Event);
+        Index = this->m_Events.size() - 1;
+        this->m_Next = 0;
+    }
+    else
+    {
+        this->m_Events[Index] = Event;
+        this->m_Next = (Index + 1) % this->m_Capacity;
+    }
+    return this->m_Events[Index];
+}
+
+NanaBox::RdpSessionPercentiles
+NanaBox::RdpSessionTelemetry::CalculatePercentiles(
+    std::uint32_t RdpSessionEvent::* Member)
+{
+    this->m_Samples.clear();
+    for (NanaBox::RdpSessionEvent const& Event : this->m_Events)
+    {
+        if (Event.Type == NanaBox::RdpSessionEventType::NetworkStatusChanged ||
+            Event.Type == NanaBox::RdpSessionEventType::QualityChanged)
+        {
+            this->m_Samples.push_back(Event.*Member);
+        }
+    }
+
+    NanaBox::RdpSessionPercentiles Result;
+    Result.Count = this->m_Samples.size();
+    if (this->m_Samples.empty())
+    {
+        return Result;
+    }
+
+    // The ring buffer is small, so sorting it is cheaper than maintaining an
+    // order statistic structure on every event.
+    std::sort(this->m_Samples.begin(), this->m_Samples.end());
+    auto Rank = [&](std::size_t Permille) -> std::uint32_t
+    {
+        std::size_t Index = (this->m_Samples.size() * Permille + 999) / 1000;
+        return this->m_Samples[Index ? Index - 1 : 0];
+    };
+    Result.Minimum = this->m_Samples.front();
+    Result.P50 = Rank(500);
+    Result.P90 = Rank(900);
+    Result.P99 = Rank(990);
+    Result.Maximum = this->m_Samples.back();
+    return Result;
+}
+
+void NanaBox::RdpSessionTelemetry::PublishNetworkStatus()
+{
+    this->m_Summary.Bandwidth = this->CalculatePercentiles(
+        &NanaBox::RdpSessionEvent::Bandwidth);
+    this->m_Summary.RoundTripTime = this->CalculatePercentiles(
+        &NanaBox::RdpSessionEvent::RoundTripTime);
+
+    if (!this->m_Metrics)
+    {
+        return;
+    }
+
+    NanaBox::RdpSessionPercentiles const& Bandwidth =
+        this->m_Summary.Bandwidth;
+    NanaBox::RdpSessionPercentiles const& RoundTripTime =
+        this->m_Summary.RoundTripTime;
+    const std::uint32_t BandwidthValues[] =
+    {
+        Bandwidth.P50,
+        Bandwidth.P90,
+        Bandwidth.P99,
+    };
+    const std::uint32_t RoundTripTimeValues[] =
+    {
+        RoundTripTime.P50,
+        RoundTripTime.P90,
+        RoundTripTime.P99,
+    };
+    static_assert(
+        std::size(BandwidthValues) ==
+        static_cast<std::size_t>(NanaBox::RdpSessionQuantile::Count));
+    for (std::size_t i = 0; i < std::size(BandwidthValues); ++i)
+    {
+        this->m_Metrics->RdpBandwidth[i].store(
+            BandwidthValues[i],
+            std::memory_order_relaxed);
+        this->m_Metrics->RdpRoundTripTime[i].store(
+            RoundTripTimeValues[i],
+            std::memory_order_relaxed);
+    }
+    this->m_Metrics->RdpQualityLevel.store(
+        this->m_Summary.QualityLevel,
+        std::memory_order_relaxed);
+}
@@ -0,0 +1,167 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      RdpSessionTelemetry.h
+ * PURPOSE:   Definition for the Remote Desktop Session Telemetry Collector
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_RDP_SESSION_TELEMETRY
+#define NANABOX_RDP_SESSION_TELEMETRY
+
+#if (defined(__cplusplus) && __cplusplus >= 201703L)
+#elif (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#else
+#error "[RdpSessionTelemetry] You should use a C++ compiler with the C++17 standard."
+#endif
+
+// This module is intentionally free of Windows dependencies like the metrics
+// registry, the caller forwards the events of the remote desktop client.
+
+#include "Metrics.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace NanaBox
+{
+    enum class RdpSessionEventType : std::uint32_t
+    {
+        PipeConnecting = 0,
+        PipeConnected = 1,
+        LoginComplete = 2,
+        NetworkStatusChanged = 3,
+        QualityChanged = 4,
+        AutoReconnecting = 5,
+        Disconnected = 6,
+    };
+
+    struct RdpSessionEvent
+    {
+        // The time since the session started connecting the named pipe in
+        // microseconds.
+        std::uint64_t Timestamp = 0;
+        RdpSessionEventType Type = RdpSessionEventType::PipeConnecting;
+        // The network status reported by the client, the bandwidth is in Kbps
+        // and the round trip time is in milliseconds.
+        std::uint32_t QualityLevel = 0;
+        std::uint32_t Bandwidth = 0;
+        std::uint32_t RoundTripTime = 0;
+        // The disconnect reason of the Disconnected and AutoReconnecting
+        // events, the extended reason is the attempt count of the latter.
+        std::int32_t Reason = 0;
+        std::int32_t ExtendedReason = 0;
+    };
+
+    // The nearest-rank percentiles of the samples in the ring buffer.
+    struct RdpSessionPercentiles
+    {
+        std::uint64_t Count = 0;
+        std::uint32_t Minimum = 0;
+        std::uint32_t P50 = 0;
+        std::uint32_t P90 = 0;
+        std::uint32_t P99 = 0;
+        std::uint32_t Maximum = 0;
+    };
+
+    struct RdpSessionSummary
+    {
+        // Starts from 1, and it is 0 if no session has been started.
+        std::uint64_t Session = 0;
+        // All events of the session, including the ones which have been
+        // overwritten in the ring buffer.
+        std::uint64_t Events = 0;
+        // The durations from starting to connect the named pipe in
+        // microseconds, they are 0 if the step is not completed.
+        std::uint64_t PipeConnectDuration = 0;
+        std::uint64_t LoginDuration = 0;
+        std::uint32_t QualityLevel = 0;
+        std::uint64_t QualityChanges = 0;
+        std::uint64_t AutoReconnects = 0;
+        RdpSessionPercentiles Bandwidth;
+        RdpSessionPercentiles RoundTripTime;
+        bool Disconnected = false;
+        std::int32_t DisconnectReason = 0;
+        std::int32_t ExtendedDisconnectReason = 0;
+    };
+
+    // Records the events of the remote desktop sessions into a ring buffer,
+    // which is reset when the next session starts, and publishes the summary
+    // to the metrics. The network status percentiles show the display path
+    // while the resource statistics show the virtual machine, so they tell
+    // which one makes the session sluggish.
+    //
+    // It is not thread safe, the caller records the events from the thread
+    // which owns the remote desktop client.
+    class RdpSessionTelemetry
+    {
+    public:
+
+        static constexpr std::size_t DefaultCapacity = 256;
+
+        RdpSessionTelemetry(
+            VirtualMachineMetrics* Metrics,
+            std::size_t Capacity = DefaultCapacity);
+
+        RdpSessionTelemetry(
+            RdpSessionTelemetry const&) = delete;
+
+        RdpSessionTelemetry& operator=(
+            RdpSessionTelemetry const&) = delete;
+
+        // Starts a new session and discards the events of the previous one.
+        void RecordPipeConnecting();
+
+        void RecordPipeConnected();
+
+        // The named pipe was connected by a connector started before the
+        // session, so the duration of the connector in microseconds is used
+        // instead of the time since RecordPipeConnecting.
+        void RecordPipeConnected(
+            std::uint64_t ConnectDuration);
+
+        void RecordLoginComplete();
+
+        void RecordNetworkStatusChanged(
+            std::uint32_t QualityLevel,
+            std::int32_t Bandwidth,
+            std::int32_t RoundTripTime);
+
+        void RecordAutoReconnecting(
+            std::int32_t DisconnectReason,
+            std::int32_t AttemptCount);
+
+        void RecordDisconnected(
+            std::int32_t DisconnectReason,
+            std::int32_t ExtendedDisconnectReason);
+
+        // Returns the events ordered from the oldest to the newest.
+        std::vector<RdpSessionEvent> Events() const;
+
+        RdpSessionSummary Summary() const;
+
+    private:
+
+        VirtualMachineMetrics* m_Metrics;
+        std::vector<RdpSessionEvent> m_Events;
+        std::size_t m_Capacity;
+        std::size_t m_Next = 0;
+        std::chrono::steady_clock::time_point m_StartTime;
+        RdpSessionSummary m_Summary;
+        std::vector<std::uint32_t> m_Samples;
+
+        RdpSessionEvent& Append(
+            RdpSessionEventType Type);
+
+        RdpSessionPercentiles CalculatePercentiles(
+            std::uint32_t RdpSessionEvent::* Member);
+
+        void PublishNetworkStatus();
+    };
+}
+
+#endif // !NANABOX_RDP_SESSION_TELEMETRY
@@ -21,8 +21,10 @@ namespace winrt
 namespace winrt::NanaBox::implementation
 {
     ResizeVirtualHardDiskPage::ResizeVirtualHardDiskPage(
-        _In_ HWND WindowHandle)
-        : m_WindowHandle(WindowHandle)
+        _In_ HWND WindowHandle,
+        _In_ std::function<void(std::wstring const&)> const& ResizedHandler)
+        : m_WindowHandle(WindowHandle),
+        m_ResizedHandler(ResizedHandler)
     {
         ::SetWindowTextW(
             this->m_WindowHandle,
@@ -177,17 +179,37 @@ namespace winrt::NanaBox::implementation
         winrt::hstring SuccessContentText =
             Mile::WinRT::GetLocalizedString(
                 L"ResizeVirtualHardDiskPage/SuccessContentText");
+        winrt::hstring TitleText =
+            Mile::WinRT::GetLocalizedString(
+                L"ResizeVirtualHardDiskPage/GridTitleTextBlock/Text");
 
         winrt::handle(Mile::CreateThread([=]()
         {
-            HWND WaitingHandle = ::ShowOperationWaitingWindow(this->m_WindowHandle);
-
-            DWORD Error = ::SimpleResizeVirtualDisk(
-                Path.c_str(),
-                Size);
+            std::unique_ptr<NanaBox::VirtualDiskOperation> Operation =
+                ::SimpleResizeVirtualDiskAsync(
+                    Path.c_str(),
+                    Size);
 
-            if (ERROR_SUCCESS == Error)
+            NanaBox::VirtualDiskOperationProgress Progress =
+                ::ShowVirtualDiskOperationProgressDialog(
+                    this->m_WindowHandle,
+                    TitleText,
+                    *Operation);
+            if (NanaBox::VirtualDiskOperationState::Succeeded
+                == Progress.State)
             {
+                if (this->m_ResizedHandler)
+                {
+                    try
+                    {
+                        this->m_ResizedHandler(Path.c_str());
+                    }
+                    catch (...)
+                    {
+
+                    }
+                }
+
                 ::ShowMessageDialog(
                     this->m_WindowHandle,
                     SuccessInstructionText.c_str(),
@@ -197,14 +219,13 @@ namespace winrt::NanaBox::implementation
 
                 ::PostMessageW(this->m_WindowHandle, WM_CLOSE, 0, 0);
             }
-            else
+            else if (NanaBox::VirtualDiskOperationState::Failed
+                == Progress.State)
             {
                 ::ShowErrorMessageDialog(
                     this->m_WindowHandle,
-                    winrt::hresult_error(HRESULT_FROM_WIN32(Error)));
+                    ::GetVirtualDiskOperationError(Progress));
             }
-
-            ::SendMessageW(WaitingHandle, WM_CLOSE, 0, 0);
         }));
     }
 
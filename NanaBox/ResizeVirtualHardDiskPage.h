@@ -6,6 +6,9 @@
 
 #include <Windows.h>
 
+#include <functional>
+#include <string>
+
 namespace winrt
 {
     using Windows::Foundation::IInspectable;
@@ -21,8 +24,12 @@ namespace winrt::NanaBox::implementation
         ResizeVirtualHardDiskPageT<ResizeVirtualHardDiskPage>
     {
     public:
+        // The handler is called with the path after a disk is resized, which
+        // is used to notify the running virtual machine which uses the disk.
         ResizeVirtualHardDiskPage(
-            _In_ HWND WindowHandle = nullptr);
+            _In_ HWND WindowHandle = nullptr,
+            _In_ std::function<void(std::wstring const&)> const&
+                ResizedHandler = nullptr);
 
         void InitializeComponent();
 
@@ -44,6 +51,7 @@ namespace winrt::NanaBox::implementation
         
     private:
         HWND m_WindowHandle;
+        std::function<void(std::wstring const&)> m_ResizedHandler;
         winrt::DispatcherQueue m_DispatcherQueue = nullptr;
     };
 }
@@ -12,24 +12,24 @@
 #include <Shlwapi.h>
 #pragma comment(lib, "Shlwapi.lib")
 
-#include <dwmapi.h>
-#pragma comment(lib, "dwmapi.lib")
-
 #include <sddl.h>
 
 #include <winrt/Windows.UI.Xaml.Controls.h>
 
+#include "VirtualDiskImage.h"
+
 #include "MessagePage.h"
 #include "AboutPage.h"
 #include "NewVirtualHardDiskPage.h"
+#include "OperationProgressPage.h"
 #include "ResizeVirtualHardDiskPage.h"
 
-namespace winrt
+#include <new>
+#include <system_error>
+
+namespace
 {
-    using Windows::UI::Xaml::HorizontalAlignment;
-    using Windows::UI::Xaml::ThicknessHelper;
-    using Windows::UI::Xaml::VerticalAlignment;
-    using Windows::UI::Xaml::Controls::ProgressRing;
+    thread_local std::wstring g_CurrentThreadBaseDirectory;
 }
 
 void SplitCommandLineEx(
@@ -236,19 +236,90 @@ void WriteAllTextToUtf8TextFile(
         &NumberOfBytesWritten));
 }
 
+void ReplaceAllTextInUtf8TextFile(
+    std::wstring const& Path,
+    std::string& Content)
+{
+    std::wstring TemporaryPath = Path + L".tmp";
+
+    try
+    {
+        winrt::file_handle FileHandle;
+
+        FileHandle.attach(::MileCreateFile(
+            TemporaryPath.c_str(),
+            GENERIC_WRITE,
+            0,
+            nullptr,
+            CREATE_ALWAYS,
+            FILE_FLAG_SEQUENTIAL_SCAN,
+            nullptr));
+        if (!FileHandle)
+        {
+            winrt::throw_last_error();
+        }
+
+        DWORD NumberOfBytesWritten = 0;
+
+        const std::string BOM = "\xEF\xBB\xBF";
+
+        winrt::check_bool(::MileWriteFile(
+            FileHandle.get(),
+            BOM.c_str(),
+            static_cast<DWORD>(BOM.size()),
+            &NumberOfBytesWritten));
+
+        winrt::check_bool(::MileWriteFile(
+            FileHandle.get(),
+            Content.c_str(),
+            static_cast<DWORD>(Content.size()),
+            &NumberOfBytesWritten));
+
+        winrt::check_bool(::FlushFileBuffers(FileHandle.get()));
+    }
+    catch (...)
+    {
+        ::MileDeleteFileIgnoreReadonlyAttribute(TemporaryPath.c_str());
+        throw;
+    }
+
+    if (!::MoveFileExW(
+        TemporaryPath.c_str(),
+        Path.c_str(),
+        MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    {
+        DWORD LastError = ::GetLastError();
+        ::MileDeleteFileIgnoreReadonlyAttribute(TemporaryPath.c_str());
+        winrt::throw_hresult(HRESULT_FROM_WIN32(LastError));
+    }
+}
+
 std::wstring GetAbsolutePath(
     std::wstring const& FileName)
 {
+    std::wstring RawPath = FileName;
+    if (!g_CurrentThreadBaseDirectory.empty() &&
+        ::PathIsRelativeW(FileName.c_str()))
+    {
+        RawPath = g_CurrentThreadBaseDirectory + L"\\" + FileName;
+    }
+
     // 32767 is the maximum path length without the terminating null character.
     std::wstring Path(32767, L'\0');
     Path.resize(::GetFullPathNameW(
-        FileName.c_str(),
+        RawPath.c_str(),
         static_cast<DWORD>(Path.size()),
         &Path[0],
         nullptr));
     return Path;
 }
 
+void SetCurrentThreadBaseDirectory(
+    std::wstring const& BaseDirectory)
+{
+    g_CurrentThreadBaseDirectory = BaseDirectory;
+}
+
 HWND CreateXamlDialog(
     _In_opt_ HWND ParentWindowHandle)
 {
@@ -550,47 +621,508 @@ DWORD SimpleCreateVirtualDisk(
     _In_ UINT64 Size,
     _Out_ PHANDLE Handle)
 {
+    return ::SimpleCreateVirtualDisk(
+        Path,
+        Size,
+        SimpleVirtualDiskCreationOptions(),
+        Handle);
+}
+
+namespace
+{
+    // The fixed disks are created by the portable library, which reports the
+    // progress of zeroing the payload and can skip it, while VirtDisk zeros
+    // the payload without progress.
+    bool IsPreallocatedVirtualDisk(
+        _In_ PCWSTR Path,
+        _In_ SimpleVirtualDiskCreationOptions const& Options)
+    {
+        PCWSTR Extension = ::PathFindExtensionW(Path);
+        return Options.Fixed &&
+            Options.ParentPath.empty() &&
+            (0 == ::_wcsicmp(Extension, L".vhdx") ||
+                0 == ::_wcsicmp(Extension, L".vhd"));
+    }
+
+    NanaBox::VirtualDiskCreateParameters GetPreallocatedVirtualDiskParameters(
+        _In_ PCWSTR Path,
+        _In_ UINT64 Size,
+        _In_ SimpleVirtualDiskCreationOptions const& Options)
+    {
+        bool Vhdx = (0 == ::_wcsicmp(::PathFindExtensionW(Path), L".vhdx"));
+
+        NanaBox::VirtualDiskCreateParameters Parameters;
+        Parameters.Format = Vhdx
+            ? NanaBox::VirtualDiskFormat::Vhdx
+            : NanaBox::VirtualDiskFormat::Vhd;
+        Parameters.Type = NanaBox::VirtualDiskType::Fixed;
+        Parameters.VirtualSize = Size;
+        Parameters.BlockSize = Options.BlockSize;
+        if (!Parameters.BlockSize && Vhdx)
+        {
+            Parameters.BlockSize = 0x100000; // 1 MiB for VHDX
+        }
+        if (Options.LogicalSectorSize)
+        {
+            Parameters.LogicalSectorSize = Options.LogicalSectorSize;
+        }
+        if (Options.PhysicalSectorSize)
+        {
+            Parameters.PhysicalSectorSize = Options.PhysicalSectorSize;
+        }
+        Parameters.SkipZeroing = Options.SkipZeroing;
+        return Parameters;
+    }
+
+    DWORD CreateVirtualDiskWithOptions(
+        _In_ PCWSTR Path,
+        _In_ UINT64 Size,
+        _In_ SimpleVirtualDiskCreationOptions const& Options,
+        _In_opt_ LPOVERLAPPED Overlapped,
+        _Out_ PHANDLE Handle)
+    {
+        bool Vhdx = (0 == ::_wcsicmp(::PathFindExtensionW(Path), L".vhdx"));
+        bool Vhd = (0 == ::_wcsicmp(::PathFindExtensionW(Path), L".vhd"));
+
+        // The storage type is specified explicitly if the format is known, so
+        // the format doesn't depend on the detection of VirtDisk.
+        VIRTUAL_STORAGE_TYPE StorageType;
+        if (Vhdx || Vhd)
+        {
+            StorageType.DeviceId = Vhdx
+                ? VIRTUAL_STORAGE_TYPE_DEVICE_VHDX
+                : VIRTUAL_STORAGE_TYPE_DEVICE_VHD;
+            StorageType.VendorId = VIRTUAL_STORAGE_TYPE_VENDOR_MICROSOFT;
+        }
+        else
+        {
+            StorageType.DeviceId = VIRTUAL_STORAGE_TYPE_DEVICE_UNKNOWN;
+            StorageType.VendorId = VIRTUAL_STORAGE_TYPE_VENDOR_UNKNOWN;
+        }
+
+        CREATE_VIRTUAL_DISK_PARAMETERS Parameters;
+        std::memset(&Parameters, 0, sizeof(CREATE_VIRTUAL_DISK_PARAMETERS));
+        Parameters.Version = CREATE_VIRTUAL_DISK_VERSION_2;
+        Parameters.Version2.BlockSizeInBytes = Options.BlockSize;
+        Parameters.Version2.SectorSizeInBytes = Options.LogicalSectorSize;
+        Parameters.Version2.PhysicalSectorSizeInBytes =
+            Options.PhysicalSectorSize;
+        if (Options.ParentPath.empty())
+        {
+            Parameters.Version2.MaximumSize = Size;
+            if (!Parameters.Version2.BlockSizeInBytes)
+            {
+                Parameters.Version2.BlockSizeInBytes = Vhdx
+                    ? 0x100000 // 1 MiB for VHDX
+                    : 0x80000; // 512 KiB for VHD
+            }
+        }
+        else
+        {
+            Parameters.Version2.ParentPath = Options.ParentPath.c_str();
+        }
+
+        return ::CreateVirtualDisk(
+            &StorageType,
+            Path,
+            VIRTUAL_DISK_ACCESS_NONE,
+            nullptr,
+            Options.Fixed
+                ? CREATE_VIRTUAL_DISK_FLAG_FULL_PHYSICAL_ALLOCATION
+                : CREATE_VIRTUAL_DISK_FLAG_NONE,
+            0,
+            &Parameters,
+            Overlapped,
+            Handle);
+    }
+
+    DWORD OpenVirtualDiskForMaintenance(
+        _In_ PCWSTR Path,
+        _Out_ PHANDLE Handle)
+    {
+        VIRTUAL_STORAGE_TYPE StorageType;
+        StorageType.DeviceId = VIRTUAL_STORAGE_TYPE_DEVICE_UNKNOWN;
+        StorageType.VendorId = VIRTUAL_STORAGE_TYPE_VENDOR_UNKNOWN;
+
+        return ::OpenVirtualDisk(
+            &StorageType,
+            Path,
+            VIRTUAL_DISK_ACCESS_ALL,
+            OPEN_VIRTUAL_DISK_FLAG_NONE,
+            nullptr,
+            Handle);
+    }
+
+    // The version 2 handles are shared with the instance of the disk which
+    // is attached to a running virtual machine, so the metadata operations
+    // like the online expansion of VHDX are possible via them.
+    DWORD OpenVirtualDiskForOnlineMaintenance(
+        _In_ PCWSTR Path,
+        _In_ BOOL GetInfoOnly,
+        _Out_ PHANDLE Handle)
+    {
+        VIRTUAL_STORAGE_TYPE StorageType;
+        StorageType.DeviceId = VIRTUAL_STORAGE_TYPE_DEVICE_UNKNOWN;
+        StorageType.VendorId = VIRTUAL_STORAGE_TYPE_VENDOR_UNKNOWN;
+
+        OPEN_VIRTUAL_DISK_PARAMETERS OpenParameters;
+        std::memset(&OpenParameters, 0, sizeof(OPEN_VIRTUAL_DISK_PARAMETERS));
+        OpenParameters.Version = OPEN_VIRTUAL_DISK_VERSION_2;
+        OpenParameters.Version2.GetInfoOnly = GetInfoOnly;
+
+        return ::OpenVirtualDisk(
+            &StorageType,
+            Path,
+            VIRTUAL_DISK_ACCESS_NONE,
+            OPEN_VIRTUAL_DISK_FLAG_NONE,
+            &OpenParameters,
+            Handle);
+    }
+
+    // The overlapped VirtDisk call, whose progress is queried via
+    // GetVirtualDiskOperationProgress and which is canceled via CancelIoEx.
+    class VirtDiskOperation : public NanaBox::VirtualDiskOperation
+    {
+    public:
+
+        VirtDiskOperation()
+        {
+            std::memset(&this->m_Overlapped, 0, sizeof(OVERLAPPED));
+            this->m_Overlapped.hEvent = ::CreateEventW(
+                nullptr,
+                TRUE,
+                FALSE,
+                nullptr);
+            if (!this->m_Overlapped.hEvent)
+            {
+                winrt::throw_last_error();
+            }
+        }
+
+        ~VirtDiskOperation()
+        {
+            if (!this->Wait(0))
+            {
+                this->Cancel();
+                this->Wait(INFINITE);
+            }
+            if (INVALID_HANDLE_VALUE != this->m_DiskHandle)
+            {
+                ::CloseHandle(this->m_DiskHandle);
+            }
+            ::CloseHandle(this->m_Overlapped.hEvent);
+        }
+
+        LPOVERLAPPED GetOverlapped()
+        {
+            return &this->m_Overlapped;
+        }
+
+        // Takes the ownership of the disk handle. The result of the call is
+        // ERROR_IO_PENDING if the operation is started in the background.
+        void Start(
+            _In_ HANDLE DiskHandle,
+            _In_ DWORD Error)
+        {
+            this->m_DiskHandle = DiskHandle;
+            this->m_Error = Error;
+        }
+
+        NanaBox::VirtualDiskOperationProgress GetProgress() const override
+        {
+            NanaBox::VirtualDiskOperationProgress Result;
+
+            DWORD Status = this->m_Error;
+            if (ERROR_IO_PENDING == Status)
+            {
+                VIRTUAL_DISK_PROGRESS Progress;
+                std::memset(&Progress, 0, sizeof(VIRTUAL_DISK_PROGRESS));
+                Status = ::GetVirtualDiskOperationProgress(
+                    this->m_DiskHandle,
+                    const_cast<LPOVERLAPPED>(&this->m_Overlapped),
+                    &Progress);
+                if (ERROR_SUCCESS == Status)
+                {
+                    Status = Progress.OperationStatus;
+                    Result.CompletedValue = Progress.CurrentValue;
+                    Result.TotalValue = Progress.CompletionValue;
+                }
+            }
+
+            switch (Status)
+            {
+            case ERROR_IO_PENDING:
+                Result.State = NanaBox::VirtualDiskOperationState::Running;
+                break;
+            case ERROR_SUCCESS:
+                Result.State = NanaBox::VirtualDiskOperationState::Succeeded;
+                break;
+            case ERROR_OPERATION_ABORTED:
+            case ERROR_CANCELLED:
+                Result.State = NanaBox::VirtualDiskOperationState::Canceled;
+                Result.ErrorCode = Status;
+                break;
+            default:
+                Result.State = NanaBox::VirtualDiskOperationState::Failed;
+                Result.ErrorCode = Status;
+                break;
+            }
+
+            return Result;
+        }
+
+        void Cancel() override
+        {
+            if (ERROR_IO_PENDING == this->m_Error)
+            {
+                ::CancelIoEx(this->m_DiskHandle, &this->m_Overlapped);
+            }
+        }
+
+        bool Wait(
+            std::uint32_t Milliseconds) override
+        {
+            if (ERROR_IO_PENDING != this->m_Error)
+            {
+                return true;
+            }
+            return WAIT_OBJECT_0 == ::WaitForSingleObject(
+                this->m_Overlapped.hEvent,
+                Milliseconds);
+        }
+
+    private:
+
+        OVERLAPPED m_Overlapped;
+        HANDLE m_DiskHandle = INVALID_HANDLE_VALUE;
+        DWORD m_Error = ERROR_SUCCESS;
+    };
+}
+
+DWORD SimpleCreateVirtualDisk(
+    _In_ PCWSTR Path,
+    _In_ UINT64 Size,
+    _In_ SimpleVirtualDiskCreationOptions const& Options,
+    _Out_ PHANDLE Handle)
+{
+    if (!::IsPreallocatedVirtualDisk(Path, Options))
+    {
+        return ::CreateVirtualDiskWithOptions(
+            Path,
+            Size,
+            Options,
+            nullptr,
+            Handle);
+    }
+
+    try
+    {
+        NanaBox::VirtualDiskImage::Create(
+            Mile::ToString(CP_UTF8, Path),
+            ::GetPreallocatedVirtualDiskParameters(Path, Size, Options));
+    }
+    catch (std::system_error const& Exception)
+    {
+        // The library reports the failed system calls with the Win32 error
+        // codes.
+        return static_cast<DWORD>(Exception.code().value());
+    }
+    catch (std::bad_alloc const&)
+    {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    catch (...)
+    {
+        // The other failures of the library are the invalid parameters.
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    // The created disk is opened via VirtDisk, so the callers get the same
+    // handle as the other disks.
     VIRTUAL_STORAGE_TYPE StorageType;
-    StorageType.DeviceId = VIRTUAL_STORAGE_TYPE_DEVICE_UNKNOWN;
-    StorageType.VendorId = VIRTUAL_STORAGE_TYPE_VENDOR_UNKNOWN;
-
-    CREATE_VIRTUAL_DISK_PARAMETERS Parameters;
-    std::memset(&Parameters, 0, sizeof(CREATE_VIRTUAL_DISK_PARAMETERS));
-    Parameters.Version = CREATE_VIRTUAL_DISK_VERSION_2;
-    Parameters.Version2.MaximumSize = Size;
-    Parameters.Version2.BlockSizeInBytes =
+    StorageType.DeviceId =
         (0 == ::_wcsicmp(::PathFindExtensionW(Path), L".vhdx"))
-        ? 0x100000 // 1 MiB for VHDX
-        : 0x80000; // 512 KiB for VHD
+        ? VIRTUAL_STORAGE_TYPE_DEVICE_VHDX
+        : VIRTUAL_STORAGE_TYPE_DEVICE_VHD;
+    StorageType.VendorId = VIRTUAL_STORAGE_TYPE_VENDOR_MICROSOFT;
 
-    return ::CreateVirtualDisk(
+    OPEN_VIRTUAL_DISK_PARAMETERS OpenParameters;
+    std::memset(&OpenParameters, 0, sizeof(OPEN_VIRTUAL_DISK_PARAMETERS));
+    OpenParameters.Version = OPEN_VIRTUAL_DISK_VERSION_2;
+
+    return ::OpenVirtualDisk(
         &StorageType,
         Path,
         VIRTUAL_DISK_ACCESS_NONE,
-        nullptr,
-        CREATE_VIRTUAL_DISK_FLAG_NONE,
-        0,
-        &Parameters,
-        nullptr,
+        OPEN_VIRTUAL_DISK_FLAG_NONE,
+        &OpenParameters,
         Handle);
 }
 
+std::unique_ptr<NanaBox::VirtualDiskOperation> SimpleCreateVirtualDiskAsync(
+    _In_ PCWSTR Path,
+    _In_ UINT64 Size,
+    _In_ SimpleVirtualDiskCreationOptions const& Options)
+{
+    if (::IsPreallocatedVirtualDisk(Path, Options))
+    {
+        return NanaBox::StartCreateVirtualDiskOperation(
+            Mile::ToString(CP_UTF8, Path),
+            ::GetPreallocatedVirtualDiskParameters(Path, Size, Options));
+    }
+
+    std::unique_ptr<VirtDiskOperation> Operation =
+        std::make_unique<VirtDiskOperation>();
+    HANDLE DiskHandle = INVALID_HANDLE_VALUE;
+    DWORD Error = ::CreateVirtualDiskWithOptions(
+        Path,
+        Size,
+        Options,
+        Operation->GetOverlapped(),
+        &DiskHandle);
+    Operation->Start(DiskHandle, Error);
+    return Operation;
+}
+
+DWORD SimpleCreateDifferencingVirtualDisk(
+    _In_ PCWSTR Path,
+    _In_ PCWSTR ParentPath)
+{
+    HANDLE DiskHandle = INVALID_HANDLE_VALUE;
+
+    SimpleVirtualDiskCreationOptions Options;
+    Options.ParentPath = ParentPath;
+
+    DWORD Error = ::SimpleCreateVirtualDisk(
+        Path,
+        0,
+        Options,
+        &DiskHandle);
+    if (ERROR_SUCCESS == Error)
+    {
+        ::CloseHandle(DiskHandle);
+    }
+    return Error;
+}
+
+DWORD SimpleSetVirtualDiskReadOnly(
+    _In_ PCWSTR Path,
+    _In_ BOOL ReadOnly)
+{
+    DWORD Attributes = ::GetFileAttributesW(Path);
+    if (INVALID_FILE_ATTRIBUTES == Attributes)
+    {
+        return ::GetLastError();
+    }
+
+    DWORD NewAttributes = ReadOnly
+        ? Attributes | FILE_ATTRIBUTE_READONLY
+        : Attributes & ~FILE_ATTRIBUTE_READONLY;
+    if (NewAttributes == Attributes)
+    {
+        return ERROR_SUCCESS;
+    }
+
+    return ::SetFileAttributesW(Path, NewAttributes)
+        ? ERROR_SUCCESS
+        : ::GetLastError();
+}
+
+std::vector<std::wstring> GetVirtualDiskParentPaths(
+    std::wstring const& Path)
+{
+    // Guard against the broken chains which point back to themselves.
+    const std::size_t MaximumChainDepth = 128;
+
+    std::vector<std::wstring> Result;
+    std::wstring CurrentPath = Path;
+    while (Result.size() < MaximumChainDepth)
+    {
+        HANDLE DiskHandle = INVALID_HANDLE_VALUE;
+
+        VIRTUAL_STORAGE_TYPE StorageType;
+        StorageType.DeviceId = VIRTUAL_STORAGE_TYPE_DEVICE_UNKNOWN;
+        StorageType.VendorId = VIRTUAL_STORAGE_TYPE_VENDOR_UNKNOWN;
+
+        OPEN_VIRTUAL_DISK_PARAMETERS OpenParameters;
+        std::memset(&OpenParameters, 0, sizeof(OPEN_VIRTUAL_DISK_PARAMETERS));
+        OpenParameters.Version = OPEN_VIRTUAL_DISK_VERSION_2;
+        OpenParameters.Version2.GetInfoOnly = TRUE;
+
+        if (ERROR_SUCCESS != ::OpenVirtualDisk(
+            &StorageType,
+            CurrentPath.c_str(),
+            VIRTUAL_DISK_ACCESS_NONE,
+            OPEN_VIRTUAL_DISK_FLAG_NO_PARENTS,
+            &OpenParameters,
+            &DiskHandle))
+        {
+            break;
+        }
+
+        std::vector<std::uint8_t> Buffer(
+            sizeof(GET_VIRTUAL_DISK_INFO) + MAX_PATH * 2 * sizeof(wchar_t));
+        PGET_VIRTUAL_DISK_INFO Information =
+            reinterpret_cast<PGET_VIRTUAL_DISK_INFO>(Buffer.data());
+        Information->Version = GET_VIRTUAL_DISK_INFO_PARENT_LOCATION;
+        ULONG BufferSize = static_cast<ULONG>(Buffer.size());
+        DWORD Error = ::GetVirtualDiskInformation(
+            DiskHandle,
+            &BufferSize,
+            Information,
+            nullptr);
+        if (ERROR_INSUFFICIENT_BUFFER == Error)
+        {
+            Buffer.resize(BufferSize);
+            Information =
+                reinterpret_cast<PGET_VIRTUAL_DISK_INFO>(Buffer.data());
+            Information->Version = GET_VIRTUAL_DISK_INFO_PARENT_LOCATION;
+            Error = ::GetVirtualDiskInformation(
+                DiskHandle,
+                &BufferSize,
+                Information,
+                nullptr);
+        }
+
+        ::CloseHandle(DiskHandle);
+
+        // The disks which are not differencing disks fail with the invalid
+        // type error, and the unresolved parents are reported as a list of
+        // the candidate locations which is useless here.
+        if (ERROR_SUCCESS != Error ||
+            !Information->ParentLocation.ParentResolved)
+        {
+            break;
+        }
+
+        CurrentPath = Information->ParentLocation.ParentLocationBuffer;
+        Result.push_back(CurrentPath);
+    }
+
+    return Result;
+}
+
 DWORD SimpleResizeVirtualDisk(
     _In_ PCWSTR Path,
     _In_ UINT64 Size)
 {
-    HANDLE DiskHandle = INVALID_HANDLE_VALUE;
+    std::unique_ptr<NanaBox::VirtualDiskOperation> Operation =
+        ::SimpleResizeVirtualDiskAsync(Path, Size);
+    Operation->Wait(INFINITE);
+    return Operation->GetProgress().ErrorCode;
+}
 
-    VIRTUAL_STORAGE_TYPE StorageType;
-    StorageType.DeviceId = VIRTUAL_STORAGE_TYPE_DEVICE_UNKNOWN;
-    StorageType.VendorId = VIRTUAL_STORAGE_TYPE_VENDOR_UNKNOWN;
+std::unique_ptr<NanaBox::VirtualDiskOperation> SimpleResizeVirtualDiskAsync(
+    _In_ PCWSTR Path,
+    _In_ UINT64 Size)
+{
+    std::unique_ptr<VirtDiskOperation> Operation =
+        std::make_unique<VirtDiskOperation>();
 
-    DWORD Error = ::OpenVirtualDisk(
-        &StorageType,
+    HANDLE DiskHandle = INVALID_HANDLE_VALUE;
+    DWORD Error = ::OpenVirtualDiskForOnlineMaintenance(
         Path,
-        VIRTUAL_DISK_ACCESS_ALL,
-        OPEN_VIRTUAL_DISK_FLAG_NONE,
-        nullptr,
+        FALSE,
         &DiskHandle);
     if (ERROR_SUCCESS == Error)
     {
@@ -603,41 +1135,128 @@ DWORD SimpleResizeVirtualDisk(
             DiskHandle,
             RESIZE_VIRTUAL_DISK_FLAG_NONE,
             &Parameters,
+            Operation->GetOverlapped());
+    }
+    Operation->Start(DiskHandle, Error);
+    return Operation;
+}
+
+DWORD SimpleGetVirtualDiskSize(
+    _In_ PCWSTR Path,
+    _Out_ PUINT64 Size)
+{
+    *Size = 0;
+
+    HANDLE DiskHandle = INVALID_HANDLE_VALUE;
+    DWORD Error = ::OpenVirtualDiskForOnlineMaintenance(
+        Path,
+        TRUE,
+        &DiskHandle);
+    if (ERROR_SUCCESS == Error)
+    {
+        GET_VIRTUAL_DISK_INFO Information;
+        std::memset(&Information, 0, sizeof(GET_VIRTUAL_DISK_INFO));
+        Information.Version = GET_VIRTUAL_DISK_INFO_SIZE;
+        ULONG BufferSize = sizeof(GET_VIRTUAL_DISK_INFO);
+        Error = ::GetVirtualDiskInformation(
+            DiskHandle,
+            &BufferSize,
+            &Information,
             nullptr);
+        if (ERROR_SUCCESS == Error)
+        {
+            *Size = Information.Size.VirtualSize;
+        }
 
         ::CloseHandle(DiskHandle);
     }
     return Error;
 }
 
-
 DWORD SimpleCompactVirtualDisk(
     _In_ PCWSTR Path)
 {
-    HANDLE DiskHandle = INVALID_HANDLE_VALUE;
+    std::unique_ptr<NanaBox::VirtualDiskOperation> Operation =
+        ::SimpleCompactVirtualDiskAsync(Path);
+    Operation->Wait(INFINITE);
+    return Operation->GetProgress().ErrorCode;
+}
 
-    VIRTUAL_STORAGE_TYPE StorageType;
-    StorageType.DeviceId = VIRTUAL_STORAGE_TYPE_DEVICE_UNKNOWN;
-    StorageType.VendorId = VIRTUAL_STORAGE_TYPE_VENDOR_UNKNOWN;
+std::unique_ptr<NanaBox::VirtualDiskOperation> SimpleCompactVirtualDiskAsync(
+    _In_ PCWSTR Path)
+{
+    std::unique_ptr<VirtDiskOperation> Operation =
+        std::make_unique<VirtDiskOperation>();
 
-    DWORD Error = ::OpenVirtualDisk(
-        &StorageType,
-        Path,
-        VIRTUAL_DISK_ACCESS_ALL,
-        OPEN_VIRTUAL_DISK_FLAG_NONE,
-        nullptr,
-        &DiskHandle);
+    HANDLE DiskHandle = INVALID_HANDLE_VALUE;
+    DWORD Error = ::OpenVirtualDiskForMaintenance(Path, &DiskHandle);
     if (ERROR_SUCCESS == Error)
     {
         Error = ::CompactVirtualDisk(
             DiskHandle,
             COMPACT_VIRTUAL_DISK_FLAG_NONE,
             nullptr,
-            nullptr);
+            Operation->GetOverlapped());
+    }
+    Operation->Start(DiskHandle, Error);
+    return Operation;
+}
 
-        ::CloseHandle(DiskHandle);
+winrt::hresult_error GetVirtualDiskOperationError(
+    NanaBox::VirtualDiskOperationProgress const& Progress)
+{
+    // The failures of the portable library have the message, and the failed
+    // system calls also have the error code.
+    HRESULT ErrorCode = Progress.ErrorCode
+        ? HRESULT_FROM_WIN32(Progress.ErrorCode)
+        : E_FAIL;
+    if (Progress.ErrorMessage.empty())
+    {
+        return winrt::hresult_error(ErrorCode);
     }
-    return Error;
+    return winrt::hresult_error(
+        ErrorCode,
+        winrt::to_hstring(Progress.ErrorMessage));
+}
+
+NanaBox::VirtualDiskOperationProgress ShowVirtualDiskOperationProgressDialog(
+    _In_ HWND ParentWindowHandle,
+    _In_ winrt::hstring const& InstructionText,
+    _In_ NanaBox::VirtualDiskOperation& Operation)
+{
+    winrt::handle Thread(Mile::CreateThread([&]()
+    {
+        winrt::check_hresult(::MileXamlThreadInitialize());
+
+        HWND WindowHandle = ::CreateXamlDialog(ParentWindowHandle);
+        if (!WindowHandle)
+        {
+            return;
+        }
+
+        winrt::NanaBox::OperationProgressPage Window =
+            winrt::make<winrt::NanaBox::implementation::OperationProgressPage>(
+                WindowHandle,
+                InstructionText,
+                &Operation);
+        ::ShowXamlDialog(
+            WindowHandle,
+            480,
+            240,
+            winrt::get_abi(Window),
+            ParentWindowHandle);
+
+        winrt::check_hresult(::MileXamlThreadUninitialize());
+    }));
+    ::WaitForSingleObject(Thread.get(), INFINITE);
+
+    // Closing the dialog before the operation is finished cancels it.
+    if (!Operation.Wait(0))
+    {
+        Operation.Cancel();
+        Operation.Wait(INFINITE);
+    }
+    return Operation.GetProgress();
 }
 
 winrt::handle ShowAboutDialog(
@@ -686,7 +1305,7 @@ winrt::handle ShowNewVirtualHardDiskDialog(
         ::ShowXamlDialog(
             WindowHandle,
             480,
-            320,
+            520,
             winrt::get_abi(Window),
             ParentWindowHandle);
 
@@ -757,11 +1376,17 @@ winrt::handle ShowCompactVirtualHardDiskDialog(
 
             try
             {
-                HWND WaitingHandle = ::ShowOperationWaitingWindow(ParentWindowHandle);
-
-                DWORD Error = SimpleCompactVirtualDisk(FilePath.c_str());
+                std::unique_ptr<NanaBox::VirtualDiskOperation> Operation =
+                    ::SimpleCompactVirtualDiskAsync(FilePath.c_str());
 
-                if (ERROR_SUCCESS == Error)
+                NanaBox::VirtualDiskOperationProgress Progress =
+                    ::ShowVirtualDiskOperationProgressDialog(
+                        ParentWindowHandle,
+                        Mile::WinRT::GetLocalizedString(
+                            L"CompactVirtualHardDiskWizard/ProgressInstructionText"),
+                        *Operation);
+                if (NanaBox::VirtualDiskOperationState::Succeeded
+                    == Progress.State)
                 {
                     ::ShowMessageDialog(
                         ParentWindowHandle,
@@ -770,14 +1395,13 @@ winrt::handle ShowCompactVirtualHardDiskDialog(
                             SuccessContentText.c_str(),
                             FilePath.c_str()).c_str());
                 }
-                else
+                else if (NanaBox::VirtualDiskOperationState::Failed
+                    == Progress.State)
                 {
                     ::ShowErrorMessageDialog(
                         ParentWindowHandle,
-                        winrt::hresult_error(HRESULT_FROM_WIN32(Error)));
+                        ::GetVirtualDiskOperationError(Progress));
                 }
-
-                ::SendMessageW(WaitingHandle, WM_CLOSE, 0, 0);
             }
             catch (...)
             {
@@ -791,7 +1415,8 @@ winrt::handle ShowCompactVirtualHardDiskDialog(
     }));
 }
 winrt::handle ShowResizeVirtualHardDiskDialog(
-    _In_ HWND ParentWindowHandle)
+    _In_ HWND ParentWindowHandle,
+    _In_ std::function<void(std::wstring const&)> const& ResizedHandler)
 {
     return winrt::handle(Mile::CreateThread([=]()
     {
@@ -805,7 +1430,8 @@ winrt::handle ShowResizeVirtualHardDiskDialog(
 
         winrt::NanaBox::ResizeVirtualHardDiskPage Window =
             winrt::make<winrt::NanaBox::implementation::ResizeVirtualHardDiskPage>(
-                WindowHandle);
+                WindowHandle,
+                ResizedHandler);
         ::ShowXamlDialog(
             WindowHandle,
             480,
@@ -886,70 +1512,81 @@ std::string GetCurrentProcessUserStringSid()
     return CachedResult;
 }
 
-HWND ShowOperationWaitingWindow(
-    _In_ HWND ParentWindowHandle)
+winrt::file_handle CreateLocalNamedPipe(
+    std::wstring const& PipeName,
+    DWORD OpenMode,
+    DWORD OutBufferSize,
+    DWORD InBufferSize)
 {
-    HWND Result = nullptr;
-
-    HANDLE ReturnEvent = ::CreateEventExW(
-        nullptr,
-        nullptr,
-        0,
-        EVENT_ALL_ACCESS);
-    if (!ReturnEvent)
+    std::string UserStringSid = ::GetCurrentProcessUserStringSid();
+    if (UserStringSid.empty())
     {
-        return nullptr;
+        ::SetLastError(ERROR_INVALID_SID);
+        return winrt::file_handle();
     }
 
-    ::CloseHandle(Mile::CreateThread([=, &Result]()
+    std::wstring SecurityDescriptorString = Mile::FormatWideString(
+        L"D:P(A;;GA;;;%s)(A;;GA;;;SY)(A;;GA;;;BA)",
+        Mile::ToWideString(CP_UTF8, UserStringSid).c_str());
+    PSECURITY_DESCRIPTOR SecurityDescriptor = nullptr;
+    if (!::ConvertStringSecurityDescriptorToSecurityDescriptorW(
+        SecurityDescriptorString.c_str(),
+        SDDL_REVISION_1,
+        &SecurityDescriptor,
+        nullptr))
     {
-        winrt::check_hresult(::MileXamlThreadInitialize());
-
-        HWND WindowHandle = ::CreateWindowExW(
-            0,
-            L"Mile.Xaml.ContentWindow",
-            nullptr,
-            WS_POPUP,
-            CW_USEDEFAULT,
-            0,
-            CW_USEDEFAULT,
-            0,
-            ParentWindowHandle,
-            nullptr,
-            nullptr,
-            nullptr);
-        if (!WindowHandle)
-        {
-            return;
-        }
-        Result = WindowHandle;
-
-        ::SetEvent(ReturnEvent);
-
-        DWM_WINDOW_CORNER_PREFERENCE Preference = DWMWCP_ROUNDSMALL;
-        ::DwmSetWindowAttribute(
-            WindowHandle,
-            DWMWA_WINDOW_CORNER_PREFERENCE,
-            &Preference,
-            sizeof(DWM_WINDOW_CORNER_PREFERENCE));
-
-        winrt::ProgressRing Content = winrt::ProgressRing();
-        Content.Margin(winrt::ThicknessHelper::FromUniformLength(12));
-        Content.HorizontalAlignment(winrt::HorizontalAlignment::Stretch);
-        Content.VerticalAlignment(winrt::VerticalAlignment::Stretch);
-        Content.IsActive(true);
-
-        ::ShowXamlDialog(
-            WindowHandle,
-            72,
-            72,
-            winrt::get_abi(Content),
-            ParentWindowHandle);
+        return winrt::file_handle();
+    }
+    auto SecurityDescriptorCleanupHandler = Mile::ScopeExitTaskHandler([&]()
+    {
+        ::LocalFree(SecurityDescriptor);
+    });
+
+    SECURITY_ATTRIBUTES SecurityAttributes = { 0 };
+    SecurityAttributes.nLength = sizeof(SECURITY_ATTRIBUTES);
+    SecurityAttributes.lpSecurityDescriptor = SecurityDescriptor;
+    SecurityAttributes.bInheritHandle = FALSE;
+
+    return winrt::file_handle(::CreateNamedPipeW(
+        PipeName.c_str(),
+        OpenMode | FILE_FLAG_FIRST_PIPE_INSTANCE,
+        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT |
+        PIPE_REJECT_REMOTE_CLIENTS,
+        1,
+        OutBufferSize,
+        InBufferSize,
+        0,
+        &SecurityAttributes));
+}
 
-        winrt::check_hresult(::MileXamlThreadUninitialize());
-    }));
+bool WaitForOverlappedOperation(
+    HANDLE FileHandle,
+    LPOVERLAPPED Overlapped,
+    BOOL Result,
+    DWORD Timeout,
+    LPDWORD NumberOfBytesTransferred)
+{
+    if (!Result && ERROR_IO_PENDING != ::GetLastError())
+    {
+        return false;
+    }
 
-    ::WaitForSingleObjectEx(ReturnEvent, INFINITE, FALSE);
+    if (WAIT_OBJECT_0 != ::WaitForSingleObject(
+        Overlapped->hEvent,
+        Timeout))
+    {
+        ::CancelIoEx(FileHandle, Overlapped);
+    }
 
-    return Result;
+    DWORD Transferred = 0;
+    bool Succeeded = ::GetOverlappedResult(
+        FileHandle,
+        Overlapped,
+        &Transferred,
+        TRUE);
+    if (NumberOfBytesTransferred)
+    {
+        *NumberOfBytesTransferred = Transferred;
+    }
+    return Succeeded;
 }
@@ -2,10 +2,14 @@
 
 #include "pch.h"
 
+#include <functional>
+#include <memory>
 #include <vector>
 #include <string>
 #include <winrt/base.h>
 
+#include "VirtualDiskOperation.h"
+
 void SplitCommandLineEx(
     std::wstring const& CommandLine,
     std::vector<std::wstring> const& OptionPrefixes,
@@ -24,9 +28,22 @@ void WriteAllTextToUtf8TextFile(
     std::wstring const& Path,
     std::string& Content);
 
+// Writes the content to a temporary file next to the target and replaces the
+// target with it, so the target is never left partially written even if the
+// system goes down in the middle.
+void ReplaceAllTextInUtf8TextFile(
+    std::wstring const& Path,
+    std::string& Content);
+
 std::wstring GetAbsolutePath(
     std::wstring const& FileName);
 
+// Relative paths passed to GetAbsolutePath on the calling thread will be
+// resolved against the specified directory instead of the current directory,
+// an empty string restores the default behavior.
+void SetCurrentThreadBaseDirectory(
+    std::wstring const& BaseDirectory);
+
 HWND CreateXamlDialog(
     _In_opt_ HWND ParentWindowHandle);
 
@@ -68,13 +85,93 @@ DWORD SimpleCreateVirtualDisk(
     _In_ UINT64 Size,
     _Out_ PHANDLE Handle);
 
+// The layout of a new virtual disk, the format follows the extension of the
+// path. The zero values use the defaults of SimpleCreateVirtualDisk, which are
+// 1 MiB blocks for VHDX, 512 KiB blocks for VHD, and the defaults of the system
+// for the block size of the differencing disks and the sector sizes.
+struct SimpleVirtualDiskCreationOptions
+{
+    // Allocates all the blocks when creating, which is only supported by the
+    // disks without a parent. The payload is preallocated and filled with
+    // zeros up front.
+    bool Fixed = false;
+    // Skips the zeroing of the payload of the fixed disks by moving the valid
+    // data length to the end, which needs the administrator privileges and
+    // exposes the stale content of the volume to the guest.
+    bool SkipZeroing = false;
+    DWORD BlockSize = 0;
+    // VHD only supports 512-byte logical sectors.
+    DWORD LogicalSectorSize = 0;
+    DWORD PhysicalSectorSize = 0;
+    // Creates a differencing disk if it is not empty, which uses the size and
+    // the logical sector size of the parent.
+    std::wstring ParentPath;
+};
+
+DWORD SimpleCreateVirtualDisk(
+    _In_ PCWSTR Path,
+    _In_ UINT64 Size,
+    _In_ SimpleVirtualDiskCreationOptions const& Options,
+    _Out_ PHANDLE Handle);
+
+// Creates a differencing virtual disk which uses the specified disk as its
+// parent, the format follows the extension of the path.
+DWORD SimpleCreateDifferencingVirtualDisk(
+    _In_ PCWSTR Path,
+    _In_ PCWSTR ParentPath);
+
+// Sets or clears the read only attribute of a virtual disk. The disks which
+// become the parents of differencing disks are marked as read only, because
+// any write to them corrupts all of their children.
+DWORD SimpleSetVirtualDiskReadOnly(
+    _In_ PCWSTR Path,
+    _In_ BOOL ReadOnly);
+
+// Returns the paths of the parent disks of a differencing virtual disk, from
+// the nearest one, or an empty list if the disk has no parent.
+std::vector<std::wstring> GetVirtualDiskParentPaths(
+    std::wstring const& Path);
+
+// Also expands the VHDX disks which are attached to a running virtual
+// machine, the guest should be notified via the SCSI attachment after that.
 DWORD SimpleResizeVirtualDisk(
     _In_ PCWSTR Path,
     _In_ UINT64 Size);
 
+// Works for the disks which are attached to a running virtual machine.
+DWORD SimpleGetVirtualDiskSize(
+    _In_ PCWSTR Path,
+    _Out_ PUINT64 Size);
+
 DWORD SimpleCompactVirtualDisk(
     _In_ PCWSTR Path);
 
+// The asynchronous versions of the functions above, the operations can be
+// canceled and report the progress while running. The returned operation is
+// never null, the errors of starting are reported via its progress.
+
+std::unique_ptr<NanaBox::VirtualDiskOperation> SimpleCreateVirtualDiskAsync(
+    _In_ PCWSTR Path,
+    _In_ UINT64 Size,
+    _In_ SimpleVirtualDiskCreationOptions const& Options);
+
+std::unique_ptr<NanaBox::VirtualDiskOperation> SimpleResizeVirtualDiskAsync(
+    _In_ PCWSTR Path,
+    _In_ UINT64 Size);
+
+std::unique_ptr<NanaBox::VirtualDiskOperation> SimpleCompactVirtualDiskAsync(
+    _In_ PCWSTR Path);
+
+winrt::hresult_error GetVirtualDiskOperationError(
+    NanaBox::VirtualDiskOperationProgress const& Progress);
+
+// Shows the progress of the operation until it is finished, the operation is
+// canceled if the dialog is closed by the user before that.
+NanaBox::VirtualDiskOperationProgress ShowVirtualDiskOperationProgressDialog(
+    _In_ HWND ParentWindowHandle,
+    _In_ winrt::hstring const& InstructionText,
+    _In_ NanaBox::VirtualDiskOperation& Operation);
+
 winrt::handle ShowAboutDialog(
     _In_ HWND ParentWindowHandle);
 
@@ -85,14 +182,31 @@ winrt::handle ShowCompactVirtualHardDiskDialog(
     _In_ HWND ParentWindowHandle);
 
 winrt::handle ShowResizeVirtualHardDiskDialog(
-    _In_ HWND ParentWindowHandle);
+    _In_ HWND ParentWindowHandle,
+    _In_ std::function<void(std::wstring const&)> const& ResizedHandler =
+        nullptr);
 
 BOOL LaunchDocumentation();
 
 std::string GetCurrentProcessUserStringSid();
 
-HWND ShowOperationWaitingWindow(
-    _In_ HWND ParentWindowHandle);
+// Creates the only instance of a named pipe which can be opened by the current
+// user, SYSTEM and the administrators from the local machine. It fails if the
+// pipe name is already used, so another user cannot squat the name before us.
+winrt::file_handle CreateLocalNamedPipe(
+    std::wstring const& PipeName,
+    DWORD OpenMode,
+    DWORD OutBufferSize,
+    DWORD InBufferSize);
+
+// Waits for the overlapped operation which is started with the result, and
+// cancels it if it is not completed within the timeout.
+bool WaitForOverlappedOperation(
+    HANDLE FileHandle,
+    LPOVERLAPPED Overlapped,
+    BOOL Result,
+    DWORD Timeout,
+    LPDWORD NumberOfBytesTransferred = nullptr);
 
 #include <Mile.Helpers.CppBase.h>
 #include <Mile.Helpers.CppWinRT.h>
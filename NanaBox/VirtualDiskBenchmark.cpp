@@ -0,0 +1,644 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualDiskBenchmark.cpp
+ * PURPOSE:   Implementation for the Virtual Disk Storage I/O Benchmark
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "VirtualDiskBenchmark.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <stdexcept>
+
+namespace
+{
+    // The histogram keeps 32 linear sub-buckets for each power of two of the
+    // nanoseconds, so the memory is fixed and the relative error of the
+    // percentiles is at most 1/64.
+    class LatencyHistogram
+    {
+    public:
+
+        void Add(
+            std::uint64_t Nanoseconds)
+        {
+            ++this->m_Buckets[LatencyHistogram::GetBucketIndex(Nanoseconds)];
+            if (!this->m_Count || Nanoseconds < this->m_Minimum)
+            {
+                this->m_Minimum = Nanoseconds;
+            }
+            this->m_Maximum = std::max(this->m_Maximum, Nanoseconds);
+            this->m_Sum += Nanoseconds;
+            ++this->m_Count;
+        }
+
+        void Merge(
+            LatencyHistogram const& Other)
+        {
+            if (!Other.m_Count)
+            {
+                return;
+            }
+            for (std::size_t i = 0; i < BucketCount; ++i)
+            {
+                this->m_Buckets[i] += Other.m_Buckets[i];
+            }
+            if (!this->m_Count || Other.m_Minimum < this->m_Minimum)
+            {
+                this->m_Minimum = Other.m_Minimum;
+            }
+            this->m_Maximum = std::max(this->m_Maximum, Other.m_Maximum);
+            this->m_Sum += Other.m_Sum;
+            this->m_Count += Other.m_Count;
+        }
+
+        NanaBox::VirtualDiskLatencyStatistics GetStatistics() const
+        {
+            NanaBox::VirtualDiskLatencyStatistics Result;
+            Result.Count = this->m_Count;
+            if (!this->m_Count)
+            {
+                return Result;
+            }
+            Result.MinimumMicroseconds = this->m_Minimum / 1000.0;
+            Result.AverageMicroseconds =
+                static_cast<double>(this->m_Sum) / this->m_Count / 1000.0;
+            Result.P50Microseconds = this->GetPercentile(0.5);
+            Result.P90Microseconds = this->GetPercentile(0.9);
+            Result.P99Microseconds = this->GetPercentile(0.99);
+            Result.P999Microseconds = this->GetPercentile(0.999);
+            Result.MaximumMicroseconds = this->m_Maximum / 1000.0;
+            return Result;
+        }
+
+    private:
+
+        static const std::size_t SubBucketCount = 32;
+        // Covers all the 64-bit values.
+        static const std::size_t BucketCount = 60 * SubBucketCount;
+
+        static std::size_t GetBucketIndex(
+            std::uint64_t Value)
+        {
+            if (Value < 2 * SubBucketCount)
+            {
+                return static_cast<std::size_t>(Value);
+            }
+            std::size_t Exponent = 0;
+            while ((Value >> Exponent) >= 2 * SubBucketCount)
+            {
+                ++Exponent;
+            }
+            return static_cast<std::size_t>(
+                Exponent * SubBucketCount + (Value >> Exponent));
+        }
+
+        // The middle of the values in the bucket.
+        static double GetBucketValue(
+            std::size_t Index)
+        {
+            if (Index < 2 * SubBucketCount)
+            {
+                return static_cast<double>(Index);
+            }
+            std::size_t Exponent = Index / SubBucketCount - 1;
+            std::uint64_t Mantissa = Index % SubBucketCount + SubBucketCount;
+            std::uint64_t Width = std::uint64_t(1) << Exponent;
+            return static_cast<double>(Mantissa << Exponent) +
+                static_cast<double>(Width - 1) / 2;
+        }
+
+        double GetPercentile(
+            double Percentile) const
+        {
+            std::uint64_t Rank = std::max<std::uint64_t>(
+                static_cast<std::uint64_t>(Percentile * this->m_Count + 0.5),
+                1);
+            std::uint64_t Accumulated = 0;
+            for (std::size_t i = 0; i < BucketCount; ++i)
+            {
+                Accumulated += this->m_Buckets[i];
+                if (Accumulated >= Rank)
+                {
+                    double Value = std::clamp(
+                        LatencyHistogram::GetBucketValue(i),
+                        static_cast<double>(this->m_Minimum),
+                        static_cast<double>(this->m_Maximum));
+                    return Value / 1000.0;
+                }
+            }
+            return this->m_Maximum / 1000.0;
+        }
+
+        std::vector<std::uint64_t> m_Buckets =
+            std::vector<std::uint64_t>(BucketCount);
+        std::uint64_t m_Count = 0;
+        std::uint64_t m_Sum = 0;
+        std::uint64_t m_Minimum = 0;
+        std::uint64_t m_Maximum = 0;
+    };
+
+    struct BenchmarkWorkerState
+    {
+        LatencyHistogram ReadLatency;
+        LatencyHistogram WriteLatency;
+        std::uint64_t Flushes = 0;
+        std::chrono::steady_clock::time_point LastCompletionTime;
+    };
+
+    const char* GetPatternName(
+        NanaBox::VirtualDiskBenchmarkPattern Value)
+    {
+        switch (Value)
+        {
+        case NanaBox::VirtualDiskBenchmarkPattern::Random:
+            return "Random";
+        case NanaBox::VirtualDiskBenchmarkPattern::Sequential:
+            return "Sequential";
+        default:
+            return "Unknown";
+        }
+    }
+
+    const char* GetFormatName(
+        NanaBox::VirtualDiskFormat Value)
+    {
+        switch (Value)
+        {
+        case NanaBox::VirtualDiskFormat::Vhd:
+            return "VHD";
+        case NanaBox::VirtualDiskFormat::Vhdx:
+            return "VHDX";
+        default:
+            return "Unknown";
+        }
+    }
+
+    const char* GetTypeName(
+        NanaBox::VirtualDiskType Value)
+    {
+        switch (Value)
+        {
+        case NanaBox::VirtualDiskType::Fixed:
+            return "Fixed";
+        case NanaBox::VirtualDiskType::Dynamic:
+            return "Dynamic";
+        case NanaBox::VirtualDiskType::Differencing:
+            return "Differencing";
+        default:
+            return "Unknown";
+        }
+    }
+
+    std::string EscapeJsonString(
+        std::string const& Value)
+    {
+        std::string Result = "\"";
+        for (char Character : Value)
+        {
+            switch (Character)
+            {
+            case '"':
+                Result += "\\\"";
+                break;
+            case '\\':
+                Result += "\\\\";
+                break;
+            case '\n':
+                Result += "\\n";
+                break;
+            case '\r':
+                Result += "\\r";
+                break;
+            case '\t':
+                Result += "\\t";
+                break;
+            default:
+                if (static_cast<unsigned char>(Character) < 0x20)
+                {
+                    char Buffer[8];
+                    std::snprintf(
+                        Buffer,
+                        sizeof(Buffer),
+                        "\\u%04x",
+                        static_cast<unsigned char>(Character));
+                    Result += Buffer;
+                }
+                else
+                {
+                    Result += Character;
+                }
+                break;
+            }
+        }
+        Result += "\"";
+        return Result;
+    }
+
+    std::string FormatJsonNumber(
+        std::uint64_t Value)
+    {
+        return std::to_string(Value);
+    }
+
+    std::string FormatJsonNumber(
+        double Value)
+    {
+        char Buffer[64];
+        std::snprintf(Buffer, sizeof(Buffer), "%.3f", Value);
+        return Buffer;
+    }
+
+    // Writes the members of a JSON object with the fixed indentation, which
+    // keeps the output readable and diffable between the runs.
+    class JsonObjectWriter
+    {
+    public:
+
+        JsonObjectWriter(
+            std::string& Output,
+            std::size_t Indentation) :
+            m_Output(Output),
+            m_Indentation(Indentation)
+        {
+            this->m_Output += "{";
+        }
+
+        void Add(
+            std::string const& Name,
+            std::string const& Value)
+        {
+            this->m_Output += this->m_First ? "\n" : ",\n";
+            this->m_First = false;
+            this->m_Output += std::string(this->m_Indentation + 4, ' ');
+            this->m_Output += ::EscapeJsonString(Name) + ": " + Value;
+        }
+
+        void Close()
+        {
+            this->m_Output += "\n";
+            this->m_Output += std::string(this->m_Indentation, ' ');
+            this->m_Output += "}";
+        }
+
+    private:
+
+        std::string& m_Output;
+        std::size_t m_Indentation = 0;
+        bool m_First = true;
+    };
+
+    std::string FormatLatencyJson(
+        NanaBox::VirtualDiskLatencyStatistics const& Value,
+        std::size_t Indentation)
+    {
+        std::string Result;
+        JsonObjectWriter Writer(Result, Indentation);
+        Writer.Add("Count", ::FormatJsonNumber(Value.Count));
+        Writer.Add(
+            "MinimumMicroseconds",
+            ::FormatJsonNumber(Value.MinimumMicroseconds));
+        Writer.Add(
+            "AverageMicroseconds",
+            ::FormatJsonNumber(Value.AverageMicroseconds));
+        Writer.Add(
+            "P50Microseconds",
+            ::FormatJsonNumber(Value.P50Microseconds));
+        Writer.Add(
+            "P90Microseconds",
+            ::FormatJsonNumber(Value.P90Microseconds));
+        Writer.Add(
+            "P99Microseconds",
+            ::FormatJsonNumber(Value.P99Microseconds));
+        Writer.Add(
+            "P999Microseconds",
+            ::FormatJsonNumber(Value.P999Microseconds));
+        Writer.Add(
+            "MaximumMicroseconds",
+            ::FormatJsonNumber(Value.MaximumMicroseconds));
+        Writer.Close();
+        return Result;
+    }
+}
+
+NanaBox::VirtualDiskBenchmarkResult NanaBox::RunVirtualDiskBenchmark(
+    NanaBox::VirtualDiskImage& Image,
+    NanaBox::VirtualDiskBenchmarkOptions const& Options)
+{
+    using Clock = std::chrono::steady_clock;
+
+    NanaBox::VirtualDiskInformation const& Information =
+        Image.GetInformation();
+    if (!Options.IoSize ||
+        Options.IoSize % Information.LogicalSectorSize)
+    {
+        throw std::runtime_error(
+            Image.GetPath() +
+            ": The I/O size must be a multiple of the logical sector size");
+    }
+    if (Options.ReadPercentage > 100)
+    {
+        throw std::runtime_error("The read percentage is out of range");
+    }
+    if (!Options.QueueDepth)
+    {
+        throw std::runtime_error("The queue depth must be at least 1");
+    }
+    if (!(Options.Seconds > 0.0) || Options.WarmUpSeconds < 0.0)
+    {
+        throw std::runtime_error("The duration is out of range");
+    }
+    if (Options.ReadPercentage < 100 && !Image.GetFile().IsWritable())
+    {
+        throw std::runtime_error(
+            Image.GetPath() + ": The image is not opened for the writes");
+    }
+
+    std::uint64_t Range = Options.Range
+        ? std::min(Options.Range, Information.VirtualSize)
+        : Information.VirtualSize;
+    std::uint64_t SlotCount = Range / Options.IoSize;
+    if (!SlotCount)
+    {
+        throw std::runtime_error(
+            Image.GetPath() + ": The range is smaller than the I/O size");
+    }
+
+    NanaBox::VirtualDiskBenchmarkResult Result;
+    Result.Options = Options;
+    Result.Options.Range = SlotCount * Options.IoSize;
+
+    // The reads and the writes into the fully present blocks only touch the
+    // payload, so they share the lock and are issued concurrently. The writes
+    // which allocate the blocks or update the sector bitmaps, the first write
+    // which updates the header and the flushes take it exclusively.
+    std::shared_mutex ImageLock;
+    std::atomic<std::uint64_t> NextSlot(0);
+    std::atomic<std::uint64_t> WriteCount(0);
+    std::atomic<bool> WriteStarted(false);
+    std::uint32_t BlockSize = Information.BlockSize;
+    auto IsFullyPresent = [&](
+        std::uint64_t Offset) -> bool
+    {
+        std::uint64_t LastBlock = (Offset + Options.IoSize - 1) / BlockSize;
+        for (std::uint64_t i = Offset / BlockSize; i <= LastBlock; ++i)
+        {
+            if (NanaBox::VirtualDiskBlockState::FullyPresent !=
+                Image.GetBlockState(i))
+            {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    std::vector<BenchmarkWorkerState> Workers(Options.QueueDepth);
+
+    Clock::time_point StartTime = Clock::now();
+    Clock::time_point MeasureTime = StartTime +
+        std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(Options.WarmUpSeconds));
+    Clock::time_point EndTime = MeasureTime +
+        std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(Options.Seconds));
+
+    NanaBox::RunVirtualDiskWorkers(
+        Options.QueueDepth,
+        Options.QueueDepth,
+        [&](std::size_t WorkerIndex, std::size_t Index)
+    {
+        static_cast<void>(WorkerIndex);
+
+        BenchmarkWorkerState& State = Workers[Index];
+        std::mt19937_64 Generator(Options.Seed + Index);
+        NanaBox::VirtualDiskBuffer Buffer(Options.IoSize);
+        for (std::size_t i = 0; i < Options.IoSize; ++i)
+        {
+            Buffer.GetData()[i] = static_cast<std::uint8_t>(Generator());
+        }
+
+        for (;;)
+        {
+            Clock::time_point IssueTime = Clock::now();
+            if (IssueTime >= EndTime)
+            {
+                break;
+            }
+            bool Measured = IssueTime >= MeasureTime;
+
+            std::uint64_t Slot =
+                NanaBox::VirtualDiskBenchmarkPattern::Random == Options.Pattern
+                ? Generator() % SlotCount
+                : NextSlot++ % SlotCount;
+            std::uint64_t Offset = Slot * Options.IoSize;
+            bool Read = Generator() % 100 < Options.ReadPercentage;
+
+            if (Read)
+            {
+                std::shared_lock<std::shared_mutex> Lock(ImageLock);
+                Image.Read(Offset, Buffer.GetData(), Options.IoSize);
+            }
+            else
+            {
+                bool Shared = false;
+                {
+                    std::shared_lock<std::shared_mutex> Lock(ImageLock);
+                    if (WriteStarted.load(std::memory_order_acquire) &&
+                        IsFullyPresent(Offset))
+                    {
+                        Image.Write(Offset, Buffer.GetData(), Options.IoSize);
+                        Shared = true;
+                    }
+                }
+                if (!Shared)
+                {
+                    std::unique_lock<std::shared_mutex> Lock(ImageLock);
+                    Image.Write(Offset, Buffer.GetData(), Options.IoSize);
+                    WriteStarted.store(true, std::memory_order_release);
+                }
+                if (Options.FlushInterval &&
+                    0 == ++WriteCount % Options.FlushInterval)
+                {
+                    std::unique_lock<std::shared_mutex> Lock(ImageLock);
+                    Image.Flush();
+                    if (Measured)
+                    {
+                        ++State.Flushes;
+                    }
+                }
+            }
+
+            Clock::time_point CompletionTime = Clock::now();
+            if (!Measured)
+            {
+                continue;
+            }
+            std::uint64_t Nanoseconds = static_cast<std::uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    CompletionTime - IssueTime).count());
+            if (Read)
+            {
+                State.ReadLatency.Add(Nanoseconds);
+            }
+            else
+            {
+                State.WriteLatency.Add(Nanoseconds);
+            }
+            State.LastCompletionTime = CompletionTime;
+        }
+    });
+
+    if (Options.ReadPercentage < 100)
+    {
+        Image.Flush();
+    }
+
+    LatencyHistogram ReadLatency;
+    LatencyHistogram WriteLatency;
+    Clock::time_point LastCompletionTime = MeasureTime;
+    for (BenchmarkWorkerState const& State : Workers)
+    {
+        ReadLatency.Merge(State.ReadLatency);
+        WriteLatency.Merge(State.WriteLatency);
+        Result.Flushes += State.Flushes;
+        LastCompletionTime = std::max(
+            LastCompletionTime,
+            State.LastCompletionTime);
+    }
+    LatencyHistogram Latency;
+    Latency.Merge(ReadLatency);
+    Latency.Merge(WriteLatency);
+
+    Result.ReadLatency = ReadLatency.GetStatistics();
+    Result.WriteLatency = WriteLatency.GetStatistics();
+    Result.Latency = Latency.GetStatistics();
+    Result.ReadOperations = Result.ReadLatency.Count;
+    Result.WriteOperations = Result.WriteLatency.Count;
+    Result.ReadBytes = Result.ReadOperations * Options.IoSize;
+    Result.WrittenBytes = Result.WriteOperations * Options.IoSize;
+    Result.Seconds = std::chrono::duration<double>(
+        LastCompletionTime - MeasureTime).count();
+    if (Result.Seconds > 0.0)
+    {
+        Result.Iops = Result.Latency.Count / Result.Seconds;
+        Result.BytesPerSecond =
+            (Result.ReadBytes + Result.WrittenBytes) / Result.Seconds;
+    }
+    return Result;
+}
+
+std::string NanaBox::FormatVirtualDiskBenchmarkJson(
+    NanaBox::VirtualDiskImage const& Image,
+    std::vector<NanaBox::VirtualDiskBenchmarkResult> const& Results)
+{
+    NanaBox::VirtualDiskInformation const& Information =
+        Image.GetInformation();
+
+    std::size_t ChainDepth = 0;
+    for (NanaBox::VirtualDiskImage const* Current = &Image;
+        Current;
+        Current = Current->GetParent())
+    {
+        ++ChainDepth;
+    }
+
+    std::string Result;
+    JsonObjectWriter Root(Result, 0);
+
+    std::string ImageObject;
+    JsonObjectWriter ImageWriter(ImageObject, 4);
+    ImageWriter.Add("Path", ::EscapeJsonString(Image.GetPath()));
+    ImageWriter.Add(
+        "Format",
+        ::EscapeJsonString(::GetFormatName(Information.Format)));
+    ImageWriter.Add(
+        "Type",
+        ::EscapeJsonString(::GetTypeName(Information.Type)));
+    ImageWriter.Add(
+        "VirtualSize",
+        ::FormatJsonNumber(Information.VirtualSize));
+    ImageWriter.Add(
+        "BlockSize",
+        ::FormatJsonNumber(std::uint64_t(Information.BlockSize)));
+    ImageWriter.Add(
+        "LogicalSectorSize",
+        ::FormatJsonNumber(std::uint64_t(Information.LogicalSectorSize)));
+    ImageWriter.Add(
+        "PhysicalSectorSize",
+        ::FormatJsonNumber(std::uint64_t(Information.PhysicalSectorSize)));
+    ImageWriter.Add(
+        "ChainDepth",
+        ::FormatJsonNumber(std::uint64_t(ChainDepth)));
+    ImageWriter.Add(
+        "Unbuffered",
+        Image.GetFile().IsUnbuffered() ? "true" : "false");
+    ImageWriter.Close();
+    Root.Add("Image", ImageObject);
+
+    std::string ResultArray = "[";
+    for (std::size_t i = 0; i < Results.size(); ++i)
+    {
+        NanaBox::VirtualDiskBenchmarkResult const& Current = Results[i];
+
+        ResultArray += i ? ",\n" : "\n";
+        ResultArray += std::string(8, ' ');
+        JsonObjectWriter Writer(ResultArray, 8);
+        Writer.Add(
+            "Pattern",
+            ::EscapeJsonString(::GetPatternName(Current.Options.Pattern)));
+        Writer.Add(
+            "IoSize",
+            ::FormatJsonNumber(std::uint64_t(Current.Options.IoSize)));
+        Writer.Add(
+            "ReadPercentage",
+            ::FormatJsonNumber(
+                std::uint64_t(Current.Options.ReadPercentage)));
+        Writer.Add(
+            "QueueDepth",
+            ::FormatJsonNumber(std::uint64_t(Current.Options.QueueDepth)));
+        Writer.Add("Range", ::FormatJsonNumber(Current.Options.Range));
+        Writer.Add(
+            "FlushInterval",
+            ::FormatJsonNumber(std::uint64_t(Current.Options.FlushInterval)));
+        Writer.Add(
+            "WarmUpSeconds",
+            ::FormatJsonNumber(Current.Options.WarmUpSeconds));
+        Writer.Add("Seconds", ::FormatJsonNumber(Current.Seconds));
+        Writer.Add(
+            "ReadOperations",
+            ::FormatJsonNumber(Current.ReadOperations));
+        Writer.Add(
+            "WriteOperations",
+            ::FormatJsonNumber(Current.WriteOperations));
+        Writer.Add("ReadBytes", ::FormatJsonNumber(Current.ReadBytes));
+        Writer.Add("WrittenBytes", ::FormatJsonNumber(Current.WrittenBytes));
+        Writer.Add("Flushes", ::FormatJsonNumber(Current.Flushes));
+        Writer.Add("Iops", ::FormatJsonNumber(Current.Iops));
+        Writer.Add(
+            "BytesPerSecond",
+            ::FormatJsonNumber(Current.BytesPerSecond));
+        Writer.Add("Latency", ::FormatLatencyJson(Current.Latency, 12));
+        Writer.Add(
+            "ReadLatency",
+            ::FormatLatencyJson(Current.ReadLatency, 12));
+        Writer.Add(
+            "WriteLatency",
+            ::FormatLatencyJson(Current.WriteLatency, 12));
+        Writer.Close();
+    }
+    ResultArray += Results.empty() ? "]" : "\n    ]";
+    Root.Add("Results", ResultArray);
+
+    Root.Close();
+    Result += "\n";
+    return Result;
+}
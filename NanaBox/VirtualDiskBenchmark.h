@@ -0,0 +1,101 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualDiskBenchmark.h
+ * PURPOSE:   Definition for the Virtual Disk Storage I/O Benchmark
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_VIRTUAL_DISK_BENCHMARK
+#define NANABOX_VIRTUAL_DISK_BENCHMARK
+
+#include "VirtualDiskImage.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace NanaBox
+{
+    enum class VirtualDiskBenchmarkPattern : std::uint32_t
+    {
+        Random = 0,
+        Sequential = 1,
+    };
+
+    struct VirtualDiskBenchmarkOptions
+    {
+        VirtualDiskBenchmarkPattern Pattern =
+            VirtualDiskBenchmarkPattern::Random;
+        // The size of each I/O, which must be a multiple of the logical
+        // sector size.
+        std::uint32_t IoSize = 4096;
+        // The percentage of the reads, and the rest are the writes.
+        std::uint32_t ReadPercentage = 100;
+        // The number of the outstanding I/O. Each of them is issued by its own
+        // worker, which issues the next one when the previous one completes.
+        std::size_t QueueDepth = 1;
+        // The bytes from the start of the virtual disk which are accessed,
+        // which is the whole virtual disk if it is zero.
+        std::uint64_t Range = 0;
+        // The I/O of the warm up is issued but not measured.
+        double WarmUpSeconds = 1.0;
+        double Seconds = 10.0;
+        // Flushes the image after every FlushInterval writes to emulate the
+        // write-through caching, which is disabled if it is zero.
+        std::uint32_t FlushInterval = 0;
+        std::uint64_t Seed = 0x4E616E61426F78ULL;
+    };
+
+    // The latencies are measured from the time the worker is ready to issue
+    // the I/O, so they include the time waiting for the other workers, and
+    // the percentiles are accurate to about 1.6%.
+    struct VirtualDiskLatencyStatistics
+    {
+        std::uint64_t Count = 0;
+        double MinimumMicroseconds = 0.0;
+        double AverageMicroseconds = 0.0;
+        double P50Microseconds = 0.0;
+        double P90Microseconds = 0.0;
+        double P99Microseconds = 0.0;
+        double P999Microseconds = 0.0;
+        double MaximumMicroseconds = 0.0;
+    };
+
+    struct VirtualDiskBenchmarkResult
+    {
+        VirtualDiskBenchmarkOptions Options;
+        std::uint64_t ReadOperations = 0;
+        std::uint64_t WriteOperations = 0;
+        std::uint64_t ReadBytes = 0;
+        std::uint64_t WrittenBytes = 0;
+        std::uint64_t Flushes = 0;
+        double Seconds = 0.0;
+        double Iops = 0.0;
+        double BytesPerSecond = 0.0;
+        VirtualDiskLatencyStatistics ReadLatency;
+        VirtualDiskLatencyStatistics WriteLatency;
+        VirtualDiskLatencyStatistics Latency;
+    };
+
+    // Runs the closed loop workload against the image through the image
+    // engine. The reads and the writes into the fully present blocks are
+    // concurrent, and the writes which change the metadata are serialized
+    // with the other I/O. Open the image unbuffered to measure the storage
+    // instead of the cache of the system, the buffers are aligned for it.
+    // The content in the range is overwritten if there are writes.
+    VirtualDiskBenchmarkResult RunVirtualDiskBenchmark(
+        VirtualDiskImage& Image,
+        VirtualDiskBenchmarkOptions const& Options);
+
+    // Formats the layout of the image and the results as a JSON document,
+    // which can be compared between the layouts and the hosts.
+    std::string FormatVirtualDiskBenchmarkJson(
+        VirtualDiskImage const& Image,
+        std::vector<VirtualDiskBenchmarkResult> const& Results);
+}
+
+#endif // !NANABOX_VIRTUAL_DISK_BENCHMARK
@@ -0,0 +1,544 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualDiskChangeTracking.cpp
+ * PURPOSE:   Implementation for the Virtual Disk Changed Block Tracking
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "VirtualDiskChangeTracking.h"
+
+#include "VirtualDiskCompaction.h"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+namespace
+{
+    const std::uint64_t MiB = 1024 * 1024;
+
+    // The spans are the units of the parallel work, and the spans are
+    // processed in batches to bound the memory used by the results.
+    const std::uint64_t ComparisonSpanSize = 4 * MiB;
+    const std::size_t ComparisonBatchSpanCount = 1024;
+    const std::size_t DeltaChunkSize = 8 * MiB;
+
+    const char DeltaSignature[8] = { 'N', 'B', 'V', 'D', 'E', 'L', 'T', 'A' };
+    const std::uint32_t DeltaVersion = 1;
+    const std::size_t DeltaHeaderSize = 64;
+    const std::size_t DeltaRangeEntrySize = 16;
+    const std::uint64_t DeltaDataAlignment = 4096;
+
+    void StoreLE32(
+        std::uint8_t* Destination,
+        std::uint32_t Value)
+    {
+        for (std::size_t i = 0; i < 4; ++i)
+        {
+            Destination[i] = static_cast<std::uint8_t>(Value >> (i * 8));
+        }
+    }
+
+    void StoreLE64(
+        std::uint8_t* Destination,
+        std::uint64_t Value)
+    {
+        for (std::size_t i = 0; i < 8; ++i)
+        {
+            Destination[i] = static_cast<std::uint8_t>(Value >> (i * 8));
+        }
+    }
+
+    std::uint32_t LoadLE32(
+        std::uint8_t const* Source)
+    {
+        std::uint32_t Value = 0;
+        for (std::size_t i = 0; i < 4; ++i)
+        {
+            Value |= static_cast<std::uint32_t>(Source[i]) << (i * 8);
+        }
+        return Value;
+    }
+
+    std::uint64_t LoadLE64(
+        std::uint8_t const* Source)
+    {
+        std::uint64_t Value = 0;
+        for (std::size_t i = 0; i < 8; ++i)
+        {
+            Value |= static_cast<std::uint64_t>(Source[i]) << (i * 8);
+        }
+        return Value;
+    }
+
+    void AppendRange(
+        std::vector<NanaBox::VirtualDiskChangedRange>& Ranges,
+        std::uint64_t Offset,
+        std::uint64_t Length)
+    {
+        if (!Length)
+        {
+            return;
+        }
+
+        if (!Ranges.empty() &&
+            Ranges.back().Offset + Ranges.back().Length == Offset)
+        {
+            Ranges.back().Length += Length;
+        }
+        else
+        {
+            NanaBox::VirtualDiskChangedRange Range;
+            Range.Offset = Offset;
+            Range.Length = Length;
+            Ranges.push_back(Range);
+        }
+    }
+
+    // Returns true if any image of the chain has the payload in the range.
+    bool HasPresentData(
+        NanaBox::VirtualDiskImage const& Image,
+        std::uint64_t Offset,
+        std::uint64_t Length)
+    {
+        for (NanaBox::VirtualDiskImage const* Current = &Image;
+            Current;
+            Current = Current->GetParent())
+        {
+            std::uint32_t BlockSize = Current->GetInformation().BlockSize;
+            std::uint64_t LastBlock = std::min(
+                (Offset + Length - 1) / BlockSize,
+                Current->GetInformation().BlockCount - 1);
+            for (std::uint64_t i = Offset / BlockSize; i <= LastBlock; ++i)
+            {
+                NanaBox::VirtualDiskBlockState State =
+                    Current->GetBlockState(i);
+                if (NanaBox::VirtualDiskBlockState::FullyPresent == State ||
+                    NanaBox::VirtualDiskBlockState::PartiallyPresent == State)
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    std::uint64_t GetDeltaDataOffset(
+        std::uint64_t RangeCount)
+    {
+        std::uint64_t Offset =
+            DeltaHeaderSize + DeltaRangeEntrySize * RangeCount;
+        return (Offset + DeltaDataAlignment - 1) /
+            DeltaDataAlignment * DeltaDataAlignment;
+    }
+
+    struct DeltaChunk
+    {
+        std::uint64_t VirtualOffset;
+        std::uint64_t FileOffset;
+        std::size_t Size;
+    };
+
+    // Splits the ranges into the chunks and assigns the offsets in the delta
+    // file, the data of the ranges is stored in order after the range table.
+    std::vector<DeltaChunk> GetDeltaChunks(
+        std::vector<NanaBox::VirtualDiskChangedRange> const& Ranges)
+    {
+        std::uint64_t FileOffset = ::GetDeltaDataOffset(Ranges.size());
+
+        std::vector<DeltaChunk> Chunks;
+        for (NanaBox::VirtualDiskChangedRange const& Range : Ranges)
+        {
+            for (std::uint64_t Offset = 0; Offset < Range.Length;)
+            {
+                std::size_t Size = static_cast<std::size_t>(
+                    std::min<std::uint64_t>(
+                        DeltaChunkSize,
+                        Range.Length - Offset));
+                Chunks.push_back({ Range.Offset + Offset, FileOffset, Size });
+                Offset += Size;
+                FileOffset += Size;
+            }
+        }
+        return Chunks;
+    }
+}
+
+std::vector<NanaBox::VirtualDiskChangedRange>
+NanaBox::GetDifferencingDiskChanges(
+    NanaBox::VirtualDiskImage const& Child)
+{
+    NanaBox::VirtualDiskInformation const& Information =
+        Child.GetInformation();
+    if (NanaBox::VirtualDiskType::Differencing != Information.Type)
+    {
+        throw std::runtime_error(
+            Child.GetPath() + ": The image is not a differencing disk");
+    }
+
+    std::vector<NanaBox::VirtualDiskChangedRange> Result;
+    std::vector<std::uint8_t> Bitmap;
+    for (std::uint64_t i = 0; i < Information.BlockCount; ++i)
+    {
+        std::uint64_t BlockOffset = i * Information.BlockSize;
+        std::uint64_t BlockLength = std::min<std::uint64_t>(
+            Information.BlockSize,
+            Information.VirtualSize - BlockOffset);
+
+        switch (Child.GetBlockState(i))
+        {
+        case NanaBox::VirtualDiskBlockState::NotPresent:
+            break;
+        case NanaBox::VirtualDiskBlockState::PartiallyPresent:
+        {
+            Child.GetBlockSectorBitmap(i, Bitmap);
+            std::uint32_t SectorSize = Information.LogicalSectorSize;
+            std::uint64_t SectorCount = BlockLength / SectorSize;
+            for (std::uint64_t j = 0; j < SectorCount; ++j)
+            {
+                // Skips the bytes without any present sector.
+                if (0 == j % 8 && !Bitmap[j / 8])
+                {
+                    j += 7;
+                    continue;
+                }
+                if (Bitmap[j / 8] & (1 << (j % 8)))
+                {
+                    ::AppendRange(
+                        Result,
+                        BlockOffset + j * SectorSize,
+                        SectorSize);
+                }
+            }
+            break;
+        }
+        default:
+            ::AppendRange(Result, BlockOffset, BlockLength);
+            break;
+        }
+    }
+    return Result;
+}
+
+std::vector<NanaBox::VirtualDiskChangedRange>
+NanaBox::CompareVirtualDiskImages(
+    NanaBox::VirtualDiskImage const& Base,
+    NanaBox::VirtualDiskImage const& Current,
+    NanaBox::VirtualDiskChangeTrackingOptions const& Options,
+    NanaBox::VirtualDiskProgressHandler const& ProgressHandler)
+{
+    std::uint64_t VirtualSize = Current.GetInformation().VirtualSize;
+    if (Base.GetInformation().VirtualSize != VirtualSize)
+    {
+        throw std::runtime_error(
+            "The virtual sizes of the images are different");
+    }
+
+    std::uint64_t Granularity = Options.Granularity;
+    if (!Granularity ||
+        (Granularity & (Granularity - 1)) ||
+        Granularity % Base.GetInformation().LogicalSectorSize ||
+        Granularity % Current.GetInformation().LogicalSectorSize)
+    {
+        throw std::invalid_argument("Invalid granularity");
+    }
+    std::uint64_t SpanSize = std::max(Granularity, ComparisonSpanSize);
+    std::uint64_t SpanCount = (VirtualSize + SpanSize - 1) / SpanSize;
+
+    std::size_t MaxParallelism = Options.MaxParallelism
+        ? Options.MaxParallelism
+        : std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+    std::size_t WorkerCount = static_cast<std::size_t>(
+        std::min<std::uint64_t>(MaxParallelism, SpanCount));
+    std::vector<NanaBox::VirtualDiskBuffer> CurrentBuffers;
+    std::vector<NanaBox::VirtualDiskBuffer> BaseBuffers;
+    for (std::size_t i = 0; i < WorkerCount; ++i)
+    {
+        CurrentBuffers.emplace_back(static_cast<std::size_t>(SpanSize));
+        BaseBuffers.emplace_back(static_cast<std::size_t>(SpanSize));
+    }
+
+    std::vector<NanaBox::VirtualDiskChangedRange> Result;
+    std::uint64_t CompletedBytes = 0;
+    std::mutex ProgressMutex;
+    for (std::uint64_t BatchStart = 0;
+        BatchStart < SpanCount;
+        BatchStart += ComparisonBatchSpanCount)
+    {
+        std::size_t BatchSize = static_cast<std::size_t>(
+            std::min<std::uint64_t>(
+                ComparisonBatchSpanCount,
+                SpanCount - BatchStart));
+        std::vector<std::vector<NanaBox::VirtualDiskChangedRange>> SpanRanges(
+            BatchSize);
+
+        NanaBox::RunVirtualDiskWorkers(
+            BatchSize,
+            MaxParallelism,
+            [&](std::size_t WorkerIndex, std::size_t Index)
+        {
+            std::uint64_t SpanOffset = (BatchStart + Index) * SpanSize;
+            std::uint64_t SpanLength = std::min(
+                SpanSize,
+                VirtualSize - SpanOffset);
+
+            bool BasePresent = ::HasPresentData(Base, SpanOffset, SpanLength);
+            bool CurrentPresent = ::HasPresentData(
+                Current,
+                SpanOffset,
+                SpanLength);
+            if (BasePresent || CurrentPresent)
+            {
+                // The ranges without the payload read as zeros, so the other
+                // side only needs to be checked for zeros.
+                std::uint8_t* CurrentData = nullptr;
+                std::uint8_t* BaseData = nullptr;
+                if (CurrentPresent)
+                {
+                    CurrentData = CurrentBuffers[WorkerIndex].GetData();
+                    Current.Read(
+                        SpanOffset,
+                        CurrentData,
+                        static_cast<std::size_t>(SpanLength));
+                }
+                if (BasePresent)
+                {
+                    BaseData = BaseBuffers[WorkerIndex].GetData();
+                    Base.Read(
+                        SpanOffset,
+                        BaseData,
+                        static_cast<std::size_t>(SpanLength));
+                }
+
+                for (std::uint64_t Offset = 0;
+                    Offset < SpanLength;
+                    Offset += Granularity)
+                {
+                    std::size_t Length = static_cast<std::size_t>(
+                        std::min(Granularity, SpanLength - Offset));
+                    bool Changed = false;
+                    if (CurrentData && BaseData)
+                    {
+                        Changed = 0 != std::memcmp(
+                            CurrentData + Offset,
+                            BaseData + Offset,
+                            Length);
+                    }
+                    else
+                    {
+                        Changed = !NanaBox::IsZeroMemory(
+                            (CurrentData ? CurrentData : BaseData) + Offset,
+                            Length);
+                    }
+                    if (Changed)
+                    {
+                        ::AppendRange(
+                            SpanRanges[Index],
+                            SpanOffset + Offset,
+                            Length);
+                    }
+                }
+            }
+
+            if (ProgressHandler)
+            {
+                std::lock_guard<std::mutex> Lock(ProgressMutex);
+                CompletedBytes += SpanLength;
+                ProgressHandler(CompletedBytes, VirtualSize);
+            }
+        });
+
+        for (auto const& Ranges : SpanRanges)
+        {
+            for (NanaBox::VirtualDiskChangedRange const& Range : Ranges)
+            {
+                ::AppendRange(Result, Range.Offset, Range.Length);
+            }
+        }
+    }
+
+    return Result;
+}
+
+void NanaBox::CreateVirtualDiskDelta(
+    NanaBox::VirtualDiskImage const& Current,
+    NanaBox::VirtualDiskGuid const& BaseDataWriteGuid,
+    std::vector<NanaBox::VirtualDiskChangedRange> const& Ranges,
+    std::string const& DeltaPath,
+    NanaBox::VirtualDiskProgressHandler const& ProgressHandler)
+{
+    NanaBox::VirtualDiskInformation const& Information =
+        Current.GetInformation();
+
+    std::vector<std::uint8_t> Header(
+        DeltaHeaderSize + DeltaRangeEntrySize * Ranges.size());
+    std::memcpy(&Header[0], DeltaSignature, sizeof(DeltaSignature));
+    ::StoreLE32(&Header[8], DeltaVersion);
+    ::StoreLE64(&Header[16], Information.VirtualSize);
+    ::StoreLE64(&Header[24], Ranges.size());
+    std::memcpy(&Header[32], BaseDataWriteGuid.Bytes, 16);
+    std::memcpy(&Header[48], Information.DataWriteGuid.Bytes, 16);
+    std::uint64_t TotalBytes = 0;
+    for (std::size_t i = 0; i < Ranges.size(); ++i)
+    {
+        std::uint8_t* Entry = &Header[DeltaHeaderSize + DeltaRangeEntrySize * i];
+        ::StoreLE64(Entry, Ranges[i].Offset);
+        ::StoreLE64(Entry + 8, Ranges[i].Length);
+        TotalBytes += Ranges[i].Length;
+    }
+
+    std::vector<::DeltaChunk> Chunks = ::GetDeltaChunks(Ranges);
+
+    try
+    {
+        NanaBox::VirtualDiskFile File(DeltaPath, true, true);
+        File.Write(0, Header.data(), Header.size());
+
+        std::size_t WorkerCount = std::min<std::size_t>(
+            std::max<std::size_t>(std::thread::hardware_concurrency(), 1),
+            Chunks.size());
+        std::vector<NanaBox::VirtualDiskBuffer> Buffers;
+        for (std::size_t i = 0; i < WorkerCount; ++i)
+        {
+            Buffers.emplace_back(DeltaChunkSize);
+        }
+
+        std::uint64_t CompletedBytes = 0;
+        std::mutex ProgressMutex;
+        NanaBox::RunVirtualDiskWorkers(
+            Chunks.size(),
+            WorkerCount,
+            [&](std::size_t WorkerIndex, std::size_t Index)
+        {
+            ::DeltaChunk const& Chunk = Chunks[Index];
+            std::uint8_t* Data = Buffers[WorkerIndex].GetData();
+            Current.Read(Chunk.VirtualOffset, Data, Chunk.Size);
+            File.Write(Chunk.FileOffset, Data, Chunk.Size);
+
+            if (ProgressHandler)
+            {
+                std::lock_guard<std::mutex> Lock(ProgressMutex);
+                CompletedBytes += Chunk.Size;
+                ProgressHandler(CompletedBytes, TotalBytes);
+            }
+        });
+
+        // The size of the file is checked when the delta is read.
+        File.SetSize(Chunks.empty()
+            ? ::GetDeltaDataOffset(Ranges.size())
+            : Chunks.back().FileOffset + Chunks.back().Size);
+        File.Flush();
+    }
+    catch (...)
+    {
+        NanaBox::RemoveVirtualDiskFile(DeltaPath);
+        throw;
+    }
+}
+
+NanaBox::VirtualDiskDeltaInformation NanaBox::ReadVirtualDiskDeltaInformation(
+    std::string const& DeltaPath)
+{
+    NanaBox::VirtualDiskFile File(DeltaPath, false);
+    std::uint64_t FileSize = File.GetSize();
+
+    std::uint8_t Header[DeltaHeaderSize];
+    if (FileSize < sizeof(Header))
+    {
+        throw std::runtime_error(DeltaPath + ": Invalid delta file");
+    }
+    File.Read(0, Header, sizeof(Header));
+    if (0 != std::memcmp(Header, DeltaSignature, sizeof(DeltaSignature)) ||
+        DeltaVersion != ::LoadLE32(&Header[8]))
+    {
+        throw std::runtime_error(DeltaPath + ": Invalid delta file");
+    }
+
+    NanaBox::VirtualDiskDeltaInformation Information;
+    Information.VirtualSize = ::LoadLE64(&Header[16]);
+    std::uint64_t RangeCount = ::LoadLE64(&Header[24]);
+    std::memcpy(Information.BaseDataWriteGuid.Bytes, &Header[32], 16);
+    std::memcpy(Information.CurrentDataWriteGuid.Bytes, &Header[48], 16);
+    if (RangeCount > (FileSize - DeltaHeaderSize) / DeltaRangeEntrySize)
+    {
+        throw std::runtime_error(DeltaPath + ": Invalid delta file");
+    }
+
+    std::vector<std::uint8_t> Table(
+        static_cast<std::size_t>(RangeCount * DeltaRangeEntrySize));
+    File.Read(DeltaHeaderSize, Table.data(), Table.size());
+    std::uint64_t PreviousEnd = 0;
+    std::uint64_t DataSize = 0;
+    for (std::size_t i = 0; i < RangeCount; ++i)
+    {
+        NanaBox::VirtualDiskChangedRange Range;
+        Range.Offset = ::LoadLE64(&Table[DeltaRangeEntrySize * i]);
+        Range.Length = ::LoadLE64(&Table[DeltaRangeEntrySize * i + 8]);
+        if (Range.Offset < PreviousEnd ||
+            Range.Offset > Information.VirtualSize ||
+            Range.Length > Information.VirtualSize - Range.Offset)
+        {
+            throw std::runtime_error(DeltaPath + ": Invalid delta file");
+        }
+        PreviousEnd = Range.Offset + Range.Length;
+        DataSize += Range.Length;
+        Information.Ranges.push_back(Range);
+    }
+
+    if (FileSize != ::GetDeltaDataOffset(RangeCount) + DataSize)
+    {
+        throw std::runtime_error(DeltaPath + ": The delta file is truncated");
+    }
+
+    return Information;
+}
+
+void NanaBox::ApplyVirtualDiskDelta(
+    NanaBox::VirtualDiskImage& Target,
+    std::string const& DeltaPath,
+    bool Force,
+    NanaBox::VirtualDiskProgressHandler const& ProgressHandler)
+{
+    NanaBox::VirtualDiskDeltaInformation Information =
+        NanaBox::ReadVirtualDiskDeltaInformation(DeltaPath);
+    if (Information.VirtualSize != Target.GetInformation().VirtualSize)
+    {
+        throw std::runtime_error(
+            "The virtual size of the image doesn't match the delta");
+    }
+    if (!Force &&
+        !Information.BaseDataWriteGuid.IsNull() &&
+        Information.BaseDataWriteGuid !=
+        Target.GetInformation().DataWriteGuid)
+    {
+        throw std::runtime_error(
+            "The image is not the base of the delta, it may be modified "
+            "after the delta was created");
+    }
+
+    std::uint64_t TotalBytes = 0;
+    for (NanaBox::VirtualDiskChangedRange const& Range : Information.Ranges)
+    {
+        TotalBytes += Range.Length;
+    }
+
+    NanaBox::VirtualDiskFile File(DeltaPath, false);
+    NanaBox::VirtualDiskBuffer Buffer(DeltaChunkSize);
+    std::uint64_t CompletedBytes = 0;
+    for (::DeltaChunk const& Chunk : ::GetDeltaChunks(Information.Ranges))
+    {
+        File.Read(Chunk.FileOffset, Buffer.GetData(), Chunk.Size);
+        Target.Write(Chunk.VirtualOffset, Buffer.GetData(), Chunk.Size);
+        CompletedBytes += Chunk.Size;
+        if (ProgressHandler)
+        {
+            ProgressHandler(CompletedBytes, TotalBytes);
+        }
+    }
+    Target.Flush();
+}
@@ -0,0 +1,89 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualDiskChangeTracking.h
+ * PURPOSE:   Definition for the Virtual Disk Changed Block Tracking
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_VIRTUAL_DISK_CHANGE_TRACKING
+#define NANABOX_VIRTUAL_DISK_CHANGE_TRACKING
+
+#include "VirtualDiskImage.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace NanaBox
+{
+    // The sorted and merged ranges of the virtual disk, in bytes.
+    struct VirtualDiskChangedRange
+    {
+        std::uint64_t Offset = 0;
+        std::uint64_t Length = 0;
+    };
+
+    struct VirtualDiskChangeTrackingOptions
+    {
+        // The unit of the comparison, which is also the granularity of the
+        // changed ranges of the snapshot comparisons. Must be a power of two
+        // and a multiple of the logical sector size.
+        std::uint32_t Granularity = 64 * 1024;
+        // Uses the number of the logical processors if it is zero.
+        std::size_t MaxParallelism = 0;
+    };
+
+    // Returns the sectors written to the differencing disk since it was
+    // created from its parent, which are read from the BAT and the sector
+    // bitmaps without reading the payload. The blocks which are explicitly
+    // zero in the child are also reported because they hide the parent.
+    std::vector<VirtualDiskChangedRange> GetDifferencingDiskChanges(
+        VirtualDiskImage const& Child);
+
+    // Compares two generations of the same virtual disk, which should have
+    // their parents attached. The ranges which are not present in both chains
+    // are skipped via the BAT, and the others are compared in parallel.
+    std::vector<VirtualDiskChangedRange> CompareVirtualDiskImages(
+        VirtualDiskImage const& Base,
+        VirtualDiskImage const& Current,
+        VirtualDiskChangeTrackingOptions const& Options,
+        VirtualDiskProgressHandler const& ProgressHandler = nullptr);
+
+    struct VirtualDiskDeltaInformation
+    {
+        std::uint64_t VirtualSize = 0;
+        // The DataWriteGuid of the VHDX images, the delta can only be applied
+        // to the image with the base GUID unless it is null.
+        VirtualDiskGuid BaseDataWriteGuid;
+        VirtualDiskGuid CurrentDataWriteGuid;
+        std::vector<VirtualDiskChangedRange> Ranges;
+    };
+
+    // Writes the changed ranges of the current image to a new delta file,
+    // which contains the header, the range table and the data of the ranges
+    // in order.
+    void CreateVirtualDiskDelta(
+        VirtualDiskImage const& Current,
+        VirtualDiskGuid const& BaseDataWriteGuid,
+        std::vector<VirtualDiskChangedRange> const& Ranges,
+        std::string const& DeltaPath,
+        VirtualDiskProgressHandler const& ProgressHandler = nullptr);
+
+    VirtualDiskDeltaInformation ReadVirtualDiskDeltaInformation(
+        std::string const& DeltaPath);
+
+    // Writes the data of the delta file to the image. Throws if the virtual
+    // size doesn't match, or the image is not the base of the delta and Force
+    // is false.
+    void ApplyVirtualDiskDelta(
+        VirtualDiskImage& Target,
+        std::string const& DeltaPath,
+        bool Force,
+        VirtualDiskProgressHandler const& ProgressHandler = nullptr);
+}
+
+#endif // !NANABOX_VIRTUAL_DISK_CHANGE_TRACKING
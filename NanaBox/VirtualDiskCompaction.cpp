@@ -0,0 +1,487 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualDiskCompaction.cpp
+ * PURPOSE:   Implementation for the Offline Virtual Disk Compaction
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "VirtualDiskCompaction.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define NANABOX_VIRTUAL_DISK_COMPACTION_X64
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define NANABOX_TARGET_AVX2
+#else
+#define NANABOX_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace
+{
+    const std::uint64_t MiB = 1024 * 1024;
+
+    bool IsZeroMemoryWords(
+        std::uint8_t const* Data,
+        std::size_t Size)
+    {
+        std::uint64_t Accumulator = 0;
+        for (; Size >= 64; Data += 64, Size -= 64)
+        {
+            std::uint64_t Words[8];
+            std::memcpy(Words, Data, sizeof(Words));
+            Accumulator |= Words[0] | Words[1] | Words[2] | Words[3] |
+                Words[4] | Words[5] | Words[6] | Words[7];
+            if (Accumulator)
+            {
+                return false;
+            }
+        }
+        for (; Size; ++Data, --Size)
+        {
+            Accumulator |= *Data;
+        }
+        return !Accumulator;
+    }
+
+#ifdef NANABOX_VIRTUAL_DISK_COMPACTION_X64
+    NANABOX_TARGET_AVX2 bool IsZeroMemoryAvx2(
+        std::uint8_t const* Data,
+        std::size_t Size)
+    {
+        for (; Size >= 128; Data += 128, Size -= 128)
+        {
+            __m256i Accumulator = _mm256_or_si256(
+                _mm256_or_si256(
+                    _mm256_loadu_si256(
+                        reinterpret_cast<__m256i const*>(Data)),
+                    _mm256_loadu_si256(
+                        reinterpret_cast<__m256i const*>(Data + 32))),
+                _mm256_or_si256(
+                    _mm256_loadu_si256(
+                        reinterpret_cast<__m256i const*>(Data + 64)),
+                    _mm256_loadu_si256(
+                        reinterpret_cast<__m256i const*>(Data + 96))));
+            if (!_mm256_testz_si256(Accumulator, Accumulator))
+            {
+                return false;
+            }
+        }
+        return ::IsZeroMemoryWords(Data, Size);
+    }
+
+    bool IsZeroMemorySse2(
+        std::uint8_t const* Data,
+        std::size_t Size)
+    {
+        const __m128i Zero = _mm_setzero_si128();
+        for (; Size >= 64; Data += 64, Size -= 64)
+        {
+            __m128i Accumulator = _mm_or_si128(
+                _mm_or_si128(
+                    _mm_loadu_si128(
+                        reinterpret_cast<__m128i const*>(Data)),
+                    _mm_loadu_si128(
+                        reinterpret_cast<__m128i const*>(Data + 16))),
+                _mm_or_si128(
+                    _mm_loadu_si128(
+                        reinterpret_cast<__m128i const*>(Data + 32)),
+                    _mm_loadu_si128(
+                        reinterpret_cast<__m128i const*>(Data + 48))));
+            if (0xFFFF != _mm_movemask_epi8(
+                _mm_cmpeq_epi8(Accumulator, Zero)))
+            {
+                return false;
+            }
+        }
+        return ::IsZeroMemoryWords(Data, Size);
+    }
+#endif
+
+    struct FileExtent
+    {
+        std::uint64_t Offset;
+        std::uint64_t Size;
+    };
+}
+
+bool NanaBox::IsZeroMemory(
+    void const* Data,
+    std::size_t Size)
+{
+    std::uint8_t const* Bytes = static_cast<std::uint8_t const*>(Data);
+#ifdef NANABOX_VIRTUAL_DISK_COMPACTION_X64
+    static const bool Avx2Supported = NanaBox::IsAvx2Supported();
+    return Avx2Supported
+        ? ::IsZeroMemoryAvx2(Bytes, Size)
+        : ::IsZeroMemorySse2(Bytes, Size);
+#else
+    return ::IsZeroMemoryWords(Bytes, Size);
+#endif
+}
+
+NanaBox::VirtualDiskCompactionResult NanaBox::CompactVirtualDiskImage(
+    NanaBox::VirtualDiskImage& Image,
+    NanaBox::VirtualDiskCompactionOptions const& Options,
+    NanaBox::VirtualDiskProgressHandler const& ProgressHandler)
+{
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point StartTime = Clock::now();
+
+    NanaBox::VirtualDiskInformation const& Information =
+        Image.GetInformation();
+    if (NanaBox::VirtualDiskFormat::Vhdx != Information.Format)
+    {
+        throw std::runtime_error(
+            Image.GetPath() + ": Only VHDX images can be compacted");
+    }
+    if (NanaBox::VirtualDiskType::Fixed == Information.Type)
+    {
+        throw std::runtime_error(
+            Image.GetPath() + ": Fixed images can't be compacted");
+    }
+    if (!Options.ScanOnly && !Image.GetFile().IsWritable())
+    {
+        throw std::runtime_error(
+            Image.GetPath() + ": The image is opened read-only");
+    }
+
+    std::size_t MaxParallelism = Options.MaxParallelism
+        ? Options.MaxParallelism
+        : std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+    std::size_t ChunkSize = std::max<std::size_t>(
+        Options.ChunkSize / 4096 * 4096,
+        4096);
+
+    NanaBox::VirtualDiskFile& File = Image.GetFile();
+    NanaBox::VirtualDiskCompactionResult Result;
+    Result.OriginalFileSize = File.GetSize();
+    Result.CompactedFileSize = Result.OriginalFileSize;
+
+    std::uint64_t CompletedBytes = 0;
+    std::uint64_t TotalBytes = 0;
+    std::mutex ProgressMutex;
+    auto ReportProgress = [&](std::uint64_t Bytes)
+    {
+        std::lock_guard<std::mutex> Lock(ProgressMutex);
+        CompletedBytes += Bytes;
+        if (ProgressHandler)
+        {
+            ProgressHandler(CompletedBytes, TotalBytes);
+        }
+    };
+
+    // The part of the last block beyond the virtual size is not scanned.
+    auto GetBlockLength = [&](std::uint64_t BlockIndex) -> std::uint64_t
+    {
+        return std::min<std::uint64_t>(
+            Information.BlockSize,
+            Information.VirtualSize - BlockIndex * Information.BlockSize);
+    };
+
+    // The partially present blocks of the differencing disks are only
+    // scanned if all the sectors are present, otherwise the sectors which are
+    // not present are still read from the parent.
+    std::vector<std::uint64_t> Candidates;
+    std::vector<std::uint8_t> Bitmap;
+    for (std::uint64_t i = 0; i < Information.BlockCount; ++i)
+    {
+        NanaBox::VirtualDiskBlockState State = Image.GetBlockState(i);
+        if (NanaBox::VirtualDiskBlockState::PartiallyPresent == State)
+        {
+            ++Result.AllocatedBlocks;
+            Image.GetBlockSectorBitmap(i, Bitmap);
+            std::size_t Sectors = static_cast<std::size_t>(
+                GetBlockLength(i) / Information.LogicalSectorSize);
+            bool FullyPresent = true;
+            for (std::size_t j = 0; FullyPresent && j < Sectors; ++j)
+            {
+                FullyPresent = Bitmap[j / 8] & (1 << (j % 8));
+            }
+            if (!FullyPresent)
+            {
+                continue;
+            }
+        }
+        else if (NanaBox::VirtualDiskBlockState::FullyPresent == State)
+        {
+            ++Result.AllocatedBlocks;
+        }
+        else
+        {
+            continue;
+        }
+
+        Candidates.push_back(i);
+        TotalBytes += GetBlockLength(i);
+    }
+    Result.ScannedBlocks = Candidates.size();
+
+    std::vector<NanaBox::VirtualDiskBuffer> Buffers;
+    for (std::size_t i = 0;
+        i < std::min(MaxParallelism, Candidates.size());
+        ++i)
+    {
+        Buffers.emplace_back(ChunkSize);
+    }
+
+    std::vector<std::uint8_t> ZeroFlags(Candidates.size(), 0);
+    std::atomic<std::uint64_t> ScannedBytes(0);
+    Clock::time_point ScanStartTime = Clock::now();
+    NanaBox::RunVirtualDiskWorkers(
+        Candidates.size(),
+        MaxParallelism,
+        [&](std::size_t WorkerIndex, std::size_t Index)
+    {
+        std::uint64_t BlockIndex = Candidates[Index];
+        std::uint64_t FileOffset = Image.GetBlockFileOffset(BlockIndex);
+        std::uint64_t Length = GetBlockLength(BlockIndex);
+        std::uint8_t* Buffer = Buffers[WorkerIndex].GetData();
+
+        bool Zero = true;
+        std::uint64_t Offset = 0;
+        while (Offset < Length)
+        {
+            std::size_t Size = static_cast<std::size_t>(
+                std::min<std::uint64_t>(ChunkSize, Length - Offset));
+            File.Read(FileOffset + Offset, Buffer, Size);
+            Offset += Size;
+            if (!NanaBox::IsZeroMemory(Buffer, Size))
+            {
+                Zero = false;
+                break;
+            }
+        }
+
+        ZeroFlags[Index] = Zero;
+        ScannedBytes += Offset;
+        ReportProgress(Length);
+    });
+    Result.ScannedBytes = ScannedBytes;
+    Result.ScanSeconds = std::chrono::duration<double>(
+        Clock::now() - ScanStartTime).count();
+
+    std::vector<std::uint64_t> ZeroBlocks;
+    for (std::size_t i = 0; i < Candidates.size(); ++i)
+    {
+        if (ZeroFlags[i])
+        {
+            ZeroBlocks.push_back(Candidates[i]);
+        }
+    }
+    Result.ZeroBlocks = ZeroBlocks.size();
+
+    // The extents which are still used after unmapping the zero blocks.
+    std::vector<::FileExtent> UsedExtents;
+    for (auto const& Range : Image.GetMetadataFileRanges())
+    {
+        UsedExtents.push_back({ Range.first, Range.second });
+    }
+    std::vector<std::uint64_t> PayloadBlocks;
+    {
+        std::size_t ZeroIndex = 0;
+        for (std::uint64_t i = 0; i < Information.BlockCount; ++i)
+        {
+            if (!Image.GetBlockFileOffset(i))
+            {
+                continue;
+            }
+            if (ZeroIndex < ZeroBlocks.size() && ZeroBlocks[ZeroIndex] == i)
+            {
+                ++ZeroIndex;
+                continue;
+            }
+            PayloadBlocks.push_back(i);
+            UsedExtents.push_back({
+                Image.GetBlockFileOffset(i),
+                Information.BlockSize });
+        }
+    }
+    std::sort(
+        UsedExtents.begin(),
+        UsedExtents.end(),
+        [](::FileExtent const& Left, ::FileExtent const& Right)
+    {
+        return Left.Offset < Right.Offset;
+    });
+
+    // The 1 MiB aligned free ranges between the used extents.
+    std::vector<::FileExtent> FreeExtents;
+    {
+        std::uint64_t Cursor = 0;
+        for (::FileExtent const& Extent : UsedExtents)
+        {
+            std::uint64_t Start = (Cursor + MiB - 1) / MiB * MiB;
+            if (Extent.Offset > Start)
+            {
+                FreeExtents.push_back({ Start, Extent.Offset - Start });
+            }
+            Cursor = std::max(Cursor, Extent.Offset + Extent.Size);
+        }
+    }
+
+    // Moves the blocks at the end of the file into the lowest free ranges,
+    // until no free range below the block can hold it.
+    struct BlockMove
+    {
+        std::uint64_t BlockIndex;
+        std::uint64_t SourceOffset;
+        std::uint64_t TargetOffset;
+        std::uint64_t Length;
+    };
+    std::vector<BlockMove> Moves;
+    {
+        std::sort(
+            PayloadBlocks.begin(),
+            PayloadBlocks.end(),
+            [&](std::uint64_t Left, std::uint64_t Right)
+        {
+            return Image.GetBlockFileOffset(Left) >
+                Image.GetBlockFileOffset(Right);
+        });
+
+        std::size_t FirstFreeExtent = 0;
+        for (std::uint64_t BlockIndex : PayloadBlocks)
+        {
+            while (FirstFreeExtent < FreeExtents.size() &&
+                FreeExtents[FirstFreeExtent].Size < Information.BlockSize)
+            {
+                ++FirstFreeExtent;
+            }
+            std::uint64_t SourceOffset = Image.GetBlockFileOffset(BlockIndex);
+            if (FirstFreeExtent >= FreeExtents.size() ||
+                FreeExtents[FirstFreeExtent].Offset +
+                Information.BlockSize > SourceOffset)
+            {
+                break;
+            }
+
+            ::FileExtent& Target = FreeExtents[FirstFreeExtent];
+            Moves.push_back({
+                BlockIndex,
+                SourceOffset,
+                Target.Offset,
+                std::min<std::uint64_t>(
+                    Information.BlockSize,
+                    Result.OriginalFileSize - SourceOffset) });
+            Target.Offset += Information.BlockSize;
+            Target.Size -= Information.BlockSize;
+        }
+    }
+    Result.RelocatedBlocks = Moves.size();
+
+    // The file ends at the last extent which is not moved or the last target
+    // of the moves.
+    std::uint64_t CompactedFileSize = 0;
+    {
+        std::vector<std::uint64_t> MovedOffsets;
+        for (BlockMove const& Move : Moves)
+        {
+            MovedOffsets.push_back(Move.SourceOffset);
+            CompactedFileSize = std::max(
+                CompactedFileSize,
+                Move.TargetOffset + Information.BlockSize);
+        }
+        std::sort(MovedOffsets.begin(), MovedOffsets.end());
+        for (::FileExtent const& Extent : UsedExtents)
+        {
+            if (!std::binary_search(
+                MovedOffsets.begin(),
+                MovedOffsets.end(),
+                Extent.Offset))
+            {
+                CompactedFileSize = std::max(
+                    CompactedFileSize,
+                    Extent.Offset + Extent.Size);
+            }
+        }
+    }
+    Result.CompactedFileSize = std::min(
+        CompactedFileSize,
+        Result.OriginalFileSize);
+
+    if (Options.ScanOnly)
+    {
+        Result.TotalSeconds = std::chrono::duration<double>(
+            Clock::now() - StartTime).count();
+        return Result;
+    }
+
+    // The freed space must not be reused before the BAT which no longer
+    // references it reaches the disk.
+    for (std::uint64_t BlockIndex : ZeroBlocks)
+    {
+        Image.SetBlockAllocation(
+            BlockIndex,
+            NanaBox::VirtualDiskBlockState::Zero,
+            0);
+    }
+    Image.Flush();
+
+    {
+        std::lock_guard<std::mutex> Lock(ProgressMutex);
+        for (BlockMove const& Move : Moves)
+        {
+            TotalBytes += Move.Length;
+        }
+    }
+    Buffers.clear();
+    for (std::size_t i = 0; i < std::min(MaxParallelism, Moves.size()); ++i)
+    {
+        Buffers.emplace_back(ChunkSize);
+    }
+    NanaBox::RunVirtualDiskWorkers(
+        Moves.size(),
+        MaxParallelism,
+        [&](std::size_t WorkerIndex, std::size_t Index)
+    {
+        BlockMove const& Move = Moves[Index];
+        std::uint8_t* Buffer = Buffers[WorkerIndex].GetData();
+        for (std::uint64_t Offset = 0; Offset < Move.Length;)
+        {
+            std::size_t Size = static_cast<std::size_t>(
+                std::min<std::uint64_t>(ChunkSize, Move.Length - Offset));
+            File.Read(Move.SourceOffset + Offset, Buffer, Size);
+            File.Write(Move.TargetOffset + Offset, Buffer, Size);
+            Offset += Size;
+        }
+        ReportProgress(Move.Length);
+    });
+
+    // The copies reach the disk before the BAT references them, and the BAT
+    // reaches the disk before the old copies are truncated.
+    if (!Moves.empty())
+    {
+        File.Flush();
+        for (BlockMove const& Move : Moves)
+        {
+            Image.SetBlockAllocation(
+                Move.BlockIndex,
+                Image.GetBlockState(Move.BlockIndex),
+                Move.TargetOffset);
+        }
+        Image.Flush();
+    }
+
+    if (Result.CompactedFileSize < Result.OriginalFileSize)
+    {
+        File.SetSize(Result.CompactedFileSize);
+        File.Flush();
+    }
+
+    Result.TotalSeconds = std::chrono::duration<double>(
+        Clock::now() - StartTime).count();
+    return Result;
+}
@@ -0,0 +1,69 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualDiskCompaction.h
+ * PURPOSE:   Definition for the Offline Virtual Disk Compaction
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_VIRTUAL_DISK_COMPACTION
+#define NANABOX_VIRTUAL_DISK_COMPACTION
+
+#include "VirtualDiskImage.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace NanaBox
+{
+    // Returns true if all bytes are zero. Uses AVX2 or SSE2 if the processor
+    // supports them, the other platforms use the 64-bit words.
+    bool IsZeroMemory(
+        void const* Data,
+        std::size_t Size);
+
+    struct VirtualDiskCompactionOptions
+    {
+        // Uses the number of the logical processors if it is zero.
+        std::size_t MaxParallelism = 0;
+        // The size of each read, so the memory usage is bounded by
+        // MaxParallelism * ChunkSize regardless of the block size.
+        std::size_t ChunkSize = 1024 * 1024;
+        // Only scans the blocks and reports what would be done, the image can
+        // be opened read-only in this mode.
+        bool ScanOnly = false;
+    };
+
+    struct VirtualDiskCompactionResult
+    {
+        std::uint64_t AllocatedBlocks = 0;
+        // The blocks with all the sectors present, the other partially present
+        // blocks of the differencing disks are kept as is.
+        std::uint64_t ScannedBlocks = 0;
+        std::uint64_t ZeroBlocks = 0;
+        std::uint64_t RelocatedBlocks = 0;
+        // The bytes actually read, the scan of a block stops at the first
+        // chunk which is not zero.
+        std::uint64_t ScannedBytes = 0;
+        std::uint64_t OriginalFileSize = 0;
+        std::uint64_t CompactedFileSize = 0;
+        double ScanSeconds = 0.0;
+        double TotalSeconds = 0.0;
+    };
+
+    // Compacts a dynamic or differencing VHDX without the VirtDisk API. The
+    // blocks with all the sectors present which only contain zeros are marked
+    // as zero in the BAT, the blocks at the end of the file are moved into the freed space,
+    // and then the file is truncated. The content of the virtual disk and the
+    // DataWriteGuid are not changed, so the children are still valid. The
+    // BAT is flushed before the freed space is reused and before the file is
+    // truncated, so the image stays consistent if it is interrupted.
+    VirtualDiskCompactionResult CompactVirtualDiskImage(
+        VirtualDiskImage& Image,
+        VirtualDiskCompactionOptions const& Options,
+        VirtualDiskProgressHandler const& ProgressHandler = nullptr);
+}
+
+#endif // !NANABOX_VIRTUAL_DISK_COMPACTION
@@ -0,0 +1,317 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualDiskConversion.cpp
+ * PURPOSE:   Implementation for the Sparse-Aware Virtual Disk Conversion
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "VirtualDiskConversion.h"
+
+#include "VirtualDiskCompaction.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    struct VirtualDiskRange
+    {
+        std::uint64_t Offset;
+        std::uint64_t Size;
+    };
+
+    // Merges the blocks present in any image of the chain into the sorted
+    // ranges of the virtual disk.
+    std::vector<VirtualDiskRange> GetPresentRanges(
+        NanaBox::VirtualDiskImage const& Source)
+    {
+        std::uint64_t VirtualSize = Source.GetInformation().VirtualSize;
+
+        std::vector<VirtualDiskRange> Ranges;
+        for (NanaBox::VirtualDiskImage const* Current = &Source;
+            Current;
+            Current = Current->GetParent())
+        {
+            NanaBox::VirtualDiskInformation const& Information =
+                Current->GetInformation();
+            for (std::uint64_t i = 0; i < Information.BlockCount; ++i)
+            {
+                NanaBox::VirtualDiskBlockState State =
+                    Current->GetBlockState(i);
+                if (NanaBox::VirtualDiskBlockState::FullyPresent != State &&
+                    NanaBox::VirtualDiskBlockState::PartiallyPresent != State)
+                {
+                    continue;
+                }
+
+                std::uint64_t Offset = i * Information.BlockSize;
+                if (Offset >= VirtualSize)
+                {
+                    continue;
+                }
+                std::uint64_t Size = std::min<std::uint64_t>(
+                    Information.BlockSize,
+                    VirtualSize - Offset);
+                if (!Ranges.empty() &&
+                    Ranges.back().Offset + Ranges.back().Size == Offset)
+                {
+                    Ranges.back().Size += Size;
+                }
+                else
+                {
+                    Ranges.push_back({ Offset, Size });
+                }
+            }
+        }
+
+        std::sort(
+            Ranges.begin(),
+            Ranges.end(),
+            [](VirtualDiskRange const& Left, VirtualDiskRange const& Right)
+        {
+            return Left.Offset < Right.Offset;
+        });
+
+        std::vector<VirtualDiskRange> Result;
+        for (VirtualDiskRange const& Range : Ranges)
+        {
+            if (!Result.empty() &&
+                Result.back().Offset + Result.back().Size >= Range.Offset)
+            {
+                Result.back().Size = std::max(
+                    Result.back().Offset + Result.back().Size,
+                    Range.Offset + Range.Size) - Result.back().Offset;
+            }
+            else
+            {
+                Result.push_back(Range);
+            }
+        }
+        return Result;
+    }
+}
+
+NanaBox::VirtualDiskConversionResult NanaBox::ConvertVirtualDiskImage(
+    NanaBox::VirtualDiskImage const& Source,
+    std::string const& TargetPath,
+    NanaBox::VirtualDiskConversionOptions const& Options,
+    NanaBox::VirtualDiskProgressHandler const& ProgressHandler)
+{
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point StartTime = Clock::now();
+
+    NanaBox::VirtualDiskInformation const& SourceInformation =
+        Source.GetInformation();
+    if (NanaBox::VirtualDiskType::Differencing == Options.Type)
+    {
+        throw std::invalid_argument(
+            "The conversion target can't be a differencing disk");
+    }
+    if (NanaBox::VirtualDiskType::Differencing == SourceInformation.Type &&
+        !Source.GetParent())
+    {
+        throw std::runtime_error(
+            Source.GetPath() + ": The parent is not attached");
+    }
+
+    NanaBox::VirtualDiskCreateParameters Parameters;
+    Parameters.Format = Options.Format;
+    Parameters.Type = Options.Type;
+    Parameters.VirtualSize = SourceInformation.VirtualSize;
+    Parameters.BlockSize = Options.BlockSize;
+    if (!Parameters.BlockSize &&
+        NanaBox::VirtualDiskType::Dynamic == SourceInformation.Type &&
+        (NanaBox::VirtualDiskFormat::Vhd == Options.Format ||
+            SourceInformation.BlockSize >= 1024 * 1024))
+    {
+        Parameters.BlockSize = SourceInformation.BlockSize;
+    }
+    Parameters.LogicalSectorSize = SourceInformation.LogicalSectorSize;
+    Parameters.PhysicalSectorSize = SourceInformation.PhysicalSectorSize;
+    if (NanaBox::VirtualDiskFormat::Vhdx == Options.Format &&
+        512 != Parameters.PhysicalSectorSize)
+    {
+        Parameters.PhysicalSectorSize = 4096;
+    }
+
+    std::size_t BufferSize = std::max<std::size_t>(
+        Options.BufferSize / (1024 * 1024) * (1024 * 1024),
+        1024 * 1024);
+    std::size_t QueueDepth = std::max<std::size_t>(Options.QueueDepth, 2);
+
+    NanaBox::VirtualDiskConversionResult Result;
+    Result.VirtualSize = SourceInformation.VirtualSize;
+
+    // The chunks are aligned to the buffer size, so the writes are aligned
+    // to the blocks of the target in most cases.
+    std::vector<::VirtualDiskRange> Chunks;
+    for (::VirtualDiskRange const& Range : ::GetPresentRanges(Source))
+    {
+        Result.PresentBytes += Range.Size;
+        std::uint64_t Current = Range.Offset;
+        std::uint64_t End = Range.Offset + Range.Size;
+        while (Current < End)
+        {
+            std::uint64_t Next = std::min<std::uint64_t>(
+                (Current / BufferSize + 1) * BufferSize,
+                End);
+            Chunks.push_back({ Current, Next - Current });
+            Current = Next;
+        }
+    }
+
+    std::unique_ptr<NanaBox::VirtualDiskImage> Target =
+        NanaBox::VirtualDiskImage::Create(TargetPath, Parameters);
+    try
+    {
+        std::vector<NanaBox::VirtualDiskBuffer> Buffers;
+        std::deque<std::size_t> FreeBuffers;
+        for (std::size_t i = 0; i < QueueDepth; ++i)
+        {
+            Buffers.emplace_back(BufferSize);
+            FreeBuffers.push_back(i);
+        }
+
+        struct ReadyChunk
+        {
+            std::size_t ChunkIndex;
+            std::size_t BufferIndex;
+        };
+        std::deque<ReadyChunk> ReadyChunks;
+        std::mutex Mutex;
+        std::condition_variable Condition;
+        bool ReaderCompleted = false;
+        bool WriterFailed = false;
+        std::exception_ptr ReaderException;
+
+        // The reader fills the free buffers in order, and the writer consumes
+        // them in the same order and gives them back.
+        std::thread Reader([&]()
+        {
+            try
+            {
+                for (std::size_t i = 0; i < Chunks.size(); ++i)
+                {
+                    std::size_t BufferIndex = 0;
+                    {
+                        std::unique_lock<std::mutex> Lock(Mutex);
+                        Condition.wait(Lock, [&]()
+                        {
+                            return WriterFailed || !FreeBuffers.empty();
+                        });
+                        if (WriterFailed)
+                        {
+                            break;
+                        }
+                        BufferIndex = FreeBuffers.front();
+                        FreeBuffers.pop_front();
+                    }
+
+                    Source.Read(
+                        Chunks[i].Offset,
+                        Buffers[BufferIndex].GetData(),
+                        static_cast<std::size_t>(Chunks[i].Size));
+
+                    {
+                        std::lock_guard<std::mutex> Lock(Mutex);
+                        ReadyChunks.push_back({ i, BufferIndex });
+                    }
+                    Condition.notify_all();
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> Lock(Mutex);
+                ReaderException = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> Lock(Mutex);
+                ReaderCompleted = true;
+            }
+            Condition.notify_all();
+        });
+
+        std::uint64_t CompletedBytes = 0;
+        try
+        {
+            for (;;)
+            {
+                ReadyChunk Current;
+                {
+                    std::unique_lock<std::mutex> Lock(Mutex);
+                    Condition.wait(Lock, [&]()
+                    {
+                        return ReaderCompleted || !ReadyChunks.empty();
+                    });
+                    if (ReadyChunks.empty())
+                    {
+                        break;
+                    }
+                    Current = ReadyChunks.front();
+                    ReadyChunks.pop_front();
+                }
+
+                ::VirtualDiskRange const& Chunk = Chunks[Current.ChunkIndex];
+                std::uint8_t* Data = Buffers[Current.BufferIndex].GetData();
+                std::size_t Size = static_cast<std::size_t>(Chunk.Size);
+                // The target reads zeros from the space which is not written.
+                if (!NanaBox::IsZeroMemory(Data, Size))
+                {
+                    Target->Write(Chunk.Offset, Data, Size);
+                    Result.WrittenBytes += Size;
+                }
+
+                {
+                    std::lock_guard<std::mutex> Lock(Mutex);
+                    FreeBuffers.push_back(Current.BufferIndex);
+                }
+                Condition.notify_all();
+
+                CompletedBytes += Size;
+                if (ProgressHandler)
+                {
+                    ProgressHandler(CompletedBytes, Result.PresentBytes);
+                }
+            }
+        }
+        catch (...)
+        {
+            {
+                std::lock_guard<std::mutex> Lock(Mutex);
+                WriterFailed = true;
+            }
+            Condition.notify_all();
+            Reader.join();
+            throw;
+        }
+        Reader.join();
+        if (ReaderException)
+        {
+            std::rethrow_exception(ReaderException);
+        }
+
+        Target->Flush();
+        Result.TargetFileSize = Target->GetFile().GetSize();
+    }
+    catch (...)
+    {
+        Target.reset();
+        NanaBox::RemoveVirtualDiskFile(TargetPath);
+        throw;
+    }
+
+    Result.Seconds = std::chrono::duration<double>(
+        Clock::now() - StartTime).count();
+    return Result;
+}
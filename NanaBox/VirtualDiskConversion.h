@@ -0,0 +1,63 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualDiskConversion.h
+ * PURPOSE:   Definition for the Sparse-Aware Virtual Disk Conversion
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_VIRTUAL_DISK_CONVERSION
+#define NANABOX_VIRTUAL_DISK_CONVERSION
+
+#include "VirtualDiskImage.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace NanaBox
+{
+    struct VirtualDiskConversionOptions
+    {
+        VirtualDiskFormat Format = VirtualDiskFormat::Vhdx;
+        // Only Fixed and Dynamic are supported, the differencing sources are
+        // flattened.
+        VirtualDiskType Type = VirtualDiskType::Dynamic;
+        // Keeps the block size of the dynamic sources if it is zero and the
+        // target format supports it, otherwise uses the default of the target
+        // format.
+        std::uint32_t BlockSize = 0;
+        // The size of each read and write.
+        std::size_t BufferSize = 8 * 1024 * 1024;
+        // The number of the buffers in flight between the reader and the
+        // writer, so the memory usage is BufferSize * QueueDepth.
+        std::size_t QueueDepth = 4;
+    };
+
+    struct VirtualDiskConversionResult
+    {
+        std::uint64_t VirtualSize = 0;
+        // The ranges which are present in the source or any of its parents,
+        // only these ranges are read.
+        std::uint64_t PresentBytes = 0;
+        // The bytes written to the target, the chunks which only contain
+        // zeros are skipped.
+        std::uint64_t WrittenBytes = 0;
+        std::uint64_t TargetFileSize = 0;
+        double Seconds = 0.0;
+    };
+
+    // Copies the content of the source, which should have its parents
+    // attached, to a new image. Only the blocks present in the source chain
+    // are read, and the reads are pipelined with the writes. The target is
+    // removed if the conversion fails.
+    VirtualDiskConversionResult ConvertVirtualDiskImage(
+        VirtualDiskImage const& Source,
+        std::string const& TargetPath,
+        VirtualDiskConversionOptions const& Options,
+        VirtualDiskProgressHandler const& ProgressHandler = nullptr);
+}
+
+#endif // !NANABOX_VIRTUAL_DISK_CONVERSION
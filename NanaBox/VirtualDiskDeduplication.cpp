@@ -0,0 +1,1257 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualDiskDeduplication.cpp
+ * PURPOSE:   Implementation for the Virtual Disk Deduplication Analyzer
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "VirtualDiskDeduplication.h"
+
+#include "VirtualDiskCompaction.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <stdexcept>
+#include <thread>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define NANABOX_VIRTUAL_DISK_DEDUPLICATION_X64
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define NANABOX_TARGET_AVX2
+#else
+#define NANABOX_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace
+{
+    const std::uint64_t MiB = 1024 * 1024;
+
+    // The reads of the payload are at least 4 MiB if the blocks are large
+    // enough, which is independent of the chunk size.
+    const std::uint64_t MinimumReadSize = 4 * MiB;
+    // The digests are passed from the workers to the index in batches.
+    const std::size_t DigestBatchSize = 4096;
+
+    // The hash is derived from the accumulation loop of XXH3. Each stripe of
+    // 64 bytes is mixed into 8 lanes of 64 bits with the keys depending on the
+    // position of the stripe, and the lanes are scrambled after each block of
+    // 16 stripes, so the reordered data doesn't get the same digest.
+    const std::size_t HashLaneCount = 8;
+    const std::size_t HashStripeSize = 64;
+    const std::size_t HashStripesPerBlock = 16;
+    const std::size_t HashBlockSize = HashStripeSize * HashStripesPerBlock;
+
+    const std::uint64_t Prime32No1 = 0x9E3779B1U;
+    const std::uint64_t Prime32No2 = 0x85EBCA77U;
+    const std::uint64_t Prime32No3 = 0xC2B2AE3DU;
+    const std::uint64_t Prime64No1 = 0x9E3779B185EBCA87ULL;
+    const std::uint64_t Prime64No2 = 0xC2B2AE3D27D4EB4FULL;
+    const std::uint64_t Prime64No3 = 0x165667B19E3779F9ULL;
+    const std::uint64_t Prime64No4 = 0x85EBCA77C2B2AE63ULL;
+    const std::uint64_t Prime64No5 = 0x27D4EB2F165667C5ULL;
+
+    struct HashKeys
+    {
+        std::uint64_t Stripe[HashStripesPerBlock + HashLaneCount - 1];
+        std::uint64_t Scramble[HashLaneCount];
+        std::uint64_t Final[HashLaneCount];
+    };
+
+    std::uint64_t SplitMix64(
+        std::uint64_t& State)
+    {
+        std::uint64_t Value = (State += 0x9E3779B97F4A7C15ULL);
+        Value = (Value ^ (Value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        Value = (Value ^ (Value >> 27)) * 0x94D049BB133111EBULL;
+        return Value ^ (Value >> 31);
+    }
+
+    HashKeys const& GetHashKeys()
+    {
+        static const HashKeys Keys = []()
+        {
+            HashKeys Result;
+            std::uint64_t State = 0x4E616E61426F78ULL;
+            for (std::uint64_t& Key : Result.Stripe)
+            {
+                Key = ::SplitMix64(State);
+            }
+            for (std::uint64_t& Key : Result.Scramble)
+            {
+                Key = ::SplitMix64(State);
+            }
+            for (std::uint64_t& Key : Result.Final)
+            {
+                Key = ::SplitMix64(State);
+            }
+            return Result;
+        }();
+        return Keys;
+    }
+
+    std::uint64_t RotateLeft(
+        std::uint64_t Value,
+        int Count)
+    {
+        return (Value << Count) | (Value >> (64 - Count));
+    }
+
+    std::uint64_t Avalanche(
+        std::uint64_t Value)
+    {
+        Value ^= Value >> 33;
+        Value *= 0xFF51AFD7ED558CCDULL;
+        Value ^= Value >> 33;
+        Value *= 0xC4CEB9FE1A85EC53ULL;
+        Value ^= Value >> 33;
+        return Value;
+    }
+
+    void AccumulateStripeWords(
+        std::uint64_t* Accumulators,
+        std::uint8_t const* Data,
+        std::uint64_t const* Keys)
+    {
+        for (std::size_t i = 0; i < HashLaneCount; ++i)
+        {
+            std::uint64_t Value;
+            std::memcpy(&Value, Data + i * 8, sizeof(Value));
+            std::uint64_t Keyed = Value ^ Keys[i];
+            Accumulators[i ^ 1] += Value;
+            Accumulators[i] += (Keyed & 0xFFFFFFFF) * (Keyed >> 32);
+        }
+    }
+
+#ifndef NANABOX_VIRTUAL_DISK_DEDUPLICATION_X64
+    void ScrambleWords(
+        std::uint64_t* Accumulators,
+        std::uint64_t const* Keys)
+    {
+        for (std::size_t i = 0; i < HashLaneCount; ++i)
+        {
+            std::uint64_t Value = Accumulators[i];
+            Value ^= Value >> 47;
+            Value ^= Keys[i];
+            Accumulators[i] = Value * Prime32No1;
+        }
+    }
+
+    void AccumulateBlocksWords(
+        std::uint64_t* Accumulators,
+        std::uint8_t const* Data,
+        std::size_t BlockCount)
+    {
+        HashKeys const& Keys = ::GetHashKeys();
+        for (; BlockCount; --BlockCount, Data += HashBlockSize)
+        {
+            for (std::size_t i = 0; i < HashStripesPerBlock; ++i)
+            {
+                ::AccumulateStripeWords(
+                    Accumulators,
+                    Data + i * HashStripeSize,
+                    &Keys.Stripe[i]);
+            }
+            ::ScrambleWords(Accumulators, Keys.Scramble);
+        }
+    }
+#else
+    NANABOX_TARGET_AVX2 void AccumulateBlocksAvx2(
+        std::uint64_t* Accumulators,
+        std::uint8_t const* Data,
+        std::size_t BlockCount)
+    {
+        HashKeys const& Keys = ::GetHashKeys();
+        __m256i Lanes[2];
+        __m256i ScrambleKeys[2];
+        for (std::size_t i = 0; i < 2; ++i)
+        {
+            Lanes[i] = _mm256_loadu_si256(
+                reinterpret_cast<__m256i const*>(Accumulators + i * 4));
+            ScrambleKeys[i] = _mm256_loadu_si256(
+                reinterpret_cast<__m256i const*>(Keys.Scramble + i * 4));
+        }
+        const __m256i Prime = _mm256_set1_epi32(
+            static_cast<int>(Prime32No1));
+
+        for (; BlockCount; --BlockCount, Data += HashBlockSize)
+        {
+            for (std::size_t Stripe = 0; Stripe < HashStripesPerBlock; ++Stripe)
+            {
+                for (std::size_t i = 0; i < 2; ++i)
+                {
+                    __m256i Value = _mm256_loadu_si256(
+                        reinterpret_cast<__m256i const*>(
+                            Data + Stripe * HashStripeSize + i * 32));
+                    __m256i Keyed = _mm256_xor_si256(
+                        Value,
+                        _mm256_loadu_si256(reinterpret_cast<__m256i const*>(
+                            &Keys.Stripe[Stripe + i * 4])));
+                    // Adds the value to the adjacent lane and the product of
+                    // the halves of the keyed value to the current lane.
+                    Lanes[i] = _mm256_add_epi64(
+                        Lanes[i],
+                        _mm256_shuffle_epi32(Value, _MM_SHUFFLE(1, 0, 3, 2)));
+                    Lanes[i] = _mm256_add_epi64(
+                        Lanes[i],
+                        _mm256_mul_epu32(
+                            Keyed,
+                            _mm256_srli_epi64(Keyed, 32)));
+                }
+            }
+
+            for (std::size_t i = 0; i < 2; ++i)
+            {
+                __m256i Value = _mm256_xor_si256(
+                    Lanes[i],
+                    _mm256_srli_epi64(Lanes[i], 47));
+                Value = _mm256_xor_si256(Value, ScrambleKeys[i]);
+                Lanes[i] = _mm256_add_epi64(
+                    _mm256_mul_epu32(Value, Prime),
+                    _mm256_slli_epi64(
+                        _mm256_mul_epu32(
+                            _mm256_srli_epi64(Value, 32),
+                            Prime),
+                        32));
+            }
+        }
+
+        for (std::size_t i = 0; i < 2; ++i)
+        {
+            _mm256_storeu_si256(
+                reinterpret_cast<__m256i*>(Accumulators + i * 4),
+                Lanes[i]);
+        }
+    }
+
+    void AccumulateBlocksSse2(
+        std::uint64_t* Accumulators,
+        std::uint8_t const* Data,
+        std::size_t BlockCount)
+    {
+        HashKeys const& Keys = ::GetHashKeys();
+        __m128i Lanes[4];
+        __m128i ScrambleKeys[4];
+        for (std::size_t i = 0; i < 4; ++i)
+        {
+            Lanes[i] = _mm_loadu_si128(
+                reinterpret_cast<__m128i const*>(Accumulators + i * 2));
+            ScrambleKeys[i] = _mm_loadu_si128(
+                reinterpret_cast<__m128i const*>(Keys.Scramble + i * 2));
+        }
+        const __m128i Prime = _mm_set1_epi32(static_cast<int>(Prime32No1));
+
+        for (; BlockCount; --BlockCount, Data += HashBlockSize)
+        {
+            for (std::size_t Stripe = 0; Stripe < HashStripesPerBlock; ++Stripe)
+            {
+                for (std::size_t i = 0; i < 4; ++i)
+                {
+                    __m128i Value = _mm_loadu_si128(
+                        reinterpret_cast<__m128i const*>(
+                            Data + Stripe * HashStripeSize + i * 16));
+                    __m128i Keyed = _mm_xor_si128(
+                        Value,
+                        _mm_loadu_si128(reinterpret_cast<__m128i const*>(
+                            &Keys.Stripe[Stripe + i * 2])));
+                    Lanes[i] = _mm_add_epi64(
+                        Lanes[i],
+                        _mm_shuffle_epi32(Value, _MM_SHUFFLE(1, 0, 3, 2)));
+                    Lanes[i] = _mm_add_epi64(
+                        Lanes[i],
+                        _mm_mul_epu32(Keyed, _mm_srli_epi64(Keyed, 32)));
+                }
+            }
+
+            for (std::size_t i = 0; i < 4; ++i)
+            {
+                __m128i Value = _mm_xor_si128(
+                    Lanes[i],
+                    _mm_srli_epi64(Lanes[i], 47));
+                Value = _mm_xor_si128(Value, ScrambleKeys[i]);
+                Lanes[i] = _mm_add_epi64(
+                    _mm_mul_epu32(Value, Prime),
+                    _mm_slli_epi64(
+                        _mm_mul_epu32(_mm_srli_epi64(Value, 32), Prime),
+                        32));
+            }
+        }
+
+        for (std::size_t i = 0; i < 4; ++i)
+        {
+            _mm_storeu_si128(
+                reinterpret_cast<__m128i*>(Accumulators + i * 2),
+                Lanes[i]);
+        }
+    }
+#endif
+
+    // The record of a hashed chunk in the index, which is also the layout of
+    // the records in the spilled runs.
+    struct DigestRecord
+    {
+        std::uint64_t Low;
+        std::uint64_t High;
+        std::uint32_t FileIndex;
+        std::uint32_t Length;
+    };
+
+    bool operator<(
+        DigestRecord const& Left,
+        DigestRecord const& Right)
+    {
+        if (Left.High != Right.High)
+        {
+            return Left.High < Right.High;
+        }
+        if (Left.Low != Right.Low)
+        {
+            return Left.Low < Right.Low;
+        }
+        return Left.FileIndex < Right.FileIndex;
+    }
+
+    bool IsSameDigest(
+        DigestRecord const& Left,
+        DigestRecord const& Right)
+    {
+        return Left.High == Right.High && Left.Low == Right.Low;
+    }
+
+    // Reads the records of a sorted run sequentially with a bounded buffer.
+    class DigestRunReader
+    {
+    public:
+
+        DigestRunReader(
+            std::string const& Path,
+            std::size_t BufferRecords) :
+            m_File(Path, false),
+            m_FileSize(m_File.GetSize()),
+            m_Buffer(BufferRecords)
+        {
+            this->Fill();
+        }
+
+        bool IsEnd() const
+        {
+            return this->m_Position == this->m_Count;
+        }
+
+        DigestRecord const& GetCurrent() const
+        {
+            return this->m_Buffer[this->m_Position];
+        }
+
+        void MoveNext()
+        {
+            if (++this->m_Position == this->m_Count)
+            {
+                this->Fill();
+            }
+        }
+
+    private:
+
+        void Fill()
+        {
+            std::uint64_t Remaining = this->m_FileSize - this->m_FileOffset;
+            this->m_Count = static_cast<std::size_t>(std::min<std::uint64_t>(
+                Remaining / sizeof(DigestRecord),
+                this->m_Buffer.size()));
+            this->m_Position = 0;
+            if (this->m_Count)
+            {
+                std::size_t Size = this->m_Count * sizeof(DigestRecord);
+                this->m_File.Read(
+                    this->m_FileOffset,
+                    this->m_Buffer.data(),
+                    Size);
+                this->m_FileOffset += Size;
+            }
+        }
+
+        NanaBox::VirtualDiskFile m_File;
+        std::uint64_t m_FileSize = 0;
+        std::uint64_t m_FileOffset = 0;
+        std::vector<DigestRecord> m_Buffer;
+        std::size_t m_Count = 0;
+        std::size_t m_Position = 0;
+    };
+
+    // Collects the records in memory, and writes them as sorted runs to the
+    // temporary folder when the memory limit is reached, so the memory usage
+    // doesn't depend on the size of the fleet.
+    class DigestIndex
+    {
+    public:
+
+        DigestIndex(
+            std::size_t MaxMemory,
+            std::string const& TemporaryDirectory) :
+            m_Capacity(std::max<std::size_t>(
+                MaxMemory / sizeof(DigestRecord),
+                DigestBatchSize)),
+            m_TemporaryDirectory(TemporaryDirectory)
+        {
+        }
+
+        ~DigestIndex()
+        {
+            for (std::string const& RunPath : this->m_RunPaths)
+            {
+                NanaBox::RemoveVirtualDiskFile(RunPath);
+            }
+        }
+
+        DigestIndex(DigestIndex const&) = delete;
+        DigestIndex& operator=(DigestIndex const&) = delete;
+
+        void Add(
+            std::vector<DigestRecord> const& Records)
+        {
+            std::lock_guard<std::mutex> Lock(this->m_Mutex);
+            for (DigestRecord const& Record : Records)
+            {
+                if (this->m_Records.size() == this->m_Capacity)
+                {
+                    this->Spill();
+                }
+                this->m_Records.push_back(Record);
+            }
+        }
+
+        std::size_t GetRunCount() const
+        {
+            return this->m_RunPaths.size();
+        }
+
+        // Calls the handler for the records in the digest order.
+        template<typename HandlerType>
+        void Enumerate(
+            HandlerType&& Handler)
+        {
+            if (this->m_RunPaths.empty())
+            {
+                std::sort(this->m_Records.begin(), this->m_Records.end());
+                for (DigestRecord const& Record : this->m_Records)
+                {
+                    Handler(Record);
+                }
+                return;
+            }
+
+            // Merges all the runs and shares the memory limit between the
+            // buffers of them.
+            if (!this->m_Records.empty())
+            {
+                this->Spill();
+            }
+            std::vector<DigestRecord>().swap(this->m_Records);
+
+            std::size_t BufferRecords = std::max<std::size_t>(
+                this->m_Capacity / this->m_RunPaths.size(),
+                DigestBatchSize);
+            std::vector<std::unique_ptr<DigestRunReader>> Readers;
+            for (std::string const& RunPath : this->m_RunPaths)
+            {
+                Readers.push_back(std::make_unique<DigestRunReader>(
+                    RunPath,
+                    BufferRecords));
+            }
+
+            auto Compare = [&](std::size_t Left, std::size_t Right)
+            {
+                return Readers[Right]->GetCurrent() <
+                    Readers[Left]->GetCurrent();
+            };
+            std::priority_queue<
+                std::size_t,
+                std::vector<std::size_t>,
+                decltype(Compare)> Heap(Compare);
+            for (std::size_t i = 0; i < Readers.size(); ++i)
+            {
+                if (!Readers[i]->IsEnd())
+                {
+                    Heap.push(i);
+                }
+            }
+            while (!Heap.empty())
+            {
+                std::size_t Current = Heap.top();
+                Heap.pop();
+                Handler(Readers[Current]->GetCurrent());
+                Readers[Current]->MoveNext();
+                if (!Readers[Current]->IsEnd())
+                {
+                    Heap.push(Current);
+                }
+            }
+        }
+
+    private:
+
+        void Spill()
+        {
+            std::sort(this->m_Records.begin(), this->m_Records.end());
+
+            std::string RunPath =
+                this->m_TemporaryDirectory +
+                "/NanaBox.Deduplication." +
+                NanaBox::FormatVirtualDiskGuid(
+                    NanaBox::GenerateVirtualDiskGuid()) +
+                ".tmp";
+            this->m_RunPaths.push_back(RunPath);
+            NanaBox::VirtualDiskFile File(RunPath, true, true);
+            File.Write(
+                0,
+                this->m_Records.data(),
+                this->m_Records.size() * sizeof(DigestRecord));
+            this->m_Records.clear();
+        }
+
+        std::size_t m_Capacity = 0;
+        std::string m_TemporaryDirectory;
+        std::mutex m_Mutex;
+        std::vector<DigestRecord> m_Records;
+        std::vector<std::string> m_RunPaths;
+    };
+
+    bool AreSectorsPresent(
+        std::vector<std::uint8_t> const& Bitmap,
+        std::uint64_t FirstSector,
+        std::uint64_t SectorCount)
+    {
+        for (std::uint64_t i = FirstSector; i < FirstSector + SectorCount; ++i)
+        {
+            if ((i & 7) == 0 && i + 8 <= FirstSector + SectorCount)
+            {
+                if (0xFF != Bitmap[static_cast<std::size_t>(i / 8)])
+                {
+                    return false;
+                }
+                i += 7;
+            }
+            else if (!(Bitmap[static_cast<std::size_t>(i / 8)] & (1 << (i & 7))))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // A minimal JSON reader for the virtual machine configurations, which
+    // keeps this module independent from the JSON library used by NanaBox.
+    struct JsonValue
+    {
+        enum class Kind
+        {
+            Null,
+            Boolean,
+            Number,
+            String,
+            Array,
+            Object,
+        };
+
+        Kind Type = Kind::Null;
+        // The content of the strings, or the literal of the other scalars.
+        std::string Text;
+        std::vector<JsonValue> Items;
+        std::vector<std::string> Names;
+
+        JsonValue const* Find(
+            std::string const& Name) const
+        {
+            for (std::size_t i = 0; i < this->Names.size(); ++i)
+            {
+                if (Name == this->Names[i])
+                {
+                    return &this->Items[i];
+                }
+            }
+            return nullptr;
+        }
+    };
+
+    class JsonReader
+    {
+    public:
+
+        JsonReader(
+            std::string const& Content,
+            std::string const& Path) :
+            m_Content(Content),
+            m_Path(Path)
+        {
+        }
+
+        JsonValue ReadDocument()
+        {
+            // Skips the UTF-8 BOM.
+            if (0 == this->m_Content.compare(0, 3, "\xEF\xBB\xBF"))
+            {
+                this->m_Position = 3;
+            }
+            JsonValue Result = this->ReadValue(0);
+            this->SkipWhitespace();
+            if (this->m_Position != this->m_Content.size())
+            {
+                this->ThrowError();
+            }
+            return Result;
+        }
+
+    private:
+
+        [[noreturn]] void ThrowError() const
+        {
+            throw std::runtime_error(
+                this->m_Path + ": Invalid JSON at offset " +
+                std::to_string(this->m_Position));
+        }
+
+        void SkipWhitespace()
+        {
+            while (this->m_Position < this->m_Content.size() &&
+                std::strchr(" \t\r\n", this->m_Content[this->m_Position]))
+            {
+                ++this->m_Position;
+            }
+        }
+
+        char Peek()
+        {
+            this->SkipWhitespace();
+            if (this->m_Position == this->m_Content.size())
+            {
+                this->ThrowError();
+            }
+            return this->m_Content[this->m_Position];
+        }
+
+        void Expect(
+            char Character)
+        {
+            if (Character != this->Peek())
+            {
+                this->ThrowError();
+            }
+            ++this->m_Position;
+        }
+
+        std::uint32_t ReadHexadecimal()
+        {
+            if (this->m_Position + 4 > this->m_Content.size())
+            {
+                this->ThrowError();
+            }
+            std::uint32_t Value = 0;
+            for (std::size_t i = 0; i < 4; ++i)
+            {
+                char Character = this->m_Content[this->m_Position++];
+                Value <<= 4;
+                if (Character >= '0' && Character <= '9')
+                {
+                    Value |= Character - '0';
+                }
+                else if (Character >= 'a' && Character <= 'f')
+                {
+                    Value |= Character - 'a' + 10;
+                }
+                else if (Character >= 'A' && Character <= 'F')
+                {
+                    Value |= Character - 'A' + 10;
+                }
+                else
+                {
+                    this->ThrowError();
+                }
+            }
+            return Value;
+        }
+
+        static void AppendUtf8(
+            std::string& Result,
+            std::uint32_t CodePoint)
+        {
+            if (CodePoint < 0x80)
+            {
+                Result.push_back(static_cast<char>(CodePoint));
+            }
+            else if (CodePoint < 0x800)
+            {
+                Result.push_back(static_cast<char>(0xC0 | (CodePoint >> 6)));
+                Result.push_back(static_cast<char>(0x80 | (CodePoint & 0x3F)));
+            }
+            else if (CodePoint < 0x10000)
+            {
+                Result.push_back(static_cast<char>(0xE0 | (CodePoint >> 12)));
+                Result.push_back(
+                    static_cast<char>(0x80 | ((CodePoint >> 6) & 0x3F)));
+                Result.push_back(static_cast<char>(0x80 | (CodePoint & 0x3F)));
+            }
+            else
+            {
+                Result.push_back(static_cast<char>(0xF0 | (CodePoint >> 18)));
+                Result.push_back(
+                    static_cast<char>(0x80 | ((CodePoint >> 12) & 0x3F)));
+                Result.push_back(
+                    static_cast<char>(0x80 | ((CodePoint >> 6) & 0x3F)));
+                Result.push_back(static_cast<char>(0x80 | (CodePoint & 0x3F)));
+            }
+        }
+
+        std::string ReadString()
+        {
+            this->Expect('"');
+            std::string Result;
+            for (;;)
+            {
+                if (this->m_Position == this->m_Content.size())
+                {
+                    this->ThrowError();
+                }
+                char Character = this->m_Content[this->m_Position++];
+                if ('"' == Character)
+                {
+                    return Result;
+                }
+                if ('\\' != Character)
+                {
+                    Result.push_back(Character);
+                    continue;
+                }
+
+                if (this->m_Position == this->m_Content.size())
+                {
+                    this->ThrowError();
+                }
+                Character = this->m_Content[this->m_Position++];
+                switch (Character)
+                {
+                case '"':
+                case '\\':
+                case '/':
+                    Result.push_back(Character);
+                    break;
+                case 'b':
+                    Result.push_back('\b');
+                    break;
+                case 'f':
+                    Result.push_back('\f');
+                    break;
+                case 'n':
+                    Result.push_back('\n');
+                    break;
+                case 'r':
+                    Result.push_back('\r');
+                    break;
+                case 't':
+                    Result.push_back('\t');
+                    break;
+                case 'u':
+                {
+                    std::uint32_t CodePoint = this->ReadHexadecimal();
+                    if (CodePoint >= 0xD800 && CodePoint < 0xDC00 &&
+                        0 == this->m_Content.compare(
+                            this->m_Position,
+                            2,
+                            "\\u"))
+                    {
+                        this->m_Position += 2;
+                        std::uint32_t Low = this->ReadHexadecimal();
+                        if (Low < 0xDC00 || Low >= 0xE000)
+                        {
+                            this->ThrowError();
+                        }
+                        CodePoint = 0x10000 +
+                            ((CodePoint - 0xD800) << 10) +
+                            (Low - 0xDC00);
+                    }
+                    JsonReader::AppendUtf8(Result, CodePoint);
+                    break;
+                }
+                default:
+                    this->ThrowError();
+                }
+            }
+        }
+
+        JsonValue ReadValue(
+            std::size_t Depth)
+        {
+            if (Depth > 64)
+            {
+                this->ThrowError();
+            }
+
+            JsonValue Result;
+            char Character = this->Peek();
+            if ('{' == Character)
+            {
+                Result.Type = JsonValue::Kind::Object;
+                ++this->m_Position;
+                if ('}' == this->Peek())
+                {
+                    ++this->m_Position;
+                    return Result;
+                }
+                for (;;)
+                {
+                    Result.Names.push_back(this->ReadString());
+                    this->Expect(':');
+                    Result.Items.push_back(this->ReadValue(Depth + 1));
+                    if (',' != this->Peek())
+                    {
+                        break;
+                    }
+                    ++this->m_Position;
+                }
+                this->Expect('}');
+            }
+            else if ('[' == Character)
+            {
+                Result.Type = JsonValue::Kind::Array;
+                ++this->m_Position;
+                if (']' == this->Peek())
+                {
+                    ++this->m_Position;
+                    return Result;
+                }
+                for (;;)
+                {
+                    Result.Items.push_back(this->ReadValue(Depth + 1));
+                    if (',' != this->Peek())
+                    {
+                        break;
+                    }
+                    ++this->m_Position;
+                }
+                this->Expect(']');
+            }
+            else if ('"' == Character)
+            {
+                Result.Type = JsonValue::Kind::String;
+                Result.Text = this->ReadString();
+            }
+            else
+            {
+                std::size_t Start = this->m_Position;
+                while (this->m_Position < this->m_Content.size() &&
+                    std::strchr(
+                        "+-.0123456789Eaeflnrstu",
+                        this->m_Content[this->m_Position]))
+                {
+                    ++this->m_Position;
+                }
+                Result.Text = this->m_Content.substr(
+                    Start,
+                    this->m_Position - Start);
+                if ("null" == Result.Text)
+                {
+                    Result.Type = JsonValue::Kind::Null;
+                }
+                else if ("true" == Result.Text || "false" == Result.Text)
+                {
+                    Result.Type = JsonValue::Kind::Boolean;
+                }
+                else if (!Result.Text.empty() &&
+                    std::strchr("-0123456789", Result.Text[0]))
+                {
+                    Result.Type = JsonValue::Kind::Number;
+                }
+                else
+                {
+                    this->m_Position = Start;
+                    this->ThrowError();
+                }
+            }
+            return Result;
+        }
+
+        std::string const& m_Content;
+        std::string const& m_Path;
+        std::size_t m_Position = 0;
+    };
+
+    // The per-worker statistics, which are merged when the scan completes.
+    struct ScanCounters
+    {
+        std::uint64_t HashedBytes = 0;
+        std::uint64_t ZeroBytes = 0;
+        std::uint64_t PartialBytes = 0;
+    };
+}
+
+NanaBox::VirtualDiskDigest NanaBox::HashVirtualDiskData(
+    void const* Data,
+    std::size_t Size)
+{
+    std::uint8_t const* Bytes = static_cast<std::uint8_t const*>(Data);
+    HashKeys const& Keys = ::GetHashKeys();
+
+    std::uint64_t Accumulators[HashLaneCount] =
+    {
+        Prime32No3,
+        Prime64No1,
+        Prime64No2,
+        Prime64No3,
+        Prime64No4,
+        Prime32No2,
+        Prime64No5,
+        Prime32No1,
+    };
+
+    std::size_t BlockCount = Size / HashBlockSize;
+#ifdef NANABOX_VIRTUAL_DISK_DEDUPLICATION_X64
+    static const bool Avx2Supported = NanaBox::IsAvx2Supported();
+    if (Avx2Supported)
+    {
+        ::AccumulateBlocksAvx2(Accumulators, Bytes, BlockCount);
+    }
+    else
+    {
+        ::AccumulateBlocksSse2(Accumulators, Bytes, BlockCount);
+    }
+#else
+    ::AccumulateBlocksWords(Accumulators, Bytes, BlockCount);
+#endif
+    Bytes += BlockCount * HashBlockSize;
+    Size -= BlockCount * HashBlockSize;
+
+    // The remaining stripes use the keys of their positions in the block, and
+    // the last partial stripe is padded with zeros. The length is mixed into
+    // the result, so the padding doesn't collide with the real zeros.
+    std::size_t Stripe = 0;
+    for (; Size >= HashStripeSize; Size -= HashStripeSize, ++Stripe)
+    {
+        ::AccumulateStripeWords(Accumulators, Bytes, &Keys.Stripe[Stripe]);
+        Bytes += HashStripeSize;
+    }
+    if (Size)
+    {
+        std::uint8_t LastStripe[HashStripeSize] = {};
+        std::memcpy(LastStripe, Bytes, Size);
+        ::AccumulateStripeWords(Accumulators, LastStripe, &Keys.Stripe[Stripe]);
+    }
+
+    std::uint64_t Length = BlockCount * HashBlockSize +
+        Stripe * HashStripeSize + Size;
+    NanaBox::VirtualDiskDigest Result;
+    Result.Low = Length * Prime64No1;
+    Result.High = ~Length * Prime64No2;
+    for (std::size_t i = 0; i < HashLaneCount; ++i)
+    {
+        Result.Low = ::RotateLeft(
+            Result.Low ^ ::Avalanche(Accumulators[i] ^ Keys.Final[i]),
+            31) * Prime64No3;
+        Result.High = ::RotateLeft(
+            Result.High + ::Avalanche(
+                Accumulators[i] + Keys.Final[HashLaneCount - 1 - i]),
+            27) * Prime64No4;
+    }
+    Result.Low = ::Avalanche(Result.Low ^ (Result.High >> 29));
+    Result.High = ::Avalanche(Result.High + Result.Low);
+    return Result;
+}
+
+std::vector<std::string> NanaBox::GetVirtualMachineDiskPaths(
+    std::string const& ConfigurationFilePath)
+{
+    NanaBox::VirtualDiskFile File(ConfigurationFilePath, false);
+    std::string Content(static_cast<std::size_t>(File.GetSize()), '\0');
+    if (!Content.empty())
+    {
+        File.Read(0, &Content[0], Content.size());
+    }
+
+    JsonValue Document = JsonReader(
+        Content,
+        ConfigurationFilePath).ReadDocument();
+    JsonValue const* Root = Document.Find("NanaBox");
+    JsonValue const* Type = Root ? Root->Find("Type") : nullptr;
+    if (!Type || "VirtualMachine" != Type->Text)
+    {
+        throw std::runtime_error(
+            ConfigurationFilePath +
+            ": Invalid Virtual Machine Configuration");
+    }
+
+    std::vector<std::string> Result;
+    JsonValue const* ScsiDevices = Root->Find("ScsiDevices");
+    if (!ScsiDevices || JsonValue::Kind::Array != ScsiDevices->Type)
+    {
+        return Result;
+    }
+    for (JsonValue const& ScsiDevice : ScsiDevices->Items)
+    {
+        JsonValue const* DeviceType = ScsiDevice.Find("Type");
+        JsonValue const* Path = ScsiDevice.Find("Path");
+        if (!DeviceType ||
+            "VirtualDisk" != DeviceType->Text ||
+            !Path ||
+            Path->Text.empty())
+        {
+            continue;
+        }
+        Result.push_back(NanaBox::ResolveVirtualDiskPath(
+            Path->Text,
+            ConfigurationFilePath));
+    }
+    return Result;
+}
+
+NanaBox::VirtualDiskDeduplicationResult
+NanaBox::AnalyzeVirtualDiskDeduplication(
+    std::vector<std::string> const& ImagePaths,
+    NanaBox::VirtualDiskDeduplicationOptions const& Options,
+    NanaBox::VirtualDiskProgressHandler const& ProgressHandler)
+{
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point StartTime = Clock::now();
+
+    if (Options.ChunkSize < 4096 ||
+        (Options.ChunkSize & (Options.ChunkSize - 1)))
+    {
+        throw std::runtime_error(
+            "The chunk size must be a power of two and at least 4 KiB");
+    }
+
+    NanaBox::VirtualDiskDeduplicationResult Result;
+    Result.ChunkSize = Options.ChunkSize;
+
+    // Each file of the chains is only scanned once, the chains are opened
+    // one by one to find the files without keeping all of them open.
+    std::set<std::string> KnownPaths;
+    std::uint64_t TotalBytes = 0;
+    for (std::string const& ImagePath : ImagePaths)
+    {
+        std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+            NanaBox::OpenVirtualDiskChain(ImagePath, false);
+        for (NanaBox::VirtualDiskImage* Current = Image.get();
+            Current;
+            Current = Current->GetParent())
+        {
+            std::string FullPath =
+                NanaBox::GetVirtualDiskFullPath(Current->GetPath());
+            if (!KnownPaths.insert(FullPath).second)
+            {
+                continue;
+            }
+
+            NanaBox::VirtualDiskInformation const& Information =
+                Current->GetInformation();
+            Result.ChunkSize = std::min(
+                Result.ChunkSize,
+                Information.BlockSize);
+
+            NanaBox::VirtualDiskDeduplicationFile File;
+            File.Path = FullPath;
+            File.AllocatedBytes = std::min(
+                Current->GetAllocatedBlockCount() * Information.BlockSize,
+                Information.VirtualSize);
+            TotalBytes += File.AllocatedBytes;
+            Result.Files.push_back(File);
+        }
+    }
+
+    std::size_t MaxParallelism = Options.MaxParallelism
+        ? Options.MaxParallelism
+        : std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+    std::uint32_t ChunkSize = Result.ChunkSize;
+
+    ::DigestIndex Digests(
+        Options.MaxIndexMemory,
+        Options.TemporaryDirectory);
+
+    std::uint64_t CompletedBytes = 0;
+    std::mutex ProgressMutex;
+
+    for (std::size_t FileIndex = 0;
+        FileIndex < Result.Files.size();
+        ++FileIndex)
+    {
+        NanaBox::VirtualDiskDeduplicationFile& File = Result.Files[FileIndex];
+        std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+            NanaBox::VirtualDiskImage::Open(File.Path, false);
+        NanaBox::VirtualDiskInformation const& Information =
+            Image->GetInformation();
+
+        std::vector<std::uint64_t> Blocks;
+        for (std::uint64_t i = 0; i < Information.BlockCount; ++i)
+        {
+            NanaBox::VirtualDiskBlockState State = Image->GetBlockState(i);
+            if ((NanaBox::VirtualDiskBlockState::FullyPresent == State ||
+                NanaBox::VirtualDiskBlockState::PartiallyPresent == State) &&
+                Image->GetBlockFileOffset(i))
+            {
+                Blocks.push_back(i);
+            }
+        }
+
+        std::size_t WorkerCount = std::min(
+            MaxParallelism,
+            std::max<std::size_t>(Blocks.size(), 1));
+        std::size_t ReadSize = static_cast<std::size_t>(std::min<std::uint64_t>(
+            Information.BlockSize,
+            std::max<std::uint64_t>(ChunkSize, MinimumReadSize)));
+        std::vector<NanaBox::VirtualDiskBuffer> Buffers;
+        std::vector<std::vector<::DigestRecord>> Batches(WorkerCount);
+        std::vector<std::vector<std::uint8_t>> Bitmaps(WorkerCount);
+        std::vector<::ScanCounters> Counters(WorkerCount);
+        for (std::size_t i = 0; i < WorkerCount; ++i)
+        {
+            Buffers.emplace_back(ReadSize);
+            Batches[i].reserve(DigestBatchSize);
+        }
+
+        NanaBox::RunVirtualDiskWorkers(
+            Blocks.size(),
+            WorkerCount,
+            [&](std::size_t WorkerIndex, std::size_t Index)
+        {
+            std::uint64_t BlockIndex = Blocks[Index];
+            std::uint64_t BlockLength = std::min<std::uint64_t>(
+                Information.BlockSize,
+                Information.VirtualSize - BlockIndex * Information.BlockSize);
+            std::uint64_t FileOffset = Image->GetBlockFileOffset(BlockIndex);
+            bool Partial = NanaBox::VirtualDiskBlockState::PartiallyPresent ==
+                Image->GetBlockState(BlockIndex);
+            std::vector<std::uint8_t>& Bitmap = Bitmaps[WorkerIndex];
+            if (Partial)
+            {
+                Image->GetBlockSectorBitmap(BlockIndex, Bitmap);
+            }
+
+            std::uint8_t* Data = Buffers[WorkerIndex].GetData();
+            std::vector<::DigestRecord>& Batch = Batches[WorkerIndex];
+            ::ScanCounters& Counter = Counters[WorkerIndex];
+            for (std::uint64_t ReadOffset = 0;
+                ReadOffset < BlockLength;
+                ReadOffset += ReadSize)
+            {
+                std::size_t Length = static_cast<std::size_t>(
+                    std::min<std::uint64_t>(
+                        ReadSize,
+                        BlockLength - ReadOffset));
+                Image->GetFile().Read(FileOffset + ReadOffset, Data, Length);
+
+                for (std::size_t Offset = 0;
+                    Offset < Length;
+                    Offset += ChunkSize)
+                {
+                    std::size_t Size = std::min<std::size_t>(
+                        ChunkSize,
+                        Length - Offset);
+                    if (Partial && !::AreSectorsPresent(
+                        Bitmap,
+                        (ReadOffset + Offset) / Information.LogicalSectorSize,
+                        Size / Information.LogicalSectorSize))
+                    {
+                        Counter.PartialBytes += Size;
+                        continue;
+                    }
+                    if (NanaBox::IsZeroMemory(Data + Offset, Size))
+                    {
+                        Counter.ZeroBytes += Size;
+                        continue;
+                    }
+
+                    NanaBox::VirtualDiskDigest Digest =
+                        NanaBox::HashVirtualDiskData(Data + Offset, Size);
+                    ::DigestRecord Record;
+                    Record.Low = Digest.Low;
+                    Record.High = Digest.High;
+                    Record.FileIndex = static_cast<std::uint32_t>(FileIndex);
+                    Record.Length = static_cast<std::uint32_t>(Size);
+                    Batch.push_back(Record);
+                    Counter.HashedBytes += Size;
+                    if (Batch.size() == DigestBatchSize)
+                    {
+                        Digests.Add(Batch);
+                        Batch.clear();
+                    }
+                }
+            }
+
+            if (ProgressHandler)
+            {
+                std::lock_guard<std::mutex> Lock(ProgressMutex);
+                CompletedBytes += BlockLength;
+                ProgressHandler(CompletedBytes, TotalBytes);
+            }
+        });
+
+        for (std::size_t i = 0; i < WorkerCount; ++i)
+        {
+            Digests.Add(Batches[i]);
+            File.ZeroBytes += Counters[i].ZeroBytes;
+            File.PartialBytes += Counters[i].PartialBytes;
+            Result.HashedBytes += Counters[i].HashedBytes;
+        }
+        Result.AllocatedBytes += File.AllocatedBytes;
+        Result.ZeroBytes += File.ZeroBytes;
+        Result.PartialBytes += File.PartialBytes;
+    }
+
+    Result.ScanSeconds = std::chrono::duration<double>(
+        Clock::now() - StartTime).count();
+
+    // The records of the same digest are adjacent and sorted by the file, so
+    // each group is accounted when the next digest starts.
+    ::DigestRecord Group = {};
+    std::uint64_t GroupCount = 0;
+    std::vector<std::pair<std::uint32_t, std::uint64_t>> GroupFiles;
+    auto FlushGroup = [&]()
+    {
+        if (!GroupCount)
+        {
+            return;
+        }
+        Result.UniqueBytes += Group.Length;
+        Result.DuplicateBytes += (GroupCount - 1) * Group.Length;
+        for (auto const& GroupFile : GroupFiles)
+        {
+            NanaBox::VirtualDiskDeduplicationFile& File =
+                Result.Files[GroupFile.first];
+            if (GroupFiles.size() > 1)
+            {
+                File.SharedBytes += GroupFile.second * Group.Length;
+            }
+            File.InternalDuplicateBytes +=
+                (GroupFile.second - 1) * Group.Length;
+        }
+        GroupCount = 0;
+        GroupFiles.clear();
+    };
+    Digests.Enumerate([&](::DigestRecord const& Record)
+    {
+        if (!GroupCount || !::IsSameDigest(Group, Record))
+        {
+            FlushGroup();
+            Group = Record;
+        }
+        ++GroupCount;
+        if (GroupFiles.empty() || GroupFiles.back().first != Record.FileIndex)
+        {
+            GroupFiles.emplace_back(Record.FileIndex, 0);
+        }
+        ++GroupFiles.back().second;
+    });
+    FlushGroup();
+
+    Result.SpilledRuns = Digests.GetRunCount();
+    Result.TotalSeconds = std::chrono::duration<double>(
+        Clock::now() - StartTime).count();
+    return Result;
+}
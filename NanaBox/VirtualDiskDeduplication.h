@@ -0,0 +1,97 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualDiskDeduplication.h
+ * PURPOSE:   Definition for the Virtual Disk Deduplication Analyzer
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_VIRTUAL_DISK_DEDUPLICATION
+#define NANABOX_VIRTUAL_DISK_DEDUPLICATION
+
+#include "VirtualDiskImage.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace NanaBox
+{
+    struct VirtualDiskDigest
+    {
+        std::uint64_t Low = 0;
+        std::uint64_t High = 0;
+    };
+
+    // A 128-bit non-cryptographic hash of the content, which uses AVX2 or
+    // SSE2 if they are available. All the implementations return the same
+    // result, so the digests can be compared between the machines.
+    VirtualDiskDigest HashVirtualDiskData(
+        void const* Data,
+        std::size_t Size);
+
+    // Returns the resolved paths of the virtual disks attached to the SCSI
+    // controller in the NanaBox virtual machine configuration file, which
+    // doesn't include the ISO images and the physical devices.
+    std::vector<std::string> GetVirtualMachineDiskPaths(
+        std::string const& ConfigurationFilePath);
+
+    struct VirtualDiskDeduplicationOptions
+    {
+        // The unit of the deduplication, which must be a power of two and at
+        // least 4 KiB. It is reduced to the smallest block size of the images.
+        std::uint32_t ChunkSize = 1024 * 1024;
+        // Uses the number of the logical processors if it is zero.
+        std::size_t MaxParallelism = 0;
+        // The memory used by the index of the digests, the sorted runs of the
+        // index are written to the temporary folder when it is full.
+        std::size_t MaxIndexMemory = 256 * 1024 * 1024;
+        std::string TemporaryDirectory = ".";
+    };
+
+    struct VirtualDiskDeduplicationFile
+    {
+        std::string Path;
+        // The payload stored in this file, which doesn't include the parents.
+        std::uint64_t AllocatedBytes = 0;
+        std::uint64_t ZeroBytes = 0;
+        // The chunks of the partially present blocks of the differencing
+        // disks which are not fully present, which are not hashed.
+        std::uint64_t PartialBytes = 0;
+        // The chunks which also exist in other files.
+        std::uint64_t SharedBytes = 0;
+        // The chunks which exist in this file more than once.
+        std::uint64_t InternalDuplicateBytes = 0;
+    };
+
+    struct VirtualDiskDeduplicationResult
+    {
+        std::uint32_t ChunkSize = 0;
+        // Each file is only counted once, the parents shared by multiple
+        // disks are already deduplicated.
+        std::vector<VirtualDiskDeduplicationFile> Files;
+        std::uint64_t AllocatedBytes = 0;
+        std::uint64_t HashedBytes = 0;
+        std::uint64_t ZeroBytes = 0;
+        std::uint64_t PartialBytes = 0;
+        std::uint64_t UniqueBytes = 0;
+        // The bytes which can be saved if all the copies except one are
+        // moved to the shared parents.
+        std::uint64_t DuplicateBytes = 0;
+        std::size_t SpilledRuns = 0;
+        double ScanSeconds = 0.0;
+        double TotalSeconds = 0.0;
+    };
+
+    // Hashes the payload of the images and all their parents in parallel with
+    // the bounded memory, and reports the duplicate chunks between them.
+    VirtualDiskDeduplicationResult AnalyzeVirtualDiskDeduplication(
+        std::vector<std::string> const& ImagePaths,
+        VirtualDiskDeduplicationOptions const& Options,
+        VirtualDiskProgressHandler const& ProgressHandler = nullptr);
+}
+
+#endif // !NANABOX_VIRTUAL_DISK_DEDUPLICATION
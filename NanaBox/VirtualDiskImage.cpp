@@ -0,0 +1,4027 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualDiskImage.cpp
+ * PURPOSE:   Implementation for the Portable VHDX and VHD Image Library
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "VirtualDiskImage.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+namespace
+{
+    const std::uint64_t KiB = 1024;
+    const std::uint64_t MiB = 1024 * KiB;
+    const std::uint64_t GiB = 1024 * MiB;
+    const std::uint64_t TiB = 1024 * GiB;
+
+    std::uint64_t RoundUp(
+        std::uint64_t Value,
+        std::uint64_t Alignment)
+    {
+        return (Value + Alignment - 1) / Alignment * Alignment;
+    }
+
+    bool IsPowerOfTwo(
+        std::uint64_t Value)
+    {
+        return Value && !(Value & (Value - 1));
+    }
+
+    [[noreturn]] void ThrowFormatError(
+        std::string const& Path,
+        char const* Message)
+    {
+        throw std::runtime_error(Path + ": " + Message);
+    }
+
+    std::uint16_t LoadLE16(
+        std::uint8_t const* Source)
+    {
+        return static_cast<std::uint16_t>(
+            Source[0] | (Source[1] << 8));
+    }
+
+    std::uint32_t LoadLE32(
+        std::uint8_t const* Source)
+    {
+        return static_cast<std::uint32_t>(Source[0]) |
+            (static_cast<std::uint32_t>(Source[1]) << 8) |
+            (static_cast<std::uint32_t>(Source[2]) << 16) |
+            (static_cast<std::uint32_t>(Source[3]) << 24);
+    }
+
+    std::uint64_t LoadLE64(
+        std::uint8_t const* Source)
+    {
+        return static_cast<std::uint64_t>(::LoadLE32(Source)) |
+            (static_cast<std::uint64_t>(::LoadLE32(Source + 4)) << 32);
+    }
+
+    void StoreLE16(
+        std::uint8_t* Target,
+        std::uint16_t Value)
+    {
+        Target[0] = static_cast<std::uint8_t>(Value);
+        Target[1] = static_cast<std::uint8_t>(Value >> 8);
+    }
+
+    void StoreLE32(
+        std::uint8_t* Target,
+        std::uint32_t Value)
+    {
+        for (std::size_t i = 0; i < 4; ++i)
+        {
+            Target[i] = static_cast<std::uint8_t>(Value >> (i * 8));
+        }
+    }
+
+    void StoreLE64(
+        std::uint8_t* Target,
+        std::uint64_t Value)
+    {
+        for (std::size_t i = 0; i < 8; ++i)
+        {
+            Target[i] = static_cast<std::uint8_t>(Value >> (i * 8));
+        }
+    }
+
+    std::uint16_t LoadBE16(
+        std::uint8_t const* Source)
+    {
+        return static_cast<std::uint16_t>((Source[0] << 8) | Source[1]);
+    }
+
+    std::uint32_t LoadBE32(
+        std::uint8_t const* Source)
+    {
+        return (static_cast<std::uint32_t>(Source[0]) << 24) |
+            (static_cast<std::uint32_t>(Source[1]) << 16) |
+            (static_cast<std::uint32_t>(Source[2]) << 8) |
+            static_cast<std::uint32_t>(Source[3]);
+    }
+
+    std::uint64_t LoadBE64(
+        std::uint8_t const* Source)
+    {
+        return (static_cast<std::uint64_t>(::LoadBE32(Source)) << 32) |
+            static_cast<std::uint64_t>(::LoadBE32(Source + 4));
+    }
+
+    void StoreBE16(
+        std::uint8_t* Target,
+        std::uint16_t Value)
+    {
+        Target[0] = static_cast<std::uint8_t>(Value >> 8);
+        Target[1] = static_cast<std::uint8_t>(Value);
+    }
+
+    void StoreBE32(
+        std::uint8_t* Target,
+        std::uint32_t Value)
+    {
+        for (std::size_t i = 0; i < 4; ++i)
+        {
+            Target[i] = static_cast<std::uint8_t>(Value >> ((3 - i) * 8));
+        }
+    }
+
+    void StoreBE64(
+        std::uint8_t* Target,
+        std::uint64_t Value)
+    {
+        ::StoreBE32(Target, static_cast<std::uint32_t>(Value >> 32));
+        ::StoreBE32(Target + 4, static_cast<std::uint32_t>(Value));
+    }
+
+    // CRC-32C (Castagnoli) used by the VHDX headers, region tables and log.
+    struct Crc32cTable
+    {
+        std::uint32_t Values[256];
+
+        Crc32cTable()
+        {
+            for (std::uint32_t i = 0; i < 256; ++i)
+            {
+                std::uint32_t Value = i;
+                for (std::size_t j = 0; j < 8; ++j)
+                {
+                    Value = (Value >> 1) ^ ((Value & 1) ? 0x82F63B78 : 0);
+                }
+                this->Values[i] = Value;
+            }
+        }
+    };
+
+    const Crc32cTable g_Crc32cTable;
+
+    // The checksum field at ChecksumOffset is treated as zero.
+    std::uint32_t ComputeCrc32c(
+        std::uint8_t const* Data,
+        std::size_t Size,
+        std::size_t ChecksumOffset)
+    {
+        std::uint32_t Crc = 0xFFFFFFFF;
+        for (std::size_t i = 0; i < Size; ++i)
+        {
+            std::uint8_t Value = Data[i];
+            if (i >= ChecksumOffset && i < ChecksumOffset + 4)
+            {
+                Value = 0;
+            }
+            Crc = g_Crc32cTable.Values[(Crc ^ Value) & 0xFF] ^ (Crc >> 8);
+        }
+        return Crc ^ 0xFFFFFFFF;
+    }
+
+    // The one's complement of the sum of the bytes used by VHD.
+    std::uint32_t ComputeVhdChecksum(
+        std::uint8_t const* Data,
+        std::size_t Size,
+        std::size_t ChecksumOffset)
+    {
+        std::uint32_t Sum = 0;
+        for (std::size_t i = 0; i < Size; ++i)
+        {
+            if (i < ChecksumOffset || i >= ChecksumOffset + 4)
+            {
+                Sum += Data[i];
+            }
+        }
+        return ~Sum;
+    }
+
+    NanaBox::VirtualDiskGuid MakeGuid(
+        std::uint32_t Data1,
+        std::uint16_t Data2,
+        std::uint16_t Data3,
+        std::uint64_t Data4)
+    {
+        NanaBox::VirtualDiskGuid Result;
+        ::StoreLE32(Result.Bytes, Data1);
+        ::StoreLE16(Result.Bytes + 4, Data2);
+        ::StoreLE16(Result.Bytes + 6, Data3);
+        ::StoreBE64(Result.Bytes + 8, Data4);
+        return Result;
+    }
+
+    NanaBox::VirtualDiskGuid LoadGuid(
+        std::uint8_t const* Source)
+    {
+        NanaBox::VirtualDiskGuid Result;
+        std::memcpy(Result.Bytes, Source, sizeof(Result.Bytes));
+        return Result;
+    }
+
+    std::string Utf16ToUtf8(
+        std::uint8_t const* Source,
+        std::size_t Length,
+        bool BigEndian)
+    {
+        std::string Result;
+        for (std::size_t i = 0; i + 1 < Length; i += 2)
+        {
+            std::uint32_t CodePoint = BigEndian
+                ? ::LoadBE16(Source + i)
+                : ::LoadLE16(Source + i);
+            if (!CodePoint)
+            {
+                break;
+            }
+            if (CodePoint >= 0xD800 && CodePoint < 0xDC00 && i + 3 < Length)
+            {
+                std::uint32_t Low = BigEndian
+                    ? ::LoadBE16(Source + i + 2)
+                    : ::LoadLE16(Source + i + 2);
+                if (Low >= 0xDC00 && Low < 0xE000)
+                {
+                    CodePoint = 0x10000 +
+                        ((CodePoint - 0xD800) << 10) + (Low - 0xDC00);
+                    i += 2;
+                }
+            }
+
+            if (CodePoint < 0x80)
+            {
+                Result.push_back(static_cast<char>(CodePoint));
+            }
+            else if (CodePoint < 0x800)
+            {
+                Result.push_back(static_cast<char>(0xC0 | (CodePoint >> 6)));
+                Result.push_back(static_cast<char>(0x80 | (CodePoint & 0x3F)));
+            }
+            else if (CodePoint < 0x10000)
+            {
+                Result.push_back(static_cast<char>(0xE0 | (CodePoint >> 12)));
+                Result.push_back(static_cast<char>(
+                    0x80 | ((CodePoint >> 6) & 0x3F)));
+                Result.push_back(static_cast<char>(0x80 | (CodePoint & 0x3F)));
+            }
+            else
+            {
+                Result.push_back(static_cast<char>(0xF0 | (CodePoint >> 18)));
+                Result.push_back(static_cast<char>(
+                    0x80 | ((CodePoint >> 12) & 0x3F)));
+                Result.push_back(static_cast<char>(
+                    0x80 | ((CodePoint >> 6) & 0x3F)));
+                Result.push_back(static_cast<char>(0x80 | (CodePoint & 0x3F)));
+            }
+        }
+        return Result;
+    }
+
+    std::vector<std::uint8_t> Utf8ToUtf16(
+        std::string const& Source,
+        bool BigEndian)
+    {
+        std::vector<std::uint8_t> Result;
+        auto Append = [&](std::uint32_t Value)
+        {
+            std::uint8_t Buffer[2];
+            if (BigEndian)
+            {
+                ::StoreBE16(Buffer, static_cast<std::uint16_t>(Value));
+            }
+            else
+            {
+                ::StoreLE16(Buffer, static_cast<std::uint16_t>(Value));
+            }
+            Result.insert(Result.end(), Buffer, Buffer + 2);
+        };
+
+        for (std::size_t i = 0; i < Source.size();)
+        {
+            std::uint8_t Lead = static_cast<std::uint8_t>(Source[i]);
+            std::size_t Length = 1;
+            std::uint32_t CodePoint = Lead;
+            if (Lead >= 0xF0)
+            {
+                Length = 4;
+                CodePoint = Lead & 0x07;
+            }
+            else if (Lead >= 0xE0)
+            {
+                Length = 3;
+                CodePoint = Lead & 0x0F;
+            }
+            else if (Lead >= 0xC0)
+            {
+                Length = 2;
+                CodePoint = Lead & 0x1F;
+            }
+            for (std::size_t j = 1; j < Length && i + j < Source.size(); ++j)
+            {
+                CodePoint = (CodePoint << 6) |
+                    (static_cast<std::uint8_t>(Source[i + j]) & 0x3F);
+            }
+            i += Length;
+
+            if (CodePoint >= 0x10000)
+            {
+                CodePoint -= 0x10000;
+                Append(0xD800 + (CodePoint >> 10));
+                Append(0xDC00 + (CodePoint & 0x3FF));
+            }
+            else
+            {
+                Append(CodePoint);
+            }
+        }
+        return Result;
+    }
+
+#ifdef _WIN32
+    std::wstring ToWidePath(
+        std::string const& Path)
+    {
+        std::wstring Result;
+        int Length = ::MultiByteToWideChar(
+            CP_UTF8,
+            0,
+            Path.c_str(),
+            static_cast<int>(Path.size()),
+            nullptr,
+            0);
+        if (Length > 0)
+        {
+            Result.resize(Length);
+            ::MultiByteToWideChar(
+                CP_UTF8,
+                0,
+                Path.c_str(),
+                static_cast<int>(Path.size()),
+                &Result[0],
+                Length);
+        }
+        return Result;
+    }
+
+    std::string FromWidePath(
+        std::wstring const& Path)
+    {
+        std::string Result;
+        int Length = ::WideCharToMultiByte(
+            CP_UTF8,
+            0,
+            Path.c_str(),
+            static_cast<int>(Path.size()),
+            nullptr,
+            0,
+            nullptr,
+            nullptr);
+        if (Length > 0)
+        {
+            Result.resize(Length);
+            ::WideCharToMultiByte(
+                CP_UTF8,
+                0,
+                Path.c_str(),
+                static_cast<int>(Path.size()),
+                &Result[0],
+                Length,
+                nullptr,
+                nullptr);
+        }
+        return Result;
+    }
+
+    [[noreturn]] void ThrowSystemError(
+        char const* Operation)
+    {
+        throw std::system_error(
+            static_cast<int>(::GetLastError()),
+            std::system_category(),
+            std::string(Operation) + " failed");
+    }
+
+    // SetFileValidData needs the privilege enabled in the token, and it is
+    // only held by the administrators by default.
+    void EnableManageVolumePrivilege()
+    {
+        HANDLE TokenHandle = nullptr;
+        if (!::OpenProcessToken(
+            ::GetCurrentProcess(),
+            TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY,
+            &TokenHandle))
+        {
+            ::ThrowSystemError("OpenProcessToken");
+        }
+
+        TOKEN_PRIVILEGES Privileges;
+        Privileges.PrivilegeCount = 1;
+        Privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        bool Succeeded = ::LookupPrivilegeValueW(
+            nullptr,
+            SE_MANAGE_VOLUME_NAME,
+            &Privileges.Privileges[0].Luid) &&
+            ::AdjustTokenPrivileges(
+                TokenHandle,
+                FALSE,
+                &Privileges,
+                sizeof(Privileges),
+                nullptr,
+                nullptr) &&
+            ERROR_SUCCESS == ::GetLastError();
+        DWORD Error = ::GetLastError();
+        ::CloseHandle(TokenHandle);
+        if (!Succeeded)
+        {
+            ::SetLastError(Error);
+            ::ThrowSystemError("Enabling SeManageVolumePrivilege");
+        }
+    }
+
+    const char g_PathSeparator = '\\';
+#else
+    [[noreturn]] void ThrowSystemError(
+        char const* Operation)
+    {
+        throw std::system_error(
+            errno,
+            std::generic_category(),
+            std::string(Operation) + " failed");
+    }
+
+    const char g_PathSeparator = '/';
+#endif
+
+    bool IsPathSeparator(
+        char Value)
+    {
+        return '\\' == Value || '/' == Value;
+    }
+
+    bool FileExists(
+        std::string const& Path)
+    {
+#ifdef _WIN32
+        DWORD Attributes = ::GetFileAttributesW(::ToWidePath(Path).c_str());
+        return INVALID_FILE_ATTRIBUTES != Attributes &&
+            !(Attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+        struct stat Status;
+        return 0 == ::stat(Path.c_str(), &Status) && S_ISREG(Status.st_mode);
+#endif
+    }
+
+    std::string GetFullPath(
+        std::string const& Path)
+    {
+#ifdef _WIN32
+        std::wstring WidePath = ::ToWidePath(Path);
+        DWORD Length = ::GetFullPathNameW(
+            WidePath.c_str(),
+            0,
+            nullptr,
+            nullptr);
+        if (!Length)
+        {
+            ::ThrowSystemError("GetFullPathNameW");
+        }
+        std::wstring Result(Length, L'\0');
+        Length = ::GetFullPathNameW(
+            WidePath.c_str(),
+            Length,
+            &Result[0],
+            nullptr);
+        Result.resize(Length);
+        return ::FromWidePath(Result);
+#else
+        char Buffer[PATH_MAX];
+        if (!::realpath(Path.c_str(), Buffer))
+        {
+            ::ThrowSystemError("realpath");
+        }
+        return Buffer;
+#endif
+    }
+
+    std::string GetDirectory(
+        std::string const& Path)
+    {
+        for (std::size_t i = Path.size(); i > 0; --i)
+        {
+            if (::IsPathSeparator(Path[i - 1]))
+            {
+                return Path.substr(0, i - 1);
+            }
+        }
+        return ".";
+    }
+
+    std::string ToNativeSeparators(
+        std::string Path)
+    {
+        for (char& Character : Path)
+        {
+            if (::IsPathSeparator(Character))
+            {
+                Character = g_PathSeparator;
+            }
+        }
+        return Path;
+    }
+
+    std::vector<std::string> SplitPath(
+        std::string const& Path)
+    {
+        std::vector<std::string> Result;
+        std::string Current;
+        for (char Character : Path)
+        {
+            if (::IsPathSeparator(Character))
+            {
+                if (!Current.empty())
+                {
+                    Result.push_back(Current);
+                    Current.clear();
+                }
+            }
+            else
+            {
+                Current.push_back(Character);
+            }
+        }
+        if (!Current.empty())
+        {
+            Result.push_back(Current);
+        }
+        return Result;
+    }
+
+    bool IsSamePathComponent(
+        std::string const& Left,
+        std::string const& Right)
+    {
+#ifdef _WIN32
+        return 0 == ::_stricmp(Left.c_str(), Right.c_str());
+#else
+        return Left == Right;
+#endif
+    }
+
+    // The relative path of Target from the folder of Source in the Windows
+    // style used by the parent locators, or an empty string if they are on the
+    // different volumes. Both of them should be the full paths.
+    std::string GetRelativePath(
+        std::string const& Source,
+        std::string const& Target)
+    {
+        std::vector<std::string> From = ::SplitPath(::GetDirectory(Source));
+        std::vector<std::string> To = ::SplitPath(Target);
+        if (To.empty())
+        {
+            return std::string();
+        }
+#ifdef _WIN32
+        if (From.empty() || !::IsSamePathComponent(From[0], To[0]))
+        {
+            return std::string();
+        }
+#endif
+
+        std::size_t Common = 0;
+        while (Common < From.size() &&
+            Common + 1 < To.size() &&
+            ::IsSamePathComponent(From[Common], To[Common]))
+        {
+            ++Common;
+        }
+
+        std::string Result = (Common == From.size()) ? ".\\" : "";
+        for (std::size_t i = Common; i < From.size(); ++i)
+        {
+            Result.append("..\\");
+        }
+        for (std::size_t i = Common; i < To.size(); ++i)
+        {
+            Result.append(To[i]);
+            if (i + 1 < To.size())
+            {
+                Result.push_back('\\');
+            }
+        }
+        return Result;
+    }
+
+    // The region table and metadata item IDs of VHDX.
+
+    const NanaBox::VirtualDiskGuid g_BatRegionGuid = ::MakeGuid(
+        0x2DC27766, 0xF623, 0x4200, 0x9D64115E9BFD4A08);
+    const NanaBox::VirtualDiskGuid g_MetadataRegionGuid = ::MakeGuid(
+        0x8B7CA206, 0x4790, 0x4B9A, 0xB8FE575F050F886E);
+    const NanaBox::VirtualDiskGuid g_FileParametersGuid = ::MakeGuid(
+        0xCAA16737, 0xFA36, 0x4D43, 0xB3B633F0AA44E76B);
+    const NanaBox::VirtualDiskGuid g_VirtualDiskSizeGuid = ::MakeGuid(
+        0x2FA54224, 0xCD1B, 0x4876, 0xB2115DBED83BF4B8);
+    const NanaBox::VirtualDiskGuid g_VirtualDiskIdGuid = ::MakeGuid(
+        0xBECA12AB, 0xB2E6, 0x4523, 0x93EFC309E000C746);
+    const NanaBox::VirtualDiskGuid g_LogicalSectorSizeGuid = ::MakeGuid(
+        0x8141BF1D, 0xA96F, 0x4709, 0xBA47F233A8FAAB5F);
+    const NanaBox::VirtualDiskGuid g_PhysicalSectorSizeGuid = ::MakeGuid(
+        0xCDA348C7, 0x445D, 0x4471, 0x9CC9E9885251C556);
+    const NanaBox::VirtualDiskGuid g_ParentLocatorGuid = ::MakeGuid(
+        0xA8D35F2D, 0xB30B, 0x454D, 0xABF7D3D84834AB0C);
+    const NanaBox::VirtualDiskGuid g_ParentLocatorTypeGuid = ::MakeGuid(
+        0xB04AEFB7, 0xD19E, 0x4A81, 0xB78925B8E9445913);
+
+    const std::uint64_t VhdxHeaderOffsets[] = { 64 * KiB, 128 * KiB };
+    const std::uint64_t VhdxRegionTableOffsets[] = { 192 * KiB, 256 * KiB };
+    const std::size_t VhdxHeaderSize = 4 * KiB;
+    const std::size_t VhdxRegionTableSize = 64 * KiB;
+    const std::size_t VhdxLogSectorSize = 4 * KiB;
+    const std::uint32_t VhdxMaximumBlockSize = 256 * MiB;
+    const std::uint64_t VhdxMaximumVirtualSize = 64 * TiB;
+    const std::uint64_t VhdxSectorBitmapBlockSize = 1 * MiB;
+    const std::uint64_t VhdxSectorsPerChunk = std::uint64_t(1) << 23;
+    const std::uint32_t VhdxDefaultBlockSize = 32 * MiB;
+
+    const std::uint32_t VhdxHeaderSignature = 0x64616568; // "head"
+    const std::uint32_t VhdxRegionTableSignature = 0x69676572; // "regi"
+    const std::uint32_t VhdxLogEntrySignature = 0x65676F6C; // "loge"
+    const std::uint32_t VhdxZeroDescriptorSignature = 0x6F72657A; // "zero"
+    const std::uint32_t VhdxDataDescriptorSignature = 0x63736564; // "desc"
+    const std::uint32_t VhdxDataSectorSignature = 0x61746164; // "data"
+
+    const std::uint64_t VhdxBatStateMask = 0x7;
+    const std::uint64_t VhdxBatFileOffsetMask = ~(MiB - 1);
+    const std::uint64_t VhdxSectorBitmapPresent = 6;
+
+    const std::uint32_t VhdxMetadataIsVirtualDisk = 0x2;
+    const std::uint32_t VhdxMetadataIsRequired = 0x4;
+
+    const std::uint32_t VhdxFileParametersLeaveBlockAllocated = 0x1;
+    const std::uint32_t VhdxFileParametersHasParent = 0x2;
+
+    struct VhdxHeader
+    {
+        std::uint64_t SequenceNumber = 0;
+        NanaBox::VirtualDiskGuid FileWriteGuid;
+        NanaBox::VirtualDiskGuid DataWriteGuid;
+        NanaBox::VirtualDiskGuid LogGuid;
+        std::uint16_t LogVersion = 0;
+        std::uint16_t Version = 1;
+        std::uint32_t LogLength = 0;
+        std::uint64_t LogOffset = 0;
+    };
+
+    bool ParseVhdxHeader(
+        std::uint8_t const* Buffer,
+        VhdxHeader& Header)
+    {
+        if (VhdxHeaderSignature != ::LoadLE32(Buffer) ||
+            ::LoadLE32(Buffer + 4) != ::ComputeCrc32c(
+                Buffer,
+                VhdxHeaderSize,
+                4))
+        {
+            return false;
+        }
+
+        Header.SequenceNumber = ::LoadLE64(Buffer + 8);
+        Header.FileWriteGuid = ::LoadGuid(Buffer + 16);
+        Header.DataWriteGuid = ::LoadGuid(Buffer + 32);
+        Header.LogGuid = ::LoadGuid(Buffer + 48);
+        Header.LogVersion = ::LoadLE16(Buffer + 64);
+        Header.Version = ::LoadLE16(Buffer + 66);
+        Header.LogLength = ::LoadLE32(Buffer + 68);
+        Header.LogOffset = ::LoadLE64(Buffer + 72);
+        return 1 == Header.Version;
+    }
+
+    void SerializeVhdxHeader(
+        VhdxHeader const& Header,
+        std::uint8_t* Buffer)
+    {
+        std::memset(Buffer, 0, VhdxHeaderSize);
+        ::StoreLE32(Buffer, VhdxHeaderSignature);
+        ::StoreLE64(Buffer + 8, Header.SequenceNumber);
+        std::memcpy(Buffer + 16, Header.FileWriteGuid.Bytes, 16);
+        std::memcpy(Buffer + 32, Header.DataWriteGuid.Bytes, 16);
+        std::memcpy(Buffer + 48, Header.LogGuid.Bytes, 16);
+        ::StoreLE16(Buffer + 64, Header.LogVersion);
+        ::StoreLE16(Buffer + 66, Header.Version);
+        ::StoreLE32(Buffer + 68, Header.LogLength);
+        ::StoreLE64(Buffer + 72, Header.LogOffset);
+        ::StoreLE32(Buffer + 4, ::ComputeCrc32c(Buffer, VhdxHeaderSize, 4));
+    }
+
+    class VhdxImage : public NanaBox::VirtualDiskImage
+    {
+    public:
+
+        VhdxImage(
+            std::string const& Path,
+            bool Writable,
+            bool Unbuffered);
+
+        NanaBox::VirtualDiskBlockState GetBlockState(
+            std::uint64_t BlockIndex) const override;
+
+        std::uint64_t GetBlockFileOffset(
+            std::uint64_t BlockIndex) const override;
+
+        void GetBlockSectorBitmap(
+            std::uint64_t BlockIndex,
+            std::vector<std::uint8_t>& Bitmap) const override;
+
+        std::vector<std::pair<std::uint64_t, std::uint64_t>>
+            GetMetadataFileRanges() const override;
+
+        void SetBlockAllocation(
+            std::uint64_t BlockIndex,
+            NanaBox::VirtualDiskBlockState State,
+            std::uint64_t FileOffset) override;
+
+        void Resize(
+            std::uint64_t VirtualSize,
+            NanaBox::VirtualDiskProgressHandler const& ProgressHandler)
+            override;
+
+        void Flush() override;
+
+    protected:
+
+        void ReadBlock(
+            std::uint64_t BlockIndex,
+            std::uint32_t BlockOffset,
+            std::uint8_t* Buffer,
+            std::size_t Size) const override;
+
+        void WriteBlock(
+            std::uint64_t BlockIndex,
+            std::uint32_t BlockOffset,
+            std::uint8_t const* Buffer,
+            std::size_t Size) override;
+
+    private:
+
+        void LoadHeaders();
+
+        void ReplayLog();
+
+        void LoadRegionTable();
+
+        void LoadMetadata();
+
+        // Writes both region tables with the new location of the BAT.
+        void WriteBatRegion(
+            std::uint64_t Offset,
+            std::uint32_t Length);
+
+        // Writes the header to the slot of the older one and makes it the
+        // current header.
+        void WriteHeader();
+
+        // Updates the FileWriteGuid and also the DataWriteGuid if the content
+        // of the virtual disk is changed before the first modification after
+        // opening, which is required by the specification.
+        void BeginWrite(
+            bool DataChanged);
+
+        std::uint64_t GetBatEntry(
+            std::uint64_t EntryIndex) const;
+
+        void SetBatEntry(
+            std::uint64_t EntryIndex,
+            std::uint64_t Value);
+
+        std::uint64_t GetPayloadEntryIndex(
+            std::uint64_t BlockIndex) const;
+
+        std::uint64_t GetSectorBitmapEntryIndex(
+            std::uint64_t BlockIndex) const;
+
+        std::uint64_t GetSectorBitmapFileOffset(
+            std::uint64_t BlockIndex) const;
+
+        // Appends the 1 MiB aligned space to the end of the file.
+        std::uint64_t AllocateSpace(
+            std::uint64_t Size);
+
+        VhdxHeader m_Header;
+        std::size_t m_CurrentHeaderIndex = 0;
+        std::uint64_t m_BatOffset = 0;
+        std::uint32_t m_BatLength = 0;
+        std::uint64_t m_MetadataOffset = 0;
+        std::uint32_t m_MetadataLength = 0;
+        std::uint64_t m_ChunkRatio = 0;
+        std::uint64_t m_BatEntryCount = 0;
+        NanaBox::VirtualDiskMapping m_BatMapping;
+        NanaBox::VirtualDiskMapping m_MetadataMapping;
+        bool m_FileWriteGuidUpdated = false;
+        bool m_DataWriteGuidUpdated = false;
+    };
+
+    bool IsBitmapBitSet(
+        std::vector<std::uint8_t> const& Bitmap,
+        std::uint64_t Index)
+    {
+        return Bitmap[Index / 8] & (1 << (Index % 8));
+    }
+
+    // Splits the range of the block into the runs of the sectors which are
+    // present or not present in the sector bitmap.
+    template<typename Callback>
+    void EnumerateSectorRuns(
+        std::vector<std::uint8_t> const& Bitmap,
+        std::uint32_t SectorSize,
+        std::uint32_t BlockOffset,
+        std::size_t Size,
+        Callback const& Handler)
+    {
+        std::uint64_t End = static_cast<std::uint64_t>(BlockOffset) + Size;
+        std::uint64_t Current = BlockOffset;
+        while (Current < End)
+        {
+            bool Present = ::IsBitmapBitSet(Bitmap, Current / SectorSize);
+            std::uint64_t RunEnd = (Current / SectorSize + 1) * SectorSize;
+            while (RunEnd < End &&
+                Present == ::IsBitmapBitSet(Bitmap, RunEnd / SectorSize))
+            {
+                RunEnd += SectorSize;
+            }
+            RunEnd = std::min(RunEnd, End);
+            Handler(
+                Present,
+                static_cast<std::uint32_t>(Current),
+                static_cast<std::size_t>(RunEnd - Current),
+                static_cast<std::size_t>(Current - BlockOffset));
+            Current = RunEnd;
+        }
+    }
+
+    VhdxImage::VhdxImage(
+        std::string const& Path,
+        bool Writable,
+        bool Unbuffered) :
+        NanaBox::VirtualDiskImage(Path, Writable, Unbuffered)
+    {
+        this->m_Information.Format = NanaBox::VirtualDiskFormat::Vhdx;
+
+        this->LoadHeaders();
+        if (!this->m_Header.LogGuid.IsNull())
+        {
+            if (!Writable)
+            {
+                ::ThrowFormatError(
+                    Path,
+                    "The log needs to be replayed, which requires write "
+                    "access to the image");
+            }
+            this->ReplayLog();
+        }
+        this->LoadRegionTable();
+        this->LoadMetadata();
+
+        this->m_BatMapping = NanaBox::VirtualDiskMapping(
+            this->m_File,
+            this->m_BatOffset,
+            static_cast<std::size_t>(this->m_BatEntryCount * 8),
+            Writable);
+    }
+
+    NanaBox::VirtualDiskBlockState VhdxImage::GetBlockState(
+        std::uint64_t BlockIndex) const
+    {
+        return static_cast<NanaBox::VirtualDiskBlockState>(
+            this->GetBatEntry(this->GetPayloadEntryIndex(BlockIndex)) &
+            VhdxBatStateMask);
+    }
+
+    std::uint64_t VhdxImage::GetBlockFileOffset(
+        std::uint64_t BlockIndex) const
+    {
+        std::uint64_t Entry = this->GetBatEntry(
+            this->GetPayloadEntryIndex(BlockIndex));
+        switch (static_cast<NanaBox::VirtualDiskBlockState>(
+            Entry & VhdxBatStateMask))
+        {
+        case NanaBox::VirtualDiskBlockState::FullyPresent:
+        case NanaBox::VirtualDiskBlockState::PartiallyPresent:
+            return Entry & VhdxBatFileOffsetMask;
+        default:
+            return 0;
+        }
+    }
+
+    void VhdxImage::GetBlockSectorBitmap(
+        std::uint64_t BlockIndex,
+        std::vector<std::uint8_t>& Bitmap) const
+    {
+        std::size_t BitmapSize = this->m_Information.BlockSize /
+            this->m_Information.LogicalSectorSize / 8;
+        Bitmap.assign(BitmapSize, 0);
+
+        switch (this->GetBlockState(BlockIndex))
+        {
+        case NanaBox::VirtualDiskBlockState::FullyPresent:
+        {
+            std::fill(Bitmap.begin(), Bitmap.end(), 0xFF);
+            break;
+        }
+        case NanaBox::VirtualDiskBlockState::PartiallyPresent:
+        {
+            std::uint64_t Offset = this->GetSectorBitmapFileOffset(BlockIndex);
+            if (Offset)
+            {
+                this->m_File.Read(Offset, Bitmap.data(), Bitmap.size());
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    std::vector<std::pair<std::uint64_t, std::uint64_t>>
+        VhdxImage::GetMetadataFileRanges() const
+    {
+        // The headers and the region tables are in the first 1 MiB.
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> Result;
+        Result.emplace_back(0, MiB);
+        Result.emplace_back(this->m_Header.LogOffset, this->m_Header.LogLength);
+        Result.emplace_back(this->m_BatOffset, this->m_BatLength);
+        Result.emplace_back(this->m_MetadataOffset, this->m_MetadataLength);
+        if (NanaBox::VirtualDiskType::Differencing == this->m_Information.Type)
+        {
+            for (std::uint64_t i = this->m_ChunkRatio;
+                i < this->m_BatEntryCount;
+                i += this->m_ChunkRatio + 1)
+            {
+                std::uint64_t Entry = this->GetBatEntry(i);
+                if (VhdxSectorBitmapPresent == (Entry & VhdxBatStateMask))
+                {
+                    Result.emplace_back(
+                        Entry & VhdxBatFileOffsetMask,
+                        VhdxSectorBitmapBlockSize);
+                }
+            }
+        }
+        return Result;
+    }
+
+    void VhdxImage::SetBlockAllocation(
+        std::uint64_t BlockIndex,
+        NanaBox::VirtualDiskBlockState State,
+        std::uint64_t FileOffset)
+    {
+        std::uint64_t EntryIndex = this->GetPayloadEntryIndex(BlockIndex);
+        bool HasPayload =
+            NanaBox::VirtualDiskBlockState::FullyPresent == State ||
+            NanaBox::VirtualDiskBlockState::PartiallyPresent == State;
+        if (HasPayload && (!FileOffset || FileOffset % MiB))
+        {
+            throw std::invalid_argument("The file offset is not aligned");
+        }
+        if (NanaBox::VirtualDiskBlockState::PartiallyPresent == State &&
+            !this->GetSectorBitmapFileOffset(BlockIndex))
+        {
+            throw std::invalid_argument(
+                "The partially present block has no sector bitmap");
+        }
+
+        // The content of the virtual disk is kept, so the children of this
+        // disk are still valid.
+        this->BeginWrite(false);
+        this->SetBatEntry(
+            EntryIndex,
+            (HasPayload ? FileOffset : 0) | static_cast<std::uint64_t>(State));
+    }
+
+    void VhdxImage::Resize(
+        std::uint64_t VirtualSize,
+        NanaBox::VirtualDiskProgressHandler const& ProgressHandler)
+    {
+        NanaBox::VirtualDiskInformation& Information = this->m_Information;
+        if (NanaBox::VirtualDiskType::Differencing == Information.Type)
+        {
+            ::ThrowFormatError(
+                this->m_Path,
+                "The differencing disks use the size of the parent");
+        }
+        if (VirtualSize < Information.VirtualSize)
+        {
+            ::ThrowFormatError(this->m_Path, "Shrinking is not supported");
+        }
+        if (VirtualSize > VhdxMaximumVirtualSize ||
+            VirtualSize % Information.LogicalSectorSize)
+        {
+            ::ThrowFormatError(this->m_Path, "Invalid virtual size");
+        }
+        if (VirtualSize == Information.VirtualSize)
+        {
+            return;
+        }
+
+        this->BeginWrite(true);
+
+        std::uint64_t BlockCount =
+            (VirtualSize + Information.BlockSize - 1) / Information.BlockSize;
+        std::uint64_t BatEntryCount =
+            BlockCount + (BlockCount - 1) / this->m_ChunkRatio;
+
+        // The old BAT region becomes the free space, which can be reused by
+        // the compaction.
+        if (BatEntryCount * 8 > this->m_BatLength)
+        {
+            std::uint64_t BatLength = ::RoundUp(BatEntryCount * 8, MiB);
+            std::uint64_t BatOffset = this->AllocateSpace(BatLength);
+            this->m_BatMapping.Flush();
+            this->m_File.Write(
+                BatOffset,
+                this->m_BatMapping.GetData(),
+                static_cast<std::size_t>(this->m_BatEntryCount * 8));
+            this->m_File.Flush();
+            this->WriteBatRegion(
+                BatOffset,
+                static_cast<std::uint32_t>(BatLength));
+        }
+
+        this->m_BatMapping = NanaBox::VirtualDiskMapping(
+            this->m_File,
+            this->m_BatOffset,
+            static_cast<std::size_t>(BatEntryCount * 8),
+            true);
+        for (std::uint64_t i = this->m_BatEntryCount; i < BatEntryCount; ++i)
+        {
+            this->SetBatEntry(i, 0);
+        }
+
+        if (NanaBox::VirtualDiskType::Fixed == Information.Type)
+        {
+            std::uint64_t NewBlockCount = BlockCount - Information.BlockCount;
+            std::uint64_t PayloadOffset =
+                ::RoundUp(this->m_File.GetSize(), MiB);
+            this->m_File.Allocate(
+                PayloadOffset + NewBlockCount * Information.BlockSize,
+                false,
+                ProgressHandler);
+            for (std::uint64_t i = 0; i < NewBlockCount; ++i)
+            {
+                std::uint64_t BlockIndex = Information.BlockCount + i;
+                this->SetBatEntry(
+                    BlockIndex + BlockIndex / this->m_ChunkRatio,
+                    (PayloadOffset + i * Information.BlockSize) |
+                    static_cast<std::uint64_t>(
+                        NanaBox::VirtualDiskBlockState::FullyPresent));
+            }
+        }
+        this->Flush();
+
+        std::uint8_t const* Region = this->m_MetadataMapping.GetData();
+        std::uint16_t EntryCount = ::LoadLE16(Region + 10);
+        for (std::uint16_t i = 0; i < EntryCount; ++i)
+        {
+            std::uint8_t const* Entry = Region + 32 + 32 * i;
+            if (g_VirtualDiskSizeGuid == ::LoadGuid(Entry))
+            {
+                std::uint8_t Item[8];
+                ::StoreLE64(Item, VirtualSize);
+                this->m_File.Write(
+                    this->m_MetadataOffset + ::LoadLE32(Entry + 16),
+                    Item,
+                    sizeof(Item));
+                break;
+            }
+        }
+        this->m_File.Flush();
+
+        // Maps the metadata again, so the view is not stale on the platforms
+        // without the coherent mappings.
+        this->m_MetadataMapping = NanaBox::VirtualDiskMapping(
+            this->m_File,
+            this->m_MetadataOffset,
+            this->m_MetadataLength,
+            false);
+        Information.VirtualSize = VirtualSize;
+        Information.BlockCount = BlockCount;
+        this->m_BatEntryCount = BatEntryCount;
+    }
+
+    void VhdxImage::Flush()
+    {
+        this->m_BatMapping.Flush();
+        this->m_File.Flush();
+    }
+
+    void VhdxImage::ReadBlock(
+        std::uint64_t BlockIndex,
+        std::uint32_t BlockOffset,
+        std::uint8_t* Buffer,
+        std::size_t Size) const
+    {
+        std::uint64_t BlockStart =
+            BlockIndex * this->m_Information.BlockSize;
+        std::uint64_t Entry = this->GetBatEntry(
+            this->GetPayloadEntryIndex(BlockIndex));
+        std::uint64_t FileOffset = Entry & VhdxBatFileOffsetMask;
+
+        switch (static_cast<NanaBox::VirtualDiskBlockState>(
+            Entry & VhdxBatStateMask))
+        {
+        case NanaBox::VirtualDiskBlockState::FullyPresent:
+        {
+            this->m_File.Read(FileOffset + BlockOffset, Buffer, Size);
+            break;
+        }
+        case NanaBox::VirtualDiskBlockState::PartiallyPresent:
+        {
+            std::vector<std::uint8_t> Bitmap;
+            this->GetBlockSectorBitmap(BlockIndex, Bitmap);
+            ::EnumerateSectorRuns(
+                Bitmap,
+                this->m_Information.LogicalSectorSize,
+                BlockOffset,
+                Size,
+                [&](
+                    bool Present,
+                    std::uint32_t RunOffset,
+                    std::size_t RunSize,
+                    std::size_t BufferOffset)
+            {
+                if (Present)
+                {
+                    this->m_File.Read(
+                        FileOffset + RunOffset,
+                        Buffer + BufferOffset,
+                        RunSize);
+                }
+                else
+                {
+                    this->ReadFromParent(
+                        BlockStart + RunOffset,
+                        Buffer + BufferOffset,
+                        RunSize);
+                }
+            });
+            break;
+        }
+        case NanaBox::VirtualDiskBlockState::NotPresent:
+        {
+            this->ReadFromParent(BlockStart + BlockOffset, Buffer, Size);
+            break;
+        }
+        default:
+        {
+            std::memset(Buffer, 0, Size);
+            break;
+        }
+        }
+    }
+
+    void VhdxImage::WriteBlock(
+        std::uint64_t BlockIndex,
+        std::uint32_t BlockOffset,
+        std::uint8_t const* Buffer,
+        std::size_t Size)
+    {
+        this->BeginWrite(true);
+
+        std::uint64_t PayloadEntryIndex =
+            this->GetPayloadEntryIndex(BlockIndex);
+        std::uint64_t Entry = this->GetBatEntry(PayloadEntryIndex);
+        NanaBox::VirtualDiskBlockState State =
+            static_cast<NanaBox::VirtualDiskBlockState>(
+                Entry & VhdxBatStateMask);
+
+        bool NeedSectorBitmap = false;
+        if (NanaBox::VirtualDiskBlockState::FullyPresent == State)
+        {
+            this->m_File.Write(
+                (Entry & VhdxBatFileOffsetMask) + BlockOffset,
+                Buffer,
+                Size);
+            return;
+        }
+        else if (NanaBox::VirtualDiskBlockState::PartiallyPresent == State)
+        {
+            this->m_File.Write(
+                (Entry & VhdxBatFileOffsetMask) + BlockOffset,
+                Buffer,
+                Size);
+            NeedSectorBitmap = true;
+        }
+        else
+        {
+            // The new blocks are appended to the end of the file, so the rest
+            // of the block reads as zero. If the block is in the parent, the
+            // sector bitmap is used to keep reading the rest from the parent
+            // instead of copying it.
+            bool Differencing = NanaBox::VirtualDiskBlockState::NotPresent ==
+                State && NanaBox::VirtualDiskType::Differencing ==
+                this->m_Information.Type;
+            if (Differencing)
+            {
+                std::uint64_t BitmapEntryIndex =
+                    this->GetSectorBitmapEntryIndex(BlockIndex);
+                if (VhdxSectorBitmapPresent !=
+                    (this->GetBatEntry(BitmapEntryIndex) & VhdxBatStateMask))
+                {
+                    this->SetBatEntry(
+                        BitmapEntryIndex,
+                        this->AllocateSpace(VhdxSectorBitmapBlockSize) |
+                        VhdxSectorBitmapPresent);
+                }
+            }
+
+            std::uint64_t FileOffset = this->AllocateSpace(
+                this->m_Information.BlockSize);
+            this->m_File.Write(FileOffset + BlockOffset, Buffer, Size);
+            State = Differencing
+                ? NanaBox::VirtualDiskBlockState::PartiallyPresent
+                : NanaBox::VirtualDiskBlockState::FullyPresent;
+            Entry = FileOffset | static_cast<std::uint64_t>(State);
+            NeedSectorBitmap = Differencing;
+        }
+
+        if (NeedSectorBitmap)
+        {
+            std::uint64_t BitmapOffset =
+                this->GetSectorBitmapFileOffset(BlockIndex);
+            if (!BitmapOffset)
+            {
+                ::ThrowFormatError(
+                    this->m_Path,
+                    "The sector bitmap of a partially present block is "
+                    "missing");
+            }
+
+            std::uint32_t SectorSize = this->m_Information.LogicalSectorSize;
+            std::uint64_t FirstSector = BlockOffset / SectorSize;
+            std::uint64_t LastSector = FirstSector + Size / SectorSize - 1;
+            std::vector<std::uint8_t> Bitmap(
+                static_cast<std::size_t>(LastSector / 8 - FirstSector / 8 + 1));
+            this->m_File.Read(
+                BitmapOffset + FirstSector / 8,
+                Bitmap.data(),
+                Bitmap.size());
+            for (std::uint64_t i = FirstSector; i <= LastSector; ++i)
+            {
+                std::uint64_t Index = i - FirstSector / 8 * 8;
+                Bitmap[Index / 8] |= static_cast<std::uint8_t>(
+                    1 << (Index % 8));
+            }
+            this->m_File.Write(
+                BitmapOffset + FirstSector / 8,
+                Bitmap.data(),
+                Bitmap.size());
+        }
+
+        this->SetBatEntry(PayloadEntryIndex, Entry);
+    }
+
+    void VhdxImage::LoadHeaders()
+    {
+        std::uint8_t Identifier[8];
+        this->m_File.Read(0, Identifier, sizeof(Identifier));
+        if (0 != std::memcmp(Identifier, "vhdxfile", sizeof(Identifier)))
+        {
+            ::ThrowFormatError(this->m_Path, "Not a VHDX file");
+        }
+
+        std::vector<std::uint8_t> Buffer(VhdxHeaderSize);
+        bool Found = false;
+        for (std::size_t i = 0; i < 2; ++i)
+        {
+            this->m_File.Read(
+                VhdxHeaderOffsets[i],
+                Buffer.data(),
+                Buffer.size());
+            VhdxHeader Current;
+            if (::ParseVhdxHeader(Buffer.data(), Current) &&
+                (!Found ||
+                    Current.SequenceNumber > this->m_Header.SequenceNumber))
+            {
+                this->m_Header = Current;
+                this->m_CurrentHeaderIndex = i;
+                Found = true;
+            }
+        }
+        if (!Found)
+        {
+            ::ThrowFormatError(this->m_Path, "No valid VHDX header");
+        }
+
+        if (this->m_Header.LogOffset % MiB ||
+            this->m_Header.LogLength % MiB ||
+            this->m_Header.LogOffset + this->m_Header.LogLength >
+            this->m_File.GetSize())
+        {
+            ::ThrowFormatError(this->m_Path, "Invalid log location");
+        }
+
+        this->m_Information.DataWriteGuid = this->m_Header.DataWriteGuid;
+    }
+
+    void VhdxImage::ReplayLog()
+    {
+        struct LogEntry
+        {
+            std::uint64_t SequenceNumber;
+            std::uint32_t Length;
+            std::uint32_t Tail;
+            std::uint64_t FlushedFileOffset;
+            std::uint64_t LastFileOffset;
+        };
+
+        std::uint32_t LogLength = this->m_Header.LogLength;
+        std::vector<std::uint8_t> Log(LogLength);
+        this->m_File.Read(this->m_Header.LogOffset, Log.data(), Log.size());
+
+        // The log is circular, so an entry may wrap around the end.
+        auto ReadLog = [&](
+            std::uint32_t Offset,
+            std::uint32_t Size)
+        {
+            std::vector<std::uint8_t> Result(Size);
+            for (std::uint32_t i = 0; i < Size; ++i)
+            {
+                Result[i] = Log[(Offset + i) % LogLength];
+            }
+            return Result;
+        };
+
+        std::map<std::uint32_t, LogEntry> Entries;
+        for (std::uint32_t Offset = 0;
+            Offset < LogLength;
+            Offset += VhdxLogSectorSize)
+        {
+            std::vector<std::uint8_t> Header = ReadLog(Offset, 64);
+            std::uint32_t EntryLength = ::LoadLE32(&Header[8]);
+            std::uint32_t Tail = ::LoadLE32(&Header[12]);
+            std::uint64_t SequenceNumber = ::LoadLE64(&Header[16]);
+            std::uint32_t DescriptorCount = ::LoadLE32(&Header[24]);
+            std::uint64_t DescriptorAreaSize = ::RoundUp(
+                64 + 32 * static_cast<std::uint64_t>(DescriptorCount),
+                VhdxLogSectorSize);
+            if (VhdxLogEntrySignature != ::LoadLE32(&Header[0]) ||
+                !EntryLength ||
+                EntryLength % VhdxLogSectorSize ||
+                EntryLength > LogLength ||
+                Tail % VhdxLogSectorSize ||
+                Tail >= LogLength ||
+                DescriptorAreaSize > EntryLength ||
+                ::LoadGuid(&Header[32]) != this->m_Header.LogGuid)
+            {
+                continue;
+            }
+
+            std::vector<std::uint8_t> Entry = ReadLog(Offset, EntryLength);
+            if (::LoadLE32(&Entry[4]) != ::ComputeCrc32c(
+                Entry.data(),
+                Entry.size(),
+                4))
+            {
+                continue;
+            }
+
+            bool Valid = true;
+            std::uint64_t DataSectorOffset = DescriptorAreaSize;
+            for (std::uint32_t i = 0; Valid && i < DescriptorCount; ++i)
+            {
+                std::uint8_t const* Descriptor = &Entry[64 + 32 * i];
+                std::uint32_t Signature = ::LoadLE32(Descriptor);
+                Valid = ::LoadLE64(Descriptor + 24) == SequenceNumber &&
+                    !(::LoadLE64(Descriptor + 16) % VhdxLogSectorSize);
+                if (VhdxZeroDescriptorSignature == Signature)
+                {
+                    Valid = Valid &&
+                        !(::LoadLE64(Descriptor + 8) % VhdxLogSectorSize);
+                }
+                else if (VhdxDataDescriptorSignature == Signature)
+                {
+                    Valid = Valid &&
+                        DataSectorOffset + VhdxLogSectorSize <= EntryLength;
+                    if (Valid)
+                    {
+                        std::uint8_t const* DataSector =
+                            &Entry[DataSectorOffset];
+                        Valid = VhdxDataSectorSignature ==
+                            ::LoadLE32(DataSector) &&
+                            ::LoadLE32(DataSector + 4) ==
+                            static_cast<std::uint32_t>(SequenceNumber >> 32) &&
+                            ::LoadLE32(DataSector + 4092) ==
+                            static_cast<std::uint32_t>(SequenceNumber);
+                    }
+                    DataSectorOffset += VhdxLogSectorSize;
+                }
+                else
+                {
+                    Valid = false;
+                }
+            }
+            if (!Valid || DataSectorOffset != EntryLength)
+            {
+                continue;
+            }
+
+            LogEntry& Current = Entries[Offset];
+            Current.SequenceNumber = SequenceNumber;
+            Current.Length = EntryLength;
+            Current.Tail = Tail;
+            Current.FlushedFileOffset = ::LoadLE64(&Header[48]);
+            Current.LastFileOffset = ::LoadLE64(&Header[56]);
+        }
+
+        // The active sequence is the longest run of the entries with the
+        // consecutive sequence numbers from the tail recorded by the head,
+        // and the head is the valid entry with the largest sequence number.
+        std::vector<std::uint32_t> Candidates;
+        for (auto const& Current : Entries)
+        {
+            Candidates.push_back(Current.first);
+        }
+        std::sort(
+            Candidates.begin(),
+            Candidates.end(),
+            [&](std::uint32_t Left, std::uint32_t Right)
+        {
+            return Entries[Left].SequenceNumber >
+                Entries[Right].SequenceNumber;
+        });
+
+        std::vector<std::uint32_t> Sequence;
+        for (std::uint32_t Head : Candidates)
+        {
+            std::uint32_t Current = Entries[Head].Tail;
+            for (std::uint32_t Step = 0;
+                Step < LogLength / VhdxLogSectorSize;
+                ++Step)
+            {
+                auto Iterator = Entries.find(Current);
+                if (Entries.end() == Iterator ||
+                    (!Sequence.empty() &&
+                        Iterator->second.SequenceNumber !=
+                        Entries[Sequence.back()].SequenceNumber + 1))
+                {
+                    break;
+                }
+                Sequence.push_back(Current);
+                if (Head == Current)
+                {
+                    break;
+                }
+                Current = (Current + Iterator->second.Length) % LogLength;
+            }
+            if (!Sequence.empty() && Head == Sequence.back())
+            {
+                break;
+            }
+            Sequence.clear();
+        }
+
+        std::vector<std::uint8_t> Zero(VhdxLogSectorSize);
+        std::vector<std::uint8_t> Sector(VhdxLogSectorSize);
+        for (std::uint32_t Offset : Sequence)
+        {
+            std::vector<std::uint8_t> Entry = ReadLog(
+                Offset,
+                Entries[Offset].Length);
+            std::uint32_t DescriptorCount = ::LoadLE32(&Entry[24]);
+            std::uint64_t DataSectorOffset = ::RoundUp(
+                64 + 32 * static_cast<std::uint64_t>(DescriptorCount),
+                VhdxLogSectorSize);
+            for (std::uint32_t i = 0; i < DescriptorCount; ++i)
+            {
+                std::uint8_t const* Descriptor = &Entry[64 + 32 * i];
+                std::uint64_t FileOffset = ::LoadLE64(Descriptor + 16);
+                if (VhdxZeroDescriptorSignature == ::LoadLE32(Descriptor))
+                {
+                    std::uint64_t Length = ::LoadLE64(Descriptor + 8);
+                    for (std::uint64_t Done = 0;
+                        Done < Length;
+                        Done += VhdxLogSectorSize)
+                    {
+                        this->m_File.Write(
+                            FileOffset + Done,
+                            Zero.data(),
+                            Zero.size());
+                    }
+                }
+                else
+                {
+                    // The leading 8 bytes and the trailing 4 bytes of the
+                    // sector are stored in the descriptor.
+                    std::uint8_t const* DataSector = &Entry[DataSectorOffset];
+                    std::memcpy(&Sector[0], Descriptor + 8, 8);
+                    std::memcpy(&Sector[8], DataSector + 8, 4084);
+                    std::memcpy(&Sector[4092], Descriptor + 4, 4);
+                    this->m_File.Write(FileOffset, Sector.data(), Sector.size());
+                    DataSectorOffset += VhdxLogSectorSize;
+                }
+            }
+        }
+
+        if (!Sequence.empty())
+        {
+            LogEntry const& Head = Entries[Sequence.back()];
+            std::uint64_t FileSize = this->m_File.GetSize();
+            if (FileSize < Head.FlushedFileOffset)
+            {
+                ::ThrowFormatError(
+                    this->m_Path,
+                    "The file is truncated before the log is flushed");
+            }
+            if (FileSize < Head.LastFileOffset)
+            {
+                this->m_File.SetSize(Head.LastFileOffset);
+            }
+        }
+        this->m_File.Flush();
+        this->m_ReplayedLogEntryCount = Sequence.size();
+
+        this->m_Header.LogGuid = NanaBox::VirtualDiskGuid();
+        this->BeginWrite(false);
+    }
+
+    void VhdxImage::LoadRegionTable()
+    {
+        std::vector<std::uint8_t> Buffer(VhdxRegionTableSize);
+        bool Found = false;
+        for (std::size_t i = 0; !Found && i < 2; ++i)
+        {
+            this->m_File.Read(
+                VhdxRegionTableOffsets[i],
+                Buffer.data(),
+                Buffer.size());
+            std::uint32_t EntryCount = ::LoadLE32(&Buffer[8]);
+            if (VhdxRegionTableSignature != ::LoadLE32(&Buffer[0]) ||
+                ::LoadLE32(&Buffer[4]) != ::ComputeCrc32c(
+                    Buffer.data(),
+                    Buffer.size(),
+                    4) ||
+                EntryCount > 2047)
+            {
+                continue;
+            }
+
+            this->m_BatLength = 0;
+            this->m_MetadataLength = 0;
+            for (std::uint32_t j = 0; j < EntryCount; ++j)
+            {
+                std::uint8_t const* Entry = &Buffer[16 + 32 * j];
+                NanaBox::VirtualDiskGuid Id = ::LoadGuid(Entry);
+                std::uint64_t FileOffset = ::LoadLE64(Entry + 16);
+                std::uint32_t Length = ::LoadLE32(Entry + 24);
+                if (g_BatRegionGuid == Id)
+                {
+                    this->m_BatOffset = FileOffset;
+                    this->m_BatLength = Length;
+                }
+                else if (g_MetadataRegionGuid == Id)
+                {
+                    this->m_MetadataOffset = FileOffset;
+                    this->m_MetadataLength = Length;
+                }
+                else if (::LoadLE32(Entry + 28) & 1)
+                {
+                    ::ThrowFormatError(
+                        this->m_Path,
+                        "Unknown required region");
+                }
+            }
+            Found = true;
+        }
+        if (!Found)
+        {
+            ::ThrowFormatError(this->m_Path, "No valid region table");
+        }
+
+        std::uint64_t FileSize = this->m_File.GetSize();
+        if (!this->m_BatLength ||
+            !this->m_MetadataLength ||
+            this->m_BatOffset % MiB ||
+            this->m_MetadataOffset % MiB ||
+            this->m_BatOffset + this->m_BatLength > FileSize ||
+            this->m_MetadataOffset + this->m_MetadataLength > FileSize)
+        {
+            ::ThrowFormatError(this->m_Path, "Invalid BAT or metadata region");
+        }
+    }
+
+    void VhdxImage::WriteBatRegion(
+        std::uint64_t Offset,
+        std::uint32_t Length)
+    {
+        // The other entries of the valid region table are kept.
+        std::vector<std::uint8_t> Buffer(VhdxRegionTableSize);
+        for (std::size_t i = 0; i < 2; ++i)
+        {
+            this->m_File.Read(
+                VhdxRegionTableOffsets[i],
+                Buffer.data(),
+                Buffer.size());
+            if (VhdxRegionTableSignature == ::LoadLE32(&Buffer[0]) &&
+                ::LoadLE32(&Buffer[4]) == ::ComputeCrc32c(
+                    Buffer.data(),
+                    Buffer.size(),
+                    4))
+            {
+                break;
+            }
+        }
+
+        std::uint32_t EntryCount = ::LoadLE32(&Buffer[8]);
+        for (std::uint32_t i = 0; i < EntryCount && i < 2047; ++i)
+        {
+            std::uint8_t* Entry = &Buffer[16 + 32 * i];
+            if (g_BatRegionGuid == ::LoadGuid(Entry))
+            {
+                ::StoreLE64(Entry + 16, Offset);
+                ::StoreLE32(Entry + 24, Length);
+            }
+        }
+        ::StoreLE32(&Buffer[4], ::ComputeCrc32c(
+            Buffer.data(),
+            Buffer.size(),
+            4));
+
+        // Each copy is flushed before the other one is written, so at least
+        // one of them is valid at any time.
+        for (std::uint64_t RegionTableOffset : VhdxRegionTableOffsets)
+        {
+            this->m_File.Write(RegionTableOffset, Buffer.data(), Buffer.size());
+            this->m_File.Flush();
+        }
+
+        this->m_BatOffset = Offset;
+        this->m_BatLength = Length;
+    }
+
+    void VhdxImage::LoadMetadata()
+    {
+        this->m_MetadataMapping = NanaBox::VirtualDiskMapping(
+            this->m_File,
+            this->m_MetadataOffset,
+            this->m_MetadataLength,
+            false);
+        std::uint8_t const* Region = this->m_MetadataMapping.GetData();
+
+        std::uint16_t EntryCount = ::LoadLE16(Region + 10);
+        if (0 != std::memcmp(Region, "metadata", 8) ||
+            EntryCount > 2047)
+        {
+            ::ThrowFormatError(this->m_Path, "Invalid metadata table");
+        }
+
+        bool HasFileParameters = false;
+        bool HasVirtualDiskSize = false;
+        bool HasLogicalSectorSize = false;
+        bool HasPhysicalSectorSize = false;
+        bool LeaveBlockAllocated = false;
+        bool HasParent = false;
+        bool HasParentLocator = false;
+
+        for (std::uint16_t i = 0; i < EntryCount; ++i)
+        {
+            std::uint8_t const* Entry = Region + 32 + 32 * i;
+            NanaBox::VirtualDiskGuid Id = ::LoadGuid(Entry);
+            std::uint32_t Offset = ::LoadLE32(Entry + 16);
+            std::uint32_t Length = ::LoadLE32(Entry + 20);
+            std::uint32_t Flags = ::LoadLE32(Entry + 24);
+            if (static_cast<std::uint64_t>(Offset) + Length >
+                this->m_MetadataLength ||
+                (Length && Offset < 64 * KiB))
+            {
+                ::ThrowFormatError(this->m_Path, "Invalid metadata item");
+            }
+            std::uint8_t const* Item = Region + Offset;
+
+            if (g_FileParametersGuid == Id && Length >= 8)
+            {
+                this->m_Information.BlockSize = ::LoadLE32(Item);
+                std::uint32_t Parameters = ::LoadLE32(Item + 4);
+                LeaveBlockAllocated =
+                    Parameters & VhdxFileParametersLeaveBlockAllocated;
+                HasParent = Parameters & VhdxFileParametersHasParent;
+                HasFileParameters = true;
+            }
+            else if (g_VirtualDiskSizeGuid == Id && Length >= 8)
+            {
+                this->m_Information.VirtualSize = ::LoadLE64(Item);
+                HasVirtualDiskSize = true;
+            }
+            else if (g_VirtualDiskIdGuid == Id && Length >= 16)
+            {
+                this->m_Information.DiskId = ::LoadGuid(Item);
+            }
+            else if (g_LogicalSectorSizeGuid == Id && Length >= 4)
+            {
+                this->m_Information.LogicalSectorSize = ::LoadLE32(Item);
+                HasLogicalSectorSize = true;
+            }
+            else if (g_PhysicalSectorSizeGuid == Id && Length >= 4)
+            {
+                this->m_Information.PhysicalSectorSize = ::LoadLE32(Item);
+                HasPhysicalSectorSize = true;
+            }
+            else if (g_ParentLocatorGuid == Id && Length >= 20)
+            {
+                if (g_ParentLocatorTypeGuid != ::LoadGuid(Item))
+                {
+                    ::ThrowFormatError(
+                        this->m_Path,
+                        "Unsupported parent locator type");
+                }
+
+                NanaBox::VirtualDiskParentLocator& Locator =
+                    this->m_Information.Parent;
+                std::uint16_t KeyValueCount = ::LoadLE16(Item + 18);
+                for (std::uint16_t j = 0; j < KeyValueCount; ++j)
+                {
+                    std::uint64_t EntryOffset = 20 + 12 * j;
+                    if (EntryOffset + 12 > Length)
+                    {
+                        ::ThrowFormatError(
+                            this->m_Path,
+                            "Invalid parent locator");
+                    }
+                    std::uint8_t const* KeyValue = Item + EntryOffset;
+                    std::uint32_t KeyOffset = ::LoadLE32(KeyValue);
+                    std::uint32_t ValueOffset = ::LoadLE32(KeyValue + 4);
+                    std::uint16_t KeyLength = ::LoadLE16(KeyValue + 8);
+                    std::uint16_t ValueLength = ::LoadLE16(KeyValue + 10);
+                    if (static_cast<std::uint64_t>(KeyOffset) + KeyLength >
+                        Length ||
+                        static_cast<std::uint64_t>(ValueOffset) + ValueLength >
+                        Length)
+                    {
+                        ::ThrowFormatError(
+                            this->m_Path,
+                            "Invalid parent locator");
+                    }
+
+                    std::string Key = ::Utf16ToUtf8(
+                        Item + KeyOffset,
+                        KeyLength,
+                        false);
+                    std::string Value = ::Utf16ToUtf8(
+                        Item + ValueOffset,
+                        ValueLength,
+                        false);
+                    if ("parent_linkage" == Key)
+                    {
+                        NanaBox::ParseVirtualDiskGuid(Value, Locator.Linkage);
+                    }
+                    else if ("parent_linkage2" == Key)
+                    {
+                        NanaBox::ParseVirtualDiskGuid(
+                            Value,
+                            Locator.AlternativeLinkage);
+                    }
+                    else if ("relative_path" == Key)
+                    {
+                        Locator.RelativePath = Value;
+                    }
+                    else if ("absolute_win32_path" == Key)
+                    {
+                        Locator.AbsolutePath = Value;
+                    }
+                    else if ("volume_path" == Key)
+                    {
+                        Locator.VolumePath = Value;
+                    }
+                }
+                HasParentLocator = true;
+            }
+            else if (Flags & VhdxMetadataIsRequired)
+            {
+                ::ThrowFormatError(
+                    this->m_Path,
+                    "Unknown required metadata item");
+            }
+        }
+
+        NanaBox::VirtualDiskInformation& Information = this->m_Information;
+        if (!HasFileParameters ||
+            !HasVirtualDiskSize ||
+            !HasLogicalSectorSize ||
+            !HasPhysicalSectorSize ||
+            (HasParent && !HasParentLocator))
+        {
+            ::ThrowFormatError(this->m_Path, "Required metadata is missing");
+        }
+        if (Information.BlockSize < MiB ||
+            Information.BlockSize > VhdxMaximumBlockSize ||
+            !::IsPowerOfTwo(Information.BlockSize) ||
+            (512 != Information.LogicalSectorSize &&
+                4096 != Information.LogicalSectorSize) ||
+            (512 != Information.PhysicalSectorSize &&
+                4096 != Information.PhysicalSectorSize) ||
+            !Information.VirtualSize ||
+            Information.VirtualSize > VhdxMaximumVirtualSize ||
+            Information.VirtualSize % Information.LogicalSectorSize)
+        {
+            ::ThrowFormatError(this->m_Path, "Invalid metadata value");
+        }
+
+        Information.Type = HasParent
+            ? NanaBox::VirtualDiskType::Differencing
+            : (LeaveBlockAllocated
+                ? NanaBox::VirtualDiskType::Fixed
+                : NanaBox::VirtualDiskType::Dynamic);
+
+        this->m_ChunkRatio = VhdxSectorsPerChunk *
+            Information.LogicalSectorSize / Information.BlockSize;
+        Information.BlockCount = (Information.VirtualSize +
+            Information.BlockSize - 1) / Information.BlockSize;
+        if (HasParent)
+        {
+            this->m_BatEntryCount = (Information.BlockCount +
+                this->m_ChunkRatio - 1) / this->m_ChunkRatio *
+                (this->m_ChunkRatio + 1);
+        }
+        else
+        {
+            this->m_BatEntryCount = Information.BlockCount +
+                (Information.BlockCount - 1) / this->m_ChunkRatio;
+        }
+        if (this->m_BatEntryCount * 8 > this->m_BatLength)
+        {
+            ::ThrowFormatError(this->m_Path, "The BAT region is too small");
+        }
+    }
+
+    void VhdxImage::WriteHeader()
+    {
+        ++this->m_Header.SequenceNumber;
+        std::size_t Index = 1 - this->m_CurrentHeaderIndex;
+        std::vector<std::uint8_t> Buffer(VhdxHeaderSize);
+        ::SerializeVhdxHeader(this->m_Header, Buffer.data());
+        this->m_File.Write(
+            VhdxHeaderOffsets[Index],
+            Buffer.data(),
+            Buffer.size());
+        this->m_File.Flush();
+        this->m_CurrentHeaderIndex = Index;
+    }
+
+    void VhdxImage::BeginWrite(
+        bool DataChanged)
+    {
+        if (!this->m_File.IsWritable())
+        {
+            ::ThrowFormatError(this->m_Path, "The image is opened read-only");
+        }
+
+        bool UpdateFileWriteGuid = !this->m_FileWriteGuidUpdated;
+        bool UpdateDataWriteGuid = DataChanged && !this->m_DataWriteGuidUpdated;
+        if (!UpdateFileWriteGuid && !UpdateDataWriteGuid)
+        {
+            return;
+        }
+
+        if (UpdateFileWriteGuid)
+        {
+            this->m_Header.FileWriteGuid = NanaBox::GenerateVirtualDiskGuid();
+            this->m_FileWriteGuidUpdated = true;
+        }
+        if (UpdateDataWriteGuid)
+        {
+            this->m_Header.DataWriteGuid = NanaBox::GenerateVirtualDiskGuid();
+            this->m_Information.DataWriteGuid = this->m_Header.DataWriteGuid;
+            this->m_DataWriteGuidUpdated = true;
+        }
+
+        // Both headers are updated, so the older one is also consistent.
+        this->WriteHeader();
+        this->WriteHeader();
+    }
+
+    std::uint64_t VhdxImage::GetBatEntry(
+        std::uint64_t EntryIndex) const
+    {
+        return ::LoadLE64(this->m_BatMapping.GetData() + EntryIndex * 8);
+    }
+
+    void VhdxImage::SetBatEntry(
+        std::uint64_t EntryIndex,
+        std::uint64_t Value)
+    {
+        ::StoreLE64(this->m_BatMapping.GetData() + EntryIndex * 8, Value);
+    }
+
+    std::uint64_t VhdxImage::GetPayloadEntryIndex(
+        std::uint64_t BlockIndex) const
+    {
+        if (BlockIndex >= this->m_Information.BlockCount)
+        {
+            throw std::out_of_range("The block index is out of range");
+        }
+        return BlockIndex + BlockIndex / this->m_ChunkRatio;
+    }
+
+    std::uint64_t VhdxImage::GetSectorBitmapEntryIndex(
+        std::uint64_t BlockIndex) const
+    {
+        return BlockIndex / this->m_ChunkRatio * (this->m_ChunkRatio + 1) +
+            this->m_ChunkRatio;
+    }
+
+    std::uint64_t VhdxImage::GetSectorBitmapFileOffset(
+        std::uint64_t BlockIndex) const
+    {
+        if (NanaBox::VirtualDiskType::Differencing != this->m_Information.Type)
+        {
+            return 0;
+        }
+
+        std::uint64_t Entry = this->GetBatEntry(
+            this->GetSectorBitmapEntryIndex(BlockIndex));
+        if (VhdxSectorBitmapPresent != (Entry & VhdxBatStateMask))
+        {
+            return 0;
+        }
+
+        std::uint64_t BitmapSize = this->m_Information.BlockSize /
+            this->m_Information.LogicalSectorSize / 8;
+        return (Entry & VhdxBatFileOffsetMask) +
+            BlockIndex % this->m_ChunkRatio * BitmapSize;
+    }
+
+    std::uint64_t VhdxImage::AllocateSpace(
+        std::uint64_t Size)
+    {
+        std::uint64_t Offset = ::RoundUp(this->m_File.GetSize(), MiB);
+        this->m_File.SetSize(Offset + Size);
+        return Offset;
+    }
+
+    const std::size_t VhdFooterSize = 512;
+    const std::size_t VhdDynamicHeaderSize = 1024;
+    const std::uint32_t VhdSectorSize = 512;
+    const std::uint32_t VhdDefaultBlockSize = 2 * MiB;
+    const std::uint64_t VhdMaximumVirtualSize = 2040 * GiB;
+    const std::uint32_t VhdUnallocatedBlock = 0xFFFFFFFF;
+    // The time stamps of VHD are the seconds since January 1, 2000 UTC.
+    const std::time_t VhdTimeStampBase = 946684800;
+
+    const std::uint32_t VhdDiskTypeFixed = 2;
+    const std::uint32_t VhdDiskTypeDynamic = 3;
+    const std::uint32_t VhdDiskTypeDifferencing = 4;
+
+    const std::uint32_t VhdPlatformCodeW2ru = 0x57327275;
+    const std::uint32_t VhdPlatformCodeW2ku = 0x57326B75;
+    const std::uint32_t VhdPlatformCodeMacX = 0x4D616358;
+
+    class VhdImage : public NanaBox::VirtualDiskImage
+    {
+    public:
+
+        VhdImage(
+            std::string const& Path,
+            bool Writable,
+            bool Unbuffered);
+
+        NanaBox::VirtualDiskBlockState GetBlockState(
+            std::uint64_t BlockIndex) const override;
+
+        std::uint64_t GetBlockFileOffset(
+            std::uint64_t BlockIndex) const override;
+
+        void GetBlockSectorBitmap(
+            std::uint64_t BlockIndex,
+            std::vector<std::uint8_t>& Bitmap) const override;
+
+        void Flush() override;
+
+    protected:
+
+        void ReadBlock(
+            std::uint64_t BlockIndex,
+            std::uint32_t BlockOffset,
+            std::uint8_t* Buffer,
+            std::size_t Size) const override;
+
+        void WriteBlock(
+            std::uint64_t BlockIndex,
+            std::uint32_t BlockOffset,
+            std::uint8_t const* Buffer,
+            std::size_t Size) override;
+
+    private:
+
+        void LoadDynamicHeader();
+
+        std::uint32_t GetBatEntry(
+            std::uint64_t BlockIndex) const;
+
+        std::uint8_t m_Footer[VhdFooterSize];
+        std::uint64_t m_FooterOffset = 0;
+        std::uint32_t m_MaxTableEntries = 0;
+        std::uint32_t m_BitmapSize = 0;
+        NanaBox::VirtualDiskMapping m_BatMapping;
+    };
+
+    VhdImage::VhdImage(
+        std::string const& Path,
+        bool Writable,
+        bool Unbuffered) :
+        NanaBox::VirtualDiskImage(Path, Writable, Unbuffered)
+    {
+        NanaBox::VirtualDiskInformation& Information = this->m_Information;
+        Information.Format = NanaBox::VirtualDiskFormat::Vhd;
+        Information.LogicalSectorSize = VhdSectorSize;
+        Information.PhysicalSectorSize = VhdSectorSize;
+
+        std::uint64_t FileSize = this->m_File.GetSize();
+        if (FileSize < VhdFooterSize)
+        {
+            ::ThrowFormatError(Path, "Not a VHD file");
+        }
+        this->m_FooterOffset = FileSize - VhdFooterSize;
+        this->m_File.Read(this->m_FooterOffset, this->m_Footer, VhdFooterSize);
+        if (0 != std::memcmp(this->m_Footer, "conectix", 8) ||
+            ::LoadBE32(this->m_Footer + 64) != ::ComputeVhdChecksum(
+                this->m_Footer,
+                VhdFooterSize,
+                64))
+        {
+            ::ThrowFormatError(Path, "Not a VHD file or the footer is broken");
+        }
+
+        Information.VirtualSize = ::LoadBE64(this->m_Footer + 48);
+        Information.DiskId = ::LoadGuid(this->m_Footer + 68);
+
+        switch (::LoadBE32(this->m_Footer + 60))
+        {
+        case VhdDiskTypeFixed:
+        {
+            Information.Type = NanaBox::VirtualDiskType::Fixed;
+            Information.BlockSize = VhdDefaultBlockSize;
+            if (Information.VirtualSize > this->m_FooterOffset)
+            {
+                ::ThrowFormatError(Path, "The file is truncated");
+            }
+            break;
+        }
+        case VhdDiskTypeDynamic:
+        {
+            Information.Type = NanaBox::VirtualDiskType::Dynamic;
+            this->LoadDynamicHeader();
+            break;
+        }
+        case VhdDiskTypeDifferencing:
+        {
+            Information.Type = NanaBox::VirtualDiskType::Differencing;
+            this->LoadDynamicHeader();
+            break;
+        }
+        default:
+            ::ThrowFormatError(Path, "Unsupported VHD disk type");
+        }
+
+        Information.BlockCount = (Information.VirtualSize +
+            Information.BlockSize - 1) / Information.BlockSize;
+        if (NanaBox::VirtualDiskType::Fixed != Information.Type &&
+            Information.BlockCount > this->m_MaxTableEntries)
+        {
+            ::ThrowFormatError(Path, "The BAT is too small");
+        }
+    }
+
+    NanaBox::VirtualDiskBlockState VhdImage::GetBlockState(
+        std::uint64_t BlockIndex) const
+    {
+        if (NanaBox::VirtualDiskType::Fixed == this->m_Information.Type)
+        {
+            if (BlockIndex >= this->m_Information.BlockCount)
+            {
+                throw std::out_of_range("The block index is out of range");
+            }
+            return NanaBox::VirtualDiskBlockState::FullyPresent;
+        }
+        else if (VhdUnallocatedBlock == this->GetBatEntry(BlockIndex))
+        {
+            return NanaBox::VirtualDiskBlockState::NotPresent;
+        }
+        else if (NanaBox::VirtualDiskType::Differencing ==
+            this->m_Information.Type)
+        {
+            return NanaBox::VirtualDiskBlockState::PartiallyPresent;
+        }
+        return NanaBox::VirtualDiskBlockState::FullyPresent;
+    }
+
+    std::uint64_t VhdImage::GetBlockFileOffset(
+        std::uint64_t BlockIndex) const
+    {
+        if (NanaBox::VirtualDiskType::Fixed == this->m_Information.Type)
+        {
+            return BlockIndex * this->m_Information.BlockSize;
+        }
+
+        std::uint32_t Entry = this->GetBatEntry(BlockIndex);
+        if (VhdUnallocatedBlock == Entry)
+        {
+            return 0;
+        }
+        return static_cast<std::uint64_t>(Entry) * VhdSectorSize +
+            this->m_BitmapSize;
+    }
+
+    void VhdImage::GetBlockSectorBitmap(
+        std::uint64_t BlockIndex,
+        std::vector<std::uint8_t>& Bitmap) const
+    {
+        Bitmap.assign(this->m_Information.BlockSize / VhdSectorSize / 8, 0);
+
+        switch (this->GetBlockState(BlockIndex))
+        {
+        case NanaBox::VirtualDiskBlockState::FullyPresent:
+        {
+            std::fill(Bitmap.begin(), Bitmap.end(), 0xFF);
+            break;
+        }
+        case NanaBox::VirtualDiskBlockState::PartiallyPresent:
+        {
+            this->m_File.Read(
+                static_cast<std::uint64_t>(
+                    this->GetBatEntry(BlockIndex)) * VhdSectorSize,
+                Bitmap.data(),
+                Bitmap.size());
+            // VHD uses the most significant bit first order.
+            for (std::uint8_t& Value : Bitmap)
+            {
+                std::uint8_t Reversed = 0;
+                for (std::size_t i = 0; i < 8; ++i)
+                {
+                    if (Value & (1 << i))
+                    {
+                        Reversed |= static_cast<std::uint8_t>(1 << (7 - i));
+                    }
+                }
+                Value = Reversed;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    void VhdImage::Flush()
+    {
+        this->m_BatMapping.Flush();
+        this->m_File.Flush();
+    }
+
+    void VhdImage::ReadBlock(
+        std::uint64_t BlockIndex,
+        std::uint32_t BlockOffset,
+        std::uint8_t* Buffer,
+        std::size_t Size) const
+    {
+        std::uint64_t BlockStart =
+            BlockIndex * this->m_Information.BlockSize;
+        std::uint64_t FileOffset = this->GetBlockFileOffset(BlockIndex);
+
+        switch (this->GetBlockState(BlockIndex))
+        {
+        case NanaBox::VirtualDiskBlockState::FullyPresent:
+        {
+            this->m_File.Read(FileOffset + BlockOffset, Buffer, Size);
+            break;
+        }
+        case NanaBox::VirtualDiskBlockState::PartiallyPresent:
+        {
+            std::vector<std::uint8_t> Bitmap;
+            this->GetBlockSectorBitmap(BlockIndex, Bitmap);
+            ::EnumerateSectorRuns(
+                Bitmap,
+                VhdSectorSize,
+                BlockOffset,
+                Size,
+                [&](
+                    bool Present,
+                    std::uint32_t RunOffset,
+                    std::size_t RunSize,
+                    std::size_t BufferOffset)
+            {
+                if (Present)
+                {
+                    this->m_File.Read(
+                        FileOffset + RunOffset,
+                        Buffer + BufferOffset,
+                        RunSize);
+                }
+                else
+                {
+                    this->ReadFromParent(
+                        BlockStart + RunOffset,
+                        Buffer + BufferOffset,
+                        RunSize);
+                }
+            });
+            break;
+        }
+        default:
+        {
+            this->ReadFromParent(BlockStart + BlockOffset, Buffer, Size);
+            break;
+        }
+        }
+    }
+
+    void VhdImage::WriteBlock(
+        std::uint64_t BlockIndex,
+        std::uint32_t BlockOffset,
+        std::uint8_t const* Buffer,
+        std::size_t Size)
+    {
+        if (!this->m_File.IsWritable())
+        {
+            ::ThrowFormatError(this->m_Path, "The image is opened read-only");
+        }
+
+        if (NanaBox::VirtualDiskType::Fixed == this->m_Information.Type)
+        {
+            this->m_File.Write(
+                BlockIndex * this->m_Information.BlockSize + BlockOffset,
+                Buffer,
+                Size);
+            return;
+        }
+
+        bool Differencing =
+            NanaBox::VirtualDiskType::Differencing == this->m_Information.Type;
+
+        std::uint32_t Entry = this->GetBatEntry(BlockIndex);
+        bool Allocate = VhdUnallocatedBlock == Entry;
+        if (Allocate)
+        {
+            // The footer is moved first, so a failure in the middle only
+            // leaks the space instead of breaking the image.
+            std::uint64_t BlockOffsetInFile =
+                ::RoundUp(this->m_FooterOffset, VhdSectorSize);
+            std::uint64_t FooterOffset = BlockOffsetInFile +
+                this->m_BitmapSize + this->m_Information.BlockSize;
+            if (BlockOffsetInFile / VhdSectorSize >= VhdUnallocatedBlock)
+            {
+                ::ThrowFormatError(this->m_Path, "The VHD file is too large");
+            }
+            this->m_File.Write(FooterOffset, this->m_Footer, VhdFooterSize);
+            this->m_FooterOffset = FooterOffset;
+
+            std::vector<std::uint8_t> Bitmap(
+                this->m_BitmapSize,
+                Differencing ? 0x00 : 0xFF);
+            this->m_File.Write(
+                BlockOffsetInFile,
+                Bitmap.data(),
+                Bitmap.size());
+            Entry = static_cast<std::uint32_t>(
+                BlockOffsetInFile / VhdSectorSize);
+        }
+
+        std::uint64_t BitmapOffset =
+            static_cast<std::uint64_t>(Entry) * VhdSectorSize;
+        this->m_File.Write(
+            BitmapOffset + this->m_BitmapSize + BlockOffset,
+            Buffer,
+            Size);
+
+        if (Differencing)
+        {
+            std::uint64_t FirstSector = BlockOffset / VhdSectorSize;
+            std::uint64_t LastSector = FirstSector + Size / VhdSectorSize - 1;
+            std::vector<std::uint8_t> Bitmap(
+                static_cast<std::size_t>(LastSector / 8 - FirstSector / 8 + 1));
+            this->m_File.Read(
+                BitmapOffset + FirstSector / 8,
+                Bitmap.data(),
+                Bitmap.size());
+            for (std::uint64_t i = FirstSector; i <= LastSector; ++i)
+            {
+                std::uint64_t Index = i - FirstSector / 8 * 8;
+                Bitmap[Index / 8] |= static_cast<std::uint8_t>(
+                    0x80 >> (Index % 8));
+            }
+            this->m_File.Write(
+                BitmapOffset + FirstSector / 8,
+                Bitmap.data(),
+                Bitmap.size());
+        }
+
+        if (Allocate)
+        {
+            ::StoreBE32(
+                this->m_BatMapping.GetData() + BlockIndex * 4,
+                Entry);
+        }
+    }
+
+    void VhdImage::LoadDynamicHeader()
+    {
+        std::uint8_t Header[VhdDynamicHeaderSize];
+        std::uint64_t HeaderOffset = ::LoadBE64(this->m_Footer + 16);
+        if (HeaderOffset + VhdDynamicHeaderSize > this->m_FooterOffset)
+        {
+            ::ThrowFormatError(this->m_Path, "Invalid dynamic disk header");
+        }
+        this->m_File.Read(HeaderOffset, Header, VhdDynamicHeaderSize);
+        if (0 != std::memcmp(Header, "cxsparse", 8) ||
+            ::LoadBE32(Header + 36) != ::ComputeVhdChecksum(
+                Header,
+                VhdDynamicHeaderSize,
+                36))
+        {
+            ::ThrowFormatError(this->m_Path, "Invalid dynamic disk header");
+        }
+
+        NanaBox::VirtualDiskInformation& Information = this->m_Information;
+        std::uint64_t TableOffset = ::LoadBE64(Header + 16);
+        this->m_MaxTableEntries = ::LoadBE32(Header + 28);
+        Information.BlockSize = ::LoadBE32(Header + 32);
+        if (Information.BlockSize < VhdSectorSize * 8 ||
+            !::IsPowerOfTwo(Information.BlockSize) ||
+            TableOffset + this->m_MaxTableEntries * 4ULL > this->m_FooterOffset)
+        {
+            ::ThrowFormatError(this->m_Path, "Invalid dynamic disk header");
+        }
+        this->m_BitmapSize = static_cast<std::uint32_t>(::RoundUp(
+            Information.BlockSize / VhdSectorSize / 8,
+            VhdSectorSize));
+
+        this->m_BatMapping = NanaBox::VirtualDiskMapping(
+            this->m_File,
+            TableOffset,
+            this->m_MaxTableEntries * 4ULL,
+            this->m_File.IsWritable());
+
+        if (NanaBox::VirtualDiskType::Differencing != Information.Type)
+        {
+            return;
+        }
+
+        NanaBox::VirtualDiskParentLocator& Locator = Information.Parent;
+        Locator.Linkage = ::LoadGuid(Header + 40);
+        for (std::size_t i = 0; i < 8; ++i)
+        {
+            std::uint8_t const* Entry = Header + 576 + 24 * i;
+            std::uint32_t PlatformCode = ::LoadBE32(Entry);
+            std::uint32_t DataLength = ::LoadBE32(Entry + 8);
+            std::uint64_t DataOffset = ::LoadBE64(Entry + 16);
+            if (!PlatformCode ||
+                !DataLength ||
+                DataLength > 64 * KiB ||
+                DataOffset + DataLength > this->m_FooterOffset)
+            {
+                continue;
+            }
+
+            std::vector<std::uint8_t> Data(DataLength);
+            this->m_File.Read(DataOffset, Data.data(), Data.size());
+            if (VhdPlatformCodeW2ru == PlatformCode)
+            {
+                Locator.RelativePath = ::Utf16ToUtf8(
+                    Data.data(),
+                    Data.size(),
+                    false);
+            }
+            else if (VhdPlatformCodeW2ku == PlatformCode)
+            {
+                Locator.AbsolutePath = ::Utf16ToUtf8(
+                    Data.data(),
+                    Data.size(),
+                    false);
+            }
+            else if (VhdPlatformCodeMacX == PlatformCode &&
+                Locator.AbsolutePath.empty())
+            {
+                std::string Url(Data.begin(), Data.end());
+                if (0 == Url.compare(0, 7, "file://"))
+                {
+                    Locator.AbsolutePath = Url.substr(7);
+                }
+            }
+        }
+    }
+
+    std::uint32_t VhdImage::GetBatEntry(
+        std::uint64_t BlockIndex) const
+    {
+        if (BlockIndex >= this->m_Information.BlockCount)
+        {
+            throw std::out_of_range("The block index is out of range");
+        }
+        return ::LoadBE32(this->m_BatMapping.GetData() + BlockIndex * 4);
+    }
+
+    void CreateVhdxFile(
+        std::string const& Path,
+        NanaBox::VirtualDiskCreateParameters const& Parameters,
+        NanaBox::VirtualDiskImage const* Parent,
+        NanaBox::VirtualDiskProgressHandler const& ProgressHandler)
+    {
+        bool Differencing =
+            NanaBox::VirtualDiskType::Differencing == Parameters.Type;
+        bool Fixed = NanaBox::VirtualDiskType::Fixed == Parameters.Type;
+
+        std::uint32_t LogicalSectorSize = Parameters.LogicalSectorSize;
+        std::uint64_t VirtualSize = Parameters.VirtualSize;
+        if (Differencing)
+        {
+            if (NanaBox::VirtualDiskFormat::Vhdx !=
+                Parent->GetInformation().Format)
+            {
+                ::ThrowFormatError(Path, "The parent must be a VHDX file");
+            }
+            LogicalSectorSize = Parent->GetInformation().LogicalSectorSize;
+            VirtualSize = Parent->GetInformation().VirtualSize;
+        }
+
+        // Hyper-V uses 2 MiB blocks for the differencing disks.
+        std::uint32_t BlockSize = Parameters.BlockSize;
+        if (!BlockSize)
+        {
+            BlockSize = Differencing ? 2 * MiB : VhdxDefaultBlockSize;
+        }
+
+        if (BlockSize < MiB ||
+            BlockSize > VhdxMaximumBlockSize ||
+            !::IsPowerOfTwo(BlockSize) ||
+            (512 != LogicalSectorSize && 4096 != LogicalSectorSize) ||
+            (512 != Parameters.PhysicalSectorSize &&
+                4096 != Parameters.PhysicalSectorSize) ||
+            !VirtualSize ||
+            VirtualSize > VhdxMaximumVirtualSize ||
+            VirtualSize % LogicalSectorSize)
+        {
+            ::ThrowFormatError(Path, "Invalid creation parameters");
+        }
+
+        std::uint64_t ChunkRatio =
+            VhdxSectorsPerChunk * LogicalSectorSize / BlockSize;
+        std::uint64_t BlockCount = (VirtualSize + BlockSize - 1) / BlockSize;
+        std::uint64_t BatEntryCount = Differencing
+            ? (BlockCount + ChunkRatio - 1) / ChunkRatio * (ChunkRatio + 1)
+            : BlockCount + (BlockCount - 1) / ChunkRatio;
+
+        // The same layout as Hyper-V, the log, the metadata and the BAT are
+        // placed after the headers, and the payload blocks follow them.
+        const std::uint64_t LogOffset = 1 * MiB;
+        const std::uint32_t LogLength = 1 * MiB;
+        const std::uint64_t MetadataOffset = 2 * MiB;
+        const std::uint32_t MetadataLength = 1 * MiB;
+        const std::uint64_t BatOffset = 3 * MiB;
+        std::uint64_t BatLength = ::RoundUp(BatEntryCount * 8, MiB);
+        std::uint64_t PayloadOffset = BatOffset + BatLength;
+
+        NanaBox::VirtualDiskFile File(Path, true, true);
+
+        // The payload of the fixed disks is zeroed by Allocate unless it is
+        // skipped. The space before the payload must read as zero, so it is
+        // written before the valid data length is moved to the end.
+        if (Fixed)
+        {
+            if (Parameters.SkipZeroing)
+            {
+                NanaBox::VirtualDiskBuffer Zero(MiB);
+                std::memset(Zero.GetData(), 0, Zero.GetSize());
+                for (std::uint64_t Offset = 0;
+                    Offset < PayloadOffset;
+                    Offset += MiB)
+                {
+                    File.Write(Offset, Zero.GetData(), Zero.GetSize());
+                }
+            }
+            File.Allocate(
+                PayloadOffset + BlockCount * BlockSize,
+                Parameters.SkipZeroing,
+                ProgressHandler);
+        }
+
+        std::vector<std::uint8_t> Buffer(VhdxRegionTableSize);
+        std::memcpy(&Buffer[0], "vhdxfile", 8);
+        std::vector<std::uint8_t> Creator = ::Utf8ToUtf16("NanaBox", false);
+        std::memcpy(&Buffer[8], Creator.data(), Creator.size());
+        File.Write(0, Buffer.data(), Buffer.size());
+
+        VhdxHeader Header;
+        Header.FileWriteGuid = NanaBox::GenerateVirtualDiskGuid();
+        Header.DataWriteGuid = NanaBox::GenerateVirtualDiskGuid();
+        Header.LogLength = LogLength;
+        Header.LogOffset = LogOffset;
+        for (std::size_t i = 0; i < 2; ++i)
+        {
+            Header.SequenceNumber = i;
+            ::SerializeVhdxHeader(Header, Buffer.data());
+            File.Write(VhdxHeaderOffsets[i], Buffer.data(), VhdxHeaderSize);
+        }
+
+        std::fill(Buffer.begin(), Buffer.end(), 0);
+        ::StoreLE32(&Buffer[0], VhdxRegionTableSignature);
+        ::StoreLE32(&Buffer[8], 2);
+        std::memcpy(&Buffer[16], g_BatRegionGuid.Bytes, 16);
+        ::StoreLE64(&Buffer[32], BatOffset);
+        ::StoreLE32(&Buffer[40], static_cast<std::uint32_t>(BatLength));
+        ::StoreLE32(&Buffer[44], 1);
+        std::memcpy(&Buffer[48], g_MetadataRegionGuid.Bytes, 16);
+        ::StoreLE64(&Buffer[64], MetadataOffset);
+        ::StoreLE32(&Buffer[72], MetadataLength);
+        ::StoreLE32(&Buffer[76], 1);
+        ::StoreLE32(&Buffer[4], ::ComputeCrc32c(
+            Buffer.data(),
+            Buffer.size(),
+            4));
+        for (std::uint64_t Offset : VhdxRegionTableOffsets)
+        {
+            File.Write(Offset, Buffer.data(), Buffer.size());
+        }
+
+        std::vector<std::uint8_t> Metadata(MetadataLength);
+        std::memcpy(&Metadata[0], "metadata", 8);
+        std::uint16_t EntryCount = 0;
+        std::uint32_t ItemOffset = 64 * KiB;
+        auto AddItem = [&](
+            NanaBox::VirtualDiskGuid const& Id,
+            std::uint32_t Flags,
+            std::vector<std::uint8_t> const& Content)
+        {
+            std::uint8_t* Entry = &Metadata[32 + 32 * EntryCount++];
+            std::memcpy(Entry, Id.Bytes, 16);
+            ::StoreLE32(Entry + 16, ItemOffset);
+            ::StoreLE32(Entry + 20, static_cast<std::uint32_t>(Content.size()));
+            ::StoreLE32(Entry + 24, Flags);
+            std::memcpy(&Metadata[ItemOffset], Content.data(), Content.size());
+            ItemOffset += static_cast<std::uint32_t>(Content.size());
+        };
+
+        std::vector<std::uint8_t> Item(8);
+        ::StoreLE32(&Item[0], BlockSize);
+        ::StoreLE32(&Item[4], Differencing
+            ? VhdxFileParametersHasParent
+            : (Fixed ? VhdxFileParametersLeaveBlockAllocated : 0));
+        AddItem(g_FileParametersGuid, VhdxMetadataIsRequired, Item);
+        ::StoreLE64(&Item[0], VirtualSize);
+        AddItem(
+            g_VirtualDiskSizeGuid,
+            VhdxMetadataIsVirtualDisk | VhdxMetadataIsRequired,
+            Item);
+        NanaBox::VirtualDiskGuid DiskId = NanaBox::GenerateVirtualDiskGuid();
+        AddItem(
+            g_VirtualDiskIdGuid,
+            VhdxMetadataIsVirtualDisk | VhdxMetadataIsRequired,
+            std::vector<std::uint8_t>(DiskId.Bytes, DiskId.Bytes + 16));
+        Item.resize(4);
+        ::StoreLE32(&Item[0], LogicalSectorSize);
+        AddItem(
+            g_LogicalSectorSizeGuid,
+            VhdxMetadataIsVirtualDisk | VhdxMetadataIsRequired,
+            Item);
+        ::StoreLE32(&Item[0], Parameters.PhysicalSectorSize);
+        AddItem(
+            g_PhysicalSectorSizeGuid,
+            VhdxMetadataIsVirtualDisk | VhdxMetadataIsRequired,
+            Item);
+
+        if (Differencing)
+        {
+            std::string FullPath = ::GetFullPath(Path);
+            std::string ParentFullPath = ::GetFullPath(Parent->GetPath());
+
+            std::vector<std::pair<std::string, std::string>> Pairs;
+            Pairs.emplace_back(
+                "parent_linkage",
+                NanaBox::FormatVirtualDiskGuid(
+                    Parent->GetInformation().DataWriteGuid));
+            std::string RelativePath = ::GetRelativePath(
+                FullPath,
+                ParentFullPath);
+            if (!RelativePath.empty())
+            {
+                Pairs.emplace_back("relative_path", RelativePath);
+            }
+#ifdef _WIN32
+            Pairs.emplace_back("absolute_win32_path", ParentFullPath);
+#endif
+
+            std::vector<std::uint8_t> Locator(20 + 12 * Pairs.size());
+            std::memcpy(&Locator[0], g_ParentLocatorTypeGuid.Bytes, 16);
+            ::StoreLE16(&Locator[18], static_cast<std::uint16_t>(Pairs.size()));
+            for (std::size_t i = 0; i < Pairs.size(); ++i)
+            {
+                std::vector<std::uint8_t> Key =
+                    ::Utf8ToUtf16(Pairs[i].first, false);
+                std::vector<std::uint8_t> Value =
+                    ::Utf8ToUtf16(Pairs[i].second, false);
+                std::uint8_t* Entry = &Locator[20 + 12 * i];
+                ::StoreLE32(Entry, static_cast<std::uint32_t>(Locator.size()));
+                ::StoreLE32(
+                    Entry + 4,
+                    static_cast<std::uint32_t>(Locator.size() + Key.size()));
+                ::StoreLE16(Entry + 8, static_cast<std::uint16_t>(Key.size()));
+                ::StoreLE16(
+                    Entry + 10,
+                    static_cast<std::uint16_t>(Value.size()));
+                Locator.insert(Locator.end(), Key.begin(), Key.end());
+                Locator.insert(Locator.end(), Value.begin(), Value.end());
+            }
+            AddItem(g_ParentLocatorGuid, VhdxMetadataIsRequired, Locator);
+        }
+
+        ::StoreLE16(&Metadata[10], EntryCount);
+        File.Write(MetadataOffset, Metadata.data(), Metadata.size());
+
+        // The new space of the file reads as zero, which is the empty log and
+        // the BAT with all blocks not present.
+        if (!Fixed)
+        {
+            File.SetSize(PayloadOffset);
+        }
+        else
+        {
+            std::vector<std::uint8_t> Bat(
+                static_cast<std::size_t>(BatEntryCount * 8));
+            for (std::uint64_t i = 0; i < BlockCount; ++i)
+            {
+                ::StoreLE64(
+                    &Bat[static_cast<std::size_t>((i + i / ChunkRatio) * 8)],
+                    (PayloadOffset + i * BlockSize) |
+                    static_cast<std::uint64_t>(
+                        NanaBox::VirtualDiskBlockState::FullyPresent));
+            }
+            File.Write(BatOffset, Bat.data(), Bat.size());
+        }
+
+        File.Flush();
+    }
+
+    // The CHS algorithm from the VHD specification.
+    std::uint32_t ComputeVhdGeometry(
+        std::uint64_t VirtualSize)
+    {
+        std::uint64_t TotalSectors = std::min<std::uint64_t>(
+            VirtualSize / VhdSectorSize,
+            65535 * 16 * 255);
+        std::uint64_t SectorsPerTrack = 0;
+        std::uint64_t Heads = 0;
+        std::uint64_t CylinderTimesHeads = 0;
+        if (TotalSectors >= 65535 * 16 * 63)
+        {
+            SectorsPerTrack = 255;
+            Heads = 16;
+            CylinderTimesHeads = TotalSectors / SectorsPerTrack;
+        }
+        else
+        {
+            SectorsPerTrack = 17;
+            CylinderTimesHeads = TotalSectors / SectorsPerTrack;
+            Heads = std::max<std::uint64_t>(
+                (CylinderTimesHeads + 1023) / 1024,
+                4);
+            if (CylinderTimesHeads >= Heads * 1024 || Heads > 16)
+            {
+                SectorsPerTrack = 31;
+                Heads = 16;
+                CylinderTimesHeads = TotalSectors / SectorsPerTrack;
+            }
+            if (CylinderTimesHeads >= Heads * 1024)
+            {
+                SectorsPerTrack = 63;
+                Heads = 16;
+                CylinderTimesHeads = TotalSectors / SectorsPerTrack;
+            }
+        }
+        std::uint64_t Cylinders = CylinderTimesHeads / Heads;
+        return static_cast<std::uint32_t>(
+            (Cylinders << 16) | (Heads << 8) | SectorsPerTrack);
+    }
+
+    void CreateVhdFile(
+        std::string const& Path,
+        NanaBox::VirtualDiskCreateParameters const& Parameters,
+        NanaBox::VirtualDiskImage const* Parent,
+        NanaBox::VirtualDiskProgressHandler const& ProgressHandler)
+    {
+        bool Differencing =
+            NanaBox::VirtualDiskType::Differencing == Parameters.Type;
+        bool Fixed = NanaBox::VirtualDiskType::Fixed == Parameters.Type;
+
+        std::uint64_t VirtualSize = Parameters.VirtualSize;
+        if (Differencing)
+        {
+            if (NanaBox::VirtualDiskFormat::Vhd !=
+                Parent->GetInformation().Format)
+            {
+                ::ThrowFormatError(Path, "The parent must be a VHD file");
+            }
+            VirtualSize = Parent->GetInformation().VirtualSize;
+        }
+
+        std::uint32_t BlockSize = Parameters.BlockSize
+            ? Parameters.BlockSize
+            : VhdDefaultBlockSize;
+        if (BlockSize < VhdSectorSize * 8 ||
+            BlockSize > VhdxMaximumBlockSize ||
+            !::IsPowerOfTwo(BlockSize) ||
+            !VirtualSize ||
+            VirtualSize > VhdMaximumVirtualSize ||
+            VirtualSize % VhdSectorSize)
+        {
+            ::ThrowFormatError(Path, "Invalid creation parameters");
+        }
+
+        std::uint8_t Footer[VhdFooterSize] = {};
+        std::memcpy(Footer, "conectix", 8);
+        ::StoreBE32(Footer + 8, 0x00000002);
+        ::StoreBE32(Footer + 12, 0x00010000);
+        ::StoreBE64(Footer + 16, Fixed ? ~0ULL : VhdFooterSize);
+        ::StoreBE32(Footer + 24, static_cast<std::uint32_t>(
+            std::time(nullptr) - VhdTimeStampBase));
+        std::memcpy(Footer + 28, "nnbx", 4);
+        ::StoreBE32(Footer + 32, 0x00010004);
+        ::StoreBE32(Footer + 36, 0x5769326B);
+        ::StoreBE64(Footer + 40, VirtualSize);
+        ::StoreBE64(Footer + 48, VirtualSize);
+        ::StoreBE32(Footer + 56, ::ComputeVhdGeometry(VirtualSize));
+        ::StoreBE32(Footer + 60, Fixed
+            ? VhdDiskTypeFixed
+            : (Differencing ? VhdDiskTypeDifferencing : VhdDiskTypeDynamic));
+        NanaBox::VirtualDiskGuid UniqueId = NanaBox::GenerateVirtualDiskGuid();
+        std::memcpy(Footer + 68, UniqueId.Bytes, 16);
+        ::StoreBE32(Footer + 64, ::ComputeVhdChecksum(
+            Footer,
+            VhdFooterSize,
+            64));
+
+        NanaBox::VirtualDiskFile File(Path, true, true);
+
+        if (Fixed)
+        {
+            File.Allocate(
+                VirtualSize,
+                Parameters.SkipZeroing,
+                ProgressHandler);
+            File.Write(VirtualSize, Footer, VhdFooterSize);
+            File.Flush();
+            return;
+        }
+
+        std::uint32_t MaxTableEntries = static_cast<std::uint32_t>(
+            (VirtualSize + BlockSize - 1) / BlockSize);
+        const std::uint64_t TableOffset =
+            VhdFooterSize + VhdDynamicHeaderSize;
+        std::vector<std::uint8_t> Bat(
+            static_cast<std::size_t>(::RoundUp(
+                MaxTableEntries * 4ULL,
+                VhdSectorSize)),
+            0xFF);
+        File.Write(TableOffset, Bat.data(), Bat.size());
+        std::uint64_t NextOffset = TableOffset + Bat.size();
+
+        std::uint8_t Header[VhdDynamicHeaderSize] = {};
+        std::memcpy(Header, "cxsparse", 8);
+        ::StoreBE64(Header + 8, ~0ULL);
+        ::StoreBE64(Header + 16, TableOffset);
+        ::StoreBE32(Header + 24, 0x00010000);
+        ::StoreBE32(Header + 28, MaxTableEntries);
+        ::StoreBE32(Header + 32, BlockSize);
+
+        if (Differencing)
+        {
+            std::memcpy(
+                Header + 40,
+                Parent->GetInformation().DiskId.Bytes,
+                16);
+
+            std::string FullPath = ::GetFullPath(Path);
+            std::string ParentFullPath = ::GetFullPath(Parent->GetPath());
+            std::vector<std::uint8_t> Name = ::Utf8ToUtf16(
+                ParentFullPath.substr(ParentFullPath.find_last_of("\\/") + 1),
+                true);
+            std::memcpy(Header + 64, Name.data(), std::min<std::size_t>(
+                Name.size(),
+                512));
+
+            std::vector<std::pair<std::uint32_t, std::string>> Locators;
+            std::string RelativePath = ::GetRelativePath(
+                FullPath,
+                ParentFullPath);
+            if (!RelativePath.empty())
+            {
+                Locators.emplace_back(VhdPlatformCodeW2ru, RelativePath);
+            }
+#ifdef _WIN32
+            Locators.emplace_back(VhdPlatformCodeW2ku, ParentFullPath);
+#endif
+            for (std::size_t i = 0; i < Locators.size(); ++i)
+            {
+                std::vector<std::uint8_t> Data =
+                    ::Utf8ToUtf16(Locators[i].second, false);
+                std::uint64_t Space = ::RoundUp(Data.size(), VhdSectorSize);
+                std::uint8_t* Entry = Header + 576 + 24 * i;
+                ::StoreBE32(Entry, Locators[i].first);
+                ::StoreBE32(Entry + 4, static_cast<std::uint32_t>(Space));
+                ::StoreBE32(Entry + 8, static_cast<std::uint32_t>(Data.size()));
+                ::StoreBE64(Entry + 16, NextOffset);
+                Data.resize(static_cast<std::size_t>(Space));
+                File.Write(NextOffset, Data.data(), Data.size());
+                NextOffset += Space;
+            }
+        }
+
+        ::StoreBE32(Header + 36, ::ComputeVhdChecksum(
+            Header,
+            VhdDynamicHeaderSize,
+            36));
+
+        File.Write(0, Footer, VhdFooterSize);
+        File.Write(VhdFooterSize, Header, VhdDynamicHeaderSize);
+        File.Write(NextOffset, Footer, VhdFooterSize);
+        File.Flush();
+    }
+}
+
+bool NanaBox::VirtualDiskGuid::IsNull() const
+{
+    return *this == NanaBox::VirtualDiskGuid();
+}
+
+bool NanaBox::VirtualDiskGuid::operator==(
+    NanaBox::VirtualDiskGuid const& Other) const
+{
+    return 0 == std::memcmp(this->Bytes, Other.Bytes, sizeof(this->Bytes));
+}
+
+bool NanaBox::VirtualDiskGuid::operator!=(
+    NanaBox::VirtualDiskGuid const& Other) const
+{
+    return !(*this == Other);
+}
+
+NanaBox::VirtualDiskGuid NanaBox::GenerateVirtualDiskGuid()
+{
+    static std::random_device Device;
+    NanaBox::VirtualDiskGuid Result;
+    for (std::size_t i = 0; i < sizeof(Result.Bytes); i += 4)
+    {
+        ::StoreLE32(Result.Bytes + i, Device());
+    }
+    // The version 4 and the variant 1 of RFC 4122.
+    Result.Bytes[7] = static_cast<std::uint8_t>((Result.Bytes[7] & 0x0F) | 0x40);
+    Result.Bytes[8] = static_cast<std::uint8_t>((Result.Bytes[8] & 0x3F) | 0x80);
+    return Result;
+}
+
+std::string NanaBox::FormatVirtualDiskGuid(
+    NanaBox::VirtualDiskGuid const& Value)
+{
+    char Buffer[64];
+    std::snprintf(
+        Buffer,
+        sizeof(Buffer),
+        "{%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X}",
+        ::LoadLE32(Value.Bytes),
+        ::LoadLE16(Value.Bytes + 4),
+        ::LoadLE16(Value.Bytes + 6),
+        Value.Bytes[8],
+        Value.Bytes[9],
+        Value.Bytes[10],
+        Value.Bytes[11],
+        Value.Bytes[12],
+        Value.Bytes[13],
+        Value.Bytes[14],
+        Value.Bytes[15]);
+    return Buffer;
+}
+
+bool NanaBox::ParseVirtualDiskGuid(
+    std::string const& Text,
+    NanaBox::VirtualDiskGuid& Value)
+{
+    std::string Content = Text;
+    if (Content.size() == 38 && '{' == Content.front() && '}' == Content.back())
+    {
+        Content = Content.substr(1, 36);
+    }
+    if (Content.size() != 36)
+    {
+        return false;
+    }
+
+    std::uint8_t Bytes[16];
+    std::size_t Count = 0;
+    for (std::size_t i = 0; i < Content.size();)
+    {
+        if (8 == i || 13 == i || 18 == i || 23 == i)
+        {
+            if ('-' != Content[i])
+            {
+                return false;
+            }
+            ++i;
+            continue;
+        }
+
+        int Digits[2];
+        for (std::size_t j = 0; j < 2; ++j)
+        {
+            char Character = Content[i + j];
+            if (Character >= '0' && Character <= '9')
+            {
+                Digits[j] = Character - '0';
+            }
+            else if (Character >= 'a' && Character <= 'f')
+            {
+                Digits[j] = Character - 'a' + 10;
+            }
+            else if (Character >= 'A' && Character <= 'F')
+            {
+                Digits[j] = Character - 'A' + 10;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        Bytes[Count++] = static_cast<std::uint8_t>((Digits[0] << 4) | Digits[1]);
+        i += 2;
+    }
+
+    // The first three fields are stored in the little-endian order.
+    Value = ::MakeGuid(
+        ::LoadBE32(Bytes),
+        ::LoadBE16(Bytes + 4),
+        ::LoadBE16(Bytes + 6),
+        ::LoadBE64(Bytes + 8));
+    return true;
+}
+
+NanaBox::VirtualDiskBuffer::VirtualDiskBuffer(
+    std::size_t Size) :
+    m_Storage(new std::uint8_t[Size + 4096]),
+    m_Size(Size)
+{
+    std::uintptr_t Address =
+        reinterpret_cast<std::uintptr_t>(this->m_Storage.get());
+    this->m_Data = this->m_Storage.get() + (4096 - Address % 4096) % 4096;
+}
+
+std::uint8_t* NanaBox::VirtualDiskBuffer::GetData() const
+{
+    return this->m_Data;
+}
+
+std::size_t NanaBox::VirtualDiskBuffer::GetSize() const
+{
+    return this->m_Size;
+}
+
+NanaBox::VirtualDiskFile::VirtualDiskFile(
+    std::string const& Path,
+    bool Writable,
+    bool Create,
+    bool Unbuffered) :
+    m_Writable(Writable)
+{
+#ifdef _WIN32
+    DWORD DesiredAccess = GENERIC_READ | (Writable ? GENERIC_WRITE : 0);
+    // The unbuffered handle is another handle with the write access.
+    DWORD ShareMode = Unbuffered
+        ? FILE_SHARE_READ | FILE_SHARE_WRITE
+        : FILE_SHARE_READ;
+    HANDLE FileHandle = ::CreateFileW(
+        ::ToWidePath(Path).c_str(),
+        DesiredAccess,
+        ShareMode,
+        nullptr,
+        Create ? CREATE_NEW : OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (INVALID_HANDLE_VALUE == FileHandle)
+    {
+        ::ThrowSystemError(("Opening " + Path).c_str());
+    }
+    this->m_FileHandle = FileHandle;
+
+    if (Unbuffered)
+    {
+        HANDLE UnbufferedFileHandle = ::ReOpenFile(
+            FileHandle,
+            DesiredAccess,
+            ShareMode,
+            FILE_FLAG_NO_BUFFERING);
+        if (INVALID_HANDLE_VALUE == UnbufferedFileHandle)
+        {
+            DWORD Error = ::GetLastError();
+            ::CloseHandle(FileHandle);
+            ::SetLastError(Error);
+            ::ThrowSystemError(("Opening " + Path + " unbuffered").c_str());
+        }
+        this->m_UnbufferedFileHandle = UnbufferedFileHandle;
+    }
+#else
+    int Flags = (Writable ? O_RDWR : O_RDONLY) | O_CLOEXEC;
+    if (Create)
+    {
+        Flags |= O_CREAT | O_EXCL;
+    }
+    this->m_FileDescriptor = ::open(Path.c_str(), Flags, 0644);
+    if (-1 == this->m_FileDescriptor)
+    {
+        ::ThrowSystemError(("Opening " + Path).c_str());
+    }
+
+    // Follows the share mode used on Windows, a writer excludes all the other
+    // opens and the readers only exclude the writers. The lock is advisory,
+    // so it only guards against the other instances of the library.
+    if (-1 == ::flock(
+        this->m_FileDescriptor,
+        (Writable ? LOCK_EX : LOCK_SH) | LOCK_NB))
+    {
+        int Error = errno;
+        ::close(this->m_FileDescriptor);
+        errno = Error;
+        ::ThrowSystemError(("Locking " + Path).c_str());
+    }
+
+    if (Unbuffered)
+    {
+        int UnbufferedFlags = (Writable ? O_RDWR : O_RDONLY) | O_CLOEXEC;
+#if defined(O_DIRECT)
+        this->m_UnbufferedFileDescriptor = ::open(
+            Path.c_str(),
+            UnbufferedFlags | O_DIRECT);
+#elif defined(F_NOCACHE)
+        this->m_UnbufferedFileDescriptor = ::open(
+            Path.c_str(),
+            UnbufferedFlags);
+        if (-1 != this->m_UnbufferedFileDescriptor &&
+            -1 == ::fcntl(this->m_UnbufferedFileDescriptor, F_NOCACHE, 1))
+        {
+            int Error = errno;
+            ::close(this->m_UnbufferedFileDescriptor);
+            this->m_UnbufferedFileDescriptor = -1;
+            errno = Error;
+        }
+#else
+        static_cast<void>(UnbufferedFlags);
+        errno = ENOTSUP;
+#endif
+        if (-1 == this->m_UnbufferedFileDescriptor)
+        {
+            int Error = errno;
+            ::close(this->m_FileDescriptor);
+            errno = Error;
+            ::ThrowSystemError(("Opening " + Path + " unbuffered").c_str());
+        }
+    }
+#endif
+}
+
+NanaBox::VirtualDiskFile::~VirtualDiskFile()
+{
+#ifdef _WIN32
+    if (this->m_UnbufferedFileHandle)
+    {
+        ::CloseHandle(this->m_UnbufferedFileHandle);
+    }
+    ::CloseHandle(this->m_FileHandle);
+#else
+    if (-1 != this->m_UnbufferedFileDescriptor)
+    {
+        ::close(this->m_UnbufferedFileDescriptor);
+    }
+    ::close(this->m_FileDescriptor);
+#endif
+}
+
+bool NanaBox::VirtualDiskFile::IsWritable() const
+{
+    return this->m_Writable;
+}
+
+bool NanaBox::VirtualDiskFile::IsUnbuffered() const
+{
+#ifdef _WIN32
+    return nullptr != this->m_UnbufferedFileHandle;
+#else
+    return -1 != this->m_UnbufferedFileDescriptor;
+#endif
+}
+
+bool NanaBox::VirtualDiskFile::IsUnbufferedAccess(
+    std::uint64_t Offset,
+    void const* Buffer,
+    std::size_t Size) const
+{
+    const std::size_t Alignment = NanaBox::VirtualDiskFile::UnbufferedAlignment;
+    return this->IsUnbuffered() &&
+        0 == Offset % Alignment &&
+        0 == Size % Alignment &&
+        0 == reinterpret_cast<std::uintptr_t>(Buffer) % Alignment;
+}
+
+std::uint64_t NanaBox::VirtualDiskFile::GetSize() const
+{
+#ifdef _WIN32
+    LARGE_INTEGER Size;
+    if (!::GetFileSizeEx(this->m_FileHandle, &Size))
+    {
+        ::ThrowSystemError("GetFileSizeEx");
+    }
+    return static_cast<std::uint64_t>(Size.QuadPart);
+#else
+    struct stat Status;
+    if (-1 == ::fstat(this->m_FileDescriptor, &Status))
+    {
+        ::ThrowSystemError("fstat");
+    }
+    return static_cast<std::uint64_t>(Status.st_size);
+#endif
+}
+
+void NanaBox::VirtualDiskFile::SetSize(
+    std::uint64_t Size)
+{
+#ifdef _WIN32
+    FILE_END_OF_FILE_INFO Information;
+    Information.EndOfFile.QuadPart = static_cast<LONGLONG>(Size);
+    if (!::SetFileInformationByHandle(
+        this->m_FileHandle,
+        FileEndOfFileInfo,
+        &Information,
+        sizeof(Information)))
+    {
+        ::ThrowSystemError("SetFileInformationByHandle");
+    }
+#else
+    if (-1 == ::ftruncate(this->m_FileDescriptor, static_cast<off_t>(Size)))
+    {
+        ::ThrowSystemError("ftruncate");
+    }
+#endif
+}
+
+void NanaBox::VirtualDiskFile::Allocate(
+    std::uint64_t Size,
+    bool SkipZeroing,
+    NanaBox::VirtualDiskProgressHandler const& ProgressHandler)
+{
+#ifdef _WIN32
+    std::uint64_t CurrentSize = this->GetSize();
+
+    FILE_ALLOCATION_INFO Information;
+    Information.AllocationSize.QuadPart = static_cast<LONGLONG>(Size);
+    if (!::SetFileInformationByHandle(
+        this->m_FileHandle,
+        FileAllocationInfo,
+        &Information,
+        sizeof(Information)))
+    {
+        ::ThrowSystemError("SetFileInformationByHandle");
+    }
+    this->SetSize(Size);
+    if (SkipZeroing)
+    {
+        ::EnableManageVolumePrivilege();
+        if (!::SetFileValidData(
+            this->m_FileHandle,
+            static_cast<LONGLONG>(Size)))
+        {
+            ::ThrowSystemError("SetFileValidData");
+        }
+        return;
+    }
+
+    // The new space is written in order, so the valid data length follows
+    // the writes and NTFS never needs to fill a gap.
+    const std::size_t ZeroChunkSize = 8 * MiB;
+    NanaBox::VirtualDiskBuffer Zero(ZeroChunkSize);
+    std::memset(Zero.GetData(), 0, Zero.GetSize());
+    for (std::uint64_t Offset = CurrentSize; Offset < Size;)
+    {
+        std::size_t Length = static_cast<std::size_t>(
+            std::min<std::uint64_t>(ZeroChunkSize, Size - Offset));
+        this->Write(Offset, Zero.GetData(), Length);
+        Offset += Length;
+        if (ProgressHandler)
+        {
+            ProgressHandler(Offset - CurrentSize, Size - CurrentSize);
+        }
+    }
+#else
+    // The unwritten extents always read as zero, so there is nothing to
+    // zero or skip here.
+    (void)SkipZeroing;
+    (void)ProgressHandler;
+#ifdef __linux__
+    std::uint64_t CurrentSize = this->GetSize();
+    if (Size > CurrentSize)
+    {
+        if (0 == ::fallocate(
+            this->m_FileDescriptor,
+            0,
+            static_cast<off_t>(CurrentSize),
+            static_cast<off_t>(Size - CurrentSize)))
+        {
+            return;
+        }
+        if (EOPNOTSUPP != errno)
+        {
+            ::ThrowSystemError("fallocate");
+        }
+    }
+#endif
+    this->SetSize(Size);
+#endif
+}
+
+void NanaBox::VirtualDiskFile::Read(
+    std::uint64_t Offset,
+    void* Buffer,
+    std::size_t Size) const
+{
+    std::uint8_t* Current = static_cast<std::uint8_t*>(Buffer);
+    while (Size)
+    {
+#ifdef _WIN32
+        OVERLAPPED Overlapped = {};
+        Overlapped.Offset = static_cast<DWORD>(Offset);
+        Overlapped.OffsetHigh = static_cast<DWORD>(Offset >> 32);
+        DWORD Transferred = 0;
+        if (!::ReadFile(
+            this->IsUnbufferedAccess(Offset, Current, Size)
+            ? this->m_UnbufferedFileHandle
+            : this->m_FileHandle,
+            Current,
+            static_cast<DWORD>(std::min<std::size_t>(Size, 1 << 30)),
+            &Transferred,
+            &Overlapped))
+        {
+            ::ThrowSystemError("ReadFile");
+        }
+#else
+        ssize_t Transferred = ::pread(
+            this->IsUnbufferedAccess(Offset, Current, Size)
+            ? this->m_UnbufferedFileDescriptor
+            : this->m_FileDescriptor,
+            Current,
+            std::min<std::size_t>(Size, 1 << 30),
+            static_cast<off_t>(Offset));
+        if (-1 == Transferred)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            ::ThrowSystemError("pread");
+        }
+#endif
+        if (!Transferred)
+        {
+            throw std::runtime_error("Unexpected end of the file");
+        }
+        Current += Transferred;
+        Offset += Transferred;
+        Size -= Transferred;
+    }
+}
+
+void NanaBox::VirtualDiskFile::Write(
+    std::uint64_t Offset,
+    void const* Buffer,
+    std::size_t Size)
+{
+    std::uint8_t const* Current = static_cast<std::uint8_t const*>(Buffer);
+    while (Size)
+    {
+#ifdef _WIN32
+        OVERLAPPED Overlapped = {};
+        Overlapped.Offset = static_cast<DWORD>(Offset);
+        Overlapped.OffsetHigh = static_cast<DWORD>(Offset >> 32);
+        DWORD Transferred = 0;
+        if (!::WriteFile(
+            this->IsUnbufferedAccess(Offset, Current, Size)
+            ? this->m_UnbufferedFileHandle
+            : this->m_FileHandle,
+            Current,
+            static_cast<DWORD>(std::min<std::size_t>(Size, 1 << 30)),
+            &Transferred,
+            &Overlapped))
+        {
+            ::ThrowSystemError("WriteFile");
+        }
+#else
+        ssize_t Transferred = ::pwrite(
+            this->IsUnbufferedAccess(Offset, Current, Size)
+            ? this->m_UnbufferedFileDescriptor
+            : this->m_FileDescriptor,
+            Current,
+            std::min<std::size_t>(Size, 1 << 30),
+            static_cast<off_t>(Offset));
+        if (-1 == Transferred)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            ::ThrowSystemError("pwrite");
+        }
+#endif
+        Current += Transferred;
+        Offset += Transferred;
+        Size -= Transferred;
+    }
+}
+
+void NanaBox::VirtualDiskFile::Flush()
+{
+    if (!this->m_Writable)
+    {
+        return;
+    }
+
+#ifdef _WIN32
+    if (!::FlushFileBuffers(this->m_FileHandle))
+    {
+        ::ThrowSystemError("FlushFileBuffers");
+    }
+#else
+    if (-1 == ::fsync(this->m_FileDescriptor))
+    {
+        ::ThrowSystemError("fsync");
+    }
+#endif
+}
+
+NanaBox::VirtualDiskMapping::VirtualDiskMapping(
+    NanaBox::VirtualDiskFile const& File,
+    std::uint64_t Offset,
+    std::size_t Size,
+    bool Writable)
+{
+    if (!Size)
+    {
+        return;
+    }
+
+#ifdef _WIN32
+    SYSTEM_INFO SystemInfo;
+    ::GetSystemInfo(&SystemInfo);
+    std::uint64_t Alignment = SystemInfo.dwAllocationGranularity;
+#else
+    std::uint64_t Alignment = static_cast<std::uint64_t>(
+        ::sysconf(_SC_PAGESIZE));
+#endif
+    std::uint64_t AlignedOffset = Offset / Alignment * Alignment;
+    std::size_t BaseSize = static_cast<std::size_t>(
+        Offset - AlignedOffset + Size);
+
+#ifdef _WIN32
+    HANDLE MappingHandle = ::CreateFileMappingW(
+        File.m_FileHandle,
+        nullptr,
+        Writable ? PAGE_READWRITE : PAGE_READONLY,
+        0,
+        0,
+        nullptr);
+    if (!MappingHandle)
+    {
+        ::ThrowSystemError("CreateFileMappingW");
+    }
+    // The view keeps the section alive after the handle is closed.
+    void* Base = ::MapViewOfFile(
+        MappingHandle,
+        Writable ? FILE_MAP_WRITE : FILE_MAP_READ,
+        static_cast<DWORD>(AlignedOffset >> 32),
+        static_cast<DWORD>(AlignedOffset),
+        BaseSize);
+    ::CloseHandle(MappingHandle);
+    if (!Base)
+    {
+        ::ThrowSystemError("MapViewOfFile");
+    }
+#else
+    void* Base = ::mmap(
+        nullptr,
+        BaseSize,
+        PROT_READ | (Writable ? PROT_WRITE : 0),
+        MAP_SHARED,
+        File.m_FileDescriptor,
+        static_cast<off_t>(AlignedOffset));
+    if (MAP_FAILED == Base)
+    {
+        ::ThrowSystemError("mmap");
+    }
+#endif
+
+    this->m_Base = Base;
+    this->m_BaseSize = BaseSize;
+    this->m_Data = static_cast<std::uint8_t*>(Base) + (Offset - AlignedOffset);
+    this->m_Size = Size;
+}
+
+NanaBox::VirtualDiskMapping::~VirtualDiskMapping()
+{
+    this->Reset();
+}
+
+NanaBox::VirtualDiskMapping::VirtualDiskMapping(
+    NanaBox::VirtualDiskMapping&& Other) noexcept
+{
+    *this = std::move(Other);
+}
+
+NanaBox::VirtualDiskMapping& NanaBox::VirtualDiskMapping::operator=(
+    NanaBox::VirtualDiskMapping&& Other) noexcept
+{
+    if (this != &Other)
+    {
+        this->Reset();
+        this->m_Base = Other.m_Base;
+        this->m_BaseSize = Other.m_BaseSize;
+        this->m_Data = Other.m_Data;
+        this->m_Size = Other.m_Size;
+        Other.m_Base = nullptr;
+        Other.m_BaseSize = 0;
+        Other.m_Data = nullptr;
+        Other.m_Size = 0;
+    }
+    return *this;
+}
+
+std::uint8_t* NanaBox::VirtualDiskMapping::GetData() const
+{
+    return this->m_Data;
+}
+
+std::size_t NanaBox::VirtualDiskMapping::GetSize() const
+{
+    return this->m_Size;
+}
+
+void NanaBox::VirtualDiskMapping::Flush()
+{
+    if (!this->m_Base)
+    {
+        return;
+    }
+
+#ifdef _WIN32
+    ::FlushViewOfFile(this->m_Base, this->m_BaseSize);
+#else
+    ::msync(this->m_Base, this->m_BaseSize, MS_SYNC);
+#endif
+}
+
+void NanaBox::VirtualDiskMapping::Reset()
+{
+    if (!this->m_Base)
+    {
+        return;
+    }
+
+#ifdef _WIN32
+    ::UnmapViewOfFile(this->m_Base);
+#else
+    ::munmap(this->m_Base, this->m_BaseSize);
+#endif
+    this->m_Base = nullptr;
+    this->m_BaseSize = 0;
+    this->m_Data = nullptr;
+    this->m_Size = 0;
+}
+
+std::unique_ptr<NanaBox::VirtualDiskImage> NanaBox::VirtualDiskImage::Open(
+    std::string const& Path,
+    bool Writable,
+    bool Unbuffered)
+{
+    char Identifier[8] = {};
+    {
+        NanaBox::VirtualDiskFile File(Path, false);
+        if (File.GetSize() >= sizeof(Identifier))
+        {
+            File.Read(0, Identifier, sizeof(Identifier));
+        }
+    }
+
+    if (0 == std::memcmp(Identifier, "vhdxfile", sizeof(Identifier)))
+    {
+        return std::make_unique<::VhdxImage>(Path, Writable, Unbuffered);
+    }
+    return std::make_unique<::VhdImage>(Path, Writable, Unbuffered);
+}
+
+std::unique_ptr<NanaBox::VirtualDiskImage> NanaBox::VirtualDiskImage::Create(
+    std::string const& Path,
+    NanaBox::VirtualDiskCreateParameters const& Parameters,
+    NanaBox::VirtualDiskProgressHandler const& ProgressHandler)
+{
+    std::unique_ptr<NanaBox::VirtualDiskImage> Parent;
+    if (NanaBox::VirtualDiskType::Differencing == Parameters.Type)
+    {
+        if (Parameters.ParentPath.empty())
+        {
+            ::ThrowFormatError(Path, "The parent path is required");
+        }
+        Parent = NanaBox::OpenVirtualDiskChain(Parameters.ParentPath, false);
+    }
+
+    if (::FileExists(Path))
+    {
+        ::ThrowFormatError(Path, "The file already exists");
+    }
+
+    try
+    {
+        if (NanaBox::VirtualDiskFormat::Vhdx == Parameters.Format)
+        {
+            ::CreateVhdxFile(Path, Parameters, Parent.get(), ProgressHandler);
+        }
+        else
+        {
+            ::CreateVhdFile(Path, Parameters, Parent.get(), ProgressHandler);
+        }
+    }
+    catch (...)
+    {
+        NanaBox::RemoveVirtualDiskFile(Path);
+        throw;
+    }
+
+    std::unique_ptr<NanaBox::VirtualDiskImage> Result =
+        NanaBox::VirtualDiskImage::Open(Path, true);
+    if (Parent)
+    {
+        Result->SetParent(std::move(Parent));
+    }
+    return Result;
+}
+
+std::string const& NanaBox::VirtualDiskImage::GetPath() const
+{
+    return this->m_Path;
+}
+
+NanaBox::VirtualDiskInformation const&
+NanaBox::VirtualDiskImage::GetInformation() const
+{
+    return this->m_Information;
+}
+
+NanaBox::VirtualDiskFile& NanaBox::VirtualDiskImage::GetFile()
+{
+    return this->m_File;
+}
+
+NanaBox::VirtualDiskFile const& NanaBox::VirtualDiskImage::GetFile() const
+{
+    return this->m_File;
+}
+
+std::size_t NanaBox::VirtualDiskImage::GetReplayedLogEntryCount() const
+{
+    return this->m_ReplayedLogEntryCount;
+}
+
+std::vector<std::string> NanaBox::VirtualDiskImage::GetParentPathCandidates() const
+{
+    std::vector<std::string> Result;
+    if (NanaBox::VirtualDiskType::Differencing != this->m_Information.Type)
+    {
+        return Result;
+    }
+
+    NanaBox::VirtualDiskParentLocator const& Locator =
+        this->m_Information.Parent;
+    if (!Locator.RelativePath.empty())
+    {
+        std::string RelativePath = Locator.RelativePath;
+        while (RelativePath.size() > 2 &&
+            '.' == RelativePath[0] &&
+            ::IsPathSeparator(RelativePath[1]))
+        {
+            RelativePath.erase(0, 2);
+        }
+        Result.push_back(::ToNativeSeparators(
+            ::GetDirectory(this->m_Path) + "\\" + RelativePath));
+    }
+#ifdef _WIN32
+    if (!Locator.VolumePath.empty())
+    {
+        Result.push_back(Locator.VolumePath);
+    }
+    if (!Locator.AbsolutePath.empty())
+    {
+        Result.push_back(Locator.AbsolutePath);
+    }
+#else
+    // The Windows paths can't be resolved on other platforms.
+    if (!Locator.AbsolutePath.empty() && '/' == Locator.AbsolutePath[0])
+    {
+        Result.push_back(Locator.AbsolutePath);
+    }
+#endif
+    return Result;
+}
+
+std::unique_ptr<NanaBox::VirtualDiskImage>
+NanaBox::VirtualDiskImage::OpenParent() const
+{
+    for (std::string const& Candidate : this->GetParentPathCandidates())
+    {
+        if (!::FileExists(Candidate))
+        {
+            continue;
+        }
+
+        std::unique_ptr<NanaBox::VirtualDiskImage> Parent =
+            NanaBox::VirtualDiskImage::Open(
+                Candidate,
+                false,
+                this->m_File.IsUnbuffered());
+        NanaBox::VirtualDiskInformation const& Information =
+            Parent->GetInformation();
+        NanaBox::VirtualDiskParentLocator const& Locator =
+            this->m_Information.Parent;
+        bool Matched = false;
+        if (Information.Format != this->m_Information.Format)
+        {
+            Matched = false;
+        }
+        else if (NanaBox::VirtualDiskFormat::Vhdx == Information.Format)
+        {
+            Matched = Information.DataWriteGuid == Locator.Linkage ||
+                Information.DataWriteGuid == Locator.AlternativeLinkage;
+        }
+        else
+        {
+            Matched = Information.DiskId == Locator.Linkage;
+        }
+        if (!Matched)
+        {
+            ::ThrowFormatError(
+                Candidate,
+                "The parent doesn't match the linkage of the differencing "
+                "disk, it may be modified after the child was created");
+        }
+        return Parent;
+    }
+
+    return nullptr;
+}
+
+NanaBox::VirtualDiskImage* NanaBox::VirtualDiskImage::GetParent() const
+{
+    return this->m_Parent.get();
+}
+
+void NanaBox::VirtualDiskImage::SetParent(
+    std::unique_ptr<NanaBox::VirtualDiskImage>&& Parent)
+{
+    this->m_Parent = std::move(Parent);
+}
+
+std::uint64_t NanaBox::VirtualDiskImage::GetAllocatedBlockCount() const
+{
+    std::uint64_t Result = 0;
+    for (std::uint64_t i = 0; i < this->m_Information.BlockCount; ++i)
+    {
+        NanaBox::VirtualDiskBlockState State = this->GetBlockState(i);
+        if (NanaBox::VirtualDiskBlockState::FullyPresent == State ||
+            NanaBox::VirtualDiskBlockState::PartiallyPresent == State)
+        {
+            ++Result;
+        }
+    }
+    return Result;
+}
+
+std::vector<std::pair<std::uint64_t, std::uint64_t>>
+NanaBox::VirtualDiskImage::GetMetadataFileRanges() const
+{
+    ::ThrowFormatError(this->m_Path, "The format is not supported");
+}
+
+void NanaBox::VirtualDiskImage::SetBlockAllocation(
+    std::uint64_t BlockIndex,
+    NanaBox::VirtualDiskBlockState State,
+    std::uint64_t FileOffset)
+{
+    static_cast<void>(BlockIndex);
+    static_cast<void>(State);
+    static_cast<void>(FileOffset);
+    ::ThrowFormatError(this->m_Path, "The format is not supported");
+}
+
+void NanaBox::VirtualDiskImage::Resize(
+    std::uint64_t VirtualSize,
+    NanaBox::VirtualDiskProgressHandler const& ProgressHandler)
+{
+    static_cast<void>(VirtualSize);
+    static_cast<void>(ProgressHandler);
+    ::ThrowFormatError(this->m_Path, "The format is not supported");
+}
+
+void NanaBox::VirtualDiskImage::Read(
+    std::uint64_t Offset,
+    void* Buffer,
+    std::size_t Size) const
+{
+    if (Offset > this->m_Information.VirtualSize ||
+        Size > this->m_Information.VirtualSize - Offset)
+    {
+        throw std::out_of_range("The range is out of the virtual disk");
+    }
+
+    std::uint8_t* Current = static_cast<std::uint8_t*>(Buffer);
+    std::uint32_t BlockSize = this->m_Information.BlockSize;
+    while (Size)
+    {
+        std::uint32_t BlockOffset = static_cast<std::uint32_t>(
+            Offset % BlockSize);
+        std::size_t Length = std::min<std::size_t>(
+            Size,
+            BlockSize - BlockOffset);
+        this->ReadBlock(Offset / BlockSize, BlockOffset, Current, Length);
+        Current += Length;
+        Offset += Length;
+        Size -= Length;
+    }
+}
+
+void NanaBox::VirtualDiskImage::Write(
+    std::uint64_t Offset,
+    void const* Buffer,
+    std::size_t Size)
+{
+    if (Offset > this->m_Information.VirtualSize ||
+        Size > this->m_Information.VirtualSize - Offset)
+    {
+        throw std::out_of_range("The range is out of the virtual disk");
+    }
+    std::uint32_t SectorSize = this->m_Information.LogicalSectorSize;
+    if (Offset % SectorSize || Size % SectorSize)
+    {
+        throw std::invalid_argument(
+            "The range is not aligned to the logical sector size");
+    }
+
+    std::uint8_t const* Current = static_cast<std::uint8_t const*>(Buffer);
+    std::uint32_t BlockSize = this->m_Information.BlockSize;
+    while (Size)
+    {
+        std::uint32_t BlockOffset = static_cast<std::uint32_t>(
+            Offset % BlockSize);
+        std::size_t Length = std::min<std::size_t>(
+            Size,
+            BlockSize - BlockOffset);
+        this->WriteBlock(Offset / BlockSize, BlockOffset, Current, Length);
+        Current += Length;
+        Offset += Length;
+        Size -= Length;
+    }
+}
+
+void NanaBox::VirtualDiskImage::Flush()
+{
+    this->m_File.Flush();
+}
+
+NanaBox::VirtualDiskImage::VirtualDiskImage(
+    std::string const& Path,
+    bool Writable,
+    bool Unbuffered) :
+    m_Path(Path),
+    m_File(Path, Writable, false, Unbuffered)
+{
+}
+
+void NanaBox::VirtualDiskImage::ReadFromParent(
+    std::uint64_t Offset,
+    std::uint8_t* Buffer,
+    std::size_t Size) const
+{
+    if (this->m_Parent)
+    {
+        this->m_Parent->Read(Offset, Buffer, Size);
+    }
+    else if (NanaBox::VirtualDiskType::Differencing == this->m_Information.Type)
+    {
+        ::ThrowFormatError(this->m_Path, "The parent is not attached");
+    }
+    else
+    {
+        std::memset(Buffer, 0, Size);
+    }
+}
+
+std::unique_ptr<NanaBox::VirtualDiskImage> NanaBox::OpenVirtualDiskChain(
+    std::string const& Path,
+    bool Writable,
+    bool Unbuffered)
+{
+    // The same limit as the depth of the differencing chains of Hyper-V.
+    const std::size_t MaximumDepth = 128;
+
+    std::unique_ptr<NanaBox::VirtualDiskImage> Result =
+        NanaBox::VirtualDiskImage::Open(Path, Writable, Unbuffered);
+    NanaBox::VirtualDiskImage* Current = Result.get();
+    for (std::size_t Depth = 0;
+        NanaBox::VirtualDiskType::Differencing ==
+        Current->GetInformation().Type;
+        ++Depth)
+    {
+        if (Depth >= MaximumDepth)
+        {
+            ::ThrowFormatError(Path, "The differencing chain is too deep");
+        }
+
+        std::unique_ptr<NanaBox::VirtualDiskImage> Parent =
+            Current->OpenParent();
+        if (!Parent)
+        {
+            ::ThrowFormatError(
+                Current->GetPath(),
+                "The parent can't be found");
+        }
+        NanaBox::VirtualDiskImage* Next = Parent.get();
+        Current->SetParent(std::move(Parent));
+        Current = Next;
+    }
+    return Result;
+}
+
+std::string NanaBox::FormatVirtualDiskSize(
+    std::uint64_t Size)
+{
+    const char* Units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    std::size_t Index = 0;
+    double Value = static_cast<double>(Size);
+    while (Value >= 1024 && Index + 1 < sizeof(Units) / sizeof(*Units))
+    {
+        Value /= 1024;
+        ++Index;
+    }
+
+    char Buffer[64];
+    std::snprintf(Buffer, sizeof(Buffer), "%.2f %s", Value, Units[Index]);
+    return Buffer;
+}
+
+void NanaBox::RemoveVirtualDiskFile(
+    std::string const& Path)
+{
+#ifdef _WIN32
+    ::DeleteFileW(::ToWidePath(Path).c_str());
+#else
+    ::unlink(Path.c_str());
+#endif
+}
+
+bool NanaBox::IsAvx2Supported()
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    int Registers[4];
+    ::__cpuid(Registers, 0);
+    if (Registers[0] < 7)
+    {
+        return false;
+    }
+    ::__cpuid(Registers, 1);
+    // The OSXSAVE and AVX bits, and the YMM state is enabled by the OS.
+    const int OsxsaveAndAvx = (1 << 27) | (1 << 28);
+    if ((Registers[2] & OsxsaveAndAvx) != OsxsaveAndAvx ||
+        (::_xgetbv(0) & 0x6) != 0x6)
+    {
+        return false;
+    }
+    ::__cpuidex(Registers, 7, 0);
+    return Registers[1] & (1 << 5);
+#elif defined(__x86_64__)
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+std::string NanaBox::GetVirtualDiskFullPath(
+    std::string const& Path)
+{
+    return ::GetFullPath(Path);
+}
+
+std::string NanaBox::ResolveVirtualDiskPath(
+    std::string const& Path,
+    std::string const& ReferenceFilePath)
+{
+#ifdef _WIN32
+    bool Absolute = (!Path.empty() && ::IsPathSeparator(Path[0])) ||
+        (Path.size() > 1 && ':' == Path[1]);
+#else
+    bool Absolute = !Path.empty() && '/' == Path[0];
+#endif
+    if (Absolute)
+    {
+        return ::ToNativeSeparators(Path);
+    }
+
+    std::string RelativePath = Path;
+    while (RelativePath.size() > 2 &&
+        '.' == RelativePath[0] &&
+        ::IsPathSeparator(RelativePath[1]))
+    {
+        RelativePath.erase(0, 2);
+    }
+    return ::ToNativeSeparators(
+        ::GetDirectory(ReferenceFilePath) + "\\" + RelativePath);
+}
+
+void NanaBox::RunVirtualDiskWorkers(
+    std::size_t Count,
+    std::size_t MaxParallelism,
+    std::function<void(
+        std::size_t WorkerIndex,
+        std::size_t Index)> const& Handler)
+{
+    if (!MaxParallelism)
+    {
+        MaxParallelism = std::max<std::size_t>(
+            std::thread::hardware_concurrency(),
+            1);
+    }
+    std::size_t WorkerCount = std::min(Count, MaxParallelism);
+    std::atomic<std::size_t> NextIndex(0);
+    std::atomic<bool> Stopped(false);
+    std::exception_ptr Exception;
+    std::mutex ExceptionMutex;
+
+    auto Worker = [&](std::size_t WorkerIndex)
+    {
+        while (!Stopped)
+        {
+            std::size_t Index = NextIndex++;
+            if (Index >= Count)
+            {
+                break;
+            }
+
+            try
+            {
+                Handler(WorkerIndex, Index);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> Lock(ExceptionMutex);
+                if (!Exception)
+                {
+                    Exception = std::current_exception();
+                }
+                Stopped = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> Threads;
+    for (std::size_t i = 1; i < WorkerCount; ++i)
+    {
+        Threads.emplace_back(Worker, i);
+    }
+    Worker(0);
+    for (std::thread& Thread : Threads)
+    {
+        Thread.join();
+    }
+
+    if (Exception)
+    {
+        std::rethrow_exception(Exception);
+    }
+}
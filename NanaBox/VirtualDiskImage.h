@@ -0,0 +1,479 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualDiskImage.h
+ * PURPOSE:   Definition for the Portable VHDX and VHD Image Library
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_VIRTUAL_DISK_IMAGE
+#define NANABOX_VIRTUAL_DISK_IMAGE
+
+#if (defined(__cplusplus) && __cplusplus >= 201703L)
+#elif (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#else
+#error "[VirtualDiskImage] You should use a C++ compiler with the C++17 standard."
+#endif
+
+// This module only uses the file system primitives of the platform instead of
+// the VirtDisk API, so the images can also be inspected and processed on the
+// machines without Hyper-V and on other platforms. The paths are UTF-8 and the
+// errors are reported via std::runtime_error, the failed system calls are
+// reported via std::system_error with the Win32 error code on Windows and the
+// errno value on other platforms.
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace NanaBox
+{
+    enum class VirtualDiskFormat : std::uint32_t
+    {
+        Vhd = 0,
+        Vhdx = 1,
+    };
+
+    enum class VirtualDiskType : std::uint32_t
+    {
+        Fixed = 0,
+        Dynamic = 1,
+        Differencing = 2,
+    };
+
+    // The payload block states defined by the VHDX specification. The blocks
+    // of VHD are reported as NotPresent, FullyPresent or PartiallyPresent, and
+    // the latter means the sector bitmap of the block needs to be checked.
+    enum class VirtualDiskBlockState : std::uint8_t
+    {
+        NotPresent = 0,
+        Undefined = 1,
+        Zero = 2,
+        Unmapped = 3,
+        FullyPresent = 6,
+        PartiallyPresent = 7,
+    };
+
+    struct VirtualDiskGuid
+    {
+        // In the on-disk layout, which is the same as the GUID structure of
+        // Windows on little-endian machines.
+        std::uint8_t Bytes[16] = {};
+
+        bool IsNull() const;
+
+        bool operator==(
+            VirtualDiskGuid const& Other) const;
+
+        bool operator!=(
+            VirtualDiskGuid const& Other) const;
+    };
+
+    VirtualDiskGuid GenerateVirtualDiskGuid();
+
+    // Formats as "{XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX}".
+    std::string FormatVirtualDiskGuid(
+        VirtualDiskGuid const& Value);
+
+    // Accepts the formats with or without the braces.
+    bool ParseVirtualDiskGuid(
+        std::string const& Text,
+        VirtualDiskGuid& Value);
+
+    // The completed and the total bytes of a long running operation. The
+    // total may grow when the later phases of the operation are planned. It
+    // may be called from the worker threads, but not concurrently.
+    using VirtualDiskProgressHandler = std::function<void(
+        std::uint64_t CompletedBytes,
+        std::uint64_t TotalBytes)>;
+
+    class VirtualDiskMapping;
+
+    // The positional file access used by the library, which doesn't depend on
+    // the file pointer, so it can be shared by multiple threads.
+    //
+    // If Unbuffered is true, the file is also opened with O_DIRECT or
+    // FILE_FLAG_NO_BUFFERING, and the I/O which is aligned to
+    // UnbufferedAlignment in the offset, the size and the buffer bypasses the
+    // cache of the system, while the other I/O like the metadata still uses
+    // the cache. The file systems which don't support it fail to open.
+    class VirtualDiskFile
+    {
+    public:
+
+        static const std::size_t UnbufferedAlignment = 4096;
+
+        VirtualDiskFile(
+            std::string const& Path,
+            bool Writable,
+            bool Create = false,
+            bool Unbuffered = false);
+
+        ~VirtualDiskFile();
+
+        VirtualDiskFile(VirtualDiskFile const&) = delete;
+        VirtualDiskFile& operator=(VirtualDiskFile const&) = delete;
+
+        bool IsWritable() const;
+
+        bool IsUnbuffered() const;
+
+        std::uint64_t GetSize() const;
+
+        void SetSize(
+            std::uint64_t Size);
+
+        // Extends the file to Size bytes with the space reserved on the
+        // volume, which reads as zero. Linux allocates the unwritten extents
+        // via fallocate, which falls back to a sparse file if the file system
+        // doesn't support it. Windows reserves the clusters and writes zeros
+        // to the new space up front with the progress reported, because NTFS
+        // would otherwise zero the space beyond the valid data length
+        // synchronously in the later writes. If SkipZeroing is true, the valid
+        // data length is moved to the end via SetFileValidData instead, which
+        // needs SeManageVolumePrivilege and exposes the stale content of the
+        // volume in the new space.
+        void Allocate(
+            std::uint64_t Size,
+            bool SkipZeroing,
+            VirtualDiskProgressHandler const& ProgressHandler = nullptr);
+
+        void Read(
+            std::uint64_t Offset,
+            void* Buffer,
+            std::size_t Size) const;
+
+        void Write(
+            std::uint64_t Offset,
+            void const* Buffer,
+            std::size_t Size);
+
+        void Flush();
+
+    private:
+
+        friend class VirtualDiskMapping;
+
+        bool m_Writable = false;
+#ifdef _WIN32
+        void* m_FileHandle = nullptr;
+        void* m_UnbufferedFileHandle = nullptr;
+#else
+        int m_FileDescriptor = -1;
+        int m_UnbufferedFileDescriptor = -1;
+#endif
+
+        bool IsUnbufferedAccess(
+            std::uint64_t Offset,
+            void const* Buffer,
+            std::size_t Size) const;
+    };
+
+    // A memory-mapped view of the file, the range doesn't need to be aligned
+    // and must be inside the file.
+    class VirtualDiskMapping
+    {
+    public:
+
+        VirtualDiskMapping() = default;
+
+        VirtualDiskMapping(
+            VirtualDiskFile const& File,
+            std::uint64_t Offset,
+            std::size_t Size,
+            bool Writable);
+
+        ~VirtualDiskMapping();
+
+        VirtualDiskMapping(VirtualDiskMapping const&) = delete;
+        VirtualDiskMapping& operator=(VirtualDiskMapping const&) = delete;
+
+        VirtualDiskMapping(
+            VirtualDiskMapping&& Other) noexcept;
+
+        VirtualDiskMapping& operator=(
+            VirtualDiskMapping&& Other) noexcept;
+
+        std::uint8_t* GetData() const;
+
+        std::size_t GetSize() const;
+
+        void Flush();
+
+    private:
+
+        void Reset();
+
+        void* m_Base = nullptr;
+        std::size_t m_BaseSize = 0;
+        std::uint8_t* m_Data = nullptr;
+        std::size_t m_Size = 0;
+    };
+
+    // A page aligned buffer for the bulk I/O, which is friendly to the
+    // unbuffered I/O and the aligned SIMD loads.
+    class VirtualDiskBuffer
+    {
+    public:
+
+        VirtualDiskBuffer() = default;
+
+        explicit VirtualDiskBuffer(
+            std::size_t Size);
+
+        std::uint8_t* GetData() const;
+
+        std::size_t GetSize() const;
+
+    private:
+
+        std::unique_ptr<std::uint8_t[]> m_Storage;
+        std::uint8_t* m_Data = nullptr;
+        std::size_t m_Size = 0;
+    };
+
+    // Whether the processor and the operating system support AVX2, which is
+    // used by the SIMD paths of the bulk data processing. Always false on the
+    // non-x64 platforms.
+    bool IsAvx2Supported();
+
+    struct VirtualDiskParentLocator
+    {
+        // The DataWriteGuid of the parent for VHDX, or the unique ID of the
+        // parent for VHD.
+        VirtualDiskGuid Linkage;
+        VirtualDiskGuid AlternativeLinkage;
+        std::string RelativePath;
+        std::string AbsolutePath;
+        std::string VolumePath;
+    };
+
+    struct VirtualDiskInformation
+    {
+        VirtualDiskFormat Format = VirtualDiskFormat::Vhdx;
+        VirtualDiskType Type = VirtualDiskType::Dynamic;
+        std::uint64_t VirtualSize = 0;
+        // VHD has no blocks for the fixed disks, the default block size of
+        // the dynamic VHD is reported to iterate them.
+        std::uint32_t BlockSize = 0;
+        std::uint32_t LogicalSectorSize = 512;
+        std::uint32_t PhysicalSectorSize = 512;
+        std::uint64_t BlockCount = 0;
+        // The Virtual Disk ID of VHDX, or the unique ID of VHD.
+        VirtualDiskGuid DiskId;
+        // Only for VHDX, which is used as the linkage by the children.
+        VirtualDiskGuid DataWriteGuid;
+        VirtualDiskParentLocator Parent;
+    };
+
+    struct VirtualDiskCreateParameters
+    {
+        VirtualDiskFormat Format = VirtualDiskFormat::Vhdx;
+        VirtualDiskType Type = VirtualDiskType::Dynamic;
+        // Ignored for the differencing disks, which use the size of the
+        // parent.
+        std::uint64_t VirtualSize = 0;
+        // Uses the default of Hyper-V if it is zero, which is 32 MiB for VHDX,
+        // 2 MiB for the differencing VHDX and 2 MiB for VHD.
+        std::uint32_t BlockSize = 0;
+        // VHD only supports 512-byte sectors, so they are ignored for it, and
+        // the differencing VHDX uses the logical sector size of the parent.
+        std::uint32_t LogicalSectorSize = 512;
+        std::uint32_t PhysicalSectorSize = 4096;
+        std::string ParentPath;
+        // Only for the fixed disks, whose payload is allocated without being
+        // zeroed on Windows, see VirtualDiskFile::Allocate. The stale content
+        // of the volume becomes visible to the guest, so it should only be
+        // used by the trusted administrators.
+        bool SkipZeroing = false;
+    };
+
+    class VirtualDiskImage
+    {
+    public:
+
+        // Detects the format from the content. A VHDX with a pending log is
+        // only accepted if Writable is true, and the log is replayed. The
+        // parents opened via OpenParent inherit Unbuffered, see
+        // VirtualDiskFile.
+        static std::unique_ptr<VirtualDiskImage> Open(
+            std::string const& Path,
+            bool Writable,
+            bool Unbuffered = false);
+
+        // Fails if the file exists. The parent is attached to the returned
+        // differencing disk. The progress is only reported while the payload
+        // of the fixed disks is zeroed, and the file is removed if the
+        // handler throws.
+        static std::unique_ptr<VirtualDiskImage> Create(
+            std::string const& Path,
+            VirtualDiskCreateParameters const& Parameters,
+            VirtualDiskProgressHandler const& ProgressHandler = nullptr);
+
+        virtual ~VirtualDiskImage() = default;
+
+        std::string const& GetPath() const;
+
+        VirtualDiskInformation const& GetInformation() const;
+
+        VirtualDiskFile& GetFile();
+
+        VirtualDiskFile const& GetFile() const;
+
+        // The number of log entries replayed while opening.
+        std::size_t GetReplayedLogEntryCount() const;
+
+        // The candidates resolved from the parent locator, in the order of
+        // preference, which are empty if the disk is not a differencing disk.
+        std::vector<std::string> GetParentPathCandidates() const;
+
+        // Opens the first existing candidate read-only and verifies the
+        // linkage, returns nullptr if no candidate exists.
+        std::unique_ptr<VirtualDiskImage> OpenParent() const;
+
+        VirtualDiskImage* GetParent() const;
+
+        void SetParent(
+            std::unique_ptr<VirtualDiskImage>&& Parent);
+
+        virtual VirtualDiskBlockState GetBlockState(
+            std::uint64_t BlockIndex) const = 0;
+
+        // Returns the offset of the payload of the block in the file, or zero
+        // if the block has no payload.
+        virtual std::uint64_t GetBlockFileOffset(
+            std::uint64_t BlockIndex) const = 0;
+
+        // One bit for each logical sector of the block in the least
+        // significant bit first order, the bit is set if the sector is
+        // present in this file.
+        virtual void GetBlockSectorBitmap(
+            std::uint64_t BlockIndex,
+            std::vector<std::uint8_t>& Bitmap) const = 0;
+
+        // The blocks with the payload in this file.
+        std::uint64_t GetAllocatedBlockCount() const;
+
+        // The ranges of the file used by the structures other than the payload
+        // blocks, as the pairs of the offset and the size. Only supported by
+        // VHDX.
+        virtual std::vector<std::pair<std::uint64_t, std::uint64_t>>
+            GetMetadataFileRanges() const;
+
+        // Changes the BAT entry of the block without touching the payload,
+        // which is used by the maintenance operations to unmap or move the
+        // payload blocks. The file offset must be 1 MiB aligned and is ignored
+        // for the states without the payload. Only supported by VHDX.
+        virtual void SetBlockAllocation(
+            std::uint64_t BlockIndex,
+            VirtualDiskBlockState State,
+            std::uint64_t FileOffset);
+
+        // Expands the virtual disk, the new space reads as zero. The BAT is
+        // moved to the end of the file if it doesn't fit in the BAT region,
+        // and the new blocks of the fixed disks are allocated. The virtual
+        // size is updated after everything else is flushed, so the image keeps
+        // the original size if it is interrupted, including by an exception
+        // thrown from the progress handler, which is called while the new
+        // blocks of the fixed disks are allocated. Only supported by the VHDX
+        // which is not a differencing disk.
+        virtual void Resize(
+            std::uint64_t VirtualSize,
+            VirtualDiskProgressHandler const& ProgressHandler = nullptr);
+
+        // Reads the virtual disk content, the data not present in the
+        // differencing disk is read from the parent, which must be attached.
+        void Read(
+            std::uint64_t Offset,
+            void* Buffer,
+            std::size_t Size) const;
+
+        // The offset and the size must be the multiples of the logical sector
+        // size. The new payload blocks are appended to the end of the file.
+        void Write(
+            std::uint64_t Offset,
+            void const* Buffer,
+            std::size_t Size);
+
+        virtual void Flush();
+
+    protected:
+
+        VirtualDiskImage(
+            std::string const& Path,
+            bool Writable,
+            bool Unbuffered);
+
+        virtual void ReadBlock(
+            std::uint64_t BlockIndex,
+            std::uint32_t BlockOffset,
+            std::uint8_t* Buffer,
+            std::size_t Size) const = 0;
+
+        virtual void WriteBlock(
+            std::uint64_t BlockIndex,
+            std::uint32_t BlockOffset,
+            std::uint8_t const* Buffer,
+            std::size_t Size) = 0;
+
+        // Reads the range of the virtual disk from the parent, or fills zeros
+        // if there is no parent.
+        void ReadFromParent(
+            std::uint64_t Offset,
+            std::uint8_t* Buffer,
+            std::size_t Size) const;
+
+        std::string m_Path;
+        VirtualDiskFile m_File;
+        VirtualDiskInformation m_Information;
+        std::unique_ptr<VirtualDiskImage> m_Parent;
+        std::size_t m_ReplayedLogEntryCount = 0;
+    };
+
+    // Opens the image and attaches all the parents. Throws if a parent can't
+    // be found.
+    std::unique_ptr<VirtualDiskImage> OpenVirtualDiskChain(
+        std::string const& Path,
+        bool Writable,
+        bool Unbuffered = false);
+
+    std::string FormatVirtualDiskSize(
+        std::uint64_t Size);
+
+    // Runs the handler for each index in [0, Count) with at most
+    // MaxParallelism threads, or the number of the logical processors if it
+    // is zero. The handler receives the index of the worker, which can be
+    // used to access the per-worker buffers. The first exception stops the
+    // other workers and is rethrown.
+    void RunVirtualDiskWorkers(
+        std::size_t Count,
+        std::size_t MaxParallelism,
+        std::function<void(
+            std::size_t WorkerIndex,
+            std::size_t Index)> const& Handler);
+
+    // Removes the file and ignores the failure, which is used to clean up the
+    // partially created images.
+    void RemoveVirtualDiskFile(
+        std::string const& Path);
+
+    // Returns the full path of the existing file, which identifies the files
+    // referenced via the different paths.
+    std::string GetVirtualDiskFullPath(
+        std::string const& Path);
+
+    // Resolves the path relative to the folder of the reference file, such as
+    // the paths of the virtual disks in the virtual machine configurations.
+    // The absolute paths are returned as is.
+    std::string ResolveVirtualDiskPath(
+        std::string const& Path,
+        std::string const& ReferenceFilePath);
+}
+
+#endif // !NANABOX_VIRTUAL_DISK_IMAGE
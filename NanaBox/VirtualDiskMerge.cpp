@@ -0,0 +1,496 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualDiskMerge.cpp
+ * PURPOSE:   Implementation for the Differencing Virtual Disk Merge Engine
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "VirtualDiskMerge.h"
+
+#include "VirtualDiskCompaction.h"
+#include "VirtualDiskConversion.h"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+namespace
+{
+    // The regions of the analysis are processed in batches to amortize the
+    // scheduling of the workers, because each region is only a few lookups.
+    const std::size_t AnalysisBatchRegionCount = 64;
+
+    std::size_t CountBits(
+        std::uint8_t Value)
+    {
+        std::size_t Result = 0;
+        for (; Value; Value &= Value - 1)
+        {
+            ++Result;
+        }
+        return Result;
+    }
+
+    // The sector bitmap of the last partially present block of an image,
+    // which is shared by the regions of the larger blocks.
+    struct BitmapCache
+    {
+        bool Valid = false;
+        std::uint64_t BlockIndex = 0;
+        std::vector<std::uint8_t> Bitmap;
+    };
+
+    // Returns true if any image of the chain has the payload in the range.
+    bool HasPresentData(
+        NanaBox::VirtualDiskImage const& Image,
+        std::uint64_t Offset,
+        std::uint64_t Length)
+    {
+        for (NanaBox::VirtualDiskImage const* Current = &Image;
+            Current;
+            Current = Current->GetParent())
+        {
+            std::uint32_t BlockSize = Current->GetInformation().BlockSize;
+            std::uint64_t LastBlock = std::min(
+                (Offset + Length - 1) / BlockSize,
+                Current->GetInformation().BlockCount - 1);
+            for (std::uint64_t i = Offset / BlockSize; i <= LastBlock; ++i)
+            {
+                NanaBox::VirtualDiskBlockState State =
+                    Current->GetBlockState(i);
+                if (NanaBox::VirtualDiskBlockState::FullyPresent == State ||
+                    NanaBox::VirtualDiskBlockState::PartiallyPresent == State)
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+}
+
+NanaBox::VirtualDiskReadAmplification
+NanaBox::AnalyzeVirtualDiskReadAmplification(
+    NanaBox::VirtualDiskImage const& Image,
+    std::size_t MaxParallelism)
+{
+    NanaBox::VirtualDiskInformation const& Information =
+        Image.GetInformation();
+
+    std::vector<NanaBox::VirtualDiskImage const*> Chain;
+    std::uint64_t RegionSize = Information.BlockSize;
+    for (NanaBox::VirtualDiskImage const* Current = &Image;
+        Current;
+        Current = Current->GetParent())
+    {
+        NanaBox::VirtualDiskInformation const& CurrentInformation =
+            Current->GetInformation();
+        if (CurrentInformation.LogicalSectorSize !=
+            Information.LogicalSectorSize ||
+            CurrentInformation.VirtualSize != Information.VirtualSize)
+        {
+            throw std::runtime_error(
+                Current->GetPath() + ": The geometry doesn't match the child");
+        }
+        RegionSize = std::min<std::uint64_t>(
+            RegionSize,
+            CurrentInformation.BlockSize);
+        Chain.push_back(Current);
+    }
+    if (NanaBox::VirtualDiskType::Differencing ==
+        Chain.back()->GetInformation().Type)
+    {
+        throw std::runtime_error(
+            Chain.back()->GetPath() + ": The parent is not attached");
+    }
+
+    if (!MaxParallelism)
+    {
+        MaxParallelism = std::max<std::size_t>(
+            std::thread::hardware_concurrency(),
+            1);
+    }
+
+    // The regions are the smallest block of the chain, so each region is in
+    // a single block of every image, and the offset of the region in the
+    // sector bitmap is byte aligned.
+    std::uint32_t SectorSize = Information.LogicalSectorSize;
+    std::uint64_t RegionCount =
+        (Information.VirtualSize + RegionSize - 1) / RegionSize;
+    std::size_t BatchCount = static_cast<std::size_t>(
+        (RegionCount + AnalysisBatchRegionCount - 1) /
+        AnalysisBatchRegionCount);
+    std::size_t WorkerCount = std::max<std::size_t>(
+        std::min(MaxParallelism, BatchCount),
+        1);
+
+    struct WorkerState
+    {
+        std::vector<std::uint64_t> ResolvedSectors;
+        std::vector<std::uint8_t> Resolved;
+        std::vector<::BitmapCache> Bitmaps;
+    };
+    std::vector<WorkerState> Workers(WorkerCount);
+    for (WorkerState& Worker : Workers)
+    {
+        Worker.ResolvedSectors.resize(Chain.size());
+        Worker.Bitmaps.resize(Chain.size());
+    }
+
+    NanaBox::RunVirtualDiskWorkers(
+        BatchCount,
+        MaxParallelism,
+        [&](std::size_t WorkerIndex, std::size_t Index)
+    {
+        WorkerState& Worker = Workers[WorkerIndex];
+        std::uint64_t FirstRegion = Index * AnalysisBatchRegionCount;
+        std::uint64_t LastRegion = std::min<std::uint64_t>(
+            FirstRegion + AnalysisBatchRegionCount,
+            RegionCount);
+        for (std::uint64_t Region = FirstRegion;
+            Region < LastRegion;
+            ++Region)
+        {
+            std::uint64_t Offset = Region * RegionSize;
+            std::uint64_t Sectors = std::min<std::uint64_t>(
+                RegionSize,
+                Information.VirtualSize - Offset) / SectorSize;
+            std::size_t Bytes = static_cast<std::size_t>((Sectors + 7) / 8);
+            std::uint8_t LastByteMask = (Sectors % 8)
+                ? static_cast<std::uint8_t>((1 << (Sectors % 8)) - 1)
+                : 0xFF;
+
+            Worker.Resolved.assign(Bytes, 0);
+            std::uint64_t ResolvedCount = 0;
+            for (std::size_t Level = 0; Level < Chain.size(); ++Level)
+            {
+                // The base resolves everything left, the sectors not present
+                // in it read as zero.
+                if (Level + 1 == Chain.size())
+                {
+                    Worker.ResolvedSectors[Level] += Sectors - ResolvedCount;
+                    break;
+                }
+
+                NanaBox::VirtualDiskImage const* Current = Chain[Level];
+                std::uint32_t BlockSize = Current->GetInformation().BlockSize;
+                std::uint64_t BlockIndex = Offset / BlockSize;
+                NanaBox::VirtualDiskBlockState State =
+                    Current->GetBlockState(BlockIndex);
+                if (NanaBox::VirtualDiskBlockState::NotPresent == State)
+                {
+                    continue;
+                }
+                if (NanaBox::VirtualDiskBlockState::PartiallyPresent != State)
+                {
+                    Worker.ResolvedSectors[Level] += Sectors - ResolvedCount;
+                    break;
+                }
+
+                ::BitmapCache& Cache = Worker.Bitmaps[Level];
+                if (!Cache.Valid || Cache.BlockIndex != BlockIndex)
+                {
+                    Current->GetBlockSectorBitmap(BlockIndex, Cache.Bitmap);
+                    Cache.BlockIndex = BlockIndex;
+                    Cache.Valid = true;
+                }
+
+                std::size_t First = static_cast<std::size_t>(
+                    Offset % BlockSize / SectorSize / 8);
+                std::uint64_t NewlyResolved = 0;
+                for (std::size_t i = 0;
+                    i < Bytes && First + i < Cache.Bitmap.size();
+                    ++i)
+                {
+                    std::uint8_t Present = static_cast<std::uint8_t>(
+                        Cache.Bitmap[First + i] & ~Worker.Resolved[i]);
+                    if (i + 1 == Bytes)
+                    {
+                        Present &= LastByteMask;
+                    }
+                    Worker.Resolved[i] |= Present;
+                    NewlyResolved += ::CountBits(Present);
+                }
+                Worker.ResolvedSectors[Level] += NewlyResolved;
+                ResolvedCount += NewlyResolved;
+                if (ResolvedCount == Sectors)
+                {
+                    break;
+                }
+            }
+        }
+    });
+
+    NanaBox::VirtualDiskReadAmplification Result;
+    Result.ChainDepth = Chain.size();
+    Result.ResolvedBytes.resize(Chain.size());
+    double LookedUpBytes = 0.0;
+    for (std::size_t Level = 0; Level < Chain.size(); ++Level)
+    {
+        for (WorkerState const& Worker : Workers)
+        {
+            Result.ResolvedBytes[Level] +=
+                Worker.ResolvedSectors[Level] * SectorSize;
+        }
+        LookedUpBytes +=
+            static_cast<double>(Result.ResolvedBytes[Level]) * (Level + 1);
+    }
+    if (Information.VirtualSize)
+    {
+        Result.ReadAmplification =
+            LookedUpBytes / static_cast<double>(Information.VirtualSize);
+    }
+    return Result;
+}
+
+NanaBox::VirtualDiskMergeResult NanaBox::MergeVirtualDiskIntoParent(
+    std::string const& ChildPath,
+    NanaBox::VirtualDiskMergeOptions const& Options,
+    NanaBox::VirtualDiskProgressHandler const& ProgressHandler)
+{
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point StartTime = Clock::now();
+
+    std::size_t MaxParallelism = Options.MaxParallelism
+        ? Options.MaxParallelism
+        : std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+    std::size_t ChunkSize = std::max<std::size_t>(
+        Options.ChunkSize / 4096 * 4096,
+        4096);
+
+    NanaBox::VirtualDiskMergeResult Result;
+
+    std::unique_ptr<NanaBox::VirtualDiskImage> Child =
+        NanaBox::OpenVirtualDiskChain(ChildPath, false);
+    NanaBox::VirtualDiskInformation const& Information =
+        Child->GetInformation();
+    if (NanaBox::VirtualDiskType::Differencing != Information.Type)
+    {
+        throw std::runtime_error(
+            ChildPath + ": The image is not a differencing disk");
+    }
+    Result.Before = NanaBox::AnalyzeVirtualDiskReadAmplification(
+        *Child,
+        MaxParallelism);
+    Result.TargetPath = Child->GetParent()->GetPath();
+
+    // The parent is opened writable below, which needs the read-only handles
+    // of the chain to be closed first. The sectors present in the child are
+    // read without the parent.
+    Child->SetParent(nullptr);
+    std::unique_ptr<NanaBox::VirtualDiskImage> Parent =
+        NanaBox::OpenVirtualDiskChain(Result.TargetPath, true);
+
+    // The part of the last block beyond the virtual size is not copied.
+    auto GetBlockLength = [&](std::uint64_t BlockIndex) -> std::uint64_t
+    {
+        return std::min<std::uint64_t>(
+            Information.BlockSize,
+            Information.VirtualSize - BlockIndex * Information.BlockSize);
+    };
+
+    // The blocks which are not present in the child are read from the
+    // parent, and all the other states hide the parent.
+    std::vector<std::uint64_t> Candidates;
+    std::vector<std::uint8_t> Bitmap;
+    for (std::uint64_t i = 0; i < Information.BlockCount; ++i)
+    {
+        NanaBox::VirtualDiskBlockState State = Child->GetBlockState(i);
+        if (NanaBox::VirtualDiskBlockState::NotPresent == State)
+        {
+            continue;
+        }
+        if (NanaBox::VirtualDiskBlockState::PartiallyPresent == State)
+        {
+            Child->GetBlockSectorBitmap(i, Bitmap);
+            std::uint64_t Sectors =
+                GetBlockLength(i) / Information.LogicalSectorSize;
+            std::uint64_t PresentSectors = 0;
+            for (std::uint64_t j = 0; j < Sectors; ++j)
+            {
+                if (Bitmap[j / 8] & (1 << (j % 8)))
+                {
+                    ++PresentSectors;
+                }
+            }
+            if (!PresentSectors)
+            {
+                continue;
+            }
+            Result.PresentBytes +=
+                PresentSectors * Information.LogicalSectorSize;
+        }
+        else
+        {
+            Result.PresentBytes += GetBlockLength(i);
+        }
+        Candidates.push_back(i);
+    }
+
+    std::vector<NanaBox::VirtualDiskBuffer> Buffers;
+    std::vector<std::vector<std::uint8_t>> Bitmaps;
+    for (std::size_t i = 0;
+        i < std::min(MaxParallelism, Candidates.size());
+        ++i)
+    {
+        Buffers.emplace_back(ChunkSize);
+        Bitmaps.emplace_back();
+    }
+
+    // The reads of the child run in parallel, and the writes are serialized
+    // because the parent appends the new blocks to the end of the file.
+    std::mutex WriteMutex;
+    std::uint64_t CompletedBytes = 0;
+    NanaBox::RunVirtualDiskWorkers(
+        Candidates.size(),
+        MaxParallelism,
+        [&](std::size_t WorkerIndex, std::size_t Index)
+    {
+        std::uint8_t* Buffer = Buffers[WorkerIndex].GetData();
+
+        auto CopyRange = [&](std::uint64_t Offset, std::uint64_t Length)
+        {
+            while (Length)
+            {
+                std::size_t Size = static_cast<std::size_t>(
+                    std::min<std::uint64_t>(ChunkSize, Length));
+                Child->Read(Offset, Buffer, Size);
+                bool Zero = NanaBox::IsZeroMemory(Buffer, Size);
+
+                std::lock_guard<std::mutex> Lock(WriteMutex);
+                if (Zero && !::HasPresentData(*Parent, Offset, Size))
+                {
+                    Result.SkippedZeroBytes += Size;
+                }
+                else
+                {
+                    Parent->Write(Offset, Buffer, Size);
+                    Result.CopiedBytes += Size;
+                }
+                CompletedBytes += Size;
+                if (ProgressHandler)
+                {
+                    ProgressHandler(CompletedBytes, Result.PresentBytes);
+                }
+
+                Offset += Size;
+                Length -= Size;
+            }
+        };
+
+        std::uint64_t BlockIndex = Candidates[Index];
+        std::uint64_t BlockOffset = BlockIndex * Information.BlockSize;
+        std::uint64_t BlockLength = GetBlockLength(BlockIndex);
+        if (NanaBox::VirtualDiskBlockState::PartiallyPresent !=
+            Child->GetBlockState(BlockIndex))
+        {
+            CopyRange(BlockOffset, BlockLength);
+            return;
+        }
+
+        std::vector<std::uint8_t>& SectorBitmap = Bitmaps[WorkerIndex];
+        Child->GetBlockSectorBitmap(BlockIndex, SectorBitmap);
+        std::uint32_t SectorSize = Information.LogicalSectorSize;
+        std::uint64_t Sectors = BlockLength / SectorSize;
+        std::uint64_t RunStart = 0;
+        std::uint64_t RunLength = 0;
+        for (std::uint64_t i = 0; i <= Sectors; ++i)
+        {
+            bool Present = i < Sectors &&
+                (SectorBitmap[i / 8] & (1 << (i % 8)));
+            if (Present)
+            {
+                if (!RunLength)
+                {
+                    RunStart = i;
+                }
+                ++RunLength;
+            }
+            else if (RunLength)
+            {
+                CopyRange(
+                    BlockOffset + RunStart * SectorSize,
+                    RunLength * SectorSize);
+                RunLength = 0;
+            }
+        }
+    });
+    Parent->Flush();
+
+    Result.After = NanaBox::AnalyzeVirtualDiskReadAmplification(
+        *Parent,
+        MaxParallelism);
+    Parent.reset();
+    Child.reset();
+
+    if (!Options.KeepChild)
+    {
+        NanaBox::RemoveVirtualDiskFile(ChildPath);
+    }
+
+    Result.Seconds = std::chrono::duration<double>(
+        Clock::now() - StartTime).count();
+    return Result;
+}
+
+NanaBox::VirtualDiskMergeResult NanaBox::MergeVirtualDiskChain(
+    std::string const& ChildPath,
+    std::string const& TargetPath,
+    NanaBox::VirtualDiskMergeOptions const& Options,
+    NanaBox::VirtualDiskProgressHandler const& ProgressHandler)
+{
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point StartTime = Clock::now();
+
+    NanaBox::VirtualDiskMergeResult Result;
+    Result.TargetPath = TargetPath;
+
+    std::unique_ptr<NanaBox::VirtualDiskImage> Chain =
+        NanaBox::OpenVirtualDiskChain(ChildPath, false);
+    Result.Before = NanaBox::AnalyzeVirtualDiskReadAmplification(
+        *Chain,
+        Options.MaxParallelism);
+
+    NanaBox::VirtualDiskImage const* Base = Chain.get();
+    while (Base->GetParent())
+    {
+        Base = Base->GetParent();
+    }
+
+    // The conversion only reads the ranges present in the chain and
+    // pipelines the reads with the writes of the target.
+    NanaBox::VirtualDiskConversionOptions ConversionOptions;
+    ConversionOptions.Format = Chain->GetInformation().Format;
+    ConversionOptions.Type = NanaBox::VirtualDiskType::Dynamic;
+    if (NanaBox::VirtualDiskType::Dynamic == Base->GetInformation().Type &&
+        Base->GetInformation().Format == ConversionOptions.Format)
+    {
+        ConversionOptions.BlockSize = Base->GetInformation().BlockSize;
+    }
+    NanaBox::VirtualDiskConversionResult ConversionResult =
+        NanaBox::ConvertVirtualDiskImage(
+            *Chain,
+            TargetPath,
+            ConversionOptions,
+            ProgressHandler);
+    Result.PresentBytes = ConversionResult.PresentBytes;
+    Result.CopiedBytes = ConversionResult.WrittenBytes;
+    Result.SkippedZeroBytes =
+        ConversionResult.PresentBytes - ConversionResult.WrittenBytes;
+    Chain.reset();
+
+    std::unique_ptr<NanaBox::VirtualDiskImage> Target =
+        NanaBox::VirtualDiskImage::Open(TargetPath, false);
+    Result.After = NanaBox::AnalyzeVirtualDiskReadAmplification(
+        *Target,
+        Options.MaxParallelism);
+
+    Result.Seconds = std::chrono::duration<double>(
+        Clock::now() - StartTime).count();
+    return Result;
+}
@@ -0,0 +1,93 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualDiskMerge.h
+ * PURPOSE:   Definition for the Differencing Virtual Disk Merge Engine
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_VIRTUAL_DISK_MERGE
+#define NANABOX_VIRTUAL_DISK_MERGE
+
+#include "VirtualDiskImage.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace NanaBox
+{
+    struct VirtualDiskReadAmplification
+    {
+        // The number of the images from the top of the chain to the base.
+        std::size_t ChainDepth = 0;
+        // The bytes of the virtual disk whose reads stop at each image of the
+        // chain, from the top to the base. The bytes which are not present in
+        // any image are counted for the base, which still has to be looked up
+        // to know that they read as zero.
+        std::vector<std::uint64_t> ResolvedBytes;
+        // The average number of the images looked up to read a byte of the
+        // virtual disk, which is 1.0 for the images without a parent.
+        double ReadAmplification = 0.0;
+    };
+
+    // Walks the BAT and the sector bitmaps of the chain in parallel without
+    // reading the payload. The image should have its parents attached.
+    VirtualDiskReadAmplification AnalyzeVirtualDiskReadAmplification(
+        VirtualDiskImage const& Image,
+        std::size_t MaxParallelism = 0);
+
+    struct VirtualDiskMergeOptions
+    {
+        // Uses the number of the logical processors if it is zero.
+        std::size_t MaxParallelism = 0;
+        // The size of each read, so the memory usage is bounded by
+        // MaxParallelism * ChunkSize regardless of the block size.
+        std::size_t ChunkSize = 1024 * 1024;
+        // Keeps the child after it is merged into the parent. The child is
+        // no longer valid because the parent is modified, so it is only
+        // useful for the diagnostics.
+        bool KeepChild = false;
+    };
+
+    struct VirtualDiskMergeResult
+    {
+        // The parent which the child is merged into, or the new image which
+        // the chain is merged into.
+        std::string TargetPath;
+        // The bytes which are present in the child or the chain.
+        std::uint64_t PresentBytes = 0;
+        std::uint64_t CopiedBytes = 0;
+        // The zero chunks which already read as zero in the target.
+        std::uint64_t SkippedZeroBytes = 0;
+        VirtualDiskReadAmplification Before;
+        VirtualDiskReadAmplification After;
+        double Seconds = 0.0;
+    };
+
+    // Copies the sectors present in the differencing disk into its parent
+    // and removes the differencing disk unless KeepChild is true. The present
+    // sectors are found via the BAT and the sector bitmaps, and they are read
+    // in parallel while the writes to the parent are serialized. The parent
+    // gets a new DataWriteGuid, so the other children of the parent become
+    // invalid, and so does the child if the merge is interrupted, although
+    // the content of the child is still the same.
+    VirtualDiskMergeResult MergeVirtualDiskIntoParent(
+        std::string const& ChildPath,
+        VirtualDiskMergeOptions const& Options,
+        VirtualDiskProgressHandler const& ProgressHandler = nullptr);
+
+    // Copies the content of the whole differencing chain to a new dynamic
+    // image which has no parent, the chain itself is not modified. The format
+    // follows the child and the block size follows the base of the chain.
+    VirtualDiskMergeResult MergeVirtualDiskChain(
+        std::string const& ChildPath,
+        std::string const& TargetPath,
+        VirtualDiskMergeOptions const& Options,
+        VirtualDiskProgressHandler const& ProgressHandler = nullptr);
+}
+
+#endif // !NANABOX_VIRTUAL_DISK_MERGE
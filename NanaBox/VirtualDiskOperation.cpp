@@ -0,0 +1,203 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualDiskOperation.cpp
+ * PURPOSE:   Implementation for the Asynchronous Virtual Disk Operations
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "VirtualDiskOperation.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+namespace
+{
+    // Thrown by the progress handler to unwind the operation when it is
+    // canceled, the portable library only stops at the consistent points.
+    class OperationCanceledError : public std::runtime_error
+    {
+    public:
+
+        OperationCanceledError() :
+            std::runtime_error("The operation is canceled")
+        {
+        }
+    };
+
+    class PortableVirtualDiskOperation : public NanaBox::VirtualDiskOperation
+    {
+    public:
+
+        using Task = std::function<void(
+            NanaBox::VirtualDiskProgressHandler const& ProgressHandler)>;
+
+        PortableVirtualDiskOperation(
+            std::uint64_t TotalValue,
+            Task const& Handler)
+        {
+            this->m_Progress.TotalValue = TotalValue;
+            this->m_Thread = std::thread([this, Handler]()
+            {
+                this->Run(Handler);
+            });
+        }
+
+        ~PortableVirtualDiskOperation()
+        {
+            this->Cancel();
+            this->m_Thread.join();
+        }
+
+        NanaBox::VirtualDiskOperationProgress GetProgress() const override
+        {
+            std::lock_guard<std::mutex> Lock(this->m_Mutex);
+            return this->m_Progress;
+        }
+
+        void Cancel() override
+        {
+            this->m_CancelRequested = true;
+        }
+
+        bool Wait(
+            std::uint32_t Milliseconds) override
+        {
+            std::unique_lock<std::mutex> Lock(this->m_Mutex);
+            return this->m_Finished.wait_for(
+                Lock,
+                std::chrono::milliseconds(Milliseconds),
+                [this]()
+            {
+                return NanaBox::VirtualDiskOperationState::Running !=
+                    this->m_Progress.State;
+            });
+        }
+
+    private:
+
+        void Run(
+            Task const& Handler)
+        {
+            NanaBox::VirtualDiskOperationState State =
+                NanaBox::VirtualDiskOperationState::Succeeded;
+            std::uint32_t ErrorCode = 0;
+            std::string ErrorMessage;
+            try
+            {
+                if (this->m_CancelRequested)
+                {
+                    throw OperationCanceledError();
+                }
+
+                Handler([this](
+                    std::uint64_t CompletedBytes,
+                    std::uint64_t TotalBytes)
+                {
+                    if (this->m_CancelRequested)
+                    {
+                        throw OperationCanceledError();
+                    }
+                    std::lock_guard<std::mutex> Lock(this->m_Mutex);
+                    this->m_Progress.CompletedValue = CompletedBytes;
+                    this->m_Progress.TotalValue = TotalBytes;
+                });
+            }
+            catch (OperationCanceledError const&)
+            {
+                State = NanaBox::VirtualDiskOperationState::Canceled;
+            }
+            catch (std::system_error const& Exception)
+            {
+                State = NanaBox::VirtualDiskOperationState::Failed;
+                ErrorCode = static_cast<std::uint32_t>(
+                    Exception.code().value());
+                ErrorMessage = Exception.what();
+            }
+            catch (std::exception const& Exception)
+            {
+                State = NanaBox::VirtualDiskOperationState::Failed;
+                ErrorMessage = Exception.what();
+            }
+
+            {
+                std::lock_guard<std::mutex> Lock(this->m_Mutex);
+                this->m_Progress.State = State;
+                this->m_Progress.ErrorCode = ErrorCode;
+                this->m_Progress.ErrorMessage = ErrorMessage;
+                if (NanaBox::VirtualDiskOperationState::Succeeded == State)
+                {
+                    this->m_Progress.CompletedValue =
+                        this->m_Progress.TotalValue;
+                }
+            }
+            this->m_Finished.notify_all();
+        }
+
+        mutable std::mutex m_Mutex;
+        std::condition_variable m_Finished;
+        std::atomic<bool> m_CancelRequested{ false };
+        NanaBox::VirtualDiskOperationProgress m_Progress;
+        std::thread m_Thread;
+    };
+}
+
+std::unique_ptr<NanaBox::VirtualDiskOperation>
+NanaBox::StartCreateVirtualDiskOperation(
+    std::string const& Path,
+    NanaBox::VirtualDiskCreateParameters const& Parameters)
+{
+    // Only zeroing the payload of the fixed disks reports the progress, and
+    // the other disks only write the headers and the metadata.
+    return std::make_unique<PortableVirtualDiskOperation>(
+        Parameters.VirtualSize,
+        [=](NanaBox::VirtualDiskProgressHandler const& ProgressHandler)
+    {
+        NanaBox::VirtualDiskImage::Create(Path, Parameters, ProgressHandler);
+    });
+}
+
+std::unique_ptr<NanaBox::VirtualDiskOperation>
+NanaBox::StartResizeVirtualDiskOperation(
+    std::string const& Path,
+    std::uint64_t VirtualSize)
+{
+    // Only zeroing the new payload of the fixed disks reports the progress,
+    // and the image keeps the original size if it is canceled meanwhile.
+    return std::make_unique<PortableVirtualDiskOperation>(
+        VirtualSize,
+        [=](NanaBox::VirtualDiskProgressHandler const& ProgressHandler)
+    {
+        std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+            NanaBox::VirtualDiskImage::Open(Path, true);
+        Image->Resize(VirtualSize, ProgressHandler);
+        Image->Flush();
+    });
+}
+
+std::unique_ptr<NanaBox::VirtualDiskOperation>
+NanaBox::StartCompactVirtualDiskOperation(
+    std::string const& Path,
+    NanaBox::VirtualDiskCompactionOptions const& Options)
+{
+    // The compaction flushes the BAT before each step which can't be undone,
+    // so it can be canceled at any progress report.
+    return std::make_unique<PortableVirtualDiskOperation>(
+        0,
+        [=](NanaBox::VirtualDiskProgressHandler const& ProgressHandler)
+    {
+        std::unique_ptr<NanaBox::VirtualDiskImage> Image =
+            NanaBox::VirtualDiskImage::Open(Path, true);
+        NanaBox::CompactVirtualDiskImage(*Image, Options, ProgressHandler);
+        Image->Flush();
+    });
+}
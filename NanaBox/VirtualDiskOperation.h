@@ -0,0 +1,82 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualDiskOperation.h
+ * PURPOSE:   Definition for the Asynchronous Virtual Disk Operations
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_VIRTUAL_DISK_OPERATION
+#define NANABOX_VIRTUAL_DISK_OPERATION
+
+#include "VirtualDiskImage.h"
+#include "VirtualDiskCompaction.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace NanaBox
+{
+    enum class VirtualDiskOperationState : std::uint32_t
+    {
+        Running = 0,
+        Succeeded = 1,
+        Failed = 2,
+        Canceled = 3,
+    };
+
+    struct VirtualDiskOperationProgress
+    {
+        VirtualDiskOperationState State = VirtualDiskOperationState::Running;
+        // The unit depends on the operation, the total may be zero if it is
+        // still unknown.
+        std::uint64_t CompletedValue = 0;
+        std::uint64_t TotalValue = 0;
+        // The system error code of the failure if it is known, which is the
+        // Win32 error code on Windows.
+        std::uint32_t ErrorCode = 0;
+        std::string ErrorMessage;
+    };
+
+    // A long running operation which runs in the background after it is
+    // started. The progress is polled in the same way as
+    // GetVirtualDiskOperationProgress of VirtDisk, so the operations of the
+    // VirtDisk API and the portable library can share the same user interface.
+    class VirtualDiskOperation
+    {
+    public:
+
+        virtual ~VirtualDiskOperation() = default;
+
+        virtual VirtualDiskOperationProgress GetProgress() const = 0;
+
+        // Requests the cancellation, the operation stops at the next
+        // consistent point and the state becomes Canceled. It does nothing if
+        // the operation is already finished.
+        virtual void Cancel() = 0;
+
+        // Returns true if the operation is finished before the timeout.
+        virtual bool Wait(
+            std::uint32_t Milliseconds) = 0;
+    };
+
+    // The operations of the portable library, which run on a background
+    // thread. The progress is reported in bytes.
+
+    std::unique_ptr<VirtualDiskOperation> StartCreateVirtualDiskOperation(
+        std::string const& Path,
+        VirtualDiskCreateParameters const& Parameters);
+
+    std::unique_ptr<VirtualDiskOperation> StartResizeVirtualDiskOperation(
+        std::string const& Path,
+        std::uint64_t VirtualSize);
+
+    std::unique_ptr<VirtualDiskOperation> StartCompactVirtualDiskOperation(
+        std::string const& Path,
+        VirtualDiskCompactionOptions const& Options);
+}
+
+#endif // !NANABOX_VIRTUAL_DISK_OPERATION
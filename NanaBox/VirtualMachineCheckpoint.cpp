@@ -0,0 +1,553 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualMachineCheckpoint.cpp
+ * PURPOSE:   Implementation for the Virtual Machine Checkpoint Operations
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "VirtualMachineCheckpoint.h"
+
+#include "Utils.h"
+
+#include <Mile.Helpers.h>
+
+#include <Shlwapi.h>
+
+#include <algorithm>
+#include <cstring>
+#include <set>
+
+namespace
+{
+    std::wstring ToAbsolutePath(
+        std::string const& Path)
+    {
+        return ::GetAbsolutePath(Mile::ToWideString(CP_UTF8, Path));
+    }
+
+    // The new files are placed in the same folder as the related files, and
+    // the paths keep the relative form of them.
+    std::string ReplaceFileName(
+        std::string const& Path,
+        std::string const& FileName)
+    {
+        std::size_t Separator = Path.find_last_of("\\/");
+        if (std::string::npos == Separator)
+        {
+            return FileName;
+        }
+        return Path.substr(0, Separator + 1) + FileName;
+    }
+
+    std::string GetFileExtension(
+        std::string const& Path)
+    {
+        std::size_t Separator = Path.find_last_of("\\/");
+        std::size_t Dot = Path.find_last_of('.');
+        if (std::string::npos == Dot ||
+            (std::string::npos != Separator && Dot < Separator))
+        {
+            return std::string();
+        }
+        return Path.substr(Dot);
+    }
+
+    std::string GenerateFileNameId()
+    {
+        GUID Id;
+        winrt::check_hresult(::CoCreateGuid(&Id));
+        return Mile::FormatString("%08x", Id.Data1);
+    }
+
+    std::string GetCurrentUtcTime()
+    {
+        SYSTEMTIME Time;
+        ::GetSystemTime(&Time);
+        return Mile::FormatString(
+            "%04u-%02u-%02uT%02u:%02u:%02uZ",
+            Time.wYear,
+            Time.wMonth,
+            Time.wDay,
+            Time.wHour,
+            Time.wMinute,
+            Time.wSecond);
+    }
+
+    // The differencing disks created for the checkpoints are named as
+    // "<Name>_<Index>_<Id>", which is used to make sure only them are deleted.
+    std::string GetDifferencingDiskFileName(
+        NanaBox::VirtualMachineConfiguration const& Configuration,
+        std::size_t Index,
+        std::string const& Id,
+        std::string const& ParentPath)
+    {
+        return Mile::FormatString(
+            "%s_%zu_%s%s",
+            Configuration.Name.c_str(),
+            Index,
+            Id.c_str(),
+            ::GetFileExtension(ParentPath).c_str());
+    }
+
+    // Only the printable characters which are also valid in the file names
+    // are allowed, because the checkpoint names are passed via the control
+    // commands and may be used to name the files by the tools.
+    bool IsValidCheckpointName(
+        std::string const& Name)
+    {
+        const std::size_t MaximumLength = 64;
+
+        if (Name.empty() ||
+            Name.size() > MaximumLength ||
+            ' ' == Name.back() ||
+            '.' == Name.back())
+        {
+            return false;
+        }
+
+        for (char const& Character : Name)
+        {
+            if (static_cast<unsigned char>(Character) < 0x20 ||
+                0x7F == Character ||
+                std::strchr("\\/:*?\"<>|", Character))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // The frozen disks are marked as read only after the differencing disks
+    // are created, and the attribute is cleared again if the operation fails
+    // so the virtual machine can still use the disks directly.
+    void MarkFrozenVirtualDisks(
+        std::vector<std::string> const& Paths,
+        std::vector<std::wstring>& FrozenDisks)
+    {
+        for (std::string const& Path : Paths)
+        {
+            if (Path.empty())
+            {
+                continue;
+            }
+
+            std::wstring AbsolutePath = ::ToAbsolutePath(Path);
+            DWORD Attributes = ::GetFileAttributesW(AbsolutePath.c_str());
+            if (INVALID_FILE_ATTRIBUTES != Attributes &&
+                (Attributes & FILE_ATTRIBUTE_READONLY))
+            {
+                continue;
+            }
+
+            winrt::check_win32(::SimpleSetVirtualDiskReadOnly(
+                AbsolutePath.c_str(),
+                TRUE));
+            FrozenDisks.push_back(AbsolutePath);
+        }
+    }
+
+    void ThawVirtualDisks(
+        std::vector<std::wstring> const& FrozenDisks)
+    {
+        for (std::wstring const& FrozenDisk : FrozenDisks)
+        {
+            ::SimpleSetVirtualDiskReadOnly(FrozenDisk.c_str(), FALSE);
+        }
+    }
+
+    // The memory state is read only while restoring, so it is shared via the
+    // hard link instead of copied whenever possible.
+    void LinkOrCopyFile(
+        std::wstring const& Source,
+        std::wstring const& Target)
+    {
+        if (!::CreateHardLinkW(Target.c_str(), Source.c_str(), nullptr))
+        {
+            winrt::check_bool(::CopyFileW(
+                Source.c_str(),
+                Target.c_str(),
+                TRUE));
+        }
+    }
+}
+
+NanaBox::CheckpointFileChanges NanaBox::CreateCheckpoint(
+    NanaBox::VirtualMachineConfiguration& Configuration,
+    std::string const& Name,
+    bool IncludeMemoryState)
+{
+    if (!::IsValidCheckpointName(Name))
+    {
+        winrt::throw_hresult(E_INVALIDARG);
+    }
+    for (NanaBox::CheckpointConfiguration const& Current
+        : Configuration.Checkpoints)
+    {
+        if (0 == _stricmp(Current.Name.c_str(), Name.c_str()))
+        {
+            winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS));
+        }
+    }
+
+    std::string Id = ::GenerateFileNameId();
+
+    NanaBox::CheckpointConfiguration Checkpoint;
+    Checkpoint.Name = Name;
+    Checkpoint.Parent = Configuration.CurrentCheckpoint;
+    Checkpoint.CreationTime = ::GetCurrentUtcTime();
+    Checkpoint.Disks.resize(Configuration.ScsiDevices.size());
+
+    NanaBox::CheckpointFileChanges Result;
+
+    std::vector<std::string> Children(Configuration.ScsiDevices.size());
+    std::vector<std::wstring> CreatedFiles;
+    try
+    {
+        for (std::size_t i = 0; i < Configuration.ScsiDevices.size(); ++i)
+        {
+            NanaBox::ScsiDeviceConfiguration const& ScsiDevice =
+                Configuration.ScsiDevices[i];
+            if (ScsiDevice.Type != NanaBox::ScsiDeviceType::VirtualDisk ||
+                ScsiDevice.Path.empty())
+            {
+                continue;
+            }
+
+            Children[i] = ::ReplaceFileName(
+                ScsiDevice.Path,
+                ::GetDifferencingDiskFileName(
+                    Configuration,
+                    i,
+                    Id,
+                    ScsiDevice.Path));
+            std::wstring ChildPath = ::ToAbsolutePath(Children[i]);
+            winrt::check_win32(::SimpleCreateDifferencingVirtualDisk(
+                ChildPath.c_str(),
+                ::ToAbsolutePath(ScsiDevice.Path).c_str()));
+            CreatedFiles.push_back(ChildPath);
+
+            Checkpoint.Disks[i] = ScsiDevice.Path;
+            Result.FrozenDisks.push_back(::ToAbsolutePath(ScsiDevice.Path));
+        }
+
+        // The guest state file is small and changed in place, so it is copied.
+        std::string GuestStateFile = Configuration.GuestStateFile.empty()
+            ? Configuration.Name + ".vmgs"
+            : Configuration.GuestStateFile;
+        if (::PathFileExistsW(::ToAbsolutePath(GuestStateFile).c_str()))
+        {
+            Checkpoint.GuestStateFile = ::ReplaceFileName(
+                GuestStateFile,
+                Mile::FormatString(
+                    "%s_%s.vmgs",
+                    Configuration.Name.c_str(),
+                    Id.c_str()));
+            std::wstring Target = ::ToAbsolutePath(Checkpoint.GuestStateFile);
+            winrt::check_bool(::CopyFileW(
+                ::ToAbsolutePath(GuestStateFile).c_str(),
+                Target.c_str(),
+                TRUE));
+            CreatedFiles.push_back(Target);
+        }
+
+        if (IncludeMemoryState && !Configuration.SaveStateFile.empty())
+        {
+            Checkpoint.SaveStateFile = ::ReplaceFileName(
+                Configuration.SaveStateFile,
+                Mile::FormatString(
+                    "%s_%s.vmrs",
+                    Configuration.Name.c_str(),
+                    Id.c_str()));
+            std::wstring Target = ::ToAbsolutePath(Checkpoint.SaveStateFile);
+            ::LinkOrCopyFile(
+                ::ToAbsolutePath(Configuration.SaveStateFile),
+                Target);
+            CreatedFiles.push_back(Target);
+        }
+    }
+    catch (...)
+    {
+        for (std::wstring const& CreatedFile : CreatedFiles)
+        {
+            ::MileDeleteFileIgnoreReadonlyAttribute(CreatedFile.c_str());
+        }
+        throw;
+    }
+
+    Configuration.CurrentCheckpointDisks.clear();
+    for (std::size_t i = 0; i < Children.size(); ++i)
+    {
+        if (!Children[i].empty())
+        {
+            Configuration.ScsiDevices[i].Path = Children[i];
+            Configuration.CurrentCheckpointDisks.push_back(Children[i]);
+        }
+    }
+    Configuration.Checkpoints.push_back(Checkpoint);
+    Configuration.CurrentCheckpoint = Name;
+
+    return Result;
+}
+
+NanaBox::CheckpointFileChanges NanaBox::RevertCheckpoint(
+    NanaBox::VirtualMachineConfiguration& Configuration,
+    std::string const& Name)
+{
+    auto Iterator = std::find_if(
+        Configuration.Checkpoints.begin(),
+        Configuration.Checkpoints.end(),
+        [&](NanaBox::CheckpointConfiguration const& Current)
+    {
+        return 0 == _stricmp(Current.Name.c_str(), Name.c_str());
+    });
+    if (Configuration.Checkpoints.end() == Iterator)
+    {
+        winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_NOT_FOUND));
+    }
+    NanaBox::CheckpointConfiguration Checkpoint = *Iterator;
+
+    std::set<std::string> FrozenFiles;
+    for (NanaBox::CheckpointConfiguration const& Current
+        : Configuration.Checkpoints)
+    {
+        FrozenFiles.insert(Current.Disks.begin(), Current.Disks.end());
+        FrozenFiles.insert(Current.SaveStateFile);
+    }
+
+    std::string Id = ::GenerateFileNameId();
+
+    std::vector<std::string> Children(Configuration.ScsiDevices.size());
+    std::string SaveStateFile;
+    std::vector<std::wstring> CreatedFiles;
+    std::vector<std::wstring> FrozenDisks;
+    try
+    {
+        std::size_t Count = std::min(
+            Configuration.ScsiDevices.size(),
+            Checkpoint.Disks.size());
+        for (std::size_t i = 0; i < Count; ++i)
+        {
+            if (Configuration.ScsiDevices[i].Type !=
+                NanaBox::ScsiDeviceType::VirtualDisk ||
+                Checkpoint.Disks[i].empty())
+            {
+                continue;
+            }
+
+            Children[i] = ::ReplaceFileName(
+                Checkpoint.Disks[i],
+                ::GetDifferencingDiskFileName(
+                    Configuration,
+                    i,
+                    Id,
+                    Checkpoint.Disks[i]));
+            std::wstring ChildPath = ::ToAbsolutePath(Children[i]);
+            winrt::check_win32(::SimpleCreateDifferencingVirtualDisk(
+                ChildPath.c_str(),
+                ::ToAbsolutePath(Checkpoint.Disks[i]).c_str()));
+            CreatedFiles.push_back(ChildPath);
+        }
+
+        if (!Checkpoint.SaveStateFile.empty())
+        {
+            SaveStateFile = ::ReplaceFileName(
+                Checkpoint.SaveStateFile,
+                Mile::FormatString(
+                    "%s_%s.SaveState.vmrs",
+                    Configuration.Name.c_str(),
+                    Id.c_str()));
+            std::wstring Target = ::ToAbsolutePath(SaveStateFile);
+            ::LinkOrCopyFile(
+                ::ToAbsolutePath(Checkpoint.SaveStateFile),
+                Target);
+            CreatedFiles.push_back(Target);
+        }
+
+        // The disks of the checkpoint are already frozen unless they are
+        // changed outside of NanaBox.
+        ::MarkFrozenVirtualDisks(Checkpoint.Disks, FrozenDisks);
+
+        // Overwriting the guest state file can't be undone, so it is the last
+        // step which may fail.
+        if (!Checkpoint.GuestStateFile.empty())
+        {
+            std::string GuestStateFile = Configuration.GuestStateFile.empty()
+                ? Configuration.Name + ".vmgs"
+                : Configuration.GuestStateFile;
+            winrt::check_bool(::CopyFileW(
+                ::ToAbsolutePath(Checkpoint.GuestStateFile).c_str(),
+                ::ToAbsolutePath(GuestStateFile).c_str(),
+                FALSE));
+        }
+    }
+    catch (...)
+    {
+        ::ThawVirtualDisks(FrozenDisks);
+        for (std::wstring const& CreatedFile : CreatedFiles)
+        {
+            ::MileDeleteFileIgnoreReadonlyAttribute(CreatedFile.c_str());
+        }
+        throw;
+    }
+
+    // The state after the checkpoint is discarded, which is never shared with
+    // the other checkpoints. Only the exact disks recorded as created by the
+    // checkpoint operations are deleted, the disks which are attached by the
+    // users are kept even if their names look like the generated ones.
+    std::set<std::string> CurrentCheckpointDisks(
+        Configuration.CurrentCheckpointDisks.begin(),
+        Configuration.CurrentCheckpointDisks.end());
+    NanaBox::CheckpointFileChanges Result;
+    Configuration.CurrentCheckpointDisks.clear();
+    for (std::size_t i = 0; i < Children.size(); ++i)
+    {
+        if (Children[i].empty())
+        {
+            continue;
+        }
+
+        std::string& Path = Configuration.ScsiDevices[i].Path;
+        if (FrozenFiles.end() == FrozenFiles.find(Path) &&
+            CurrentCheckpointDisks.end() != CurrentCheckpointDisks.find(Path))
+        {
+            Result.DiscardedFiles.push_back(::ToAbsolutePath(Path));
+        }
+        Path = Children[i];
+        Configuration.CurrentCheckpointDisks.push_back(Children[i]);
+    }
+    if (!Configuration.SaveStateFile.empty() &&
+        FrozenFiles.end() == FrozenFiles.find(Configuration.SaveStateFile))
+    {
+        Result.DiscardedFiles.push_back(
+            ::ToAbsolutePath(Configuration.SaveStateFile));
+    }
+    Configuration.SaveStateFile = SaveStateFile;
+    Configuration.CurrentCheckpoint = Checkpoint.Name;
+
+    return Result;
+}
+
+void NanaBox::ApplyCheckpointFileChanges(
+    NanaBox::CheckpointFileChanges const& Changes)
+{
+    // The frozen disks are only the parents in the written configuration, so
+    // the failures are reported without undoing the checkpoint operation.
+    for (std::wstring const& FrozenDisk : Changes.FrozenDisks)
+    {
+        DWORD Attributes = ::GetFileAttributesW(FrozenDisk.c_str());
+        if (INVALID_FILE_ATTRIBUTES != Attributes &&
+            (Attributes & FILE_ATTRIBUTE_READONLY))
+        {
+            continue;
+        }
+
+        winrt::check_win32(::SimpleSetVirtualDiskReadOnly(
+            FrozenDisk.c_str(),
+            TRUE));
+    }
+
+    for (std::wstring const& DiscardedFile : Changes.DiscardedFiles)
+    {
+        ::MileDeleteFileIgnoreReadonlyAttribute(DiscardedFile.c_str());
+    }
+}
+
+void NanaBox::FreezeCurrentVirtualDisks(
+    NanaBox::VirtualMachineConfiguration& Configuration)
+{
+    std::string Id = ::GenerateFileNameId();
+
+    std::vector<std::string> Parents(Configuration.ScsiDevices.size());
+    std::vector<std::string> Children(Configuration.ScsiDevices.size());
+    std::vector<std::wstring> CreatedFiles;
+    std::vector<std::wstring> FrozenDisks;
+    try
+    {
+        for (std::size_t i = 0; i < Configuration.ScsiDevices.size(); ++i)
+        {
+            NanaBox::ScsiDeviceConfiguration const& ScsiDevice =
+                Configuration.ScsiDevices[i];
+            if (ScsiDevice.Type != NanaBox::ScsiDeviceType::VirtualDisk ||
+                ScsiDevice.Path.empty())
+            {
+                continue;
+            }
+
+            std::wstring ParentPath = ::ToAbsolutePath(ScsiDevice.Path);
+            DWORD Attributes = ::GetFileAttributesW(ParentPath.c_str());
+            if (INVALID_FILE_ATTRIBUTES == Attributes)
+            {
+                winrt::throw_last_error();
+            }
+            if (Attributes & FILE_ATTRIBUTE_READONLY)
+            {
+                continue;
+            }
+
+            // Nothing may write to the disk after it is frozen, so the disks
+            // which are opened for writing are refused instead of frozen.
+            winrt::file_handle ParentHandle(::CreateFileW(
+                ParentPath.c_str(),
+                GENERIC_READ,
+                FILE_SHARE_READ,
+                nullptr,
+                OPEN_EXISTING,
+                FILE_ATTRIBUTE_NORMAL,
+                nullptr));
+            if (!ParentHandle)
+            {
+                winrt::throw_last_error();
+            }
+            ParentHandle.close();
+
+            Children[i] = ::ReplaceFileName(
+                ScsiDevice.Path,
+                ::GetDifferencingDiskFileName(
+                    Configuration,
+                    i,
+                    Id,
+                    ScsiDevice.Path));
+            std::wstring ChildPath = ::ToAbsolutePath(Children[i]);
+            winrt::check_win32(::SimpleCreateDifferencingVirtualDisk(
+                ChildPath.c_str(),
+                ParentPath.c_str()));
+            CreatedFiles.push_back(ChildPath);
+
+            Parents[i] = ScsiDevice.Path;
+        }
+
+        ::MarkFrozenVirtualDisks(Parents, FrozenDisks);
+    }
+    catch (...)
+    {
+        ::ThawVirtualDisks(FrozenDisks);
+        for (std::wstring const& CreatedFile : CreatedFiles)
+        {
+            ::MileDeleteFileIgnoreReadonlyAttribute(CreatedFile.c_str());
+        }
+        throw;
+    }
+
+    // The frozen disks are not the current state anymore, so they are never
+    // deleted when reverting to a checkpoint, while the new differencing disks
+    // are discarded like the ones created by the checkpoints.
+    for (std::size_t i = 0; i < Children.size(); ++i)
+    {
+        if (Children[i].empty())
+        {
+            continue;
+        }
+
+        std::vector<std::string>& Current =
+            Configuration.CurrentCheckpointDisks;
+        Current.erase(
+            std::remove(Current.begin(), Current.end(), Parents[i]),
+            Current.end());
+        Current.push_back(Children[i]);
+        Configuration.ScsiDevices[i].Path = Children[i];
+    }
+}
@@ -0,0 +1,68 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualMachineCheckpoint.h
+ * PURPOSE:   Definition for the Virtual Machine Checkpoint Operations
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_VIRTUAL_MACHINE_CHECKPOINT
+#define NANABOX_VIRTUAL_MACHINE_CHECKPOINT
+
+#include "ConfigurationManager.h"
+
+// A checkpoint freezes the current virtual disks as the read only parents and
+// redirects the writes to new differencing disks, so the checkpoints of a
+// virtual machine form the chains of the differencing disks which are
+// recorded in the configuration. The virtual machine must not be running for these operations,
+// and the relative paths are resolved via GetAbsolutePath.
+
+namespace NanaBox
+{
+    // The changes of the existing files which are only applied after the new
+    // configuration is written, so the configuration file never refers to the
+    // deleted files, or uses the frozen disks directly, if writing it fails.
+    struct CheckpointFileChanges
+    {
+        // The absolute paths of the disks to be marked as read only.
+        std::vector<std::wstring> FrozenDisks;
+        // The absolute paths of the files which are not used anymore.
+        std::vector<std::wstring> DiscardedFiles;
+    };
+
+    // Creates a named checkpoint from the current state. The save state file
+    // of a saved virtual machine is kept as the memory state of the checkpoint
+    // if IncludeMemoryState is true. Throws E_INVALIDARG if the name contains
+    // the characters which are not allowed in the file names. The disks of the
+    // checkpoint are returned to be frozen.
+    CheckpointFileChanges CreateCheckpoint(
+        VirtualMachineConfiguration& Configuration,
+        std::string const& Name,
+        bool IncludeMemoryState);
+
+    // Switches to new differencing disks of the frozen disks of the checkpoint
+    // without copying them, and restores the guest state and the memory state
+    // of it. The current differencing disks and save state file are returned
+    // to be deleted.
+    CheckpointFileChanges RevertCheckpoint(
+        VirtualMachineConfiguration& Configuration,
+        std::string const& Name);
+
+    // Applies the file changes returned by the checkpoint operations, it must
+    // be called after the new configuration is written.
+    void ApplyCheckpointFileChanges(
+        CheckpointFileChanges const& Changes);
+
+    // Freezes the current virtual disks and redirects the writes to new
+    // differencing disks like CreateCheckpoint without recording a checkpoint,
+    // so the frozen disks can be shared as the parents of the linked clones.
+    // The disks which are already read only are kept. Throws with
+    // ERROR_SHARING_VIOLATION if a disk is opened for writing, for example, by
+    // the running virtual machine.
+    void FreezeCurrentVirtualDisks(
+        VirtualMachineConfiguration& Configuration);
+}
+
+#endif // !NANABOX_VIRTUAL_MACHINE_CHECKPOINT
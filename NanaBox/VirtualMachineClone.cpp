@@ -0,0 +1,250 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualMachineClone.cpp
+ * PURPOSE:   Implementation for the Linked Clone Operations
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "VirtualMachineClone.h"
+
+#include "DependencyScheduler.h"
+
+#include "VirtualMachineCheckpoint.h"
+
+#include "Utils.h"
+
+#include <Mile.Helpers.h>
+
+#include <Shlwapi.h>
+
+#include <set>
+#include <stdexcept>
+
+NanaBox::VirtualMachineConfiguration NanaBox::CreateLinkedClone(
+    NanaBox::VirtualMachineConfiguration const& Source,
+    std::string const& Name,
+    std::wstring const& TargetDirectory)
+{
+    NanaBox::VirtualMachineConfiguration Configuration = Source;
+    Configuration.Name = Name;
+    Configuration.Pool = NanaBox::PoolConfiguration();
+    Configuration.GuestStateFile.clear();
+    Configuration.RuntimeStateFile.clear();
+    Configuration.SaveStateFile.clear();
+    Configuration.ChipsetInformation.UUID.clear();
+    Configuration.Checkpoints.clear();
+    Configuration.CurrentCheckpoint.clear();
+    Configuration.CurrentCheckpointDisks.clear();
+
+    // The Host Network Service assigns the MAC addresses from the dynamic
+    // range of the host when creating the endpoints, which never conflicts
+    // with the other virtual machines on the host.
+    for (NanaBox::NetworkAdapterConfiguration& NetworkAdapter
+        : Configuration.NetworkAdapters)
+    {
+        GUID EndpointId;
+        winrt::check_hresult(::CoCreateGuid(&EndpointId));
+        NetworkAdapter.EndpointId = winrt::to_string(::FromGuid(EndpointId));
+        NetworkAdapter.MacAddress.clear();
+    }
+
+    std::set<std::wstring> FileNames;
+    for (NanaBox::ScsiDeviceConfiguration& ScsiDevice
+        : Configuration.ScsiDevices)
+    {
+        if (ScsiDevice.Path.empty() ||
+            ScsiDevice.Type == NanaBox::ScsiDeviceType::PhysicalDevice)
+        {
+            continue;
+        }
+
+        std::wstring ParentPath = ::GetAbsolutePath(
+            Mile::ToWideString(CP_UTF8, ScsiDevice.Path));
+        if (ScsiDevice.Type != NanaBox::ScsiDeviceType::VirtualDisk)
+        {
+            ScsiDevice.Path = winrt::to_string(ParentPath);
+            continue;
+        }
+
+        // The parents are shared by all clones, so the writable ones are
+        // refused instead of being corrupted by the source later.
+        DWORD Attributes = ::GetFileAttributesW(ParentPath.c_str());
+        if (INVALID_FILE_ATTRIBUTES == Attributes)
+        {
+            winrt::throw_last_error();
+        }
+        if (!(Attributes & FILE_ATTRIBUTE_READONLY))
+        {
+            winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_INVALID_STATE));
+        }
+
+        std::wstring FileName = ::PathFindFileNameW(ParentPath.c_str());
+        if (!FileNames.insert(FileName).second)
+        {
+            FileName = Mile::FormatWideString(
+                L"%zu.%s",
+                FileNames.size(),
+                FileName.c_str());
+            FileNames.insert(FileName);
+        }
+
+        winrt::check_win32(::SimpleCreateDifferencingVirtualDisk(
+            (TargetDirectory + L"\\" + FileName).c_str(),
+            ParentPath.c_str()));
+        ScsiDevice.Path = winrt::to_string(FileName);
+    }
+
+    // Keep the boot entries and the settings stored in the guest state of the
+    // source.
+    std::wstring SourceGuestStateFile = ::GetAbsolutePath(
+        Mile::ToWideString(CP_UTF8, Source.GuestStateFile.empty()
+            ? Source.Name + ".vmgs"
+            : Source.GuestStateFile));
+    if (::PathFileExistsW(SourceGuestStateFile.c_str()))
+    {
+        Configuration.GuestStateFile = Name + ".vmgs";
+        winrt::check_bool(::CopyFileW(
+            SourceGuestStateFile.c_str(),
+            Mile::FormatWideString(
+                L"%s\\%s",
+                TargetDirectory.c_str(),
+                Mile::ToWideString(
+                    CP_UTF8,
+                    Configuration.GuestStateFile).c_str()).c_str(),
+            TRUE));
+    }
+
+    return Configuration;
+}
+
+std::vector<std::wstring> NanaBox::CloneVirtualMachine(
+    std::wstring const& SourceFilePath,
+    std::size_t Count,
+    std::size_t MaxParallelism)
+{
+    NanaBox::VirtualMachineConfiguration Source =
+        NanaBox::DeserializeConfiguration(
+            ::ReadAllTextFromUtf8TextFile(SourceFilePath));
+
+    std::wstring SourceDirectory = SourceFilePath;
+    std::wcsrchr(&SourceDirectory[0], L'\\')[0] = L'\0';
+    SourceDirectory.resize(std::wcslen(SourceDirectory.c_str()));
+
+    // The source is moved onto new differencing disks and its current disks
+    // are frozen as the parents of the clones, which fails if the source is
+    // running. The source keeps using the new disks even if the clones fail.
+    {
+        ::SetCurrentThreadBaseDirectory(SourceDirectory);
+        auto BaseDirectoryHandler = Mile::ScopeExitTaskHandler([]()
+        {
+            ::SetCurrentThreadBaseDirectory(std::wstring());
+        });
+
+        NanaBox::VirtualMachineConfiguration Current = Source;
+        NanaBox::FreezeCurrentVirtualDisks(Current);
+        if (Current.CurrentCheckpointDisks != Source.CurrentCheckpointDisks)
+        {
+            std::string SourceFileContent =
+                NanaBox::SerializeConfiguration(Current);
+            ::ReplaceAllTextInUtf8TextFile(
+                SourceFilePath,
+                SourceFileContent);
+        }
+    }
+
+    // The folders are created before the parallel part, so the numbers are
+    // reserved in order and the existing virtual machines are skipped.
+    std::vector<std::string> Names;
+    std::vector<std::wstring> TargetDirectories;
+    auto CleanupHandler = Mile::ScopeExitTaskHandler([&]()
+    {
+        for (std::wstring const& TargetDirectory : TargetDirectories)
+        {
+            ::SimpleRemoveDirectory(TargetDirectory.c_str());
+        }
+    });
+    for (std::size_t Number = 1; Names.size() < Count; ++Number)
+    {
+        std::string Name = Mile::FormatString(
+            "%s-%zu",
+            Source.Name.c_str(),
+            Number);
+        std::wstring TargetDirectory = Mile::FormatWideString(
+            L"%s\\%s",
+            SourceDirectory.c_str(),
+            Mile::ToWideString(CP_UTF8, Name).c_str());
+        if (!::CreateDirectoryW(TargetDirectory.c_str(), nullptr))
+        {
+            if (ERROR_ALREADY_EXISTS == ::GetLastError())
+            {
+                continue;
+            }
+            winrt::throw_last_error();
+        }
+        Names.push_back(Name);
+        TargetDirectories.push_back(TargetDirectory);
+    }
+
+    std::vector<std::wstring> Result(Count);
+    std::vector<NanaBox::DependencyTask> Tasks(Count);
+    for (std::size_t i = 0; i < Count; ++i)
+    {
+        Tasks[i].Name = Names[i];
+    }
+
+    std::vector<NanaBox::DependencyTaskTimeline> Timeline =
+        NanaBox::RunDependencyTasks(
+            Tasks,
+            MaxParallelism,
+            [&](std::size_t Index)
+    {
+        ::SetCurrentThreadBaseDirectory(SourceDirectory);
+        auto BaseDirectoryHandler = Mile::ScopeExitTaskHandler([]()
+        {
+            ::SetCurrentThreadBaseDirectory(std::wstring());
+        });
+
+        try
+        {
+            NanaBox::VirtualMachineConfiguration Configuration =
+                NanaBox::CreateLinkedClone(
+                    Source,
+                    Names[Index],
+                    TargetDirectories[Index]);
+
+            std::wstring ConfigurationFilePath = Mile::FormatWideString(
+                L"%s\\%s.7b",
+                TargetDirectories[Index].c_str(),
+                Mile::ToWideString(CP_UTF8, Names[Index]).c_str());
+            std::string ConfigurationFileContent =
+                NanaBox::SerializeConfiguration(Configuration);
+            ::ReplaceAllTextInUtf8TextFile(
+                ConfigurationFilePath,
+                ConfigurationFileContent);
+
+            Result[Index] = ConfigurationFilePath;
+        }
+        catch (...)
+        {
+            winrt::hresult_error Exception = Mile::WinRT::ToHResultError();
+            throw std::runtime_error(Mile::FormatString(
+                "0x%08X %s",
+                Exception.code().value,
+                winrt::to_string(Exception.message()).c_str()));
+        }
+    });
+
+    for (NanaBox::DependencyTaskTimeline const& Current : Timeline)
+    {
+        if (Current.Status != NanaBox::DependencyTaskStatus::Succeeded)
+        {
+            throw std::runtime_error(Current.Name + ": " + Current.Error);
+        }
+    }
+
+    TargetDirectories.clear();
+    return Result;
+}
@@ -0,0 +1,51 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualMachineClone.h
+ * PURPOSE:   Definition for the Linked Clone Operations
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_VIRTUAL_MACHINE_CLONE
+#define NANABOX_VIRTUAL_MACHINE_CLONE
+
+#include "ConfigurationManager.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace NanaBox
+{
+    // Creates the files of a linked clone in the target folder, which should
+    // exist, and returns the configuration of it. The virtual disks of the
+    // clone are differencing disks which use the virtual disks of the source
+    // as the parents, so no disk image is copied, and the guest state file of
+    // the source is copied. The virtual disks of the source must have been
+    // frozen via FreezeCurrentVirtualDisks or be read only, otherwise it
+    // throws with ERROR_INVALID_STATE. The clone gets the specified name and new network
+    // endpoints, the MAC addresses are assigned by the Host Network Service
+    // when the endpoints are created. The relative paths in the source are
+    // resolved via GetAbsolutePath, and the files of the clone are referenced
+    // relatively.
+    VirtualMachineConfiguration CreateLinkedClone(
+        VirtualMachineConfiguration const& Source,
+        std::string const& Name,
+        std::wstring const& TargetDirectory);
+
+    // Creates Count linked clones of the configuration file with at most
+    // MaxParallelism clones in flight. The virtual disks of the source are
+    // frozen first and the configuration file of the source is updated to use
+    // the new differencing disks, so the source must not be running. Each clone is named as
+    // "<SourceName>-<Number>" and placed in the folder with the same name
+    // next to the source. Returns the paths of the configuration files of the
+    // clones, or removes all of them and throws if any of them failed.
+    std::vector<std::wstring> CloneVirtualMachine(
+        std::wstring const& SourceFilePath,
+        std::size_t Count,
+        std::size_t MaxParallelism);
+}
+
+#endif // !NANABOX_VIRTUAL_MACHINE_CLONE
@@ -0,0 +1,749 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualMachineLifecycle.cpp
+ * PURPOSE:   Implementation for the Virtual Machine Lifecycle Operations
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "VirtualMachineLifecycle.h"
+
+#include "DependencyScheduler.h"
+
+#include "Utils.h"
+
+#include <Mile.Helpers.h>
+
+#include <Shlwapi.h>
+
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <map>
+
+namespace
+{
+    // The steps are mostly waiting for the Host Compute Service, the Host
+    // Network Service and the storage, so the limit is not tied to the count
+    // of processors.
+    const std::size_t PreparationParallelism = 8;
+
+    struct PreparationStep
+    {
+        NanaBox::DependencyTask Task;
+        NanaBox::PreparationStepType Type;
+        std::function<void()> Action;
+    };
+
+    // Expands the virtual disk to the size in MiB, returns false if the disk
+    // is already large enough, because the disk is never shrunk.
+    bool ExpandVirtualDisk(
+        std::wstring const& Path,
+        std::uint64_t Size)
+    {
+        std::uint64_t CurrentSize = 0;
+        winrt::check_win32(::SimpleGetVirtualDiskSize(
+            Path.c_str(),
+            &CurrentSize));
+        std::uint64_t TargetSize = Size * 1024 * 1024;
+        if (TargetSize <= CurrentSize)
+        {
+            return false;
+        }
+
+        winrt::check_win32(::SimpleResizeVirtualDisk(
+            Path.c_str(),
+            TargetSize));
+        return true;
+    }
+}
+
+void NanaBox::PrepareVirtualMachine(
+    NanaBox::VirtualMachineConfiguration& Configuration)
+{
+    std::chrono::steady_clock::time_point StartTime =
+        std::chrono::steady_clock::now();
+
+    std::shared_ptr<NanaBox::VirtualMachineMetrics> Metrics =
+        NanaBox::GetVirtualMachineMetrics(Configuration.Name);
+    winrt::hstring Owner = winrt::to_hstring(Configuration.Name);
+
+    if (Configuration.GuestStateFile.empty())
+    {
+        Configuration.GuestStateFile = Configuration.Name + ".vmgs";
+    }
+
+    if (Configuration.RuntimeStateFile.empty())
+    {
+        Configuration.RuntimeStateFile = Configuration.Name + ".vmrs";
+    }
+
+    // All paths are resolved on the calling thread because the relative paths
+    // may depend on the base directory of it.
+    std::vector<::PreparationStep> Steps;
+
+    Steps.push_back({ { "ExistenceProbe", {} },
+        NanaBox::PreparationStepType::ExistenceProbe,
+        [&]()
+    {
+        bool VirtualMachineExisted = true;
+        try
+        {
+            winrt::make_self<NanaBox::ComputeSystem>(Owner);
+        }
+        catch (...)
+        {
+            VirtualMachineExisted = false;
+        }
+
+        if (VirtualMachineExisted)
+        {
+            winrt::throw_hresult(HCS_E_SYSTEM_ALREADY_EXISTS);
+        }
+    } });
+
+    for (std::size_t i = 0; i < Configuration.ScsiDevices.size(); ++i)
+    {
+        NanaBox::ScsiDeviceConfiguration& ScsiDevice =
+            Configuration.ScsiDevices[i];
+
+        if (ScsiDevice.Type == NanaBox::ScsiDeviceType::PhysicalDevice)
+        {
+            break;
+        }
+
+        std::wstring Path = ::GetAbsolutePath(Mile::ToWideString(
+            CP_UTF8, ScsiDevice.Path));
+        // The saved state of the guest expects the original capacity of the
+        // disk, so the size is applied in the next cold start instead.
+        std::uint64_t Size =
+            (ScsiDevice.Type == NanaBox::ScsiDeviceType::VirtualDisk &&
+                Configuration.SaveStateFile.empty())
+            ? ScsiDevice.Size
+            : 0;
+        // Expanding the disk cannot be undone, so it waits until it is known
+        // that the disk is not used by the existing virtual machine with the
+        // same name.
+        Steps.push_back({ { "DiskAccess" + std::to_string(i),
+            { "ExistenceProbe" } },
+            NanaBox::PreparationStepType::DiskAccess,
+            [&Owner, Path, Size]()
+        {
+            if (::PathFileExistsW(Path.c_str()))
+            {
+                // The disk is not in use yet, so the size is applied offline,
+                // which also supports VHD.
+                if (Size)
+                {
+                    ::ExpandVirtualDisk(Path, Size);
+                }
+
+                winrt::check_hresult(::HcsGrantVmAccess(
+                    Owner.c_str(),
+                    Path.c_str()));
+
+                // The worker process opens the whole chain of a differencing
+                // disk, which is created by the checkpoints and the clones.
+                for (std::wstring const& ParentPath
+                    : ::GetVirtualDiskParentPaths(Path))
+                {
+                    winrt::check_hresult(::HcsGrantVmAccess(
+                        Owner.c_str(),
+                        ParentPath.c_str()));
+                }
+            }
+        } });
+    }
+
+    {
+        std::wstring GuestStateFile = ::GetAbsolutePath(Mile::ToWideString(
+            CP_UTF8, Configuration.GuestStateFile));
+        Steps.push_back({ { "GuestStateFile", {} },
+            NanaBox::PreparationStepType::GuestStateFile,
+            [&Owner, GuestStateFile]()
+        {
+            if (!::PathFileExistsW(GuestStateFile.c_str()))
+            {
+                winrt::check_hresult(::HcsCreateEmptyGuestStateFile(
+                    GuestStateFile.c_str()));
+            }
+
+            winrt::check_hresult(::HcsGrantVmAccess(
+                Owner.c_str(),
+                GuestStateFile.c_str()));
+        } });
+    }
+
+    {
+        std::wstring RuntimeStateFile = ::GetAbsolutePath(Mile::ToWideString(
+            CP_UTF8, Configuration.RuntimeStateFile));
+        Steps.push_back({ { "RuntimeStateFile", {} },
+            NanaBox::PreparationStepType::RuntimeStateFile,
+            [&Owner, RuntimeStateFile]()
+        {
+            if (!::PathFileExistsW(RuntimeStateFile.c_str()))
+            {
+                winrt::check_hresult(::HcsCreateEmptyRuntimeStateFile(
+                    RuntimeStateFile.c_str()));
+            }
+
+            winrt::check_hresult(::HcsGrantVmAccess(
+                Owner.c_str(),
+                RuntimeStateFile.c_str()));
+        } });
+    }
+
+    if (!Configuration.SaveStateFile.empty())
+    {
+        std::wstring SaveStateFile = ::GetAbsolutePath(Mile::ToWideString(
+            CP_UTF8, Configuration.SaveStateFile));
+        Steps.push_back({ { "SaveStateFile", {} },
+            NanaBox::PreparationStepType::SaveStateFile,
+            [&Owner, SaveStateFile]()
+        {
+            if (::PathFileExistsW(SaveStateFile.c_str()))
+            {
+                winrt::check_hresult(::HcsGrantVmAccess(
+                    Owner.c_str(),
+                    SaveStateFile.c_str()));
+            }
+        } });
+    }
+
+    // The endpoints may be used by the existing virtual machine which has the
+    // same name, so they are only touched after the existence probe.
+    for (std::size_t i = 0; i < Configuration.NetworkAdapters.size(); ++i)
+    {
+        NanaBox::NetworkAdapterConfiguration& NetworkAdapter =
+            Configuration.NetworkAdapters[i];
+        Steps.push_back({ { "NetworkEndpoint" + std::to_string(i),
+            { "ExistenceProbe" } },
+            NanaBox::PreparationStepType::NetworkEndpoint,
+            [&Configuration, &NetworkAdapter]()
+        {
+            if (!NetworkAdapter.Connected)
+            {
+                NanaBox::ComputeNetworkDeleteEndpoint(NetworkAdapter);
+                return;
+            }
+
+            try
+            {
+                NanaBox::ComputeNetworkEnsureEndpoint(
+                    Configuration.Name,
+                    NetworkAdapter);
+            }
+            catch (...)
+            {
+
+            }
+        } });
+    }
+
+    std::vector<NanaBox::DependencyTask> Tasks;
+    for (::PreparationStep const& Step : Steps)
+    {
+        Tasks.push_back(Step.Task);
+    }
+
+    std::vector<std::exception_ptr> Exceptions(Steps.size());
+    NanaBox::RunDependencyTasks(
+        Tasks,
+        PreparationParallelism,
+        [&](std::size_t Index)
+    {
+        std::chrono::steady_clock::time_point StepStartTime =
+            std::chrono::steady_clock::now();
+        auto RecordHandler = Mile::ScopeExitTaskHandler([&]()
+        {
+            Metrics->RecordPreparationStep(
+                Steps[Index].Type,
+                std::chrono::steady_clock::now() - StepStartTime);
+        });
+
+        try
+        {
+            Steps[Index].Action();
+        }
+        catch (...)
+        {
+            Exceptions[Index] = std::current_exception();
+            throw;
+        }
+    });
+
+    Metrics->PreparationDuration = std::chrono::duration_cast<
+        std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - StartTime).count();
+
+    // Rethrow the original exception of the first failed step, so the error
+    // is the same as preparing sequentially.
+    for (std::exception_ptr const& Exception : Exceptions)
+    {
+        if (Exception)
+        {
+            std::rethrow_exception(Exception);
+        }
+    }
+}
+
+winrt::com_ptr<NanaBox::ComputeSystem> NanaBox::CreateVirtualMachine(
+    NanaBox::VirtualMachineConfiguration const& Configuration)
+{
+    return winrt::make_self<NanaBox::ComputeSystem>(
+        winrt::to_hstring(Configuration.Name),
+        winrt::to_hstring(NanaBox::MakeHcsConfiguration(Configuration)));
+}
+
+void NanaBox::StartVirtualMachine(
+    winrt::com_ptr<NanaBox::ComputeSystem> const& Instance,
+    NanaBox::VirtualMachineConfiguration& Configuration)
+{
+    Instance->Start();
+
+    NanaBox::ComputeSystemUpdateGpu(
+        Instance,
+        Configuration.Gpu);
+
+    if (!Configuration.SaveStateFile.empty())
+    {
+        std::wstring SaveStateFile = ::GetAbsolutePath(Mile::ToWideString(
+            CP_UTF8, Configuration.SaveStateFile));
+
+        ::MileDeleteFileIgnoreReadonlyAttribute(SaveStateFile.c_str());
+
+        Configuration.SaveStateFile.clear();
+    }
+}
+
+void NanaBox::SaveVirtualMachine(
+    winrt::com_ptr<NanaBox::ComputeSystem> const& Instance,
+    NanaBox::VirtualMachineConfiguration& Configuration)
+{
+    // Temporarily disable the GPU-PV settings because virtual machine
+    // doen't support save the state when GPU-PV is enabled.
+    NanaBox::GpuConfiguration Gpu;
+    Gpu.AssignmentMode = NanaBox::GpuAssignmentMode::Disabled;
+    NanaBox::ComputeSystemUpdateGpu(Instance, Gpu);
+
+    Instance->Pause();
+
+    if (Configuration.SaveStateFile.empty())
+    {
+        Configuration.SaveStateFile = Configuration.Name + ".SaveState.vmrs";
+    }
+
+    std::wstring SaveStateFile = ::GetAbsolutePath(Mile::ToWideString(
+        CP_UTF8, Configuration.SaveStateFile));
+
+    ::MileDeleteFileIgnoreReadonlyAttribute(SaveStateFile.c_str());
+
+    nlohmann::json Options;
+    Options["SaveType"] = "ToFile";
+    Options["SaveStateFilePath"] = winrt::to_string(SaveStateFile.c_str());
+
+    try
+    {
+        Instance->Save(winrt::to_hstring(Options.dump()));
+    }
+    catch (...)
+    {
+        winrt::hresult_error Exception = Mile::WinRT::ToHResultError();
+
+        ::MileDeleteFileIgnoreReadonlyAttribute(SaveStateFile.c_str());
+
+        Configuration.SaveStateFile.clear();
+
+        Instance->Resume();
+
+        NanaBox::ComputeSystemUpdateGpu(
+            Instance,
+            Configuration.Gpu);
+
+        throw Exception;
+    }
+}
+
+void NanaBox::ReloadVirtualMachine(
+    winrt::com_ptr<NanaBox::ComputeSystem> const& Instance,
+    NanaBox::VirtualMachineConfiguration& Configuration,
+    NanaBox::VirtualMachineConfiguration const& Target)
+{
+    std::shared_ptr<NanaBox::VirtualMachineMetrics> Metrics =
+        NanaBox::GetVirtualMachineMetrics(Configuration.Name);
+
+    if (Configuration.MemorySize != Target.MemorySize)
+    {
+        try
+        {
+            NanaBox::ComputeSystemUpdateMemorySize(
+                Instance,
+                Target.MemorySize);
+            Configuration.MemorySize = Target.MemorySize;
+            Metrics->RecordReloadChange(
+                NanaBox::ReloadChangeType::MemorySize);
+        }
+        catch (...)
+        {
+
+        }
+    }
+
+    if (0 != _stricmp(
+        Configuration.ComPorts.ComPort1.c_str(),
+        Target.ComPorts.ComPort1.c_str()))
+    {
+        try
+        {
+            if (Configuration.ComPorts.ComPort1.empty())
+            {
+                NanaBox::ComputeSystemAddComPort(
+                    Instance,
+                    0,
+                    Target.ComPorts.ComPort1);
+            }
+            else if (Target.ComPorts.ComPort1.empty())
+            {
+                NanaBox::ComputeSystemRemoveComPort(
+                    Instance,
+                    0,
+                    Target.ComPorts.ComPort1);
+            }
+            else
+            {
+                NanaBox::ComputeSystemUpdateComPort(
+                    Instance,
+                    0,
+                    Target.ComPorts.ComPort1);
+            }
+
+            Configuration.ComPorts.ComPort1 = Target.ComPorts.ComPort1;
+            Metrics->RecordReloadChange(
+                NanaBox::ReloadChangeType::ComPort);
+        }
+        catch (...)
+        {
+
+        }
+    }
+
+    if (0 != _stricmp(
+        Configuration.ComPorts.ComPort2.c_str(),
+        Target.ComPorts.ComPort2.c_str()))
+    {
+        try
+        {
+            if (Configuration.ComPorts.ComPort2.empty())
+            {
+                NanaBox::ComputeSystemAddComPort(
+                    Instance,
+                    1,
+                    Target.ComPorts.ComPort2);
+            }
+            else if (Target.ComPorts.ComPort2.empty())
+            {
+                NanaBox::ComputeSystemRemoveComPort(
+                    Instance,
+                    1,
+                    Target.ComPorts.ComPort2);
+            }
+            else
+            {
+                NanaBox::ComputeSystemUpdateComPort(
+                    Instance,
+                    1,
+                    Target.ComPorts.ComPort2);
+            }
+
+            Configuration.ComPorts.ComPort2 = Target.ComPorts.ComPort2;
+            Metrics->RecordReloadChange(
+                NanaBox::ReloadChangeType::ComPort);
+        }
+        catch (...)
+        {
+
+        }
+    }
+
+    try
+    {
+        NanaBox::ComputeSystemUpdateGpu(
+            Instance,
+            Target.Gpu);
+        Configuration.Gpu = Target.Gpu;
+    }
+    catch (...)
+    {
+
+    }
+
+    {
+        using NetworkAdapterMapType =
+            std::map<std::string, NanaBox::NetworkAdapterConfiguration>;
+
+        NetworkAdapterMapType PreviousList;
+        NetworkAdapterMapType CurrentList;
+        std::vector<NanaBox::NetworkAdapterConfiguration> KeepList;
+        std::vector<NanaBox::NetworkAdapterConfiguration> AddList;
+        std::vector<NanaBox::NetworkAdapterConfiguration> RemoveList;
+        std::vector<NanaBox::NetworkAdapterConfiguration> FinalList;
+
+        for (NanaBox::NetworkAdapterConfiguration const& Previous
+            : Configuration.NetworkAdapters)
+        {
+            PreviousList.insert(std::pair(Previous.EndpointId, Previous));
+        }
+
+        for (NanaBox::NetworkAdapterConfiguration const& Current
+            : Target.NetworkAdapters)
+        {
+            CurrentList.insert(std::pair(Current.EndpointId, Current));
+        }
+
+        for (NanaBox::NetworkAdapterConfiguration const& Previous
+            : Configuration.NetworkAdapters)
+        {
+            NetworkAdapterMapType::iterator Current =
+                CurrentList.find(Previous.EndpointId);
+
+            if (CurrentList.end() == Current)
+            {
+                RemoveList.push_back(Previous);
+            }
+            else
+            {
+                if (Previous.Connected != Current->second.Connected ||
+                    0 != _stricmp(
+                        Previous.MacAddress.c_str(),
+                        Current->second.MacAddress.c_str()))
+                {
+                    if (Previous.Connected)
+                    {
+                        RemoveList.push_back(Previous);
+                    }
+                    AddList.push_back(Current->second);
+                }
+                else
+                {
+                    KeepList.push_back(Previous);
+                }
+            }
+        }
+
+        for (NanaBox::NetworkAdapterConfiguration const& Current
+            : Target.NetworkAdapters)
+        {
+            if (PreviousList.end() == PreviousList.find(Current.EndpointId))
+            {
+                AddList.push_back(Current);
+            }
+        }
+
+        for (NanaBox::NetworkAdapterConfiguration& Current : KeepList)
+        {
+            FinalList.push_back(Current);
+        }
+
+        for (NanaBox::NetworkAdapterConfiguration& Current : RemoveList)
+        {
+            try
+            {
+                NanaBox::ComputeSystemRemoveNetworkAdapter(
+                    Instance,
+                    Current);
+                NanaBox::ComputeNetworkDeleteEndpoint(Current);
+                Metrics->RecordReloadChange(
+                    NanaBox::ReloadChangeType::NetworkAdapterRemoved);
+            }
+            catch (...)
+            {
+                FinalList.push_back(Current);
+            }
+        }
+
+        for (NanaBox::NetworkAdapterConfiguration& Current : AddList)
+        {
+            try
+            {
+                if (Current.Connected)
+                {
+                    NanaBox::ComputeNetworkEnsureEndpoint(
+                        Configuration.Name,
+                        Current);
+                    NanaBox::ComputeSystemAddNetworkAdapter(
+                        Instance,
+                        Current);
+                }
+                else
+                {
+                    NanaBox::ComputeNetworkDeleteEndpoint(Current);
+                }
+                FinalList.push_back(Current);
+                Metrics->RecordReloadChange(
+                    NanaBox::ReloadChangeType::NetworkAdapterAdded);
+            }
+            catch (...)
+            {
+
+            }
+        }
+
+        Configuration.NetworkAdapters = FinalList;
+    }
+
+    {
+        size_t PreviousCount = Configuration.ScsiDevices.size();
+        size_t NewCount = Target.ScsiDevices.size();
+        if (PreviousCount <= NewCount)
+        {
+            for (std::uint32_t i = 0; i < NewCount; ++i)
+            {
+                NanaBox::ScsiDeviceConfiguration const& Current =
+                    Target.ScsiDevices[i];
+
+                if (i < PreviousCount)
+                {
+                    NanaBox::ScsiDeviceConfiguration& Previous =
+                        Configuration.ScsiDevices[i];
+
+                    if (Previous.Type == Current.Type)
+                    {
+                        if (0 != _stricmp(
+                            Previous.Path.c_str(),
+                            Current.Path.c_str()))
+                        {
+                            try
+                            {
+                                NanaBox::ComputeSystemUpdateScsiDevice(
+                                    Instance,
+                                    i,
+                                    Current);
+                                Previous.Path = Current.Path;
+                                Metrics->RecordReloadChange(
+                                    NanaBox::ReloadChangeType::ScsiDeviceUpdated);
+                            }
+                            catch (...)
+                            {
+
+                            }
+                        }
+                        else if (Previous.Size != Current.Size)
+                        {
+                            try
+                            {
+                                if (Current.Size &&
+                                    NanaBox::ExpandVirtualMachineDisk(
+                                        Instance,
+                                        i,
+                                        Current))
+                                {
+                                    Metrics->RecordReloadChange(
+                                        NanaBox::ReloadChangeType::ScsiDeviceExpanded);
+                                }
+                                Previous.Size = Current.Size;
+                            }
+                            catch (...)
+                            {
+
+                            }
+                        }
+                    }
+                }
+                else
+                {
+                    try
+                    {
+                        if (Current.Type !=
+                            NanaBox::ScsiDeviceType::PhysicalDevice)
+                        {
+                            std::wstring Path = ::GetAbsolutePath(
+                                Mile::ToWideString(CP_UTF8, Current.Path));
+                            if (!::PathFileExistsW(Path.c_str()))
+                            {
+                                continue;
+                            }
+                            winrt::check_hresult(::HcsGrantVmAccess(
+                                winrt::to_hstring(Configuration.Name).c_str(),
+                                Path.c_str()));
+                        }
+
+                        NanaBox::ComputeSystemAddScsiDevice(
+                            Instance,
+                            i,
+                            Current);
+                        Configuration.ScsiDevices.push_back(Current);
+                        Metrics->RecordReloadChange(
+                            NanaBox::ReloadChangeType::ScsiDeviceAdded);
+                    }
+                    catch (...)
+                    {
+
+                    }
+                }
+            }
+        }
+    }
+}
+
+bool NanaBox::ExpandVirtualMachineDisk(
+    winrt::com_ptr<NanaBox::ComputeSystem> const& Instance,
+    std::uint32_t DeviceID,
+    NanaBox::ScsiDeviceConfiguration const& Configuration)
+{
+    std::wstring Path = ::GetAbsolutePath(
+        Mile::ToWideString(CP_UTF8, Configuration.Path));
+
+    // VHD can't be resized while it is in use.
+    if (NanaBox::ScsiDeviceType::VirtualDisk != Configuration.Type ||
+        0 != ::_wcsicmp(::PathFindExtensionW(Path.c_str()), L".vhdx"))
+    {
+        winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED));
+    }
+
+    if (!::ExpandVirtualDisk(Path, Configuration.Size))
+    {
+        return false;
+    }
+
+    // Updating the attachment with the same settings makes the storage
+    // virtual service provider read the capacity again, which reports the
+    // capacity change to the guest via a SCSI unit attention.
+    NanaBox::ComputeSystemUpdateScsiDevice(
+        Instance,
+        DeviceID,
+        Configuration);
+    return true;
+}
+
+bool NanaBox::NotifyVirtualMachineDiskResized(
+    winrt::com_ptr<NanaBox::ComputeSystem> const& Instance,
+    std::vector<NanaBox::ScsiDeviceConfiguration> const& ScsiDevices,
+    std::wstring const& Path)
+{
+    std::wstring ResizedPath = ::GetAbsolutePath(Path);
+
+    bool Result = false;
+    for (std::uint32_t i = 0; i < ScsiDevices.size(); ++i)
+    {
+        NanaBox::ScsiDeviceConfiguration const& ScsiDevice = ScsiDevices[i];
+        if (NanaBox::ScsiDeviceType::VirtualDisk != ScsiDevice.Type)
+        {
+            continue;
+        }
+
+        if (0 != ::_wcsicmp(
+            ::GetAbsolutePath(Mile::ToWideString(
+                CP_UTF8,
+                ScsiDevice.Path)).c_str(),
+            ResizedPath.c_str()))
+        {
+            continue;
+        }
+
+        NanaBox::ComputeSystemUpdateScsiDevice(Instance, i, ScsiDevice);
+        Result = true;
+    }
+    return Result;
+}
@@ -0,0 +1,75 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualMachineLifecycle.h
+ * PURPOSE:   Definition for the Virtual Machine Lifecycle Operations
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_VIRTUAL_MACHINE_LIFECYCLE
+#define NANABOX_VIRTUAL_MACHINE_LIFECYCLE
+
+#include "ConfigurationManager.h"
+
+// These operations are shared by the main window and the headless host, so
+// they only touch the Host Compute System and never the user interface. The
+// relative paths in the configuration are resolved via GetAbsolutePath.
+
+namespace NanaBox
+{
+    // Grants the access to the disks and the state files, creates the missing
+    // state files and recreates the network endpoints. It doesn't depend on
+    // other virtual machines, so it can run concurrently with them. The steps
+    // are independent of each other and run concurrently as well, and their
+    // durations are recorded to the metrics of the virtual machine.
+    void PrepareVirtualMachine(
+        VirtualMachineConfiguration& Configuration);
+
+    // Creates the compute system of a prepared virtual machine. The caller
+    // should subscribe the events before starting.
+    winrt::com_ptr<ComputeSystem> CreateVirtualMachine(
+        VirtualMachineConfiguration const& Configuration);
+
+    // Starts the compute system, applies the GPU settings and removes the
+    // consumed save state file from the configuration.
+    void StartVirtualMachine(
+        winrt::com_ptr<ComputeSystem> const& Instance,
+        VirtualMachineConfiguration& Configuration);
+
+    // Pauses the compute system and saves it to the save state file. The
+    // compute system is resumed and the exception is rethrown when failed,
+    // otherwise it stays paused and the caller should terminate it.
+    void SaveVirtualMachine(
+        winrt::com_ptr<ComputeSystem> const& Instance,
+        VirtualMachineConfiguration& Configuration);
+
+    // Applies the differences of the compute system related settings from the
+    // target configuration. The settings which failed to apply are kept
+    // unchanged in the current configuration.
+    void ReloadVirtualMachine(
+        winrt::com_ptr<ComputeSystem> const& Instance,
+        VirtualMachineConfiguration& Current,
+        VirtualMachineConfiguration const& Target);
+
+    // Expands the virtual disk attached to the SCSI controller of a running
+    // virtual machine to the size in the configuration and notifies the guest
+    // via the attachment, so the guest sees the new capacity without a
+    // restart. Only VHDX supports it. Returns false if the disk is already
+    // large enough, because the disk is never shrunk.
+    bool ExpandVirtualMachineDisk(
+        winrt::com_ptr<ComputeSystem> const& Instance,
+        std::uint32_t DeviceID,
+        ScsiDeviceConfiguration const& Configuration);
+
+    // Notifies the guest of the new capacity of the virtual disks attached to
+    // the SCSI controller which use the file, after it is expanded outside of
+    // the virtual machine. Returns whether any of the disks uses the file.
+    bool NotifyVirtualMachineDiskResized(
+        winrt::com_ptr<ComputeSystem> const& Instance,
+        std::vector<ScsiDeviceConfiguration> const& ScsiDevices,
+        std::wstring const& Path);
+}
+
+#endif // !NANABOX_VIRTUAL_MACHINE_LIFECYCLE
@@ -0,0 +1,494 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualMachinePool.cpp
+ * PURPOSE:   Implementation for the Pre-warmed Virtual Machine Pool
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "VirtualMachinePool.h"
+
+#include "VirtualMachineCheckpoint.h"
+#include "VirtualMachineClone.h"
+
+#include "Utils.h"
+
+#include <Mile.Helpers.h>
+
+#include <Shlwapi.h>
+
+namespace
+{
+    // Keeps a broken template from occupying the host with endless refills.
+    const std::chrono::seconds RefillRetryDelay = std::chrono::seconds(30);
+
+    const std::size_t MaximumRequestHistory = 32;
+
+    double ToMilliseconds(
+        std::chrono::steady_clock::duration Duration)
+    {
+        return std::chrono::duration<double, std::milli>(Duration).count();
+    }
+
+    std::string GetCurrentExceptionMessage()
+    {
+        winrt::hresult_error Exception = Mile::WinRT::ToHResultError();
+        return Mile::FormatString(
+            "0x%08X %s",
+            Exception.code().value,
+            winrt::to_string(Exception.message()).c_str());
+    }
+
+    std::wstring GetParentDirectory(
+        std::wstring const& Path)
+    {
+        std::wstring Result = Path;
+        std::wcsrchr(&Result[0], L'\\')[0] = L'\0';
+        Result.resize(std::wcslen(Result.c_str()));
+        return Result;
+    }
+}
+
+NanaBox::VirtualMachinePool::VirtualMachinePool(
+    std::wstring const& TemplateFilePath,
+    NanaBox::VirtualMachineConfiguration const& Template) :
+    m_TemplateDirectory(::GetParentDirectory(TemplateFilePath)),
+    m_Template(Template)
+{
+    this->m_PoolDirectory = Mile::FormatWideString(
+        L"%s\\%s.Pool",
+        this->m_TemplateDirectory.c_str(),
+        Mile::ToWideString(CP_UTF8, this->m_Template.Name).c_str());
+    ::CreateDirectoryW(this->m_PoolDirectory.c_str(), nullptr);
+
+    // The template is frozen once into the read only base when the pool is
+    // created, and the frozen configuration is kept in the pool folder, so
+    // the instances always use the same base even after the host is restarted
+    // while the template itself is switched to new differencing disks. The
+    // relative paths in it are still resolved against the folder of the
+    // template.
+    std::wstring BaseFilePath = Mile::FormatWideString(
+        L"%s\\%s.7b",
+        this->m_PoolDirectory.c_str(),
+        Mile::ToWideString(CP_UTF8, this->m_Template.Name).c_str());
+    if (::PathFileExistsW(BaseFilePath.c_str()))
+    {
+        this->m_Template = NanaBox::DeserializeConfiguration(
+            ::ReadAllTextFromUtf8TextFile(BaseFilePath));
+        this->m_Template.Pool = Template.Pool;
+    }
+    else
+    {
+        ::SetCurrentThreadBaseDirectory(this->m_TemplateDirectory);
+        auto BaseDirectoryHandler = Mile::ScopeExitTaskHandler([]()
+        {
+            ::SetCurrentThreadBaseDirectory(std::wstring());
+        });
+
+        NanaBox::VirtualMachineConfiguration Current = Template;
+        NanaBox::FreezeCurrentVirtualDisks(Current);
+        if (Current.CurrentCheckpointDisks != Template.CurrentCheckpointDisks)
+        {
+            std::string TemplateFileContent =
+                NanaBox::SerializeConfiguration(Current);
+            ::ReplaceAllTextInUtf8TextFile(
+                TemplateFilePath,
+                TemplateFileContent);
+        }
+
+        std::string BaseFileContent =
+            NanaBox::SerializeConfiguration(this->m_Template);
+        ::ReplaceAllTextInUtf8TextFile(
+            BaseFilePath,
+            BaseFileContent);
+    }
+
+    // The saved instances are kept across the restarts of the host, and the
+    // ones interrupted while warming up are discarded.
+    std::vector<std::string> Instances;
+    HANDLE RootHandle = ::MileCreateFile(
+        this->m_PoolDirectory.c_str(),
+        SYNCHRONIZE | FILE_LIST_DIRECTORY,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS,
+        nullptr);
+    if (RootHandle != INVALID_HANDLE_VALUE)
+    {
+        Mile::EnumerateFileByHandle(
+            RootHandle,
+            [&](
+                _In_ PMILE_FILE_ENUMERATE_INFORMATION Information) -> BOOL
+        {
+            if (!::MileIsDotsName(Information->FileName) &&
+                (Information->FileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            {
+                Instances.push_back(winrt::to_string(Information->FileName));
+            }
+
+            return TRUE;
+        });
+
+        ::CloseHandle(RootHandle);
+    }
+
+    for (std::string const& Name : Instances)
+    {
+        bool Saved = false;
+        try
+        {
+            NanaBox::VirtualMachineConfiguration Configuration =
+                NanaBox::DeserializeConfiguration(
+                    ::ReadAllTextFromUtf8TextFile(Mile::FormatWideString(
+                        L"%s\\%s.7b",
+                        this->GetInstanceDirectory(Name).c_str(),
+                        Mile::ToWideString(CP_UTF8, Name).c_str())));
+            Saved = !Configuration.SaveStateFile.empty();
+        }
+        catch (...)
+        {
+
+        }
+
+        if (Saved)
+        {
+            this->m_ReadyInstances.push_back(Name);
+        }
+        else
+        {
+            this->DeleteInstance(Name);
+        }
+    }
+
+    for (std::uint32_t i = 0; i < this->m_Template.Pool.RefillConcurrency; ++i)
+    {
+        this->m_RefillWorkers.emplace_back([this]()
+        {
+            this->RefillWorker();
+        });
+    }
+}
+
+NanaBox::VirtualMachinePool::~VirtualMachinePool()
+{
+    {
+        std::lock_guard<std::mutex> Guard(this->m_Lock);
+        this->m_Stopping = true;
+    }
+    this->m_Condition.notify_all();
+
+    for (std::thread& Worker : this->m_RefillWorkers)
+    {
+        Worker.join();
+    }
+}
+
+std::string const& NanaBox::VirtualMachinePool::GetName() const
+{
+    return this->m_Template.Name;
+}
+
+std::wstring NanaBox::VirtualMachinePool::GetInstanceDirectory(
+    std::string const& Name)
+{
+    return Mile::FormatWideString(
+        L"%s\\%s",
+        this->m_PoolDirectory.c_str(),
+        Mile::ToWideString(CP_UTF8, Name).c_str());
+}
+
+std::string NanaBox::VirtualMachinePool::CloneInstance()
+{
+    GUID InstanceId;
+    winrt::check_hresult(::CoCreateGuid(&InstanceId));
+    std::string Name = Mile::FormatString(
+        "%s-%08x",
+        this->m_Template.Name.c_str(),
+        InstanceId.Data1);
+
+    std::wstring InstanceDirectory = this->GetInstanceDirectory(Name);
+    ::CreateDirectoryW(this->m_PoolDirectory.c_str(), nullptr);
+    winrt::check_bool(::CreateDirectoryW(InstanceDirectory.c_str(), nullptr));
+
+    try
+    {
+        // The relative paths in the template are resolved against the folder
+        // of the template, and the files of the instance are referenced
+        // relatively, so the instance can be moved after acquired.
+        ::SetCurrentThreadBaseDirectory(this->m_TemplateDirectory);
+        auto BaseDirectoryHandler = Mile::ScopeExitTaskHandler([]()
+        {
+            ::SetCurrentThreadBaseDirectory(std::wstring());
+        });
+
+        NanaBox::VirtualMachineConfiguration Configuration =
+            NanaBox::CreateLinkedClone(
+                this->m_Template,
+                Name,
+                InstanceDirectory);
+
+        std::string ConfigurationFileContent =
+            NanaBox::SerializeConfiguration(Configuration);
+        ::ReplaceAllTextInUtf8TextFile(
+            Mile::FormatWideString(
+                L"%s\\%s.7b",
+                InstanceDirectory.c_str(),
+                Mile::ToWideString(CP_UTF8, Name).c_str()),
+            ConfigurationFileContent);
+    }
+    catch (...)
+    {
+        ::SimpleRemoveDirectory(InstanceDirectory.c_str());
+        throw;
+    }
+
+    return Name;
+}
+
+void NanaBox::VirtualMachinePool::WarmUpInstance(
+    std::string const& Name)
+{
+    std::wstring InstanceDirectory = this->GetInstanceDirectory(Name);
+    std::wstring ConfigurationFilePath = Mile::FormatWideString(
+        L"%s\\%s.7b",
+        InstanceDirectory.c_str(),
+        Mile::ToWideString(CP_UTF8, Name).c_str());
+
+    ::SetCurrentThreadBaseDirectory(InstanceDirectory);
+    auto BaseDirectoryHandler = Mile::ScopeExitTaskHandler([]()
+    {
+        ::SetCurrentThreadBaseDirectory(std::wstring());
+    });
+
+    NanaBox::VirtualMachineConfiguration Configuration =
+        NanaBox::DeserializeConfiguration(
+            ::ReadAllTextFromUtf8TextFile(ConfigurationFilePath));
+
+    // The metrics of the warm up are not exported, the instance registers
+    // them again when it is acquired.
+    auto MetricsHandler = Mile::ScopeExitTaskHandler([&]()
+    {
+        NanaBox::ReleaseVirtualMachineMetrics(Name);
+    });
+
+    NanaBox::PrepareVirtualMachine(Configuration);
+
+    winrt::com_ptr<NanaBox::ComputeSystem> Instance =
+        NanaBox::CreateVirtualMachine(Configuration);
+    auto InstanceHandler = Mile::ScopeExitTaskHandler([&]()
+    {
+        if (Instance)
+        {
+            try
+            {
+                Instance->Terminate();
+            }
+            catch (...)
+            {
+
+            }
+        }
+    });
+
+    NanaBox::StartVirtualMachine(Instance, Configuration);
+
+    // Give the guest time to reach a known state, for example, the logon
+    // screen or the services started by the template.
+    {
+        std::unique_lock<std::mutex> Guard(this->m_Lock);
+        if (this->m_Condition.wait_for(
+            Guard,
+            std::chrono::seconds(this->m_Template.Pool.WarmupTime),
+            [this]() { return this->m_Stopping; }))
+        {
+            throw winrt::hresult_canceled();
+        }
+    }
+
+    NanaBox::SaveVirtualMachine(Instance, Configuration);
+    Instance->Terminate();
+    Instance = nullptr;
+
+    // The save state file marks the instance as ready.
+    std::string ConfigurationFileContent =
+        NanaBox::SerializeConfiguration(Configuration);
+    ::ReplaceAllTextInUtf8TextFile(
+        ConfigurationFilePath,
+        ConfigurationFileContent);
+}
+
+void NanaBox::VirtualMachinePool::DeleteInstance(
+    std::string const& Name)
+{
+    std::wstring InstanceDirectory = this->GetInstanceDirectory(Name);
+
+    try
+    {
+        NanaBox::VirtualMachineConfiguration Configuration =
+            NanaBox::DeserializeConfiguration(
+                ::ReadAllTextFromUtf8TextFile(Mile::FormatWideString(
+                    L"%s\\%s.7b",
+                    InstanceDirectory.c_str(),
+                    Mile::ToWideString(CP_UTF8, Name).c_str())));
+        for (NanaBox::NetworkAdapterConfiguration& NetworkAdapter
+            : Configuration.NetworkAdapters)
+        {
+            NanaBox::ComputeNetworkDeleteEndpoint(NetworkAdapter);
+        }
+    }
+    catch (...)
+    {
+
+    }
+
+    ::SimpleRemoveDirectory(InstanceDirectory.c_str());
+
+    NanaBox::ReleaseVirtualMachineMetrics(Name);
+}
+
+void NanaBox::VirtualMachinePool::RefillWorker()
+{
+    std::unique_lock<std::mutex> Guard(this->m_Lock);
+    for (;;)
+    {
+        this->m_Condition.wait(Guard, [this]()
+        {
+            return this->m_Stopping ||
+                this->m_ReadyInstances.size() + this->m_RefillingCount <
+                this->m_Template.Pool.Size;
+        });
+        if (this->m_Stopping)
+        {
+            break;
+        }
+
+        ++this->m_RefillingCount;
+        Guard.unlock();
+
+        std::chrono::steady_clock::time_point StartTime =
+            std::chrono::steady_clock::now();
+        std::string Name;
+        std::string Error;
+        try
+        {
+            Name = this->CloneInstance();
+            this->WarmUpInstance(Name);
+        }
+        catch (...)
+        {
+            Error = ::GetCurrentExceptionMessage();
+            if (!Name.empty())
+            {
+                this->DeleteInstance(Name);
+            }
+        }
+
+        Guard.lock();
+        --this->m_RefillingCount;
+        if (Error.empty())
+        {
+            this->m_ReadyInstances.push_back(Name);
+            this->m_LastRefillTime = std::chrono::steady_clock::now() - StartTime;
+        }
+        else if (!this->m_Stopping)
+        {
+            ++this->m_RefillFailures;
+            this->m_LastRefillError = Error;
+            this->m_Condition.wait_for(
+                Guard,
+                ::RefillRetryDelay,
+                [this]() { return this->m_Stopping; });
+        }
+    }
+}
+
+std::wstring NanaBox::VirtualMachinePool::Acquire(
+    bool& Warm)
+{
+    std::string Name;
+    {
+        std::lock_guard<std::mutex> Guard(this->m_Lock);
+        if (!this->m_ReadyInstances.empty())
+        {
+            Name = this->m_ReadyInstances.front();
+            this->m_ReadyInstances.pop_front();
+        }
+    }
+    this->m_Condition.notify_all();
+
+    Warm = !Name.empty();
+    if (!Warm)
+    {
+        Name = this->CloneInstance();
+    }
+
+    std::wstring FileName = Mile::ToWideString(CP_UTF8, Name);
+    std::wstring TargetDirectory = Mile::FormatWideString(
+        L"%s\\%s",
+        this->m_TemplateDirectory.c_str(),
+        FileName.c_str());
+    if (!::MoveFileExW(
+        this->GetInstanceDirectory(Name).c_str(),
+        TargetDirectory.c_str(),
+        0))
+    {
+        DWORD LastError = ::GetLastError();
+        if (Warm)
+        {
+            std::lock_guard<std::mutex> Guard(this->m_Lock);
+            this->m_ReadyInstances.push_front(Name);
+        }
+        else
+        {
+            this->DeleteInstance(Name);
+        }
+        winrt::throw_hresult(HRESULT_FROM_WIN32(LastError));
+    }
+
+    return Mile::FormatWideString(
+        L"%s\\%s.7b",
+        TargetDirectory.c_str(),
+        FileName.c_str());
+}
+
+void NanaBox::VirtualMachinePool::RecordRequest(
+    NanaBox::VirtualMachinePoolRequest const& Request)
+{
+    std::lock_guard<std::mutex> Guard(this->m_Lock);
+    this->m_Requests.push_back(Request);
+    if (this->m_Requests.size() > ::MaximumRequestHistory)
+    {
+        this->m_Requests.pop_front();
+    }
+}
+
+std::string NanaBox::VirtualMachinePool::FormatStatus()
+{
+    std::lock_guard<std::mutex> Guard(this->m_Lock);
+
+    std::string Result = Mile::FormatString(
+        "%s\tReady=%zu\tRefilling=%zu\tSize=%u\tRefillConcurrency=%u\t"
+        "LastRefill=%.1fms\tFailures=%zu\t%s\n",
+        this->m_Template.Name.c_str(),
+        this->m_ReadyInstances.size(),
+        this->m_RefillingCount,
+        this->m_Template.Pool.Size,
+        this->m_Template.Pool.RefillConcurrency,
+        ::ToMilliseconds(this->m_LastRefillTime),
+        this->m_RefillFailures,
+        this->m_LastRefillError.c_str());
+
+    for (NanaBox::VirtualMachinePoolRequest const& Request : this->m_Requests)
+    {
+        Result += Mile::FormatString(
+            "# %s\t%s\tTimeToUsable=%.1fms\n",
+            Request.Name.c_str(),
+            Request.Warm ? "Warm" : "Cold",
+            ::ToMilliseconds(Request.TimeToUsable));
+    }
+
+    return Result;
+}
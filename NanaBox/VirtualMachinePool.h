@@ -0,0 +1,111 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualMachinePool.h
+ * PURPOSE:   Definition for the Pre-warmed Virtual Machine Pool
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_VIRTUAL_MACHINE_POOL
+#define NANABOX_VIRTUAL_MACHINE_POOL
+
+#include "VirtualMachineLifecycle.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace NanaBox
+{
+    struct VirtualMachinePoolRequest
+    {
+        std::string Name;
+        // The instance was restored from the pool instead of booted.
+        bool Warm = false;
+        // From receiving the request to the compute system running.
+        std::chrono::steady_clock::duration TimeToUsable =
+            std::chrono::steady_clock::duration::zero();
+    };
+
+    // Keeps the instances of a template virtual machine booted, warmed up and
+    // then saved, so a request only needs to restore one of them. Each instance
+    // is a linked clone of the template which uses differencing disks of the
+    // read only base frozen from the template when the pool is created, and
+    // lives in the "<TemplateName>.Pool" folder next to the template until it
+    // is acquired. The pool is refilled in the background with at most
+    // RefillConcurrency instances warming up at the same time.
+    class VirtualMachinePool
+    {
+    public:
+
+        VirtualMachinePool(
+            std::wstring const& TemplateFilePath,
+            VirtualMachineConfiguration const& Template);
+
+        ~VirtualMachinePool();
+
+        VirtualMachinePool(
+            VirtualMachinePool const&) = delete;
+
+        VirtualMachinePool& operator=(
+            VirtualMachinePool const&) = delete;
+
+        std::string const& GetName() const;
+
+        // Takes a saved instance out of the pool, or clones a new instance
+        // without warming it up if the pool is empty. The instance is moved
+        // next to the template and the path of its configuration file is
+        // returned, the caller should start it.
+        std::wstring Acquire(
+            bool& Warm);
+
+        void RecordRequest(
+            VirtualMachinePoolRequest const& Request);
+
+        std::string FormatStatus();
+
+    private:
+
+        std::wstring m_TemplateDirectory;
+        std::wstring m_PoolDirectory;
+        VirtualMachineConfiguration m_Template;
+
+        // Protects the members below.
+        std::mutex m_Lock;
+        std::condition_variable m_Condition;
+        bool m_Stopping = false;
+        std::deque<std::string> m_ReadyInstances;
+        std::size_t m_RefillingCount = 0;
+        std::size_t m_RefillFailures = 0;
+        std::string m_LastRefillError;
+        std::chrono::steady_clock::duration m_LastRefillTime =
+            std::chrono::steady_clock::duration::zero();
+        std::deque<VirtualMachinePoolRequest> m_Requests;
+        std::vector<std::thread> m_RefillWorkers;
+
+        std::wstring GetInstanceDirectory(
+            std::string const& Name);
+
+        // Creates the differencing disks, the guest state file and the
+        // configuration file of a new instance, returns the name of it.
+        std::string CloneInstance();
+
+        // Boots the instance, waits for the warmup time and saves it.
+        void WarmUpInstance(
+            std::string const& Name);
+
+        // Deletes the network endpoints and the folder of the instance.
+        void DeleteInstance(
+            std::string const& Name);
+
+        void RefillWorker();
+    };
+}
+
+#endif // !NANABOX_VIRTUAL_MACHINE_POOL
@@ -0,0 +1,434 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualMachineStatistics.cpp
+ * PURPOSE:   Implementation for the Virtual Machine Statistics Sampler
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#include "VirtualMachineStatistics.h"
+
+#include <Mile.Helpers.CppBase.h>
+#include <Mile.Json.h>
+
+#include <algorithm>
+
+namespace
+{
+    std::size_t GetStatisticsBufferSize()
+    {
+        return
+            FIELD_OFFSET(NanaBox::VirtualMachineStatisticsBuffer, Samples) +
+            sizeof(NanaBox::VirtualMachineStatisticsSample) *
+            NanaBox::VirtualMachineStatisticsCapacity;
+    }
+
+    // An update only copies one sample, so a writer which keeps the sequence
+    // odd for all of the attempts has died or hung in the middle of it.
+    const std::uint32_t g_MaximumReadAttempts = 4096;
+
+    // Returns false if the buffer stays inconsistent, the capacity is passed
+    // by the caller after validating it instead of reading it again from the
+    // shared memory.
+    bool ReadStatisticsBuffer(
+        NanaBox::VirtualMachineStatisticsBuffer const* Buffer,
+        std::uint32_t Capacity,
+        std::vector<NanaBox::VirtualMachineStatisticsSample>& Result)
+    {
+        Result.clear();
+        Result.reserve(Capacity);
+
+        for (std::uint32_t i = 0; i < g_MaximumReadAttempts; ++i)
+        {
+            LONG64 Sequence = ::ReadAcquire64(&Buffer->Sequence);
+            if (Sequence & 1)
+            {
+                ::YieldProcessor();
+                continue;
+            }
+
+            Result.clear();
+            std::uint64_t Count = Buffer->Count;
+            std::uint64_t Available = std::min<std::uint64_t>(
+                Count,
+                Capacity);
+            for (std::uint64_t j = Count - Available; j < Count; ++j)
+            {
+                Result.push_back(Buffer->Samples[j % Capacity]);
+            }
+
+            ::MemoryBarrier();
+            if (Sequence == ::ReadAcquire64(&Buffer->Sequence))
+            {
+                return true;
+            }
+        }
+
+        Result.clear();
+        return false;
+    }
+}
+
+std::wstring NanaBox::GetVirtualMachineStatisticsSectionName(
+    std::string const& Name)
+{
+    return L"Local\\NanaBox.Statistics." + Mile::ToWideString(CP_UTF8, Name);
+}
+
+NanaBox::VirtualMachineStatisticsSample NanaBox::QueryVirtualMachineStatistics(
+    winrt::com_ptr<NanaBox::ComputeSystem> const& Instance,
+    bool& ProcessorStatisticsSupported)
+{
+    NanaBox::VirtualMachineStatisticsSample Result;
+
+    nlohmann::json Query;
+    Query["PropertyTypes"] = nlohmann::json::array();
+    Query["PropertyTypes"].push_back("Statistics");
+    Query["PropertyTypes"].push_back("Memory");
+    if (ProcessorStatisticsSupported)
+    {
+        Query["PropertyTypes"].push_back("ProcessorStatistics");
+    }
+
+    winrt::hstring RawProperties;
+    try
+    {
+        RawProperties = Instance->GetProperties(
+            winrt::to_hstring(Query.dump()));
+    }
+    catch (...)
+    {
+        if (!ProcessorStatisticsSupported)
+        {
+            throw;
+        }
+
+        // Older builds reject the unknown property type for the whole query,
+        // so retry without it and never ask for it again.
+        ProcessorStatisticsSupported = false;
+        return NanaBox::QueryVirtualMachineStatistics(
+            Instance,
+            ProcessorStatisticsSupported);
+    }
+
+    nlohmann::json Properties = nlohmann::json::parse(
+        winrt::to_string(RawProperties));
+
+    FILETIME SystemTime;
+    ::GetSystemTimeAsFileTime(&SystemTime);
+    Result.Timestamp =
+        (static_cast<std::uint64_t>(SystemTime.dwHighDateTime) << 32) |
+        SystemTime.dwLowDateTime;
+
+    nlohmann::json Statistics = Mile::Json::GetSubKey(
+        Properties,
+        "Statistics");
+    Result.Uptime = Mile::Json::ToUInt64(
+        Mile::Json::GetSubKey(Statistics, "Uptime100ns"));
+
+    nlohmann::json Processor = Mile::Json::GetSubKey(
+        Properties,
+        "ProcessorStatistics");
+    if (Processor.is_null())
+    {
+        Processor = Mile::Json::GetSubKey(Statistics, "Processor");
+    }
+    Result.ProcessorTotalRuntime = Mile::Json::ToUInt64(
+        Mile::Json::GetSubKey(Processor, "TotalRuntime100ns"));
+    Result.ProcessorUserRuntime = Mile::Json::ToUInt64(
+        Mile::Json::GetSubKey(Processor, "RuntimeUser100ns"));
+    Result.ProcessorKernelRuntime = Mile::Json::ToUInt64(
+        Mile::Json::GetSubKey(Processor, "RuntimeKernel100ns"));
+
+    nlohmann::json Memory = Mile::Json::GetSubKey(
+        Mile::Json::GetSubKey(Properties, "Memory"),
+        "VirtualMachineMemory");
+    Result.AssignedMemory = Mile::Json::ToUInt64(
+        Mile::Json::GetSubKey(Memory, "AssignedMemory"));
+    Result.AvailableMemory = Mile::Json::ToUInt64(
+        Mile::Json::GetSubKey(Memory, "AvailableMemory"));
+
+    return Result;
+}
+
+std::uint32_t NanaBox::CalculateProcessorUsage(
+    NanaBox::VirtualMachineStatisticsSample const& Previous,
+    NanaBox::VirtualMachineStatisticsSample const& Current,
+    std::uint32_t ProcessorCount)
+{
+    if (!ProcessorCount ||
+        Current.Timestamp <= Previous.Timestamp ||
+        Current.ProcessorTotalRuntime < Previous.ProcessorTotalRuntime)
+    {
+        return 0;
+    }
+
+    std::uint64_t Elapsed =
+        (Current.Timestamp - Previous.Timestamp) * ProcessorCount;
+    std::uint64_t Consumed =
+        Current.ProcessorTotalRuntime - Previous.ProcessorTotalRuntime;
+
+    return static_cast<std::uint32_t>(std::min<std::uint64_t>(
+        Consumed * 10000 / Elapsed,
+        10000));
+}
+
+std::vector<NanaBox::VirtualMachineStatisticsSample>
+NanaBox::ReadVirtualMachineStatistics(
+    std::string const& Name,
+    std::uint32_t* ProcessorCount)
+{
+    winrt::handle SectionHandle = winrt::handle(::OpenFileMappingW(
+        FILE_MAP_READ,
+        FALSE,
+        NanaBox::GetVirtualMachineStatisticsSectionName(Name).c_str()));
+    winrt::check_bool(static_cast<bool>(SectionHandle));
+
+    NanaBox::VirtualMachineStatisticsBuffer* Buffer =
+        reinterpret_cast<NanaBox::VirtualMachineStatisticsBuffer*>(
+            ::MapViewOfFile(
+                SectionHandle.get(),
+                FILE_MAP_READ,
+                0,
+                0,
+                0));
+    winrt::check_pointer(Buffer);
+    auto UnmapHandler = Mile::ScopeExitTaskHandler([&]()
+    {
+        ::UnmapViewOfFile(Buffer);
+    });
+
+    std::uint32_t Capacity = Buffer->Capacity;
+    if (NanaBox::VirtualMachineStatisticsSignature != Buffer->Signature ||
+        NanaBox::VirtualMachineStatisticsVersion != Buffer->Version ||
+        0 == Capacity ||
+        NanaBox::VirtualMachineStatisticsCapacity < Capacity)
+    {
+        winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_INVALID_DATA));
+    }
+
+    if (ProcessorCount)
+    {
+        *ProcessorCount = Buffer->ProcessorCount;
+    }
+
+    std::vector<NanaBox::VirtualMachineStatisticsSample> Result;
+    if (!::ReadStatisticsBuffer(Buffer, Capacity, Result))
+    {
+        winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_BUSY));
+    }
+    return Result;
+}
+
+NanaBox::VirtualMachineStatisticsSampler::VirtualMachineStatisticsSampler(
+    std::string const& Name,
+    std::uint32_t ProcessorCount,
+    winrt::com_ptr<NanaBox::ComputeSystem> const& Instance) :
+    m_Instance(Instance)
+{
+    ULARGE_INTEGER SectionSize;
+    SectionSize.QuadPart = ::GetStatisticsBufferSize();
+
+    this->m_SectionHandle = winrt::handle(::CreateFileMappingW(
+        INVALID_HANDLE_VALUE,
+        nullptr,
+        PAGE_READWRITE,
+        SectionSize.HighPart,
+        SectionSize.LowPart,
+        NanaBox::GetVirtualMachineStatisticsSectionName(Name).c_str()));
+    winrt::check_bool(static_cast<bool>(this->m_SectionHandle));
+
+    this->m_Buffer =
+        reinterpret_cast<NanaBox::VirtualMachineStatisticsBuffer*>(
+            ::MapViewOfFile(
+                this->m_SectionHandle.get(),
+                FILE_MAP_ALL_ACCESS,
+                0,
+                0,
+                0));
+    winrt::check_pointer(this->m_Buffer);
+
+    // The section may outlive a previous instance of the same virtual machine
+    // when an external reader still holds it, so always start from scratch.
+    ::InterlockedIncrement64(&this->m_Buffer->Sequence);
+    this->m_Buffer->Signature = NanaBox::VirtualMachineStatisticsSignature;
+    this->m_Buffer->Version = NanaBox::VirtualMachineStatisticsVersion;
+    this->m_Buffer->Capacity = NanaBox::VirtualMachineStatisticsCapacity;
+    this->m_Buffer->ProcessorCount = ProcessorCount;
+    this->m_Buffer->Count = 0;
+    ::InterlockedIncrement64(&this->m_Buffer->Sequence);
+
+    this->m_StopEvent = winrt::handle(::CreateEventExW(
+        nullptr,
+        nullptr,
+        CREATE_EVENT_MANUAL_RESET,
+        EVENT_ALL_ACCESS));
+    winrt::check_bool(static_cast<bool>(this->m_StopEvent));
+
+    this->m_WorkerThread = winrt::handle(Mile::CreateThread([this]()
+    {
+        this->Worker();
+    }));
+    winrt::check_bool(static_cast<bool>(this->m_WorkerThread));
+}
+
+NanaBox::VirtualMachineStatisticsSampler::~VirtualMachineStatisticsSampler()
+{
+    if (this->m_StopEvent)
+    {
+        ::SetEvent(this->m_StopEvent.get());
+    }
+
+    if (this->m_WorkerThread)
+    {
+        ::WaitForSingleObject(this->m_WorkerThread.get(), INFINITE);
+    }
+
+    if (this->m_Buffer)
+    {
+        ::UnmapViewOfFile(this->m_Buffer);
+        this->m_Buffer = nullptr;
+    }
+}
+
+std::uint32_t NanaBox::VirtualMachineStatisticsSampler::ProcessorCount() const
+{
+    return this->m_Buffer->ProcessorCount;
+}
+
+std::vector<NanaBox::VirtualMachineStatisticsSample>
+NanaBox::VirtualMachineStatisticsSampler::Snapshot() const
+{
+    std::vector<NanaBox::VirtualMachineStatisticsSample> Result;
+    ::ReadStatisticsBuffer(
+        this->m_Buffer,
+        NanaBox::VirtualMachineStatisticsCapacity,
+        Result);
+    return Result;
+}
+
+bool NanaBox::VirtualMachineStatisticsSampler::Latest(
+    NanaBox::VirtualMachineStatisticsSample& Previous,
+    NanaBox::VirtualMachineStatisticsSample& Current) const
+{
+    const std::uint32_t Capacity = NanaBox::VirtualMachineStatisticsCapacity;
+
+    for (std::uint32_t i = 0; i < g_MaximumReadAttempts; ++i)
+    {
+        LONG64 Sequence = ::ReadAcquire64(&this->m_Buffer->Sequence);
+        if (Sequence & 1)
+        {
+            ::YieldProcessor();
+            continue;
+        }
+
+        std::uint64_t Count = this->m_Buffer->Count;
+        if (Count < 2)
+        {
+            return false;
+        }
+        Previous = this->m_Buffer->Samples[(Count - 2) % Capacity];
+        Current = this->m_Buffer->Samples[(Count - 1) % Capacity];
+
+        ::MemoryBarrier();
+        if (Sequence == ::ReadAcquire64(&this->m_Buffer->Sequence))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void NanaBox::VirtualMachineStatisticsSampler::Append(
+    NanaBox::VirtualMachineStatisticsSample const& Sample)
+{
+    ::InterlockedIncrement64(&this->m_Buffer->Sequence);
+    this->m_Buffer->Samples[
+        this->m_Buffer->Count % this->m_Buffer->Capacity] = Sample;
+    ++this->m_Buffer->Count;
+    ::InterlockedIncrement64(&this->m_Buffer->Sequence);
+}
+
+void NanaBox::VirtualMachineStatisticsSampler::Worker()
+{
+    bool ProcessorStatisticsSupported = true;
+    bool HasPrevious = false;
+    NanaBox::VirtualMachineStatisticsSample Previous;
+    std::uint32_t PreviousUsage = 0;
+    DWORD Interval = this->m_MinimumInterval;
+    // The first query is made immediately.
+    DWORD WaitTime = 0;
+
+    while (WAIT_TIMEOUT == ::WaitForSingleObject(
+        this->m_StopEvent.get(),
+        WaitTime))
+    {
+        ULONGLONG QueryStartTime = ::GetTickCount64();
+
+        NanaBox::VirtualMachineStatisticsSample Current;
+        try
+        {
+            Current = NanaBox::QueryVirtualMachineStatistics(
+                this->m_Instance,
+                ProcessorStatisticsSupported);
+        }
+        catch (...)
+        {
+            // The virtual machine may be transitioning, try again later. The
+            // previous sample is kept as is, so the next successful sample is
+            // only paired with a real one.
+            Interval = this->m_MaximumInterval;
+            WaitTime = Interval;
+            continue;
+        }
+
+        DWORD QueryTime = static_cast<DWORD>(
+            ::GetTickCount64() - QueryStartTime);
+
+        this->Append(Current);
+
+        // Sample faster while the guest is busy or its memory is changing,
+        // and back off while it is idle and stable.
+        bool Changing = true;
+        if (HasPrevious)
+        {
+            std::uint32_t Usage = NanaBox::CalculateProcessorUsage(
+                Previous,
+                Current,
+                this->m_Buffer->ProcessorCount);
+            std::uint32_t UsageDelta = Usage > PreviousUsage
+                ? Usage - PreviousUsage
+                : PreviousUsage - Usage;
+            std::uint64_t MemoryDelta =
+                Current.AvailableMemory > Previous.AvailableMemory
+                ? Current.AvailableMemory - Previous.AvailableMemory
+                : Previous.AvailableMemory - Current.AvailableMemory;
+            Changing =
+                UsageDelta > 500 ||
+                MemoryDelta * 20 > Current.AssignedMemory;
+            PreviousUsage = Usage;
+
+            this->SampleAdded(Previous, Current);
+        }
+
+        if (Changing)
+        {
+            Interval = std::max(this->m_MinimumInterval, Interval / 2);
+        }
+        else
+        {
+            Interval = std::min(this->m_MaximumInterval, Interval * 3 / 2);
+        }
+
+        // Keep the sampler itself below 5% of the wall clock time when the
+        // host service is slow to answer.
+        Interval = std::max(Interval, QueryTime * 20);
+
+        Previous = Current;
+        HasPrevious = true;
+        WaitTime = Interval;
+    }
+}
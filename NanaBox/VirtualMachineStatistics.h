@@ -0,0 +1,128 @@
+﻿/*
+ * PROJECT:   NanaBox
+ * FILE:      VirtualMachineStatistics.h
+ * PURPOSE:   Definition for the Virtual Machine Statistics Sampler
+ *
+ * LICENSE:   The MIT License
+ *
+ * MAINTAINER: MouriNaruto (Kenji.Mouri@outlook.com)
+ */
+
+#ifndef NANABOX_VIRTUAL_MACHINE_STATISTICS
+#define NANABOX_VIRTUAL_MACHINE_STATISTICS
+
+#include "HostCompute.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace NanaBox
+{
+    struct VirtualMachineStatisticsSample
+    {
+        // The sample time in 100ns units since 1601-01-01 (UTC).
+        std::uint64_t Timestamp = 0;
+        // The uptime of the virtual machine in 100ns units.
+        std::uint64_t Uptime = 0;
+        // The processor time consumed by all virtual processors in 100ns
+        // units.
+        std::uint64_t ProcessorTotalRuntime = 0;
+        std::uint64_t ProcessorUserRuntime = 0;
+        std::uint64_t ProcessorKernelRuntime = 0;
+        // The memory assigned to the virtual machine in MB.
+        std::uint64_t AssignedMemory = 0;
+        // The memory reported as available by the guest in MB.
+        std::uint64_t AvailableMemory = 0;
+    };
+
+    // The layout of the shared memory section named
+    // "Local\NanaBox.Statistics.<Name>", external tools can read it via
+    // ReadVirtualMachineStatistics. The Sequence member is odd while the
+    // sampler is writing.
+    struct VirtualMachineStatisticsBuffer
+    {
+        std::uint32_t Signature;
+        std::uint32_t Version;
+        std::uint32_t Capacity;
+        std::uint32_t ProcessorCount;
+        volatile LONG64 Sequence;
+        std::uint64_t Count;
+        VirtualMachineStatisticsSample Samples[1];
+    };
+
+    const std::uint32_t VirtualMachineStatisticsSignature = 0x5453424E;
+    const std::uint32_t VirtualMachineStatisticsVersion = 1;
+    const std::uint32_t VirtualMachineStatisticsCapacity = 512;
+
+    std::wstring GetVirtualMachineStatisticsSectionName(
+        std::string const& Name);
+
+    VirtualMachineStatisticsSample QueryVirtualMachineStatistics(
+        winrt::com_ptr<NanaBox::ComputeSystem> const& Instance,
+        bool& ProcessorStatisticsSupported);
+
+    // Returns the processor usage between two samples in 0.01% units.
+    std::uint32_t CalculateProcessorUsage(
+        VirtualMachineStatisticsSample const& Previous,
+        VirtualMachineStatisticsSample const& Current,
+        std::uint32_t ProcessorCount);
+
+    // Returns the samples ordered from the oldest to the newest. Throws
+    // ERROR_BUSY if the sampler stops in the middle of an update.
+    std::vector<VirtualMachineStatisticsSample> ReadVirtualMachineStatistics(
+        std::string const& Name,
+        std::uint32_t* ProcessorCount = nullptr);
+
+    class VirtualMachineStatisticsSampler
+    {
+    public:
+
+        VirtualMachineStatisticsSampler(
+            std::string const& Name,
+            std::uint32_t ProcessorCount,
+            winrt::com_ptr<NanaBox::ComputeSystem> const& Instance);
+
+        ~VirtualMachineStatisticsSampler();
+
+        VirtualMachineStatisticsSampler(
+            VirtualMachineStatisticsSampler const&) = delete;
+
+        VirtualMachineStatisticsSampler& operator=(
+            VirtualMachineStatisticsSampler const&) = delete;
+
+        std::uint32_t ProcessorCount() const;
+
+        // The snapshot is empty and Latest returns false if the buffer stays
+        // inconsistent for a bounded number of attempts.
+        std::vector<VirtualMachineStatisticsSample> Snapshot() const;
+
+        bool Latest(
+            VirtualMachineStatisticsSample& Previous,
+            VirtualMachineStatisticsSample& Current) const;
+
+        // Raised from the sampler thread with the previous and the newly
+        // appended sample, handlers must not block.
+        Mile::WinRT::Event<winrt::delegate<
+            VirtualMachineStatisticsSample,
+            VirtualMachineStatisticsSample>> SampleAdded;
+
+    private:
+
+        const DWORD m_MinimumInterval = 500;
+        const DWORD m_MaximumInterval = 5000;
+
+        winrt::com_ptr<NanaBox::ComputeSystem> m_Instance;
+        winrt::handle m_SectionHandle;
+        VirtualMachineStatisticsBuffer* m_Buffer = nullptr;
+        winrt::handle m_StopEvent;
+        winrt::handle m_WorkerThread;
+
+        void Append(
+            VirtualMachineStatisticsSample const& Sample);
+
+        void Worker();
+    };
+}
+
+#endif // !NANABOX_VIRTUAL_MACHINE_STATISTICS